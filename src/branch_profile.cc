@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/branch_profile.h"
+
+#include <algorithm>
+#include <functional>
+#include <ios>
+#include <map>
+#include <tuple>
+#include <utility>
+
+namespace perftools {
+
+namespace {
+
+// Returns the offset of |location| in the file of its mapping.
+uint64_t FileOffset(const PerfDataHandler::Location& location) {
+  return location.ip - location.mapping->start + location.mapping->file_offset;
+}
+
+bool IsMapped(const PerfDataHandler::Location& location) {
+  return location.mapping != nullptr && location.ip >= location.mapping->start;
+}
+
+}  // namespace
+
+size_t BranchProfileAggregator::EdgeKey::Hasher::operator()(
+    const EdgeKey& key) const noexcept {
+  size_t h = std::hash<const Dso*>{}(key.dso);
+  h = h * 31 + std::hash<uint64_t>{}(key.from);
+  h = h * 31 + std::hash<uint64_t>{}(key.to);
+  return h;
+}
+
+bool BranchProfileAggregator::KeepSample(const SampleContext& sample) {
+  return sample.sample.branch_stack_size() > 0;
+}
+
+bool BranchProfileAggregator::Sample(const SampleContext& sample) {
+  if (sample.branch_stack.empty() || sample.spe.is_spe) return false;
+  profile_.samples += sample.count;
+  // The most recent branch comes first, so the code from the target of each
+  // branch to the source of the one before it in the stack ran in between.
+  for (size_t i = 0; i < sample.branch_stack.size(); ++i) {
+    const BranchStackPair& branch = sample.branch_stack[i];
+    if (!IsMapped(branch.from) || !IsMapped(branch.to) ||
+        branch.from.mapping->dso != branch.to.mapping->dso) {
+      profile_.unmapped_branches += sample.count;
+    } else {
+      BranchCounts& counts =
+          branches_[EdgeKey{branch.from.mapping->dso, FileOffset(branch.from),
+                            FileOffset(branch.to)}];
+      counts.count += sample.count;
+      if (branch.mispredicted) counts.mispredicted += sample.count;
+    }
+
+    if (i + 1 == sample.branch_stack.size()) break;
+    const Location& begin = sample.branch_stack[i + 1].to;
+    const Location& end = branch.from;
+    if (!IsMapped(begin) || !IsMapped(end) ||
+        begin.mapping->dso != end.mapping->dso || begin.ip > end.ip) {
+      profile_.unmapped_ranges += sample.count;
+      continue;
+    }
+    ranges_[EdgeKey{begin.mapping->dso, FileOffset(begin), FileOffset(end)}] +=
+        sample.count;
+  }
+  return true;
+}
+
+void BranchProfileAggregator::Finish() {
+  // The binaries are ordered by name rather than by the addresses of their
+  // DSOs, so that the profile is the same on every run.
+  std::map<std::pair<std::string, std::string>, BranchProfile::Binary>
+      binaries;
+  auto binary = [&binaries](const Dso* dso) -> BranchProfile::Binary& {
+    BranchProfile::Binary& b =
+        binaries[std::make_pair(dso->filename, dso->build_id.value)];
+    b.filename = dso->filename;
+    b.build_id = dso->build_id.value;
+    return b;
+  };
+  for (const auto& it : branches_) {
+    BranchProfile::Branch branch;
+    branch.from_offset = it.first.from;
+    branch.to_offset = it.first.to;
+    branch.count = it.second.count;
+    branch.mispredicted = it.second.mispredicted;
+    binary(it.first.dso).branches.push_back(branch);
+  }
+  branches_.clear();
+  for (const auto& it : ranges_) {
+    BranchProfile::Range range;
+    range.begin_offset = it.first.from;
+    range.end_offset = it.first.to;
+    range.count = it.second;
+    binary(it.first.dso).ranges.push_back(range);
+  }
+  ranges_.clear();
+
+  profile_.binaries.clear();
+  for (auto& it : binaries) {
+    BranchProfile::Binary& b = it.second;
+    std::sort(b.branches.begin(), b.branches.end(),
+              [](const BranchProfile::Branch& a,
+                 const BranchProfile::Branch& b) {
+                return std::tie(a.from_offset, a.to_offset) <
+                       std::tie(b.from_offset, b.to_offset);
+              });
+    std::sort(b.ranges.begin(), b.ranges.end(),
+              [](const BranchProfile::Range& a, const BranchProfile::Range& b) {
+                return std::tie(a.begin_offset, a.end_offset) <
+                       std::tie(b.begin_offset, b.end_offset);
+              });
+    profile_.binaries.push_back(std::move(b));
+  }
+}
+
+BranchProfile PerfDataProtoToBranchProfile(
+    const quipper::PerfDataProto& perf_data) {
+  BranchProfileAggregator aggregator;
+  PerfDataHandler::Process(perf_data, &aggregator);
+  return aggregator.profile();
+}
+
+void WriteBranchProfile(const BranchProfile& profile, std::ostream* out) {
+  const std::ios::fmtflags flags = out->flags();
+  for (const auto& binary : profile.binaries) {
+    *out << std::dec << "binary "
+         << (binary.filename.empty() ? "-" : binary.filename) << " "
+         << (binary.build_id.empty() ? "-" : binary.build_id) << "\n";
+    *out << binary.ranges.size() << "\n";
+    for (const auto& range : binary.ranges) {
+      *out << std::hex << range.begin_offset << "-" << range.end_offset << ":"
+           << std::dec << range.count << "\n";
+    }
+    *out << binary.branches.size() << "\n";
+    for (const auto& branch : binary.branches) {
+      *out << std::hex << branch.from_offset << "->" << branch.to_offset << ":"
+           << std::dec << branch.count << ":" << branch.mispredicted << "\n";
+    }
+  }
+  out->flags(flags);
+}
+
+}  // namespace perftools
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_BRANCH_PROFILE_H_
+#define PERFTOOLS_BRANCH_PROFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "src/perf_data_handler.h"
+#include "src/quipper/perf_data.pb.h"
+
+namespace perftools {
+
+// The taken branches and the fall-through ranges between them found in the
+// LBR stacks of a profile, counted per binary, as AutoFDO- and BOLT-style
+// optimizers consume them. The addresses are offsets in the files of the
+// binaries. The entries are sorted by offsets, and the binaries by filename
+// and build ID.
+struct BranchProfile {
+  struct Branch {
+    uint64_t from_offset = 0;
+    uint64_t to_offset = 0;
+    uint64_t count = 0;
+    // The number of times the target was mispredicted.
+    uint64_t mispredicted = 0;
+  };
+
+  // The code executed without a taken branch from the target of a branch to
+  // the source of the next one, inclusive.
+  struct Range {
+    uint64_t begin_offset = 0;
+    uint64_t end_offset = 0;
+    uint64_t count = 0;
+  };
+
+  struct Binary {
+    std::string filename;
+    std::string build_id;
+    std::vector<Branch> branches;
+    std::vector<Range> ranges;
+  };
+
+  std::vector<Binary> binaries;
+  // The samples with an LBR stack.
+  uint64_t samples = 0;
+  // The branches and ranges dropped because their ends weren't in the same
+  // mapped binary.
+  uint64_t unmapped_branches = 0;
+  uint64_t unmapped_ranges = 0;
+};
+
+// Aggregates the LBR stacks of the samples into a BranchProfile, keyed by
+// binary and offsets, instead of building a profile sample per distinct
+// stack. Memory use is then proportional to the number of distinct branches
+// rather than of distinct stacks.
+class BranchProfileAggregator : public PerfDataHandler {
+ public:
+  BranchProfileAggregator() {}
+  BranchProfileAggregator(const BranchProfileAggregator&) = delete;
+  BranchProfileAggregator& operator=(const BranchProfileAggregator&) = delete;
+
+  // Skips the samples without a branch stack before they are normalized.
+  bool KeepSample(const SampleContext& sample) override;
+  bool Sample(const SampleContext& sample) override;
+  void Comm(const CommContext& comm) override {}
+  void MMap(const MMapContext& mmap) override {}
+  // Builds the profile, while the DSOs are still alive.
+  void Finish() override;
+
+  // Returns the profile, once the events have been processed.
+  const BranchProfile& profile() const { return profile_; }
+
+ private:
+  // A branch or a range of a binary.
+  struct EdgeKey {
+    const Dso* dso;
+    uint64_t from;
+    uint64_t to;
+
+    bool operator==(const EdgeKey& other) const {
+      return dso == other.dso && from == other.from && to == other.to;
+    }
+
+    struct Hasher {
+      size_t operator()(const EdgeKey& key) const noexcept;
+    };
+  };
+
+  struct BranchCounts {
+    uint64_t count = 0;
+    uint64_t mispredicted = 0;
+  };
+
+  std::unordered_map<EdgeKey, BranchCounts, EdgeKey::Hasher> branches_;
+  std::unordered_map<EdgeKey, uint64_t, EdgeKey::Hasher> ranges_;
+  BranchProfile profile_;
+};
+
+// Aggregates the LBR stacks of the samples of |perf_data|. The Arm SPE
+// samples, whose branch stacks are the single branch of a record, are
+// skipped.
+BranchProfile PerfDataProtoToBranchProfile(
+    const quipper::PerfDataProto& perf_data);
+
+// Writes |profile| as text: for each binary, a "binary <filename>
+// <build ID>" line, then the number of ranges and a "<begin>-<end>:<count>"
+// line for each, then the number of branches and a
+// "<from>-><to>:<count>:<mispredicted>" line for each, with the offsets in
+// hex. Missing filenames and build IDs are written as "-".
+void WriteBranchProfile(const BranchProfile& profile, std::ostream* out);
+
+}  // namespace perftools
+
+#endif  // PERFTOOLS_BRANCH_PROFILE_H_
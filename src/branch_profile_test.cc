@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/branch_profile.h"
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "src/quipper/perf_data.pb.h"
+
+namespace perftools {
+namespace {
+
+void AddMmap(uint32_t pid, const std::string& filename, uint64_t start,
+             uint64_t len, uint64_t pgoff, quipper::PerfDataProto* proto) {
+  auto* mmap = proto->add_events()->mutable_mmap_event();
+  mmap->set_filename(filename);
+  mmap->set_pid(pid);
+  mmap->set_tid(pid);
+  mmap->set_start(start);
+  mmap->set_len(len);
+  mmap->set_pgoff(pgoff);
+}
+
+// Adds a sample of |pid| with the |branches|, most recent first.
+void AddSample(uint32_t pid,
+               const std::vector<std::pair<uint64_t, uint64_t>>& branches,
+               bool mispredicted, quipper::PerfDataProto* proto) {
+  auto* sample = proto->add_events()->mutable_sample_event();
+  sample->set_pid(pid);
+  sample->set_tid(pid);
+  sample->set_ip(branches.empty() ? 0x1000 : branches[0].second);
+  sample->set_period(1);
+  for (const auto& branch : branches) {
+    auto* entry = sample->add_branch_stack();
+    entry->set_from_ip(branch.first);
+    entry->set_to_ip(branch.second);
+    entry->set_mispredicted(mispredicted);
+  }
+}
+
+quipper::PerfDataProto ExampleProfile() {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  AddMmap(10, "/bin/app", 0x1000, 0x1000, 0, &proto);
+  AddMmap(10, "/lib/libc.so", 0x10000, 0x1000, 0x2000, &proto);
+  AddMmap(20, "/bin/app", 0x5000, 0x1000, 0, &proto);
+  AddSample(10, {{0x1100, 0x1200}, {0x1050, 0x1080}}, true, &proto);
+  AddSample(20, {{0x5100, 0x5200}, {0x5050, 0x5080}}, false, &proto);
+  // A call into libc and a return from it, which aren't within one binary,
+  // and a stack that doesn't run forward from the oldest branch.
+  AddSample(10, {{0x10040, 0x1300}, {0x1210, 0x10010}, {0x1250, 0x1220}},
+            false, &proto);
+  // A sample without LBR stack.
+  AddSample(10, {}, false, &proto);
+  return proto;
+}
+
+TEST(BranchProfileTest, AggregatesBranchesAndRangesPerBinary) {
+  const BranchProfile profile = PerfDataProtoToBranchProfile(ExampleProfile());
+  EXPECT_EQ(3, profile.samples);
+  EXPECT_EQ(2, profile.unmapped_branches);
+  EXPECT_EQ(1, profile.unmapped_ranges);
+
+  ASSERT_EQ(2, profile.binaries.size());
+  const BranchProfile::Binary& app = profile.binaries[0];
+  EXPECT_EQ("/bin/app", app.filename);
+  ASSERT_EQ(3, app.branches.size());
+  EXPECT_EQ(0x50, app.branches[0].from_offset);
+  EXPECT_EQ(0x80, app.branches[0].to_offset);
+  EXPECT_EQ(2, app.branches[0].count);
+  EXPECT_EQ(1, app.branches[0].mispredicted);
+  EXPECT_EQ(0x100, app.branches[1].from_offset);
+  EXPECT_EQ(0x200, app.branches[1].to_offset);
+  EXPECT_EQ(2, app.branches[1].count);
+  EXPECT_EQ(1, app.branches[1].mispredicted);
+  EXPECT_EQ(0x250, app.branches[2].from_offset);
+  EXPECT_EQ(0x220, app.branches[2].to_offset);
+  EXPECT_EQ(1, app.branches[2].count);
+  ASSERT_EQ(1, app.ranges.size());
+  EXPECT_EQ(0x80, app.ranges[0].begin_offset);
+  EXPECT_EQ(0x100, app.ranges[0].end_offset);
+  EXPECT_EQ(2, app.ranges[0].count);
+
+  // The range from the return from libc to the call into it.
+  const BranchProfile::Binary& libc = profile.binaries[1];
+  EXPECT_EQ("/lib/libc.so", libc.filename);
+  EXPECT_TRUE(libc.branches.empty());
+  ASSERT_EQ(1, libc.ranges.size());
+  EXPECT_EQ(0x2010, libc.ranges[0].begin_offset);
+  EXPECT_EQ(0x2040, libc.ranges[0].end_offset);
+}
+
+TEST(BranchProfileTest, WritesText) {
+  std::stringstream out;
+  WriteBranchProfile(PerfDataProtoToBranchProfile(ExampleProfile()), &out);
+  EXPECT_EQ(
+      "binary /bin/app -\n"
+      "1\n"
+      "80-100:2\n"
+      "3\n"
+      "50->80:2:1\n"
+      "100->200:2:1\n"
+      "250->220:1:0\n"
+      "binary /lib/libc.so -\n"
+      "1\n"
+      "2010-2040:1\n"
+      "0\n",
+      out.str());
+}
+
+}  // namespace
+}  // namespace perftools
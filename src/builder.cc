@@ -8,10 +8,16 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
-#include <map>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_set>
 #include <utility>
@@ -21,18 +27,153 @@
 #include <unordered_set>
 
 #include "src/quipper/base/logging.h"
+#include "src/quipper/compat/thread_pool.h"
+#include "src/quipper/trace.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/wire_format_lite.h"
 
+using google::protobuf::io::CodedOutputStream;
 using google::protobuf::io::StringOutputStream;
 using google::protobuf::io::GzipOutputStream;
 using google::protobuf::io::FileOutputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
+using google::protobuf::internal::WireFormatLite;
 using google::protobuf::RepeatedField;
 
 namespace perftools {
 namespace profiles {
 typedef std::unordered_map<uint64, uint64> IndexMap;
 typedef std::unordered_set<uint64> IndexSet;
+
+namespace {
+
+// The header of the gzip streams written by CompressGzipBlocks(): deflate,
+// no flags, no time, Unix.
+const char kGzipHeader[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+
+// Compresses |profile| to |output| as a gzip stream at |level|.
+bool GzipProfile(const Profile &profile, int level,
+                 ZeroCopyOutputStream *output) {
+  GzipOutputStream::Options gzip_options;
+  if (level >= 0) gzip_options.compression_level = level;
+  GzipOutputStream gzip_stream(output, gzip_options);
+  if (!profile.SerializeToZeroCopyStream(&gzip_stream)) {
+    LOG(ERROR) << "Failed to serialize to gzip stream";
+    return false;
+  }
+  return gzip_stream.Close();
+}
+
+// Returns the blocks of |data| to be compressed as set in |options|.
+std::vector<std::string_view> SplitBlocks(std::string_view data,
+                                          const MarshalOptions &options) {
+  std::vector<std::string_view> blocks;
+  const size_t block_size =
+      options.pool != nullptr ? std::max<size_t>(options.block_size, 1)
+                              : data.size();
+  do {
+    blocks.push_back(data.substr(0, block_size));
+    data.remove_prefix(blocks.back().size());
+  } while (!data.empty());
+  return blocks;
+}
+
+// Calls |compress| for each index of |blocks|, concurrently on the pool of
+// |options|, if any. Returns whether all the calls succeeded.
+bool CompressBlocks(const std::vector<std::string_view> &blocks,
+                    const MarshalOptions &options,
+                    const std::function<bool(size_t)> &compress) {
+  std::atomic<bool> ok(true);
+  quipper::ParallelFor(
+      options.pool, blocks.size(),
+      options.pool != nullptr ? options.pool->num_threads() : 1,
+      [&compress, &ok](size_t i) {
+        if (!compress(i)) ok = false;
+      });
+  return ok;
+}
+
+// Compresses |data| to |output| as a gzip stream whose blocks are deflated
+// independently.
+bool CompressGzipBlocks(std::string_view data, const MarshalOptions &options,
+                        std::string *output) {
+  const std::vector<std::string_view> blocks = SplitBlocks(data, options);
+  std::vector<std::string> compressed(blocks.size());
+  std::vector<uLong> crcs(blocks.size());
+  const int level = options.level >= 0 ? options.level : Z_DEFAULT_COMPRESSION;
+  auto compress = [&](size_t i) {
+    const bool last = i + 1 == blocks.size();
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      return false;
+    }
+    // A sync flush adds an empty stored block to the bound of a finished
+    // stream.
+    compressed[i].resize(deflateBound(&stream, blocks[i].size()) + 16);
+    stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(blocks[i].data()));
+    stream.avail_in = blocks[i].size();
+    stream.next_out = reinterpret_cast<Bytef *>(&compressed[i][0]);
+    stream.avail_out = compressed[i].size();
+    const int ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    compressed[i].resize(stream.total_out);
+    deflateEnd(&stream);
+    crcs[i] = crc32(0, reinterpret_cast<const Bytef *>(blocks[i].data()),
+                    blocks[i].size());
+    return ret == (last ? Z_STREAM_END : Z_OK) && stream.avail_in == 0;
+  };
+  if (!CompressBlocks(blocks, options, compress)) {
+    LOG(ERROR) << "Failed to deflate the profile";
+    return false;
+  }
+
+  uLong crc = crcs[0];
+  size_t size = sizeof(kGzipHeader) + 8;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    if (i > 0) crc = crc32_combine(crc, crcs[i], blocks[i].size());
+    size += compressed[i].size();
+  }
+  output->reserve(size);
+  output->assign(kGzipHeader, sizeof(kGzipHeader));
+  for (const std::string &block : compressed) output->append(block);
+  // The trailer holds the CRC and the size of the data, little-endian.
+  for (uint64_t value : {static_cast<uint64_t>(crc),
+                         static_cast<uint64_t>(data.size())}) {
+    for (int i = 0; i < 4; ++i) output->push_back((value >> (8 * i)) & 0xff);
+  }
+  return true;
+}
+
+// Compresses |data| to |output| as a zstd frame for each block.
+bool CompressZstdBlocks(std::string_view data, const MarshalOptions &options,
+                        std::string *output) {
+  const std::vector<std::string_view> blocks = SplitBlocks(data, options);
+  std::vector<std::string> compressed(blocks.size());
+  // zstd takes level 0 for its default.
+  const int level = std::max(options.level, 0);
+  auto compress = [&](size_t i) {
+    compressed[i].resize(ZSTD_compressBound(blocks[i].size()));
+    const size_t size =
+        ZSTD_compress(&compressed[i][0], compressed[i].size(),
+                      blocks[i].data(), blocks[i].size(), level);
+    if (ZSTD_isError(size)) return false;
+    compressed[i].resize(size);
+    return true;
+  };
+  if (!CompressBlocks(blocks, options, compress)) {
+    LOG(ERROR) << "Failed to compress the profile with zstd";
+    return false;
+  }
+  output->clear();
+  for (const std::string &block : compressed) output->append(block);
+  return true;
+}
+
+}  // namespace
+
 }  // namespace profiles
 }  // namespace perftools
 
@@ -66,14 +207,24 @@ int64_t Builder::StringId(const char *str) {
   return InternalStringId(str);
 }
 
-int64_t Builder::InternalStringId(const std::string &str) {
-  const int64_t index = profile_->string_table_size();
-  const auto inserted = strings_.emplace(str, index);
-  if (!inserted.second) {
-    // Failed to insert -- use existing id.
-    return inserted.first->second;
+int64_t Builder::StringId(std::string_view str) {
+  if (str.empty()) {
+    return 0;
   }
-  profile_->add_string_table(inserted.first->first);
+  return InternalStringId(str);
+}
+
+int64_t Builder::InternalStringId(std::string_view str) {
+  const auto existing = strings_.find(str);
+  if (existing != strings_.end()) {
+    return existing->second;
+  }
+  const int64_t index = profile_->string_table_size();
+  // The elements of the repeated field are never moved, so the view stays
+  // valid as the table grows.
+  std::string *stored = profile_->add_string_table();
+  stored->assign(str.data(), str.size());
+  strings_.emplace(*stored, index);
   return index;
 }
 
@@ -128,24 +279,52 @@ bool Builder::Emit(std::string *output) {
 }
 
 bool Builder::Marshal(const Profile &profile, std::string *output) {
+  return Marshal(profile, MarshalOptions(), output);
+}
+
+bool Builder::Marshal(const Profile &profile, const MarshalOptions &options,
+                      std::string *output) {
+  QUIPPER_TRACE_SPAN("Builder::Marshal");
   *output = "";
-  StringOutputStream stream(output);
-  GzipOutputStream gzip_stream(&stream);
-  if (!profile.SerializeToZeroCopyStream(&gzip_stream)) {
-    LOG(ERROR) << "Failed to serialize to gzip stream";
+  if (options.format == MarshalOptions::kGzip && options.pool == nullptr) {
+    StringOutputStream stream(output);
+    return GzipProfile(profile, options.level, &stream);
+  }
+  // The blocks are compressed out of the whole serialized profile.
+  std::string serialized;
+  if (!profile.SerializeToString(&serialized)) {
+    LOG(ERROR) << "Failed to serialize the profile";
     return false;
   }
-  return gzip_stream.Close();
+  if (options.format == MarshalOptions::kZstd) {
+    return CompressZstdBlocks(serialized, options, output);
+  }
+  return CompressGzipBlocks(serialized, options, output);
 }
 
 bool Builder::MarshalToFile(const Profile &profile, int fd) {
-  FileOutputStream stream(fd);
-  GzipOutputStream gzip_stream(&stream);
-  if (!profile.SerializeToZeroCopyStream(&gzip_stream)) {
-    LOG(ERROR) << "Failed to serialize to gzip stream";
-    return false;
+  return MarshalToFile(profile, MarshalOptions(), fd);
+}
+
+bool Builder::MarshalToFile(const Profile &profile,
+                            const MarshalOptions &options, int fd) {
+  if (options.format == MarshalOptions::kGzip && options.pool == nullptr) {
+    FileOutputStream stream(fd);
+    return GzipProfile(profile, options.level, &stream);
   }
-  return gzip_stream.Close();
+  std::string output;
+  if (!Marshal(profile, options, &output)) return false;
+  for (size_t written = 0; written < output.size();) {
+    const ssize_t ret =
+        write(fd, output.data() + written, output.size() - written);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      PLOG(ERROR) << "Failed to write the profile";
+      return false;
+    }
+    written += ret;
+  }
+  return true;
 }
 
 bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
@@ -162,6 +341,46 @@ bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
   return ret;
 }
 
+ProfileEncoder::ProfileEncoder(ZeroCopyOutputStream *output)
+    : gzip_stream_(new GzipOutputStream(output)),
+      coded_stream_(new CodedOutputStream(gzip_stream_.get())) {
+  StringId("");
+}
+
+ProfileEncoder::~ProfileEncoder() {}
+
+int64_t ProfileEncoder::StringId(const char *str) {
+  if (str == nullptr) {
+    str = "";
+  }
+  const auto inserted = strings_.emplace(str, strings_.size());
+  if (inserted.second) {
+    WireFormatLite::WriteString(Profile::kStringTableFieldNumber,
+                                inserted.first->first, coded_stream_.get());
+  }
+  return inserted.first->second;
+}
+
+bool ProfileEncoder::Write(const Profile &profile) {
+  if (profile.string_table_size() != 0) {
+    LOG(ERROR) << "Profile fields to encode must not have a string table";
+    return false;
+  }
+  if (!profile.SerializeToCodedStream(coded_stream_.get())) {
+    LOG(ERROR) << "Failed to serialize to gzip stream";
+    return false;
+  }
+  return true;
+}
+
+bool ProfileEncoder::Close() {
+  bool ok = !coded_stream_->HadError();
+  // The coded stream hands its unused buffer back to the gzip stream when
+  // destroyed, so it must go first.
+  coded_stream_.reset();
+  return gzip_stream_->Close() && ok;
+}
+
 // Returns a bool indicating if the profile is valid. It logs any
 // errors it encounters.
 bool Builder::CheckValid(const Profile &profile) {
@@ -302,32 +521,59 @@ bool Builder::Finalize() {
     }
   }
 
-  // Look up location address on mapping ranges.
-  if (profile_->mapping_size() > 0) {
-    std::map<uint64_t, std::pair<uint64_t, uint64_t> > mapping_map;
+  // Look up location address on mapping ranges. Producers that set the
+  // mappings of the locations themselves don't need the ranges at all.
+  const auto &locations = profile_->location();
+  if (profile_->mapping_size() > 0 &&
+      std::any_of(locations.begin(), locations.end(), [](const Location &loc) {
+        return loc.address() != 0 && loc.mapping_id() == 0;
+      })) {
+    // The ranges sorted by start. Of the mappings that start at the same
+    // address, the last one is used.
+    struct MappingRange {
+      uint64_t start;
+      uint64_t limit;
+      uint64_t id;
+    };
+    std::vector<MappingRange> ranges;
+    ranges.reserve(profile_->mapping_size());
     for (const auto &mapping : profile_->mapping()) {
-      mapping_map[mapping.memory_start()] =
-          std::make_pair(mapping.memory_limit(), mapping.id());
+      ranges.push_back(
+          {mapping.memory_start(), mapping.memory_limit(), mapping.id()});
+    }
+    std::stable_sort(ranges.begin(), ranges.end(),
+                     [](const MappingRange &a, const MappingRange &b) {
+                       return a.start < b.start;
+                     });
+    size_t num_ranges = 0;
+    for (const MappingRange &range : ranges) {
+      if (num_ranges > 0 && ranges[num_ranges - 1].start == range.start) {
+        ranges[num_ranges - 1] = range;
+      } else {
+        ranges[num_ranges++] = range;
+      }
     }
+    ranges.resize(num_ranges);
 
     for (auto &loc : *profile_->mutable_location()) {
       if (loc.address() != 0 && loc.mapping_id() == 0) {
-        auto mapping = mapping_map.upper_bound(loc.address());
-        if (mapping == mapping_map.begin()) {
+        auto range = std::upper_bound(
+            ranges.begin(), ranges.end(), loc.address(),
+            [](uint64_t address, const MappingRange &range) {
+              return address < range.start;
+            });
+        if (range == ranges.begin()) {
           // Address landed before the first mapping
           continue;
         }
-        mapping--;
-        uint64_t limit = mapping->second.first;
-        uint64_t id = mapping->second.second;
-
-        if (loc.address() <= limit) {
-          loc.set_mapping_id(id);
+        --range;
+        if (loc.address() <= range->limit) {
+          loc.set_mapping_id(range->id);
         }
       }
     }
   }
-  return CheckValid(*profile_);
+  return !check_valid_ || CheckValid(*profile_);
 }
 
 }  // namespace profiles
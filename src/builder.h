@@ -13,6 +13,7 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
 
@@ -26,6 +27,8 @@ typedef uint64_t uint64;
 typedef std::string string;
 
 typedef std::unordered_map<string, int64> StringIndexMap;
+// Keyed by views of strings that are stored elsewhere.
+typedef std::unordered_map<std::string_view, int64> StringViewIndexMap;
 
 class FunctionHasher {
  public:
@@ -47,6 +50,20 @@ typedef std::unordered_map<std::tuple<int64, int64, int64, int64>, int64,
 
 #include "src/profile.pb.h"
 
+namespace google {
+namespace protobuf {
+namespace io {
+class CodedOutputStream;
+class GzipOutputStream;
+class ZeroCopyOutputStream;
+}  // namespace io
+}  // namespace protobuf
+}  // namespace google
+
+namespace quipper {
+class ThreadPool;
+}  // namespace quipper
+
 namespace perftools {
 namespace profiles {
 
@@ -55,6 +72,26 @@ enum CallstackType { kRegular = 0, kInterrupt = 1 };
 void AddCallstackToSample(Sample *sample, const void *const *stack, int depth,
                           CallstackType type);
 
+// How Builder::Marshal() compresses a profile.
+struct MarshalOptions {
+  enum Format {
+    kGzip,
+    // zstd, for the consumers that can read it, which compresses faster
+    // than gzip for the same ratio.
+    kZstd,
+  };
+  Format format = kGzip;
+  // The compression level, or -1 for the default level of the format.
+  int level = -1;
+  // If not null, the serialized profile is split into blocks of |block_size|
+  // bytes, which are compressed concurrently on |pool|. The gzip blocks are
+  // deflated independently and end on byte boundaries, so that they join into
+  // a single gzip stream, as pigz writes them. The zstd blocks are frames of
+  // their own, which decoders read one after another.
+  quipper::ThreadPool *pool = nullptr;
+  size_t block_size = 1 << 20;
+};
+
 // Provides mechanisms to facilitate the generation of profiles
 // on a compressed protobuf:
 // - Manages the creation of the string table.
@@ -69,6 +106,7 @@ class Builder {
   // Adds a string to the profile string table if not already present.
   // Returns a unique integer id for this string.
   int64_t StringId(const char *str);
+  int64_t StringId(std::string_view str);
 
   // Adds a function with these attributes to the profile function
   // table, if not already present. Returns a unique integer id for
@@ -89,6 +127,11 @@ class Builder {
   // address into the mapping address range.
   bool Finalize();
 
+  // Sets whether Finalize() checks that the profile is valid, which it does
+  // by default. The check walks the whole profile, so producers that only
+  // build valid profiles may skip it.
+  void set_check_valid(bool check_valid) { check_valid_ = check_valid; }
+
   // Serializes and compresses the profile into a string, replacing
   // its contents. It calls Finalize() and returns whether the
   // encoding was successful.
@@ -98,11 +141,16 @@ class Builder {
   // contents. Returns false if there were errors on the serialization
   // or compression, and the output string will not contain valid data.
   static bool Marshal(const Profile &profile, std::string *output);
+  // Same as above, but compresses the profile as set in |options|.
+  static bool Marshal(const Profile &profile, const MarshalOptions &options,
+                      std::string *output);
 
   // Serializes and compresses a profile into a file represented by a
   // file descriptor. Returns false if there were errors on the
   // serialization or compression.
   static bool MarshalToFile(const Profile &profile, int fd);
+  static bool MarshalToFile(const Profile &profile,
+                            const MarshalOptions &options, int fd);
 
   // Serializes and compresses a profile into a file, creating a new
   // file or replacing its contents if it already exists.
@@ -123,10 +171,12 @@ class Builder {
   Profile *mutable_profile() { return profile_.get(); }
 
  private:
-  int64_t InternalStringId(const std::string &str);
+  int64_t InternalStringId(std::string_view str);
 
-  // Maps to deduplicate strings and functions.
-  StringIndexMap strings_;
+  // Maps to deduplicate strings and functions. The keys of strings_ are views
+  // of the strings in the profile's string table, so that each string is only
+  // stored once.
+  StringViewIndexMap strings_;
   FunctionIndexMap functions_;
 
   // Actual profile being updated.
@@ -134,6 +184,45 @@ class Builder {
 
   // Any error that may have been encountered while building the profile.
   std::string error_;
+
+  // Whether Finalize() checks the profile.
+  bool check_valid_ = true;
+};
+
+// Writes a compressed profile incrementally, so that the whole profile never
+// has to be held in memory, as it does with Builder::Marshal(). The encoded
+// Profile message is the concatenation of the fields written, in the order
+// they were written: repeated fields such as samples and locations may be
+// written a few at a time, and interleaved with each other. Strings are
+// interned by the encoder and written to the string table as they are first
+// seen. The output decodes to the same profile as Builder::Marshal() would
+// produce for the union of the fields written.
+class ProfileEncoder {
+ public:
+  // Writes the gzipped profile to |output|, which must outlive the encoder.
+  explicit ProfileEncoder(google::protobuf::io::ZeroCopyOutputStream *output);
+  ~ProfileEncoder();
+
+  ProfileEncoder(const ProfileEncoder &) = delete;
+  ProfileEncoder &operator=(const ProfileEncoder &) = delete;
+
+  // Returns the index of |str| in the string table of the profile, writing
+  // it to the table first if it isn't there yet. Index 0 is the empty string.
+  int64_t StringId(const char *str);
+
+  // Writes the fields set in |profile|, which must refer to strings by the
+  // indices returned by StringId() and have an empty string table. Returns
+  // false if |profile| has a string table or on errors.
+  bool Write(const Profile &profile);
+
+  // Finishes the compressed stream. Returns whether everything was written
+  // successfully. No further calls should be made to the encoder after this.
+  bool Close();
+
+ private:
+  StringIndexMap strings_;
+  std::unique_ptr<google::protobuf::io::GzipOutputStream> gzip_stream_;
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> coded_stream_;
 };
 
 }  // namespace profiles
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/builder.h"
+
+#include <string>
+#include <string_view>
+
+#include <zstd.h>
+
+#include <gtest/gtest.h>
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "src/quipper/compat/thread_pool.h"
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::GzipInputStream;
+using google::protobuf::io::StringOutputStream;
+
+// Strings are interned once, whichever overload they are passed to, and
+// stay interned as the string table grows.
+TEST(BuilderTest, InternsStrings) {
+  Builder builder;
+  EXPECT_EQ(0, builder.StringId(""));
+  EXPECT_EQ(0, builder.StringId(std::string_view()));
+  EXPECT_EQ(0, builder.StringId(static_cast<const char*>(nullptr)));
+  for (int i = 0; i < 1000; ++i) {
+    const std::string str = "string" + std::to_string(i);
+    EXPECT_EQ(i + 1, builder.StringId(str.c_str()));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    const std::string str = "string" + std::to_string(i);
+    EXPECT_EQ(i + 1, builder.StringId(std::string_view(str)));
+  }
+  const Profile& profile = *builder.mutable_profile();
+  ASSERT_EQ(1001, profile.string_table_size());
+  EXPECT_EQ("", profile.string_table(0));
+  EXPECT_EQ("string999", profile.string_table(1000));
+}
+
+// Finalize() assigns the locations without a mapping to the one containing
+// their address, the last one added if several start at the same address.
+TEST(BuilderTest, FinalizeAssignsMappingsToLocations) {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  profile->add_sample_type()->set_type(builder.StringId("samples"));
+  profile->set_default_sample_type(profile->sample_type(0).type());
+  const struct {
+    uint64_t start;
+    uint64_t limit;
+  } mappings[] = {{0x3000, 0x4000}, {0x1000, 0x2000}, {0x3000, 0x3800}};
+  for (const auto& m : mappings) {
+    auto* mapping = profile->add_mapping();
+    mapping->set_id(profile->mapping_size());
+    mapping->set_memory_start(m.start);
+    mapping->set_memory_limit(m.limit);
+  }
+  for (uint64_t address : {0x800, 0x1800, 0x2800, 0x3400, 0x3c00}) {
+    auto* location = profile->add_location();
+    location->set_id(profile->location_size());
+    location->set_address(address);
+  }
+  profile->mutable_location(4)->set_mapping_id(1);
+  ASSERT_TRUE(builder.Finalize());
+
+  EXPECT_EQ(0, profile->location(0).mapping_id());
+  EXPECT_EQ(2, profile->location(1).mapping_id());
+  EXPECT_EQ(0, profile->location(2).mapping_id());
+  EXPECT_EQ(3, profile->location(3).mapping_id());
+  EXPECT_EQ(1, profile->location(4).mapping_id());
+}
+
+TEST(BuilderTest, FinalizeMaySkipTheCheck) {
+  Builder builder;
+  // There is no sample type.
+  EXPECT_FALSE(builder.Finalize());
+  builder.set_check_valid(false);
+  EXPECT_TRUE(builder.Finalize());
+}
+
+bool Unmarshal(const std::string& data, Profile* profile) {
+  ArrayInputStream stream(data.data(), data.size());
+  GzipInputStream gzip_stream(&stream);
+  return profile->ParseFromZeroCopyStream(&gzip_stream);
+}
+
+// Writing a profile a few fields at a time gives the profile that
+// Builder::Marshal() writes all at once.
+TEST(ProfileEncoderTest, EncodesProfileIncrementally) {
+  Builder builder;
+  Profile* want = builder.mutable_profile();
+  std::string encoded;
+  StringOutputStream stream(&encoded);
+  ProfileEncoder encoder(&stream);
+
+  Profile fields;
+  auto* sample_type = fields.add_sample_type();
+  sample_type->set_type(encoder.StringId("samples"));
+  sample_type->set_unit(encoder.StringId("count"));
+  fields.set_default_sample_type(encoder.StringId("samples"));
+  sample_type = want->add_sample_type();
+  sample_type->set_type(builder.StringId("samples"));
+  sample_type->set_unit(builder.StringId("count"));
+  want->set_default_sample_type(builder.StringId("samples"));
+  ASSERT_TRUE(encoder.Write(fields));
+
+  for (int i = 1; i <= 10; ++i) {
+    fields.Clear();
+    const std::string filename = "/lib/" + std::to_string(i % 3);
+    auto* mapping = fields.add_mapping();
+    mapping->set_id(i);
+    mapping->set_memory_start(i * 0x1000);
+    mapping->set_memory_limit((i + 1) * 0x1000);
+    mapping->set_filename(encoder.StringId(filename.c_str()));
+    auto* location = fields.add_location();
+    location->set_id(i);
+    location->set_mapping_id(i);
+    location->set_address(i * 0x1000 + 0x10);
+    auto* sample = fields.add_sample();
+    sample->add_location_id(i);
+    sample->add_value(i);
+    ASSERT_TRUE(encoder.Write(fields));
+
+    mapping = want->add_mapping();
+    *mapping = fields.mapping(0);
+    mapping->set_filename(builder.StringId(filename.c_str()));
+    *want->add_location() = fields.location(0);
+    *want->add_sample() = fields.sample(0);
+  }
+  ASSERT_TRUE(encoder.Close());
+
+  Profile got;
+  ASSERT_TRUE(Unmarshal(encoded, &got));
+  EXPECT_EQ(want->SerializeAsString(), got.SerializeAsString());
+  EXPECT_EQ(6, got.string_table_size());
+  EXPECT_EQ("", got.string_table(0));
+}
+
+// The profile compressed in blocks on several threads decompresses to the
+// same profile, in either format.
+TEST(BuilderTest, MarshalsInBlocks) {
+  Builder builder;
+  Profile* want = builder.mutable_profile();
+  for (int i = 0; i < 10000; ++i) {
+    auto* sample = want->add_sample();
+    sample->add_location_id(i % 100 + 1);
+    sample->add_value(i);
+    sample->add_label()->set_key(builder.StringId(std::to_string(i % 7)));
+  }
+  const std::string serialized = want->SerializeAsString();
+
+  quipper::ThreadPool pool(4);
+  MarshalOptions options;
+  options.block_size = 1000;
+  for (quipper::ThreadPool* p : {&pool, static_cast<quipper::ThreadPool*>(
+                                            nullptr)}) {
+    options.pool = p;
+    for (int level : {-1, 0, 9}) {
+      options.format = MarshalOptions::kGzip;
+      options.level = level;
+      std::string gzipped;
+      ASSERT_TRUE(Builder::Marshal(*want, options, &gzipped));
+      Profile got;
+      ASSERT_TRUE(Unmarshal(gzipped, &got)) << "level " << level;
+      EXPECT_EQ(serialized, got.SerializeAsString()) << "level " << level;
+
+      options.format = MarshalOptions::kZstd;
+      std::string compressed;
+      ASSERT_TRUE(Builder::Marshal(*want, options, &compressed));
+      std::string decompressed(serialized.size(), '\0');
+      // The frames of the blocks decompress one after the other.
+      EXPECT_EQ(serialized.size(),
+                ZSTD_decompress(&decompressed[0], decompressed.size(),
+                                compressed.data(), compressed.size()));
+      EXPECT_EQ(serialized, decompressed) << "level " << level;
+    }
+  }
+
+  // An empty profile is a single empty block.
+  options.pool = &pool;
+  options.format = MarshalOptions::kGzip;
+  std::string gzipped;
+  ASSERT_TRUE(Builder::Marshal(Profile(), options, &gzipped));
+  Profile got;
+  ASSERT_TRUE(Unmarshal(gzipped, &got));
+  EXPECT_EQ(0, got.ByteSizeLong());
+}
+
+TEST(ProfileEncoderTest, RejectsStringTables) {
+  std::string encoded;
+  StringOutputStream stream(&encoded);
+  ProfileEncoder encoder(&stream);
+  Profile fields;
+  fields.add_string_table("");
+  EXPECT_FALSE(encoder.Write(fields));
+  EXPECT_TRUE(encoder.Close());
+}
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/conversion_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "src/quipper/base/logging.h"
+
+namespace perftools {
+
+namespace {
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+// The start of the cache files, followed by the version of their format.
+constexpr char kMagic[8] = {'P', 'D', 'C', 'C', 'A', 'C', 'H', '1'};
+constexpr char kSuffix[] = ".pcache";
+
+uint64_t RotateLeft(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+uint64_t Read64(const unsigned char* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint32_t Read32(const unsigned char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  return RotateLeft(acc, 31) * kPrime1;
+}
+
+uint64_t MergeRound(uint64_t acc, uint64_t value) {
+  acc ^= Round(0, value);
+  return acc * kPrime1 + kPrime4;
+}
+
+bool HasSuffix(const std::string& s, const std::string& suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void AppendUint64(uint64_t value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendString(const std::string& s, std::string* out) {
+  AppendUint64(s.size(), out);
+  out->append(s);
+}
+
+// Reads the fields of a cache file in order, failing once one is missing.
+class EntryReader {
+ public:
+  explicit EntryReader(const std::string& data) : data_(data) {}
+
+  bool ReadUint64(uint64_t* value) {
+    if (data_.size() - offset_ < sizeof(*value)) return false;
+    memcpy(value, data_.data() + offset_, sizeof(*value));
+    offset_ += sizeof(*value);
+    return true;
+  }
+
+  bool ReadString(std::string* s) {
+    uint64_t size;
+    if (!ReadUint64(&size) || data_.size() - offset_ < size) return false;
+    s->assign(data_, offset_, size);
+    offset_ += size;
+    return true;
+  }
+
+  bool AtEnd() const { return offset_ == data_.size(); }
+
+ private:
+  const std::string& data_;
+  size_t offset_ = 0;
+};
+
+bool Gunzip(const std::string& input, std::string* output) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) return false;
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  output->clear();
+  char buffer[1 << 16];
+  int ret;
+  do {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      inflateEnd(&stream);
+      return false;
+    }
+    output->append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (ret != Z_STREAM_END);
+  inflateEnd(&stream);
+  return true;
+}
+
+// Returns the arguments of a conversion that its result depends on, in a
+// canonical order.
+std::string ConversionKey(const std::map<std::string, std::string>& build_ids,
+                          const ConversionParams& params) {
+  std::string key;
+  AppendUint64(params.sample_labels, &key);
+  // Only the marshaled data of the profiles depends on kMarshalProfiles.
+  AppendUint64(params.options & ~kMarshalProfiles, &key);
+  AppendUint64(params.timestamp_bucket_ns, &key);
+  AppendUint64(params.downsample_rate, &key);
+  AppendUint64(params.downsample_seed, &key);
+  AppendUint64(params.spe_filter.events, &key);
+  AppendUint64(params.spe_filter.ops, &key);
+  AppendUint64(params.spe_filter.min_total_lat, &key);
+  AppendUint64(build_ids.size(), &key);
+  for (const auto& it : build_ids) {
+    AppendString(it.first, &key);
+    AppendString(it.second, &key);
+  }
+  AppendUint64(params.thread_types.size(), &key);
+  for (const auto& it : params.thread_types) {
+    AppendUint64(it.first, &key);
+    AppendString(it.second, &key);
+  }
+  const quipper::PerfReader::ProcessFilter& filter = params.process_filter;
+  std::vector<uint64_t> pids(filter.pids.begin(), filter.pids.end());
+  std::sort(pids.begin(), pids.end());
+  AppendUint64(pids.size(), &key);
+  for (uint64_t pid : pids) AppendUint64(pid, &key);
+  for (const auto* names : {&filter.comms, &filter.cgroups}) {
+    std::vector<std::string> sorted(names->begin(), names->end());
+    std::sort(sorted.begin(), sorted.end());
+    AppendUint64(sorted.size(), &key);
+    for (const auto& name : sorted) AppendString(name, &key);
+  }
+  return key;
+}
+
+}  // namespace
+
+uint64_t Digest64(const void* data, const size_t size, const uint64_t seed) {
+  const auto* p = static_cast<const unsigned char*>(data);
+  const unsigned char* const end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+    for (; end - p >= 32; p += 32) {
+      v1 = Round(v1, Read64(p));
+      v2 = Round(v2, Read64(p + 8));
+      v3 = Round(v3, Read64(p + 16));
+      v4 = Round(v4, Read64(p + 24));
+    }
+    h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) +
+        RotateLeft(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += size;
+  for (; end - p >= 8; p += 8) {
+    h ^= Round(0, Read64(p));
+    h = RotateLeft(h, 27) * kPrime1 + kPrime4;
+  }
+  if (end - p >= 4) {
+    h ^= Read32(p) * kPrime1;
+    h = RotateLeft(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * kPrime5;
+    h = RotateLeft(h, 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+ConversionCache::ConversionCache(const std::string& directory,
+                                 const uint64_t max_bytes)
+    : directory_(directory), max_bytes_(max_bytes) {
+  DIR* dir = opendir(directory_.c_str());
+  if (dir == nullptr) {
+    PLOG(ERROR) << "Could not open the cache directory " << directory_;
+    return;
+  }
+  std::vector<std::pair<int64_t, std::string>> files;
+  std::vector<uint64_t> sizes;
+  while (const struct dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    struct stat st;
+    if (!HasSuffix(name, kSuffix) ||
+        stat((directory_ + "/" + name).c_str(), &st) != 0) {
+      continue;
+    }
+    files.emplace_back(
+        st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+        name.substr(0, name.size() - strlen(kSuffix)));
+    sizes.push_back(st.st_size);
+  }
+  closedir(dir);
+  std::vector<size_t> order(files.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  // Touched from the least recently used on, which ends up last.
+  std::sort(order.begin(), order.end(), [&files](size_t a, size_t b) {
+    return files[a] < files[b];
+  });
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i : order) Touch(files[i].second, sizes[i]);
+  while (size_bytes_ > max_bytes_) Evict(lru_.back());
+}
+
+ProcessProfiles ConversionCache::RawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params) {
+  const std::string key = ConversionKey(build_ids, params);
+  char name[33];
+  snprintf(name, sizeof(name), "%016llx%016llx",
+           static_cast<unsigned long long>(Digest64(raw, raw_size)),  // NOLINT
+           static_cast<unsigned long long>(                           // NOLINT
+               Digest64(key.data(), key.size())));
+  const bool marshaled = params.options & kMarshalProfiles;
+  ProcessProfiles profiles;
+  if (Lookup(name, raw_size, marshaled, &profiles)) return profiles;
+
+  ConversionParams marshal_params = params;
+  marshal_params.options |= kMarshalProfiles;
+  profiles = perftools::RawPerfDataToProfiles(raw, raw_size, build_ids,
+                                              marshal_params);
+  if (profiles.empty()) return profiles;
+  bool all_marshaled = true;
+  for (const auto& pp : profiles) {
+    all_marshaled = all_marshaled && !pp->marshaled_data.empty();
+  }
+  if (all_marshaled) Insert(name, raw_size, profiles);
+  if (!marshaled) {
+    for (auto& pp : profiles) std::string().swap(pp->marshaled_data);
+  }
+  return profiles;
+}
+
+uint64_t ConversionCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t ConversionCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+uint64_t ConversionCache::size_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_bytes_;
+}
+
+bool ConversionCache::Lookup(const std::string& name, const uint64_t raw_size,
+                             const bool marshaled, ProcessProfiles* profiles) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(name);
+    if (it == entries_.end()) {
+      ++misses_;
+      return false;
+    }
+    Touch(name, it->second.size);
+  }
+  const std::string path = Path(name);
+  std::ifstream file(path, std::ios::binary);
+  const std::string data((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+  EntryReader reader(data);
+  uint64_t size = 0, count = 0;
+  bool ok = data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) == 0;
+  if (ok) {
+    uint64_t magic;
+    ok = reader.ReadUint64(&magic) && reader.ReadUint64(&size) &&
+         size == raw_size && reader.ReadUint64(&count);
+  }
+  std::string serialized;
+  for (uint64_t i = 0; ok && i < count; ++i) {
+    auto pp = std::make_unique<ProcessProfile>();
+    uint64_t pid = 0, min_time = 0, max_time = 0, num_stats = 0;
+    ok = reader.ReadUint64(&pid) && reader.ReadUint64(&min_time) &&
+         reader.ReadUint64(&max_time) && reader.ReadUint64(&num_stats);
+    for (uint64_t j = 0; ok && j < num_stats; ++j) {
+      uint64_t source = 0, frames = 0;
+      // A damaged file may have sources that aren't BuildIdSources.
+      ok = reader.ReadUint64(&source) && reader.ReadUint64(&frames) &&
+           source <= kBuildIdNoMmap;
+      if (ok) pp->build_id_stats[static_cast<BuildIdSource>(source)] = frames;
+    }
+    ok = ok && reader.ReadString(&pp->marshaled_data) &&
+         Gunzip(pp->marshaled_data, &serialized) &&
+         pp->data.ParseFromString(serialized);
+    if (!ok) break;
+    pp->pid = pid;
+    pp->min_sample_time_ns = min_time;
+    pp->max_sample_time_ns = max_time;
+    if (!marshaled) std::string().swap(pp->marshaled_data);
+    profiles->push_back(std::move(pp));
+  }
+  ok = ok && reader.AtEnd();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok) {
+    // The entry may have been evicted meanwhile, or the file damaged.
+    LOG(WARNING) << "Could not read the cache entry " << path;
+    profiles->clear();
+    if (entries_.count(name) > 0) Evict(name);
+    ++misses_;
+    return false;
+  }
+  // Other processes using the directory see the entry as recently used too.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  ++hits_;
+  return true;
+}
+
+void ConversionCache::Insert(const std::string& name, const uint64_t raw_size,
+                             const ProcessProfiles& profiles) {
+  std::string data(kMagic, sizeof(kMagic));
+  AppendUint64(raw_size, &data);
+  AppendUint64(profiles.size(), &data);
+  for (const auto& pp : profiles) {
+    AppendUint64(pp->pid, &data);
+    AppendUint64(pp->min_sample_time_ns, &data);
+    AppendUint64(pp->max_sample_time_ns, &data);
+    AppendUint64(pp->build_id_stats.size(), &data);
+    for (const auto& it : pp->build_id_stats) {
+      AppendUint64(it.first, &data);
+      AppendUint64(it.second, &data);
+    }
+    AppendString(pp->marshaled_data, &data);
+  }
+
+  // Written to a file of its own first, so that the entry is never seen
+  // partially written.
+  std::string temp_path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    temp_path = Path(name) + "." + std::to_string(getpid()) + "-" +
+                std::to_string(next_temp_id_++) + ".tmp";
+  }
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  file.write(data.data(), data.size());
+  file.close();
+  if (!file || rename(temp_path.c_str(), Path(name).c_str()) != 0) {
+    PLOG(WARNING) << "Could not write the cache entry " << Path(name);
+    unlink(temp_path.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Touch(name, data.size());
+  while (size_bytes_ > max_bytes_) Evict(lru_.back());
+}
+
+void ConversionCache::Touch(const std::string& name, const uint64_t size) {
+  const auto it = entries_.find(name);
+  if (it != entries_.end()) {
+    size_bytes_ -= it->second.size;
+    lru_.erase(it->second.lru_position);
+  }
+  lru_.push_front(name);
+  entries_[name] = Entry{lru_.begin(), size};
+  size_bytes_ += size;
+}
+
+void ConversionCache::Evict(const std::string name) {
+  const auto it = entries_.find(name);
+  size_bytes_ -= it->second.size;
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+  unlink(Path(name).c_str());
+}
+
+std::string ConversionCache::Path(const std::string& name) const {
+  return directory_ + "/" + name + kSuffix;
+}
+
+}  // namespace perftools
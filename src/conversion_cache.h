@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_CONVERSION_CACHE_H_
+#define PERFTOOLS_CONVERSION_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "src/perf_data_converter.h"
+
+namespace perftools {
+
+// Returns a 64-bit digest of the |size| bytes at |data|, computed as XXH64
+// is, which hashes several gigabytes per second.
+uint64_t Digest64(const void* data, size_t size, uint64_t seed = 0);
+
+// Caches the profiles converted from raw perf data on local disk, keyed by a
+// digest of the input and of the arguments of the conversion, so that
+// converting the same input again with the same arguments, e.g. on retries
+// or for several consumers, only reads the marshaled profiles back. The
+// least recently used entries are evicted once the cache takes more than its
+// size limit. The cache can be shared by concurrent conversions, and by
+// processes using the same directory, which only see each other's entries
+// once they are opened.
+class ConversionCache {
+ public:
+  // Stores the entries in |directory|, which must exist, and keeps them
+  // under about |max_bytes|. The entries already in the directory are used,
+  // the most recently modified being the most recently used.
+  ConversionCache(const std::string& directory, uint64_t max_bytes);
+
+  ConversionCache(const ConversionCache&) = delete;
+  ConversionCache& operator=(const ConversionCache&) = delete;
+
+  // Returns the profiles RawPerfDataToProfiles() returns with these
+  // arguments, from the cache if the same input was converted with the same
+  // arguments before. The stats of |params| are only filled in by the
+  // conversions. The profiles are marshaled to be cached, whether or not
+  // kMarshalProfiles is in the options, and their marshaled data is only kept
+  // with it. Failed conversions are not cached.
+  ProcessProfiles RawPerfDataToProfiles(
+      const void* raw, uint64_t raw_size,
+      const std::map<std::string, std::string>& build_ids,
+      const ConversionParams& params = {});
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+  // The bytes taken by the entries of the cache.
+  uint64_t size_bytes() const;
+
+ private:
+  struct Entry {
+    std::list<std::string>::iterator lru_position;
+    uint64_t size;
+  };
+
+  // Reads the profiles of the entry |name|, and marks it as the most
+  // recently used. Returns false if there is no such entry or it can't be
+  // read, in which case it is dropped.
+  bool Lookup(const std::string& name, uint64_t raw_size, bool marshaled,
+              ProcessProfiles* profiles);
+  // Writes the entry |name| of |profiles|, then evicts the least recently
+  // used entries while the cache is over its size limit.
+  void Insert(const std::string& name, uint64_t raw_size,
+              const ProcessProfiles& profiles);
+  // Adds or updates the entry |name| of |size| bytes as the most recently
+  // used. Must be called with |mutex_| held.
+  void Touch(const std::string& name, uint64_t size);
+  // Takes |name| by value, since it may be the entry's own name in |lru_|.
+  void Evict(std::string name);
+  std::string Path(const std::string& name) const;
+
+  const std::string directory_;
+  const uint64_t max_bytes_;
+
+  mutable std::mutex mutex_;
+  // The names of the entries, the most recently used first.
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t size_bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  // Makes the names of the files being written unique.
+  uint64_t next_temp_id_ = 0;
+};
+
+}  // namespace perftools
+
+#endif  // PERFTOOLS_CONVERSION_CACHE_H_
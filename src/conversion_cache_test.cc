@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/conversion_cache.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "src/quipper/kernel/perf_event.h"
+#include "src/quipper/perf_data.pb.h"
+#include "src/quipper/perf_reader.h"
+
+namespace perftools {
+namespace {
+
+// Returns the raw perf data of samples of two processes.
+std::string MakeRawPerfData() {
+  quipper::PerfDataProto proto;
+  auto* attr = proto.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_size(sizeof(quipper::perf_event_attr));
+  attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                        quipper::PERF_SAMPLE_PERIOD);
+  proto.add_event_types()->set_name("cycles");
+  proto.add_metadata_mask(0);
+  for (int pid = 100; pid <= 101; ++pid) {
+    auto* event = proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap_event = event->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  for (int i = 0; i < 10; ++i) {
+    auto* event = proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample_event = event->mutable_sample_event();
+    sample_event->set_ip(0x1100 + i % 3);
+    sample_event->set_pid(100 + i % 2);
+    sample_event->set_tid(100 + i % 2);
+    sample_event->set_period(1);
+  }
+  quipper::PerfReader reader;
+  std::string raw;
+  EXPECT_TRUE(reader.Deserialize(proto));
+  EXPECT_TRUE(reader.WriteToString(&raw));
+  return raw;
+}
+
+// Returns an empty directory for a cache.
+std::string MakeCacheDirectory(const std::string& name) {
+  const std::string dir = ::testing::TempDir() + "/" + name;
+  mkdir(dir.c_str(), 0755);
+  DIR* entries = opendir(dir.c_str());
+  while (const struct dirent* entry = readdir(entries)) {
+    unlink((dir + "/" + entry->d_name).c_str());
+  }
+  closedir(entries);
+  return dir;
+}
+
+TEST(ConversionCacheTest, DigestsAsXxh64) {
+  EXPECT_EQ(0xef46db3751d8e999ULL, Digest64("", 0));
+  EXPECT_EQ(0x44bc2cf5ad770999ULL, Digest64("abc", 3));
+  std::vector<unsigned char> bytes(100);
+  for (size_t i = 0; i < bytes.size(); ++i) bytes[i] = i;
+  EXPECT_EQ(0x80653e7e9b887cddULL, Digest64(bytes.data(), bytes.size(), 7));
+}
+
+TEST(ConversionCacheTest, ReturnsCachedProfiles) {
+  const std::string raw = MakeRawPerfData();
+  const std::string dir = MakeCacheDirectory("conversion_cache_hits");
+  const ProcessProfiles expected = perftools::RawPerfDataToProfiles(
+      raw.data(), raw.size(), {}, kPidAndTidLabels, kGroupByPids);
+  ASSERT_EQ(2, expected.size());
+  ConversionParams params;
+  params.sample_labels = kPidAndTidLabels;
+  ConversionParams marshal_params;
+  marshal_params.options = kGroupByPids | kMarshalProfiles;
+
+  uint64_t size_bytes;
+  {
+    ConversionCache cache(dir, 1 << 30);
+    for (int i = 0; i < 2; ++i) {
+      const ProcessProfiles pps =
+          cache.RawPerfDataToProfiles(raw.data(), raw.size(), {}, params);
+      ASSERT_EQ(expected.size(), pps.size());
+      for (size_t j = 0; j < pps.size(); ++j) {
+        EXPECT_EQ(expected[j]->pid, pps[j]->pid);
+        EXPECT_EQ(expected[j]->min_sample_time_ns, pps[j]->min_sample_time_ns);
+        EXPECT_EQ(expected[j]->max_sample_time_ns, pps[j]->max_sample_time_ns);
+        EXPECT_EQ(expected[j]->build_id_stats, pps[j]->build_id_stats);
+        EXPECT_EQ(expected[j]->data.SerializeAsString(),
+                  pps[j]->data.SerializeAsString());
+        EXPECT_TRUE(pps[j]->marshaled_data.empty());
+      }
+    }
+    EXPECT_EQ(1, cache.hits());
+    EXPECT_EQ(1, cache.misses());
+
+    // Other arguments are converted again.
+    const ProcessProfiles pps = cache.RawPerfDataToProfiles(
+        raw.data(), raw.size(), {}, marshal_params);
+    ASSERT_FALSE(pps.empty());
+    EXPECT_FALSE(pps[0]->marshaled_data.empty());
+    EXPECT_EQ(2, cache.misses());
+    size_bytes = cache.size_bytes();
+    EXPECT_GT(size_bytes, 0);
+  }
+
+  // The entries are found again by a new cache, which evicts the least
+  // recently used one to fit a smaller limit.
+  ConversionCache cache(dir, size_bytes - 1);
+  EXPECT_LT(cache.size_bytes(), size_bytes);
+  const ProcessProfiles pps =
+      cache.RawPerfDataToProfiles(raw.data(), raw.size(), {}, marshal_params);
+  ASSERT_FALSE(pps.empty());
+  EXPECT_FALSE(pps[0]->marshaled_data.empty());
+  EXPECT_EQ(1, cache.hits());
+}
+
+}  // namespace
+}  // namespace perftools
@@ -8,11 +8,15 @@
 #ifndef PERFTOOLS_INTERVALMAP_H_
 #define PERFTOOLS_INTERVALMAP_H_
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 #include "src/quipper/base/logging.h"
 
@@ -31,6 +35,13 @@ class IntervalMap {
   // if no interval contains key.
   bool Lookup(uint64_t key, V* value) const;
 
+  // Same as Lookup(), but also sets start and limit to the bounds of the
+  // interval containing key. If there is none, sets them to the bounds of the
+  // gap between the intervals around key instead; the gap ends at UINT64_MAX
+  // if no interval starts after key.
+  bool LookupInterval(uint64_t key, uint64_t* start, uint64_t* limit,
+                      V* value) const;
+
   // Find the interval containing key, or the next interval containing
   // something greater than key. Returns false if one is not found, otherwise
   // it sets start, limit, and value to the corresponding values from the
@@ -124,6 +135,26 @@ bool IntervalMap<V>::Lookup(uint64_t key, V* value) const {
   return true;
 }
 
+template <class V>
+bool IntervalMap<V>::LookupInterval(uint64_t key, uint64_t* start,
+                                    uint64_t* limit, V* value) const {
+  auto next = interval_start_.upper_bound(key);
+  *start = 0;
+  *limit = next == interval_start_.end() ? UINT64_MAX : next->first;
+  auto iter = next;
+  if (!Decrement(&iter)) {
+    return false;
+  }
+  if (iter->second.limit <= key) {
+    *start = iter->second.limit;
+    return false;
+  }
+  *start = iter->first;
+  *limit = iter->second.limit;
+  *value = iter->second.value;
+  return true;
+}
+
 template <class V>
 bool IntervalMap<V>::FindNext(uint64_t key, uint64_t* start, uint64_t* limit,
                               V* value) const {
@@ -205,6 +236,444 @@ void IntervalMap<V>::Insert(uint64_t start, uint64_t limit, const V& value) {
   interval_start_.emplace(std::pair<uint64_t, Value>{start, {limit, value}});
 }
 
+// FlatIntervalMap has the same interface and behavior as IntervalMap, but keeps
+// the intervals in a vector sorted by start. Lookups are binary searches over
+// contiguous memory rather than walks down a tree, at the cost of writes that
+// move the intervals after the written ones. It suits maps that are read much
+// more often than they are written, such as the address space of a process.
+template <class V>
+class FlatIntervalMap {
+ public:
+  FlatIntervalMap() {}
+
+  // Set [start, limit) to value. If this interval overlaps one currently in the
+  // map, the overlapping section will be overwritten by the new interval.
+  void Set(uint64_t start, uint64_t limit, const V& value);
+
+  // Finds the value associated with the interval containing key. Returns false
+  // if no interval contains key.
+  bool Lookup(uint64_t key, V* value) const;
+
+  // Same as Lookup(), but also sets start and limit to the bounds of the
+  // interval containing key.
+  bool LookupInterval(uint64_t key, uint64_t* start, uint64_t* limit,
+                      V* value) const;
+
+  // Find the first interval that starts after key. Returns false if one is not
+  // found, otherwise it sets start, limit, and value to the corresponding
+  // values from the interval.
+  bool FindNext(uint64_t key, uint64_t* start, uint64_t* limit, V* value) const;
+
+  // Remove all entries from the map.
+  void Clear() { intervals_.clear(); }
+
+  // Clears everything in the interval map from [clear_start, clear_limit).
+  // This may cut off sections or entire intervals in the map.
+  void ClearInterval(uint64_t clear_start, uint64_t clear_limit);
+
+  uint64_t Size() const { return intervals_.size(); }
+
+ private:
+  struct Interval {
+    uint64_t start;
+    uint64_t limit;
+    V value;
+  };
+
+  using Iter = typename std::vector<Interval>::iterator;
+  using ConstIter = typename std::vector<Interval>::const_iterator;
+
+  static bool StartsAfter(uint64_t point, const Interval& interval) {
+    return point < interval.start;
+  }
+  static bool StartsBefore(const Interval& interval, uint64_t point) {
+    return interval.start < point;
+  }
+
+  // Returns the first interval that starts after point.
+  ConstIter UpperBound(uint64_t point) const {
+    return std::upper_bound(intervals_.begin(), intervals_.end(), point,
+                            StartsAfter);
+  }
+  Iter UpperBound(uint64_t point) {
+    return std::upper_bound(intervals_.begin(), intervals_.end(), point,
+                            StartsAfter);
+  }
+
+  // Removes everything in the interval map from [remove_start, remove_limit),
+  // and returns the position at which an interval starting at remove_start
+  // belongs.
+  Iter RemoveInterval(uint64_t remove_start, uint64_t remove_limit);
+
+  std::vector<Interval> intervals_;
+};
+
+template <class V>
+void FlatIntervalMap<V>::Set(uint64_t start, uint64_t limit, const V& value) {
+  CHECK_LT(start, limit);
+  auto pos = RemoveInterval(start, limit);
+  intervals_.insert(pos, Interval{start, limit, value});
+}
+
+template <class V>
+bool FlatIntervalMap<V>::Lookup(uint64_t key, V* value) const {
+  uint64_t start, limit;
+  return LookupInterval(key, &start, &limit, value);
+}
+
+template <class V>
+bool FlatIntervalMap<V>::LookupInterval(uint64_t key, uint64_t* start,
+                                        uint64_t* limit, V* value) const {
+  auto iter = UpperBound(key);
+  if (iter == intervals_.begin()) {
+    return false;
+  }
+  --iter;
+  if (iter->limit <= key) {
+    return false;
+  }
+  *start = iter->start;
+  *limit = iter->limit;
+  *value = iter->value;
+  return true;
+}
+
+template <class V>
+bool FlatIntervalMap<V>::FindNext(uint64_t key, uint64_t* start,
+                                  uint64_t* limit, V* value) const {
+  auto iter = UpperBound(key);
+  if (iter == intervals_.end()) {
+    return false;
+  }
+  *start = iter->start;
+  *limit = iter->limit;
+  *value = iter->value;
+  return true;
+}
+
+template <class V>
+void FlatIntervalMap<V>::ClearInterval(uint64_t clear_start,
+                                       uint64_t clear_limit) {
+  CHECK_LT(clear_start, clear_limit);
+  RemoveInterval(clear_start, clear_limit);
+}
+
+template <class V>
+typename FlatIntervalMap<V>::Iter FlatIntervalMap<V>::RemoveInterval(
+    uint64_t remove_start, uint64_t remove_limit) {
+  // The intervals that start before remove_limit and end after remove_start
+  // overlap the removed range. Only the first and the last of them can stick
+  // out of it.
+  auto first = UpperBound(remove_start);
+  if (first != intervals_.begin() && std::prev(first)->limit > remove_start) {
+    --first;
+  }
+  auto last =
+      std::lower_bound(first, intervals_.end(), remove_limit, StartsBefore);
+  if (first == last) {
+    return first;
+  }
+
+  // Keep the parts of the overlapping intervals on either side of the range.
+  const Interval front = *first;
+  const Interval back = *std::prev(last);
+  auto pos = intervals_.erase(first, last);
+  if (back.limit > remove_limit) {
+    pos = intervals_.insert(pos,
+                            Interval{remove_limit, back.limit, back.value});
+  }
+  if (front.start < remove_start) {
+    pos = intervals_.insert(pos, Interval{front.start, remove_start,
+                                          front.value});
+    ++pos;
+  }
+  return pos;
+}
+
+// LayeredIntervalMap keeps most intervals in a FlatIntervalMap, and those that
+// are written often, such as the many small code regions a JIT emits, in an
+// IntervalMap on top of it, so that writing them doesn't move the intervals of
+// the flat map around. An interval set on either layer overwrites the
+// overlapping sections of those set before it, as in a single map.
+template <class V>
+class LayeredIntervalMap {
+ public:
+  LayeredIntervalMap() {}
+
+  // Set [start, limit) to value in the flat layer.
+  void Set(uint64_t start, uint64_t limit, const V& value) {
+    top_.ClearInterval(start, limit);
+    base_.Set(start, limit, value);
+  }
+
+  // Set [start, limit) to value in the top layer.
+  void SetTop(uint64_t start, uint64_t limit, const V& value) {
+    top_.Set(start, limit, value);
+  }
+
+  // Finds the value associated with the interval containing key, and sets
+  // start and limit to the bounds of the part of it that is visible. Returns
+  // false if no interval contains key.
+  bool LookupInterval(uint64_t key, uint64_t* start, uint64_t* limit,
+                      V* value) const;
+
+  uint64_t Size() const { return base_.Size() + top_.Size(); }
+
+ private:
+  FlatIntervalMap<V> base_;
+  IntervalMap<V> top_;
+};
+
+template <class V>
+bool LayeredIntervalMap<V>::LookupInterval(uint64_t key, uint64_t* start,
+                                           uint64_t* limit, V* value) const {
+  if (top_.LookupInterval(key, start, limit, value)) {
+    return true;
+  }
+  // The interval of the flat layer is cut off by those on top of it.
+  const uint64_t gap_start = *start;
+  const uint64_t gap_limit = *limit;
+  if (!base_.LookupInterval(key, start, limit, value)) {
+    return false;
+  }
+  *start = std::max(*start, gap_start);
+  *limit = std::min(*limit, gap_limit);
+  return true;
+}
+
+// PersistentIntervalMap has the same interface and behavior as IntervalMap,
+// but its versions share structure: the intervals are kept in a treap of
+// immutable nodes, and a write copies only the nodes on the paths it changes.
+// Copying the map is then O(1), so that readers can keep a snapshot of a
+// version, e.g. the address space of a process at some time or that of a
+// forked child, while the writer goes on to the next ones. Distinct copies
+// can be used on different threads concurrently.
+template <class V>
+class PersistentIntervalMap {
+ public:
+  PersistentIntervalMap() {}
+
+  // Set [start, limit) to value. If this interval overlaps one currently in the
+  // map, the overlapping section will be overwritten by the new interval.
+  void Set(uint64_t start, uint64_t limit, const V& value);
+
+  // Finds the value associated with the interval containing key. Returns false
+  // if no interval contains key.
+  bool Lookup(uint64_t key, V* value) const {
+    uint64_t start, limit;
+    return LookupInterval(key, &start, &limit, value);
+  }
+
+  // Same as IntervalMap::LookupInterval().
+  bool LookupInterval(uint64_t key, uint64_t* start, uint64_t* limit,
+                      V* value) const;
+
+  // Find the first interval that starts after key. Returns false if one is not
+  // found, otherwise it sets start, limit, and value to the corresponding
+  // values from the interval.
+  bool FindNext(uint64_t key, uint64_t* start, uint64_t* limit, V* value) const;
+
+  // Remove all entries from the map.
+  void Clear() { root_.reset(); }
+
+  // Clears everything in the interval map from [clear_start, clear_limit).
+  // This may cut off sections or entire intervals in the map.
+  void ClearInterval(uint64_t clear_start, uint64_t clear_limit) {
+    CHECK_LT(clear_start, clear_limit);
+    RemoveInterval(clear_start, clear_limit, nullptr);
+  }
+
+  uint64_t Size() const { return root_ == nullptr ? 0 : root_->size; }
+
+ private:
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+
+  struct Node {
+    Node(uint64_t start, uint64_t limit, const V& value, NodePtr left,
+         NodePtr right)
+        : start(start),
+          limit(limit),
+          value(value),
+          left(std::move(left)),
+          right(std::move(right)),
+          size(1 + SubtreeSize(this->left) + SubtreeSize(this->right)) {}
+
+    const uint64_t start;
+    const uint64_t limit;
+    const V value;
+    const NodePtr left;
+    const NodePtr right;
+    // The number of intervals in the subtree.
+    const uint64_t size;
+  };
+
+  static uint64_t SubtreeSize(const NodePtr& node) {
+    return node == nullptr ? 0 : node->size;
+  }
+
+  // The heap priority of the node of an interval starting at start, a hash of
+  // it, so that the shape of the tree only depends on the intervals in it.
+  static uint64_t Priority(uint64_t start) {
+    uint64_t x = start + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  static NodePtr WithChildren(const NodePtr& node, NodePtr left,
+                              NodePtr right) {
+    return std::make_shared<const Node>(node->start, node->limit, node->value,
+                                        std::move(left), std::move(right));
+  }
+
+  // Joins two trees, all of whose intervals in |left| start before those in
+  // |right|.
+  static NodePtr Merge(const NodePtr& left, const NodePtr& right);
+
+  // Splits a tree into the intervals that start before |point| and the
+  // others. |before| and |after| must not point to |node|.
+  static void Split(const NodePtr& node, uint64_t point, NodePtr* before,
+                    NodePtr* after);
+
+  // Returns the interval that starts last in a non-empty tree.
+  static const Node* Last(const Node* node) {
+    while (node->right != nullptr) node = node->right.get();
+    return node;
+  }
+
+  // Removes everything in the interval map from [remove_start, remove_limit),
+  // then inserts the node |inserted| in its place if it isn't null.
+  void RemoveInterval(uint64_t remove_start, uint64_t remove_limit,
+                      NodePtr inserted);
+
+  NodePtr root_;
+};
+
+template <class V>
+void PersistentIntervalMap<V>::Set(uint64_t start, uint64_t limit,
+                                   const V& value) {
+  CHECK_LT(start, limit);
+  RemoveInterval(start, limit,
+                 std::make_shared<const Node>(start, limit, value, nullptr,
+                                              nullptr));
+}
+
+template <class V>
+bool PersistentIntervalMap<V>::LookupInterval(uint64_t key, uint64_t* start,
+                                              uint64_t* limit,
+                                              V* value) const {
+  // The intervals starting last at or before key, and first after it.
+  const Node* before = nullptr;
+  const Node* after = nullptr;
+  for (const Node* node = root_.get(); node != nullptr;) {
+    if (node->start <= key) {
+      before = node;
+      node = node->right.get();
+    } else {
+      after = node;
+      node = node->left.get();
+    }
+  }
+  *start = 0;
+  *limit = after == nullptr ? UINT64_MAX : after->start;
+  if (before == nullptr) {
+    return false;
+  }
+  if (before->limit <= key) {
+    *start = before->limit;
+    return false;
+  }
+  *start = before->start;
+  *limit = before->limit;
+  *value = before->value;
+  return true;
+}
+
+template <class V>
+bool PersistentIntervalMap<V>::FindNext(uint64_t key, uint64_t* start,
+                                        uint64_t* limit, V* value) const {
+  const Node* after = nullptr;
+  for (const Node* node = root_.get(); node != nullptr;) {
+    if (node->start <= key) {
+      node = node->right.get();
+    } else {
+      after = node;
+      node = node->left.get();
+    }
+  }
+  if (after == nullptr) {
+    return false;
+  }
+  *start = after->start;
+  *limit = after->limit;
+  *value = after->value;
+  return true;
+}
+
+template <class V>
+typename PersistentIntervalMap<V>::NodePtr PersistentIntervalMap<V>::Merge(
+    const NodePtr& left, const NodePtr& right) {
+  if (left == nullptr) return right;
+  if (right == nullptr) return left;
+  if (Priority(left->start) > Priority(right->start)) {
+    return WithChildren(left, left->left, Merge(left->right, right));
+  }
+  return WithChildren(right, Merge(left, right->left), right->right);
+}
+
+template <class V>
+void PersistentIntervalMap<V>::Split(const NodePtr& node, uint64_t point,
+                                     NodePtr* before, NodePtr* after) {
+  if (node == nullptr) {
+    before->reset();
+    after->reset();
+  } else if (node->start < point) {
+    NodePtr right_before;
+    Split(node->right, point, &right_before, after);
+    *before = WithChildren(node, node->left, std::move(right_before));
+  } else {
+    NodePtr left_after;
+    Split(node->left, point, before, &left_after);
+    *after = WithChildren(node, std::move(left_after), node->right);
+  }
+}
+
+template <class V>
+void PersistentIntervalMap<V>::RemoveInterval(uint64_t remove_start,
+                                              uint64_t remove_limit,
+                                              NodePtr inserted) {
+  NodePtr before, rest, middle, after;
+  Split(root_, remove_start, &before, &rest);
+  Split(rest, remove_limit, &middle, &after);
+  // Only the last interval starting before the range, and the last one
+  // starting in it, can stick out of it.
+  NodePtr front, back;
+  if (before != nullptr) {
+    const Node* last = Last(before.get());
+    if (last->limit > remove_start) {
+      const NodePtr all = std::move(before);
+      NodePtr last_node;
+      Split(all, last->start, &before, &last_node);
+      front = std::make_shared<const Node>(last->start, remove_start,
+                                           last->value, nullptr, nullptr);
+      if (last->limit > remove_limit) {
+        back = std::make_shared<const Node>(remove_limit, last->limit,
+                                            last->value, nullptr, nullptr);
+      }
+    }
+  }
+  if (middle != nullptr) {
+    const Node* last = Last(middle.get());
+    if (last->limit > remove_limit) {
+      back = std::make_shared<const Node>(remove_limit, last->limit,
+                                          last->value, nullptr, nullptr);
+    }
+  }
+  root_ = Merge(Merge(Merge(before, front), Merge(std::move(inserted), back)),
+                after);
+}
+
 }  // namespace perftools
 
 #endif  // PERFTOOLS_INTERVALMAP_H_
@@ -10,6 +10,8 @@
 
 #include "src/intervalmap.h"
 
+#include <random>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -282,6 +284,179 @@ TEST_P(IntervalMapTest, GenericTest) {
 INSTANTIATE_TEST_SUITE_P(AllIntervalMapTests, IntervalMapTest,
                          ::testing::ValuesIn(tests));
 
+// FlatIntervalMap behaves exactly like IntervalMap for random sequences of
+// overlapping writes.
+TEST(FlatIntervalMapTest, MatchesIntervalMap) {
+  std::mt19937_64 rng(12345);
+  std::uniform_int_distribution<uint64_t> point(0, 200);
+  std::uniform_int_distribution<int> op(0, 9);
+  IntervalMap<int> map;
+  FlatIntervalMap<int> flat_map;
+  for (int i = 0; i < 2000; ++i) {
+    uint64_t start = point(rng);
+    uint64_t limit = start + 1 + point(rng) % 40;
+    switch (op(rng)) {
+      case 0:
+        map.ClearInterval(start, limit);
+        flat_map.ClearInterval(start, limit);
+        break;
+      case 1:
+        if (i % 500 == 0) {
+          map.Clear();
+          flat_map.Clear();
+        }
+        break;
+      default:
+        map.Set(start, limit, i);
+        flat_map.Set(start, limit, i);
+    }
+    ASSERT_EQ(map.Size(), flat_map.Size()) << "after operation " << i;
+    for (uint64_t key = 0; key <= 250; ++key) {
+      int value = -1, flat_value = -1;
+      ASSERT_EQ(map.Lookup(key, &value), flat_map.Lookup(key, &flat_value))
+          << "key " << key << " after operation " << i;
+      ASSERT_EQ(value, flat_value) << "key " << key << " after operation " << i;
+
+      uint64_t next_start = 0, next_limit = 0;
+      uint64_t flat_next_start = 0, flat_next_limit = 0;
+      ASSERT_EQ(map.FindNext(key, &next_start, &next_limit, &value),
+                flat_map.FindNext(key, &flat_next_start, &flat_next_limit,
+                                  &flat_value))
+          << "key " << key << " after operation " << i;
+      ASSERT_EQ(next_start, flat_next_start);
+      ASSERT_EQ(next_limit, flat_next_limit);
+      ASSERT_EQ(value, flat_value);
+    }
+  }
+}
+
+// LayeredIntervalMap behaves like a single IntervalMap that both of its layers
+// are written to, and the bounds it looks up are those of the visible parts of
+// the intervals.
+TEST(LayeredIntervalMapTest, MatchesIntervalMap) {
+  std::mt19937_64 rng(12345);
+  std::uniform_int_distribution<uint64_t> point(0, 200);
+  std::uniform_int_distribution<int> op(0, 2);
+  IntervalMap<int> map;
+  LayeredIntervalMap<int> layered_map;
+  for (int i = 0; i < 2000; ++i) {
+    uint64_t start = point(rng);
+    uint64_t limit = start + 1 + point(rng) % 40;
+    map.Set(start, limit, i);
+    if (op(rng) == 0) {
+      layered_map.Set(start, limit, i);
+    } else {
+      layered_map.SetTop(start, limit, i);
+    }
+    for (uint64_t key = 0; key <= 250; ++key) {
+      int value = -1, layered_value = -1;
+      uint64_t want_start = 0, want_limit = 0;
+      uint64_t layered_start = 0, layered_limit = 0;
+      bool found = map.Lookup(key, &value);
+      ASSERT_EQ(found, layered_map.LookupInterval(key, &layered_start,
+                                                  &layered_limit,
+                                                  &layered_value))
+          << "key " << key << " after operation " << i;
+      if (!found) continue;
+      ASSERT_EQ(value, layered_value)
+          << "key " << key << " after operation " << i;
+      ASSERT_TRUE(map.LookupInterval(key, &want_start, &want_limit, &value));
+      // The intervals set on top are never merged, so the bounds are within
+      // those of the single map.
+      ASSERT_LE(want_start, layered_start);
+      ASSERT_LE(layered_start, key);
+      ASSERT_LT(key, layered_limit);
+      ASSERT_LE(layered_limit, want_limit);
+      for (uint64_t k = layered_start; k < layered_limit; ++k) {
+        ASSERT_TRUE(map.Lookup(k, &value));
+        ASSERT_EQ(layered_value, value) << "key " << k;
+      }
+    }
+  }
+}
+
+// PersistentIntervalMap behaves exactly like IntervalMap, and its copies keep
+// the versions they were copied from.
+TEST(PersistentIntervalMapTest, MatchesIntervalMap) {
+  std::mt19937_64 rng(12345);
+  std::uniform_int_distribution<uint64_t> point(0, 200);
+  std::uniform_int_distribution<int> op(0, 9);
+  IntervalMap<int> map;
+  PersistentIntervalMap<int> persistent_map;
+  std::vector<std::pair<IntervalMap<int>, PersistentIntervalMap<int>>>
+      versions;
+  auto expect_same = [](const IntervalMap<int>& map,
+                        const PersistentIntervalMap<int>& persistent_map) {
+    ASSERT_EQ(map.Size(), persistent_map.Size());
+    for (uint64_t key = 0; key <= 250; ++key) {
+      int value = -1, persistent_value = -1;
+      uint64_t start = 0, limit = 0;
+      uint64_t persistent_start = 0, persistent_limit = 0;
+      ASSERT_EQ(map.LookupInterval(key, &start, &limit, &value),
+                persistent_map.LookupInterval(key, &persistent_start,
+                                              &persistent_limit,
+                                              &persistent_value))
+          << "key " << key;
+      ASSERT_EQ(value, persistent_value) << "key " << key;
+      ASSERT_EQ(start, persistent_start) << "key " << key;
+      ASSERT_EQ(limit, persistent_limit) << "key " << key;
+      ASSERT_EQ(map.FindNext(key, &start, &limit, &value),
+                persistent_map.FindNext(key, &persistent_start,
+                                        &persistent_limit, &persistent_value))
+          << "key " << key;
+      ASSERT_EQ(start, persistent_start) << "key " << key;
+      ASSERT_EQ(limit, persistent_limit) << "key " << key;
+      ASSERT_EQ(value, persistent_value) << "key " << key;
+    }
+  };
+  for (int i = 0; i < 2000; ++i) {
+    uint64_t start = point(rng);
+    uint64_t limit = start + 1 + point(rng) % 40;
+    switch (op(rng)) {
+      case 0:
+        map.ClearInterval(start, limit);
+        persistent_map.ClearInterval(start, limit);
+        break;
+      case 1:
+        if (i % 500 == 0) {
+          map.Clear();
+          persistent_map.Clear();
+        }
+        break;
+      default:
+        map.Set(start, limit, i);
+        persistent_map.Set(start, limit, i);
+    }
+    if (i % 100 == 0) versions.emplace_back(map, persistent_map);
+    SCOPED_TRACE("after operation " + std::to_string(i));
+    expect_same(map, persistent_map);
+  }
+  for (const auto& version : versions) {
+    expect_same(version.first, version.second);
+  }
+}
+
+TEST(IntervalMapLookupTest, LookupIntervalFindsGaps) {
+  IntervalMap<int> map;
+  map.Set(10, 20, 1);
+  map.Set(30, 40, 2);
+  uint64_t start, limit;
+  int value = 0;
+  EXPECT_FALSE(map.LookupInterval(5, &start, &limit, &value));
+  EXPECT_EQ(0, start);
+  EXPECT_EQ(10, limit);
+  EXPECT_TRUE(map.LookupInterval(15, &start, &limit, &value));
+  EXPECT_EQ(10, start);
+  EXPECT_EQ(20, limit);
+  EXPECT_EQ(1, value);
+  EXPECT_FALSE(map.LookupInterval(20, &start, &limit, &value));
+  EXPECT_EQ(20, start);
+  EXPECT_EQ(30, limit);
+  EXPECT_FALSE(map.LookupInterval(45, &start, &limit, &value));
+  EXPECT_EQ(40, start);
+  EXPECT_EQ(UINT64_MAX, limit);
+}
+
 }  // namespace
 }  // namespace perftools
 
@@ -7,13 +7,21 @@
 
 #include "src/perf_data_converter.h"
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <deque>
 #include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -21,10 +29,17 @@
 #include "src/quipper/base/logging.h"
 #include "src/builder.h"
 #include "src/perf_data_handler.h"
+#include "src/profile_merger.h"
 #include "src/quipper/address_context.h"
+#include "src/quipper/event_reorderer.h"
+#include "src/quipper/kernel/perf_event.h"
+#include "src/quipper/kernel/perf_internals.h"
 #include "src/quipper/perf_data.pb.h"
 #include "src/quipper/perf_parser.h"
+#include "src/quipper/perf_protobuf_io.h"
 #include "src/quipper/perf_reader.h"
+#include "src/quipper/string_interner.h"
+#include "src/quipper/trace.h"
 
 namespace perftools {
 namespace {
@@ -58,11 +73,116 @@ const char* ExecModeString(quipper::AddressContext context) {
 // In order to successfully unmarshal the proto in Go, all strings inserted into
 // the profile string table must be valid UTF-8.
 int64_t UTF8StringId(const std::string& s, ProfileBuilder* builder) {
-  return builder->StringId(s.c_str());
+  return builder->StringId(std::string_view(s));
 }
 
-// List of profile location IDs, currently used to represent a call stack.
-typedef std::vector<uint64_t> LocationIdVector;
+// Mixes |value| into |hash|. Unlike a XOR of std::hash values, which are the
+// integers themselves, every bit of the result depends on every bit of both
+// inputs, and the result depends on the order in which values are mixed in.
+uint64_t HashCombine(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+// Final avalanche of a hash built with HashCombine(), so that its low bits
+// depend on all of the input.
+uint64_t FinalizeHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+// Picks about one in |rate| of the samples of each process. The choice only
+// depends on the seed, the process and the position of the sample among those
+// of the process, so it is the same on every run.
+class SampleSelector {
+ public:
+  SampleSelector(uint32_t rate, uint64_t seed) : rate_(rate), seed_(seed) {}
+
+  // Returns true if the next sample of |pid| is kept.
+  bool Keep(uint32_t pid) {
+    if (rate_ <= 1) return true;
+    uint64_t index = sample_counts_[pid]++;
+    uint64_t h = HashCombine(HashCombine(HashCombine(0, seed_), pid), index);
+    return FinalizeHash(h) % rate_ == 0;
+  }
+
+ private:
+  const uint32_t rate_;
+  const uint64_t seed_;
+  // The number of samples seen so far, by process.
+  std::unordered_map<uint32_t, uint64_t> sample_counts_;
+};
+
+// Interns the call stacks of a process. Stacks are paths from the root of a
+// trie of location IDs, going from the leaf frame to the outermost caller, so
+// that each distinct stack, and each distinct leaf-side part of a stack, is
+// stored once and is identified by a 32-bit ID. Stacks that share their leaf
+// frames, e.g. those of samples in the same function, share their nodes.
+class StackTable {
+ public:
+  typedef uint32_t StackId;
+  // The ID of the stack without any frames.
+  static constexpr StackId kEmptyStack = 0;
+
+  StackTable() { clear(); }
+
+  // Returns the ID of |stack| with |location_id| added as its outermost frame.
+  StackId AddCaller(StackId stack, uint64_t location_id) {
+    auto inserted = children_.emplace(Edge{stack, location_id},
+                                      static_cast<StackId>(nodes_.size()));
+    if (inserted.second) {
+      CHECK_LT(nodes_.size(), UINT32_MAX) << "Too many distinct stacks";
+      nodes_.push_back(Node{stack, nodes_[stack].depth + 1, location_id});
+    }
+    return inserted.first->second;
+  }
+
+  // Stores the location IDs of |stack|, leaf first, in |sample|.
+  void SetLocationIds(StackId stack,
+                      perftools::profiles::Sample* sample) const {
+    auto* location_ids = sample->mutable_location_id();
+    location_ids->Resize(nodes_[stack].depth, 0);
+    for (uint32_t i = nodes_[stack].depth; i > 0; --i) {
+      location_ids->Set(i - 1, nodes_[stack].location_id);
+      stack = nodes_[stack].parent;
+    }
+  }
+
+  void clear() {
+    nodes_.assign(1, Node{kEmptyStack, 0, 0});
+    children_.clear();
+  }
+
+ private:
+  struct Node {
+    // The stack without this node's frame.
+    StackId parent;
+    // The number of frames in the stack.
+    uint32_t depth;
+    uint64_t location_id;
+  };
+
+  // A node's parent and its location ID, which identify the node.
+  struct Edge {
+    StackId parent;
+    uint64_t location_id;
+
+    bool operator==(const Edge& rhs) const {
+      return parent == rhs.parent && location_id == rhs.location_id;
+    }
+  };
+
+  struct EdgeHasher {
+    size_t operator()(const Edge& e) const {
+      uint64_t h = HashCombine(HashCombine(0, e.parent), e.location_id);
+      return static_cast<size_t>(h ^ (h >> 29));
+    }
+  };
+
+  std::vector<Node> nodes_;
+  std::unordered_map<Edge, StackId, EdgeHasher> children_;
+};
 
 // It is sufficient to key the location and mapping maps by PID.
 // However, when Samples include labels, it is necessary to key their maps
@@ -91,7 +211,8 @@ struct SampleKey {
   uint64_t cache_latency = 0;
   uint64_t data_src = 0;
   uint64_t snoop_status = 0;
-  LocationIdVector stack;
+  // The ID of the sample's call stack in the StackTable of its process.
+  StackTable::StackId stack = StackTable::kEmptyStack;
   // Cycle count from the start of the sampled operation up to the point where
   // the operation has finished execution and is no longer capable of stalling
   // any instruction that consumes its output.
@@ -104,13 +225,138 @@ struct SampleKey {
   // Cycle count from a virtual address being passed to the MMU for translation,
   // to the result of the translation being available.
   uint32_t translation_latency = 0;
+  // The hash of all the above. Set by ComputeHash(), which must be called once
+  // the key is complete and before it is looked up in a SampleMap.
+  size_t hash = 0;
+
+  void ComputeHash();
+};
+
+void SampleKey::ComputeHash() {
+  uint64_t h = 0;
+  h = HashCombine(h, pid);
+  h = HashCombine(h, tid);
+  h = HashCombine(h, time_ns);
+  h = HashCombine(h, static_cast<uint64_t>(exec_mode));
+  h = HashCombine(h, comm);
+  h = HashCombine(h, thread_type);
+  h = HashCombine(h, thread_comm);
+  h = HashCombine(h, cgroup);
+  h = HashCombine(h, code_page_size);
+  h = HashCombine(h, data_page_size);
+  h = HashCombine(h, cpu);
+  h = HashCombine(h, cache_latency);
+  h = HashCombine(h, data_src);
+  h = HashCombine(h, snoop_status);
+  h = HashCombine(h, total_latency);
+  h = HashCombine(h, issue_latency);
+  h = HashCombine(h, translation_latency);
+  h = HashCombine(h, stack);
+  hash = static_cast<size_t>(FinalizeHash(h));
+}
+
+// The keys of the samples of the most common sets of labels, see
+// PerfDataConverter::SelectSampleKey(). They only hold what those labels tell
+// apart, which makes them a fraction of the size of a SampleKey, and cheaper
+// to hash and compare. The pid is left out, since the samples of each process
+// are in a map of their own.
+
+// For no labels, or only the pid label.
+struct StackSampleKey {
+  StackTable::StackId stack = StackTable::kEmptyStack;
+  size_t hash = 0;
+
+  void ComputeHash() {
+    hash = static_cast<size_t>(FinalizeHash(HashCombine(0, stack)));
+  }
+};
+
+// For kPidAndTidLabels.
+struct TidSampleKey {
+  Tid tid = 0;
+  StackTable::StackId stack = StackTable::kEmptyStack;
+  size_t hash = 0;
+
+  void ComputeHash() {
+    hash = static_cast<size_t>(
+        FinalizeHash(HashCombine(HashCombine(0, tid), stack)));
+  }
+};
+
+// For kPidAndTidLabels | kTimestampNsLabel.
+struct TimeSampleKey {
+  Tid tid = 0;
+  StackTable::StackId stack = StackTable::kEmptyStack;
+  uint64_t time_ns = 0;
+  size_t hash = 0;
+
+  void ComputeHash() {
+    uint64_t h = HashCombine(HashCombine(0, tid), time_ns);
+    hash = static_cast<size_t>(FinalizeHash(HashCombine(h, stack)));
+  }
+};
+
+// For kCommLabel | kThreadCommLabel.
+struct CommSampleKey {
+  uint64_t comm = 0;
+  uint64_t thread_comm = 0;
+  StackTable::StackId stack = StackTable::kEmptyStack;
+  size_t hash = 0;
+
+  void ComputeHash() {
+    uint64_t h = HashCombine(HashCombine(0, comm), thread_comm);
+    hash = static_cast<size_t>(FinalizeHash(HashCombine(h, stack)));
+  }
 };
 
+// Returns the SampleKey with the same fields as |key|, from which the labels
+// of a new sample are added.
+const SampleKey& FullSampleKey(const SampleKey& key) { return key; }
+SampleKey FullSampleKey(const StackSampleKey& key) {
+  SampleKey full;
+  full.stack = key.stack;
+  return full;
+}
+SampleKey FullSampleKey(const TidSampleKey& key) {
+  SampleKey full;
+  full.tid = key.tid;
+  full.stack = key.stack;
+  return full;
+}
+SampleKey FullSampleKey(const TimeSampleKey& key) {
+  SampleKey full;
+  full.tid = key.tid;
+  full.time_ns = key.time_ns;
+  full.stack = key.stack;
+  return full;
+}
+SampleKey FullSampleKey(const CommSampleKey& key) {
+  SampleKey full;
+  full.comm = key.comm;
+  full.thread_comm = key.thread_comm;
+  full.stack = key.stack;
+  return full;
+}
+
 struct SampleKeyEqualityTester {
-  bool operator()(const SampleKey a, const SampleKey b) const {
-    return ((a.pid == b.pid) && (a.tid == b.tid) && (a.time_ns == b.time_ns) &&
-            (a.exec_mode == b.exec_mode) && (a.comm == b.comm) &&
-            (a.thread_type == b.thread_type) &&
+  bool operator()(const StackSampleKey& a, const StackSampleKey& b) const {
+    return a.stack == b.stack;
+  }
+  bool operator()(const TidSampleKey& a, const TidSampleKey& b) const {
+    return a.hash == b.hash && a.tid == b.tid && a.stack == b.stack;
+  }
+  bool operator()(const TimeSampleKey& a, const TimeSampleKey& b) const {
+    return a.hash == b.hash && a.tid == b.tid && a.time_ns == b.time_ns &&
+           a.stack == b.stack;
+  }
+  bool operator()(const CommSampleKey& a, const CommSampleKey& b) const {
+    return a.hash == b.hash && a.comm == b.comm &&
+           a.thread_comm == b.thread_comm && a.stack == b.stack;
+  }
+  bool operator()(const SampleKey& a, const SampleKey& b) const {
+    return ((a.hash == b.hash) && (a.pid == b.pid) && (a.tid == b.tid) &&
+            (a.time_ns == b.time_ns) && (a.exec_mode == b.exec_mode) &&
+            (a.comm == b.comm) && (a.thread_type == b.thread_type) &&
             (a.thread_comm == b.thread_comm) && (a.cgroup == b.cgroup) &&
             (a.code_page_size == b.code_page_size) &&
             (a.data_page_size == b.data_page_size) && (a.cpu == b.cpu) &&
@@ -123,29 +369,9 @@ struct SampleKeyEqualityTester {
 };
 
 struct SampleKeyHasher {
-  size_t operator()(const SampleKey k) const {
-    size_t hash = 0;
-    hash ^= std::hash<int32_t>()(k.pid);
-    hash ^= std::hash<int32_t>()(k.tid);
-    hash ^= std::hash<uint64_t>()(k.time_ns);
-    hash ^= std::hash<int>()(static_cast<int>(k.exec_mode));
-    hash ^= std::hash<uint64_t>()(k.comm);
-    hash ^= std::hash<uint64_t>()(k.thread_type);
-    hash ^= std::hash<uint64_t>()(k.thread_comm);
-    hash ^= std::hash<uint64_t>()(k.cgroup);
-    hash ^= std::hash<uint64_t>()(k.code_page_size);
-    hash ^= std::hash<uint64_t>()(k.data_page_size);
-    hash ^= std::hash<uint32_t>()(k.cpu);
-    hash ^= std::hash<uint64_t>()(k.cache_latency);
-    hash ^= std::hash<uint64_t>()(k.data_src);
-    hash ^= std::hash<uint64_t>()(k.snoop_status);
-    for (const auto& id : k.stack) {
-      hash ^= std::hash<uint64_t>()(id);
-    }
-    hash ^= std::hash<uint32_t>()(k.total_latency);
-    hash ^= std::hash<uint32_t>()(k.issue_latency);
-    hash ^= std::hash<uint32_t>()(k.translation_latency);
-    return hash;
+  template <typename Key>
+  size_t operator()(const Key& k) const {
+    return k.hash;
   }
 };
 
@@ -155,15 +381,31 @@ struct SampleKeyHasher {
 // that are identical except for TID.  Likewise, if the requested sample
 // labels include timestamp_ns, then we'll need to have separate
 // profile_proto::Samples for samples that are identical except for timestamp.
-typedef std::unordered_map<SampleKey, perftools::profiles::Sample*,
-                           SampleKeyHasher, SampleKeyEqualityTester>
-    SampleMap;
+template <typename Key>
+using SampleMap = std::unordered_map<Key, perftools::profiles::Sample*,
+                                     SampleKeyHasher, SampleKeyEqualityTester>;
+
+// A profile location, and the mapping that its address was in when it was
+// created.
+struct LocationMapEntry {
+  uint64_t location_id;
+  const PerfDataHandler::Mapping* mapping;
+};
 
-// Map from a virtual address to a profile location ID. It only keys off the
-// address, not also the mapping ID since the map / its portions are invalidated
-// by Comm() and MMap() methods to force re-creation of those locations.
-//
-typedef std::map<uint64_t, uint64_t> LocationMap;
+// Map from a virtual address to a profile location. Each mmap event creates a
+// new mapping, which makes the locations of the addresses it covers stale, so
+// an entry is only used while the address is still in the same mapping. This
+// makes invalidating a range free, instead of requiring an ordered map. The
+// map is cleared by Comm() when the process calls exec().
+typedef std::unordered_map<uint64_t, LocationMapEntry> LocationMap;
+
+// A callchain frame of a sample, and the ID of its location, or 0 if the frame
+// has no location in the profile.
+struct CallchainFrame {
+  uint64_t ip;
+  const PerfDataHandler::Mapping* mapping;
+  uint64_t location_id;
+};
 
 // Map from the handler mapping object to profile mapping ID. The mappings
 // the handler creates are immutable and reasonably shared (as in no new mapping
@@ -171,12 +413,86 @@ typedef std::map<uint64_t, uint64_t> LocationMap;
 typedef std::unordered_map<const PerfDataHandler::Mapping*, uint64_t>
     MappingMap;
 
+// The string table indices of the build ID and filename of a DSO in a profile.
+// A build ID of 0 stands for a missing one.
+struct DsoStrings {
+  int64_t build_id;
+  int64_t filename;
+};
+
+// Map from the interned handler DSO to its strings in a profile, so that the
+// strings of a DSO mapped into many processes are only looked up once.
+typedef std::unordered_map<const PerfDataHandler::Dso*, DsoStrings> DsoMap;
+
+// Returns what identifies the code of |mapping| in every process that maps
+// it: its DSO if it is a file or has a build ID, and else the mapping itself,
+// which forked processes share, since the other DSOs, such as anonymous
+// memory, hold different code in each process.
+const void* SharedCodeIdentity(const PerfDataHandler::Mapping* mapping) {
+  const std::string& filename = mapping->filename();
+  const bool is_file = (filename.size() > 1 && filename[0] == '/' &&
+                        filename[1] != '/' &&
+                        filename.compare(0, 7, "/memfd:") != 0) ||
+                       mapping->filename_md5_prefix() != 0;
+  if (is_file || !mapping->build_id().value.empty()) return mapping->dso;
+  return mapping;
+}
+
+// What the code that processes map has in common across them: a location is
+// keyed by the SharedCodeIdentity() of its mapping and the file offset of its
+// address, with start and limit left 0, and a mapping by its identity, its
+// extent and the file offset it starts at.
+struct SharedCodeKey {
+  const void* code;
+  uint64_t start;
+  uint64_t limit;
+  uint64_t file_offset;
+
+  bool operator==(const SharedCodeKey& rhs) const {
+    return code == rhs.code && start == rhs.start && limit == rhs.limit &&
+           file_offset == rhs.file_offset;
+  }
+};
+
+struct SharedCodeKeyHasher {
+  size_t operator()(const SharedCodeKey& k) const {
+    uint64_t h = HashCombine(0, reinterpret_cast<uintptr_t>(k.code));
+    h = HashCombine(HashCombine(HashCombine(h, k.start), k.limit),
+                    k.file_offset);
+    return static_cast<size_t>(FinalizeHash(h));
+  }
+};
+
+// The locations and mappings of a profile that the samples of several
+// processes go to, by SharedCodeKey, so that the code of a library or of the
+// kernel that they all run only gets one location per address and one
+// mapping. Each location keeps the address and mapping of the first process
+// that added it, which symbolize to the same code as those of the others.
+struct SharedCode {
+  std::unordered_map<SharedCodeKey, uint64_t, SharedCodeKeyHasher>
+      location_ids;
+  std::unordered_map<SharedCodeKey, uint64_t, SharedCodeKeyHasher> mapping_ids;
+};
+
+// The number of frames of each BuildIdSource, by source. Bumping a counter is
+// all that the frames of a sample cost; they are only turned into a
+// BuildIdStats when the profile is made.
+typedef std::array<int64_t, kBuildIdNoMmap + 1> BuildIdCounts;
+
+// Counts a frame in |mapping|, or in no mapping if it is null, in |counts|.
+void CountBuildIdSource(const PerfDataHandler::Mapping* mapping,
+                        BuildIdCounts* counts) {
+  ++(*counts)[mapping != nullptr ? mapping->build_id().source
+                                 : kBuildIdNoMmap];
+}
+
 // Per-process (aggregated when no PID grouping requested) info.
 // See docs on ProcessProfile in the header file for details on the fields.
 class ProcessMeta {
  public:
   // Constructs the object for the specified PID.
-  explicit ProcessMeta(Pid pid) : pid_(pid) {}
+  explicit ProcessMeta(Pid pid, std::string cgroup = "")
+      : pid_(pid), cgroup_(std::move(cgroup)) {}
 
   // Updates the bounding time interval ranges per specified timestamp.
   void UpdateTimestamps(int64_t time_nsec) {
@@ -188,68 +504,300 @@ class ProcessMeta {
     }
   }
 
+  // Returns the profile of the process, with |data| and, if not null, the
+  // build ID sources counted in |build_id_counts|.
   std::unique_ptr<ProcessProfile> MakeProcessProfile(
-      Profile* data, const std::unordered_map<Pid, BuildIdStats>& stats) {
+      Profile* data, const BuildIdCounts* build_id_counts) {
     ProcessProfile* pp = new ProcessProfile();
     pp->pid = pid_;
+    pp->cgroup = cgroup_;
     pp->data.Swap(data);
     pp->min_sample_time_ns = min_sample_time_ns_;
     pp->max_sample_time_ns = max_sample_time_ns_;
-    if (stats.find(pid_) != stats.end()) {
-      pp->build_id_stats = stats.at(pid_);
+    if (build_id_counts != nullptr) {
+      for (size_t i = 0; i < build_id_counts->size(); ++i) {
+        if ((*build_id_counts)[i] != 0) {
+          pp->build_id_stats[static_cast<BuildIdSource>(i)] =
+              (*build_id_counts)[i];
+        }
+      }
     }
     return std::unique_ptr<ProcessProfile>(pp);
   }
 
+  Pid pid() const { return pid_; }
+
  private:
   Pid pid_;
+  std::string cgroup_;
   int64_t min_sample_time_ns_ = 0;
   int64_t max_sample_time_ns_ = 0;
 };
 
+// The string table indices of the sample label keys and units of a profile.
+// They are interned the first time they are used, as they would be by calling
+// StringId() for every label, but only looked up once.
+class LabelStrings {
+ public:
+  enum Index {
+    kPidKey,
+    kTidKey,
+    kCommKey,
+    kTimestampNsKey,
+    kExecutionModeKey,
+    kThreadTypeKey,
+    kThreadCommKey,
+    kCgroupKey,
+    kCodePageSizeKey,
+    kDataPageSizeKey,
+    kCpuKey,
+    kCacheLatencyKey,
+    kDataSrcKey,
+    kSnoopStatusKey,
+    kTotalLatencyKey,
+    kIssueLatencyKey,
+    kTranslationLatencyKey,
+    kEventKey,
+    kCpuUnit,
+    kCyclesUnit,
+    kNumStrings,
+  };
+
+  explicit LabelStrings(ProfileBuilder* builder) : builder_(builder) {
+    std::fill(ids_, ids_ + kNumStrings, -1);
+  }
+
+  int64_t Id(Index index) {
+    if (ids_[index] < 0) {
+      ids_[index] = builder_->StringId(kStrings[index]);
+    }
+    return ids_[index];
+  }
+
+  // Returns the string ID of the cgroup path |cgroup|. The normalizer interns
+  // the paths, so they are looked up by address.
+  int64_t CgroupId(const std::string* cgroup) {
+    auto inserted = cgroup_ids_.emplace(cgroup, 0);
+    if (inserted.second) {
+      inserted.first->second = UTF8StringId(*cgroup, builder_);
+    }
+    return inserted.first->second;
+  }
+
+  // With kEventLabels, adds the name of the next event of the profile, by
+  // file attrs index, whose ID EventNameId() returns.
+  void AddEventName(const std::string& name) {
+    event_name_ids_.push_back(UTF8StringId(name, builder_));
+  }
+  int64_t EventNameId(int64_t event_index) const {
+    return event_name_ids_[event_index];
+  }
+
+ private:
+  static const char* const kStrings[kNumStrings];
+
+  ProfileBuilder* builder_;
+  int64_t ids_[kNumStrings];
+  std::unordered_map<const std::string*, int64_t> cgroup_ids_;
+  std::vector<int64_t> event_name_ids_;
+};
+
+const char* const LabelStrings::kStrings[kNumStrings] = {
+    PidLabelKey,
+    TidLabelKey,
+    CommLabelKey,
+    TimestampNsLabelKey,
+    ExecutionModeLabelKey,
+    ThreadTypeLabelKey,
+    ThreadCommLabelKey,
+    CgroupLabelKey,
+    CodePageSizeLabelKey,
+    DataPageSizeLabelKey,
+    CpuLabelKey,
+    CacheLatencyLabelKey,
+    DataSrcLabelKey,
+    SnoopStatusLabelKey,
+    TotalLatencyLabelKey,
+    IssueLatencyLabelKey,
+    TranslationLatencyLabelKey,
+    EventLabelKey,
+    "cpu",
+    "cycles",
+};
+
 class PerfDataConverter : public PerfDataHandler {
  public:
   explicit PerfDataConverter(
       const quipper::PerfDataProto& perf_data,
       uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
-      const std::map<Tid, std::string>& thread_types = {})
-      : perf_data_(perf_data),
+      const std::map<Tid, std::string>& thread_types = {},
+      uint64_t timestamp_bucket_ns = 0, uint32_t downsample_rate = 1,
+      uint64_t downsample_seed = 0)
+      : perf_data_(&perf_data),
         sample_labels_(sample_labels),
-        options_(options) {
+        options_((options & kGroupByCgroup) ? options & ~kGroupByPids
+                                            : options),
+        data_address_bucket_bytes_((options & kDataAddressPages)
+                                       ? kDataAddressPageBytes
+                                   : (options & kDataAddressCacheLines)
+                                       ? kDataAddressCacheLineBytes
+                                       : 0),
+        timestamp_bucket_ns_(timestamp_bucket_ns),
+        downsample_rate_(downsample_rate > 1 ? downsample_rate : 1),
+        sample_selector_(downsample_rate, downsample_seed) {
     for (auto& it : thread_types) {
       thread_types_.insert(std::make_pair(it.first, it.second));
     }
+    SelectSampleKey();
   }
   PerfDataConverter(const PerfDataConverter&) = delete;
   PerfDataConverter& operator=(const PerfDataConverter&) = delete;
   virtual ~PerfDataConverter() {}
 
-  ProcessProfiles Profiles();
+  // Finalizes the profiles, and marshals them if requested, on up to
+  // |num_threads| threads, or as many tasks on |executor| if it isn't null.
+  ProcessProfiles Profiles(int num_threads = 1,
+                           ConversionExecutor* executor = nullptr);
+
+  // Returns whether Sample() would take any action for |sample|. It only looks
+  // at the sample, so it may be called from any thread.
+  bool AcceptsSample(const PerfDataHandler::SampleContext& sample) const;
+
+  // Reserves the profiles for |capacities|, which must outlive the
+  // conversion, when they are created.
+  void SetCapacities(const ProfileCapacities* capacities) {
+    capacities_ = capacities;
+  }
+
+  // Sets the position of the following samples among all the samples handled.
+  // Converters that are each given a part of the samples use it to put their
+  // profiles in the order a single converter would have created them in.
+  void SetSampleOrder(uint64_t order) { sample_order_ = order; }
+
+  // Returns the sample order set when each of the Profiles() was created.
+  const std::deque<uint64_t>& profile_orders() const { return profile_orders_; }
+
+  // Starts new profiles, after Profiles(), for the next part of the same
+  // recording, whose file attrs and metadata are in |perf_data|. The comms of
+  // the threads are kept. The locations and mappings of the profiles are not,
+  // since their IDs are only meaningful within the profiles they were added
+  // to.
+  void StartChunk(const quipper::PerfDataProto& perf_data);
+
+  // With kGroupByPids, hands over the profiles of the processes that exit or
+  // exec to |callback|, and, with max_profile_bytes > 0, the largest profiles
+  // when those being built take more than about max_profile_bytes. Profiles()
+  // leaves out the profiles handed over.
+  void SetProfileCallback(ProfileCallback callback,
+                          uint64_t max_profile_bytes) {
+    profile_callback_ = std::move(callback);
+    max_profile_bytes_ = max_profile_bytes;
+  }
 
   // Callbacks for PerfDataHandler
+  bool KeepSample(const PerfDataHandler::SampleContext& sample) override {
+    return sample_selector_.Keep(sample.sample.pid());
+  }
+  bool NeedsStacks() const override { return !(options_ & kLeafOnly); }
   bool Sample(const PerfDataHandler::SampleContext& sample) override;
+  void SampleBatch(const PerfDataHandler::SampleContext* samples,
+                   size_t num_samples) override {
+    for (size_t i = 0; i < num_samples; ++i) {
+      PerfDataConverter::Sample(samples[i]);
+    }
+  }
   void Comm(const CommContext& comm) override;
   void MMap(const MMapContext& mmap) override;
+  // Exits only hand over profiles to the profile callback.
+  bool WantsExits() const override {
+    return profile_callback_ && (options_ & kGroupByPids);
+  }
+  void Exit(const quipper::PerfDataProto::ForkEvent& exit) override;
 
  private:
+  // The state of a process, see per_pid_.
+  struct PerPidInfo;
+
+  // Finalizes the profile of builders_[i], and marshals it if requested.
+  std::unique_ptr<ProcessProfile> FinishProfile(size_t i);
+
+  // Hands the profile of |pid| being built, if any, to the profile callback,
+  // and forgets it.
+  void EmitProfile(Pid pid);
+
+  // Counts |bytes| more of memory used by the profile of the process.
+  void AddProfileBytes(PerPidInfo* per_pid, uint64_t bytes) {
+    per_pid->profile_bytes += bytes;
+    profile_bytes_ += bytes;
+  }
+
+  // Emits the largest profiles if those being built take more than
+  // max_profile_bytes_. Only called between samples, since it releases the
+  // builders.
+  void EnforceProfileBudget();
+
+  // Sets add_sample_ to the AddSample() of the smallest key that tells apart
+  // the samples whose labels differ, so that the labels requested are only
+  // looked at once, rather than for each sample.
+  void SelectSampleKey();
+  template <typename Key>
+  void SelectSampleKey() {
+    add_sample_ = &PerfDataConverter::AddSample<Key>;
+    reserve_samples_ = &PerfDataConverter::ReserveSamples<Key>;
+  }
+
+  // Reserves the profile of the new builder of |per_pid|, and with
+  // kGroupByPids the caches of the process, for the capacity of |pid|.
+  void ReserveCapacity(Pid pid, PerPidInfo* per_pid);
+  template <typename Key>
+  void ReserveSamples(PerPidInfo* per_pid, size_t num_samples) {
+    std::get<SampleMap<Key>>(per_pid->sample_maps).reserve(num_samples);
+  }
+
+  // Adds |sample| to the profile of its process, keyed by a Key, which is
+  // either a SampleKey or one of the keys of the common label sets.
+  template <typename Key>
+  void AddSample(const PerfDataHandler::SampleContext& sample);
+
+  // Returns the call stack of |sample| in the StackTable of its process,
+  // |per_pid|, adding its locations to the profile.
+  StackTable::StackId SampleStack(const PerfDataHandler::SampleContext& sample,
+                                  PerPidInfo* per_pid,
+                                  ProfileBuilder* builder);
+
   // Adds a new sample updating the event counters if such sample is not present
   // in the profile initializing its metrics. Updates the metrics associated
   // with the sample if the sample was added before.
+  template <typename Key>
   void AddOrUpdateSample(const PerfDataHandler::SampleContext& context,
-                         const Pid& pid, const SampleKey& sample_key,
-                         ProfileBuilder* builder);
+                         PerPidInfo* per_pid, const Key& sample_key,
+                         ProfileBuilder* builder, LabelStrings* label_strings);
+
+  // Adds the requested labels of a new sample, whose key is |sample_key|.
+  void AddSampleLabels(const PerfDataHandler::SampleContext& context,
+                       const SampleKey& sample_key, ProfileBuilder* builder,
+                       LabelStrings* label_strings,
+                       perftools::profiles::Sample* sample);
 
   // Adds a new location to the profile if such location is not present in the
   // profile, returning the ID of the location. It also adds the profile mapping
-  // corresponding to the specified handler mapping.
-  uint64_t AddOrGetLocation(const Pid& pid, uint64_t addr,
+  // corresponding to the specified handler mapping. The locations are cached
+  // in |per_pid|, the state of the process whose address |addr| is.
+  uint64_t AddOrGetLocation(PerPidInfo* per_pid, uint64_t addr,
                             const PerfDataHandler::Mapping* mapping,
                             ProfileBuilder* builder);
 
+  // Returns the ID of the location of the return address |frame| of a
+  // callchain, or 0 if the frame is skipped.
+  uint64_t CallchainLocationId(PerPidInfo* per_pid,
+                               const PerfDataHandler::Location& frame,
+                               ProfileBuilder* builder);
+
   // Adds a new mapping to the profile if such mapping is not present in the
   // profile, returning the ID of the mapping. It returns 0 to indicate that the
   // mapping was not added (only happens if smap == 0 currently).
-  uint64_t AddOrGetMapping(const Pid& pid, const PerfDataHandler::Mapping* smap,
+  uint64_t AddOrGetMapping(PerPidInfo* per_pid,
+                           const PerfDataHandler::Mapping* smap,
                            ProfileBuilder* builder);
 
   // Returns whether pid labels were requested for inclusion in the
@@ -324,40 +872,149 @@ class PerfDataConverter : public PerfDataHandler {
     return (sample_labels_ & kTranslationLatencyLabel);
   }
 
-  SampleKey MakeSampleKey(const PerfDataHandler::SampleContext& sample,
-                          ProfileBuilder* builder);
+  // Returns the key of |sample|, without its stack, which is set afterwards.
+  template <typename Key>
+  Key MakeSampleKey(const PerfDataHandler::SampleContext& sample,
+                    PerPidInfo* per_pid, ProfileBuilder* builder,
+                    LabelStrings* label_strings);
 
+  // Returns the builder of the profile that |sample| goes to, and stores the
+  // label strings of the profile in |label_strings|.
   ProfileBuilder* GetOrCreateBuilder(
-      const PerfDataHandler::SampleContext& sample);
+      const PerfDataHandler::SampleContext& sample,
+      LabelStrings** label_strings);
 
-  const quipper::PerfDataProto& perf_data_;
+  const quipper::PerfDataProto* perf_data_;  // unowned.
   // Using deque so that appends do not invalidate existing pointers.
   std::deque<ProfileBuilder> builders_;
   std::deque<ProcessMeta> process_metas_;
+  std::deque<LabelStrings> label_strings_;
+  std::unordered_map<const ProfileBuilder*, DsoMap> dso_maps_;
+  // Without kGroupByPids, the code that the processes of each profile share.
+  std::unordered_map<const ProfileBuilder*, SharedCode> shared_code_;
+  std::deque<uint64_t> profile_orders_;
+  uint64_t sample_order_ = 0;
+  // Whether each of the builders_ was handed to the profile callback.
+  std::vector<bool> emitted_;
+
+  ProfileCallback profile_callback_;
+  uint64_t max_profile_bytes_ = 0;
+  // The estimated memory used by the profiles being built.
+  uint64_t profile_bytes_ = 0;
 
   struct PerPidInfo {
     ProfileBuilder* builder = nullptr;
+    // The index of |builder| in builders_.
+    size_t profile_index = 0;
+    // The estimated memory used by the profile and the maps below.
+    uint64_t profile_bytes = 0;
     ProcessMeta* process_meta = nullptr;
+    LabelStrings* label_strings = nullptr;
+    // The DSO of the last main mapping of a sample found to have the filename
+    // of the profile's main mapping.
+    const PerfDataHandler::Dso* main_dso = nullptr;
     LocationMap location_map;
     MappingMap mapping_map;
-    std::unordered_map<Tid, std::string> tid_to_comm_map;
-    SampleMap sample_map;
-    void clear() {
-      builder = nullptr;
-      process_meta = nullptr;
+    // The commands of the threads, interned in comms_.
+    std::unordered_map<Tid, const std::string*> tid_to_comm_map;
+    // Returns the command of |tid|, or an empty one if it is not known.
+    const std::string& Comm(Tid tid) const {
+      static const std::string* const kNoComm = new std::string();
+      const auto it = tid_to_comm_map.find(tid);
+      return *(it != tid_to_comm_map.end() ? it->second : kNoComm);
+    }
+    // The samples of the profile by their key. Only the map of the key that
+    // the converter selected is used.
+    using SampleMaps =
+        std::tuple<SampleMap<SampleKey>, SampleMap<StackSampleKey>,
+                   SampleMap<TidSampleKey>, SampleMap<TimeSampleKey>,
+                   SampleMap<CommSampleKey>>;
+    SampleMaps sample_maps;
+    // With kEventLabels, the samples of each event instead, by file attrs
+    // index.
+    std::vector<SampleMaps> event_sample_maps;
+    StackTable stack_table;
+    // The callchain frames of the last sample of each thread. The frames on
+    // the root side of a thread's stack rarely change from one sample to the
+    // next, so their locations are taken from here instead of being looked up
+    // again.
+    std::unordered_map<Tid, std::vector<CallchainFrame>> last_callchains;
+    // The build ID sources of the frames of the samples of the process, which
+    // go to the profile whose pid is that of the process.
+    BuildIdCounts build_id_counts{};
+    // With kGroupByCgroup, the builder that the maps above refer to.
+    const ProfileBuilder* caches_builder = nullptr;
+    // Forgets the locations, mappings and samples of the process.
+    void ClearCaches() {
       location_map.clear();
       mapping_map.clear();
+      std::apply([](auto&... maps) { (maps.clear(), ...); }, sample_maps);
+      event_sample_maps.clear();
+      stack_table.clear();
+      last_callchains.clear();
+      caches_builder = nullptr;
+    }
+    // Forgets the profile of the process, but not its comms.
+    void ClearProfile() {
+      builder = nullptr;
+      profile_bytes = 0;
+      process_meta = nullptr;
+      label_strings = nullptr;
+      main_dso = nullptr;
+      ClearCaches();
+      build_id_counts.fill(0);
+    }
+    void clear() {
+      ClearProfile();
       tid_to_comm_map.clear();
-      sample_map.clear();
     }
   };
   std::unordered_map<Pid, PerPidInfo> per_pid_;
+  // With kGroupByCgroup, the profiles by the cgroup path of their samples,
+  // null for those without a cgroup. Only the builder fields are used, the
+  // caches stay in per_pid_.
+  std::unordered_map<const std::string*, PerPidInfo> per_cgroup_;
+  // The frames of the callchain being converted, swapped with those of the
+  // last one of the thread to reuse the storage of both.
+  std::vector<CallchainFrame> callchain_frames_;
 
   const uint32_t sample_labels_;
   const uint32_t options_;
+  // The size of the buckets that data addresses are put in, or 0.
+  const uint64_t data_address_bucket_bytes_;
+  // The width of the buckets that sample timestamps are put in, or 0.
+  const uint64_t timestamp_bucket_ns_;
+  // The values of each kept sample are multiplied by this, see KeepSample().
+  const uint32_t downsample_rate_;
+  SampleSelector sample_selector_;
   std::unordered_map<Tid, std::string> thread_types_;
+  // The distinct commands of the threads, which many threads share.
+  quipper::StringInterner comms_;
+  // The AddSample() and ReserveSamples() of the key selected by
+  // SelectSampleKey().
+  void (PerfDataConverter::*add_sample_)(
+      const PerfDataHandler::SampleContext& sample) = nullptr;
+  void (PerfDataConverter::*reserve_samples_)(PerPidInfo* per_pid,
+                                              size_t num_samples) = nullptr;
+  // See SetCapacities().
+  const ProfileCapacities* capacities_ = nullptr;
 };
 
+// Returns the address of the start of the bucket of |bucket_bytes| of data
+// address |addr| of |mapping|. The buckets are aligned in the file offsets of
+// the mapping, so that the same data is in the same bucket wherever it is
+// mapped, and the first starts at the start of the mapping.
+uint64_t DataAddressBucket(uint64_t addr,
+                           const PerfDataHandler::Mapping& mapping,
+                           uint64_t bucket_bytes) {
+  const uint64_t offset = addr - mapping.start + mapping.file_offset;
+  const uint64_t bucket_offset = offset - offset % bucket_bytes;
+  if (bucket_offset < mapping.file_offset) {
+    return mapping.start;
+  }
+  return bucket_offset - mapping.file_offset + mapping.start;
+}
+
 // Test the bit and return the data_src string for sample key.
 std::string DataSrcString(uint64_t mem_lvl) {
   if (!(mem_lvl & quipper::PERF_MEM_LVL_HIT)) return "";
@@ -387,8 +1044,55 @@ std::string SnoopStatusString(uint64_t mem_snoop) {
   return "Unknown Status";
 }
 
-SampleKey PerfDataConverter::MakeSampleKey(
-    const PerfDataHandler::SampleContext& sample, ProfileBuilder* builder) {
+template <>
+StackSampleKey PerfDataConverter::MakeSampleKey<StackSampleKey>(
+    const PerfDataHandler::SampleContext& sample, PerPidInfo* per_pid,
+    ProfileBuilder* builder, LabelStrings* label_strings) {
+  return StackSampleKey();
+}
+
+template <>
+TidSampleKey PerfDataConverter::MakeSampleKey<TidSampleKey>(
+    const PerfDataHandler::SampleContext& sample, PerPidInfo* per_pid,
+    ProfileBuilder* builder, LabelStrings* label_strings) {
+  TidSampleKey sample_key;
+  sample_key.tid = sample.sample.has_tid() ? sample.sample.tid() : 0;
+  return sample_key;
+}
+
+template <>
+TimeSampleKey PerfDataConverter::MakeSampleKey<TimeSampleKey>(
+    const PerfDataHandler::SampleContext& sample, PerPidInfo* per_pid,
+    ProfileBuilder* builder, LabelStrings* label_strings) {
+  TimeSampleKey sample_key;
+  sample_key.tid = sample.sample.has_tid() ? sample.sample.tid() : 0;
+  sample_key.time_ns = sample.sample.has_sample_time_ns()
+                           ? sample.sample.sample_time_ns()
+                           : 0;
+  if (timestamp_bucket_ns_ != 0) {
+    sample_key.time_ns -= sample_key.time_ns % timestamp_bucket_ns_;
+  }
+  return sample_key;
+}
+
+template <>
+CommSampleKey PerfDataConverter::MakeSampleKey<CommSampleKey>(
+    const PerfDataHandler::SampleContext& sample, PerPidInfo* per_pid,
+    ProfileBuilder* builder, LabelStrings* label_strings) {
+  CommSampleKey sample_key;
+  if (!sample.sample.has_pid()) return sample_key;
+  sample_key.comm = UTF8StringId(per_pid->Comm(sample.sample.pid()), builder);
+  if (sample.sample.has_tid()) {
+    sample_key.thread_comm =
+        UTF8StringId(per_pid->Comm(sample.sample.tid()), builder);
+  }
+  return sample_key;
+}
+
+template <>
+SampleKey PerfDataConverter::MakeSampleKey<SampleKey>(
+    const PerfDataHandler::SampleContext& sample, PerPidInfo* per_pid,
+    ProfileBuilder* builder, LabelStrings* label_strings) {
   SampleKey sample_key;
   sample_key.pid = sample.sample.has_pid() ? sample.sample.pid() : 0;
   sample_key.tid =
@@ -397,13 +1101,15 @@ SampleKey PerfDataConverter::MakeSampleKey(
       (IncludeTimestampNsLabels() && sample.sample.has_sample_time_ns())
           ? sample.sample.sample_time_ns()
           : 0;
+  if (timestamp_bucket_ns_ != 0) {
+    sample_key.time_ns -= sample_key.time_ns % timestamp_bucket_ns_;
+  }
   if (IncludeExecutionModeLabels()) {
     sample_key.exec_mode = quipper::ContextFromHeader(sample.header);
   }
   if (IncludeCommLabels() && sample.sample.has_pid()) {
     Pid pid = sample.sample.pid();
-    std::string comm = per_pid_[pid].tid_to_comm_map[pid];
-    sample_key.comm = UTF8StringId(comm, builder);
+    sample_key.comm = UTF8StringId(per_pid->Comm(pid), builder);
   }
   if (IncludeThreadTypeLabels() && sample.sample.has_tid()) {
     Tid tid = sample.sample.tid();
@@ -414,13 +1120,11 @@ SampleKey PerfDataConverter::MakeSampleKey(
   }
   if (IncludeThreadCommLabels() && sample.sample.has_pid() &&
       sample.sample.has_tid()) {
-    Pid pid = sample.sample.pid();
     Tid tid = sample.sample.tid();
-    const std::string& comm = per_pid_[pid].tid_to_comm_map[tid];
-    sample_key.thread_comm = UTF8StringId(comm, builder);
+    sample_key.thread_comm = UTF8StringId(per_pid->Comm(tid), builder);
   }
   if (IncludeCgroupLabels() && sample.cgroup) {
-    sample_key.cgroup = UTF8StringId(*sample.cgroup, builder);
+    sample_key.cgroup = label_strings->CgroupId(sample.cgroup);
   }
   if (IncludeCodePageSizeLabels() && sample.sample.has_code_page_size()) {
     sample_key.code_page_size = sample.sample.code_page_size();
@@ -484,30 +1188,40 @@ SampleKey PerfDataConverter::MakeSampleKey(
 }
 
 ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
-    const PerfDataHandler::SampleContext& sample) {
+    const PerfDataHandler::SampleContext& sample,
+    LabelStrings** label_strings) {
   Pid builder_pid = (options_ & kGroupByPids) ? sample.sample.pid() : 0;
   VLOG(2) << "Processing sample for PID=" << sample.sample.pid();
-  auto& per_pid = per_pid_[builder_pid];
+  auto& per_pid = (options_ & kGroupByCgroup) ? per_cgroup_[sample.cgroup]
+                                              : per_pid_[builder_pid];
   if (per_pid.builder == nullptr) {
     VLOG(2) << "Creating a new profile for PID key " << builder_pid;
+    per_pid.profile_index = builders_.size();
     builders_.push_back(ProfileBuilder());
     per_pid.builder = &builders_.back();
-    process_metas_.push_back(ProcessMeta(builder_pid));
+    emitted_.push_back(false);
+    process_metas_.push_back(ProcessMeta(
+        builder_pid, sample.cgroup != nullptr ? *sample.cgroup : ""));
     per_pid.process_meta = &process_metas_.back();
+    profile_orders_.push_back(sample_order_);
+    label_strings_.emplace_back(per_pid.builder);
+    per_pid.label_strings = &label_strings_.back();
+
+    ReserveCapacity(builder_pid, &per_pid);
 
     ProfileBuilder* builder = per_pid.builder;
     Profile* profile = builder->mutable_profile();
     int last_index = 0;
     int unknown_event_idx = 0;
-    for (int event_idx = 0; event_idx < perf_data_.file_attrs_size();
+    for (int event_idx = 0; event_idx < perf_data_->file_attrs_size();
          ++event_idx) {
       // Come up with an event name for this event.  perf.data will usually
       // contain an event_types section of the same cardinality as its
       // file_attrs; in this case we can just use the name there.  Otherwise
       // we just give it an anonymous name.
       std::string event_name = "";
-      if (perf_data_.file_attrs_size() == perf_data_.event_types_size()) {
-        const auto& event_type = perf_data_.event_types(event_idx);
+      if (perf_data_->file_attrs_size() == perf_data_->event_types_size()) {
+        const auto& event_type = perf_data_->event_types(event_idx);
         if (event_type.has_name()) {
           event_name = event_type.name() + "_";
         }
@@ -515,6 +1229,11 @@ ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
       if (event_name.empty()) {
         event_name = "event_" + std::to_string(unknown_event_idx++) + "_";
       }
+      if (options_ & kEventLabels) {
+        event_name.pop_back();
+        per_pid.label_strings->AddEventName(event_name);
+        continue;
+      }
       auto sample_type = profile->add_sample_type();
       sample_type->set_type(UTF8StringId(event_name + "sample", builder));
       sample_type->set_unit(builder->StringId("count"));
@@ -523,6 +1242,15 @@ ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
       sample_type->set_type(last_index);
       sample_type->set_unit(builder->StringId("count"));
     }
+    if (options_ & kEventLabels) {
+      auto sample_type = profile->add_sample_type();
+      sample_type->set_type(builder->StringId("sample"));
+      sample_type->set_unit(builder->StringId("count"));
+      sample_type = profile->add_sample_type();
+      last_index = builder->StringId("event");
+      sample_type->set_type(last_index);
+      sample_type->set_unit(builder->StringId("count"));
+    }
     DCHECK_NE(last_index, 0);
     profile->set_default_sample_type(last_index);
     if (sample.main_mapping == nullptr) {
@@ -531,28 +1259,44 @@ ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
       fake_main->set_memory_start(0);
       fake_main->set_memory_limit(1);
     } else {
-      AddOrGetMapping(sample.sample.pid(), sample.main_mapping, builder);
+      AddOrGetMapping(&per_pid_[sample.sample.pid()], sample.main_mapping,
+                      builder);
+      per_pid.main_dso = sample.main_mapping->dso;
     }
-    if (perf_data_.string_metadata().has_perf_version()) {
-      std::string perf_version =
-          "perf-version:" + perf_data_.string_metadata().perf_version().value();
+    if (perf_data_->string_metadata().has_perf_version()) {
+      std::string perf_version = "perf-version:" +
+          perf_data_->string_metadata().perf_version().value();
       profile->add_comment(UTF8StringId(perf_version, builder));
     }
-    if (perf_data_.string_metadata().has_perf_command_line_whole()) {
+    if (timestamp_bucket_ns_ != 0 && IncludeTimestampNsLabels()) {
+      profile->add_comment(UTF8StringId(
+          "timestamp-bucket-ns:" + std::to_string(timestamp_bucket_ns_),
+          builder));
+    }
+    if (downsample_rate_ > 1) {
+      profile->add_comment(UTF8StringId(
+          "downsample-rate:" + std::to_string(downsample_rate_), builder));
+    }
+    if (perf_data_->string_metadata().has_perf_command_line_whole()) {
       std::string perf_command =
           "perf-command:" +
-          perf_data_.string_metadata().perf_command_line_whole().value();
+          perf_data_->string_metadata().perf_command_line_whole().value();
       profile->add_comment(UTF8StringId(perf_command, builder));
     }
   } else {
     Profile* profile = per_pid.builder->mutable_profile();
+    // The filenames are only compared when the DSO differs from the last one
+    // that matched, as the interned DSOs of most samples are the same.
     if ((options_ & kGroupByPids) && sample.main_mapping != nullptr &&
-        !sample.main_mapping->filename.empty()) {
+        sample.main_mapping->dso != per_pid.main_dso &&
+        !sample.main_mapping->filename().empty()) {
       const std::string& filename =
           profile->string_table(profile->mapping(0).filename());
       const std::string& sample_filename = MappingFilename(sample.main_mapping);
 
-      if (filename != sample_filename) {
+      if (filename == sample_filename) {
+        per_pid.main_dso = sample.main_mapping->dso;
+      } else {
         if (options_ & kFailOnMainMappingMismatch) {
           LOG(FATAL) << "main mapping mismatch: " << sample.sample.pid() << " "
                      << filename << " " << sample_filename;
@@ -566,11 +1310,54 @@ ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
   if (sample.sample.sample_time_ns()) {
     per_pid.process_meta->UpdateTimestamps(sample.sample.sample_time_ns());
   }
+  *label_strings = per_pid.label_strings;
   return per_pid.builder;
 }
 
+void PerfDataConverter::ReserveCapacity(Pid pid, PerPidInfo* per_pid) {
+  if (capacities_ == nullptr || (options_ & kGroupByCgroup)) {
+    return;
+  }
+  ProfileCapacity capacity;
+  if (options_ & kGroupByPids) {
+    const auto it = capacities_->find(pid);
+    if (it == capacities_->end()) {
+      return;
+    }
+    capacity = it->second;
+  } else {
+    for (const auto& it : *capacities_) {
+      capacity.samples += it.second.samples;
+      capacity.locations += it.second.locations;
+      capacity.mappings += it.second.mappings;
+    }
+  }
+  // RepeatedPtrField sizes are ints.
+  const auto bounded = [](uint64_t n) {
+    return static_cast<int>(
+        std::min<uint64_t>(n, std::numeric_limits<int>::max()));
+  };
+  const int samples =
+      bounded((capacity.samples + downsample_rate_ - 1) / downsample_rate_);
+  const int locations = bounded(capacity.locations);
+  const int mappings = bounded(capacity.mappings);
+  Profile* profile = per_pid->builder->mutable_profile();
+  profile->mutable_sample()->Reserve(samples);
+  profile->mutable_location()->Reserve(locations);
+  profile->mutable_mapping()->Reserve(mappings);
+  // Without kGroupByPids, the caches are those of each of the processes of the
+  // profile.
+  if (options_ & kGroupByPids) {
+    per_pid->location_map.reserve(locations);
+    per_pid->mapping_map.reserve(mappings);
+    if (!(options_ & kEventLabels)) {
+      (this->*reserve_samples_)(per_pid, samples);
+    }
+  }
+}
+
 uint64_t PerfDataConverter::AddOrGetMapping(
-    const Pid& pid, const PerfDataHandler::Mapping* smap,
+    PerPidInfo* per_pid, const PerfDataHandler::Mapping* smap,
     ProfileBuilder* builder) {
   CHECK(builder != nullptr) << "Cannot add mapping to null builder";
 
@@ -578,11 +1365,22 @@ uint64_t PerfDataConverter::AddOrGetMapping(
     return 0;
   }
 
-  MappingMap& mapmap = per_pid_[pid].mapping_map;
+  MappingMap& mapmap = per_pid->mapping_map;
   auto it = mapmap.find(smap);
   if (it != mapmap.end()) {
     return it->second;
   }
+  uint64_t* shared_id = nullptr;
+  if (!(options_ & kGroupByPids)) {
+    shared_id = &shared_code_[builder]
+                     .mapping_ids[SharedCodeKey{SharedCodeIdentity(smap),
+                                                smap->start, smap->limit,
+                                                smap->file_offset}];
+    if (*shared_id != 0) {
+      mapmap.insert(std::make_pair(smap, *shared_id));
+      return *shared_id;
+    }
+  }
 
   Profile* profile = builder->mutable_profile();
   auto mapping = profile->add_mapping();
@@ -591,138 +1389,71 @@ uint64_t PerfDataConverter::AddOrGetMapping(
   mapping->set_memory_start(smap->start);
   mapping->set_memory_limit(smap->limit);
   mapping->set_file_offset(smap->file_offset);
-  if (!smap->build_id.value.empty()) {
-    mapping->set_build_id(UTF8StringId(smap->build_id.value, builder));
+  auto dso_it = dso_maps_[builder].emplace(smap->dso, DsoStrings{0, 0});
+  DsoStrings& dso_strings = dso_it.first->second;
+  if (dso_it.second) {
+    if (!smap->build_id().value.empty()) {
+      dso_strings.build_id = UTF8StringId(smap->build_id().value, builder);
+    }
+    dso_strings.filename = UTF8StringId(MappingFilename(smap), builder);
   }
-  std::string mapping_filename = MappingFilename(smap);
-  mapping->set_filename(UTF8StringId(mapping_filename, builder));
+  if (dso_strings.build_id != 0) {
+    mapping->set_build_id(dso_strings.build_id);
+  }
+  mapping->set_filename(dso_strings.filename);
   CHECK_LE(mapping->memory_start(), mapping->memory_limit())
       << "Mapping start must be strictly less than its limit: "
       << mapping->filename();
   VLOG(2) << "Added mapping ID=" << mapping_id
-          << ", filename=" << mapping_filename
+          << ", filename=" << profile->string_table(mapping->filename())
           << ", memory_start=" << mapping->memory_start()
           << ", memory_limit=" << mapping->memory_limit()
           << ", file_offset=" << mapping->file_offset();
   mapmap.insert(std::make_pair(smap, mapping_id));
+  if (shared_id != nullptr) *shared_id = mapping_id;
+  AddProfileBytes(per_pid, sizeof(perftools::profiles::Mapping) +
+                           sizeof(MappingMap::value_type));
   return mapping_id;
 }
 
+template <typename Key>
 void PerfDataConverter::AddOrUpdateSample(
-    const PerfDataHandler::SampleContext& context, const Pid& pid,
-    const SampleKey& sample_key, ProfileBuilder* builder) {
-  perftools::profiles::Sample* sample = per_pid_[pid].sample_map[sample_key];
+    const PerfDataHandler::SampleContext& context, PerPidInfo* per_pid,
+    const Key& sample_key, ProfileBuilder* builder,
+    LabelStrings* label_strings) {
+  const bool event_labels = options_ & kEventLabels;
+  // AcceptsSample() rejects the samples without an event.
+  const size_t event_index = static_cast<size_t>(context.file_attrs_index);
+  PerPidInfo::SampleMaps* sample_maps = &per_pid->sample_maps;
+  if (event_labels) {
+    if (per_pid->event_sample_maps.size() <= event_index) {
+      per_pid->event_sample_maps.resize(event_index + 1);
+    }
+    sample_maps = &per_pid->event_sample_maps[event_index];
+  }
+  perftools::profiles::Sample*& sample =
+      std::get<SampleMap<Key>>(*sample_maps)[sample_key];
 
   if (sample == nullptr) {
+    const int num_events = event_labels ? 1 : perf_data_->file_attrs_size();
     Profile* profile = builder->mutable_profile();
     sample = profile->add_sample();
-    per_pid_[pid].sample_map[sample_key] = sample;
-    for (const auto& location_id : sample_key.stack) {
-      sample->add_location_id(location_id);
-    }
-    // Emit any requested labels.
-    if (IncludePidLabels() && context.sample.has_pid()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(PidLabelKey));
-      label->set_num(static_cast<int64_t>(context.sample.pid()));
-    }
-    if (IncludeTidLabels() && context.sample.has_tid()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(TidLabelKey));
-      label->set_num(static_cast<int64_t>(context.sample.tid()));
-    }
-    if (IncludeCommLabels() && sample_key.comm != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CommLabelKey));
-      label->set_str(sample_key.comm);
-    }
-    if (IncludeTimestampNsLabels() && context.sample.has_sample_time_ns()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(TimestampNsLabelKey));
-      int64_t timestamp_ns_as_int64 =
-          static_cast<int64_t>(context.sample.sample_time_ns());
-      label->set_num(timestamp_ns_as_int64);
-    }
-    if (IncludeExecutionModeLabels() &&
-        sample_key.exec_mode != quipper::AddressContext::kUnknown) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(ExecutionModeLabelKey));
-      label->set_str(builder->StringId(ExecModeString(sample_key.exec_mode)));
-    }
-    if (IncludeThreadTypeLabels() && sample_key.thread_type != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(ThreadTypeLabelKey));
-      label->set_str(sample_key.thread_type);
-    }
-    if (IncludeThreadCommLabels() && sample_key.thread_comm != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(ThreadCommLabelKey));
-      label->set_str(sample_key.thread_comm);
-    }
-    if (IncludeCgroupLabels() && sample_key.cgroup != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CgroupLabelKey));
-      label->set_str(sample_key.cgroup);
-    }
-    if (IncludeCodePageSizeLabels() && sample_key.code_page_size != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CodePageSizeLabelKey));
-      label->set_num(sample_key.code_page_size);
-    }
-    if (IncludeDataPageSizeLabels() && sample_key.data_page_size != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(DataPageSizeLabelKey));
-      label->set_num(sample_key.data_page_size);
-    }
-    if (IncludeCpuLabels() && context.sample.has_cpu()) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CpuLabelKey));
-      label->set_num(static_cast<int64_t>(context.sample.cpu()));
-      label->set_num_unit(builder->StringId("cpu"));
-    }
-    if (IncludeCacheLatencyLabel() && sample_key.cache_latency != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(CacheLatencyLabelKey));
-      label->set_num(sample_key.cache_latency);
-      label->set_num_unit(builder->StringId("cycles"));
-    }
-    if (IncludeDataSrcLabels()) {
-      if (sample_key.data_src != 0) {
-        auto* label = sample->add_label();
-        label->set_key(builder->StringId(DataSrcLabelKey));
-        label->set_str(sample_key.data_src);
-      }
-      if (sample_key.snoop_status != 0) {
-        auto* label = sample->add_label();
-        label->set_key(builder->StringId(SnoopStatusLabelKey));
-        label->set_str(sample_key.snoop_status);
-      }
-    }
-
-    if (IncludeTotalLatencyLabels() && sample_key.total_latency != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(TotalLatencyLabelKey));
-      label->set_num(sample_key.total_latency);
-      label->set_num_unit(builder->StringId("cycles"));
-    }
-    if (IncludeIssueLatencyLabels() && sample_key.issue_latency != 0) {
-      auto* label = sample->add_label();
-      label->set_key(builder->StringId(IssueLatencyLabelKey));
-      label->set_num(sample_key.issue_latency);
-      label->set_num_unit(builder->StringId("cycles"));
-    }
-    if (IncludeTranslationLatencyLabels() &&
-        sample_key.translation_latency != 0) {
+    per_pid->stack_table.SetLocationIds(sample_key.stack, sample);
+    AddProfileBytes(per_pid, sizeof(perftools::profiles::Sample) +
+                             sizeof(typename SampleMap<Key>::value_type) +
+                             sample->location_id_size() * sizeof(uint64_t) +
+                             2 * num_events * sizeof(int64_t));
+    AddSampleLabels(context, FullSampleKey(sample_key), builder, label_strings,
+                    sample);
+    if (event_labels) {
       auto* label = sample->add_label();
-      label->set_key(builder->StringId(TranslationLatencyLabelKey));
-      label->set_num(sample_key.translation_latency);
-      label->set_num_unit(builder->StringId("cycles"));
+      label->set_key(label_strings->Id(LabelStrings::kEventKey));
+      label->set_str(label_strings->EventNameId(event_index));
     }
 
     // Two values per collected event: the first is sample counts, the second is
     // event counts (unsampled weight for each sample).
-    for (int event_id = 0; event_id < perf_data_.file_attrs_size();
-         ++event_id) {
+    for (int event_id = 0; event_id < num_events; ++event_id) {
       sample->add_value(0);
       sample->add_value(0);
     }
@@ -733,26 +1464,143 @@ void PerfDataConverter::AddOrUpdateSample(
   if (context.sample.period() > 0) {
     weight = context.sample.period();
   } else if (context.file_attrs_index >= 0) {
-    uint64_t period =
-        perf_data_.file_attrs(context.file_attrs_index).attr().sample_period();
+    uint64_t period = perf_data_->file_attrs(context.file_attrs_index)
+                          .attr()
+                          .sample_period();
     if (period > 0) {
       // If sampling used a fixed period, use that as the weight.
       weight = period;
     }
   }
-  int event_index = context.file_attrs_index;
-  sample->set_value(2 * event_index, sample->value(2 * event_index) + 1);
-  sample->set_value(2 * event_index + 1,
-                    sample->value(2 * event_index + 1) + weight);
+  // With event labels, the samples only have the values of their own event.
+  const int value_index = event_labels ? 0 : context.file_attrs_index;
+  const int64_t count = static_cast<int64_t>(context.count) *
+                        static_cast<int64_t>(downsample_rate_);
+  sample->set_value(2 * value_index, sample->value(2 * value_index) + count);
+  sample->set_value(2 * value_index + 1,
+                    sample->value(2 * value_index + 1) + weight * count);
+}
+
+void PerfDataConverter::AddSampleLabels(
+    const PerfDataHandler::SampleContext& context, const SampleKey& sample_key,
+    ProfileBuilder* builder, LabelStrings* label_strings,
+    perftools::profiles::Sample* sample) {
+  if (IncludePidLabels() && context.sample.has_pid()) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kPidKey));
+    label->set_num(static_cast<int64_t>(context.sample.pid()));
+  }
+  if (IncludeTidLabels() && context.sample.has_tid()) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kTidKey));
+    label->set_num(static_cast<int64_t>(context.sample.tid()));
+  }
+  if (IncludeCommLabels() && sample_key.comm != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kCommKey));
+    label->set_str(sample_key.comm);
+  }
+  if (IncludeTimestampNsLabels() && context.sample.has_sample_time_ns()) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kTimestampNsKey));
+    // The sample time, or the start of its bucket.
+    label->set_num(static_cast<int64_t>(sample_key.time_ns));
+  }
+  if (IncludeExecutionModeLabels() &&
+      sample_key.exec_mode != quipper::AddressContext::kUnknown) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kExecutionModeKey));
+    label->set_str(builder->StringId(ExecModeString(sample_key.exec_mode)));
+  }
+  if (IncludeThreadTypeLabels() && sample_key.thread_type != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kThreadTypeKey));
+    label->set_str(sample_key.thread_type);
+  }
+  if (IncludeThreadCommLabels() && sample_key.thread_comm != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kThreadCommKey));
+    label->set_str(sample_key.thread_comm);
+  }
+  if (IncludeCgroupLabels() && sample_key.cgroup != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kCgroupKey));
+    label->set_str(sample_key.cgroup);
+  }
+  if (IncludeCodePageSizeLabels() && sample_key.code_page_size != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kCodePageSizeKey));
+    label->set_num(sample_key.code_page_size);
+  }
+  if (IncludeDataPageSizeLabels() && sample_key.data_page_size != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kDataPageSizeKey));
+    label->set_num(sample_key.data_page_size);
+  }
+  if (IncludeCpuLabels() && context.sample.has_cpu()) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kCpuKey));
+    label->set_num(static_cast<int64_t>(context.sample.cpu()));
+    label->set_num_unit(label_strings->Id(LabelStrings::kCpuUnit));
+  }
+  if (IncludeCacheLatencyLabel() && sample_key.cache_latency != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kCacheLatencyKey));
+    label->set_num(sample_key.cache_latency);
+    label->set_num_unit(label_strings->Id(LabelStrings::kCyclesUnit));
+  }
+  if (IncludeDataSrcLabels()) {
+    if (sample_key.data_src != 0) {
+      auto* label = sample->add_label();
+      label->set_key(label_strings->Id(LabelStrings::kDataSrcKey));
+      label->set_str(sample_key.data_src);
+    }
+    if (sample_key.snoop_status != 0) {
+      auto* label = sample->add_label();
+      label->set_key(label_strings->Id(LabelStrings::kSnoopStatusKey));
+      label->set_str(sample_key.snoop_status);
+    }
+  }
+
+  if (IncludeTotalLatencyLabels() && sample_key.total_latency != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kTotalLatencyKey));
+    label->set_num(sample_key.total_latency);
+    label->set_num_unit(label_strings->Id(LabelStrings::kCyclesUnit));
+  }
+  if (IncludeIssueLatencyLabels() && sample_key.issue_latency != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kIssueLatencyKey));
+    label->set_num(sample_key.issue_latency);
+    label->set_num_unit(label_strings->Id(LabelStrings::kCyclesUnit));
+  }
+  if (IncludeTranslationLatencyLabels() &&
+      sample_key.translation_latency != 0) {
+    auto* label = sample->add_label();
+    label->set_key(label_strings->Id(LabelStrings::kTranslationLatencyKey));
+    label->set_num(sample_key.translation_latency);
+    label->set_num_unit(label_strings->Id(LabelStrings::kCyclesUnit));
+  }
 }
 
 uint64_t PerfDataConverter::AddOrGetLocation(
-    const Pid& pid, uint64_t addr, const PerfDataHandler::Mapping* mapping,
+    PerPidInfo* per_pid, uint64_t addr, const PerfDataHandler::Mapping* mapping,
     ProfileBuilder* builder) {
-  LocationMap& loc_map = per_pid_[pid].location_map;
-  auto loc_it = loc_map.find(addr);
-  if (loc_it != loc_map.end()) {
-    return loc_it->second;
+  LocationMapEntry& entry =
+      per_pid->location_map.emplace(addr, LocationMapEntry{0, nullptr})
+          .first->second;
+  if (entry.location_id != 0 && entry.mapping == mapping) {
+    return entry.location_id;
+  }
+  uint64_t* shared_id = nullptr;
+  if (!(options_ & kGroupByPids) && mapping != nullptr) {
+    shared_id = &shared_code_[builder].location_ids[SharedCodeKey{
+        SharedCodeIdentity(mapping), 0, 0,
+        addr - mapping->start + mapping->file_offset}];
+    if (*shared_id != 0) {
+      entry = LocationMapEntry{*shared_id, mapping};
+      return *shared_id;
+    }
   }
 
   Profile* profile = builder->mutable_profile();
@@ -760,15 +1608,18 @@ uint64_t PerfDataConverter::AddOrGetLocation(
   uint64_t loc_id = profile->location_size();
   loc->set_id(loc_id);
   loc->set_address(addr);
-  uint64_t mapping_id = AddOrGetMapping(pid, mapping, builder);
+  uint64_t mapping_id = AddOrGetMapping(per_pid, mapping, builder);
   if (mapping_id != 0) {
     loc->set_mapping_id(mapping_id);
   } else {
-    CHECK(addr == 0) << "Unmapped address in PID " << pid;
+    CHECK(addr == 0) << "Unmapped address " << addr;
   }
   VLOG(2) << "Added location ID=" << loc_id << ", addr=" << addr
           << ", mapping_id=" << mapping_id;
-  loc_map[addr] = loc_id;
+  AddProfileBytes(per_pid, sizeof(perftools::profiles::Location) +
+                           sizeof(LocationMap::value_type));
+  entry = LocationMapEntry{loc_id, mapping};
+  if (shared_id != nullptr) *shared_id = loc_id;
   return loc_id;
 }
 
@@ -779,34 +1630,182 @@ void PerfDataConverter::Comm(const CommContext& comm) {
     // The is_exec bit indicates an exec() happened, so clear everything
     // from the existing pid.
     VLOG(2) << "exec() for PID=" << pid << ", clearing the profile";
+    EmitProfile(pid);
     per_pid_[pid].clear();
   }
-  per_pid_[pid].tid_to_comm_map[tid] = PerfDataHandler::NameOrMd5Prefix(
-      comm.comm->comm(), comm.comm->comm_md5_prefix());
+  per_pid_[pid].tid_to_comm_map[tid] =
+      comm.comm->comm().empty()
+          ? comms_.Intern(PerfDataHandler::NameOrMd5Prefix(
+                "", comm.comm->comm_md5_prefix()))
+          : comms_.Intern(comm.comm->comm());
 }
 
-// Invalidates the locations in location_map in the mmap event's range.
-void PerfDataConverter::MMap(const MMapContext& mmap) {
-  LocationMap& loc_map = per_pid_[mmap.pid].location_map;
-  loc_map.erase(loc_map.lower_bound(mmap.mapping->start),
-                loc_map.lower_bound(mmap.mapping->limit));
+// The locations in the mmap event's range are invalidated by the new mapping,
+// see LocationMap.
+void PerfDataConverter::MMap(const MMapContext& mmap) {}
+
+void PerfDataConverter::Exit(const quipper::PerfDataProto::ForkEvent& exit) {
+  if (!profile_callback_ || !(options_ & kGroupByPids) ||
+      exit.pid() != exit.tid()) {
+    return;
+  }
+  EmitProfile(exit.pid());
+  // The PID may be reused by a new process, which gets new comms.
+  per_pid_.erase(exit.pid());
 }
 
-bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
+std::unique_ptr<ProcessProfile> PerfDataConverter::FinishProfile(size_t i) {
+  auto& b = builders_[i];
+  // The locations are built with their mappings and the samples with their
+  // locations, so the profiles don't need to be checked.
+  b.set_check_valid(false);
+  b.Finalize();
+  // The profiles are finished concurrently, so the process is only looked up.
+  const auto it = per_pid_.find(process_metas_[i].pid());
+  auto pp = process_metas_[i].MakeProcessProfile(
+      b.mutable_profile(),
+      it != per_pid_.end() ? &it->second.build_id_counts : nullptr);
+  if ((options_ & kMarshalProfiles) &&
+      !ProfileBuilder::Marshal(pp->data, &pp->marshaled_data)) {
+    LOG(ERROR) << "Could not marshal the profile of PID " << pp->pid;
+    pp->marshaled_data.clear();
+  }
+  return pp;
+}
+
+void PerfDataConverter::EmitProfile(Pid pid) {
+  if (!profile_callback_ || !(options_ & kGroupByPids)) {
+    return;
+  }
+  auto it = per_pid_.find(pid);
+  if (it == per_pid_.end() || it->second.builder == nullptr) {
+    return;
+  }
+  PerPidInfo& per_pid = it->second;
+  const size_t i = per_pid.profile_index;
+  std::unique_ptr<ProcessProfile> pp = FinishProfile(i);
+  // Releases the memory of the profile. The small per-profile entries of the
+  // other deques are kept, so that the indices stay the same.
+  dso_maps_.erase(per_pid.builder);
+  shared_code_.erase(per_pid.builder);
+  builders_[i] = ProfileBuilder();
+  emitted_[i] = true;
+  profile_bytes_ -= per_pid.profile_bytes;
+  per_pid.ClearProfile();
+  profile_callback_(std::move(pp));
+}
+
+void PerfDataConverter::EnforceProfileBudget() {
+  if (max_profile_bytes_ == 0 || profile_bytes_ <= max_profile_bytes_ ||
+      !profile_callback_ || !(options_ & kGroupByPids)) {
+    return;
+  }
+  // Emits the largest profiles until half of the budget is free, so that the
+  // processes aren't looked through again for a while.
+  std::vector<std::pair<uint64_t, Pid>> sizes;
+  for (const auto& it : per_pid_) {
+    if (it.second.builder != nullptr) {
+      sizes.emplace_back(it.second.profile_bytes, it.first);
+    }
+  }
+  std::sort(sizes.rbegin(), sizes.rend());
+  for (const auto& size : sizes) {
+    if (profile_bytes_ <= max_profile_bytes_ / 2) break;
+    EmitProfile(size.second);
+  }
+}
+
+bool PerfDataConverter::AcceptsSample(
+    const PerfDataHandler::SampleContext& sample) const {
   if (sample.file_attrs_index < 0 ||
-      sample.file_attrs_index >= perf_data_.file_attrs_size()) {
+      sample.file_attrs_index >= perf_data_->file_attrs_size()) {
     LOG(WARNING) << "out of bounds file_attrs_index: "
                  << sample.file_attrs_index;
     return false;
   }
 
-  if (sample.lost && (options_ & kDropLostEvents)) {
+  return !(sample.lost && (options_ & kDropLostEvents));
+}
+
+uint64_t PerfDataConverter::CallchainLocationId(
+    PerPidInfo* per_pid, const PerfDataHandler::Location& frame,
+    ProfileBuilder* builder) {
+  // These aren't real callchain entries, just hints as to kernel / user
+  // addresses.
+  if (frame.ip >= quipper::PERF_CONTEXT_MAX) {
+    return 0;
+  }
+  if (frame.mapping == nullptr) {
+    return 0;
+  }
+  // Why <=? Because this is a return address, which should be
+  // preceded by a call (the "real" context.)  If we're at the edge
+  // of the mapping, we're really off its edge.
+  if (frame.ip <= frame.mapping->start) {
+    return 0;
+  }
+  // Subtract one so we point to the call instead of the return addr.
+  return AddOrGetLocation(per_pid, frame.ip - 1, frame.mapping, builder);
+}
+
+bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
+  if (!AcceptsSample(sample)) {
     return false;
   }
+  (this->*add_sample_)(sample);
+  EnforceProfileBudget();
+  return true;
+}
+
+template <typename Key>
+void PerfDataConverter::AddSample(
+    const PerfDataHandler::SampleContext& sample) {
+  LabelStrings* label_strings;
+  ProfileBuilder* builder = GetOrCreateBuilder(sample, &label_strings);
+  // The process is only looked up once per sample, as its caches are used for
+  // every frame.
+  PerPidInfo* per_pid = &per_pid_[sample.sample.pid()];
+  if ((options_ & kGroupByCgroup) && per_pid->caches_builder != builder) {
+    // The locations and samples cached for a process that moved to another
+    // cgroup belong to the profile of its former cgroup.
+    per_pid->ClearCaches();
+    per_pid->caches_builder = builder;
+  }
+  Key sample_key = MakeSampleKey<Key>(sample, per_pid, builder, label_strings);
+  sample_key.stack = SampleStack(sample, per_pid, builder);
+  sample_key.ComputeHash();
+  AddOrUpdateSample(sample, per_pid, sample_key, builder, label_strings);
+}
+
+void PerfDataConverter::SelectSampleKey() {
+  uint32_t labels = sample_labels_;
+  if (!IncludeThreadTypeLabels()) labels &= ~kThreadTypeLabel;
+  // The pid labels are taken from the samples, which are keyed by process
+  // anyway.
+  switch (labels & ~kPidLabel) {
+    case kNoLabels:
+      SelectSampleKey<StackSampleKey>();
+      break;
+    case kTidLabel:
+      SelectSampleKey<TidSampleKey>();
+      break;
+    case kTidLabel | kTimestampNsLabel:
+      SelectSampleKey<TimeSampleKey>();
+      break;
+    case kCommLabel | kThreadCommLabel:
+      SelectSampleKey<CommSampleKey>();
+      break;
+    default:
+      SelectSampleKey<SampleKey>();
+      break;
+  }
+}
 
-  Pid event_pid = sample.sample.pid();
-  ProfileBuilder* builder = GetOrCreateBuilder(sample);
-  SampleKey sample_key = MakeSampleKey(sample, builder);
+StackTable::StackId PerfDataConverter::SampleStack(
+    const PerfDataHandler::SampleContext& sample, PerPidInfo* per_pid,
+    ProfileBuilder* builder) {
+  StackTable& stacks = per_pid->stack_table;
+  StackTable::StackId stack = StackTable::kEmptyStack;
 
   uint64_t ip = sample.sample_mapping != nullptr ? sample.sample.ip() : 0;
   if (ip != 0) {
@@ -827,55 +1826,69 @@ bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
       CHECK_GE(addr, start);
       CHECK_LT(addr, limit);
     }
-    sample_key.stack.push_back(
-        AddOrGetLocation(event_pid, addr, sample.addr_mapping, builder));
+    if (addr != 0 && data_address_bucket_bytes_ != 0) {
+      addr = DataAddressBucket(addr, *sample.addr_mapping,
+                               data_address_bucket_bytes_);
+    }
+    stack = stacks.AddCaller(
+        stack, AddOrGetLocation(per_pid, addr, sample.addr_mapping, builder));
   }
-  sample_key.stack.push_back(
-      AddOrGetLocation(event_pid, ip, sample.sample_mapping, builder));
-  IncBuildIdStats(event_pid, sample.sample_mapping);
+  stack = stacks.AddCaller(
+      stack, AddOrGetLocation(per_pid, ip, sample.sample_mapping, builder));
+  CountBuildIdSource(sample.sample_mapping, &per_pid->build_id_counts);
 
   // LBR callstacks include only user call chains. If this is an LBR sample,
   // we get the kernel callstack from the sample's callchain, and the user
   // callstack from the sample's branch_stack.
   const bool lbr_sample = !sample.branch_stack.empty() && !sample.spe.is_spe;
-  bool skipped_dup = false;
-  for (const auto& frame : sample.callchain) {
-    if (lbr_sample && frame.ip == quipper::PERF_CONTEXT_USER) {
+  const auto& callchain = sample.callchain;
+  size_t end = 0;
+  while (end < callchain.size() &&
+         !(lbr_sample && callchain[end].ip == quipper::PERF_CONTEXT_USER)) {
+    ++end;
+  }
+  // perf_events includes the IP at the leaf of the callchain. If PEBS is on,
+  // kernels built after
+  // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/commit/arch/x86/events/intel/ds.c?id=b8000586c90b4804902058a38d3a59ce5708e695
+  // will have the first callchain entry be the interrupted IP, while in older
+  // kernels it will be the sampled IP. If PEBS is off, the first callchain
+  // entry will be the interrupted IP. Either way, skip the first non-marker
+  // entry.
+  size_t begin = 0;
+  while (begin < end && callchain[begin].ip >= quipper::PERF_CONTEXT_MAX) {
+    ++begin;
+  }
+  begin = std::min(begin + 1, end);
+
+  // Only the frames that differ from those of the thread's last sample, on
+  // the leaf side, are looked up.
+  const Tid tid = sample.sample.has_tid() ? sample.sample.tid() : 0;
+  std::vector<CallchainFrame>& last = per_pid->last_callchains[tid];
+  size_t shared = 0;
+  while (shared < end - begin && shared < last.size()) {
+    const auto& frame = callchain[end - 1 - shared];
+    const CallchainFrame& last_frame = last[last.size() - 1 - shared];
+    if (frame.ip != last_frame.ip || frame.mapping != last_frame.mapping) {
       break;
     }
-
-    // These aren't real callchain entries, just hints as to kernel / user
-    // addresses.
-    if (frame.ip >= quipper::PERF_CONTEXT_MAX) {
-      continue;
-    }
-
-    // perf_events includes the IP at the leaf of the callchain. If PEBS is on,
-    // kernels built after
-    // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/commit/arch/x86/events/intel/ds.c?id=b8000586c90b4804902058a38d3a59ce5708e695
-    // will have the first callchain entry be the interrupted IP, while in older
-    // kernels it will be the sampled IP. If PEBS is off, the first callchain
-    // entry will be the interrupted IP. Either way, skip the first non-marker
-    // entry.
-    if (!skipped_dup) {
-      skipped_dup = true;
-      continue;
-    }
-    if (frame.mapping == nullptr) {
-      continue;
-    }
-    // Why <=? Because this is a return address, which should be
-    // preceded by a call (the "real" context.)  If we're at the edge
-    // of the mapping, we're really off its edge.
-    if (frame.ip <= frame.mapping->start) {
+    ++shared;
+  }
+  callchain_frames_.clear();
+  for (size_t i = begin; i < end; ++i) {
+    const auto& frame = callchain[i];
+    const uint64_t location_id =
+        i < end - shared
+            ? CallchainLocationId(per_pid, frame, builder)
+            : last[last.size() - (end - i)].location_id;
+    callchain_frames_.push_back(
+        CallchainFrame{frame.ip, frame.mapping, location_id});
+    if (location_id == 0) {
       continue;
     }
-
-    // Subtract one so we point to the call instead of the return addr.
-    sample_key.stack.push_back(
-        AddOrGetLocation(event_pid, frame.ip - 1, frame.mapping, builder));
-    IncBuildIdStats(event_pid, frame.mapping);
+    stack = stacks.AddCaller(stack, location_id);
+    CountBuildIdSource(frame.mapping, &per_pid->build_id_counts);
   }
+  last.swap(callchain_frames_);
 
   // Only add the frame from branch_stack if it is an LBR sample.
   if (lbr_sample) {
@@ -892,78 +1905,930 @@ bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
       if (frame.from.ip < frame.from.mapping->start) {
         continue;
       }
-      sample_key.stack.push_back(AddOrGetLocation(event_pid, frame.from.ip,
-                                                  frame.from.mapping, builder));
-      IncBuildIdStats(event_pid, frame.from.mapping);
+      stack = stacks.AddCaller(
+          stack, AddOrGetLocation(per_pid, frame.from.ip, frame.from.mapping,
+                                  builder));
+      CountBuildIdSource(frame.from.mapping, &per_pid->build_id_counts);
     }
   }
 
-  AddOrUpdateSample(sample, event_pid, sample_key, builder);
-  return true;
+  return stack;
 }
 
-ProcessProfiles PerfDataConverter::Profiles() {
-  ProcessProfiles pps;
-  for (size_t i = 0; i < builders_.size(); i++) {
-    auto& b = builders_[i];
-    b.Finalize();
-    auto pp = process_metas_[i].MakeProcessProfile(b.mutable_profile(),
-                                                   process_build_id_stats_);
-    pps.push_back(std::move(pp));
+void PerfDataConverter::StartChunk(const quipper::PerfDataProto& perf_data) {
+  perf_data_ = &perf_data;
+  builders_.clear();
+  process_metas_.clear();
+  label_strings_.clear();
+  dso_maps_.clear();
+  shared_code_.clear();
+  profile_orders_.clear();
+  sample_order_ = 0;
+  emitted_.clear();
+  profile_bytes_ = 0;
+  for (auto& it : per_pid_) {
+    it.second.ClearProfile();
   }
+  per_cgroup_.clear();
+}
+
+ProcessProfiles PerfDataConverter::Profiles(int num_threads,
+                                            ConversionExecutor* executor) {
+  QUIPPER_TRACE_SPAN("PerfDataConverter::Profiles");
+  ProcessProfiles pps(builders_.size());
+  quipper::ParallelFor(executor, builders_.size(), std::max(num_threads, 1),
+                       [this, &pps](size_t i) {
+                         if (!emitted_[i]) pps[i] = FinishProfile(i);
+                       });
+  pps.erase(std::remove(pps.begin(), pps.end(), nullptr), pps.end());
   return pps;
 }
 
-}  // namespace
+// Merges the profiles of the same process in |parts|, built by different
+// converters, into the first of them, and drops the others. Returns false,
+// and leaves |parts| as they are, if they could not be merged.
+bool MergeProcessProfiles(std::vector<std::unique_ptr<ProcessProfile>>* parts) {
+  if (parts->size() == 1) return true;
+  perftools::profiles::ProfileMerger merger(/*same_address_space=*/true);
+  for (const auto& part : *parts) {
+    if (!merger.Add(part->data)) return false;
+  }
+  std::unique_ptr<Profile> merged = merger.Consume();
+  if (merged == nullptr) return false;
+  ProcessProfile* pp = parts->front().get();
+  pp->data.Swap(merged.get());
+  for (size_t i = 1; i < parts->size(); ++i) {
+    const ProcessProfile& part = *(*parts)[i];
+    if (pp->min_sample_time_ns == 0 ||
+        (part.min_sample_time_ns != 0 &&
+         part.min_sample_time_ns < pp->min_sample_time_ns)) {
+      pp->min_sample_time_ns = part.min_sample_time_ns;
+    }
+    pp->max_sample_time_ns =
+        std::max(pp->max_sample_time_ns, part.max_sample_time_ns);
+    for (const auto& it : part.build_id_stats) {
+      pp->build_id_stats[it.first] += it.second;
+    }
+  }
+  parts->resize(1);
+  return true;
+}
 
-ProcessProfiles PerfDataProtoToProfiles(
-    const quipper::PerfDataProto* perf_data, const uint32_t sample_labels,
-    const uint32_t options, const std::map<Tid, std::string>& thread_types) {
-  PerfDataConverter converter(*perf_data, sample_labels, options, thread_types);
-  PerfDataHandler::Process(*perf_data, &converter);
-  return converter.Profiles();
+// Builds the profiles of a kGroupByPids or kPerCpuSamples conversion on
+// several threads. The processes are split into shards by PID, or with
+// kPerCpuSamples the samples by CPU, and each shard has a PerfDataConverter
+// of its own, which runs on a thread of its own. The normalized events are
+// copied, since the normalizer reuses them, and handed to the shard of their
+// process or CPU in batches, in their original order. With kPerCpuSamples,
+// each shard gets the comms of every process, and the profiles of a process
+// are merged once the shards are finished.
+class ShardedPerfDataConverter : public PerfDataHandler {
+ public:
+  ShardedPerfDataConverter(const quipper::PerfDataProto& perf_data,
+                           uint32_t sample_labels, uint32_t options,
+                           const std::map<Tid, std::string>& thread_types,
+                           uint64_t timestamp_bucket_ns,
+                           uint32_t downsample_rate, uint64_t downsample_seed,
+                           int num_shards)
+      : options_(options),
+        per_cpu_(options & kPerCpuSamples),
+        sample_selector_(downsample_rate, downsample_seed) {
+    // With kPerCpuSamples, the profiles are marshaled once merged.
+    const uint32_t shard_options =
+        per_cpu_ ? options & ~kMarshalProfiles : options;
+    for (int i = 0; i < num_shards; ++i) {
+      shards_.emplace_back(new Shard(perf_data, sample_labels, shard_options,
+                                     thread_types, timestamp_bucket_ns,
+                                     downsample_rate));
+    }
+  }
+  ShardedPerfDataConverter(const ShardedPerfDataConverter&) = delete;
+  ShardedPerfDataConverter& operator=(const ShardedPerfDataConverter&) =
+      delete;
+  ~ShardedPerfDataConverter() override { Finish(); }
+
+  // Returns the profiles of all the shards, in the order a single
+  // PerfDataConverter would have returned them in. The shards finalize their
+  // profiles concurrently, as tasks on |executor| if it isn't null, as are
+  // the profiles of each process merged with kPerCpuSamples. Must be called
+  // after Finish().
+  ProcessProfiles Profiles(ConversionExecutor* executor = nullptr);
+
+  // Callbacks for PerfDataHandler. The events are converted asynchronously
+  // until Finish() returns. The samples are picked here, as the shards'
+  // converters would, since KeepSample() is called by the normalizer.
+  bool KeepSample(const PerfDataHandler::SampleContext& sample) override {
+    return sample_selector_.Keep(sample.sample.pid());
+  }
+  // See PerfDataConverter::SetCapacities(). With kPerCpuSamples, each shard
+  // only gets a part of the samples of each process, so the profiles aren't
+  // reserved for all of them.
+  void SetCapacities(const ProfileCapacities* capacities) {
+    if (per_cpu_) return;
+    for (auto& shard : shards_) shard->converter().SetCapacities(capacities);
+  }
+
+  bool NeedsStacks() const override {
+    return shards_.front()->converter().NeedsStacks();
+  }
+  bool Sample(const PerfDataHandler::SampleContext& sample) override;
+  void Comm(const CommContext& comm) override;
+  void MMap(const MMapContext& mmap) override;
+  void Finish() override;
+
+ private:
+  // A copy of a normalized event. Exactly one of sample, comm.comm and
+  // mmap.mapping is set.
+  struct Event {
+    quipper::PerfDataProto::EventHeader header;
+    quipper::PerfDataProto::SampleEvent sample_event;
+    quipper::PerfDataProto::CommEvent comm_event;
+    std::unique_ptr<SampleContext> sample;
+    CommContext comm = {nullptr, false};
+    MMapContext mmap = {nullptr, 0};
+    uint64_t sample_order = 0;
+  };
+  typedef std::vector<std::unique_ptr<Event>> Batch;
+
+  class Shard {
+   public:
+    Shard(const quipper::PerfDataProto& perf_data, uint32_t sample_labels,
+          uint32_t options, const std::map<Tid, std::string>& thread_types,
+          uint64_t timestamp_bucket_ns, uint32_t downsample_rate)
+        : converter_(perf_data, sample_labels, options, thread_types,
+                     timestamp_bucket_ns, downsample_rate),
+          thread_(&Shard::Run, this) {}
+
+    PerfDataConverter& converter() { return converter_; }
+
+    // Queues |event| for conversion.
+    void Add(std::unique_ptr<Event> event);
+
+    // Converts the queued events and stops the thread.
+    void Finish();
+
+   private:
+    // The number of events handed to the thread at once.
+    static constexpr size_t kBatchSize = 256;
+    // The number of batches queued before Add() waits for the thread, which
+    // bounds the memory taken by the copies.
+    static constexpr size_t kMaxQueuedBatches = 64;
+
+    void Push(Batch batch);
+    void Run();
+
+    PerfDataConverter converter_;
+    Batch pending_;
+    std::mutex mutex_;
+    std::condition_variable queue_changed_;
+    std::deque<Batch> queue_;
+    bool finished_ = false;
+    std::thread thread_;
+  };
+
+  Shard* ShardForPid(Pid pid) { return shards_[pid % shards_.size()].get(); }
+  Shard* ShardForSample(const SampleContext& sample) {
+    return per_cpu_ ? shards_[sample.sample.cpu() % shards_.size()].get()
+                    : ShardForPid(sample.sample.pid());
+  }
+  // Calls |add| with each shard that the events of |pid| other than samples
+  // go to: that of the process, or every shard with kPerCpuSamples.
+  template <typename Add>
+  void ForEachShardOfPid(Pid pid, Add add) {
+    if (!per_cpu_) {
+      add(ShardForPid(pid));
+      return;
+    }
+    for (auto& shard : shards_) add(shard.get());
+  }
+
+  // The number of execs of |pid| before the sample |sample_order|, which
+  // tells apart the profiles of the PID before and after each exec.
+  size_t ExecsBefore(Pid pid, uint64_t sample_order) const;
+
+  const uint32_t options_;
+  const bool per_cpu_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  SampleSelector sample_selector_;
+  uint64_t next_sample_order_ = 0;
+  // With kPerCpuSamples and kGroupByPids, the order of the first sample after
+  // each exec of each process.
+  std::unordered_map<Pid, std::vector<uint64_t>> exec_sample_orders_;
+  bool finished_ = false;
+};
+
+void ShardedPerfDataConverter::Shard::Add(std::unique_ptr<Event> event) {
+  pending_.push_back(std::move(event));
+  if (pending_.size() == kBatchSize) {
+    Push(std::move(pending_));
+    pending_ = Batch();
+    pending_.reserve(kBatchSize);
+  }
 }
 
-ProcessProfiles RawPerfDataToProfiles(
-    const void* raw, const uint64_t raw_size,
-    const std::map<std::string, std::string>& build_ids,
-    const uint32_t sample_labels, const uint32_t options,
-    const std::map<Tid, std::string>& thread_types) {
-  quipper::PerfReader reader;
-  if (!reader.ReadFromPointer(reinterpret_cast<const char*>(raw), raw_size)) {
-    LOG(ERROR) << "Could not read input perf.data";
-    return ProcessProfiles();
+void ShardedPerfDataConverter::Shard::Finish() {
+  Push(std::move(pending_));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
   }
+  queue_changed_.notify_all();
+  thread_.join();
+}
 
-  reader.InjectBuildIDs(build_ids);
+void ShardedPerfDataConverter::Shard::Push(Batch batch) {
+  if (batch.empty()) return;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_changed_.wait(lock,
+                        [this] { return queue_.size() < kMaxQueuedBatches; });
+    queue_.push_back(std::move(batch));
+  }
+  queue_changed_.notify_all();
+}
 
+void ShardedPerfDataConverter::Shard::Run() {
+  while (true) {
+    Batch batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_changed_.wait(lock,
+                          [this] { return !queue_.empty() || finished_; });
+      if (queue_.empty()) return;
+      batch = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    queue_changed_.notify_all();
+    for (const auto& event : batch) {
+      if (event->sample != nullptr) {
+        converter_.SetSampleOrder(event->sample_order);
+        converter_.Sample(*event->sample);
+      } else if (event->comm.comm != nullptr) {
+        converter_.Comm(event->comm);
+      } else {
+        converter_.MMap(event->mmap);
+      }
+    }
+  }
+}
+
+bool ShardedPerfDataConverter::Sample(const SampleContext& sample) {
+  Shard* shard = ShardForSample(sample);
+  if (!shard->converter().AcceptsSample(sample)) {
+    return false;
+  }
+  std::unique_ptr<Event> event(new Event);
+  event->header = sample.header;
+  event->sample_event = sample.sample;
+  event->sample.reset(new SampleContext(event->header, event->sample_event));
+  SampleContext* copy = event->sample.get();
+  copy->main_mapping = sample.main_mapping;
+  copy->sample_mapping = sample.sample_mapping;
+  copy->addr_mapping = sample.addr_mapping;
+  copy->callchain = sample.callchain;
+  copy->branch_stack = sample.branch_stack;
+  copy->file_attrs_index = sample.file_attrs_index;
+  copy->cgroup = sample.cgroup;
+  copy->lost = sample.lost;
+  copy->count = sample.count;
+  copy->spe.is_spe = sample.spe.is_spe;
+  copy->spe.record = sample.spe.record;
+  event->sample_order = next_sample_order_++;
+  shard->Add(std::move(event));
+  return true;
+}
+
+void ShardedPerfDataConverter::Comm(const CommContext& comm) {
+  if (per_cpu_ && comm.is_exec && (options_ & kGroupByPids)) {
+    exec_sample_orders_[comm.comm->pid()].push_back(next_sample_order_);
+  }
+  ForEachShardOfPid(comm.comm->pid(), [&comm](Shard* shard) {
+    std::unique_ptr<Event> event(new Event);
+    event->comm_event = *comm.comm;
+    event->comm.comm = &event->comm_event;
+    event->comm.is_exec = comm.is_exec;
+    shard->Add(std::move(event));
+  });
+}
+
+void ShardedPerfDataConverter::MMap(const MMapContext& mmap) {
+  ForEachShardOfPid(mmap.pid, [&mmap](Shard* shard) {
+    std::unique_ptr<Event> event(new Event);
+    event->mmap = mmap;
+    shard->Add(std::move(event));
+  });
+}
+
+size_t ShardedPerfDataConverter::ExecsBefore(Pid pid,
+                                             uint64_t sample_order) const {
+  const auto it = exec_sample_orders_.find(pid);
+  if (it == exec_sample_orders_.end()) return 0;
+  return std::upper_bound(it->second.begin(), it->second.end(),
+                          sample_order) -
+         it->second.begin();
+}
+
+void ShardedPerfDataConverter::Finish() {
+  if (finished_) return;
+  finished_ = true;
+  for (auto& shard : shards_) shard->Finish();
+}
+
+ProcessProfiles ShardedPerfDataConverter::Profiles(
+    ConversionExecutor* executor) {
+  CHECK(finished_);
+  std::vector<ProcessProfiles> shard_pps(shards_.size());
+  quipper::ParallelFor(executor, shards_.size(), shards_.size(),
+                       [this, &shard_pps](size_t i) {
+                         shard_pps[i] = shards_[i]->converter().Profiles();
+                       });
+  std::vector<std::pair<uint64_t, std::unique_ptr<ProcessProfile>>> profiles;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    const std::deque<uint64_t>& orders =
+        shards_[i]->converter().profile_orders();
+    for (size_t j = 0; j < shard_pps[i].size(); ++j) {
+      profiles.emplace_back(orders[j], std::move(shard_pps[i][j]));
+    }
+  }
+  std::sort(profiles.begin(), profiles.end(),
+            [](const std::pair<uint64_t, std::unique_ptr<ProcessProfile>>& a,
+               const std::pair<uint64_t, std::unique_ptr<ProcessProfile>>& b) {
+              return a.first < b.first;
+            });
+  ProcessProfiles pps;
+  if (!per_cpu_) {
+    for (auto& profile : profiles) pps.push_back(std::move(profile.second));
+    return pps;
+  }
+
+  // The profiles of each process, and of each exec of it, in the order of
+  // the first of them.
+  std::vector<std::vector<std::unique_ptr<ProcessProfile>>> parts;
+  std::map<std::pair<Pid, size_t>, size_t> part_indices;
+  for (auto& profile : profiles) {
+    const Pid pid = profile.second->pid;
+    const auto inserted = part_indices.emplace(
+        std::make_pair(pid, ExecsBefore(pid, profile.first)), parts.size());
+    if (inserted.second) parts.emplace_back();
+    parts[inserted.first->second].push_back(std::move(profile.second));
+  }
+  quipper::ParallelFor(
+      executor, parts.size(), shards_.size(), [this, &parts](size_t i) {
+        if (!MergeProcessProfiles(&parts[i])) {
+          LOG(ERROR) << "Could not merge the profiles of PID "
+                     << parts[i].front()->pid << ", returning its "
+                     << parts[i].size() << " profiles unmerged";
+        }
+        if (!(options_ & kMarshalProfiles)) return;
+        for (auto& pp : parts[i]) {
+          if (!ProfileBuilder::Marshal(pp->data, &pp->marshaled_data)) {
+            LOG(ERROR) << "Could not marshal the profile of PID " << pp->pid;
+            pp->marshaled_data.clear();
+          }
+        }
+      });
+  for (auto& process_parts : parts) {
+    for (auto& pp : process_parts) pps.push_back(std::move(pp));
+  }
+  return pps;
+}
+
+// The sample fields the conversion doesn't look at, which are left out of the
+// events read.
+constexpr uint64_t kUnconvertedSampleFields =
+    quipper::PERF_SAMPLE_RAW | quipper::PERF_SAMPLE_READ |
+    quipper::PERF_SAMPLE_REGS_USER | quipper::PERF_SAMPLE_STACK_USER |
+    quipper::PERF_SAMPLE_TRANSACTION | quipper::PERF_SAMPLE_PHYS_ADDR;
+
+// Returns the sample fields the events are read with for a conversion with
+// |options|.
+uint64_t ConvertedSampleFields(uint32_t options) {
+  uint64_t unconverted = kUnconvertedSampleFields;
+  if (options & kLeafOnly) {
+    unconverted |=
+        quipper::PERF_SAMPLE_CALLCHAIN | quipper::PERF_SAMPLE_BRANCH_STACK;
+  }
+  return ~unconverted;
+}
+
+// The name of the kernel in build ID events, see PrepareBuildIDs().
+constexpr char kKernelBuildIdFilename[] = "[kernel.kallsyms]";
+
+// Adds the kernel build ID aliases the handler expects to the perf data read
+// by |reader|.
+void AliasKernelBuildIDs(quipper::PerfReader* reader) {
   // Perf populates info about the kernel using multiple pathways,
   // which don't actually all match up how they name kernel data; in
   // particular, buildids are reported by a different name ("[kernel.kallsyms]")
   // than the actual mmap filename ("[kernel.kallsyms]_text" or
   // "[kernel.kallsyms]_stext"). Normalize these names so our ProcessProfiles
   // will match kernel mappings to a buildid.
-  reader.AlternateBuildIDFilenames({
-      {"[kernel.kallsyms]", "[kernel.kallsyms]_text"},
-      {"[kernel.kallsyms]", "[kernel.kallsyms]_stext"},
+  reader->AlternateBuildIDFilenames({
+      {kKernelBuildIdFilename, "[kernel.kallsyms]_text"},
+      {kKernelBuildIdFilename, "[kernel.kallsyms]_stext"},
   });
+}
+
+// Injects the given build IDs into the perf data read by |reader| and adds the
+// kernel build ID aliases the handler expects.
+void PrepareBuildIDs(const std::map<std::string, std::string>& build_ids,
+                     quipper::PerfReader* reader) {
+  reader->InjectBuildIDs(build_ids);
+  AliasKernelBuildIDs(reader);
+}
+
+// Same as above, for the build IDs of the files the perf data mentions. The
+// kernel is mentioned by the names of its aliases.
+void PrepareBuildIDs(const quipper::BuildIdIndex& build_ids,
+                     quipper::PerfReader* reader) {
+  reader->InjectIndexedBuildIDs(build_ids, {kKernelBuildIdFilename});
+  AliasKernelBuildIDs(reader);
+}
+
+// Adds the counts of the events of |perf_data| and the sizes of |profiles| to
+// |stats|.
+void CountConversion(const quipper::PerfDataProto& perf_data,
+                     const ProcessProfiles& profiles, ConversionStats* stats) {
+  for (const auto& event : perf_data.events()) {
+    ++stats->events_by_type[event.header().type()];
+  }
+  stats->profiles = profiles.size();
+  for (const auto& pp : profiles) {
+    stats->profile_samples += pp->data.sample_size();
+    stats->profile_locations += pp->data.location_size();
+    stats->profile_functions += pp->data.function_size();
+    stats->profile_mappings += pp->data.mapping_size();
+    stats->marshaled_bytes += pp->marshaled_data.size();
+  }
+}
+
+}  // namespace
+
+ProfileCapacities EstimateProfileCapacities(
+    const quipper::PerfDataProto& perf_data) {
+  // The pid of the mmaps of the kernel and its modules, which are mapped in
+  // every process.
+  constexpr uint32_t kKernelPid = std::numeric_limits<uint32_t>::max();
+  ProfileCapacities capacities;
+  uint64_t kernel_mmaps = 0;
+  for (const auto& event : perf_data.events()) {
+    if (event.has_sample_event()) {
+      ProfileCapacity& capacity = capacities[event.sample_event().pid()];
+      ++capacity.samples;
+      ++capacity.locations;
+    } else if (event.has_mmap_event()) {
+      const uint32_t pid = event.mmap_event().pid();
+      if (pid == kKernelPid) {
+        ++kernel_mmaps;
+      } else {
+        ++capacities[pid].mappings;
+      }
+    }
+  }
+  for (auto& it : capacities) {
+    it.second.mappings += kernel_mmaps;
+  }
+  return capacities;
+}
+
+ProcessProfiles PerfDataProtoToProfiles(
+    const quipper::PerfDataProto* perf_data, const ConversionParams& params,
+    std::string_view perf_data_input, const ProfileCapacities* capacities) {
+  const uint32_t options = params.options;
+  const int num_threads = params.num_threads;
+  ConversionStats* stats = params.stats;
+  PerfDataHandler::NormalizationStats* normalization =
+      stats != nullptr ? &stats->normalization : nullptr;
+  ProfileCapacities estimated;
+  if (capacities == nullptr) {
+    estimated = EstimateProfileCapacities(*perf_data);
+    capacities = &estimated;
+  }
+  ProcessProfiles profiles;
+  if (num_threads > 1 && (options & (kGroupByPids | kPerCpuSamples)) &&
+      !(options & kGroupByCgroup)) {
+    ShardedPerfDataConverter converter(
+        *perf_data, params.sample_labels, options, params.thread_types,
+        params.timestamp_bucket_ns, params.downsample_rate,
+        params.downsample_seed, num_threads);
+    converter.SetCapacities(capacities);
+    {
+      quipper::ScopedPhaseTimer timer(stats ? &stats->normalize : nullptr);
+      PerfDataHandler::Process(*perf_data, &converter, num_threads,
+                               params.spe_filter, normalization,
+                               perf_data_input);
+    }
+    quipper::ScopedPhaseTimer timer(stats ? &stats->finalize : nullptr);
+    profiles = converter.Profiles(params.executor);
+  } else {
+    PerfDataConverter converter(*perf_data, params.sample_labels, options,
+                                params.thread_types, params.timestamp_bucket_ns,
+                                params.downsample_rate, params.downsample_seed);
+    converter.SetCapacities(capacities);
+    {
+      quipper::ScopedPhaseTimer timer(stats ? &stats->normalize : nullptr);
+      PerfDataHandler::Process(*perf_data, &converter, num_threads,
+                               params.spe_filter, normalization,
+                               perf_data_input);
+    }
+    quipper::ScopedPhaseTimer timer(stats ? &stats->finalize : nullptr);
+    profiles = converter.Profiles(num_threads, params.executor);
+  }
+  if (stats != nullptr) {
+    stats->convert = stats->normalization.handler_samples;
+    CountConversion(*perf_data, profiles, stats);
+  }
+  return profiles;
+}
 
+ProcessProfiles PerfDataProtoToProfiles(
+    const quipper::PerfDataProto* perf_data, const uint32_t sample_labels,
+    const uint32_t options, const std::map<Tid, std::string>& thread_types) {
+  ConversionParams params;
+  params.sample_labels = sample_labels;
+  params.options = options;
+  params.thread_types = thread_types;
+  return PerfDataProtoToProfiles(perf_data, params);
+}
+
+void PerfDataProtoToProfiles(const quipper::PerfDataProto* perf_data,
+                             const ProfileCallback& callback,
+                             const ConversionParams& params) {
+  PerfDataConverter converter(*perf_data, params.sample_labels, params.options,
+                              params.thread_types, params.timestamp_bucket_ns,
+                              params.downsample_rate, params.downsample_seed);
+  const ProfileCapacities capacities = EstimateProfileCapacities(*perf_data);
+  converter.SetCapacities(&capacities);
+  converter.SetProfileCallback(callback, /*max_profile_bytes=*/0);
+  PerfDataHandler::Process(*perf_data, &converter, params.num_threads,
+                           params.spe_filter);
+  for (auto& pp : converter.Profiles(params.num_threads)) {
+    callback(std::move(pp));
+  }
+}
+
+namespace {
+
+// Parses the perf data read by |reader| and converts it, for
+// ReadRawPerfDataToProfiles() and PerfReaderToProfiles(). |raw| is the input
+// that |reader| references, if any.
+template <typename BuildIds>
+ProcessProfiles ParsePerfReaderToProfiles(
+    quipper::PerfReader* reader, std::string_view raw,
+    const BuildIds& build_ids, const ConversionParams& params) {
+  ConversionStats* const stats = params.stats;
   // Use PerfParser to modify reader's events to have magic done to them such
   // as hugepage deduction and sorting events based on time, if timestamps are
   // present.
   quipper::PerfParserOptions opts;
   opts.sort_events_by_time = true;
+  // The samples are aggregated in any order, but those kept by downsampling
+  // depend on it.
+  opts.keep_unordered_samples = params.downsample_rate <= 1;
+  opts.sort_only_state_events = params.options & kPerCpuSamples;
   opts.deduce_huge_page_mappings = true;
   opts.combine_mappings = true;
-  opts.allow_unaligned_jit_mappings = options & kAllowUnalignedJitMappings;
-  quipper::PerfParser parser(&reader, opts);
-  if (!parser.ParseRawEvents()) {
-    LOG(ERROR) << "Could not parse perf events.";
+  opts.allow_unaligned_jit_mappings =
+      params.options & kAllowUnalignedJitMappings;
+  // The events are mapped again when they are normalized.
+  opts.map_events = false;
+  opts.num_threads = params.num_threads;
+  opts.executor = params.executor;
+  quipper::PerfParser parser(reader, opts);
+  {
+    quipper::ScopedPhaseTimer timer(stats ? &stats->parse : nullptr);
+    PrepareBuildIDs(build_ids, reader);
+    if (!parser.ParseRawEvents()) {
+      LOG(ERROR) << "Could not parse perf events.";
+      return ProcessProfiles();
+    }
+  }
+  if (stats != nullptr) {
+    stats->sort = parser.times().sort;
+    stats->huge_page_deduction = parser.times().huge_page_deduction;
+    stats->combine_mappings = parser.times().combine_mappings;
+    stats->arena_bytes = reader->arena_space_allocated();
+    stats->read_warnings = reader->warnings();
+  }
+
+  // The samples are mapped when they are normalized, so the share of them
+  // that PerfParser would have required to be mapped is checked then.
+  ConversionStats local_stats;
+  ConversionParams local_params;
+  const ConversionParams* convert_params = &params;
+  if (stats == nullptr) {
+    local_params = params;
+    local_params.stats = &local_stats;
+    convert_params = &local_params;
+  }
+  ProcessProfiles profiles =
+      PerfDataProtoToProfiles(&reader->proto(), *convert_params, raw);
+  const PerfDataHandler::NormalizationStats& normalization =
+      convert_params->stats->normalization;
+  const int64_t recorded = normalization.recorded_samples;
+  const int64_t mapped = normalization.mapped_samples;
+  const float threshold = opts.sample_mapping_percentage_threshold;
+  if (recorded > 0 && mapped * 100. < threshold * recorded) {
+    LOG(ERROR) << "Only " << mapped * 100 / recorded
+               << "% of samples had all locations mapped to a module, "
+               << "expected at least " << static_cast<int>(threshold) << "%";
+    return ProcessProfiles();
+  }
+  return profiles;
+}
+
+// RawPerfDataToProfiles() or IndexedRawPerfDataToProfiles().
+template <typename BuildIds>
+ProcessProfiles ReadRawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size, const BuildIds& build_ids,
+    const ConversionParams& params) {
+  ConversionStats* const stats = params.stats;
+  quipper::PerfReader reader(
+      quipper::PerfReader::ArenaOptionsForInputSize(raw_size));
+  if (params.num_threads > 1) reader.SetNumDecodeThreads(params.num_threads);
+  reader.SetProcessFilter(params.process_filter);
+  reader.SetSampleFields(ConvertedSampleFields(params.options));
+  // The trace data is decoded straight out of |raw|, which outlives the
+  // conversion, and the metadata that isn't converted is left there.
+  reader.SetReferenceAuxtraceData(true);
+  reader.SetLazyMetadata(true);
+  {
+    quipper::ScopedPhaseTimer timer(stats ? &stats->read : nullptr);
+    if (!reader.ReadFromPointer(reinterpret_cast<const char*>(raw),
+                                raw_size)) {
+      LOG(ERROR) << "Could not read input perf.data";
+      return ProcessProfiles();
+    }
+  }
+  if (stats != nullptr) stats->bytes_read = raw_size;
+
+  return ParsePerfReaderToProfiles(
+      &reader, std::string_view(reinterpret_cast<const char*>(raw), raw_size),
+      build_ids, params);
+}
+
+}  // namespace
+
+ProcessProfiles RawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params) {
+  return ReadRawPerfDataToProfiles(raw, raw_size, build_ids, params);
+}
+
+ProcessProfiles RawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const uint32_t sample_labels, const uint32_t options,
+    const std::map<Tid, std::string>& thread_types) {
+  ConversionParams params;
+  params.sample_labels = sample_labels;
+  params.options = options;
+  params.thread_types = thread_types;
+  return ReadRawPerfDataToProfiles(raw, raw_size, build_ids, params);
+}
+
+ProcessProfiles IndexedRawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size,
+    const quipper::BuildIdIndex& build_ids, const ConversionParams& params) {
+  return ReadRawPerfDataToProfiles(raw, raw_size, build_ids, params);
+}
+
+ProcessProfiles PerfReaderToProfiles(
+    quipper::PerfReader* reader,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params) {
+  return ParsePerfReaderToProfiles(reader, std::string_view(), build_ids,
+                                   params);
+}
+
+ProcessProfiles ChunkedPerfDataProtoFileToProfiles(
+    const std::string& filename, const ConversionParams& params) {
+  quipper::ChunkedProtobufReader reader;
+  if (!reader.Open(filename)) return ProcessProfiles();
+  PerfDataConverter converter(reader.header(), params.sample_labels,
+                              params.options, params.thread_types,
+                              params.timestamp_bucket_ns,
+                              params.downsample_rate, params.downsample_seed);
+  std::unique_ptr<PerfDataHandler::EventStream> stream =
+      PerfDataHandler::CreateEventStream(reader.header(), &converter,
+                                         params.spe_filter);
+  quipper::PerfDataProto chunk;
+  while (reader.ReadChunk(&chunk)) {
+    for (const auto& event : chunk.events()) stream->ProcessEvent(event);
+  }
+  if (reader.failed()) {
+    LOG(ERROR) << "Could not read " << filename;
     return ProcessProfiles();
   }
+  stream->Finish();
+  return converter.Profiles();
+}
+
+// The state that PerfDataConversionSession keeps across the chunks.
+class PerfDataConversionSession::Impl {
+ public:
+  explicit Impl(const ConversionParams& params)
+      : params_(params), process_filter_(params.process_filter) {}
+
+  ProcessProfiles AddChunk(const void* raw, uint64_t raw_size,
+                           const std::map<std::string, std::string>& build_ids);
+
+  void SetProfileCallback(ProfileCallback callback,
+                          uint64_t max_profile_bytes) {
+    profile_callback_ = std::move(callback);
+    max_profile_bytes_ = max_profile_bytes;
+  }
+
+  void EnableSnapshots() { snapshots_ = true; }
+
+  ProcessProfiles Snapshot();
+
+ private:
+  // Hands |event| to the stream, holding |mutex_| with snapshots enabled.
+  void ProcessEvent(const quipper::PerfDataProto::PerfEvent& event) {
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+    if (snapshots_) lock.lock();
+    stream_->ProcessEvent(event);
+  }
+
+  const ConversionParams params_;
+  // The processes selected by the chunks read so far, in addition to those
+  // of the original filter.
+  quipper::PerfReader::ProcessFilter process_filter_;
+  ProfileCallback profile_callback_;
+  uint64_t max_profile_bytes_ = 0;
+
+  // The reader of the last chunk, whose proto the converter and the stream
+  // refer to until the next chunk is started.
+  std::unique_ptr<quipper::PerfReader> reader_;
+  std::unique_ptr<PerfDataConverter> converter_;
+  std::unique_ptr<PerfDataHandler::EventStream> stream_;
+
+  bool snapshots_ = false;
+  // Guards the converter and the stream, the chunk proto and the pending
+  // profiles with snapshots enabled.
+  std::mutex mutex_;
+  // The proto of the chunk being added, if any.
+  const quipper::PerfDataProto* chunk_proto_ = nullptr;
+  // The profiles of the chunks added since the last snapshot, not marshaled.
+  ProcessProfiles pending_;
+};
 
-  return PerfDataProtoToProfiles(&reader.proto(), sample_labels, options,
-                                 thread_types);
+ProcessProfiles PerfDataConversionSession::Impl::Snapshot() {
+  ProcessProfiles pps;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pps = std::move(pending_);
+    pending_.clear();
+    if (chunk_proto_ != nullptr) {
+      for (auto& pp : converter_->Profiles()) pps.push_back(std::move(pp));
+      converter_->StartChunk(*chunk_proto_);
+    }
+  }
+  // Marshaled after the lock is released, so that the conversion goes on
+  // meanwhile.
+  if (params_.options & kMarshalProfiles) {
+    for (auto& pp : pps) {
+      if (!ProfileBuilder::Marshal(pp->data, &pp->marshaled_data)) {
+        LOG(ERROR) << "Could not marshal the profile of PID " << pp->pid;
+        pp->marshaled_data.clear();
+      }
+    }
+  }
+  return pps;
+}
+
+ProcessProfiles PerfDataConversionSession::Impl::AddChunk(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids) {
+  typedef std::unique_ptr<quipper::PerfDataProto::PerfEvent> EventPtr;
+  std::unique_ptr<quipper::PerfReader> reader(new quipper::PerfReader);
+  reader->SetProcessFilter(process_filter_);
+  reader->SetSampleFields(ConvertedSampleFields(params_.options));
+  bool started = false;
+  // Restores the time order of the events across the per-CPU ring buffers,
+  // like the sort done by PerfParser, if the events have timestamps.
+  std::unique_ptr<quipper::EventReorderer<EventPtr>> reorderer;
+  int64_t late_events = 0;
+  // The metadata has been read by the time the first event is delivered.
+  auto start_stream = [&]() {
+    PrepareBuildIDs(build_ids, reader.get());
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+    if (snapshots_) lock.lock();
+    chunk_proto_ = &reader->proto();
+    if (stream_ == nullptr) {
+      // With snapshots enabled, Snapshot() marshals the profiles.
+      converter_.reset(new PerfDataConverter(
+          reader->proto(), params_.sample_labels,
+          snapshots_ ? params_.options & ~kMarshalProfiles : params_.options,
+          params_.thread_types, params_.timestamp_bucket_ns,
+          params_.downsample_rate, params_.downsample_seed));
+      if (profile_callback_) {
+        converter_->SetProfileCallback(profile_callback_, max_profile_bytes_);
+      }
+      stream_ = PerfDataHandler::CreateEventStream(
+          reader->proto(), converter_.get(), params_.spe_filter);
+    } else {
+      converter_->StartChunk(reader->proto());
+      stream_->StartChunk(reader->proto());
+    }
+    // The previous chunk is no longer referred to.
+    reader_.reset();
+    started = true;
+    bool has_timestamps = true;
+    for (const auto& attr : reader->attrs()) {
+      if (!(attr.attr().sample_type() & quipper::PERF_SAMPLE_TIME)) {
+        has_timestamps = false;
+        break;
+      }
+    }
+    if (has_timestamps) {
+      reorderer.reset(new quipper::EventReorderer<EventPtr>(
+          [this](EventPtr event) { ProcessEvent(*event); }));
+    }
+  };
+  reader->SetEventCallback(
+      [&](const quipper::PerfDataProto::PerfEvent& event) {
+        if (!started) start_stream();
+        if (reorderer == nullptr) {
+          ProcessEvent(event);
+        } else if (event.header().type() ==
+                   quipper::PERF_RECORD_FINISHED_ROUND) {
+          reorderer->FinishRound();
+        } else if (event.timestamp() == 0 ||
+                   !reorderer->InOrder(event.timestamp())) {
+          // A full sort would place the events without a timestamp first.
+          // Late events can't be reordered anymore, so handle them right
+          // away.
+          late_events += event.timestamp() != 0;
+          ProcessEvent(event);
+        } else {
+          reorderer->Push(event.timestamp(),
+                          EventPtr(new quipper::PerfDataProto::PerfEvent(
+                              event)));
+        }
+        return true;
+      });
+  const bool ok =
+      reader->ReadFromPointer(reinterpret_cast<const char*>(raw), raw_size);
+  process_filter_ = reader->process_filter();
+  // The converter and the stream refer to the proto of a chunk that was cut
+  // short until the next one is started.
+  if (started) reader_ = std::move(reader);
+  if (!ok) {
+    LOG(ERROR) << "Could not read input perf.data";
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunk_proto_ = nullptr;
+    return ProcessProfiles();
+  }
+  if (!started) start_stream();
+  if (reorderer != nullptr) reorderer->Flush();
+  if (late_events > 0) {
+    LOG(WARNING) << late_events << " events arrived after their round and "
+                 << "were processed out of time order.";
+  }
+  if (!snapshots_) {
+    stream_->Finish();
+    chunk_proto_ = nullptr;
+    return converter_->Profiles();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  stream_->Finish();
+  for (auto& pp : converter_->Profiles()) pending_.push_back(std::move(pp));
+  chunk_proto_ = nullptr;
+  return ProcessProfiles();
+}
+
+PerfDataConversionSession::PerfDataConversionSession(
+    const ConversionParams& params)
+    : impl_(new Impl(params)) {}
+
+PerfDataConversionSession::~PerfDataConversionSession() {}
+
+void PerfDataConversionSession::SetProfileCallback(
+    ProfileCallback callback, const uint64_t max_profile_bytes) {
+  impl_->SetProfileCallback(std::move(callback), max_profile_bytes);
+}
+
+void PerfDataConversionSession::EnableSnapshots() { impl_->EnableSnapshots(); }
+
+ProcessProfiles PerfDataConversionSession::Snapshot() {
+  return impl_->Snapshot();
+}
+
+ProcessProfiles PerfDataConversionSession::AddChunk(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids) {
+  return impl_->AddChunk(raw, raw_size, build_ids);
+}
+
+ProcessProfiles StreamingRawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params) {
+  PerfDataConversionSession session(params);
+  return session.AddChunk(raw, raw_size, build_ids);
 }
 
 }  // namespace perftools
@@ -8,11 +8,20 @@
 #ifndef PERFTOOLS_PERF_DATA_CONVERTER_H_
 #define PERFTOOLS_PERF_DATA_CONVERTER_H_
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "src/profile.pb.h"
 #include "src/perf_data_handler.h"
+#include "src/quipper/build_id_index.h"
+#include "src/quipper/compat/thread_pool.h"
+#include "src/quipper/perf_reader.h"
+#include "src/quipper/phase_timer.h"
+#include "src/quipper/warning_counts.h"
 
 namespace quipper {
 class PerfDataProto;
@@ -90,6 +99,8 @@ const char SnoopStatusLabelKey[] = "snoop_status";
 const char TotalLatencyLabelKey[] = "total_latency";
 const char IssueLatencyLabelKey[] = "issue_latency";
 const char TranslationLatencyLabelKey[] = "translation_latency";
+// With kEventLabels, the key of the label naming the event of a sample.
+const char EventLabelKey[] = "event";
 
 // Execution mode label values.
 const char ExecutionModeHostKernel[] = "Host Kernel";
@@ -117,12 +128,65 @@ enum ConversionOptions {
   kAddDataAddressFrames = 8,
   // Whether to drop synthetic samples representing lost events/lost samples.
   kDropLostEvents = 16,
+  // Whether to also serialize and compress each profile, like
+  // perftools::profiles::Builder::Marshal() does, into
+  // ProcessProfile::marshaled_data. With more than one thread, the profiles
+  // are finalized and marshaled concurrently.
+  kMarshalProfiles = 32,
+  // Whether to produce one profile per cgroup of the samples, plus one for the
+  // samples without a cgroup, instead of one per process. Takes precedence
+  // over kGroupByPids.
+  kGroupByCgroup = 64,
+  // Whether to give each sample only the sample and event counts of its own
+  // event, as the values of the sample types "sample" and "event", with a
+  // label with key EventLabelKey and string value set to the event's name,
+  // instead of two values for each event of the perf data. The samples of
+  // different events are kept apart. Profiles of perf data with many events
+  // take a fraction of the memory and size, but each sample type sums up the
+  // counts of all the events, which are only told apart by their labels.
+  kEventLabels = 128,
+  // Whether to give each sample only its sampled address as its stack, plus
+  // its data address with kAddDataAddressFrames, for flat profiles of self
+  // time. The callchains and branch stacks are neither read nor normalized,
+  // which takes a fraction of the time for deep stacks.
+  kLeafOnly = 256,
+  // With kAddDataAddressFrames, whether to give the data addresses of the
+  // same cache line, of kDataAddressCacheLineBytes, or of the same page, of
+  // kDataAddressPageBytes, a single location, at the start of the line or page
+  // in the file offsets of their mapping, so that profiles of memory accesses
+  // have a location per line or page touched rather than per address. Pages
+  // take precedence over cache lines.
+  kDataAddressCacheLines = 512,
+  kDataAddressPages = 1024,
+  // Whether to aggregate the samples in the order each CPU recorded them, for
+  // large host-wide captures whose samples far outnumber their mmaps, comms,
+  // forks and exits. Only those events are sorted by time, and each sample
+  // is processed after the last of them no later than it, see
+  // quipper::PerfReader::MaybeSortStateEventsByTime(). With num_threads > 1,
+  // the samples of each CPU are aggregated on the thread of that CPU, whatever
+  // their process, and the profiles of each process built on different
+  // threads are then merged, as by perftools::profiles::ProfileMerger, so
+  // that the conversion scales with the threads even if one process takes
+  // most of the samples. The profiles have the same samples, though not in
+  // the same order, nor are their locations and mappings. If the profiles of
+  // a process can't be merged, they are all returned, unmerged, with an
+  // error logged. With downsampling, the samples kept are picked in that
+  // order. Has no effect with kGroupByCgroup.
+  kPerCpuSamples = 2048,
 };
 
+// The sizes of the buckets of data addresses, see kDataAddressCacheLines and
+// kDataAddressPages.
+constexpr uint64_t kDataAddressCacheLineBytes = 64;
+constexpr uint64_t kDataAddressPageBytes = 4096;
+
 struct ProcessProfile {
   // Process PID or 0 if no process grouping was requested.
   // PIDs can duplicate if there was a PID reuse during the profiling session.
   uint32_t pid = 0;
+  // With kGroupByCgroup, the cgroup path of the samples of the profile, or
+  // empty for those without a cgroup.
+  std::string cgroup;
   // Profile proto data.
   perftools::profiles::Profile data;
   // Min timestamp of a sample, in nanoseconds since boot, or 0 if unknown.
@@ -134,38 +198,305 @@ struct ProcessProfile {
   // equal to the total number of frames + IP in the profile, weighted by
   // sample count.
   BuildIdStats build_id_stats;
+  // The gzipped, serialized profile if kMarshalProfiles was requested.
+  // Empty otherwise, or if the profile could not be marshaled.
+  std::string marshaled_data;
 };
 
 // Type alias for a random access sequence of owned ProcessProfile objects.
 using ProcessProfiles = std::vector<std::unique_ptr<ProcessProfile>>;
 
-// Converts raw Linux perf data to a vector of process profiles.
-//
-// sample_labels is the OR-product of all SampleLabels desired in the output
-// profiles. options governs other conversion options such as whether per-PID
-// profiles should be returned or all processes should be merged into the same
-// profile.
+// Takes a profile that is done before the end of a conversion, see
+// PerfDataConversionSession::SetProfileCallback().
+using ProfileCallback = std::function<void(std::unique_ptr<ProcessProfile>)>;
+
+// The threads that conversions run their parallel work on. One executor can be
+// shared by any number of concurrent conversions, e.g. in a service, which
+// then use no more threads than it has, however many they are.
+using ConversionExecutor = quipper::ThreadPool;
+
+// The expected size of the profile of a process, which a conversion reserves
+// the samples, locations and mappings of the profile, and the maps it looks
+// them up in, for up front, instead of growing them one at a time.
+struct ProfileCapacity {
+  // The distinct samples, before downsampling.
+  uint64_t samples = 0;
+  uint64_t locations = 0;
+  uint64_t mappings = 0;
+};
+
+// The expected sizes of the profiles of a conversion, by pid. The profiles of
+// several processes, without kGroupByPids, are reserved for the sum of their
+// sizes, and those of cgroups, with kGroupByCgroup, aren't reserved.
+using ProfileCapacities = std::unordered_map<uint32_t, ProfileCapacity>;
+
+// Estimates the sizes of the profiles of |perf_data| from a count of the
+// samples and mmaps of each process, taking the samples as the bound of the
+// distinct samples and of the locations.
+ProfileCapacities EstimateProfileCapacities(
+    const quipper::PerfDataProto& perf_data);
+
+// Where a conversion spent its time and what it went through, so that slow
+// conversions can be attributed to their inputs. The phases that a
+// conversion doesn't go through are left at 0. In programs that count their
+// allocations, see quipper::CountAllocation(), the phases also have the
+// allocations made during them.
+struct ConversionStats {
+  // Reading the perf data into a PerfDataProto.
+  quipper::PhaseTime read;
+  // The passes of quipper::PerfParser over the events.
+  quipper::PhaseTime sort;
+  quipper::PhaseTime huge_page_deduction;
+  quipper::PhaseTime combine_mappings;
+  // Injecting the build IDs and all the passes above.
+  quipper::PhaseTime parse;
+  // Normalizing the events, which includes converting the samples.
+  quipper::PhaseTime normalize;
+  // Aggregating the samples into the profiles. With num_threads > 1 and
+  // kGroupByPids or kPerCpuSamples, this is only handing them to the threads
+  // that do it.
+  quipper::PhaseTime convert;
+  // Finalizing, and with kMarshalProfiles marshaling, the profiles.
+  quipper::PhaseTime finalize;
+
+  // The size of the raw perf data, and of the arena its proto was read on.
+  uint64_t bytes_read = 0;
+  uint64_t arena_bytes = 0;
+  // The number of events of each PERF_RECORD_* type converted.
+  std::map<uint32_t, uint64_t> events_by_type;
+  // The events skipped or read in part while reading the perf data.
+  quipper::WarningCounts read_warnings;
+
+  // The profiles returned, and their sizes in total.
+  uint64_t profiles = 0;
+  uint64_t profile_samples = 0;
+  uint64_t profile_locations = 0;
+  uint64_t profile_functions = 0;
+  uint64_t profile_mappings = 0;
+  uint64_t marshaled_bytes = 0;
+
+  PerfDataHandler::NormalizationStats normalization;
+};
+
+// The parameters of a conversion, the same for every entry point. Those that
+// an entry point doesn't support are ignored, as described for it.
+struct ConversionParams {
+  // The OR-product of all SampleLabels desired in the output profiles.
+  uint32_t sample_labels = kNoLabels;
+  // The OR-product of the ConversionOptions, such as whether per-PID profiles
+  // should be returned or all processes should be merged into the same
+  // profile.
+  uint32_t options = kGroupByPids;
+  // A map of TIDs to opaque strings of the caller's choosing. When
+  // sample_labels & kThreadTypeLabel != 0, any sample generated by a TID in
+  // |thread_types| will be labelled with
+  // {key=ThreadTypeLabelKey, value=thread_types[$tid]}. If sample_labels
+  // doesn't include ThreadTypeLabelKey *or* the TID is not in |thread_types|,
+  // no ThreadTypeLabelKey will be applied to the sample.
+  std::map<uint32_t, std::string> thread_types;
+  // With num_threads > 1, large data sections are decoded on up to
+  // num_threads threads, and the profiles are finalized, and marshaled with
+  // kMarshalProfiles, on as many threads. With kGroupByPids, the profiles of
+  // different processes are also built concurrently. The resulting profiles
+  // are the same. With kPerCpuSamples, the samples of different CPUs are
+  // aggregated concurrently instead, see kPerCpuSamples.
+  int num_threads = 1;
+  // With timestamp_bucket_ns > 0 and kTimestampNsLabel, sample timestamps are
+  // rounded down to a multiple of timestamp_bucket_ns, so that samples which
+  // only differ by their time within a bucket are aggregated into one. The
+  // TimestampNsLabelKey labels are then the starts of the buckets, and the
+  // profiles have a "timestamp-bucket-ns:<width>" comment.
+  uint64_t timestamp_bucket_ns = 0;
+  // With downsample_rate > 1, about one in downsample_rate of the samples of
+  // each process are kept, and the values of the kept samples are multiplied
+  // by downsample_rate, so that the totals are preserved in expectation.
+  // Which samples are kept only depends on downsample_seed and on the order
+  // of the samples of each process, so the result is the same on every run.
+  // The other samples are dropped before they are normalized, which makes
+  // the conversion faster in proportion. The profiles have a
+  // "downsample-rate:<rate>" comment.
+  uint32_t downsample_rate = 1;
+  uint64_t downsample_seed = 0;
+  // Only the Arm SPE records that spe_filter keeps, e.g. the loads that miss
+  // the last level cache, are turned into samples. The others are skipped as
+  // they are decoded.
+  quipper::ArmSpeDecoder::RecordFilter spe_filter;
+  // Only the events of the processes that process_filter selects are kept,
+  // see quipper::PerfReader::SetProcessFilter(). The others are dropped as
+  // they are decoded, so converting the profile of one service out of a
+  // host-wide recording takes time in proportion to the samples of that
+  // service. The data section is then decoded on a single thread.
+  quipper::PerfReader::ProcessFilter process_filter;
+  // If not null, the time spent in each phase of the conversion and its
+  // counters are stored in it.
+  ConversionStats* stats = nullptr;
+  // If not null, the work spread over num_threads threads runs as tasks on
+  // it instead of on threads of the conversion's own, so that many
+  // concurrent conversions can share its threads. The data section is still
+  // decoded on threads of its own, see quipper::PerfReader::
+  // SetNumDecodeThreads(). The resulting profiles are the same.
+  ConversionExecutor* executor = nullptr;
+};
+
+// Converts raw Linux perf data to a vector of process profiles, as described
+// by |params|.
 //
-// thread_types is map of TIDs to opaque strings of the caller's choosing.
-// When sample_labels & kThreadTypeLabel != 0, any sample generated by a TID
-// in |thread_types| will be labelled with
-// {key=ThreadTypeLabelKey, value=thread_types[$tid]}.
-// If sample_labels doesn't include ThreadTypeLabelKey *or* the TID is not in
-// |thread_types|, no ThreadTypeLabelKey will be applied to the sample.
+// Conversions don't share any mutable state, so any number of them can run
+// concurrently in one process, along with changes of the logging level. The
+// one-time initialization of libelf and the constants computed on first use
+// are thread-safe, and the md5 cache is per thread. The build IDs can be
+// shared too, as a quipper::BuildIdIndex, see IndexedRawPerfDataToProfiles().
 //
-// Returns a vector of process profiles, empty if any error occurs.
+// Returns a vector of process profiles, empty if any error occurs, or if less
+// than quipper::PerfParserOptions::sample_mapping_percentage_threshold percent
+// of the samples recorded have all their addresses mapped.
+extern ProcessProfiles RawPerfDataToProfiles(
+    const void* raw, uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params);
+
+// Same as above, with the other parameters left at their defaults.
 extern ProcessProfiles RawPerfDataToProfiles(
     const void* raw, uint64_t raw_size,
     const std::map<std::string, std::string>& build_ids,
     uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
     const std::map<uint32_t, std::string>& thread_types = {});
 
-// Converts a PerfDataProto to a vector of process profiles.
+// Same as RawPerfDataToProfiles(), but takes the build IDs prepared once in
+// |build_ids|, which can be shared by many conversions. Only the build IDs of
+// the files that the perf data mentions are injected into it.
+extern ProcessProfiles IndexedRawPerfDataToProfiles(
+    const void* raw, uint64_t raw_size, const quipper::BuildIdIndex& build_ids,
+    const ConversionParams& params = {});
+
+// Same as RawPerfDataToProfiles(), for the perf data already read by |reader|,
+// e.g. piped perf data fed to quipper::PerfReader::Feed() as it arrived. The
+// events of |reader| are parsed in place. The process filter, and the
+// decoding threads, are those already set on |reader|.
+extern ProcessProfiles PerfReaderToProfiles(
+    quipper::PerfReader* reader,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params = {});
+
+// Streaming variant of RawPerfDataToProfiles(). The events are decoded,
+// normalized and aggregated one at a time instead of being materialized in a
+// PerfDataProto first, so memory use is proportional to the size of the
+// resulting profiles rather than to the number of events. Events are put back
+// in time order within the window bounded by the PERF_RECORD_FINISHED_ROUND
+// events that "perf record" writes; input without them must already be in
+// time order, e.g. recorded with a single ring buffer or rewritten by
+// "perf inject --ordered". Huge page mapping deduction and
+// mapping combining, which need the whole event stream, are not done. Since
+// the mmaps aren't known when |build_ids| are injected, build IDs for files
+// without a build ID event are injected with kernel misc bits. Piped perf data
+// is not supported. num_threads, stats and executor are ignored.
+//
+// Returns a vector of process profiles, empty if any error occurs.
+extern ProcessProfiles StreamingRawPerfDataToProfiles(
+    const void* raw, uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const ConversionParams& params = {});
+
+// Converts a recording that was split into several perf.data files, e.g. the
+// files written one after the other by "perf record --switch-output", into
+// one vector of process profiles per file. The files are converted the way
+// StreamingRawPerfDataToProfiles() converts one. The mmaps, comms and build
+// IDs of the earlier files are kept, so that the samples of a file are
+// attributed to the mappings and processes that perf only recorded in an
+// earlier one, without the earlier files being read again.
+class PerfDataConversionSession {
+ public:
+  // |params| are as described for StreamingRawPerfDataToProfiles().
+  explicit PerfDataConversionSession(const ConversionParams& params = {});
+  ~PerfDataConversionSession();
+
+  PerfDataConversionSession(const PerfDataConversionSession&) = delete;
+  PerfDataConversionSession& operator=(const PerfDataConversionSession&) =
+      delete;
+
+  // With kGroupByPids, hands the profile of a process to |callback| as soon
+  // as the process exits or execs, instead of holding it until AddChunk()
+  // returns, so that memory use is bounded by the profiles of the live
+  // processes. With max_profile_bytes > 0, when the profiles being built take
+  // more than about max_profile_bytes, the largest ones are also handed over,
+  // and the later samples of their processes go to new profiles. The
+  // profiles handed over are left out of those AddChunk() returns. Must be
+  // called before the first AddChunk().
+  void SetProfileCallback(ProfileCallback callback,
+                          uint64_t max_profile_bytes = 0);
+
+  // Holds the profiles of the chunks until Snapshot() hands them over,
+  // instead of returning them from AddChunk(), so that a long-lived session
+  // fed with the chunks of a continuous recording can produce rolling
+  // profiles without converting the recording again. Must be called before
+  // the first AddChunk().
+  void EnableSnapshots();
+
+  // With snapshots enabled, returns the profiles of the samples converted
+  // since the previous Snapshot(), including those of the chunk being added.
+  // Can be called from another thread while AddChunk() runs: the conversion
+  // of the chunk goes on into new profiles, so that each sample is in exactly
+  // one snapshot. The samples of a process in different chunks, or on both
+  // sides of a snapshot taken during a chunk, are in different profiles.
+  // Must not be called from the profile callback.
+  ProcessProfiles Snapshot();
+
+  // Converts the next file of the recording. Returns the profiles of the
+  // samples in that file only, none with snapshots enabled, empty if any
+  // error occurs.
+  ProcessProfiles AddChunk(const void* raw, uint64_t raw_size,
+                           const std::map<std::string, std::string>& build_ids);
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// Converts a PerfDataProto to a vector of process profiles, as described by
+// |params|. With num_threads > 1, the profiles are finalized and marshaled on
+// up to num_threads threads, and with kGroupByPids, the profiles of different
+// processes are also built on as many threads. The process filter is ignored,
+// and the read and parse phases of the stats are left as they are.
+// perf_data_input is the perf data the proto was read from, needed
+// if the reader referenced the auxtrace trace data in it, see
+// quipper::PerfReader::SetReferenceAuxtraceData(). The profiles are reserved
+// for |capacities|, if not null, and for EstimateProfileCapacities() of
+// |perf_data| otherwise.
+extern ProcessProfiles PerfDataProtoToProfiles(
+    const quipper::PerfDataProto* perf_data, const ConversionParams& params,
+    std::string_view perf_data_input = {},
+    const ProfileCapacities* capacities = nullptr);
+
+// Same as above, with the other parameters left at their defaults.
 extern ProcessProfiles PerfDataProtoToProfiles(
     const quipper::PerfDataProto* perf_data, uint32_t sample_labels = kNoLabels,
     uint32_t options = kGroupByPids,
     const std::map<uint32_t, std::string>& thread_types = {});
 
+// Like PerfDataProtoToProfiles(), but hands each profile to |callback| as soon
+// as it is complete instead of returning them all at the end, so that the
+// callers can marshal and upload them one at a time. With kGroupByPids, the
+// profile of a process is complete when the process exits or execs. The other
+// profiles are handed over at the end, in the order they would have been
+// returned in. The profiles of different processes are not built
+// concurrently, but the others are finalized on up to num_threads threads.
+// The process filter, stats and executor are ignored.
+extern void PerfDataProtoToProfiles(
+    const quipper::PerfDataProto* perf_data, const ProfileCallback& callback,
+    const ConversionParams& params = {});
+
+// Converts a file written by quipper::WriteChunkedProtobufToFile() to a vector
+// of process profiles. The chunks of events are read and handed to the
+// converter one at a time, so that memory use is bounded by the size of a
+// chunk and of the resulting profiles, and protos too large to be parsed whole
+// can be converted. The events are handled in the order they are stored.
+// |params| are as described for StreamingRawPerfDataToProfiles(), and the
+// process filter is ignored too.
+//
+// Returns a vector of process profiles, empty if any error occurs.
+extern ProcessProfiles ChunkedPerfDataProtoFileToProfiles(
+    const std::string& filename, const ConversionParams& params = {});
+
 }  // namespace perftools
 
 #endif  // PERFTOOLS_PERF_DATA_CONVERTER_H_
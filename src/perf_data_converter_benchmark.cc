@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Microbenchmarks of the stages of a conversion, on synthetic perf data. The
+// inputs are parameterized by the number of samples, the depth of their call
+// stacks and the number of processes they are spread over, e.g.:
+//   perf_data_converter_benchmark --benchmark_filter=Process
+//
+// The recording has one mmap of an executable per process, and samples whose
+// call stacks are drawn from a few hundred functions of it, like a CPU
+// profile of a host running a few services would.
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "src/quipper/base/logging.h"
+#include "src/builder.h"
+#include "src/intervalmap.h"
+#include "src/perf_data_converter.h"
+#include "src/perf_data_handler.h"
+#include "src/quipper/address_mapper.h"
+#include "src/quipper/arm_spe_decoder.h"
+#include "src/quipper/binary_data_utils.h"
+#include "src/quipper/compat/thread_pool.h"
+#include "src/quipper/kernel/perf_event.h"
+#include "src/quipper/kernel/perf_internals.h"
+#include "src/quipper/perf_data.pb.h"
+#include "src/quipper/perf_parser.h"
+#include "src/quipper/perf_reader.h"
+#include "src/quipper/sample_info_reader.h"
+#include <benchmark/benchmark.h>
+
+namespace perftools {
+namespace {
+
+const uint64_t kTextStart = 0x400000;
+const uint64_t kTextSize = 0x100000;
+// The number of distinct functions that the stacks are made of.
+const int kNumFunctions = 500;
+
+// The sample fields of the synthetic recordings.
+const uint64_t kSampleType =
+    quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+    quipper::PERF_SAMPLE_TIME | quipper::PERF_SAMPLE_PERIOD |
+    quipper::PERF_SAMPLE_CALLCHAIN;
+
+// Returns the address of a call in the |i|th function.
+uint64_t FunctionAddress(uint64_t i) {
+  return kTextStart + (i % kNumFunctions) * (kTextSize / kNumFunctions) + 0x10;
+}
+
+// Returns a recording of |num_samples| samples with |depth| frames, spread
+// over |num_pids| processes.
+quipper::PerfDataProto MakePerfData(int num_samples, int depth,
+                                    int num_pids) {
+  quipper::PerfDataProto perf_data;
+  auto* attr = perf_data.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_size(sizeof(quipper::perf_event_attr));
+  attr->set_sample_type(kSampleType);
+  perf_data.add_event_types()->set_name("cycles");
+  perf_data.add_metadata_mask(0);
+  for (int pid = 1; pid <= num_pids; ++pid) {
+    auto* event = perf_data.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_COMM);
+    auto* comm = event->mutable_comm_event();
+    comm->set_pid(pid);
+    comm->set_tid(pid);
+    comm->set_comm("service" + std::to_string(pid % 8));
+    event = perf_data.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap = event->mutable_mmap_event();
+    mmap->set_pid(pid);
+    mmap->set_tid(pid);
+    mmap->set_start(kTextStart);
+    mmap->set_len(kTextSize);
+    mmap->set_pgoff(0);
+    mmap->set_filename("/usr/bin/service" + std::to_string(pid % 8));
+  }
+  std::mt19937_64 random(42);
+  for (int i = 0; i < num_samples; ++i) {
+    auto* event = perf_data.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample = event->mutable_sample_event();
+    const int pid = 1 + i % num_pids;
+    sample->set_pid(pid);
+    sample->set_tid(pid);
+    sample->set_sample_time_ns(1000 * (i + 1));
+    sample->set_period(10000);
+    // The callers are the same for most samples, as in real profiles, and
+    // the leaves vary.
+    sample->set_ip(FunctionAddress(random()));
+    sample->add_callchain(quipper::PERF_CONTEXT_USER);
+    sample->add_callchain(sample->ip());
+    for (int frame = 1; frame < depth; ++frame) {
+      sample->add_callchain(
+          FunctionAddress(frame * 7 + (random() % 4 == 0 ? random() : 0)));
+    }
+  }
+  return perf_data;
+}
+
+// Returns the raw perf.data file of MakePerfData().
+std::string MakeRawPerfData(int num_samples, int depth, int num_pids) {
+  quipper::PerfReader reader;
+  CHECK(reader.Deserialize(MakePerfData(num_samples, depth, num_pids)));
+  std::string raw;
+  CHECK(reader.WriteToString(&raw));
+  return raw;
+}
+
+// Sets the number of samples processed by each iteration.
+void SetSamplesProcessed(benchmark::State& state, int64_t num_samples) {
+  state.SetItemsProcessed(state.iterations() * num_samples);
+}
+
+// {samples, stack depth, processes}.
+void ConversionArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"samples", "depth", "pids"});
+  b->Args({10000, 16, 1});
+  b->Args({10000, 64, 1});
+  b->Args({10000, 16, 100});
+  b->Args({100000, 32, 10});
+}
+
+void BM_ReadFromPointer(benchmark::State& state) {
+  const std::string raw =
+      MakeRawPerfData(state.range(0), state.range(1), state.range(2));
+  for (auto _ : state) {
+    quipper::PerfReader reader;
+    CHECK(reader.ReadFromPointer(raw.data(), raw.size()));
+    benchmark::DoNotOptimize(reader.events().size());
+  }
+  SetSamplesProcessed(state, state.range(0));
+  state.SetBytesProcessed(state.iterations() * raw.size());
+}
+BENCHMARK(BM_ReadFromPointer)->Apply(ConversionArgs);
+
+void BM_ParseRawEvents(benchmark::State& state) {
+  const std::string raw =
+      MakeRawPerfData(state.range(0), state.range(1), state.range(2));
+  quipper::PerfParserOptions options;
+  options.sort_events_by_time = true;
+  options.deduce_huge_page_mappings = true;
+  options.combine_mappings = true;
+  for (auto _ : state) {
+    state.PauseTiming();
+    quipper::PerfReader reader;
+    CHECK(reader.ReadFromPointer(raw.data(), raw.size()));
+    state.ResumeTiming();
+    quipper::PerfParser parser(&reader, options);
+    CHECK(parser.ParseRawEvents());
+  }
+  SetSamplesProcessed(state, state.range(0));
+}
+BENCHMARK(BM_ParseRawEvents)->Apply(ConversionArgs);
+
+void BM_ReadPerfSampleInfo(benchmark::State& state) {
+  const int depth = state.range(0);
+  quipper::perf_event_attr attr = {};
+  attr.sample_type = kSampleType;
+  quipper::SampleInfoReader reader(attr, /*read_cross_endian=*/false);
+  // IP, TID, TIME, PERIOD, then the number of callchain entries and the
+  // entries.
+  std::vector<uint64_t> event(1 + 4 + 1 + depth);
+  auto* header = reinterpret_cast<quipper::perf_event_header*>(event.data());
+  header->type = quipper::PERF_RECORD_SAMPLE;
+  header->size = event.size() * sizeof(uint64_t);
+  event[1] = FunctionAddress(0);
+  event[2] = (static_cast<uint64_t>(1) << 32) | 1;
+  event[3] = 1000;
+  event[4] = 10000;
+  event[5] = depth;
+  for (int i = 0; i < depth; ++i) event[6 + i] = FunctionAddress(i);
+  const auto& sample_event =
+      *reinterpret_cast<const quipper::event_t*>(event.data());
+  for (auto _ : state) {
+    quipper::perf_sample sample;
+    CHECK(reader.ReadPerfSampleInfo(sample_event, &sample));
+    benchmark::DoNotOptimize(sample.ip);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ReadPerfSampleInfo)->ArgName("depth")->Arg(16)->Arg(128);
+
+// Looks up addresses in |num_intervals| adjacent intervals, in random order.
+void BM_IntervalMapLookup(benchmark::State& state) {
+  const int num_intervals = state.range(0);
+  IntervalMap<int> map;
+  for (int i = 0; i < num_intervals; ++i) {
+    map.Set(kTextStart + i * 0x1000, kTextStart + (i + 1) * 0x1000, i);
+  }
+  std::mt19937_64 random(42);
+  std::vector<uint64_t> keys(4096);
+  for (auto& key : keys) key = kTextStart + random() % (num_intervals * 0x1000);
+  size_t i = 0;
+  for (auto _ : state) {
+    int value;
+    benchmark::DoNotOptimize(map.Lookup(keys[i++ % keys.size()], &value));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IntervalMapLookup)->ArgName("intervals")->Arg(16)->Arg(4096);
+
+void BM_AddressMapperLookup(benchmark::State& state) {
+  const int num_mappings = state.range(0);
+  quipper::AddressMapper mapper;
+  for (int i = 0; i < num_mappings; ++i) {
+    CHECK(mapper.MapWithID(kTextStart + i * 0x10000, 0x10000, i, 0,
+                           /*remove_existing_mappings=*/true,
+                           /*allow_unaligned_jit_mappings=*/false));
+  }
+  std::mt19937_64 random(42);
+  std::vector<uint64_t> keys(4096);
+  for (auto& key : keys) {
+    key = kTextStart + random() % (num_mappings * 0x10000);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    uint64_t mapped;
+    quipper::AddressMapper::MappingList::const_iterator it;
+    benchmark::DoNotOptimize(mapper.GetMappedAddressAndListIterator(
+        keys[i++ % keys.size()], &mapped, &it));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AddressMapperLookup)->ArgName("mappings")->Arg(16)->Arg(4096);
+
+// Counts the samples, to measure the normalization alone.
+class CountingHandler : public PerfDataHandler {
+ public:
+  bool Sample(const SampleContext& sample) override {
+    ++num_samples_;
+    return true;
+  }
+  void Comm(const CommContext& comm) override {}
+  void MMap(const MMapContext& mmap) override {}
+
+  int64_t num_samples() const { return num_samples_; }
+
+ private:
+  int64_t num_samples_ = 0;
+};
+
+void BM_Process(benchmark::State& state) {
+  const quipper::PerfDataProto perf_data =
+      MakePerfData(state.range(0), state.range(1), state.range(2));
+  for (auto _ : state) {
+    CountingHandler handler;
+    PerfDataHandler::Process(perf_data, &handler);
+    CHECK_EQ(handler.num_samples(), state.range(0));
+  }
+  SetSamplesProcessed(state, state.range(0));
+}
+BENCHMARK(BM_Process)->Apply(ConversionArgs);
+
+// The normalization and the aggregation of the samples by
+// PerfDataConverter::Sample(), with the profiles finalized.
+void BM_PerfDataProtoToProfiles(benchmark::State& state) {
+  const quipper::PerfDataProto perf_data =
+      MakePerfData(state.range(0), state.range(1), state.range(2));
+  for (auto _ : state) {
+    const ProcessProfiles profiles =
+        PerfDataProtoToProfiles(&perf_data, kNoLabels, kGroupByPids);
+    CHECK_EQ(profiles.size(), static_cast<size_t>(state.range(2)));
+  }
+  SetSamplesProcessed(state, state.range(0));
+}
+BENCHMARK(BM_PerfDataProtoToProfiles)->Apply(ConversionArgs);
+
+// The same, with the labels that make the most distinct samples.
+void BM_PerfDataProtoToProfilesWithLabels(benchmark::State& state) {
+  const quipper::PerfDataProto perf_data =
+      MakePerfData(state.range(0), state.range(1), state.range(2));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(PerfDataProtoToProfiles(
+        &perf_data, kPidAndTidLabels | kCommLabel | kTimestampNsLabel,
+        kGroupByPids));
+  }
+  SetSamplesProcessed(state, state.range(0));
+}
+BENCHMARK(BM_PerfDataProtoToProfilesWithLabels)->Apply(ConversionArgs);
+
+// Fills |builder| with a profile of |num_samples| samples with |depth|
+// frames, whose locations are yet to be assigned to their mappings.
+void FillProfile(int num_samples, int depth, profiles::Builder* builder) {
+  profiles::Profile* profile = builder->mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder->StringId("cycles"));
+  sample_type->set_unit(builder->StringId("count"));
+  profile->set_default_sample_type(sample_type->type());
+  for (int i = 0; i < 8; ++i) {
+    auto* mapping = profile->add_mapping();
+    mapping->set_id(i + 1);
+    mapping->set_memory_start(kTextStart + i * kTextSize);
+    mapping->set_memory_limit(kTextStart + (i + 1) * kTextSize);
+    mapping->set_filename(
+        builder->StringId(("/usr/lib/lib" + std::to_string(i)).c_str()));
+  }
+  for (int i = 0; i < 8 * kNumFunctions; ++i) {
+    auto* location = profile->add_location();
+    location->set_id(i + 1);
+    location->set_address(FunctionAddress(i) + (i / kNumFunctions) * kTextSize);
+  }
+  std::mt19937_64 random(42);
+  for (int i = 0; i < num_samples; ++i) {
+    auto* sample = profile->add_sample();
+    for (int frame = 0; frame < depth; ++frame) {
+      sample->add_location_id(1 + random() % profile->location_size());
+    }
+    sample->add_value(1 + random() % 100);
+  }
+}
+
+void BM_BuilderFinalize(benchmark::State& state) {
+  for (auto _ : state) {
+    state.PauseTiming();
+    profiles::Builder builder;
+    FillProfile(state.range(0), state.range(1), &builder);
+    state.ResumeTiming();
+    CHECK(builder.Finalize());
+  }
+  SetSamplesProcessed(state, state.range(0));
+}
+BENCHMARK(BM_BuilderFinalize)
+    ->ArgNames({"samples", "depth"})
+    ->Args({10000, 16})
+    ->Args({100000, 32});
+
+void BM_BuilderMarshal(benchmark::State& state) {
+  profiles::Builder builder;
+  FillProfile(state.range(0), state.range(1), &builder);
+  CHECK(builder.Finalize());
+  std::string output;
+  for (auto _ : state) {
+    CHECK(profiles::Builder::Marshal(*builder.mutable_profile(), &output));
+  }
+  SetSamplesProcessed(state, state.range(0));
+  state.SetBytesProcessed(state.iterations() *
+                          builder.mutable_profile()->ByteSizeLong());
+}
+BENCHMARK(BM_BuilderMarshal)
+    ->ArgNames({"samples", "depth"})
+    ->Args({10000, 16})
+    ->Args({100000, 32});
+
+// Compresses the profile in the format of state.range(1), in blocks on
+// state.range(2) threads if it isn't 0.
+void BM_BuilderMarshalWithOptions(benchmark::State& state) {
+  profiles::Builder builder;
+  FillProfile(state.range(0), 32, &builder);
+  CHECK(builder.Finalize());
+  std::unique_ptr<quipper::ThreadPool> pool;
+  if (state.range(2) > 0) pool.reset(new quipper::ThreadPool(state.range(2)));
+  profiles::MarshalOptions options;
+  options.format = static_cast<profiles::MarshalOptions::Format>(
+      state.range(1));
+  options.pool = pool.get();
+  std::string output;
+  for (auto _ : state) {
+    CHECK(profiles::Builder::Marshal(*builder.mutable_profile(), options,
+                                     &output));
+  }
+  SetSamplesProcessed(state, state.range(0));
+  state.SetBytesProcessed(state.iterations() *
+                          builder.mutable_profile()->ByteSizeLong());
+}
+BENCHMARK(BM_BuilderMarshalWithOptions)
+    ->ArgNames({"samples", "format", "threads"})
+    ->ArgsProduct({{100000}, {profiles::MarshalOptions::kGzip,
+                              profiles::MarshalOptions::kZstd},
+                   {0, 4}});
+
+// A load that hits in L1 and a not-taken conditional branch, as "perf record
+// -e arm_spe//" writes them.
+const char* const kSpeRecords[] = {
+    "b0d0c2a1ed66baffc0",  // PC
+    "65805f0000",          // CONTEXT
+    "4900",                // LD GP-REG
+    "521600",              // EV RETIRED L1D-ACCESS TLB-ACCESS
+    "990400",              // LAT 4 ISSUE
+    "980c00",              // LAT 12 TOT
+    "b2286b0903370eff00",  // VA
+    "9a0100",              // LAT 1 XLAT
+    "4300",                // DATA-SOURCE 0
+    "712e652f6a0a000000",  // TS
+    "b0e0b0efed66baffc0",  // PC
+    "650e000000",          // CONTEXT
+    "4a01",                // B COND
+    "524200",              // EV RETIRED NOT-TAKEN
+    "991000",              // LAT 16 ISSUE
+    "981100",              // LAT 17 TOT
+    "b1e4b0efed66baffc0",  // TGT
+    "718d652f6a0a000000",  // TS
+};
+
+void BM_ArmSpeDecoderNextRecord(benchmark::State& state) {
+  std::string records;
+  for (const char* packet : kSpeRecords) {
+    std::string raw(strlen(packet) / 2, '\0');
+    CHECK(quipper::HexStringToRawData(
+        packet, reinterpret_cast<quipper::u8*>(&raw[0]), raw.size()));
+    records += raw;
+  }
+  std::string trace;
+  for (int i = 0; i < state.range(0) / 2; ++i) trace += records;
+  for (auto _ : state) {
+    quipper::ArmSpeDecoder decoder(trace, /*is_cross_endian=*/false);
+    quipper::ArmSpeDecoder::Record record;
+    int64_t num_records = 0;
+    while (decoder.NextRecord(&record)) ++num_records;
+    CHECK_EQ(num_records, state.range(0) / 2 * 2);
+  }
+  state.SetItemsProcessed(state.iterations() * (state.range(0) / 2 * 2));
+  state.SetBytesProcessed(state.iterations() * trace.size());
+}
+BENCHMARK(BM_ArmSpeDecoderNextRecord)->ArgName("records")->Arg(100000);
+
+}  // namespace
+}  // namespace perftools
+
+BENCHMARK_MAIN();
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/perf_data_converter_c.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "google/protobuf/arena.h"
+#include "src/perf_data_converter.h"
+#include "src/quipper/base/logging.h"
+#include "src/quipper/perf_data.pb.h"
+#include "src/quipper/perf_serializer.h"
+
+namespace {
+
+// Returns the options of |options|, up to the fields the caller knows of.
+pdc_options ReadOptions(const pdc_options* options) {
+  pdc_options result;
+  pdc_init_options(&result);
+  if (options != nullptr) {
+    std::memcpy(&result, options,
+                std::min(options->struct_size, sizeof(result)));
+    result.struct_size = sizeof(result);
+  }
+  return result;
+}
+
+// Returns the conversion parameters of |options|.
+perftools::ConversionParams ToConversionParams(const pdc_options& options) {
+  perftools::ConversionParams params;
+  params.sample_labels = options.sample_labels;
+  params.options = options.options;
+  params.num_threads = options.num_threads;
+  return params;
+}
+
+// Hands each of |profiles| to |allocate|, freeing them as it goes. Returns the
+// number of profiles, or -1 on errors.
+int64_t HandOver(perftools::ProcessProfiles profiles,
+                 pdc_allocate_profile allocate, void* context) {
+  if (profiles.empty()) return -1;
+  for (auto& profile : profiles) {
+    const std::string& marshaled = profile->marshaled_data;
+    const size_t size =
+        marshaled.empty() ? profile->data.ByteSizeLong() : marshaled.size();
+    void* buffer = allocate(context, profile->pid, size);
+    if (buffer == nullptr) {
+      LOG(ERROR) << "No buffer was allocated for a profile of " << size
+                 << " bytes";
+      return -1;
+    }
+    if (marshaled.empty()) {
+      profile->data.SerializeWithCachedSizesToArray(
+          static_cast<uint8_t*>(buffer));
+    } else {
+      std::memcpy(buffer, marshaled.data(), size);
+    }
+    profile.reset();
+  }
+  return profiles.size();
+}
+
+}  // namespace
+
+extern "C" {
+
+int pdc_api_version(void) { return PDC_API_VERSION; }
+
+void pdc_init_options(pdc_options* options) {
+  std::memset(options, 0, sizeof(*options));
+  options->struct_size = sizeof(*options);
+  options->sample_labels = perftools::kNoLabels;
+  options->options = perftools::kGroupByPids;
+  options->num_threads = 1;
+}
+
+int64_t pdc_raw_perf_data_to_profiles(const void* data, size_t size,
+                                      const pdc_options* options,
+                                      pdc_allocate_profile allocate,
+                                      void* context) {
+  const pdc_options opts = ReadOptions(options);
+  std::map<std::string, std::string> build_ids;
+  for (size_t i = 0; i < opts.num_build_ids; ++i) {
+    build_ids[opts.build_id_filenames[i]] = opts.build_ids[i];
+  }
+  return HandOver(perftools::RawPerfDataToProfiles(data, size, build_ids,
+                                                   ToConversionParams(opts)),
+                  allocate, context);
+}
+
+int64_t pdc_perf_data_proto_to_profiles(const void* data, size_t size,
+                                        const pdc_options* options,
+                                        pdc_allocate_profile allocate,
+                                        void* context) {
+  const pdc_options opts = ReadOptions(options);
+  // Parse on an arena, so that the messages of the proto are freed at once.
+  google::protobuf::Arena arena;
+  auto* perf_data =
+      google::protobuf::Arena::Create<quipper::PerfDataProto>(&arena);
+  if (!perf_data->ParseFromArray(data, size)) {
+    LOG(ERROR) << "Could not parse the PerfDataProto";
+    return -1;
+  }
+  quipper::PerfSerializer::ExpandCallchains(perf_data);
+  return HandOver(
+      perftools::PerfDataProtoToProfiles(perf_data, ToConversionParams(opts)),
+      allocate, context);
+}
+
+}  // extern "C"
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// A C interface to the conversions of perf_data_converter.h, for embedding
+// them in other runtimes, e.g. through cgo or ctypes, without running
+// perf_to_profile as a subprocess. The inputs are read in place from the
+// caller's buffers, and each serialized profile is written straight into a
+// buffer that the caller allocates for it. The options are those of
+// perf_data_converter.h.
+
+#ifndef PERFTOOLS_PERF_DATA_CONVERTER_C_H_
+#define PERFTOOLS_PERF_DATA_CONVERTER_C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define PDC_EXPORT __attribute__((visibility("default")))
+#else
+#define PDC_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The version of this interface. It is only incremented when the interface
+// changes in a backward-incompatible way; fields are only ever appended to
+// pdc_options.
+#define PDC_API_VERSION 1
+
+// Returns PDC_API_VERSION of the library, which may be newer than the header
+// the caller was built with.
+PDC_EXPORT int pdc_api_version(void);
+
+typedef struct pdc_options {
+  // sizeof(pdc_options) as the caller was built with, so that newer versions
+  // of the library don't read the fields appended later.
+  size_t struct_size;
+  // The perftools::SampleLabels and perftools::ConversionOptions ORed
+  // together. With kMarshalProfiles, the profiles are gzipped.
+  uint32_t sample_labels;
+  uint32_t options;
+  // The number of threads a conversion may use, see ConversionParams.
+  int num_threads;
+  // The build IDs of |num_build_ids| files, as hex strings, for raw perf data.
+  const char* const* build_id_filenames;
+  const char* const* build_ids;
+  size_t num_build_ids;
+} pdc_options;
+
+// Fills in the default options, which group the samples by process without
+// labels.
+PDC_EXPORT void pdc_init_options(pdc_options* options);
+
+// Returns a buffer of |size| bytes for the serialized profile of the process
+// |pid|, 0 if the samples aren't grouped by process, or NULL to stop the
+// conversion. |context| is the one given to the conversion. The buffer isn't
+// used by the library once it is filled in.
+typedef void* (*pdc_allocate_profile)(void* context, uint32_t pid,
+                                      size_t size);
+
+// Converts the |size| bytes of raw perf data at |data|, as
+// RawPerfDataToProfiles() does, and hands each profile to |allocate| in
+// turn. Returns the number of profiles, or -1 if the data can't be converted
+// or |allocate| returns NULL. |options| may be NULL for the defaults.
+PDC_EXPORT int64_t pdc_raw_perf_data_to_profiles(
+    const void* data, size_t size, const pdc_options* options,
+    pdc_allocate_profile allocate, void* context);
+
+// Same as above, for the |size| bytes of a serialized PerfDataProto at
+// |data|, as PerfDataProtoToProfiles() converts it. The build IDs of
+// |options| are ignored, since the proto has its own.
+PDC_EXPORT int64_t pdc_perf_data_proto_to_profiles(
+    const void* data, size_t size, const pdc_options* options,
+    pdc_allocate_profile allocate, void* context);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // PERFTOOLS_PERF_DATA_CONVERTER_C_H_
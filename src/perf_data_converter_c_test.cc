@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/perf_data_converter_c.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "src/perf_data_converter.h"
+#include "src/quipper/kernel/perf_event.h"
+#include "src/quipper/perf_data.pb.h"
+#include "src/quipper/perf_reader.h"
+
+namespace perftools {
+namespace {
+
+// Returns the perf data of samples of two processes.
+quipper::PerfDataProto MakePerfData() {
+  quipper::PerfDataProto proto;
+  auto* attr = proto.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_size(sizeof(quipper::perf_event_attr));
+  attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                        quipper::PERF_SAMPLE_PERIOD);
+  proto.add_event_types()->set_name("cycles");
+  proto.add_metadata_mask(0);
+  for (int pid = 100; pid <= 101; ++pid) {
+    auto* event = proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap_event = event->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  for (int i = 0; i < 10; ++i) {
+    auto* event = proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample_event = event->mutable_sample_event();
+    sample_event->set_ip(0x1100 + i % 3);
+    sample_event->set_pid(100 + i % 2);
+    sample_event->set_tid(100 + i % 2);
+    sample_event->set_period(1);
+  }
+  return proto;
+}
+
+// The profiles handed over by a conversion.
+struct Profiles {
+  std::vector<uint32_t> pids;
+  std::vector<std::string> data;
+  // Fail the allocations after this many.
+  size_t max_profiles = 100;
+};
+
+void* AllocateProfile(void* context, uint32_t pid, size_t size) {
+  Profiles* profiles = static_cast<Profiles*>(context);
+  if (profiles->data.size() >= profiles->max_profiles) return nullptr;
+  profiles->pids.push_back(pid);
+  profiles->data.emplace_back(size, '\0');
+  return &profiles->data.back()[0];
+}
+
+TEST(PerfDataConverterCTest, ConvertsRawPerfData) {
+  EXPECT_EQ(PDC_API_VERSION, pdc_api_version());
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.Deserialize(MakePerfData()));
+  std::string raw;
+  ASSERT_TRUE(reader.WriteToString(&raw));
+
+  const std::map<std::string, std::string> build_ids = {
+      {"/usr/bin/foo", "abcdef0024"}};
+  const ProcessProfiles expected = RawPerfDataToProfiles(
+      raw.data(), raw.size(), build_ids, kPidAndTidLabels, kGroupByPids);
+  ASSERT_EQ(2, expected.size());
+
+  pdc_options options;
+  pdc_init_options(&options);
+  options.sample_labels = kPidAndTidLabels;
+  const char* filenames[] = {"/usr/bin/foo"};
+  const char* ids[] = {"abcdef0024"};
+  options.build_id_filenames = filenames;
+  options.build_ids = ids;
+  options.num_build_ids = 1;
+  Profiles profiles;
+  EXPECT_EQ(2, pdc_raw_perf_data_to_profiles(raw.data(), raw.size(), &options,
+                                             AllocateProfile, &profiles));
+  ASSERT_EQ(2, profiles.data.size());
+  for (size_t i = 0; i < profiles.data.size(); ++i) {
+    EXPECT_EQ(expected[i]->pid, profiles.pids[i]);
+    EXPECT_EQ(expected[i]->data.SerializeAsString(), profiles.data[i]);
+  }
+
+  // The marshaled profiles are handed over with kMarshalProfiles.
+  options.options |= kMarshalProfiles;
+  Profiles marshaled;
+  EXPECT_EQ(2, pdc_raw_perf_data_to_profiles(raw.data(), raw.size(), &options,
+                                             AllocateProfile, &marshaled));
+  ASSERT_EQ(2, marshaled.data.size());
+  EXPECT_EQ('\x1f', marshaled.data[0][0]);  // The gzip magic.
+
+  // The conversion stops when no buffer is allocated.
+  Profiles one;
+  one.max_profiles = 1;
+  EXPECT_EQ(-1, pdc_raw_perf_data_to_profiles(raw.data(), raw.size(), nullptr,
+                                              AllocateProfile, &one));
+  EXPECT_EQ(1, one.data.size());
+
+  Profiles none;
+  EXPECT_EQ(-1, pdc_raw_perf_data_to_profiles("junk", 4, nullptr,
+                                              AllocateProfile, &none));
+  EXPECT_TRUE(none.data.empty());
+}
+
+TEST(PerfDataConverterCTest, ConvertsPerfDataProto) {
+  const quipper::PerfDataProto proto = MakePerfData();
+  const ProcessProfiles expected = PerfDataProtoToProfiles(&proto);
+  ASSERT_EQ(2, expected.size());
+
+  // The options of callers built with an older header, which end before
+  // num_threads, are filled in with the defaults.
+  pdc_options options;
+  pdc_init_options(&options);
+  options.struct_size = offsetof(pdc_options, num_threads);
+  options.num_threads = -5;
+  const std::string data = proto.SerializeAsString();
+  Profiles profiles;
+  EXPECT_EQ(2, pdc_perf_data_proto_to_profiles(data.data(), data.size(),
+                                               &options, AllocateProfile,
+                                               &profiles));
+  ASSERT_EQ(2, profiles.data.size());
+  for (size_t i = 0; i < profiles.data.size(); ++i) {
+    EXPECT_EQ(expected[i]->pid, profiles.pids[i]);
+    EXPECT_EQ(expected[i]->data.SerializeAsString(), profiles.data[i]);
+  }
+
+  Profiles none;
+  EXPECT_EQ(-1, pdc_perf_data_proto_to_profiles("\xff", 1, nullptr,
+                                                AllocateProfile, &none));
+}
+
+}  // namespace
+}  // namespace perftools
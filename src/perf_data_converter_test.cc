@@ -16,10 +16,13 @@
 #include <cstring>
 #include <fstream>
 #include <ios>
+#include <limits>
 #include <map>
 #include <memory>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -27,11 +30,16 @@
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include "src/builder.h"
 #include "src/intervalmap.h"
 #include "src/perf_data_handler.h"
+#include "src/quipper/base/logging.h"
 #include "src/quipper/perf_parser.h"
+#include "src/quipper/perf_protobuf_io.h"
 #include "src/quipper/perf_reader.h"
+#include "src/quipper/synthetic_perf_data.h"
 
+using perftools::ConversionParams;
 using perftools::ProcessProfiles;
 using perftools::profiles::Location;
 using perftools::profiles::Mapping;
@@ -46,6 +54,15 @@ using testing::UnorderedPointwise;
 
 namespace {
 
+// Returns the parameters of a conversion with |sample_labels| and |options|,
+// and the others left at their defaults.
+ConversionParams Params(uint32_t sample_labels, uint32_t options) {
+  ConversionParams params;
+  params.sample_labels = sample_labels;
+  params.options = options;
+  return params;
+}
+
 typedef std::unordered_map<std::string, std::pair<int64_t, int64_t>> MapCounts;
 
 // GetMapCounts returns a map keyed by a location identifier and
@@ -291,6 +308,667 @@ TEST_F(PerfDataConverterTest, ConvertsGroupPid) {
   EXPECT_EQ(19989, total_samples);
 }
 
+TEST_F(PerfDataConverterTest, StreamingConvertsGroupPid) {
+  std::string multiple_profile(
+      GetResource("single-event-multi-process.perf.data"));
+  std::string raw_perf_data = GetContents(multiple_profile);
+  ASSERT_FALSE(raw_perf_data.empty()) << multiple_profile;
+
+  const auto pps = StreamingRawPerfDataToProfiles(
+      reinterpret_cast<const void*>(raw_perf_data.c_str()),
+      raw_perf_data.size(), {}, Params(kPidAndTidLabels, kGroupByPids));
+
+  uint64_t total_samples = 0;
+  EXPECT_EQ(6, pps.size());
+  for (const auto& per_thread : pps) {
+    for (const auto& sample : per_thread->data.sample()) {
+      for (int x = 0; x < sample.value_size(); x += 2) {
+        total_samples += sample.value(x);
+      }
+    }
+  }
+  // Streaming must not drop any of the 19989 original samples.
+  EXPECT_EQ(19989, total_samples);
+}
+
+// The chunks of a recording that was split by "perf record --switch-output"
+// only have the mmaps and comms of the threads that changed while they were
+// written, so the samples of the later chunks are resolved with those of the
+// earlier ones.
+TEST_F(PerfDataConverterTest, ConvertsChunksOfOneRecording) {
+  auto make_chunk = [](int num_samples, bool with_mmaps) {
+    PerfDataProto perf_data_proto;
+    auto* attr = perf_data_proto.add_file_attrs()->mutable_attr();
+    attr->set_type(quipper::PERF_TYPE_HARDWARE);
+    attr->set_size(sizeof(quipper::perf_event_attr));
+    attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                          quipper::PERF_SAMPLE_PERIOD);
+    perf_data_proto.add_event_types()->set_name("cycles");
+    perf_data_proto.add_metadata_mask(0);
+    if (with_mmaps) {
+      auto* event = perf_data_proto.add_events();
+      event->mutable_header()->set_type(quipper::PERF_RECORD_COMM);
+      auto* comm_event = event->mutable_comm_event();
+      comm_event->set_pid(100);
+      comm_event->set_tid(100);
+      comm_event->set_comm("foo");
+      event = perf_data_proto.add_events();
+      event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+      auto* mmap_event = event->mutable_mmap_event();
+      mmap_event->set_filename("/usr/bin/foo");
+      mmap_event->set_pid(100);
+      mmap_event->set_tid(100);
+      mmap_event->set_start(0x1000);
+      mmap_event->set_len(0x1000);
+      mmap_event->set_pgoff(0);
+    }
+    for (int i = 0; i < num_samples; ++i) {
+      auto* event = perf_data_proto.add_events();
+      event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+      auto* sample_event = event->mutable_sample_event();
+      sample_event->set_ip(0x1100 + i);
+      sample_event->set_pid(100);
+      sample_event->set_tid(100);
+      sample_event->set_period(1);
+    }
+    std::string str;
+    quipper::PerfReader reader;
+    EXPECT_TRUE(reader.Deserialize(perf_data_proto));
+    EXPECT_TRUE(reader.WriteToString(&str));
+    return str;
+  };
+  const std::string first = make_chunk(2, true);
+  const std::string second = make_chunk(3, false);
+
+  auto mapped_samples = [](const perftools::ProcessProfile& pp) {
+    int64_t mapped = 0;
+    const Profile& profile = pp.data;
+    for (const auto& sample : profile.sample()) {
+      for (const auto& location : profile.location()) {
+        if (location.id() == sample.location_id(0) &&
+            location.mapping_id() != 0 &&
+            profile.string_table(
+                profile.mapping(location.mapping_id() - 1).filename()) ==
+                "/usr/bin/foo") {
+          mapped += sample.value(0);
+        }
+      }
+    }
+    return mapped;
+  };
+
+  PerfDataConversionSession session(Params(kCommLabel, kGroupByPids));
+  ProcessProfiles pps = session.AddChunk(first.data(), first.size(), {});
+  ASSERT_EQ(1, pps.size());
+  EXPECT_EQ(100, pps[0]->pid);
+  EXPECT_EQ(2, mapped_samples(*pps[0]));
+  pps = session.AddChunk(second.data(), second.size(), {});
+  ASSERT_EQ(1, pps.size());
+  EXPECT_EQ(100, pps[0]->pid);
+  // Only the samples of the second chunk, in a profile of their own.
+  EXPECT_EQ(3, pps[0]->data.sample_size());
+  EXPECT_EQ(3, mapped_samples(*pps[0]));
+  const Profile& profile = pps[0]->data;
+  for (const auto& sample : profile.sample()) {
+    ASSERT_EQ(1, sample.label_size());
+    EXPECT_EQ("foo", profile.string_table(sample.label(0).str()));
+  }
+
+  // Converted on its own, the second chunk has no mappings to resolve to.
+  pps = StreamingRawPerfDataToProfiles(second.data(), second.size(), {},
+                                       Params(kCommLabel, kGroupByPids));
+  ASSERT_EQ(1, pps.size());
+  EXPECT_EQ(0, mapped_samples(*pps[0]));
+
+  // With snapshots, the profiles of the chunks are held until they are taken.
+  PerfDataConversionSession live(
+      Params(kCommLabel, kGroupByPids | kMarshalProfiles));
+  live.EnableSnapshots();
+  EXPECT_TRUE(live.AddChunk(first.data(), first.size(), {}).empty());
+  EXPECT_TRUE(live.AddChunk(second.data(), second.size(), {}).empty());
+  pps = live.Snapshot();
+  ASSERT_EQ(2, pps.size());
+  EXPECT_EQ(2, mapped_samples(*pps[0]));
+  EXPECT_EQ(3, mapped_samples(*pps[1]));
+  EXPECT_FALSE(pps[1]->marshaled_data.empty());
+  EXPECT_TRUE(live.Snapshot().empty());
+
+  // The snapshots taken while a chunk is added split its samples.
+  const int kNumSamples = 20000;
+  const std::string large = make_chunk(kNumSamples, false);
+  auto total_samples = [](const ProcessProfiles& pps) {
+    int64_t total = 0;
+    for (const auto& pp : pps) {
+      for (const auto& sample : pp->data.sample()) total += sample.value(0);
+    }
+    return total;
+  };
+  int64_t total = 0;
+  std::thread adder([&live, &large] {
+    EXPECT_TRUE(live.AddChunk(large.data(), large.size(), {}).empty());
+  });
+  for (int i = 0; i < 100; ++i) total += total_samples(live.Snapshot());
+  adder.join();
+  total += total_samples(live.Snapshot());
+  EXPECT_EQ(kNumSamples, total);
+}
+
+// With a profile callback, the profiles of the processes that exit are handed
+// over as they exit, and the largest ones when the budget is exceeded.
+TEST_F(PerfDataConverterTest, HandsOverProfilesBeforeTheEnd) {
+  PerfDataProto perf_data_proto;
+  auto* attr = perf_data_proto.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_size(sizeof(quipper::perf_event_attr));
+  attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                        quipper::PERF_SAMPLE_PERIOD);
+  perf_data_proto.add_event_types()->set_name("cycles");
+  perf_data_proto.add_metadata_mask(0);
+  for (int pid = 100; pid <= 101; ++pid) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap_event = event->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    for (int i = 0; i < 3; ++i) {
+      event = perf_data_proto.add_events();
+      event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+      auto* sample_event = event->mutable_sample_event();
+      sample_event->set_ip(0x1100 + i);
+      sample_event->set_pid(pid);
+      sample_event->set_tid(pid);
+      sample_event->set_period(1);
+    }
+  }
+  auto* event = perf_data_proto.add_events();
+  event->mutable_header()->set_type(quipper::PERF_RECORD_EXIT);
+  auto* exit_event = event->mutable_exit_event();
+  exit_event->set_pid(100);
+  exit_event->set_tid(100);
+  std::string raw;
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.Deserialize(perf_data_proto));
+  ASSERT_TRUE(reader.WriteToString(&raw));
+
+  ProcessProfiles emitted;
+  auto callback = [&emitted](std::unique_ptr<ProcessProfile> pp) {
+    emitted.push_back(std::move(pp));
+  };
+  {
+    PerfDataConversionSession session;
+    session.SetProfileCallback(callback);
+    const ProcessProfiles pps = session.AddChunk(raw.data(), raw.size(), {});
+    ASSERT_EQ(1, emitted.size());
+    EXPECT_EQ(100, emitted[0]->pid);
+    EXPECT_EQ(3, emitted[0]->data.sample_size());
+    ASSERT_EQ(1, pps.size());
+    EXPECT_EQ(101, pps[0]->pid);
+    EXPECT_EQ(3, pps[0]->data.sample_size());
+  }
+
+  // Over the budget after each sample, each profile has a single sample.
+  emitted.clear();
+  PerfDataConversionSession session;
+  session.SetProfileCallback(callback, /*max_profile_bytes=*/1);
+  const ProcessProfiles pps = session.AddChunk(raw.data(), raw.size(), {});
+  EXPECT_TRUE(pps.empty());
+  ASSERT_EQ(6, emitted.size());
+  for (const auto& pp : emitted) {
+    ASSERT_EQ(1, pp->data.sample_size());
+    EXPECT_EQ(1, pp->data.sample(0).value(0));
+    EXPECT_EQ(1, pp->data.location_size());
+    EXPECT_TRUE(perftools::profiles::Builder::CheckValid(pp->data));
+  }
+}
+
+TEST_F(PerfDataConverterTest, ConvertsChunkedProtoFiles) {
+  PerfDataProto perf_data_proto;
+  auto* attr = perf_data_proto.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                        quipper::PERF_SAMPLE_PERIOD);
+  perf_data_proto.add_event_types()->set_name("cycles");
+  for (int pid = 100; pid <= 101; ++pid) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_COMM);
+    auto* comm_event = event->mutable_comm_event();
+    comm_event->set_pid(pid);
+    comm_event->set_tid(pid);
+    comm_event->set_comm("comm" + std::to_string(pid));
+    event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap_event = event->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  for (int i = 0; i < 9; ++i) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample_event = event->mutable_sample_event();
+    sample_event->set_ip(0x1100 + i % 3);
+    sample_event->set_pid(100 + i % 2);
+    sample_event->set_tid(100 + i % 2);
+    sample_event->set_period(1);
+  }
+  const std::string path = ::testing::TempDir() + "chunked.pb.data";
+  ASSERT_TRUE(quipper::WriteChunkedProtobufToFile(perf_data_proto, path,
+                                                  /*events_per_chunk=*/4));
+
+  const ProcessProfiles expected =
+      PerfDataProtoToProfiles(&perf_data_proto, kCommLabel, kGroupByPids);
+  const ProcessProfiles pps = ChunkedPerfDataProtoFileToProfiles(
+      path, Params(kCommLabel, kGroupByPids));
+  ASSERT_EQ(2, pps.size());
+  ASSERT_EQ(expected.size(), pps.size());
+  for (size_t i = 0; i < pps.size(); ++i) {
+    EXPECT_EQ(expected[i]->pid, pps[i]->pid);
+    EXPECT_EQ(expected[i]->data.SerializeAsString(),
+              pps[i]->data.SerializeAsString());
+  }
+  unlink(path.c_str());
+
+  EXPECT_TRUE(ChunkedPerfDataProtoFileToProfiles(
+                  path, Params(kCommLabel, kGroupByPids))
+                  .empty());
+}
+
+// Building the profiles of different processes on several threads gives the
+// same profiles, in the same order.
+TEST_F(PerfDataConverterTest, ConvertsGroupPidOnMultipleThreads) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  const int kNumPids = 20;
+  for (int pid = 1; pid <= kNumPids; ++pid) {
+    auto* comm_event = perf_data_proto.add_events()->mutable_comm_event();
+    comm_event->set_pid(pid);
+    comm_event->set_tid(pid);
+    comm_event->set_comm("comm" + std::to_string(pid));
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo" + std::to_string(pid % 3));
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  }
+  // Interleave the samples of the processes, which start in reverse order.
+  for (int i = 0; i < 1000; ++i) {
+    int pid = kNumPids - i % kNumPids;
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + (i * 7) % 0x100);
+    sample_event->set_pid(pid);
+    sample_event->set_tid(pid + i % 2);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+    sample_event->add_callchain(quipper::PERF_CONTEXT_USER);
+    sample_event->add_callchain(sample_event->ip());
+    sample_event->add_callchain(0x1800 + i % 5);
+  }
+
+  const ProcessProfiles want = PerfDataProtoToProfiles(
+      &perf_data_proto, kPidAndTidLabels | kCommLabel, kGroupByPids);
+  ConversionParams params =
+      Params(kPidAndTidLabels | kCommLabel, kGroupByPids | kMarshalProfiles);
+  params.num_threads = 4;
+  const ProcessProfiles got = PerfDataProtoToProfiles(&perf_data_proto, params);
+  ASSERT_EQ(kNumPids, want.size());
+  ASSERT_EQ(want.size(), got.size());
+  for (size_t i = 0; i < want.size(); ++i) {
+    EXPECT_EQ(kNumPids - i, want[i]->pid);
+    EXPECT_EQ(want[i]->pid, got[i]->pid);
+    EXPECT_EQ(want[i]->data.SerializeAsString(),
+              got[i]->data.SerializeAsString())
+        << "pid " << want[i]->pid;
+    EXPECT_TRUE(want[i]->marshaled_data.empty());
+    std::string marshaled;
+    ASSERT_TRUE(
+        perftools::profiles::Builder::Marshal(want[i]->data, &marshaled));
+    EXPECT_EQ(marshaled, got[i]->marshaled_data) << "pid " << want[i]->pid;
+  }
+
+  // Conversions sharing an executor, which has fewer threads than they ask
+  // for, give the same profiles too.
+  ConversionExecutor executor(2);
+  for (uint32_t options : {kGroupByPids, kNoOptions}) {
+    const ProcessProfiles single = PerfDataProtoToProfiles(
+        &perf_data_proto, kPidAndTidLabels | kCommLabel, options);
+    std::vector<ProcessProfiles> shared(3);
+    std::vector<std::thread> threads;
+    for (auto& pps : shared) {
+      threads.emplace_back([&, options] {
+        ConversionParams params =
+            Params(kPidAndTidLabels | kCommLabel, options);
+        params.num_threads = 4;
+        params.executor = &executor;
+        pps = PerfDataProtoToProfiles(&perf_data_proto, params);
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    for (const auto& pps : shared) {
+      ASSERT_EQ(single.size(), pps.size());
+      for (size_t i = 0; i < single.size(); ++i) {
+        EXPECT_EQ(single[i]->data.SerializeAsString(),
+                  pps[i]->data.SerializeAsString())
+            << "options " << options << ", pid " << single[i]->pid;
+      }
+    }
+  }
+}
+
+// Aggregating the samples of each CPU on a thread of its own and merging the
+// profiles of each process gives the same samples, in profiles of their own
+// for each exec of a process.
+TEST_F(PerfDataConverterTest, ConvertsPerCpuSamplesOnMultipleThreads) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto add_mmap = [&perf_data_proto](uint32_t pid,
+                                     const std::string& filename) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  };
+  auto add_samples = [&perf_data_proto](int num_samples) {
+    for (int i = 0; i < num_samples; ++i) {
+      auto* sample_event =
+          perf_data_proto.add_events()->mutable_sample_event();
+      const uint32_t pid = i % 5 == 0 ? 2 : 1;
+      sample_event->set_ip(0x1000 + (i * 7) % 0x40);
+      sample_event->set_pid(pid);
+      sample_event->set_tid(pid + i % 3);
+      sample_event->set_cpu(i % 6);
+      sample_event->set_sample_time_ns(1000 + i);
+      sample_event->set_period(1 + i % 2);
+      sample_event->set_id(0);
+      sample_event->add_callchain(quipper::PERF_CONTEXT_USER);
+      sample_event->add_callchain(sample_event->ip());
+      sample_event->add_callchain(0x1800 + i % 5);
+    }
+  };
+  add_mmap(1, "/usr/bin/server");
+  add_mmap(2, "/usr/bin/helper");
+  add_samples(500);
+  // The helper execs another binary.
+  auto* comm_event = perf_data_proto.add_events()->mutable_comm_event();
+  comm_event->set_pid(2);
+  comm_event->set_tid(2);
+  comm_event->set_comm("other");
+  add_mmap(2, "/usr/bin/other");
+  add_samples(500);
+
+  // The values of the samples of a profile by their labels and stacks.
+  auto samples = [](const Profile& profile) {
+    std::map<std::string, std::vector<int64_t>> samples;
+    std::unordered_map<uint64_t, std::string> locations;
+    for (const auto& location : profile.location()) {
+      std::string& name = locations[location.id()];
+      for (const auto& mapping : profile.mapping()) {
+        if (mapping.id() == location.mapping_id()) {
+          name = profile.string_table(mapping.filename());
+        }
+      }
+      name += ":" + std::to_string(location.address());
+    }
+    for (const auto& sample : profile.sample()) {
+      std::string key;
+      for (const auto& label : sample.label()) {
+        key += profile.string_table(label.key()) + "=" +
+               std::to_string(label.num()) + ",";
+      }
+      for (uint64_t id : sample.location_id()) key += locations[id] + ",";
+      std::vector<int64_t>& values = samples[key];
+      values.resize(sample.value_size());
+      for (int i = 0; i < sample.value_size(); ++i) {
+        values[i] += sample.value(i);
+      }
+    }
+    return samples;
+  };
+
+  for (uint32_t options : {kGroupByPids, kNoOptions}) {
+    const ProcessProfiles want = PerfDataProtoToProfiles(
+        &perf_data_proto, kPidAndTidLabels, options);
+    ASSERT_EQ(options == kGroupByPids ? 3 : 1, want.size());
+    ConversionParams params = Params(
+        kPidAndTidLabels, options | kPerCpuSamples | kMarshalProfiles);
+    params.num_threads = 4;
+    const ProcessProfiles got =
+        PerfDataProtoToProfiles(&perf_data_proto, params);
+    ASSERT_EQ(want.size(), got.size()) << "options " << options;
+    for (size_t i = 0; i < want.size(); ++i) {
+      EXPECT_EQ(want[i]->pid, got[i]->pid);
+      EXPECT_EQ(samples(want[i]->data), samples(got[i]->data))
+          << "options " << options << ", profile " << i;
+      EXPECT_EQ(want[i]->min_sample_time_ns, got[i]->min_sample_time_ns);
+      EXPECT_EQ(want[i]->max_sample_time_ns, got[i]->max_sample_time_ns);
+      EXPECT_EQ(want[i]->build_id_stats, got[i]->build_id_stats);
+      EXPECT_FALSE(got[i]->marshaled_data.empty());
+    }
+  }
+}
+
+// The profiles of the CPUs of a process are merged without moving any of its
+// mappings, even those with the same size and file.
+TEST_F(PerfDataConverterTest, MergesPerCpuSamplesInPlace) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  const std::vector<std::pair<std::string, uint64_t>> mmaps = {
+      {"//anon", 0x1000},
+      {"//anon", 0x3000},
+      {"/usr/lib/libfoo.so", 0x5000},
+      {"/usr/lib/libfoo.so", 0x7000}};
+  for (const auto& mmap : mmaps) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(mmap.first);
+    mmap_event->set_pid(1);
+    mmap_event->set_tid(1);
+    mmap_event->set_start(mmap.second);
+    mmap_event->set_len(0x1000);
+  }
+  for (int i = 0; i < 64; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(mmaps[i % 4].second + 0x100 + (i / 4) % 2);
+    sample_event->set_pid(1);
+    sample_event->set_tid(1);
+    sample_event->set_cpu(i / 4 % 8);
+    sample_event->set_sample_time_ns(1000 + i);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+  }
+
+  // The samples of a profile by the mapping address and filename of their
+  // locations.
+  auto samples = [](const Profile& profile) {
+    std::map<std::string, int64_t> samples;
+    for (const auto& sample : profile.sample()) {
+      for (const auto& location : profile.location()) {
+        if (location.id() != sample.location_id(0)) continue;
+        for (const auto& mapping : profile.mapping()) {
+          if (mapping.id() != location.mapping_id()) continue;
+          samples[profile.string_table(mapping.filename()) + ":" +
+                  std::to_string(mapping.memory_start()) + ":" +
+                  std::to_string(location.address())] += sample.value(0);
+        }
+      }
+    }
+    return samples;
+  };
+
+  const ProcessProfiles want =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kGroupByPids);
+  ConversionParams params = Params(kNoLabels, kGroupByPids | kPerCpuSamples);
+  params.num_threads = 4;
+  const ProcessProfiles got = PerfDataProtoToProfiles(&perf_data_proto, params);
+  ASSERT_EQ(1, want.size());
+  ASSERT_EQ(1, got.size());
+  EXPECT_EQ(want[0]->data.mapping_size(), got[0]->data.mapping_size());
+  EXPECT_EQ(8, samples(want[0]->data).size());
+  EXPECT_EQ(samples(want[0]->data), samples(got[0]->data));
+}
+
+// The keys of the common label sets tell apart the same samples as the full
+// key, which the converter uses when any other label is requested, such as
+// cgroup labels of samples without cgroups.
+TEST_F(PerfDataConverterTest, ConvertsCommonLabelSetsLikeOthers) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (int pid = 1; pid <= 3; ++pid) {
+    for (int tid = pid; tid <= pid + 1; ++tid) {
+      auto* comm_event = perf_data_proto.add_events()->mutable_comm_event();
+      comm_event->set_pid(pid);
+      comm_event->set_tid(tid);
+      comm_event->set_comm("comm" + std::to_string(tid));
+    }
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  }
+  for (int i = 0; i < 300; ++i) {
+    int pid = 1 + i % 3;
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + (i * 7) % 0x40);
+    sample_event->set_pid(pid);
+    sample_event->set_tid(pid + i % 2);
+    sample_event->set_sample_time_ns(1000 * (i % 4));
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+  }
+
+  const uint32_t kLabelSets[] = {
+      kNoLabels, kPidLabel, kPidAndTidLabels,
+      kPidAndTidLabels | kTimestampNsLabel, kCommLabel | kThreadCommLabel};
+  for (uint32_t labels : kLabelSets) {
+    const ProcessProfiles want = PerfDataProtoToProfiles(
+        &perf_data_proto, labels | kCgroupLabel, kGroupByPids);
+    const ProcessProfiles got =
+        PerfDataProtoToProfiles(&perf_data_proto, labels, kGroupByPids);
+    ASSERT_EQ(3, want.size());
+    ASSERT_EQ(want.size(), got.size());
+    for (size_t i = 0; i < want.size(); ++i) {
+      EXPECT_EQ(want[i]->data.SerializeAsString(),
+                got[i]->data.SerializeAsString())
+          << "labels " << labels << ", pid " << want[i]->pid;
+    }
+  }
+}
+
+// Without kGroupByPids, the processes share the locations and mappings of the
+// files and the kernel that they all map, but not of their anonymous memory.
+TEST_F(PerfDataConverterTest, SharesLocationsOfProcessesInOneProfile) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto add_mmap = [&perf_data_proto](uint32_t pid, const std::string& filename,
+                                     uint64_t start, uint64_t pgoff) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(start);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(pgoff);
+  };
+  add_mmap(std::numeric_limits<uint32_t>::max(), "[kernel.kallsyms]_text",
+           0xffff0000, 0);
+  for (uint32_t pid = 1; pid <= 3; ++pid) {
+    add_mmap(pid, "/usr/bin/foo", 0x1000, 0);
+    add_mmap(pid, "/lib/libc.so", 0x10000 * pid, 0x2000);
+    add_mmap(pid, "//anon", 0x100000, 0);
+  }
+  for (uint32_t pid = 1; pid <= 3; ++pid) {
+    for (uint64_t ip : {0x1100ULL, 0x10000ULL * pid + 0x200, 0xffff0300ULL,
+                        0x100400ULL}) {
+      auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+      sample_event->set_ip(ip);
+      sample_event->set_pid(pid);
+      sample_event->set_tid(pid);
+      sample_event->set_period(1);
+      sample_event->set_id(0);
+    }
+  }
+
+  const ProcessProfiles pps =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kNoOptions);
+  ASSERT_EQ(1, pps.size());
+  const auto& p = pps[0]->data;
+  // One location each for foo, libc and the kernel, and one per process for
+  // the anonymous memory.
+  EXPECT_EQ(6, p.location_size());
+  EXPECT_EQ(6, p.mapping_size());
+  int64_t total = 0;
+  for (const auto& sample : p.sample()) total += sample.value(0);
+  EXPECT_EQ(12, total);
+
+  const ProcessProfiles per_process =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kGroupByPids);
+  ASSERT_EQ(3, per_process.size());
+  for (const auto& pp : per_process) {
+    EXPECT_EQ(4, pp->data.location_size());
+  }
+}
+
+// The profile of a process is handed to the callback when the process exits,
+// and the others at the end.
+TEST_F(PerfDataConverterTest, HandsProfilesToCallback) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (int pid = 1; pid <= 3; ++pid) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  auto add_samples = [&perf_data_proto](int first_pid, int last_pid) {
+    for (int i = 0; i < 30; ++i) {
+      auto* sample_event =
+          perf_data_proto.add_events()->mutable_sample_event();
+      sample_event->set_ip(0x1000 + i % 7);
+      sample_event->set_pid(first_pid + i % (last_pid - first_pid + 1));
+      sample_event->set_tid(sample_event->pid());
+      sample_event->set_period(1);
+      sample_event->set_id(0);
+    }
+  };
+  add_samples(1, 3);
+  auto* exit_event = perf_data_proto.add_events()->mutable_exit_event();
+  exit_event->set_pid(3);
+  exit_event->set_tid(3);
+  add_samples(1, 2);
+
+  const ProcessProfiles want =
+      PerfDataProtoToProfiles(&perf_data_proto, kPidLabel, kGroupByPids);
+  ASSERT_EQ(3, want.size());
+  ProcessProfiles got;
+  PerfDataProtoToProfiles(
+      &perf_data_proto,
+      [&got](std::unique_ptr<ProcessProfile> pp) {
+        got.push_back(std::move(pp));
+      },
+      Params(kPidLabel, kGroupByPids));
+  ASSERT_EQ(3, got.size());
+  EXPECT_EQ(3, got[0]->pid);
+  EXPECT_EQ(1, got[1]->pid);
+  EXPECT_EQ(2, got[2]->pid);
+  for (const auto& pp : got) {
+    EXPECT_EQ(want[pp->pid - 1]->data.SerializeAsString(),
+              pp->data.SerializeAsString())
+        << "pid " << pp->pid;
+  }
+}
+
 TEST_F(PerfDataConverterTest, GroupByThreadTypes) {
   std::string path(
       GetResource("single-event-multi-process-single-ip.textproto"));
@@ -372,6 +1050,89 @@ TEST_F(PerfDataConverterTest, PreservesKallsymsRelocation) {
   EXPECT_THAT(mmaps, Contains(want_mmap_name));
 }
 
+TEST_F(PerfDataConverterTest, ReportsConversionStats) {
+  quipper::testing::SyntheticPerfDataOptions options;
+  options.num_processes = 4;
+  options.num_samples = 5000;
+  options.churn_rate = 0.01;
+  std::stringstream out;
+  ASSERT_TRUE(quipper::testing::WriteSyntheticPerfData(options, &out));
+  const std::string raw_perf_data = out.str();
+
+  ConversionStats stats;
+  ConversionParams params;
+  params.stats = &stats;
+  const ProcessProfiles pps = RawPerfDataToProfiles(
+      reinterpret_cast<const void*>(raw_perf_data.c_str()),
+      raw_perf_data.size(), {}, params);
+  ASSERT_FALSE(pps.empty());
+  EXPECT_EQ(raw_perf_data.size(), stats.bytes_read);
+  EXPECT_GT(stats.arena_bytes, 0);
+  EXPECT_TRUE(stats.read_warnings.empty());
+  EXPECT_GT(stats.read.wall_seconds, 0);
+  EXPECT_GE(stats.parse.wall_seconds, stats.sort.wall_seconds);
+  EXPECT_GE(stats.normalize.wall_seconds, stats.convert.wall_seconds);
+  EXPECT_GT(stats.convert.wall_seconds, 0);
+  EXPECT_GT(stats.finalize.wall_seconds, 0);
+
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(raw_perf_data));
+  std::map<uint32_t, uint64_t> want_events;
+  for (const auto& event : reader.events()) {
+    ++want_events[event.header().type()];
+  }
+  EXPECT_EQ(want_events, stats.events_by_type);
+  EXPECT_EQ(want_events[quipper::PERF_RECORD_SAMPLE],
+            stats.normalization.samples);
+  EXPECT_EQ(stats.normalization.samples, stats.normalization.recorded_samples);
+  EXPECT_GT(stats.normalization.mapped_samples, 0);
+  EXPECT_GT(stats.normalization.callchain_ips, 0);
+  EXPECT_GT(stats.normalization.address_spaces, 0);
+  EXPECT_GT(stats.normalization.mappings, 0);
+
+  EXPECT_EQ(pps.size(), stats.profiles);
+  uint64_t samples = 0;
+  for (const auto& pp : pps) samples += pp->data.sample_size();
+  EXPECT_EQ(samples, stats.profile_samples);
+  EXPECT_GT(stats.profile_locations, 0);
+  EXPECT_EQ(0, stats.marshaled_bytes);
+}
+
+// Raw perf data fails to convert if too few of its samples are mapped, as
+// quipper::PerfParser::ParseRawEvents() would once have failed.
+TEST_F(PerfDataConverterTest, FailsOnMostlyUnmappedSamples) {
+  quipper::testing::SyntheticPerfDataOptions options;
+  options.num_processes = 4;
+  options.num_samples = 1000;
+  std::stringstream out;
+  ASSERT_TRUE(quipper::testing::WriteSyntheticPerfData(options, &out));
+  const std::string raw_perf_data = out.str();
+  EXPECT_FALSE(RawPerfDataToProfiles(raw_perf_data.data(),
+                                     raw_perf_data.size(), {})
+                   .empty());
+
+  // Without the mmaps of the processes, none of their samples are mapped.
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(raw_perf_data));
+  PerfDataProto perf_data_proto = reader.proto();
+  perf_data_proto.clear_events();
+  for (const auto& event : reader.proto().events()) {
+    if (!event.has_mmap_event()) *perf_data_proto.add_events() = event;
+  }
+  quipper::PerfReader unmapped_reader;
+  ASSERT_TRUE(unmapped_reader.Deserialize(perf_data_proto));
+  std::string unmapped;
+  ASSERT_TRUE(unmapped_reader.WriteToString(&unmapped));
+  ConversionStats stats;
+  ConversionParams params;
+  params.stats = &stats;
+  EXPECT_TRUE(
+      RawPerfDataToProfiles(unmapped.data(), unmapped.size(), {}, params)
+          .empty());
+  EXPECT_EQ(options.num_samples, stats.normalization.recorded_samples);
+  EXPECT_EQ(0, stats.normalization.mapped_samples);
+}
+
 TEST_F(PerfDataConverterTest, HandlesDataAddresses) {
   struct TestCase {
     std::string desc;
@@ -430,6 +1191,317 @@ TEST_F(PerfDataConverterTest, HandlesDataAddresses) {
   }
 }
 
+// The data addresses of the same cache line or page, aligned in the file
+// offsets of their mapping, share a location.
+TEST_F(PerfDataConverterTest, BucketsDataAddresses) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (int i = 0; i < 2; ++i) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(i == 0 ? "/usr/bin/foo" : "/data");
+    mmap_event->set_pid(1);
+    mmap_event->set_tid(1);
+    mmap_event->set_start(i == 0 ? 0x1000 : 0x10000);
+    mmap_event->set_len(i == 0 ? 0x1000 : 0x4000);
+    mmap_event->set_pgoff(i == 0 ? 0 : 0x1010);
+  }
+  for (uint64_t addr : {0x10000, 0x10020, 0x10040, 0x10fff, 0x11000}) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1100);
+    sample_event->set_addr(addr);
+    sample_event->set_pid(1);
+    sample_event->set_tid(1);
+    sample_event->set_period(1);
+  }
+
+  struct TestCase {
+    uint32_t options;
+    std::set<uint64_t> want_addresses;
+  };
+  const std::vector<TestCase> cases = {
+      {0, {0x1100, 0x10000, 0x10020, 0x10040, 0x10fff, 0x11000}},
+      {kDataAddressCacheLines, {0x1100, 0x10000, 0x10030, 0x10ff0}},
+      {kDataAddressPages, {0x1100, 0x10000, 0x10ff0}},
+      {kDataAddressCacheLines | kDataAddressPages, {0x1100, 0x10000, 0x10ff0}},
+  };
+  for (const auto& c : cases) {
+    const ProcessProfiles pps = PerfDataProtoToProfiles(
+        &perf_data_proto, kNoLabels, kAddDataAddressFrames | c.options);
+    ASSERT_EQ(1, pps.size());
+    const Profile& p = pps[0]->data;
+    std::set<uint64_t> addresses;
+    for (const auto& location : p.location()) {
+      addresses.insert(location.address());
+    }
+    EXPECT_EQ(c.want_addresses, addresses) << c.options;
+    EXPECT_EQ(c.want_addresses.size() - 1, p.sample_size()) << c.options;
+  }
+}
+
+TEST_F(PerfDataConverterTest, AddsLabelsWithKeys) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/usr/lib/foo");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0);
+  for (int i = 0; i < 3; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1010);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100 + i);
+    sample_event->set_cpu(i);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+  }
+
+  ProcessProfiles pps = PerfDataProtoToProfiles(
+      &perf_data_proto, kPidAndTidLabels | kCpuLabel, kGroupByPids);
+  ASSERT_EQ(1, pps.size());
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(3, profile.sample_size());
+  for (int i = 0; i < 3; ++i) {
+    const auto& labels = profile.sample(i).label();
+    ASSERT_EQ(3, labels.size());
+    EXPECT_EQ(PidLabelKey, profile.string_table(labels[0].key()));
+    EXPECT_EQ(100, labels[0].num());
+    EXPECT_EQ(TidLabelKey, profile.string_table(labels[1].key()));
+    EXPECT_EQ(100 + i, labels[1].num());
+    EXPECT_EQ(CpuLabelKey, profile.string_table(labels[2].key()));
+    EXPECT_EQ(i, labels[2].num());
+    EXPECT_EQ("cpu", profile.string_table(labels[2].num_unit()));
+  }
+}
+
+// Samples in the same timestamp bucket are aggregated and labeled with the
+// start of the bucket.
+TEST_F(PerfDataConverterTest, AggregatesSamplesInTimestampBuckets) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/usr/lib/foo");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0);
+  for (uint64_t time_ns : {10000001, 15000000, 20000003}) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1010);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+    sample_event->set_sample_time_ns(time_ns);
+  }
+
+  const uint64_t kBucketNs = 10000000;
+  ConversionParams params = Params(kTimestampNsLabel, kGroupByPids);
+  params.timestamp_bucket_ns = kBucketNs;
+  ProcessProfiles pps = PerfDataProtoToProfiles(&perf_data_proto, params);
+  ASSERT_EQ(1, pps.size());
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(2, profile.sample_size());
+  const int64_t expected_counts[] = {2, 1};
+  const int64_t expected_times[] = {10000000, 20000000};
+  for (int i = 0; i < 2; ++i) {
+    const auto& sample = profile.sample(i);
+    EXPECT_EQ(expected_counts[i], sample.value(0));
+    ASSERT_EQ(1, sample.label_size());
+    EXPECT_EQ(TimestampNsLabelKey,
+              profile.string_table(sample.label(0).key()));
+    EXPECT_EQ(expected_times[i], sample.label(0).num());
+  }
+  std::vector<std::string> comments;
+  for (int64_t comment : profile.comment()) {
+    comments.push_back(profile.string_table(comment));
+  }
+  EXPECT_THAT(comments, Contains("timestamp-bucket-ns:10000000"));
+}
+
+// Samples are attributed to the event with their id, whether the ids are
+// consecutive or not.
+TEST_F(PerfDataConverterTest, AttributesSamplesToEventsById) {
+  const std::vector<std::vector<std::vector<uint64_t>>> ids_cases = {
+      {{10, 11}, {12, 14}},
+      {{1, 1ULL << 40}, {1ULL << 50}},
+  };
+  for (const auto& ids : ids_cases) {
+    PerfDataProto perf_data_proto;
+    for (const auto& attr_ids : ids) {
+      auto* file_attr = perf_data_proto.add_file_attrs();
+      for (uint64_t id : attr_ids) {
+        file_attr->add_ids(id);
+      }
+    }
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/lib/foo");
+    mmap_event->set_pid(100);
+    mmap_event->set_tid(100);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+    // One sample for each id of the first event, two for each of the second,
+    // and one with an unknown id, which is dropped.
+    std::vector<uint64_t> sample_ids = {ids[0][0], ids[0][1], ids[1][0],
+                                        ids[1][0], ids[1].back() + 1};
+    if (ids[1].size() > 1) sample_ids[3] = ids[1][1];
+    for (uint64_t id : sample_ids) {
+      auto* sample_event =
+          perf_data_proto.add_events()->mutable_sample_event();
+      sample_event->set_ip(0x1010);
+      sample_event->set_pid(100);
+      sample_event->set_tid(100);
+      sample_event->set_period(1);
+      sample_event->set_id(id);
+    }
+
+    ProcessProfiles pps = PerfDataProtoToProfiles(&perf_data_proto);
+    ASSERT_EQ(1, pps.size());
+    const auto& profile = pps[0]->data;
+    ASSERT_EQ(1, profile.sample_size());
+    ASSERT_EQ(4, profile.sample(0).value_size());
+    EXPECT_EQ(2, profile.sample(0).value(0)) << ids[1][0];
+    EXPECT_EQ(2, profile.sample(0).value(2)) << ids[1][0];
+  }
+}
+
+// The samples lost in a record are counted by a single profile sample.
+TEST_F(PerfDataConverterTest, CountsLostSamplesAtOnce) {
+  PerfDataProto perf_data_proto;
+  auto* file_attr = perf_data_proto.add_file_attrs();
+  file_attr->add_ids(7);
+  file_attr->mutable_attr()->set_sample_period(3);
+  const uint64_t kNumLost = 1000000;
+  for (int i = 0; i < 2; ++i) {
+    auto* lost_event = perf_data_proto.add_events()->mutable_lost_event();
+    lost_event->set_id(7);
+    lost_event->mutable_sample_info()->set_pid(1);
+    lost_event->mutable_sample_info()->set_tid(1);
+    lost_event->set_lost(kNumLost);
+  }
+
+  const ProcessProfiles pps =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kGroupByPids);
+  ASSERT_EQ(1, pps.size());
+  const Profile& profile = pps[0]->data;
+  ASSERT_EQ(1, profile.sample_size());
+  EXPECT_EQ(2 * kNumLost, profile.sample(0).value(0));
+  EXPECT_EQ(2 * 3 * kNumLost, profile.sample(0).value(1));
+}
+
+// Downsampling keeps the same samples on every run, and scales their values
+// so that the totals stay about the same.
+TEST_F(PerfDataConverterTest, DownsamplesDeterministically) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (int pid = 1; pid <= 2; ++pid) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/lib/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  }
+  const int kNumSamples = 4000;
+  for (int i = 0; i < kNumSamples; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + i % 0x100);
+    sample_event->set_pid(1 + i % 2);
+    sample_event->set_tid(1 + i % 2);
+    sample_event->set_period(3);
+    sample_event->set_id(0);
+  }
+
+  const uint32_t kRate = 10;
+  ConversionParams params;
+  params.downsample_rate = kRate;
+  params.downsample_seed = 42;
+  const ProcessProfiles want =
+      PerfDataProtoToProfiles(&perf_data_proto, params);
+  ASSERT_EQ(2, want.size());
+  int64_t total_count = 0;
+  for (const auto& pp : want) {
+    int64_t count = 0;
+    int64_t weight = 0;
+    for (const auto& sample : pp->data.sample()) {
+      EXPECT_EQ(0, sample.value(0) % kRate);
+      count += sample.value(0);
+      weight += sample.value(1);
+    }
+    EXPECT_EQ(3 * count, weight);
+    EXPECT_GT(count, 0);
+    EXPECT_LT(pp->data.sample_size(), 0x100);
+    total_count += count;
+    std::vector<std::string> comments;
+    for (int64_t comment : pp->data.comment()) {
+      comments.push_back(pp->data.string_table(comment));
+    }
+    EXPECT_THAT(comments, Contains("downsample-rate:10"));
+  }
+  EXPECT_GT(total_count, kNumSamples * 8 / 10);
+  EXPECT_LT(total_count, kNumSamples * 12 / 10);
+
+  for (int num_threads : {1, 2}) {
+    params.num_threads = num_threads;
+    const ProcessProfiles got =
+        PerfDataProtoToProfiles(&perf_data_proto, params);
+    ASSERT_EQ(want.size(), got.size());
+    for (size_t i = 0; i < want.size(); ++i) {
+      EXPECT_EQ(want[i]->data.SerializeAsString(),
+                got[i]->data.SerializeAsString())
+          << "num_threads " << num_threads << ", pid " << want[i]->pid;
+    }
+  }
+  params.num_threads = 1;
+  params.downsample_seed = 43;
+  const ProcessProfiles other_seed =
+      PerfDataProtoToProfiles(&perf_data_proto, params);
+  ASSERT_EQ(want.size(), other_seed.size());
+  EXPECT_NE(want[0]->data.SerializeAsString(),
+            other_seed[0]->data.SerializeAsString());
+}
+
+// An address that is mapped again gets a new location in the new mapping.
+TEST_F(PerfDataConverterTest, RemapCreatesNewLocations) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (const char* filename : {"/usr/lib/foo", "/usr/lib/bar"}) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(100);
+    mmap_event->set_tid(100);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+    for (int i = 0; i < 2; ++i) {
+      auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+      sample_event->set_ip(0x1010);
+      sample_event->set_pid(100);
+      sample_event->set_tid(100);
+      sample_event->set_period(1);
+      sample_event->set_id(0);
+    }
+  }
+
+  ProcessProfiles pps = PerfDataProtoToProfiles(&perf_data_proto);
+  ASSERT_EQ(1, pps.size());
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(2, profile.location_size());
+  EXPECT_EQ(0x1010, profile.location(0).address());
+  EXPECT_EQ(0x1010, profile.location(1).address());
+  EXPECT_NE(profile.location(0).mapping_id(), profile.location(1).mapping_id());
+  ASSERT_EQ(2, profile.sample_size());
+  EXPECT_EQ(2, profile.sample(0).value(0));
+  EXPECT_EQ(profile.location(0).id(), profile.sample(0).location_id(0));
+  EXPECT_EQ(2, profile.sample(1).value(0));
+  EXPECT_EQ(profile.location(1).id(), profile.sample(1).location_id(0));
+}
+
 TEST_F(PerfDataConverterTest, HandlesKernelMmapOverlappingUserCode) {
   std::string path = GetResource("perf-overlapping-kernel-mapping.textproto");
   std::string ascii_pb = GetContents(path);
@@ -681,6 +1753,72 @@ TEST_F(PerfDataConverterTest, GroupsByComm) {
               UnorderedPointwise(Eq(), expected_thread_comm_counts));
 }
 
+// The frames that consecutive samples of a thread share are taken from the
+// last sample, as long as their mappings stay the same.
+TEST_F(PerfDataConverterTest, ReusesCallchainFramesOfThreads) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto add_mmap = [&perf_data_proto](const char* filename) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(100);
+    mmap_event->set_tid(100);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  };
+  auto add_sample = [&perf_data_proto](uint32_t tid,
+                                       const std::vector<uint64_t>& ips) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(ips[0]);
+    sample_event->set_pid(100);
+    sample_event->set_tid(tid);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+    sample_event->add_callchain(quipper::PERF_CONTEXT_USER);
+    for (uint64_t ip : ips) {
+      sample_event->add_callchain(ip);
+    }
+  };
+  add_mmap("/usr/lib/foo");
+  add_sample(100, {0x1010, 0x1101, 0x1201, 0x1301});
+  add_sample(100, {0x1020, 0x1111, 0x1201, 0x1301});
+  add_sample(101, {0x1030, 0x1301});
+  add_sample(100, {0x1020, 0x1301});
+  add_mmap("/usr/lib/bar");
+  add_sample(100, {0x1020, 0x1301});
+
+  ProcessProfiles pps = PerfDataProtoToProfiles(&perf_data_proto);
+  ASSERT_EQ(1, pps.size());
+  const auto& profile = pps[0]->data;
+  auto addresses = [&profile](const Sample& sample) {
+    std::vector<uint64_t> addresses;
+    for (uint64_t id : sample.location_id()) {
+      addresses.push_back(profile.location(id - 1).address());
+    }
+    return addresses;
+  };
+  ASSERT_EQ(5, profile.sample_size());
+  EXPECT_THAT(addresses(profile.sample(0)),
+              testing::ElementsAre(0x1010, 0x1100, 0x1200, 0x1300));
+  EXPECT_THAT(addresses(profile.sample(1)),
+              testing::ElementsAre(0x1020, 0x1110, 0x1200, 0x1300));
+  EXPECT_THAT(addresses(profile.sample(2)),
+              testing::ElementsAre(0x1030, 0x1300));
+  EXPECT_THAT(addresses(profile.sample(3)),
+              testing::ElementsAre(0x1020, 0x1300));
+  EXPECT_THAT(addresses(profile.sample(4)),
+              testing::ElementsAre(0x1020, 0x1300));
+  EXPECT_EQ(profile.sample(0).location_id(3),
+            profile.sample(3).location_id(1));
+  // The remapped frames get new locations.
+  ASSERT_EQ(9, profile.location_size());
+  const uint64_t before = profile.sample(3).location_id(1);
+  const uint64_t after = profile.sample(4).location_id(1);
+  EXPECT_NE(profile.location(before - 1).mapping_id(),
+            profile.location(after - 1).mapping_id());
+}
+
 TEST_F(PerfDataConverterTest, SkipsFirstCallchainIPPebs) {
   std::string ascii_pb(
       GetContents(GetResource("perf-callchain-pebs.textproto")));
@@ -822,6 +1960,226 @@ TEST_F(PerfDataConverterTest, ConvertsCgroup) {
   }
 }
 
+// The samples of cgroups with the same path go to the same profile, including
+// those of a process that moves between cgroups.
+TEST_F(PerfDataConverterTest, GroupsByCgroup) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  const std::pair<uint64_t, std::string> kCgroups[] = {
+      {1, "/a"}, {2, "/b"}, {3, "/a"}};
+  for (const auto& cgroup : kCgroups) {
+    auto* cgroup_event = perf_data_proto.add_events()->mutable_cgroup_event();
+    cgroup_event->set_id(cgroup.first);
+    cgroup_event->set_path(cgroup.second);
+  }
+  for (int pid = 1; pid <= 2; ++pid) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  // Process 2 moves from /a to /b halfway, and cgroup 0 is unknown.
+  for (int i = 0; i < 40; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + i % 5);
+    sample_event->set_pid(1 + i % 2);
+    sample_event->set_tid(sample_event->pid());
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+    const uint64_t cgroup = sample_event->pid() == 1 ? 1 + 2 * (i % 4 == 0)
+                            : i < 20                 ? 3
+                                                     : 2;
+    sample_event->set_cgroup(i == 39 ? 0 : cgroup);
+  }
+
+  const ProcessProfiles pps = PerfDataProtoToProfiles(
+      &perf_data_proto, kPidLabel | kCgroupLabel,
+      kGroupByPids | kGroupByCgroup);
+  ASSERT_EQ(3, pps.size());
+  std::map<std::string, int64_t> counts;
+  for (const auto& pp : pps) {
+    EXPECT_EQ(0, pp->pid);
+    const auto& p = pp->data;
+    for (const auto& sample : p.sample()) {
+      counts[pp->cgroup] += sample.value(0);
+      std::string label_cgroup;
+      for (const auto& label : sample.label()) {
+        if (p.string_table(label.key()) == CgroupLabelKey) {
+          label_cgroup = p.string_table(label.str());
+        }
+      }
+      EXPECT_EQ(pp->cgroup, label_cgroup);
+      for (uint64_t location_id : sample.location_id()) {
+        EXPECT_LE(location_id, p.location_size());
+      }
+    }
+  }
+  const std::map<std::string, int64_t> expected_counts{
+      {"/a", 30}, {"/b", 9}, {"", 1}};
+  EXPECT_EQ(expected_counts, counts);
+}
+
+// With kEventLabels, each sample only has the values of its own event, which
+// its label names, and the counts of each event are those of the default
+// sample types.
+TEST_F(PerfDataConverterTest, ConvertsEventLabels) {
+  PerfDataProto perf_data_proto;
+  for (int i = 0; i < 3; ++i) {
+    perf_data_proto.add_file_attrs()->add_ids(i);
+    auto* event_type = perf_data_proto.add_event_types();
+    if (i < 2) event_type->set_name(i == 0 ? "cycles" : "instructions");
+  }
+  auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/usr/bin/foo");
+  mmap_event->set_pid(1);
+  mmap_event->set_tid(1);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  for (int i = 0; i < 30; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + i % 2);
+    sample_event->set_pid(1);
+    sample_event->set_tid(1);
+    sample_event->set_period(10 * (1 + i % 3));
+    sample_event->set_id(i % 5 == 0 ? 0 : 1 + i % 2);
+  }
+
+  const ProcessProfiles dense =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kNoOptions);
+  ASSERT_EQ(1, dense.size());
+  const Profile& d = dense[0]->data;
+  ASSERT_EQ(6, d.sample_type_size());
+  std::map<std::string, std::pair<int64_t, int64_t>> expected;
+  for (int e = 0; e < 3; ++e) {
+    std::string name = d.string_table(d.sample_type(2 * e).type());
+    name.resize(name.size() - std::string("_sample").size());
+    for (const auto& sample : d.sample()) {
+      expected[name].first += sample.value(2 * e);
+      expected[name].second += sample.value(2 * e + 1);
+    }
+  }
+
+  const ProcessProfiles sparse =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kEventLabels);
+  ASSERT_EQ(1, sparse.size());
+  const Profile& p = sparse[0]->data;
+  ASSERT_EQ(2, p.sample_type_size());
+  EXPECT_EQ("sample", p.string_table(p.sample_type(0).type()));
+  EXPECT_EQ("event", p.string_table(p.sample_type(1).type()));
+  EXPECT_EQ("event", p.string_table(p.default_sample_type()));
+  EXPECT_EQ(d.location_size(), p.location_size());
+  std::map<std::string, std::pair<int64_t, int64_t>> counts;
+  for (const auto& sample : p.sample()) {
+    ASSERT_EQ(2, sample.value_size());
+    ASSERT_EQ(1, sample.label_size());
+    EXPECT_EQ(EventLabelKey, p.string_table(sample.label(0).key()));
+    const std::string& name = p.string_table(sample.label(0).str());
+    counts[name].first += sample.value(0);
+    counts[name].second += sample.value(1);
+  }
+  EXPECT_EQ(expected, counts);
+  EXPECT_EQ(3, counts.size());
+  EXPECT_EQ(1, counts.count("event_0"));
+}
+
+// With kLeafOnly, the samples only have the frame of their sampled address,
+// and those that only differ in their callers are aggregated.
+TEST_F(PerfDataConverterTest, ConvertsLeafOnly) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/usr/bin/foo");
+  mmap_event->set_pid(1);
+  mmap_event->set_tid(1);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  for (int i = 0; i < 12; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1100 + i % 2);
+    sample_event->set_pid(1);
+    sample_event->set_tid(1);
+    sample_event->set_period(1);
+    sample_event->add_callchain(quipper::PERF_CONTEXT_USER);
+    sample_event->add_callchain(0x1100 + i % 2);
+    sample_event->add_callchain(0x1200 + i % 3);
+    if (i % 4 == 0) {
+      auto* entry = sample_event->add_branch_stack();
+      entry->set_from_ip(0x1300);
+      entry->set_to_ip(0x1400);
+    }
+  }
+
+  const ProcessProfiles full =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kNoOptions);
+  ASSERT_EQ(1, full.size());
+  EXPECT_LT(2, full[0]->data.sample_size());
+
+  const ProcessProfiles leaf =
+      PerfDataProtoToProfiles(&perf_data_proto, kNoLabels, kLeafOnly);
+  ASSERT_EQ(1, leaf.size());
+  const Profile& p = leaf[0]->data;
+  EXPECT_EQ(2, p.location_size());
+  ASSERT_EQ(2, p.sample_size());
+  std::set<uint64_t> addresses;
+  for (const auto& sample : p.sample()) {
+    ASSERT_EQ(1, sample.location_id_size());
+    for (const auto& location : p.location()) {
+      if (location.id() == sample.location_id(0)) {
+        addresses.insert(location.address());
+      }
+    }
+  }
+  EXPECT_EQ(std::set<uint64_t>({0x1100, 0x1101}), addresses);
+  EXPECT_EQ(12, p.sample(0).value(0) + p.sample(1).value(0));
+}
+
+// The capacities are estimated from the samples and mmaps of each process,
+// and reserving the profiles for them doesn't change the profiles.
+TEST_F(PerfDataConverterTest, ReservesProfileCapacities) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (uint32_t pid : {1U, 2U, 0xffffffffU}) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(pid == 0xffffffff ? "[kernel.kallsyms]_text"
+                                               : "/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(pid == 0xffffffff ? 0xffff0000 : 0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  for (int i = 0; i < 9; ++i) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + i % 4);
+    sample_event->set_pid(1 + i % 3 / 2);
+    sample_event->set_tid(1 + i % 3 / 2);
+    sample_event->set_period(1);
+  }
+
+  const ProfileCapacities capacities =
+      EstimateProfileCapacities(perf_data_proto);
+  ASSERT_EQ(2, capacities.size());
+  EXPECT_EQ(6, capacities.at(1).samples);
+  EXPECT_EQ(6, capacities.at(1).locations);
+  EXPECT_EQ(2, capacities.at(1).mappings);
+  EXPECT_EQ(3, capacities.at(2).samples);
+  EXPECT_EQ(2, capacities.at(2).mappings);
+
+  for (uint32_t options : {kGroupByPids, kNoOptions}) {
+    const ProfileCapacities none;
+    const ProcessProfiles reserved = PerfDataProtoToProfiles(
+        &perf_data_proto, Params(kNoLabels, options), {}, &capacities);
+    const ProcessProfiles unreserved = PerfDataProtoToProfiles(
+        &perf_data_proto, Params(kNoLabels, options), {}, &none);
+    ASSERT_EQ(unreserved.size(), reserved.size());
+    for (size_t i = 0; i < reserved.size(); ++i) {
+      EXPECT_EQ(unreserved[i]->data.SerializeAsString(),
+                reserved[i]->data.SerializeAsString());
+    }
+  }
+}
+
 std::pair<int, std::unordered_map<uint64_t, uint64_t>> ExtractCounts(
     const ProcessProfiles& pps, std::string key_name) {
   std::unordered_map<uint64_t, uint64_t> counts;
@@ -1217,6 +2575,196 @@ TEST_F(PerfDataConverterTest, BuildIdStats) {
   EXPECT_EQ(pps[1]->build_id_stats.at(kBuildIdNoMmap), 1);
 }
 
+// The frames are counted by the build ID source of their mapping, and each
+// profile of a process counts those of its own samples.
+TEST_F(PerfDataConverterTest, CountsBuildIdSourcesOfFrames) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->add_ids(0);
+  for (int pid = 1; pid <= 2; ++pid) {
+    auto* mmap_event = perf_data_proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/bin/foo");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  }
+  auto add_sample = [&perf_data_proto](int pid, uint64_t ip) {
+    auto* sample_event = perf_data_proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(ip);
+    sample_event->set_pid(pid);
+    sample_event->set_tid(pid);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+    sample_event->add_callchain(quipper::PERF_CONTEXT_USER);
+    sample_event->add_callchain(ip);
+    sample_event->add_callchain(0x1800);
+  };
+  for (int i = 0; i < 3; ++i) add_sample(1, 0x1100);
+  add_sample(2, 0x9000);
+  // The process exits, and a new one with the same pid starts.
+  auto* exit_event = perf_data_proto.add_events()->mutable_exit_event();
+  exit_event->set_pid(2);
+  exit_event->set_tid(2);
+  add_sample(2, 0x1100);
+
+  std::vector<std::unique_ptr<ProcessProfile>> pps;
+  PerfDataProtoToProfiles(
+      &perf_data_proto,
+      [&pps](std::unique_ptr<ProcessProfile> pp) {
+        pps.push_back(std::move(pp));
+      });
+  ASSERT_EQ(3, pps.size());
+  // The sample of the exited process is in an unmapped address, and its
+  // caller in the mapping, which has no build ID.
+  EXPECT_EQ(2, pps[0]->pid);
+  EXPECT_EQ((BuildIdStats{{kBuildIdNoMmap, 1}, {kBuildIdMissing, 1}}),
+            pps[0]->build_id_stats);
+  EXPECT_EQ(1, pps[1]->pid);
+  EXPECT_EQ((BuildIdStats{{kBuildIdMissing, 6}}), pps[1]->build_id_stats);
+  EXPECT_EQ(2, pps[2]->pid);
+  EXPECT_EQ((BuildIdStats{{kBuildIdMissing, 2}}), pps[2]->build_id_stats);
+}
+
+TEST_F(PerfDataConverterTest, ConvertsWithIndexedBuildIds) {
+  PerfDataProto perf_data_proto;
+  auto* attr = perf_data_proto.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_size(sizeof(quipper::perf_event_attr));
+  attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                        quipper::PERF_SAMPLE_PERIOD);
+  perf_data_proto.add_event_types()->set_name("cycles");
+  perf_data_proto.add_metadata_mask(0);
+  auto add_mmap = [&perf_data_proto](uint32_t pid, uint16_t misc,
+                                     const std::string& filename,
+                                     uint64_t start) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    event->mutable_header()->set_misc(misc);
+    auto* mmap_event = event->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(start);
+    mmap_event->set_len(0x1000);
+  };
+  add_mmap(-1, quipper::PERF_RECORD_MISC_KERNEL, "[kernel.kallsyms]_text",
+           0xffffffff81000000);
+  add_mmap(10, quipper::PERF_RECORD_MISC_USER, "/usr/bin/foo", 0x1000);
+  for (uint64_t ip : {0x1100ULL, 0xffffffff81000100ULL}) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample_event = event->mutable_sample_event();
+    sample_event->set_ip(ip);
+    sample_event->set_pid(10);
+    sample_event->set_tid(10);
+    sample_event->set_period(1);
+  }
+  std::string raw;
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.Deserialize(perf_data_proto));
+  ASSERT_TRUE(reader.WriteToString(&raw));
+
+  const std::map<std::string, std::string> build_ids = {
+      {"/usr/bin/foo", "abcdef0024"},
+      {"/usr/bin/unused", "0123"},
+      {"[kernel.kallsyms]", "f00d"},
+  };
+  const quipper::BuildIdIndex index(build_ids);
+  const ProcessProfiles expected =
+      RawPerfDataToProfiles(raw.data(), raw.size(), build_ids);
+  const ProcessProfiles pps =
+      IndexedRawPerfDataToProfiles(raw.data(), raw.size(), index);
+  ASSERT_EQ(1, expected.size());
+  ASSERT_EQ(1, pps.size());
+  EXPECT_EQ(expected[0]->data.SerializeAsString(),
+            pps[0]->data.SerializeAsString());
+  // The kernel's build ID is found by the name of its mmap.
+  const auto& profile = pps[0]->data;
+  ASSERT_EQ(2, profile.mapping_size());
+  for (const auto& mapping : profile.mapping()) {
+    EXPECT_NE(0, mapping.build_id()) << mapping.DebugString();
+  }
+}
+
+// Concurrent conversions, sharing their build IDs, give the same profiles as
+// conversions one at a time, while the logging level changes.
+TEST_F(PerfDataConverterTest, ConvertsConcurrently) {
+  PerfDataProto perf_data_proto;
+  auto* attr = perf_data_proto.add_file_attrs()->mutable_attr();
+  attr->set_type(quipper::PERF_TYPE_HARDWARE);
+  attr->set_size(sizeof(quipper::perf_event_attr));
+  attr->set_sample_type(quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                        quipper::PERF_SAMPLE_PERIOD);
+  perf_data_proto.add_event_types()->set_name("cycles");
+  perf_data_proto.add_metadata_mask(0);
+  for (uint32_t pid = 10; pid < 14; ++pid) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_MMAP);
+    auto* mmap_event = event->mutable_mmap_event();
+    mmap_event->set_filename(pid % 2 ? "/usr/bin/foo" : "/usr/lib/libbar.so");
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+  }
+  for (int i = 0; i < 200; ++i) {
+    auto* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample_event = event->mutable_sample_event();
+    // A few samples are outside of the mappings.
+    sample_event->set_ip(i % 25 == 0 ? 0x3000 : 0x1000 + i % 7 * 0x200);
+    sample_event->set_pid(10 + i % 4);
+    sample_event->set_tid(10 + i % 4);
+    sample_event->set_period(1);
+  }
+  std::string raw;
+  quipper::PerfReader reader;
+  ASSERT_TRUE(reader.Deserialize(perf_data_proto));
+  ASSERT_TRUE(reader.WriteToString(&raw));
+
+  const std::map<std::string, std::string> build_ids = {
+      {"/usr/bin/foo", "abcdef0024"},
+      {"/usr/lib/libbar.so", "0123"},
+  };
+  const quipper::BuildIdIndex index(build_ids);
+  const uint32_t labels = kPidLabel | kTidLabel | kCommLabel;
+  const ProcessProfiles expected =
+      RawPerfDataToProfiles(raw.data(), raw.size(), build_ids, labels);
+  ASSERT_EQ(4, expected.size());
+  ConversionParams indexed_params = Params(labels, kGroupByPids);
+  indexed_params.num_threads = 2;
+
+  const int log_level = logging::GetMinLogLevel();
+  std::vector<std::thread> threads;
+  // Not a vector<bool>, whose elements can't be written concurrently.
+  std::vector<int> same(8, 0);
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&, t]() {
+      bool ok = true;
+      for (int i = 0; i < 10; ++i) {
+        const ProcessProfiles pps =
+            t % 2 ? IndexedRawPerfDataToProfiles(raw.data(), raw.size(), index,
+                                                 indexed_params)
+                  : RawPerfDataToProfiles(raw.data(), raw.size(), build_ids,
+                                          labels);
+        ok = ok && pps.size() == expected.size();
+        for (size_t j = 0; ok && j < pps.size(); ++j) {
+          ok = pps[j]->data.SerializeAsString() ==
+               expected[j]->data.SerializeAsString();
+        }
+      }
+      same[t] = ok;
+    });
+  }
+  for (int i = 0; i < 100; ++i) {
+    logging::SetMinLogLevel(i % 2 ? log_level : ERROR);
+  }
+  for (auto& thread : threads) thread.join();
+  logging::SetMinLogLevel(log_level);
+  EXPECT_EQ(std::vector<int>(8, 1), same);
+}
+
 TEST_F(PerfDataConverterTest, AddressContext) {
   std::string ascii_pb(
       GetContents(GetResource("perf-address-context.textproto")));
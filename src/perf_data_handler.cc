@@ -7,11 +7,12 @@
 
 #include "src/perf_data_handler.h"
 
-#include <sys/mman.h>
-
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <functional>
 #include <iomanip>
 #include <iostream>
@@ -20,6 +21,8 @@
 #include <regex>  
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -31,8 +34,10 @@
 #include "src/quipper/arm_spe_decoder.h"
 #include "src/quipper/binary_data_utils.h"
 #include "src/quipper/dso.h"
+#include "src/quipper/event_id_index.h"
 #include "src/quipper/kernel/perf_event.h"
 #include "src/quipper/kernel/perf_internals.h"
+#include "src/quipper/trace.h"
 
 using quipper::PerfDataProto;
 using quipper::PerfDataProto_MMapEvent;
@@ -59,32 +64,29 @@ bool HasSuffixString(const std::string& s, const char* substr) {
 }
 
 // Checks if the auxtrace events contain Arm SPE data.
-bool HasArmSPEAuxtrace(const PerfDataProto& perf_proto) {
-  for (const auto& event_proto : perf_proto.events()) {
-    if (event_proto.has_auxtrace_info_event()) {
-      if (event_proto.auxtrace_info_event().type() ==
-          quipper::PERF_AUXTRACE_ARM_SPE) {
-        return true;
-      }
-    }
-  }
-  return false;
-}
-
-// Creates a tid->pid mapping through fork & comm events.
-std::unordered_map<uint32_t, uint32_t> TidToPidMapping(
-    const PerfDataProto& perf_proto) {
-  std::unordered_map<uint32_t, uint32_t> t2p;
+// Returns whether the events contain Arm SPE auxtrace data, and if so, stores
+// the tid->pid mapping created through the fork & comm events in |t2p|. Both
+// are found in a single pass over the events.
+bool ScanArmSPEAuxtrace(const PerfDataProto& perf_proto,
+                        std::unordered_map<uint32_t, uint32_t>* t2p) {
+  bool has_spe_auxtrace = false;
   for (const auto& event_proto : perf_proto.events()) {
     if (event_proto.has_fork_event()) {
       const auto& fork = event_proto.fork_event();
-      t2p[fork.tid()] = fork.pid();
+      (*t2p)[fork.tid()] = fork.pid();
     } else if (event_proto.has_comm_event()) {
       const auto& comm = event_proto.comm_event();
-      t2p[comm.tid()] = comm.pid();
+      (*t2p)[comm.tid()] = comm.pid();
+    } else if (event_proto.has_auxtrace_info_event() &&
+               event_proto.auxtrace_info_event().type() ==
+                   quipper::PERF_AUXTRACE_ARM_SPE) {
+      has_spe_auxtrace = true;
     }
   }
-  return t2p;
+  if (!has_spe_auxtrace) {
+    t2p->clear();
+  }
+  return has_spe_auxtrace;
 }
 
 // Normalizer iterates through the events and metadata of the given
@@ -92,141 +94,152 @@ std::unordered_map<uint32_t, uint32_t> TidToPidMapping(
 // the iteration, it drives callbacks to PerfDataHandler with samples in a fully
 // normalized form (e.g. samples with their corresponding metadata like their
 // mappings, call chains, branch stacks etc.).
-class Normalizer {
+//
+// In streaming mode, the events are not read from the PerfDataProto, but handed
+// to ProcessEvent() one at a time by the caller instead.
+class Normalizer : public PerfDataHandler::EventStream {
  public:
-  Normalizer(const PerfDataProto& perf_proto, PerfDataHandler* handler)
-      : perf_proto_(perf_proto), handler_(handler) {
-    for (const auto& build_id : perf_proto_.build_ids()) {
-      const std::string& bytes = build_id.build_id_hash();
-      std::stringstream hex;
-      for (size_t i = 0; i < bytes.size(); ++i) {
-        // The char must be turned into an int to be used by stringstream;
-        // however, if the byte's value -8 it should be turned to 0x00f8 as an
-        // int, not 0xfff8. This cast solves this problem.
-        const auto& byte = static_cast<unsigned char>(bytes[i]);
-        hex << std::hex << std::setfill('0') << std::setw(2)
-            << static_cast<int>(byte);
-      }
-      std::string filename = PerfDataHandler::NameOrMd5Prefix(
-          build_id.filename(), build_id.filename_md5_prefix());
-      auto build_id_it = filename_to_build_id_.find(filename);
-      BuildIdSource build_id_source =
-          build_id.has_is_injected() && build_id.is_injected()
-              ? kBuildIdFilenameInjected
-              : kBuildIdFilename;
-      if (build_id_it != filename_to_build_id_.end() &&
-          build_id_it->second.value != hex.str()) {
-        LOG(WARNING)
-            << "Observed build ID changed for file path " << filename
-            << ": initially saw " << build_id_it->second.value << ", now saw "
-            << hex.str() << std::hex << " (pid=0x" << build_id.pid() << ")"
-            << ". In-flight build ID change may lead to wrong symbolization.";
-        build_id_source = kBuildIdFilenameAmbiguous;
-      }
-      filename_to_build_id_[filename] = BuildId(hex.str(), build_id_source);
-
-      switch (build_id.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) {
-        case quipper::PERF_RECORD_MISC_KERNEL:
-          if (quipper::IsKernelNonModuleName(filename) ||
-              !HasSuffixString(filename, ".ko")) {
-            std::string build_id = hex.str();
-            if (!maybe_kernel_build_id_.empty() &&
-                maybe_kernel_build_id_ != build_id) {
-              LOG(WARNING) << "Multiple kernel buildids found, file name: "
-                           << filename << ", build id: " << build_id
-                           << ". Using the "
-                              "first found buildid: "
-                           << maybe_kernel_build_id_ << ".";
-              break;
-            }
-            LOG(INFO) << "Using the build id found for the file name: "
-                      << filename << ", build id: " << build_id << ".";
-            maybe_kernel_build_id_ = build_id;
-          }
-      }
+  Normalizer(const PerfDataProto& perf_proto, PerfDataHandler* handler,
+             bool streaming = false)
+      : perf_proto_(&perf_proto),
+        handler_(handler),
+        streaming_(streaming),
+        normalize_stacks_(handler->NeedsStacks()) {
+    sample_batch_.reserve(kSampleBatchSize);
+    ReadMetadata();
+
+    // In streaming mode, these are discovered as the events arrive.
+    if (!streaming_) {
+      has_spe_auxtrace_ = ScanArmSPEAuxtrace(*perf_proto_, &tid_to_pid_);
     }
+  }
 
-    // We will use LOST_SAMPLE events to count lost samples for perf version
-    // 6.1 or newer.
-    // The following code converts the first two parts of the full perf version
-    // string into two integers (for example, assume perf_version="6.123.456",
-    // then v1=6, v2=123), and decides if the version is 6.1 or newer.
-    const std::string& perf_version =
-        perf_proto_.string_metadata().has_perf_version()
-            ? perf_proto_.string_metadata().perf_version().value()
-            : "";
-    std::regex rx(R"(([0-9]+)\.([0-9]+).*)");
-    std::cmatch cm;
-    std::regex_match(perf_version.c_str(), cm, rx);
-
-    if (cm.size() == 3) {
-      int v1 = std::stoi(cm[1]);
-      int v2 = std::stoi(cm[2]);
-      use_lost_sample_ = std::make_pair(v1, v2) >= std::make_pair(6, 1);
-    } else {
-      LOG(WARNING) << "Invalid perf version: " << perf_version;
-    }
+  Normalizer(const Normalizer&) = delete;
+  Normalizer& operator=(const Normalizer&) = delete;
 
-    uint64_t current_event_index = 0;
-    for (const auto& attr : perf_proto_.file_attrs()) {
-      for (uint64_t id : attr.ids()) {
-        id_to_event_index_[id] = current_event_index;
-      }
-      current_event_index++;
-    }
+  ~Normalizer() override {}
 
-    has_spe_auxtrace_ = HasArmSPEAuxtrace(perf_proto_);
-    if (has_spe_auxtrace_) {
-      tid_to_pid_ = TidToPidMapping(perf_proto_);
-    }
+  // Converts to a protobuf using quipper and then aggregate the results. The
+  // samples in |samples|, if not null, are processed at their positions among
+  // the events of the proto.
+  void Normalize(const quipper::SampleColumns* samples = nullptr);
+
+  // Sets the number of threads Normalize() decodes Arm SPE trace buffers on,
+  // ahead of the events that carry them.
+  void set_num_threads(int num_threads) { num_threads_ = num_threads; }
+
+  // Sets the filter of the Arm SPE records that samples are synthesized from.
+  void set_spe_filter(const quipper::ArmSpeDecoder::RecordFilter& filter) {
+    spe_filter_ = filter;
   }
 
-  Normalizer(const Normalizer&) = delete;
-  Normalizer& operator=(const Normalizer&) = delete;
+  // Sets where Finish() stores the counters of the normalization.
+  void set_stats(PerfDataHandler::NormalizationStats* stats) {
+    stats_out_ = stats;
+  }
 
-  ~Normalizer() {}
+  // Sets the perf data the proto was read from, which holds the trace data
+  // of the auxtrace events that are read with a trace_data_offset.
+  void set_perf_data(std::string_view perf_data) { perf_data_ = perf_data; }
 
-  // Converts to a protobuf using quipper and then aggregate the results.
-  void Normalize();
+  // Normalizes a single event and calls the handler for it as needed.
+  void ProcessEvent(const PerfDataProto::PerfEvent& event_proto) override;
 
- private:
-  // Using a 32-bit type for the PID values as the max PID value on 64-bit
-  // systems is 2^22, see http://man7.org/linux/man-pages/man5/proc.5.html.
-  typedef std::unordered_map<uint32_t, PerfDataHandler::Mapping*> PidToMMapMap;
-  typedef std::unordered_map<uint32_t, const quipper::PerfDataProto_CommEvent*>
-      PidToCommMap;
+  void Finish() override {
+    FlushSamples();
+    LogStats();
+    if (stats_out_ != nullptr) {
+      stat_.address_spaces = 0;
+      for (const auto& it : pid_states_) {
+        stat_.address_spaces += it.second.mmaps != nullptr;
+      }
+      stat_.mappings = owned_mappings_.size();
+      stat_.dsos = owned_dsos_.size();
+      *stats_out_ = stat_;
+    }
+    handler_->Finish();
+  }
 
-  typedef IntervalMap<const PerfDataHandler::Mapping*> MMapIntervalMap;
+  void StartChunk(const PerfDataProto& perf_proto) override;
+
+ private:
+  // Address spaces are looked up for every sample and callchain frame, but
+  // only written by mmap events.
+  // The code regions of JITs are kept apart from the other mappings, as there
+  // may be hundreds of thousands of them, mapped one by one.
+  typedef LayeredIntervalMap<const PerfDataHandler::Mapping*> MMapIntervalMap;
 
   // Gets the build ID if the mmap2 event's build_id field exists, otherwise
   // finds the build ID according to the filename from the mmap.
   BuildId GetBuildId(const quipper::PerfDataProto_MMapEvent* mmap);
+  // Same as above, for the mmaps of |filename| with |build_id_from_mmap|,
+  // without the cache of resolved_build_ids_.
+  BuildId ResolveBuildId(const std::string& filename,
+                         const std::string& build_id_from_mmap) const;
 
-  void ConvertMmapFromKsymbol(
-      const quipper::PerfDataProto_KsymbolEvent& ksymbol_event, uint32_t prot,
-      quipper::PerfDataProto_MMapEvent* mmap);
+  // Returns the mmaps of pid to be changed, unshared from those of its parent
+  // or children, and drops the lookups cached from them.
+  MMapIntervalMap* MutableMMaps(uint32_t pid);
 
   // Copy the parent's mmaps/comm if they exist.  Otherwise, items
   // will be lazily populated.
   void UpdateMapsWithMMapEvent(const quipper::PerfDataProto_MMapEvent* mmap);
 
   void UpdateMapsWithForkEvent(const quipper::PerfDataProto_ForkEvent& fork);
+
   void LogStats();
 
-  // Handles the sample_event in event_proto (wrapped in the sample context) and
-  // call handler_->Sample.
-  void HandleSample(PerfDataHandler::SampleContext* context);
+  // Handles the sample_event in event_proto (wrapped in the sample context).
+  // Returns false if the sample is dropped, and true if it should be passed to
+  // the handler.
+  bool HandleSample(PerfDataHandler::SampleContext* context);
+  // Normalizes the callchain and the branch stack of the sample of process
+  // |pid| into |context|.
+  void NormalizeStacks(uint32_t pid, PerfDataHandler::SampleContext* context);
+
+  // Appends a context for the sample to sample_batch_, giving it the callchain
+  // and branch stack storage of an earlier sample. |header| and |sample| must
+  // stay alive until the next FlushSamples().
+  PerfDataHandler::SampleContext* AddSample(
+      const quipper::PerfDataProto::EventHeader& header,
+      const quipper::PerfDataProto::SampleEvent& sample);
+
+  // Removes the last sample from sample_batch_, keeping its storage.
+  void RemoveLastSample();
+
+  // Passes the samples in sample_batch_ to the handler. Called before any
+  // other callback of the handler, so that it sees the events in order.
+  void FlushSamples();
 
   // Handles the auxtrace event in event_proto that contains the Arm SPE
   // records to parse potential samples.
   void HandleSpeAuxtrace(const quipper::PerfDataProto::PerfEvent& event_proto);
 
+  // Returns the trace data of auxtrace_event, from the event itself or from
+  // perf_data_. Returns an empty view if there is none.
+  std::string_view TraceData(
+      const quipper::PerfDataProto::AuxtraceEvent& auxtrace_event) const;
+
+  // Synthesizes a sample from an Arm SPE record and handles it.
+  void HandleSpeRecord(const quipper::ArmSpeDecoder::Record& record);
+
+  // Returns the records decoded from spe_buffers_[next_spe_buffer_], and moves
+  // on to the next buffer. Decodes the next few buffers on up to num_threads_
+  // threads if needed.
+  std::vector<quipper::ArmSpeDecoder::Record> TakeDecodedSpeRecords();
+
   // Handles the ksymbol event in event_proto.
   void HandleKsymbol(const quipper::PerfDataProto::PerfEvent& event_proto);
 
   // Handles the perf LOST event or LOST_SAMPLE event.
   void HandleLost(const quipper::PerfDataProto::PerfEvent& event_proto);
 
+  // Returns the interned DSO with the specified attributes, adding it if
+  // needed. The returned pointer is owned by the normalizer.
+  const PerfDataHandler::Dso* InternDso(const std::string& filename,
+                                        const BuildId& build_id,
+                                        uint64_t filename_md5_prefix);
+
   // Get a memoized fake mapping by specified attributes or add one. Never
   // returns nullptr. The returned pointer is owned by the normalizer and
   // bound to its lifetime.
@@ -240,29 +253,70 @@ class Normalizer {
   const PerfDataHandler::Mapping* TryLookupInPid(uint32_t pid,
                                                  uint64_t ip) const;
 
+  // Forgets the cached lookups in the address space of pid, which is about to
+  // change.
+  void InvalidateMappingCache(uint32_t pid);
+
   // Find the mapping for a given ip given a context; returns nullptr if none
   // can be found.
   const PerfDataHandler::Mapping* GetMappingFromPidAndIP(
       uint32_t pid, uint64_t ip, quipper::AddressContext context) const;
 
-  // Find the main MMAP event for this pid.  If no mapping is found,
-  // nullptr is returned.
-  const PerfDataHandler::Mapping* GetMainMMapFromPid(uint32_t pid) const;
+  // Reads the build IDs, the perf version and the file attrs of
+  // perf_proto_->
+  void ReadMetadata();
+
+  // Fills the tables used by GetEventIndexForSample().
+  void BuildEventIndex();
 
   // For profiles with a single event, perf doesn't bother sending the
   // id.  So, if there is only one event, the event index must be 0.
   // Returns the event index corresponding to the id for this sample, or
   // -1 for an error.
   int64_t GetEventIndexForSample(
-      const quipper::PerfDataProto_SampleEvent& sample) const;
-
-  const quipper::PerfDataProto& perf_proto_;
-  PerfDataHandler* handler_;  // unowned.
-
-  // Mapping we have allocated.
-  std::vector<std::unique_ptr<PerfDataHandler::Mapping>> owned_mappings_;
-  std::vector<std::unique_ptr<quipper::PerfDataProto_MMapEvent>>
-      owned_quipper_mappings_;
+      const quipper::PerfDataProto_SampleEvent& sample);
+
+  const quipper::PerfDataProto* perf_proto_;  // unowned.
+  PerfDataHandler* handler_;                  // unowned.
+
+  // Whether the events are handed to ProcessEvent() rather than read from
+  // perf_proto_->
+  const bool streaming_;
+  // See PerfDataHandler::NeedsStacks().
+  const bool normalize_stacks_;
+
+  // The maximum number of samples passed to handler_->SampleBatch() at once.
+  static constexpr size_t kSampleBatchSize = 256;
+
+  // Whether the sample events handed to ProcessEvent() stay alive until the
+  // end, so that their samples can be batched. Otherwise, each sample is
+  // passed to the handler right away.
+  bool batch_samples_ = false;
+
+  // The normalized samples not passed to the handler yet. The vector never
+  // grows past kSampleBatchSize, so the contexts don't move.
+  std::vector<PerfDataHandler::SampleContext> sample_batch_;
+  // The storage used by the callchain and branch_stack of sample_batch_[i]
+  // before the last flush, emptied but not freed.
+  std::vector<std::vector<PerfDataHandler::Location>> callchain_pool_;
+  std::vector<std::vector<PerfDataHandler::BranchStackPair>>
+      branch_stack_pool_;
+  // The longest callchain and branch stack normalized so far. The storage of
+  // the samples that don't have pooled storage yet is reserved for as many,
+  // since the depths are mostly bounded by the same recording options, which
+  // aren't in the file attrs.
+  size_t max_callchain_size_ = 0;
+  size_t max_branch_stack_size_ = 0;
+
+  // Whether any of the file_attrs has the comm_exec bit set.
+  bool has_comm_exec_support_ = false;
+
+  // Mapping we have allocated. The objects owned by the normalizer are kept in
+  // deques, which allocate them in chunks and never move them, so that the
+  // pointers handed out stay valid until the normalizer is destroyed.
+  std::deque<PerfDataHandler::Mapping> owned_mappings_;
+  // Copies of the streamed comm events referenced by pid_states_.
+  std::deque<quipper::PerfDataProto_CommEvent> owned_comm_events_;
 
   struct FakeMappingKey {
     std::string comm;
@@ -288,22 +342,102 @@ class Normalizer {
                      FakeMappingKey::Hasher>
       fake_mappings_;
 
+  // The interned DSOs, keyed by views of their own fields, so that the
+  // mappings of a file mapped into many processes share its strings.
+  struct DsoKey {
+    std::string_view filename;
+    std::string_view build_id;
+    BuildIdSource build_id_source;
+    uint64_t filename_md5_prefix;
+
+    bool operator==(const DsoKey& rhs) const {
+      return filename == rhs.filename && build_id == rhs.build_id &&
+             build_id_source == rhs.build_id_source &&
+             filename_md5_prefix == rhs.filename_md5_prefix;
+    }
+
+    struct Hasher {
+      std::size_t operator()(const DsoKey& k) const noexcept {
+        std::size_t h = std::hash<std::string_view>{}(k.filename);
+        h = h * 31 + std::hash<std::string_view>{}(k.build_id);
+        return h * 31 + k.filename_md5_prefix;
+      }
+    };
+  };
+
+  std::deque<PerfDataHandler::Dso> owned_dsos_;
+  std::unordered_map<DsoKey, const PerfDataHandler::Dso*, DsoKey::Hasher>
+      dsos_;
+
   // The event for a given sample is determined by the id.
   // Map each id to an index in the event_profiles_ vector.
-  std::unordered_map<uint64_t, uint64_t> id_to_event_index_;
-
-  // pid_to_comm_event maps a pid to the corresponding comm event.
-  PidToCommMap pid_to_comm_event_;
+  quipper::EventIdIndex id_to_event_index_;
+
+  // The span of the kernel's mappings, from the lowest start to the highest
+  // limit. Empty if there are none.
+  uint64_t kernel_start_ = UINT64_MAX;
+  uint64_t kernel_limit_ = 0;
+
+  // The address space last looked up in by TryLookupInPid(), and the intervals
+  // of it that were hit most recently, most recent first. Consecutive lookups
+  // are mostly for the frames of one sample, or for samples of one thread, and
+  // hit the same few mappings, e.g. the main binary, libc and the kernel.
+  // User and kernel addresses are cached separately, since the kernel's
+  // address space is looked up in whenever a user lookup fails.
+  struct MappingCache {
+    struct Entry {
+      uint64_t start;
+      uint64_t limit;
+      const PerfDataHandler::Mapping* mapping;
+    };
+    static constexpr int kNumEntries = 4;
 
-  // pid_to_mmaps maps a pid to all mmap events that correspond to that pid.
-  std::unordered_map<uint32_t, std::unique_ptr<MMapIntervalMap>> pid_to_mmaps_;
+    bool valid = false;
+    uint32_t pid = 0;
+    // Null if there are no mmaps for pid.
+    const MMapIntervalMap* mmaps = nullptr;
+    // The resolved IPs of pid, set along with mmaps, see PidState.
+    std::unordered_map<uint64_t, Entry>* resolved_ips = nullptr;
+    int num_entries = 0;
+    Entry entries[kNumEntries];
+  };
+  mutable MappingCache user_mapping_cache_;
+  mutable MappingCache kernel_mapping_cache_;
+
+  // The state of a process, kept in one record so that a sample only looks its
+  // process up once.
+  struct PidState {
+    // All the mmap events of the process, or null if there are none. A forked
+    // child shares its parent's map until either of them mmaps, as many
+    // children exec or exit without mmapping anything.
+    std::shared_ptr<MMapIntervalMap> mmaps;
+    // The interval found for each IP looked up in mmaps, with a null mapping
+    // if there is none, until the address space changes. The same IPs recur
+    // in most samples of a process, so each of them only goes through the
+    // interval map once, and kernel IPs that are first looked up in the
+    // process's address space don't fail there over and over again. They are
+    // cleared after kMaxResolvedIps, to bound their memory.
+    std::unordered_map<uint64_t, MappingCache::Entry> resolved_ips;
+    // The mmap that most likely contains the filename of the main executable,
+    // or null.
+    PerfDataHandler::Mapping* executable_mmap = nullptr;
+    // The comm event of the process, or null.
+    const quipper::PerfDataProto_CommEvent* comm = nullptr;
+    // Whether an mmap event of the process was found.
+    bool had_any_mmap = false;
+  };
+  static constexpr size_t kMaxResolvedIps = 1 << 16;
 
-  // pid_to_executable_mmap maps a pid to mmap that most likely contains the
-  // filename of the main executable for that pid.
-  PidToMMapMap pid_to_executable_mmap_;
+  // Returns the state of pid, or null if nothing is known about it.
+  const PidState* FindPidState(uint32_t pid) const {
+    const auto it = pid_states_.find(pid);
+    return it != pid_states_.end() ? &it->second : nullptr;
+  }
 
-  // |pid_had_any_mmap_| stores the pids that have their mmap events found.
-  std::unordered_set<uint32_t> pid_had_any_mmap_;
+  // Using a 32-bit type for the PID values as the max PID value on 64-bit
+  // systems is 2^22, see http://man7.org/linux/man-pages/man5/proc.5.html.
+  // The resolved IPs are mutable, as lookups fill them in.
+  mutable std::unordered_map<uint32_t, PidState> pid_states_;
 
   // map filenames to build-ids, to deal with the situation where buildid-mmap
   // is not available.
@@ -315,8 +449,19 @@ class Normalizer {
   // when no buildid found for the filename [kernel.kallsyms] .
   std::string maybe_kernel_build_id_;
 
-  // map from cgroup id to pathname.
-  std::unordered_map<uint64_t, const std::string> cgroup_map_;
+  // The build ID GetBuildId() resolved for the last mmap of each filename,
+  // keyed as filename_to_build_id_ is, and the mmap's own build ID. Most of
+  // the mmaps of a profile repeat a few files, e.g. forked processes.
+  struct ResolvedBuildId {
+    std::string build_id_from_mmap;
+    BuildId build_id;
+  };
+  std::unordered_map<std::string, ResolvedBuildId> resolved_build_ids_;
+
+  // map from cgroup id to pathname, interned in cgroup_paths_ so that the
+  // samples of the cgroups with the same path point to the same string.
+  std::unordered_map<uint64_t, const std::string*> cgroup_map_;
+  std::unordered_set<std::string> cgroup_paths_;
 
   // Whether we should use lost_samples_event event to count lost samples.
   // Difference between lost_event and lost_samples_event: lost_event can be
@@ -331,27 +476,32 @@ class Normalizer {
   // Whether the following auxtrace events contain Arm SPE data.
   bool has_spe_auxtrace_ = false;
 
+  quipper::ArmSpeDecoder::RecordFilter spe_filter_;
+  // See set_perf_data().
+  std::string_view perf_data_;
+  // The number of threads that Arm SPE trace buffers are decoded on.
+  int num_threads_ = 1;
+  // With more than one thread, the auxtrace events with Arm SPE data, in
+  // order. The records of spe_buffers_[decoded_spe_begin_ + i] are in
+  // decoded_spe_records_[i], and next_spe_buffer_ is the next buffer to be
+  // handled.
+  std::vector<const quipper::PerfDataProto::AuxtraceEvent*> spe_buffers_;
+  size_t next_spe_buffer_ = 0;
+  size_t decoded_spe_begin_ = 0;
+  std::vector<std::vector<quipper::ArmSpeDecoder::Record>> decoded_spe_records_;
+  // The event that the sample of each Arm SPE record is synthesized in. Each
+  // sample is passed to the handler before the next one, so the event is
+  // reused rather than built for every record.
+  quipper::PerfDataProto::PerfEvent spe_event_;
+
   // map from thread ID to process ID. It is used for parsing SPE records into
   // samples.
   std::unordered_map<uint32_t, uint32_t> tid_to_pid_;
 
-  struct {
-    int64_t samples = 0;
-    int64_t samples_with_addr = 0;
-    int64_t synthesized_lost_samples = 0;
-    int64_t missing_main_mmap = 0;
-    int64_t missing_sample_mmap = 0;
-    int64_t missing_addr_mmap = 0;
-    int64_t missing_pid = 0;
-
-    int64_t callchain_ips = 0;
-    int64_t missing_callchain_mmap = 0;
-
-    int64_t branch_stack_ips = 0;
-    int64_t missing_branch_stack_mmap = 0;
-
-    int64_t no_event_errors = 0;
-  } stat_;
+  PerfDataHandler::NormalizationStats stat_;
+  // Where Finish() copies stat_, if anywhere. The handler's calls are only
+  // timed then.
+  PerfDataHandler::NormalizationStats* stats_out_ = nullptr;
 };
 
 void Normalizer::UpdateMapsWithForkEvent(
@@ -360,115 +510,241 @@ void Normalizer::UpdateMapsWithForkEvent(
     // Don't care about threads.
     return;
   }
-  const auto& it = pid_to_mmaps_.find(fork.ppid());
-  if (it != pid_to_mmaps_.end()) {
-    pid_to_mmaps_[fork.pid()] =
-        std::unique_ptr<MMapIntervalMap>(new MMapIntervalMap(*it->second));
+  const PidState* parent = FindPidState(fork.ppid());
+  if (parent == nullptr) {
+    return;
+  }
+  // The parent's state stays where it is as the child's is added.
+  PidState& child = pid_states_[fork.pid()];
+  if (parent->mmaps != nullptr) {
+    InvalidateMappingCache(fork.pid());
+    child.mmaps = parent->mmaps;
   }
-  auto comm_it = pid_to_comm_event_.find(fork.ppid());
-  if (comm_it != pid_to_comm_event_.end()) {
-    pid_to_comm_event_[fork.pid()] = comm_it->second;
+  if (parent->comm != nullptr) {
+    child.comm = parent->comm;
   }
-  auto exec_mmap_it = pid_to_executable_mmap_.find(fork.ppid());
-  if (exec_mmap_it != pid_to_executable_mmap_.end()) {
-    pid_to_executable_mmap_[fork.pid()] = exec_mmap_it->second;
+  if (parent->executable_mmap != nullptr) {
+    child.executable_mmap = parent->executable_mmap;
   }
 }
 
 static constexpr char kLostMappingFilename[] = "[lost]";
 static const uint64_t kLostMd5Prefix = quipper::Md5Prefix(kLostMappingFilename);
 
-void Normalizer::Normalize() {
-  // Perf keeps the tracking bits (e.g. comm_exec) in only one of the events'
-  // file_attrs.
-  bool has_comm_exec_support = false;
-  for (const auto& fa : perf_proto_.file_attrs()) {
-    if (fa.attr().comm_exec()) {
-      has_comm_exec_support = true;
-      break;
+void Normalizer::Normalize(const quipper::SampleColumns* samples) {
+  QUIPPER_TRACE_SPAN("Normalizer::Normalize");
+  // The events of perf_proto_ outlive the batches.
+  batch_samples_ = true;
+  if (has_spe_auxtrace_ && num_threads_ > 1) {
+    for (const auto& event_proto : perf_proto_->events()) {
+      if (event_proto.has_auxtrace_event() &&
+          !TraceData(event_proto.auxtrace_event()).empty()) {
+        spe_buffers_.push_back(&event_proto.auxtrace_event());
+      }
     }
   }
-  for (const auto& event_proto : perf_proto_.events()) {
-    if (event_proto.has_mmap_event()) {
-      UpdateMapsWithMMapEvent(&event_proto.mmap_event());
-      pid_had_any_mmap_.insert(event_proto.mmap_event().pid());
-    } else if (event_proto.has_comm_event()) {
-      PerfDataHandler::CommContext comm_context;
-      if (event_proto.comm_event().pid() == event_proto.comm_event().tid()) {
-        if (!has_comm_exec_support ||
-            event_proto.header().misc() & quipper::PERF_RECORD_MISC_COMM_EXEC ||
-            pid_had_any_mmap_.find(event_proto.comm_event().pid()) ==
-                pid_had_any_mmap_.end()) {
-          // Based on the perf data collected, comm events (with pid == tid) can
-          // be generated (1) on exec() or (2) when the main thread name is set
-          // after exec (generating another COMM EVENT, e.g. using PR_SET_NAME
-          // http://man7.org/linux/man-pages/man2/prctl.2.html).
-          // We want to identify if a comm event (with pid == tid) is due to
-          // exec() (the first case) and erase the pid to executable mapping in
-          // |pid_to_executable_mmap_| if so.
-          // One way to know that comm event is due to exec() is to check if the
-          // misc bit is set to PERF_RECORD_MISC_COMM_EXEC. However, this misc
-          // bit is only set in newer kernels (>= 3.16) and for execs that
-          // happen after perf collection start. Thus, we need to have some
-          // heuristics to cover other cases and identify possible comm events
-          // that happen due to exec().
-          // Another way is to find the contrary scenario for the second case.
-          // Commonly found patterns of comm events on setting the main thread
-          // name can look like this: FORK EVENT -> COMM EVENT (on exec()) ->
-          // MMAP EVENTs -> SAMPLE EVENTs -> COMM EVENT (on setting main thread
-          // name) -> SAMPLE EVENTs ... Thus, if a mmap event is already found
-          // for a pid before a comm event, this comm event is due to setting
-          // the main thread name. Vice versa, if the mmap event is not yet
-          // found for the pid, it is very likely this comm event happens due
-          // to exec() and |pid_to_executable_mmap_| should be erased.
-          // Also note that for older kernels (< 3.16), where the comm_exec
-          // in perf file attribute is not set, we will erase the mapping in
-          // |pid_to_executable_mmap_| at the occurrence of a comm event.
-          // Thus we have the following heuristics:
-          // The pid to executable mapping in |pid_to_executable_mmap_| is
-          // erased when either one of the following is true (1) comm_exec in
-          // perf file attribute is not set (kernel < 3.16) (2) comm_event's
-          // PERF_RECORD_MISC_COMM_EXEC misc bit is set in header, meaning an
-          // exec() happened, (3) no mmap event for this pid has been found,
-          // meaning this is the first comm event after an exec().
-          pid_to_executable_mmap_.erase(event_proto.comm_event().pid());
-          // is_exec is true if the comm event happened due to exec(), this flag
-          // is passed to perf_data_converter and used to modify PerPidInfo.
-          comm_context.is_exec = true;
-        }
-        pid_to_comm_event_[event_proto.comm_event().pid()] =
-            &event_proto.comm_event();
+
+  if (samples == nullptr || samples->size() == 0) {
+    for (const auto& event_proto : perf_proto_->events()) {
+      ProcessEvent(event_proto);
+    }
+    Finish();
+    return;
+  }
+
+  // Each sample is rebuilt in the same message, which is only used during
+  // the call.
+  PerfDataProto::PerfEvent sample_event;
+  size_t next_sample = 0;
+  const size_t num_events = perf_proto_->events_size();
+  for (size_t i = 0; i <= num_events; ++i) {
+    for (; next_sample < samples->size() &&
+           samples->event_index(next_sample) <= i;
+         ++next_sample) {
+      samples->GetEvent(next_sample, &sample_event);
+      ProcessEvent(sample_event);
+      FlushSamples();
+    }
+    if (i < num_events) ProcessEvent(perf_proto_->events(i));
+  }
+
+  Finish();
+}
+
+void Normalizer::ProcessEvent(const PerfDataProto::PerfEvent& event_proto) {
+  if (event_proto.has_mmap_event()) {
+    UpdateMapsWithMMapEvent(&event_proto.mmap_event());
+    pid_states_[event_proto.mmap_event().pid()].had_any_mmap = true;
+  } else if (event_proto.has_comm_event()) {
+    PerfDataHandler::CommContext comm_context;
+    if (event_proto.comm_event().pid() == event_proto.comm_event().tid()) {
+      PidState& state = pid_states_[event_proto.comm_event().pid()];
+      if (!has_comm_exec_support_ ||
+          event_proto.header().misc() & quipper::PERF_RECORD_MISC_COMM_EXEC ||
+          !state.had_any_mmap) {
+        // Based on the perf data collected, comm events (with pid == tid) can
+        // be generated (1) on exec() or (2) when the main thread name is set
+        // after exec (generating another COMM EVENT, e.g. using PR_SET_NAME
+        // http://man7.org/linux/man-pages/man2/prctl.2.html).
+        // We want to identify if a comm event (with pid == tid) is due to
+        // exec() (the first case) and erase the pid to executable mapping in
+        // PidState::executable_mmap if so.
+        // One way to know that comm event is due to exec() is to check if the
+        // misc bit is set to PERF_RECORD_MISC_COMM_EXEC. However, this misc
+        // bit is only set in newer kernels (>= 3.16) and for execs that
+        // happen after perf collection start. Thus, we need to have some
+        // heuristics to cover other cases and identify possible comm events
+        // that happen due to exec().
+        // Another way is to find the contrary scenario for the second case.
+        // Commonly found patterns of comm events on setting the main thread
+        // name can look like this: FORK EVENT -> COMM EVENT (on exec()) ->
+        // MMAP EVENTs -> SAMPLE EVENTs -> COMM EVENT (on setting main thread
+        // name) -> SAMPLE EVENTs ... Thus, if a mmap event is already found
+        // for a pid before a comm event, this comm event is due to setting
+        // the main thread name. Vice versa, if the mmap event is not yet
+        // found for the pid, it is very likely this comm event happens due
+        // to exec() and PidState::executable_mmap should be erased.
+        // Also note that for older kernels (< 3.16), where the comm_exec
+        // in perf file attribute is not set, we will erase the mapping in
+        // PidState::executable_mmap at the occurrence of a comm event.
+        // Thus we have the following heuristics:
+        // The pid to executable mapping in PidState::executable_mmap is
+        // erased when either one of the following is true (1) comm_exec in
+        // perf file attribute is not set (kernel < 3.16) (2) comm_event's
+        // PERF_RECORD_MISC_COMM_EXEC misc bit is set in header, meaning an
+        // exec() happened, (3) no mmap event for this pid has been found,
+        // meaning this is the first comm event after an exec().
+        state.executable_mmap = nullptr;
+        // is_exec is true if the comm event happened due to exec(), this flag
+        // is passed to perf_data_converter and used to modify PerPidInfo.
+        comm_context.is_exec = true;
       }
-      comm_context.comm = &event_proto.comm_event();
-      handler_->Comm(comm_context);
-    } else if (event_proto.has_fork_event()) {
-      UpdateMapsWithForkEvent(event_proto.fork_event());
-    } else if (event_proto.has_cgroup_event()) {
-      const auto& cgroup = event_proto.cgroup_event();
-      cgroup_map_.insert({cgroup.id(), cgroup.path()});
-    } else if (event_proto.has_lost_samples_event() ||
-               event_proto.has_lost_event()) {
-      HandleLost(event_proto);
-    } else if (event_proto.has_sample_event()) {
-      PerfDataHandler::SampleContext sample_context(event_proto.header(),
-                                                    event_proto.sample_event());
-      HandleSample(&sample_context);
-    } else if (event_proto.has_auxtrace_event()) {
-      if (has_spe_auxtrace_) {
-        HandleSpeAuxtrace(event_proto);
+      const quipper::PerfDataProto_CommEvent* comm = &event_proto.comm_event();
+      if (streaming_) {
+        // The streamed event is gone after this call, so keep a copy.
+        comm = &owned_comm_events_.emplace_back(*comm);
       }
-    } else if (event_proto.has_auxtrace_error_event()) {
+      state.comm = comm;
+    }
+    if (streaming_) {
+      // Mirrors ScanArmSPEAuxtrace(). The auxtrace info event may come after
+      // the threads are synthesized, so the mapping is kept regardless of it.
+      tid_to_pid_[event_proto.comm_event().tid()] =
+          event_proto.comm_event().pid();
+    }
+    comm_context.comm = &event_proto.comm_event();
+    FlushSamples();
+    handler_->Comm(comm_context);
+  } else if (event_proto.has_fork_event()) {
+    UpdateMapsWithForkEvent(event_proto.fork_event());
+    if (streaming_) {
+      tid_to_pid_[event_proto.fork_event().tid()] =
+          event_proto.fork_event().pid();
+    }
+  } else if (event_proto.has_exit_event()) {
+    if (handler_->WantsExits()) {
+      FlushSamples();
+      handler_->Exit(event_proto.exit_event());
+    }
+  } else if (event_proto.has_cgroup_event()) {
+    const auto& cgroup = event_proto.cgroup_event();
+    cgroup_map_.insert(
+        {cgroup.id(), &*cgroup_paths_.insert(cgroup.path()).first});
+  } else if (event_proto.has_lost_samples_event() ||
+             event_proto.has_lost_event()) {
+    HandleLost(event_proto);
+  } else if (event_proto.has_sample_event()) {
+    PerfDataHandler::SampleContext* sample_context =
+        AddSample(event_proto.header(), event_proto.sample_event());
+    if (!HandleSample(sample_context)) {
+      RemoveLastSample();
+    } else if (!batch_samples_ || sample_batch_.size() == kSampleBatchSize) {
+      FlushSamples();
+    }
+  } else if (event_proto.has_auxtrace_info_event()) {
+    if (streaming_ && event_proto.auxtrace_info_event().type() ==
+                          quipper::PERF_AUXTRACE_ARM_SPE) {
+      has_spe_auxtrace_ = true;
+    }
+  } else if (event_proto.has_auxtrace_event()) {
+    if (has_spe_auxtrace_) {
+      HandleSpeAuxtrace(event_proto);
+    }
+  } else if (event_proto.has_auxtrace_error_event()) {
+    if (stat_.warnings.Add("Trace errors of",
+                           quipper::PERF_RECORD_AUXTRACE_ERROR)) {
       LOG(WARNING) << "auxtrace_error event: "
                    << event_proto.auxtrace_error_event().msg();
-    } else if (event_proto.has_ksymbol_event()) {
-      HandleKsymbol(event_proto);
+    }
+  } else if (event_proto.has_ksymbol_event()) {
+    HandleKsymbol(event_proto);
+  }
+}
+
+PerfDataHandler::SampleContext* Normalizer::AddSample(
+    const quipper::PerfDataProto::EventHeader& header,
+    const quipper::PerfDataProto::SampleEvent& sample) {
+  const size_t i = sample_batch_.size();
+  sample_batch_.emplace_back(header, sample);
+  PerfDataHandler::SampleContext* context = &sample_batch_.back();
+  if (i < callchain_pool_.size()) {
+    context->callchain.swap(callchain_pool_[i]);
+    context->branch_stack.swap(branch_stack_pool_[i]);
+  } else {
+    context->callchain.reserve(max_callchain_size_);
+    context->branch_stack.reserve(max_branch_stack_size_);
+  }
+  return context;
+}
+
+void Normalizer::RemoveLastSample() {
+  const size_t i = sample_batch_.size() - 1;
+  if (i >= callchain_pool_.size()) {
+    callchain_pool_.resize(i + 1);
+    branch_stack_pool_.resize(i + 1);
+  }
+  callchain_pool_[i].swap(sample_batch_[i].callchain);
+  callchain_pool_[i].clear();
+  branch_stack_pool_[i].swap(sample_batch_[i].branch_stack);
+  branch_stack_pool_[i].clear();
+  sample_batch_.pop_back();
+}
+
+// Returns whether the IP, callchain and branch stack addresses of |context|
+// are all mapped. The context markers of the callchain have no mapping.
+static bool AllAddressesMapped(const PerfDataHandler::SampleContext& context) {
+  if (context.sample_mapping == nullptr) return false;
+  for (const auto& frame : context.callchain) {
+    if (frame.mapping == nullptr &&
+        quipper::ContextFromCallchain(
+            static_cast<quipper::perf_callchain_context>(frame.ip)) ==
+            quipper::AddressContext::kUnknown) {
+      return false;
     }
   }
+  for (const auto& branch : context.branch_stack) {
+    if (branch.from.mapping == nullptr || branch.to.mapping == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  LogStats();
+void Normalizer::FlushSamples() {
+  if (sample_batch_.empty()) {
+    return;
+  }
+  {
+    quipper::ScopedPhaseTimer timer(
+        stats_out_ != nullptr ? &stat_.handler_samples : nullptr);
+    handler_->SampleBatch(sample_batch_.data(), sample_batch_.size());
+  }
+  while (!sample_batch_.empty()) {
+    RemoveLastSample();
+  }
 }
 
-void Normalizer::HandleSample(PerfDataHandler::SampleContext* context) {
+bool Normalizer::HandleSample(PerfDataHandler::SampleContext* context) {
   CHECK(context != nullptr);
   if (context->spe.is_spe) {
     // This is for the situation like SPE-record generated sample, where we want
@@ -484,7 +760,10 @@ void Normalizer::HandleSample(PerfDataHandler::SampleContext* context) {
   }
   if (context->file_attrs_index == -1) {
     ++stat_.no_event_errors;
-    return;
+    return false;
+  }
+  if (!handler_->KeepSample(*context)) {
+    return false;
   }
   ++stat_.samples;
 
@@ -504,35 +783,75 @@ void Normalizer::HandleSample(PerfDataHandler::SampleContext* context) {
     stat_.missing_addr_mmap += context->addr_mapping == nullptr;
   }
 
-  context->main_mapping = GetMainMMapFromPid(pid);
+  const PidState* state = FindPidState(pid);
+  context->main_mapping = state != nullptr ? state->executable_mmap : nullptr;
+  if (context->main_mapping == nullptr) {
+    VLOG(2) << "No argv0 name found for sample with pid: " << pid;
+  }
   std::unique_ptr<PerfDataHandler::Mapping> fake;
   // Kernel samples might take some extra work.
   if (context->main_mapping == nullptr &&
       header_context == quipper::AddressContext::kHostKernel) {
-    auto comm_it = pid_to_comm_event_.find(pid);
-    auto kernel_it = pid_to_executable_mmap_.find(kKernelPid);
-    if (comm_it != pid_to_comm_event_.end()) {
+    const PidState* kernel_state = FindPidState(kKernelPid);
+    const PerfDataHandler::Mapping* kernel_mmap =
+        kernel_state != nullptr ? kernel_state->executable_mmap : nullptr;
+    if (state != nullptr && state->comm != nullptr) {
       BuildId build_id("", kBuildIdMissing);
-      if (kernel_it != pid_to_executable_mmap_.end()) {
-        build_id.value = kernel_it->second->build_id.value;
+      if (kernel_mmap != nullptr) {
+        build_id.value = kernel_mmap->build_id().value;
         build_id.source = kBuildIdKernelPrefix;
       }
       // The comm_md5_prefix is used for the filename_md5_prefix field in the
       // fake mapping. This allows recovery of the process name (execname) by
       // resolving its md5 prefix when the comm string is nil or empty.
-      context->main_mapping =
-          GetOrAddFakeMapping(comm_it->second->comm(), build_id,
-                              comm_it->second->comm_md5_prefix(), 0);
-    } else if (pid == 0 && kernel_it != pid_to_executable_mmap_.end()) {
+      context->main_mapping = GetOrAddFakeMapping(
+          state->comm->comm(), build_id, state->comm->comm_md5_prefix(), 0);
+    } else if (pid == 0 && kernel_mmap != nullptr) {
       // PID is 0 for the per-CPU idle tasks. Attribute these to the kernel.
-      context->main_mapping = kernel_it->second;
+      context->main_mapping = kernel_mmap;
     }
   }
 
   stat_.missing_main_mmap += context->main_mapping == nullptr;
 
+  if (normalize_stacks_) {
+    NormalizeStacks(pid, context);
+  }
+  ++stat_.recorded_samples;
+  stat_.mapped_samples += AllAddressesMapped(*context);
+
+  // Add the branch stack pair for SPE sample if it is a branch instruction with
+  // target branch address.
+  if (context->spe.is_spe && context->spe.record.tgt_br_ip.addr != 0) {
+    const auto& record = context->spe.record;
+    PerfDataHandler::BranchStackPair br;
+    br.from.ip = context->sample.ip();
+    br.from.mapping = context->sample_mapping;
+    br.to.ip = context->spe.record.tgt_br_ip.addr;
+    br.to.mapping =
+        GetMappingFromPidAndIP(pid, record.tgt_br_ip.addr, header_context);
+    br.mispredicted = record.event.br_mis_pred;
+    context->branch_stack.push_back(br);
+  }
+  max_branch_stack_size_ =
+      std::max(max_branch_stack_size_, context->branch_stack.size());
+
+  if (sample.has_cgroup()) {
+    auto cgrp_it = cgroup_map_.find(sample.cgroup());
+    if (cgrp_it != cgroup_map_.end()) {
+      context->cgroup = cgrp_it->second;
+    }
+  }
+  return true;
+}
+
+void Normalizer::NormalizeStacks(uint32_t pid,
+                                 PerfDataHandler::SampleContext* context) {
+  const auto& sample = context->sample;
   // Normalize the callchain.
   context->callchain.resize(sample.callchain_size());
+  max_callchain_size_ =
+      std::max(max_callchain_size_, context->callchain.size());
   quipper::AddressContext callchain_context = quipper::AddressContext::kUnknown;
   for (int i = 0; i < sample.callchain_size(); ++i) {
     ++stat_.callchain_ips;
@@ -575,31 +894,28 @@ void Normalizer::HandleSample(PerfDataHandler::SampleContext* context) {
     context->branch_stack[i].predicted = entry.predicted();
     context->branch_stack[i].in_transaction = entry.in_transaction();
     context->branch_stack[i].abort = entry.abort();
-    context->branch_stack[i].cycles = entry.cycles();
-    context->branch_stack[i].spec = entry.spec();
-  }
-
-  // Add the branch stack pair for SPE sample if it is a branch instruction with
-  // target branch address.
-  if (context->spe.is_spe && context->spe.record.tgt_br_ip.addr != 0) {
-    const auto& record = context->spe.record;
-    PerfDataHandler::BranchStackPair br;
-    br.from.ip = context->sample.ip();
-    br.from.mapping = context->sample_mapping;
-    br.to.ip = context->spe.record.tgt_br_ip.addr;
-    br.to.mapping =
-        GetMappingFromPidAndIP(pid, record.tgt_br_ip.addr, header_context);
-    br.mispredicted = record.event.br_mis_pred;
-    context->branch_stack.push_back(br);
+    context->branch_stack[i].cycles =
+        std::min(entry.cycles(), PerfDataHandler::BranchStackPair::kMaxCycles);
+    context->branch_stack[i].spec =
+        entry.spec() & PerfDataHandler::BranchStackPair::kSpecMask;
   }
+}
 
-  if (sample.has_cgroup()) {
-    auto cgrp_it = cgroup_map_.find(sample.cgroup());
-    if (cgrp_it != cgroup_map_.end()) {
-      context->cgroup = &cgrp_it->second;
-    }
+const PerfDataHandler::Dso* Normalizer::InternDso(
+    const std::string& filename, const BuildId& build_id,
+    uint64_t filename_md5_prefix) {
+  DsoKey key = {filename, build_id.value, build_id.source,
+                filename_md5_prefix};
+  auto it = dsos_.find(key);
+  if (it != dsos_.end()) {
+    return it->second;
   }
-  handler_->Sample(*context);
+  const PerfDataHandler::Dso* dso =
+      &owned_dsos_.emplace_back(filename, build_id, filename_md5_prefix);
+  key = {dso->filename, dso->build_id.value, dso->build_id.source,
+         dso->filename_md5_prefix};
+  dsos_.emplace(key, dso);
+  return dso;
 }
 
 const PerfDataHandler::Mapping* Normalizer::GetOrAddFakeMapping(
@@ -610,10 +926,10 @@ const PerfDataHandler::Mapping* Normalizer::GetOrAddFakeMapping(
   if (it != fake_mappings_.end()) {
     return it->second;
   }
-  owned_mappings_.emplace_back(new PerfDataHandler::Mapping(
-      comm, build_id, start_addr, start_addr + 1, 0, comm_md5_prefix));
-  return fake_mappings_.insert({key, owned_mappings_.back().get()})
-      .first->second;
+  const PerfDataHandler::Mapping* mapping = &owned_mappings_.emplace_back(
+      InternDso(comm, build_id, comm_md5_prefix), start_addr, start_addr + 1,
+      0);
+  return fake_mappings_.insert({key, mapping}).first->second;
 }
 
 void Normalizer::HandleLost(
@@ -673,13 +989,19 @@ void Normalizer::HandleLost(
       GetOrAddFakeMapping(kLostMappingFilename, BuildId("", kBuildIdMissing),
                           kLostMd5Prefix, sample.ip());
 
-  int64_t synthesized_lost = 0;
+  FlushSamples();
+  // The lost samples are passed as one sample standing for all those kept.
+  uint64_t num_kept = 0;
   for (uint64_t i = 0; i < num_lost; ++i) {
-    if (handler_->Sample(context)) {
-      synthesized_lost++;
-    }
+    if (handler_->KeepSample(context)) ++num_kept;
+  }
+  context.count = num_kept;
+  if (num_kept == 0) return;
+  quipper::ScopedPhaseTimer timer(
+      stats_out_ != nullptr ? &stat_.handler_samples : nullptr);
+  if (handler_->Sample(context)) {
+    stat_.synthesized_lost_samples += num_kept;
   }
-  stat_.synthesized_lost_samples += synthesized_lost;
 }
 
 static void CheckStat(int64_t num, int64_t denom, const std::string& desc) {
@@ -702,6 +1024,7 @@ void Normalizer::LogStats() {
             "missing_branch_stack_mmap");
   CheckStat(stat_.missing_pid, stat_.samples, "missing_pid");
   CheckStat(stat_.no_event_errors, 1, "unknown event id");
+  stat_.warnings.Log();
 }
 
 // IsSameBuildId returns true iff build ID is a prefix of the other AND the rest
@@ -717,15 +1040,33 @@ static bool IsSameBuildId(const std::string& build_id1,
 }
 
 BuildId Normalizer::GetBuildId(const quipper::PerfDataProto_MMapEvent* mmap) {
-  std::string filename = PerfDataHandler::NameOrMd5Prefix(
-      mmap->filename(), mmap->filename_md5_prefix());
+  const std::string& build_id_from_mmap = mmap->build_id();
+  // Only the mmaps of stripped filenames need their key computed.
+  std::string md5_name;
+  if (mmap->filename().empty()) {
+    md5_name =
+        PerfDataHandler::NameOrMd5Prefix("", mmap->filename_md5_prefix());
+  }
+  const std::string& filename =
+      mmap->filename().empty() ? md5_name : mmap->filename();
+  auto it = resolved_build_ids_.find(filename);
+  if (it == resolved_build_ids_.end()) {
+    it = resolved_build_ids_.emplace(filename, ResolvedBuildId()).first;
+  } else if (it->second.build_id_from_mmap == build_id_from_mmap) {
+    return it->second.build_id;
+  }
+  it->second.build_id_from_mmap = build_id_from_mmap;
+  it->second.build_id = ResolveBuildId(filename, build_id_from_mmap);
+  return it->second.build_id;
+}
+
+BuildId Normalizer::ResolveBuildId(
+    const std::string& filename, const std::string& build_id_from_mmap) const {
   auto it = filename_to_build_id_.find(filename);
   BuildId build_id_from_filename = it != filename_to_build_id_.end()
                                        ? it->second
                                        : BuildId("", kBuildIdMissing);
 
-  std::string build_id_from_mmap = mmap->has_build_id() ? mmap->build_id() : "";
-
   if (!build_id_from_mmap.empty()) {
     return IsSameBuildId(build_id_from_filename.value, build_id_from_mmap)
                ? BuildId(build_id_from_mmap, kBuildIdMmapSameFilename)
@@ -756,45 +1097,40 @@ static bool IsVirtualMapping(const std::string& map_name) {
          HasPrefixString(map_name, "[anon:");
 }
 
-void Normalizer::ConvertMmapFromKsymbol(
-    const quipper::PerfDataProto_KsymbolEvent& ksymbol_event, uint32_t prot,
-    quipper::PerfDataProto_MMapEvent* mmap) {
-  uint32_t pid = 1;
-  uint32_t tid = 1;
-  uint32_t flags = 0;
-  uint64_t pgoff = 0;
-  mmap->set_pid(pid);
-  mmap->set_tid(tid);
-  mmap->set_flags(flags);
-  mmap->set_pgoff(pgoff);
-  mmap->set_prot(prot);
-  mmap->set_start(ksymbol_event.addr());
-  mmap->set_len(ksymbol_event.len());
-  // TODO(go/gwp-bpf-name-breakdown): Need to do post-processing on `filename`.
-  mmap->set_filename(ksymbol_event.name());
-  *mmap->mutable_sample_info() = ksymbol_event.sample_info();
+// Whether map_name is one of the files that "perf inject --jit" writes for the
+// code regions of a JIT.
+static bool IsJitCodeMapping(const std::string& map_name) {
+  return map_name.find("jitted-") != std::string::npos;
+}
+
+Normalizer::MMapIntervalMap* Normalizer::MutableMMaps(uint32_t pid) {
+  InvalidateMappingCache(pid);
+  std::shared_ptr<MMapIntervalMap>& shared_map = pid_states_[pid].mmaps;
+  if (shared_map == nullptr) {
+    shared_map = std::make_shared<MMapIntervalMap>();
+  } else if (shared_map.use_count() > 1) {
+    // Copy the map shared with a parent or child before changing it.
+    shared_map = std::make_shared<MMapIntervalMap>(*shared_map);
+  }
+  return shared_map.get();
 }
 
 void Normalizer::UpdateMapsWithMMapEvent(
     const quipper::PerfDataProto_MMapEvent* mmap) {
   if (mmap->len() == 0) {
-    LOG(WARNING) << "bogus mapping: " << mmap->filename();
+    if (stat_.warnings.Add("Skipped zero length mappings")) {
+      LOG(WARNING) << "bogus mapping: " << mmap->filename();
+    }
     return;
   }
   uint32_t pid = mmap->pid();
-  MMapIntervalMap* interval_map = nullptr;
-  const auto& it = pid_to_mmaps_.find(pid);
-  if (it == pid_to_mmaps_.end()) {
-    interval_map = new MMapIntervalMap;
-    pid_to_mmaps_[pid] = std::unique_ptr<MMapIntervalMap>(interval_map);
-  } else {
-    interval_map = it->second.get();
-  }
+  MMapIntervalMap* interval_map = MutableMMaps(pid);
+  PidState& state = pid_states_[pid];
 
-  PerfDataHandler::Mapping* mapping = new PerfDataHandler::Mapping(
-      mmap->filename(), GetBuildId(mmap), mmap->start(),
-      mmap->start() + mmap->len(), mmap->pgoff(), mmap->filename_md5_prefix());
-  owned_mappings_.emplace_back(mapping);
+  PerfDataHandler::Mapping* mapping = &owned_mappings_.emplace_back(
+      InternDso(mmap->filename(), GetBuildId(mmap),
+                mmap->filename_md5_prefix()),
+      mmap->start(), mmap->start() + mmap->len(), mmap->pgoff());
   if (mapping->start <= (static_cast<uint64_t>(1) << 63) &&
       mapping->file_offset > (static_cast<uint64_t>(1) << 63) &&
       mapping->limit > (static_cast<uint64_t>(1) << 63)) {
@@ -809,11 +1145,20 @@ void Normalizer::UpdateMapsWithMMapEvent(
     mapping->start = mapping->file_offset - mapping->file_offset % 4096;
   }
 
-  interval_map->Set(mapping->start, mapping->limit, mapping);
+  if (pid == kKernelPid) {
+    kernel_start_ = std::min(kernel_start_, mapping->start);
+    kernel_limit_ = std::max(kernel_limit_, mapping->limit);
+  }
+  if (IsJitCodeMapping(mmap->filename())) {
+    interval_map->SetTop(mapping->start, mapping->limit, mapping);
+  } else {
+    interval_map->Set(mapping->start, mapping->limit, mapping);
+  }
   // Pass the final mapping through to the subclass also.
   PerfDataHandler::MMapContext mmap_context;
   mmap_context.pid = pid;
   mmap_context.mapping = mapping;
+  FlushSamples();
   handler_->MMap(mmap_context);
 
   // Main executables are usually loaded at 0x8048000 or 0x400000.
@@ -822,23 +1167,39 @@ void Normalizer::UpdateMapsWithMMapEvent(
   // This is true even if the old MMAP started at one of the locations, because
   // the pid may have been recycled since then (so newer is better).
   if (mapping->start == 0x8048000 || mapping->start == 0x400000) {
-    pid_to_executable_mmap_[pid] = mapping;
+    state.executable_mmap = mapping;
     return;
   }
   // Figure out whether this MMAP is the main executable.
   // If there have been no previous MMAPs for this pid, then this MMAP is our
   // best guess.
-  auto old_mapping_it = pid_to_executable_mmap_.find(pid);
-  PerfDataHandler::Mapping* old_mapping =
-      old_mapping_it == pid_to_executable_mmap_.end() ? nullptr
-                                                      : old_mapping_it->second;
+  PerfDataHandler::Mapping* old_mapping = state.executable_mmap;
 
   if (old_mapping != nullptr && old_mapping->start == 0x400000 &&
-      old_mapping->filename.empty() &&
+      old_mapping->filename().empty() &&
       mapping->start - mapping->file_offset == 0x400000) {
     // Hugepages remap the main binary, but the original mapping loses
-    // its name, so we have this hack.
-    old_mapping->filename = mmap->filename();
+    // its name, so we have this hack. The handler already has the original
+    // mapping, and may be reading it on another thread, so it is replaced by
+    // a named copy, which is passed to the handler in turn.
+    PerfDataHandler::Mapping* named_mapping = &owned_mappings_.emplace_back(
+        InternDso(mmap->filename(), old_mapping->build_id(),
+                  old_mapping->filename_md5_prefix()),
+        old_mapping->start, old_mapping->limit, old_mapping->file_offset);
+    uint64_t start, limit;
+    for (uint64_t address = old_mapping->start; address < old_mapping->limit;
+         address = limit) {
+      const PerfDataHandler::Mapping* value;
+      if (interval_map->LookupInterval(address, &start, &limit, &value) &&
+          value == old_mapping) {
+        interval_map->Set(start, limit, named_mapping);
+      }
+    }
+    InvalidateMappingCache(pid);
+    state.executable_mmap = named_mapping;
+    mmap_context.mapping = named_mapping;
+    FlushSamples();
+    handler_->MMap(mmap_context);
   }
 
   if (old_mapping == nullptr && !HasSuffixString(mmap->filename(), ".ko") &&
@@ -859,31 +1220,83 @@ void Normalizer::UpdateMapsWithMMapEvent(
         !HasPrefixString(mmap->filename(), "/usr/local/bin/") &&
         !HasPrefixString(mmap->filename(), "/usr/local/sbin/") &&
         !HasPrefixString(mmap->filename(), "/usr/libexec/") &&
-        !HasSuffixString(mmap->filename(), "/sel_ldr/")) {
+        !HasSuffixString(mmap->filename(), "/sel_ldr/") &&
+        stat_.warnings.Add("Guessed the main mappings of processes")) {
       LOG(INFO) << "Guessing main mapping for PID=" << pid << " "
                 << mmap->filename();
     }
-    pid_to_executable_mmap_[pid] = mapping;
+    state.executable_mmap = mapping;
     return;
   }
 
   if (pid == kKernelPid && HasPrefixString(mmap->filename(), kKernelPrefix)) {
-    pid_to_executable_mmap_[pid] = mapping;
+    state.executable_mmap = mapping;
   }
 }
 
 const PerfDataHandler::Mapping* Normalizer::TryLookupInPid(uint32_t pid,
                                                            uint64_t ip) const {
-  const auto& it = pid_to_mmaps_.find(pid);
-  if (it == pid_to_mmaps_.end()) {
+  MappingCache* cache =
+      pid == kKernelPid ? &kernel_mapping_cache_ : &user_mapping_cache_;
+  if (!cache->valid || cache->pid != pid) {
+    const auto it = pid_states_.find(pid);
+    PidState* state = it != pid_states_.end() ? &it->second : nullptr;
+    cache->valid = true;
+    cache->pid = pid;
+    cache->mmaps = state != nullptr ? state->mmaps.get() : nullptr;
+    cache->resolved_ips =
+        cache->mmaps != nullptr ? &state->resolved_ips : nullptr;
+    cache->num_entries = 0;
+  }
+  if (cache->mmaps == nullptr) {
     VLOG(2) << "No mmaps for pid " << pid;
     return nullptr;
   }
-  MMapIntervalMap* mmaps = it->second.get();
 
-  const PerfDataHandler::Mapping* mapping = nullptr;
-  mmaps->Lookup(ip, &mapping);
-  return mapping;
+  MappingCache::Entry* entries = cache->entries;
+  for (int i = 0; i < cache->num_entries; ++i) {
+    if (ip >= entries[i].start && ip < entries[i].limit) {
+      const MappingCache::Entry hit = entries[i];
+      std::move_backward(entries, entries + i, entries + i + 1);
+      entries[0] = hit;
+      return hit.mapping;
+    }
+  }
+
+  MappingCache::Entry entry;
+  const auto resolved = cache->resolved_ips->find(ip);
+  if (resolved != cache->resolved_ips->end()) {
+    entry = resolved->second;
+  } else {
+    if (!cache->mmaps->LookupInterval(ip, &entry.start, &entry.limit,
+                                      &entry.mapping)) {
+      entry = {0, 0, nullptr};
+    }
+    if (cache->resolved_ips->size() >= kMaxResolvedIps) {
+      cache->resolved_ips->clear();
+    }
+    cache->resolved_ips->emplace(ip, entry);
+  }
+  if (entry.mapping == nullptr) {
+    return nullptr;
+  }
+  if (cache->num_entries < MappingCache::kNumEntries) ++cache->num_entries;
+  std::move_backward(entries, entries + cache->num_entries - 1,
+                     entries + cache->num_entries);
+  entries[0] = entry;
+  return entry.mapping;
+}
+
+void Normalizer::InvalidateMappingCache(uint32_t pid) {
+  for (MappingCache* cache : {&user_mapping_cache_, &kernel_mapping_cache_}) {
+    if (cache->pid == pid) cache->valid = false;
+  }
+  const auto it = pid_states_.find(pid);
+  if (it != pid_states_.end()) {
+    // Frees the memory of the IPs rather than keeping it for new ones.
+    std::unordered_map<uint64_t, MappingCache::Entry>().swap(
+        it->second.resolved_ips);
+  }
 }
 
 // Find the mapping for ip in the context of pid and context.  We might be
@@ -908,10 +1321,21 @@ const PerfDataHandler::Mapping* Normalizer::GetMappingFromPidAndIP(
   // First look up the mapping for the ip in the address space of the given pid.
   // If no mapping is found, then try to find in the kernel space, with pid of
   // -1. However, if the ip is guaranteed to be in user context, it will not be
-  // looked up in the kernel space.
-  const PerfDataHandler::Mapping* mapping = TryLookupInPid(pid, ip);
-  if (mapping == nullptr && context != quipper::AddressContext::kHostUser) {
-    mapping = TryLookupInPid(-1, ip);
+  // looked up in the kernel space. The ips known to be in kernel context are
+  // looked up in the kernel space first instead, if they are within its span,
+  // as they are rarely in the process's.
+  const PerfDataHandler::Mapping* mapping = nullptr;
+  if (context == quipper::AddressContext::kHostKernel && ip >= kernel_start_ &&
+      ip < kernel_limit_) {
+    mapping = TryLookupInPid(kKernelPid, ip);
+    if (mapping == nullptr) {
+      mapping = TryLookupInPid(pid, ip);
+    }
+  } else {
+    mapping = TryLookupInPid(pid, ip);
+    if (mapping == nullptr && context != quipper::AddressContext::kHostUser) {
+      mapping = TryLookupInPid(kKernelPid, ip);
+    }
   }
   if (mapping == nullptr) {
     VLOG(2) << "no sample mmap found for pid " << pid << " and ip " << ip;
@@ -922,83 +1346,299 @@ const PerfDataHandler::Mapping* Normalizer::GetMappingFromPidAndIP(
   return mapping;
 }
 
-const PerfDataHandler::Mapping* Normalizer::GetMainMMapFromPid(
-    uint32_t pid) const {
-  auto mapping_it = pid_to_executable_mmap_.find(pid);
-  if (mapping_it != pid_to_executable_mmap_.end()) {
-    return mapping_it->second;
-  }
-
-  VLOG(2) << "No argv0 name found for sample with pid: " << pid;
-  return nullptr;
-}
-
 int64_t Normalizer::GetEventIndexForSample(
-    const quipper::PerfDataProto_SampleEvent& sample) const {
-  if (perf_proto_.file_attrs().size() == 1) {
+    const quipper::PerfDataProto_SampleEvent& sample) {
+  if (perf_proto_->file_attrs().size() == 1) {
     return 0;
   }
 
   if (!sample.has_id()) {
-    LOG(ERROR) << "Perf sample did not have id";
+    if (stat_.warnings.Add("Samples without an id")) {
+      LOG(ERROR) << "Perf sample did not have id";
+    }
     return -1;
   }
 
-  auto it = id_to_event_index_.find(sample.id());
-  if (it == id_to_event_index_.end()) {
-    LOG(ERROR) << "Incorrect event id: " << sample.id();
+  uint32_t event_index;
+  if (!id_to_event_index_.Find(sample.id(), &event_index)) {
+    if (stat_.warnings.Add("Samples with an unknown event id")) {
+      LOG(ERROR) << "Incorrect event id: " << sample.id();
+    }
     return -1;
   }
-  return it->second;
+  return event_index;
+}
+
+void Normalizer::ReadMetadata() {
+  // The build IDs of the filenames, and of the kernel, may change.
+  resolved_build_ids_.clear();
+  for (const auto& build_id : perf_proto_->build_ids()) {
+    const std::string& bytes = build_id.build_id_hash();
+    std::stringstream hex;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+      // The char must be turned into an int to be used by stringstream;
+      // however, if the byte's value -8 it should be turned to 0x00f8 as an
+      // int, not 0xfff8. This cast solves this problem.
+      const auto& byte = static_cast<unsigned char>(bytes[i]);
+      hex << std::hex << std::setfill('0') << std::setw(2)
+          << static_cast<int>(byte);
+    }
+    std::string filename = PerfDataHandler::NameOrMd5Prefix(
+        build_id.filename(), build_id.filename_md5_prefix());
+    auto build_id_it = filename_to_build_id_.find(filename);
+    BuildIdSource build_id_source =
+        build_id.has_is_injected() && build_id.is_injected()
+            ? kBuildIdFilenameInjected
+            : kBuildIdFilename;
+    if (build_id_it != filename_to_build_id_.end() &&
+        build_id_it->second.value != hex.str()) {
+      LOG(WARNING)
+          << "Observed build ID changed for file path " << filename
+          << ": initially saw " << build_id_it->second.value << ", now saw "
+          << hex.str() << std::hex << " (pid=0x" << build_id.pid() << ")"
+          << ". In-flight build ID change may lead to wrong symbolization.";
+      build_id_source = kBuildIdFilenameAmbiguous;
+    }
+    filename_to_build_id_[filename] = BuildId(hex.str(), build_id_source);
+
+    switch (build_id.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) {
+      case quipper::PERF_RECORD_MISC_KERNEL:
+        if (quipper::IsKernelNonModuleName(filename) ||
+            !HasSuffixString(filename, ".ko")) {
+          std::string build_id = hex.str();
+          if (!maybe_kernel_build_id_.empty() &&
+              maybe_kernel_build_id_ != build_id) {
+            LOG(WARNING) << "Multiple kernel buildids found, file name: "
+                         << filename << ", build id: " << build_id
+                         << ". Using the "
+                            "first found buildid: "
+                         << maybe_kernel_build_id_ << ".";
+            break;
+          }
+          LOG(INFO) << "Using the build id found for the file name: "
+                    << filename << ", build id: " << build_id << ".";
+          maybe_kernel_build_id_ = build_id;
+        }
+    }
+  }
+
+  // We will use LOST_SAMPLE events to count lost samples for perf version
+  // 6.1 or newer.
+  // The following code converts the first two parts of the full perf version
+  // string into two integers (for example, assume perf_version="6.123.456",
+  // then v1=6, v2=123), and decides if the version is 6.1 or newer.
+  const std::string& perf_version =
+      perf_proto_->string_metadata().has_perf_version()
+          ? perf_proto_->string_metadata().perf_version().value()
+          : "";
+  std::regex rx(R"(([0-9]+)\.([0-9]+).*)");
+  std::cmatch cm;
+  std::regex_match(perf_version.c_str(), cm, rx);
+
+  if (cm.size() == 3) {
+    int v1 = std::stoi(cm[1]);
+    int v2 = std::stoi(cm[2]);
+    use_lost_sample_ = std::make_pair(v1, v2) >= std::make_pair(6, 1);
+  } else {
+    LOG(WARNING) << "Invalid perf version: " << perf_version;
+  }
+
+  BuildEventIndex();
+
+  // Perf keeps the tracking bits (e.g. comm_exec) in only one of the events'
+  // file_attrs.
+  for (const auto& fa : perf_proto_->file_attrs()) {
+    if (fa.attr().comm_exec()) {
+      has_comm_exec_support_ = true;
+      break;
+    }
+  }
+}
+
+void Normalizer::StartChunk(const PerfDataProto& perf_proto) {
+  perf_proto_ = &perf_proto;
+  // The build IDs seen so far are kept, as the mmaps that refer to them are.
+  use_lost_sample_ = false;
+  has_comm_exec_support_ = false;
+  id_to_event_index_.clear();
+  stat_ = {};
+  ReadMetadata();
+}
+
+void Normalizer::BuildEventIndex() {
+  uint32_t current_event_index = 0;
+  for (const auto& attr : perf_proto_->file_attrs()) {
+    for (uint64_t id : attr.ids()) {
+      id_to_event_index_.Set(id, current_event_index);
+    }
+    current_event_index++;
+  }
 }
 
+// The number of Arm SPE trace buffers decoded at once per thread. Bounds the
+// memory taken by the records decoded ahead.
+static const size_t kSpeBuffersPerThread = 4;
+
+// The number of Arm SPE records decoded at once.
+static const size_t kSpeRecordsPerBatch = 64;
+
 void Normalizer::HandleSpeAuxtrace(
     const quipper::PerfDataProto::PerfEvent& event_proto) {
+  QUIPPER_TRACE_SPAN("Normalizer::HandleSpeAuxtrace");
   const quipper::PerfDataProto::AuxtraceEvent& auxtrace_event =
       event_proto.auxtrace_event();
-  if (!auxtrace_event.has_trace_data()) {
+  const std::string_view trace_data = TraceData(auxtrace_event);
+  if (trace_data.empty()) {
+    if (auxtrace_event.has_trace_data_offset() &&
+        stat_.warnings.Add("Auxtrace events whose trace data is missing")) {
+      LOG(WARNING) << "The trace data at offset "
+                   << auxtrace_event.trace_data_offset()
+                   << " is outside of the perf data";
+    }
     return;
   }
 
-  quipper::ArmSpeDecoder::Record record;
-  quipper::ArmSpeDecoder decoder(auxtrace_event.trace_data(), false);
-  while (decoder.NextRecord(&record)) {
-    // Synthesize a perf data sample with from the SPE record.
-    uint32_t tid = record.context.id;
-    uint32_t pid = 0;
-    if (tid != 0) {
-      auto pid_it = tid_to_pid_.find(tid);
-      if (pid_it == tid_to_pid_.end()) {
-        stat_.missing_pid++;
+  // The samples synthesized below only live during an iteration, so they are
+  // passed to the handler one at a time.
+  FlushSamples();
+  if (next_spe_buffer_ < spe_buffers_.size() &&
+      spe_buffers_[next_spe_buffer_] == &auxtrace_event) {
+    for (const auto& record : TakeDecodedSpeRecords()) {
+      HandleSpeRecord(record);
+    }
+    return;
+  }
+  quipper::ArmSpeDecoder::Record records[kSpeRecordsPerBatch];
+  quipper::ArmSpeDecoder decoder(trace_data, false);
+  decoder.set_filter(spe_filter_);
+  size_t num_records;
+  do {
+    num_records = decoder.NextRecords(records, kSpeRecordsPerBatch);
+    for (size_t i = 0; i < num_records; ++i) {
+      HandleSpeRecord(records[i]);
+    }
+  } while (num_records == kSpeRecordsPerBatch);
+}
+
+std::string_view Normalizer::TraceData(
+    const quipper::PerfDataProto::AuxtraceEvent& auxtrace_event) const {
+  if (!auxtrace_event.has_trace_data_offset()) {
+    return auxtrace_event.trace_data();
+  }
+  const uint64_t offset = auxtrace_event.trace_data_offset();
+  if (offset > perf_data_.size() ||
+      auxtrace_event.size() > perf_data_.size() - offset) {
+    return std::string_view();
+  }
+  return perf_data_.substr(offset, auxtrace_event.size());
+}
+
+void Normalizer::HandleSpeRecord(const quipper::ArmSpeDecoder::Record& record) {
+  // Synthesize a perf data sample with from the SPE record.
+  uint32_t tid = record.context.id;
+  uint32_t pid = 0;
+  if (tid != 0) {
+    auto pid_it = tid_to_pid_.find(tid);
+    if (pid_it == tid_to_pid_.end()) {
+      stat_.missing_pid++;
+      if (stat_.warnings.Add("SPE records of threads of unknown processes")) {
         LOG(WARNING) << "tid->pid mapping does not contain tid " << tid;
-      } else {
-        pid = pid_it->second;
       }
+    } else {
+      pid = pid_it->second;
     }
+  }
 
-    quipper::PerfDataProto::PerfEvent event_proto;
-    auto& sample = *event_proto.mutable_sample_event();
-    sample.set_tid(tid);
-    sample.set_pid(pid);
-    sample.set_ip(record.ip.addr);
+  // Only these fields are ever set, so they overwrite those of the previous
+  // record.
+  auto& sample = *spe_event_.mutable_sample_event();
+  sample.set_tid(tid);
+  sample.set_pid(pid);
+  sample.set_ip(record.ip.addr);
+
+  PerfDataHandler::SampleContext* context =
+      AddSample(spe_event_.header(), sample);
+  context->spe.is_spe = true;
+  context->spe.record = record;
+  if (HandleSample(context)) {
+    FlushSamples();
+  } else {
+    RemoveLastSample();
+  }
+}
 
-    PerfDataHandler::SampleContext context(event_proto.header(), sample);
-    context.spe.is_spe = true;
-    context.spe.record = record;
-    HandleSample(&context);
+std::vector<quipper::ArmSpeDecoder::Record>
+Normalizer::TakeDecodedSpeRecords() {
+  if (next_spe_buffer_ ==
+      decoded_spe_begin_ + decoded_spe_records_.size()) {
+    // Decode the next buffers, each on whichever thread is free first.
+    decoded_spe_begin_ = next_spe_buffer_;
+    const size_t num_buffers =
+        std::min(kSpeBuffersPerThread * num_threads_,
+                 spe_buffers_.size() - decoded_spe_begin_);
+    decoded_spe_records_.clear();
+    decoded_spe_records_.resize(num_buffers);
+    std::atomic<size_t> next(0);
+    auto decode = [this, num_buffers, &next] {
+      for (size_t i = next++; i < num_buffers; i = next++) {
+        quipper::ArmSpeDecoder decoder(
+            TraceData(*spe_buffers_[decoded_spe_begin_ + i]), false);
+        decoder.set_filter(spe_filter_);
+        auto& records = decoded_spe_records_[i];
+        size_t size = 0;
+        do {
+          records.resize(size + kSpeRecordsPerBatch);
+          size += decoder.NextRecords(&records[size], kSpeRecordsPerBatch);
+        } while (size == records.size());
+        records.resize(size);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(num_threads_, num_buffers); ++i) {
+      threads.emplace_back(decode);
+    }
+    decode();
+    for (auto& thread : threads) thread.join();
   }
+  return std::move(
+      decoded_spe_records_[next_spe_buffer_++ - decoded_spe_begin_]);
 }
 
 void Normalizer::HandleKsymbol(
     const quipper::PerfDataProto::PerfEvent& event_proto) {
-  quipper::PerfDataProto_MMapEvent mmap;
-  if (event_proto.ksymbol_event().ksym_type() ==
-          quipper::PERF_RECORD_KSYMBOL_TYPE_BPF &&
-      event_proto.ksymbol_event().flags() == 0) {
-    uint32_t prot = PROT_EXEC | PROT_READ;
-    ConvertMmapFromKsymbol(event_proto.ksymbol_event(), prot, &mmap);
-    UpdateMapsWithMMapEvent(&mmap);
+  const auto& ksymbol = event_proto.ksymbol_event();
+  if (ksymbol.ksym_type() != quipper::PERF_RECORD_KSYMBOL_TYPE_BPF ||
+      ksymbol.flags() != 0) {
+    return;
+  }
+  if (ksymbol.len() == 0) {
+    if (stat_.warnings.Add("Skipped zero length mappings")) {
+      LOG(WARNING) << "bogus mapping: " << ksymbol.name();
+    }
+    return;
   }
+  // Hosts with many BPF programs register tens of thousands of them, so they
+  // go straight to the kernel's map, without the heuristics of mmap events.
+  // Like the code regions of JITs, they are set in the top layer, where
+  // mapping them one by one doesn't move the other mappings.
+  // TODO(go/gwp-bpf-name-breakdown): Need to do post-processing on the name.
+  const auto build_id_it = filename_to_build_id_.find(ksymbol.name());
+  PerfDataHandler::Mapping* mapping = &owned_mappings_.emplace_back(
+      InternDso(ksymbol.name(),
+                build_id_it != filename_to_build_id_.end()
+                    ? build_id_it->second
+                    : BuildId("", kBuildIdMissing),
+                0),
+      ksymbol.addr(), ksymbol.addr() + ksymbol.len(), 0);
+  kernel_start_ = std::min(kernel_start_, mapping->start);
+  kernel_limit_ = std::max(kernel_limit_, mapping->limit);
+  MutableMMaps(kKernelPid)->SetTop(mapping->start, mapping->limit, mapping);
+
+  PerfDataHandler::MMapContext mmap_context;
+  mmap_context.pid = kKernelPid;
+  mmap_context.mapping = mapping;
+  FlushSamples();
+  handler_->MMap(mmap_context);
 }
 
 }  // namespace
@@ -1032,11 +1672,35 @@ bool IsVersionedSharedObject(const std::string& path) {
 PerfDataHandler::PerfDataHandler() {}
 
 void PerfDataHandler::Process(const quipper::PerfDataProto& perf_proto,
-                              PerfDataHandler* handler) {
+                              PerfDataHandler* handler, int num_threads,
+                              const quipper::ArmSpeDecoder::RecordFilter&
+                                  spe_filter,
+                              NormalizationStats* stats,
+                              std::string_view perf_data) {
   Normalizer Normalizer(perf_proto, handler);
+  Normalizer.set_num_threads(num_threads);
+  Normalizer.set_spe_filter(spe_filter);
+  Normalizer.set_stats(stats);
+  Normalizer.set_perf_data(perf_data);
   return Normalizer.Normalize();
 }
 
+void PerfDataHandler::Process(const quipper::PerfDataProto& perf_proto,
+                              const quipper::SampleColumns& samples,
+                              PerfDataHandler* handler) {
+  Normalizer normalizer(perf_proto, handler);
+  normalizer.Normalize(&samples);
+}
+
+std::unique_ptr<PerfDataHandler::EventStream>
+PerfDataHandler::CreateEventStream(
+    const quipper::PerfDataProto& perf_proto, PerfDataHandler* handler,
+    const quipper::ArmSpeDecoder::RecordFilter& spe_filter) {
+  auto* normalizer = new Normalizer(perf_proto, handler, /*streaming=*/true);
+  normalizer->set_spe_filter(spe_filter);
+  return std::unique_ptr<EventStream>(normalizer);
+}
+
 std::string PerfDataHandler::NameOrMd5Prefix(std::string name,
                                              uint64_t md5_prefix) {
   if (name.empty()) {
@@ -1048,14 +1712,102 @@ std::string PerfDataHandler::NameOrMd5Prefix(std::string name,
 }
 
 std::string PerfDataHandler::MappingFilename(const Mapping* m) {
-  return NameOrMd5Prefix(m->filename, m->filename_md5_prefix);
+  return NameOrMd5Prefix(m->filename(), m->filename_md5_prefix());
+}
+
+FanOutHandler::FanOutHandler(std::vector<PerfDataHandler*> handlers)
+    : handlers_(std::move(handlers)), lost_counts_(handlers_.size(), 0) {}
+
+bool FanOutHandler::KeepSample(const SampleContext& sample) {
+  bool any_kept = false;
+  if (sample.lost) {
+    // The normalizer asks once per lost sample, then passes the synthesized
+    // sample to Sample(), without batching it.
+    for (size_t h = 0; h < handlers_.size(); ++h) {
+      if (handlers_[h]->KeepSample(sample)) {
+        ++lost_counts_[h];
+        any_kept = true;
+      }
+    }
+    return any_kept;
+  }
+  for (PerfDataHandler* handler : handlers_) {
+    const bool kept = handler->KeepSample(sample);
+    kept_.push_back(kept);
+    any_kept |= kept;
+  }
+  if (!any_kept) kept_.resize(kept_.size() - handlers_.size());
+  return any_kept;
+}
+
+bool FanOutHandler::Sample(const SampleContext& sample) {
+  bool handled = false;
+  if (sample.lost) {
+    for (size_t h = 0; h < handlers_.size(); ++h) {
+      if (lost_counts_[h] == 0) continue;
+      SampleContext context(sample);
+      context.count = lost_counts_[h];
+      lost_counts_[h] = 0;
+      handled |= handlers_[h]->Sample(context);
+    }
+    return handled;
+  }
+  for (size_t h = 0; h < handlers_.size(); ++h) {
+    if (Kept(0, h)) handled |= handlers_[h]->Sample(sample);
+  }
+  Passed(1);
+  return handled;
+}
+
+void FanOutHandler::SampleBatch(const SampleContext* samples,
+                                size_t num_samples) {
+  for (size_t h = 0; h < handlers_.size(); ++h) {
+    size_t begin = 0;
+    while (begin < num_samples) {
+      if (!Kept(begin, h)) {
+        ++begin;
+        continue;
+      }
+      size_t end = begin + 1;
+      while (end < num_samples && Kept(end, h)) ++end;
+      handlers_[h]->SampleBatch(samples + begin, end - begin);
+      begin = end;
+    }
+  }
+  Passed(num_samples);
+}
+
+void FanOutHandler::Passed(size_t num_rows) {
+  next_row_ += num_rows;
+  if (next_row_ * handlers_.size() == kept_.size()) {
+    kept_.clear();
+    next_row_ = 0;
+  }
+}
+
+void FanOutHandler::Comm(const CommContext& comm) {
+  for (PerfDataHandler* handler : handlers_) handler->Comm(comm);
+}
+
+void FanOutHandler::MMap(const MMapContext& mmap) {
+  for (PerfDataHandler* handler : handlers_) handler->MMap(mmap);
+}
+
+bool FanOutHandler::WantsExits() const {
+  for (const PerfDataHandler* handler : handlers_) {
+    if (handler->WantsExits()) return true;
+  }
+  return false;
+}
+
+void FanOutHandler::Exit(const quipper::PerfDataProto::ForkEvent& exit) {
+  for (PerfDataHandler* handler : handlers_) {
+    if (handler->WantsExits()) handler->Exit(exit);
+  }
 }
 
-void PerfDataHandler::IncBuildIdStats(uint32_t pid,
-                                      const PerfDataHandler::Mapping* mapping) {
-  BuildIdSource source =
-      mapping != nullptr ? mapping->build_id.source : kBuildIdNoMmap;
-  process_build_id_stats_[pid][source]++;
+void FanOutHandler::Finish() {
+  for (PerfDataHandler* handler : handlers_) handler->Finish();
 }
 
 }  // namespace perftools
@@ -8,11 +8,17 @@
 #ifndef PERFTOOLS_PERF_DATA_HANDLER_H_
 #define PERFTOOLS_PERF_DATA_HANDLER_H_
 
+#include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include "src/quipper/arm_spe_decoder.h"
 #include "src/quipper/perf_data.pb.h"
+#include "src/quipper/phase_timer.h"
+#include "src/quipper/sample_columns.h"
+#include "src/quipper/warning_counts.h"
 
 namespace perftools {
 
@@ -74,27 +80,49 @@ struct BuildId {
 // they may want to maintain as part of the output data creation.
 class PerfDataHandler {
  public:
+  // A file mapped into memory, shared by all the mappings of the same file
+  // with the same build ID. The DSOs are interned by the handler, so they may
+  // be used as cache keys the same way as mappings.
+  struct Dso {
+    Dso(const std::string& filename, const BuildId& build_id,
+        uint64_t filename_md5_prefix)
+        : filename(filename),
+          build_id(build_id.value, build_id.source),
+          filename_md5_prefix(filename_md5_prefix) {}
+
+    std::string filename;  // Empty if missing.
+    BuildId build_id;      // build_id.value is empty if missing
+    uint64_t filename_md5_prefix;
+  };
+
   struct Mapping {
    public:
+    Mapping(const Dso* dso, uint64_t start, uint64_t limit,
+            uint64_t file_offset)
+        : dso(dso), start(start), limit(limit), file_offset(file_offset) {}
+
+    // Creates a mapping that owns a DSO of its own.
     Mapping(const std::string& filename, const BuildId& build_id,
             uint64_t start, uint64_t limit, uint64_t file_offset,
             uint64_t filename_md5_prefix)
-        : filename(filename),
-          build_id(build_id.value, build_id.source),
-          start(start),
+        : start(start),
           limit(limit),
           file_offset(file_offset),
-          filename_md5_prefix(filename_md5_prefix) {}
+          owned_dso_(new Dso(filename, build_id, filename_md5_prefix)) {
+      dso = owned_dso_.get();
+    }
 
-    std::string filename;  // Empty if missing.
-    BuildId build_id;      // build_id.value is empty if missing
+    const std::string& filename() const { return dso->filename; }
+    const BuildId& build_id() const { return dso->build_id; }
+    uint64_t filename_md5_prefix() const { return dso->filename_md5_prefix; }
+
+    const Dso* dso;
     uint64_t start;
     uint64_t limit;  // limit=ceiling.
     uint64_t file_offset;
-    uint64_t filename_md5_prefix;
 
    private:
-    Mapping() {}
+    std::unique_ptr<const Dso> owned_dso_;
   };
 
   struct Location {
@@ -113,21 +141,31 @@ class PerfDataHandler {
           cycles(0),
           spec(0) {}
 
+    // The widths of the cycles and spec fields of the kernel's
+    // perf_branch_entry. The flags are packed with them into a single word,
+    // as branch stacks of 32 entries are copied for every LBR sample.
+    static constexpr int kCyclesBits = 16;
+    static constexpr int kSpecBits = 2;
+    static constexpr uint32_t kMaxCycles = (1u << kCyclesBits) - 1;
+    static constexpr uint32_t kSpecMask = (1u << kSpecBits) - 1;
+
     Location from;
     Location to;
     // Branch target was mispredicted.
-    bool mispredicted;
+    bool mispredicted : 1;
     // Branch target was predicted.
-    bool predicted;
+    bool predicted : 1;
     // Indicates running in a hardware transaction.
-    bool in_transaction;
+    bool in_transaction : 1;
     // Indicates aborting a hardware transaction.
-    bool abort;
-    // The cycles from last taken branch (LBR).
-    uint32_t cycles;
+    bool abort : 1;
+    // The cycles from last taken branch (LBR), saturated at kMaxCycles.
+    uint32_t cycles : kCyclesBits;
     // Branch speculation outcome classification if supported.
-    uint32_t spec;
+    uint32_t spec : kSpecBits;
   };
+  static_assert(sizeof(BranchStackPair) <= 2 * sizeof(Location) + 8,
+                "BranchStackPair flags should be packed into one word");
 
   struct SampleContext {
     SampleContext(const quipper::PerfDataProto::EventHeader& h,
@@ -140,6 +178,7 @@ class PerfDataHandler {
           file_attrs_index(-1),
           cgroup(nullptr),
           lost(false),
+          count(1),
           spe{false, quipper::ArmSpeDecoder::Record()} {}
 
     // The event's header.
@@ -152,17 +191,23 @@ class PerfDataHandler {
     const Mapping* sample_mapping;
     // The mapping in which event.addr is found.
     const Mapping* addr_mapping;
-    // Locations corresponding to event.callchain.
+    // Locations corresponding to event.callchain. The normalizer reuses the
+    // storage of callchain and branch_stack for later samples, so it must not
+    // be referenced after the callback returns.
     std::vector<Location> callchain;
     // Locations corresponding to entries in event.branch_stack.
     std::vector<BranchStackPair> branch_stack;
     // An index into PerfDataProto.file_attrs or -1 if
     // unavailable.
     int64_t file_attrs_index;
-    // Cgroup pathname
+    // Cgroup pathname. The samples of cgroups with the same path point to the
+    // same string.
     const std::string* cgroup;
     // True if this is a synthesized sample created to account for lost events.
     bool lost;
+    // The number of identical samples this stands for. Only synthesized lost
+    // samples stand for more than one, one per lost sample of a record.
+    uint64_t count;
     // The attributes for the sample if it comes from Arm SPE.
     struct {
       bool is_spe;
@@ -185,14 +230,100 @@ class PerfDataHandler {
     uint32_t pid;
   };
 
+  // EventStream normalizes events that are handed to it one at a time and
+  // drives the handler callbacks for them the same way Process() does. The
+  // events must be delivered in time order, since the mappings and comms a
+  // sample refers to are resolved from the events seen so far.
+  class EventStream {
+   public:
+    virtual ~EventStream() {}
+
+    // Normalizes a single event. The event only needs to stay alive for the
+    // duration of the call.
+    virtual void ProcessEvent(
+        const quipper::PerfDataProto::PerfEvent& event_proto) = 0;
+
+    // Called once after the last event has been processed.
+    virtual void Finish() = 0;
+
+    // Continues the stream, after Finish(), with the events of the next part
+    // of the same recording, e.g. the next file written by "perf record
+    // --switch-output". perf_proto replaces the one the stream was created
+    // with, and must outlive the stream or the next call. The mmaps, comms
+    // and build IDs seen so far are kept, so that the samples are resolved as
+    // if the parts had been one profile.
+    virtual void StartChunk(const quipper::PerfDataProto& perf_proto) = 0;
+  };
+
   PerfDataHandler(const PerfDataHandler&) = delete;
   PerfDataHandler& operator=(const PerfDataHandler&) = delete;
 
+  // The counters of a normalization, which are also logged when they point
+  // at a broken profile, and the sizes of its maps at the end.
+  struct NormalizationStats {
+    int64_t samples = 0;
+    int64_t samples_with_addr = 0;
+    int64_t synthesized_lost_samples = 0;
+    int64_t missing_main_mmap = 0;
+    int64_t missing_sample_mmap = 0;
+    int64_t missing_addr_mmap = 0;
+    int64_t missing_pid = 0;
+
+    // The samples recorded, rather than synthesized for lost ones, and those
+    // of them whose IP, callchain and branch stack addresses were all mapped.
+    int64_t recorded_samples = 0;
+    int64_t mapped_samples = 0;
+
+    int64_t callchain_ips = 0;
+    int64_t missing_callchain_mmap = 0;
+
+    int64_t branch_stack_ips = 0;
+    int64_t missing_branch_stack_mmap = 0;
+
+    int64_t no_event_errors = 0;
+
+    // The events and samples that were skipped or guessed about, which are
+    // logged once at the end.
+    quipper::WarningCounts warnings;
+
+    // The processes with an address space, the mappings and the DSOs.
+    int64_t address_spaces = 0;
+    int64_t mappings = 0;
+    int64_t dsos = 0;
+
+    // The time spent in the handler's Sample() and SampleBatch().
+    quipper::PhaseTime handler_samples;
+  };
+
   // Process initiates processing of perf_proto.  handler.Sample will
-  // be called for every event in the profile.
+  // be called for every event in the profile. Arm SPE trace data is decoded on
+  // up to |num_threads| threads; the handler is always called on the calling
+  // thread, in order. Only the Arm SPE records that |spe_filter| keeps are
+  // turned into samples. The counters of the normalization are stored in
+  // |stats| if it isn't null. |perf_data| is the perf data |perf_proto| was
+  // read from, if it was read by a quipper::PerfReader that referenced the
+  // auxtrace trace data in it, see SetReferenceAuxtraceData().
+  static void Process(
+      const quipper::PerfDataProto& perf_proto, PerfDataHandler* handler,
+      int num_threads = 1,
+      const quipper::ArmSpeDecoder::RecordFilter& spe_filter = {},
+      NormalizationStats* stats = nullptr, std::string_view perf_data = {});
+
+  // Same as above, for a profile whose samples were read into |samples| rather
+  // than stored in |perf_proto|. Each sample is processed in its original
+  // position among the events of |perf_proto|.
   static void Process(const quipper::PerfDataProto& perf_proto,
+                      const quipper::SampleColumns& samples,
                       PerfDataHandler* handler);
 
+  // Returns a stream that normalizes events which are not stored in
+  // perf_proto, e.g. events delivered by quipper::PerfReader's event callback.
+  // perf_proto provides the file attrs, build IDs and metadata of the profile,
+  // and must outlive the stream. Any events in perf_proto are ignored.
+  static std::unique_ptr<EventStream> CreateEventStream(
+      const quipper::PerfDataProto& perf_proto, PerfDataHandler* handler,
+      const quipper::ArmSpeDecoder::RecordFilter& spe_filter = {});
+
   // Returns name string if it's non empty or hex string of md5_prefix.
   static std::string NameOrMd5Prefix(std::string name, uint64_t md5_prefix);
 
@@ -204,22 +335,87 @@ class PerfDataHandler {
   virtual ~PerfDataHandler() {}
 
   // Implement these callbacks:
+  // Called for every sample before it is normalized, with only the sample,
+  // the header and the file_attrs_index set. Returning false drops the sample
+  // without normalizing it, and Sample() isn't called for it.
+  virtual bool KeepSample(const SampleContext& sample) { return true; }
+  // Returns whether the callchains and branch stacks of the samples are
+  // normalized. Handlers that only look at the sampled addresses return false
+  // to get samples with neither, which saves looking up every frame.
+  virtual bool NeedsStacks() const { return true; }
   // Called for every sample. Returns false if no action was taken.
   virtual bool Sample(const SampleContext& sample) = 0;
+  // Called with consecutive normalized samples instead of Sample() for each
+  // of them. The contexts are only valid during the call. The default calls
+  // Sample() for each sample, in order.
+  virtual void SampleBatch(const SampleContext* samples, size_t num_samples) {
+    for (size_t i = 0; i < num_samples; ++i) {
+      Sample(samples[i]);
+    }
+  }
   // When comm.pid()==comm.tid() it indicates an exec() happened.
   virtual void Comm(const CommContext& comm) = 0;
   // Called for every mmap event.
   virtual void MMap(const MMapContext& mmap) = 0;
+  // Returns whether Exit() is called. The samples batched so far are passed
+  // to the handler before each exit event, so handlers that ignore exits
+  // return false to keep the batches full.
+  virtual bool WantsExits() const { return false; }
+  // Called for every exit event if WantsExits(). When exit.pid()==exit.tid()
+  // it indicates the process exited.
+  virtual void Exit(const quipper::PerfDataProto::ForkEvent& exit) {}
+  // Called once after the last event has been processed, while the mappings
+  // passed to the other callbacks are still alive.
+  virtual void Finish() {}
 
  protected:
   PerfDataHandler();
+};
+
+// FanOutHandler passes the events of a single normalization to several
+// handlers, e.g. a converter and a stats collector, so that the mappings,
+// build IDs and Arm SPE records are only resolved once for all of them. Each
+// handler is called as if it had been passed to PerfDataHandler::Process()
+// alone: it gets the samples its KeepSample() keeps, and all the other
+// callbacks, in order.
+class FanOutHandler : public PerfDataHandler {
+ public:
+  // The handlers must outlive this, and are called in the order given.
+  explicit FanOutHandler(std::vector<PerfDataHandler*> handlers);
+
+  FanOutHandler(const FanOutHandler&) = delete;
+  FanOutHandler& operator=(const FanOutHandler&) = delete;
+
+  // Keeps the samples which any of the handlers keeps.
+  bool KeepSample(const SampleContext& sample) override;
+  // Returns true if any of the handlers the sample is passed to does.
+  bool Sample(const SampleContext& sample) override;
+  // Passes each handler the runs of consecutive samples it keeps.
+  void SampleBatch(const SampleContext* samples, size_t num_samples) override;
+  void Comm(const CommContext& comm) override;
+  void MMap(const MMapContext& mmap) override;
+  // Returns true if any of the handlers does, and only passes Exit() to those.
+  bool WantsExits() const override;
+  void Exit(const quipper::PerfDataProto::ForkEvent& exit) override;
+  void Finish() override;
 
-  // The build ID source count of each process; key by process ID.
-  std::unordered_map<uint32_t, BuildIdStats> process_build_id_stats_;
+ private:
+  // Returns whether the handler |h| keeps the |row|th sample not yet passed.
+  bool Kept(size_t row, size_t h) const {
+    return kept_[(next_row_ + row) * handlers_.size() + h];
+  }
+  // Drops the first |num_rows| samples not yet passed.
+  void Passed(size_t num_rows);
 
-  // Increments the counter of the corresponding Build ID Stat of the process
-  // according to the given mapping.
-  void IncBuildIdStats(uint32_t pid, const PerfDataHandler::Mapping* mapping);
+  const std::vector<PerfDataHandler*> handlers_;
+  // Whether each handler keeps each of the kept samples, one row of
+  // handlers_.size() entries per sample, from the first sample not yet passed
+  // to the handlers at row next_row_.
+  std::vector<bool> kept_;
+  size_t next_row_ = 0;
+  // The number of lost samples each handler keeps of the synthesized sample
+  // that stands for them, which is passed to Sample() once they're all kept.
+  std::vector<uint64_t> lost_counts_;
 };
 
 }  // namespace perftools
@@ -8,6 +8,8 @@
 #include "src/perf_data_handler.h"
 
 #include <cstdint>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -99,11 +101,12 @@ class TestPerfDataHandler : public PerfDataHandler {
   // Callbacks for PerfDataHandler
   bool Sample(const SampleContext& sample) override {
     seen_sample_events_.push_back(sample.sample);
+    seen_sample_counts_.push_back(sample.count);
     if (sample.addr_mapping != nullptr) {
       const Mapping* m = sample.addr_mapping;
       seen_addr_mappings_.push_back(std::unique_ptr<Mapping>(
-          new Mapping(m->filename, m->build_id, m->start, m->limit,
-                      m->file_offset, m->filename_md5_prefix)));
+          new Mapping(m->filename(), m->build_id(), m->start, m->limit,
+                      m->file_offset, m->filename_md5_prefix())));
     } else {
       seen_addr_mappings_.push_back(nullptr);
     }
@@ -127,8 +130,9 @@ class TestPerfDataHandler : public PerfDataHandler {
   }
   void Comm(const CommContext& comm) override {}
   void MMap(const MMapContext& mmap) override {
-    std::string actual_build_id = mmap.mapping->build_id.value;
-    std::string actual_filename = mmap.mapping->filename;
+    std::string actual_build_id = mmap.mapping->build_id().value;
+    std::string actual_filename = mmap.mapping->filename();
+    seen_mmap_dsos_.push_back(mmap.mapping->dso);
     const auto expected_build_id_it =
         expected_filename_to_build_id_.find(actual_filename);
     if (expected_build_id_it != expected_filename_to_build_id_.end()) {
@@ -158,11 +162,21 @@ class TestPerfDataHandler : public PerfDataHandler {
     return seen_addr_mappings_;
   }
 
+  // The DSOs are owned by the normalizer, so they may only be compared once
+  // processing is done.
+  const std::vector<const Dso*>& SeenMMapDsos() const {
+    return seen_mmap_dsos_;
+  }
+
   const std::vector<quipper::PerfDataProto::SampleEvent>& SeenSampleEvents()
       const {
     return seen_sample_events_;
   }
 
+  const std::vector<uint64_t>& SeenSampleCounts() const {
+    return seen_sample_counts_;
+  }
+
   const std::vector<quipper::ArmSpeDecoder::Record>& SeenArmSpeRecords() const {
     return seen_arm_spe_records_;
   }
@@ -184,7 +198,9 @@ class TestPerfDataHandler : public PerfDataHandler {
   std::unordered_map<std::string, std::string> expected_filename_to_build_id_;
   std::unordered_set<std::string> seen_filenames_;
   std::vector<std::unique_ptr<Mapping>> seen_addr_mappings_;
+  std::vector<const Dso*> seen_mmap_dsos_;
   std::vector<quipper::PerfDataProto::SampleEvent> seen_sample_events_;
+  std::vector<uint64_t> seen_sample_counts_;
   std::vector<quipper::ArmSpeDecoder::Record> seen_arm_spe_records_;
 };
 
@@ -315,6 +331,70 @@ TEST(PerfDataHandlerTest, SampleBranchStackMatches) {
   PerfDataHandler::Process(proto, &handler);
 }
 
+// Records the branch stacks of the samples.
+class BranchStackRecordingHandler : public PerfDataHandler {
+ public:
+  BranchStackRecordingHandler() {}
+  BranchStackRecordingHandler(const BranchStackRecordingHandler&) = delete;
+  BranchStackRecordingHandler& operator=(const BranchStackRecordingHandler&) =
+      delete;
+
+  bool Sample(const SampleContext& sample) override {
+    branch_stacks_.push_back(sample.branch_stack);
+    return true;
+  }
+  void Comm(const CommContext& comm) override {}
+  void MMap(const MMapContext& mmap) override {}
+
+  const std::vector<std::vector<BranchStackPair>>& branch_stacks() const {
+    return branch_stacks_;
+  }
+
+ private:
+  std::vector<std::vector<BranchStackPair>> branch_stacks_;
+};
+
+// The packed flags of the branch stack entries are kept apart, and cycles
+// beyond the kernel's 16 bits are saturated.
+TEST(PerfDataHandlerTest, BranchStackFlagsArePacked) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto* sample_event = proto.add_events()->mutable_sample_event();
+  sample_event->set_ip(123);
+  sample_event->set_pid(100);
+  sample_event->set_tid(100);
+  sample_event->set_id(0);
+  auto* entry = sample_event->add_branch_stack();
+  entry->set_mispredicted(true);
+  entry->set_abort(true);
+  entry->set_cycles(0xffff);
+  entry->set_spec(3);
+  entry = sample_event->add_branch_stack();
+  entry->set_predicted(true);
+  entry->set_in_transaction(true);
+  entry->set_cycles(70000);
+  entry->set_spec(1);
+
+  BranchStackRecordingHandler handler;
+  PerfDataHandler::Process(proto, &handler);
+  ASSERT_EQ(1, handler.branch_stacks().size());
+  const auto& branch_stack = handler.branch_stacks()[0];
+  ASSERT_EQ(2, branch_stack.size());
+  EXPECT_TRUE(branch_stack[0].mispredicted);
+  EXPECT_FALSE(branch_stack[0].predicted);
+  EXPECT_FALSE(branch_stack[0].in_transaction);
+  EXPECT_TRUE(branch_stack[0].abort);
+  EXPECT_EQ(0xffff, branch_stack[0].cycles);
+  EXPECT_EQ(3, branch_stack[0].spec);
+  EXPECT_FALSE(branch_stack[1].mispredicted);
+  EXPECT_TRUE(branch_stack[1].predicted);
+  EXPECT_TRUE(branch_stack[1].in_transaction);
+  EXPECT_FALSE(branch_stack[1].abort);
+  EXPECT_EQ(PerfDataHandler::BranchStackPair::kMaxCycles,
+            branch_stack[1].cycles);
+  EXPECT_EQ(1, branch_stack[1].spec);
+}
+
 TEST(PerfDataHandlerTest, AddressMappingIsSet) {
   quipper::PerfDataProto proto;
 
@@ -368,12 +448,428 @@ TEST(PerfDataHandlerTest, AddressMappingIsSet) {
   EXPECT_EQ(nullptr, addr_mappings[0]);
   const PerfDataHandler::Mapping* mapping = addr_mappings[1].get();
   ASSERT_TRUE(mapping != nullptr);
-  EXPECT_EQ("/foo/baz", mapping->filename);
+  EXPECT_EQ("/foo/baz", mapping->filename());
   EXPECT_EQ(0x3000, mapping->start);
   EXPECT_EQ(0x4000, mapping->limit);
   EXPECT_EQ(0x1000, mapping->file_offset);
 }
 
+// A mapping that replaces another one is found, even though the replaced one
+// was looked up just before.
+TEST(PerfDataHandlerTest, AddressMappingIsUpdatedByMmap) {
+  quipper::PerfDataProto proto;
+
+  // File attrs are required for sample event processing.
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  for (const char* filename : {"/foo/bar", "/foo/baz"}) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(100);
+    mmap_event->set_tid(100);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1010);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    sample_event->set_addr(0x1100);
+    sample_event->set_sample_time_ns(456);
+    sample_event->set_period(1);
+    sample_event->set_id(file_attr_id);
+  }
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(2u, addr_mappings.size());
+  ASSERT_TRUE(addr_mappings[0] != nullptr);
+  EXPECT_EQ("/foo/bar", addr_mappings[0]->filename());
+  ASSERT_TRUE(addr_mappings[1] != nullptr);
+  EXPECT_EQ("/foo/baz", addr_mappings[1]->filename());
+}
+
+// The nameless mapping of the main binary left by a hugepage remap gets the
+// name of the binary from its next mapping, as a new mapping, leaving the one
+// already passed to the handler as it was.
+TEST(PerfDataHandlerTest, HugepageMappingIsRenamedByNewMapping) {
+  quipper::PerfDataProto proto;
+  uint64_t file_attr_id = 0;
+  proto.add_file_attrs()->add_ids(file_attr_id);
+
+  auto* mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x400000);
+  mmap_event->set_len(0x200000);
+  mmap_event->set_pgoff(0);
+  mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/usr/bin/foo");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x600000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0x200000);
+
+  auto* sample_event = proto.add_events()->mutable_sample_event();
+  sample_event->set_ip(0x400010);
+  sample_event->set_pid(100);
+  sample_event->set_tid(100);
+  sample_event->set_addr(0x400100);
+  sample_event->set_sample_time_ns(456);
+  sample_event->set_period(1);
+  sample_event->set_id(file_attr_id);
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  const auto& dsos = handler.SeenMMapDsos();
+  ASSERT_EQ(3u, dsos.size());
+  EXPECT_NE(dsos[0], dsos[1]);
+  EXPECT_EQ(dsos[1], dsos[2]);
+  const auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(1u, addr_mappings.size());
+  ASSERT_TRUE(addr_mappings[0] != nullptr);
+  EXPECT_EQ("/usr/bin/foo", addr_mappings[0]->filename());
+  EXPECT_EQ(0x400000, addr_mappings[0]->start);
+  EXPECT_EQ(0x600000, addr_mappings[0]->limit);
+}
+
+// A forked child starts with its parent's mappings, and later mmaps by either
+// of them don't affect the other.
+TEST(PerfDataHandlerTest, ForkedProcessesHaveSeparateMappings) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto add_mmap = [&proto](uint32_t pid, const char* filename,
+                           uint64_t start) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(start);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  };
+  auto add_sample = [&proto](uint32_t pid, uint64_t addr) {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(addr);
+    sample_event->set_pid(pid);
+    sample_event->set_tid(pid);
+    sample_event->set_addr(addr);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+  };
+
+  add_mmap(100, "/foo/bar", 0x1000);
+  for (uint32_t child : {200, 300}) {
+    auto* fork = proto.add_events()->mutable_fork_event();
+    fork->set_pid(child);
+    fork->set_tid(child);
+    fork->set_ppid(100);
+    fork->set_ptid(100);
+  }
+  add_mmap(200, "/foo/child", 0x1000);
+  add_mmap(100, "/foo/parent", 0x3000);
+  for (uint32_t pid : {100, 200, 300}) {
+    add_sample(pid, 0x1100);
+    add_sample(pid, 0x3100);
+  }
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(6u, addr_mappings.size());
+  const char* const want_filenames[] = {"/foo/bar",   "/foo/parent",
+                                        "/foo/child", nullptr,
+                                        "/foo/bar",   nullptr};
+  for (int i = 0; i < 6; ++i) {
+    if (want_filenames[i] == nullptr) {
+      EXPECT_TRUE(addr_mappings[i] == nullptr) << i;
+      continue;
+    }
+    ASSERT_TRUE(addr_mappings[i] != nullptr) << i;
+    EXPECT_EQ(want_filenames[i], addr_mappings[i]->filename()) << i;
+  }
+}
+
+// Kernel addresses that are not in the process's address space are looked up
+// in the kernel's, which can also change.
+// The mappings of the same file in different processes share its DSO.
+TEST(PerfDataHandlerTest, MappingsOfTheSameFileShareDso) {
+  quipper::PerfDataProto proto;
+  struct {
+    const char* filename;
+    uint32_t pid;
+  } mmaps[] = {{"/lib/libc.so", 100}, {"/lib/libc.so", 200}, {"/foo/bar", 200}};
+  for (const auto& m : mmaps) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(m.filename);
+    mmap_event->set_pid(m.pid);
+    mmap_event->set_tid(m.pid);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+  }
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  const auto& dsos = handler.SeenMMapDsos();
+  ASSERT_EQ(3u, dsos.size());
+  EXPECT_EQ(dsos[0], dsos[1]);
+  EXPECT_NE(dsos[0], dsos[2]);
+}
+
+TEST(PerfDataHandlerTest, KernelAddressMappingIsUpdatedByMmap) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+
+  auto* user_mmap = proto.add_events()->mutable_mmap_event();
+  user_mmap->set_filename("/foo/bar");
+  user_mmap->set_pid(100);
+  user_mmap->set_tid(100);
+  user_mmap->set_start(0x1000);
+  user_mmap->set_len(0x1000);
+  user_mmap->set_pgoff(0);
+  for (const char* filename : {"/foo/kernel1", "/foo/kernel2"}) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(std::numeric_limits<uint32_t>::max());
+    mmap_event->set_tid(std::numeric_limits<uint32_t>::max());
+    mmap_event->set_start(0xffff0000);
+    mmap_event->set_len(0x1000);
+    mmap_event->set_pgoff(0);
+
+    for (int i = 0; i < 2; ++i) {
+      auto* sample_event = proto.add_events()->mutable_sample_event();
+      sample_event->set_ip(0x1010);
+      sample_event->set_pid(100);
+      sample_event->set_tid(100);
+      sample_event->set_addr(0xffff0100);
+      sample_event->set_period(1);
+      sample_event->set_id(0);
+    }
+  }
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(4u, addr_mappings.size());
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(addr_mappings[i] != nullptr) << i;
+    EXPECT_EQ(i < 2 ? "/foo/kernel1" : "/foo/kernel2",
+              addr_mappings[i]->filename());
+  }
+}
+
+// Records the samples passed in batches, and the other callbacks between them.
+class BatchRecordingHandler : public PerfDataHandler {
+ public:
+  explicit BatchRecordingHandler(bool wants_exits = false)
+      : wants_exits_(wants_exits) {}
+  BatchRecordingHandler(const BatchRecordingHandler&) = delete;
+  BatchRecordingHandler& operator=(const BatchRecordingHandler&) = delete;
+
+  bool Sample(const SampleContext& sample) override {
+    ADD_FAILURE() << "Sample() called instead of SampleBatch()";
+    return false;
+  }
+  void SampleBatch(const SampleContext* samples, size_t num_samples) override {
+    calls_.push_back("batch:" + std::to_string(num_samples));
+    for (size_t i = 0; i < num_samples; ++i) {
+      std::vector<uint64_t> ips;
+      for (const auto& location : samples[i].callchain) {
+        ips.push_back(location.ip);
+      }
+      callchains_.push_back(ips);
+    }
+  }
+  void Comm(const CommContext& comm) override { calls_.push_back("comm"); }
+  void MMap(const MMapContext& mmap) override { calls_.push_back("mmap"); }
+  bool WantsExits() const override { return wants_exits_; }
+  void Exit(const quipper::PerfDataProto::ForkEvent& exit) override {
+    calls_.push_back("exit");
+  }
+
+  const std::vector<std::string>& calls() const { return calls_; }
+  const std::vector<std::vector<uint64_t>>& callchains() const {
+    return callchains_;
+  }
+
+ private:
+  const bool wants_exits_;
+  std::vector<std::string> calls_;
+  std::vector<std::vector<uint64_t>> callchains_;
+};
+
+// Samples are passed in batches, which end before every other callback, and
+// the callchain storage reused across batches holds each sample's own frames.
+TEST(PerfDataHandlerTest, SamplesArePassedInBatches) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto* mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/bar");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0);
+  auto add_sample = [&proto](int i) {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1010);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    sample_event->set_id(0);
+    for (int j = 0; j < i % 4; ++j) {
+      sample_event->add_callchain(0x1000 + i);
+    }
+  };
+  const int kNumSamples = 300;
+  for (int i = 0; i < kNumSamples; ++i) {
+    add_sample(i);
+  }
+  auto* comm_event = proto.add_events()->mutable_comm_event();
+  comm_event->set_pid(100);
+  comm_event->set_tid(101);
+  comm_event->set_comm("foo");
+  add_sample(kNumSamples);
+  add_sample(kNumSamples + 1);
+
+  BatchRecordingHandler handler;
+  PerfDataHandler::Process(proto, &handler);
+  EXPECT_THAT(handler.calls(), testing::ElementsAre("mmap", "batch:256",
+                                                    "batch:44", "comm",
+                                                    "batch:2"));
+  ASSERT_EQ(kNumSamples + 2, handler.callchains().size());
+  for (int i = 0; i < kNumSamples + 2; ++i) {
+    EXPECT_EQ(std::vector<uint64_t>(i % 4, 0x1000 + i),
+              handler.callchains()[i])
+        << "sample " << i;
+  }
+}
+
+// Exits only end batches of samples for the handlers that want them.
+TEST(PerfDataHandlerTest, ExitsArePassedIfWanted) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto add_sample = [&proto]() {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1010);
+    sample_event->set_pid(100);
+    sample_event->set_tid(101);
+    sample_event->set_id(0);
+  };
+  add_sample();
+  auto* exit_event = proto.add_events()->mutable_exit_event();
+  exit_event->set_pid(100);
+  exit_event->set_tid(101);
+  add_sample();
+
+  BatchRecordingHandler handler;
+  PerfDataHandler::Process(proto, &handler);
+  EXPECT_THAT(handler.calls(), testing::ElementsAre("batch:2"));
+  BatchRecordingHandler exits_handler(/*wants_exits=*/true);
+  PerfDataHandler::Process(proto, &exits_handler);
+  EXPECT_THAT(exits_handler.calls(),
+              testing::ElementsAre("batch:1", "exit", "batch:1"));
+
+  BatchRecordingHandler fanned_out;
+  BatchRecordingHandler fanned_out_exits(/*wants_exits=*/true);
+  FanOutHandler fan_out({&fanned_out, &fanned_out_exits});
+  PerfDataHandler::Process(proto, &fan_out);
+  EXPECT_THAT(fanned_out.calls(),
+              testing::ElementsAre("batch:1", "batch:1"));
+  EXPECT_THAT(fanned_out_exits.calls(),
+              testing::ElementsAre("batch:1", "exit", "batch:1"));
+}
+
+// Keeps every |keep_every|th sample it is asked about, and records the
+// samples and the other callbacks.
+class EveryNthRecordingHandler : public PerfDataHandler {
+ public:
+  explicit EveryNthRecordingHandler(int keep_every) : keep_every_(keep_every) {}
+  EveryNthRecordingHandler(const EveryNthRecordingHandler&) = delete;
+  EveryNthRecordingHandler& operator=(const EveryNthRecordingHandler&) =
+      delete;
+
+  bool KeepSample(const SampleContext& sample) override {
+    return ++asked_ % keep_every_ == 0;
+  }
+  bool Sample(const SampleContext& sample) override {
+    calls_.push_back("sample:" + std::to_string(sample.sample.ip()) + ":" +
+                     std::to_string(sample.callchain.size()) + ":" +
+                     std::to_string(sample.count));
+    return true;
+  }
+  void Comm(const CommContext& comm) override { calls_.push_back("comm"); }
+  void MMap(const MMapContext& mmap) override { calls_.push_back("mmap"); }
+  void Finish() override { calls_.push_back("finish"); }
+
+  const std::vector<std::string>& calls() const { return calls_; }
+
+ private:
+  const int keep_every_;
+  int asked_ = 0;
+  std::vector<std::string> calls_;
+};
+
+// Each handler of a FanOutHandler sees what it would see alone.
+TEST(PerfDataHandlerTest, FanOutHandlerMatchesSeparateProcessing) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto* mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/bar");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  for (int i = 0; i < 600; ++i) {
+    if (i == 400) {
+      auto* comm_event = proto.add_events()->mutable_comm_event();
+      comm_event->set_pid(100);
+      comm_event->set_tid(101);
+      comm_event->set_comm("foo");
+      auto* lost_event = proto.add_events()->mutable_lost_event();
+      lost_event->mutable_sample_info()->set_id(0);
+      lost_event->mutable_sample_info()->set_pid(100);
+      lost_event->mutable_sample_info()->set_tid(100);
+      lost_event->set_lost(10);
+    }
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1000 + i);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    sample_event->set_id(0);
+    for (int j = 0; j < i % 4; ++j) sample_event->add_callchain(0x1800);
+  }
+
+  std::vector<std::vector<std::string>> expected;
+  for (int keep_every : {1, 2, 3}) {
+    EveryNthRecordingHandler handler(keep_every);
+    PerfDataHandler::Process(proto, &handler);
+    expected.push_back(handler.calls());
+  }
+
+  EveryNthRecordingHandler all(1), halves(2), thirds(3);
+  FanOutHandler fan_out({&all, &halves, &thirds});
+  PerfDataHandler::Process(proto, &fan_out);
+  EXPECT_EQ(expected[0], all.calls());
+  EXPECT_EQ(expected[1], halves.calls());
+  EXPECT_EQ(expected[2], thirds.calls());
+  // The lost samples are passed with the number each handler keeps.
+  EXPECT_THAT(thirds.calls(), testing::Contains(
+                                  "sample:" + std::to_string(9ULL << 60) +
+                                  ":0:3"));
+}
+
 TEST(PerfDataHandlerTest, MappingBuildIdAndSourceAreSet) {
   quipper::PerfDataProto proto;
 
@@ -421,10 +917,65 @@ TEST(PerfDataHandlerTest, MappingBuildIdAndSourceAreSet) {
   auto& mappings = handler.SeenAddrMappings();
 
   // Expect mmap events have their build ID and sources set.
-  EXPECT_EQ(mappings[0]->build_id.value, "abcdef0001");
-  EXPECT_EQ(mappings[0]->build_id.source, kBuildIdMmapDiffFilename);
-  EXPECT_EQ(mappings[1]->build_id.value, "");
-  EXPECT_EQ(mappings[1]->build_id.source, kBuildIdMissing);
+  EXPECT_EQ(mappings[0]->build_id().value, "abcdef0001");
+  EXPECT_EQ(mappings[0]->build_id().source, kBuildIdMmapDiffFilename);
+  EXPECT_EQ(mappings[1]->build_id().value, "");
+  EXPECT_EQ(mappings[1]->build_id().source, kBuildIdMissing);
+}
+
+// Records the build IDs of the mmaps.
+class BuildIdRecordingHandler : public PerfDataHandler {
+ public:
+  BuildIdRecordingHandler() {}
+  BuildIdRecordingHandler(const BuildIdRecordingHandler&) = delete;
+  BuildIdRecordingHandler& operator=(const BuildIdRecordingHandler&) = delete;
+
+  bool Sample(const SampleContext& sample) override { return true; }
+  void Comm(const CommContext& comm) override {}
+  void MMap(const MMapContext& mmap) override {
+    build_ids_.push_back(mmap.mapping->build_id());
+  }
+
+  const std::vector<BuildId>& build_ids() const { return build_ids_; }
+
+ private:
+  std::vector<BuildId> build_ids_;
+};
+
+// The build IDs resolved for the earlier mmaps of a file are only reused for
+// mmaps with the same build ID of their own.
+TEST(PerfDataHandlerTest, RepeatedMmapsOfFileResolveBuildIds) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto* build_id = proto.add_build_ids();
+  build_id->set_filename("/usr/lib/foo");
+  build_id->set_build_id_hash(std::string("\xab\xcd", 2));
+  const char* const kMmapBuildIds[] = {"", "", "abcd00", "1234", "1234", ""};
+  for (size_t i = 0; i < std::size(kMmapBuildIds); ++i) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename("/usr/lib/foo");
+    mmap_event->set_pid(100 + i);
+    mmap_event->set_tid(100 + i);
+    mmap_event->set_start(0x1000);
+    mmap_event->set_len(0x1000);
+    if (kMmapBuildIds[i][0] != '\0') mmap_event->set_build_id(kMmapBuildIds[i]);
+  }
+
+  BuildIdRecordingHandler handler;
+  PerfDataHandler::Process(proto, &handler);
+  ASSERT_EQ(std::size(kMmapBuildIds), handler.build_ids().size());
+  const BuildId expected[] = {
+      BuildId("abcd", kBuildIdFilename),
+      BuildId("abcd", kBuildIdFilename),
+      BuildId("abcd00", kBuildIdMmapSameFilename),
+      BuildId("1234", kBuildIdMmapDiffFilename),
+      BuildId("1234", kBuildIdMmapDiffFilename),
+      BuildId("abcd", kBuildIdFilename),
+  };
+  for (size_t i = 0; i < std::size(expected); ++i) {
+    EXPECT_EQ(expected[i].value, handler.build_ids()[i].value) << i;
+    EXPECT_EQ(expected[i].source, handler.build_ids()[i].source) << i;
+  }
 }
 
 TEST(PerfDataHandlerTest, LostSampleEventsAreHandledInNewerPerf) {
@@ -471,7 +1022,8 @@ TEST(PerfDataHandlerTest, LostSampleEventsAreHandledInNewerPerf) {
                                 std::unordered_map<std::string, std::string>{});
     PerfDataHandler::Process(proto, &handler);
 
-    EXPECT_EQ(handler.SeenAddrMappings().size(), 5)
+    // The lost samples of a record are passed as a single sample.
+    EXPECT_EQ(handler.SeenSampleCounts(), std::vector<uint64_t>{5})
         << " perf_version:" << perf_version;
   }
 }
@@ -510,11 +1062,118 @@ TEST(PerfDataHandlerTest, LostEventsAreHandledInOlderPerf) {
                                 std::unordered_map<std::string, std::string>{});
     PerfDataHandler::Process(proto, &handler);
 
-    EXPECT_EQ(handler.SeenAddrMappings().size(), 10)
+    EXPECT_EQ(handler.SeenSampleCounts(), std::vector<uint64_t>{10})
         << " perf_version: " << perf_version;
   }
 }
 
+TEST(PerfDataHandlerTest, EventStreamMatchesProcess) {
+  quipper::PerfDataProto proto;
+
+  // File attrs are required for sample event processing.
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  auto* comm_event = proto.add_events()->mutable_comm_event();
+  comm_event->set_comm("bar");
+  comm_event->set_pid(100);
+  comm_event->set_tid(100);
+
+  auto mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/bar");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0);
+
+  auto* sample_event = proto.add_events()->mutable_sample_event();
+  sample_event->set_ip(0x1100);
+  sample_event->set_pid(100);
+  sample_event->set_tid(100);
+  sample_event->set_addr(0x1200);
+  sample_event->set_period(1);
+  sample_event->set_id(file_attr_id);
+
+  // The streamed events only live for the duration of each call, and the
+  // metadata proto passed to the stream has no events at all.
+  quipper::PerfDataProto metadata = proto;
+  metadata.clear_events();
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  std::unique_ptr<PerfDataHandler::EventStream> stream =
+      PerfDataHandler::CreateEventStream(metadata, &handler);
+  for (const auto& event : proto.events()) {
+    std::unique_ptr<quipper::PerfDataProto::PerfEvent> streamed_event(
+        new quipper::PerfDataProto::PerfEvent(event));
+    stream->ProcessEvent(*streamed_event);
+  }
+  stream->Finish();
+
+  const auto& sample_events = handler.SeenSampleEvents();
+  ASSERT_EQ(1u, sample_events.size());
+  EXPECT_EQ(0x1100, sample_events[0].ip());
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(1u, addr_mappings.size());
+  ASSERT_TRUE(addr_mappings[0] != nullptr);
+  EXPECT_EQ("/foo/bar", addr_mappings[0]->filename());
+  EXPECT_EQ(0x1000, addr_mappings[0]->start);
+  EXPECT_EQ(0x2000, addr_mappings[0]->limit);
+}
+
+TEST(PerfDataHandlerTest, ProcessesSampleColumnsInPlace) {
+  quipper::PerfDataProto proto;
+
+  // File attrs are required for sample event processing.
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  auto* comm_event = proto.add_events()->mutable_comm_event();
+  comm_event->set_comm("bar");
+  comm_event->set_pid(100);
+  comm_event->set_tid(100);
+
+  auto mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("/foo/bar");
+  mmap_event->set_pid(100);
+  mmap_event->set_tid(100);
+  mmap_event->set_start(0x1000);
+  mmap_event->set_len(0x1000);
+  mmap_event->set_pgoff(0);
+
+  // The first sample precedes the mmap, the second one follows it.
+  quipper::SampleColumns samples;
+  for (size_t event_index : {1, 2}) {
+    quipper::PerfDataProto::PerfEvent event;
+    event.mutable_header()->set_type(quipper::PERF_RECORD_SAMPLE);
+    auto* sample_event = event.mutable_sample_event();
+    sample_event->set_ip(0x1000 + 0x100 * event_index);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    sample_event->set_addr(0x1200);
+    sample_event->set_period(1);
+    sample_event->set_id(file_attr_id);
+    ASSERT_TRUE(quipper::SampleColumns::CanStore(event));
+    samples.Append(event, event_index);
+  }
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, samples, &handler);
+
+  const auto& sample_events = handler.SeenSampleEvents();
+  ASSERT_EQ(2u, sample_events.size());
+  EXPECT_EQ(0x1100, sample_events[0].ip());
+  EXPECT_EQ(0x1200, sample_events[1].ip());
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(2u, addr_mappings.size());
+  EXPECT_EQ(nullptr, addr_mappings[0]);
+  ASSERT_TRUE(addr_mappings[1] != nullptr);
+  EXPECT_EQ("/foo/bar", addr_mappings[1]->filename());
+}
+
 TEST(PerfDataHandlerTest, SpeAuxtraceIntoSamples) {
   quipper::PerfDataProto proto;
 
@@ -591,6 +1250,70 @@ TEST(PerfDataHandlerTest, SpeAuxtraceIntoSamples) {
   EXPECT_EQ(spe_records[0].translation_lat, 1);
   EXPECT_EQ(spe_records[1].total_lat, 17);
   EXPECT_EQ(spe_records[1].issue_lat, 16);
+
+  // Only the samples of the records the filter keeps are handled.
+  quipper::ArmSpeDecoder::RecordFilter filter;
+  filter.ops = quipper::ArmSpeDecoder::kOpLoadStore;
+  TestPerfDataHandler filtered_handler(
+      {}, std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &filtered_handler, 1, filter);
+  ASSERT_EQ(filtered_handler.SeenSampleEvents().size(), 1);
+  EXPECT_EQ(filtered_handler.SeenSampleEvents()[0].pid(), 1);
+  ASSERT_EQ(filtered_handler.SeenArmSpeRecords().size(), 1);
+  EXPECT_EQ(filtered_handler.SeenArmSpeRecords()[0].total_lat, 12);
+
+  // The trace data can be left in the perf data the proto was read from.
+  const std::string perf_data = "PERFILE2" + trace_data;
+  auxtrace_event->clear_trace_data();
+  auxtrace_event->set_size(trace_data.size());
+  auxtrace_event->set_trace_data_offset(8);
+  TestPerfDataHandler referenced_handler(
+      {{}, expected_br_entries},
+      std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &referenced_handler, 1, {}, nullptr,
+                           perf_data);
+  ASSERT_EQ(referenced_handler.SeenArmSpeRecords().size(), 2);
+  EXPECT_EQ(referenced_handler.SeenArmSpeRecords()[1].total_lat, 17);
+}
+
+// Decoding the SPE buffers on several threads gives the samples of decoding
+// them one at a time, in the same order.
+TEST(PerfDataHandlerTest, SpeAuxtraceOnThreads) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  proto.add_events()->mutable_auxtrace_info_event()->set_type(
+      quipper::PERF_AUXTRACE_ARM_SPE);
+  for (int i = 0; i < 50; ++i) {
+    auto* comm = proto.add_events()->mutable_comm_event();
+    comm->set_tid(0x100 + i);
+    comm->set_pid(1 + i);
+    std::string trace_data = quipper::GenerateBinaryTrace({
+        "b0 d0 c2 a1 ed 66 ba ff c0",  // PC 0xffba66eda1c2d0 el2 ns=1
+        "65 0" + std::to_string(i % 10) + " 01 00 00",  // CONTEXT 0x10i el2
+        "49 00",                       // LD GP-REG
+        "98 0c 00",                    // LAT 12 TOT
+        "71 2e 65 2f 6a 0a 00 00 00",  // TS 44731163950
+    });
+    // Buffers with one and with two records.
+    if (i % 3 == 0) trace_data += trace_data;
+    proto.add_events()->mutable_auxtrace_event()->set_trace_data(trace_data);
+  }
+
+  TestPerfDataHandler serial_handler(
+      {}, std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &serial_handler);
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler, 4);
+
+  const auto& sample_events = handler.SeenSampleEvents();
+  ASSERT_EQ(sample_events.size(), 67);
+  ASSERT_EQ(sample_events.size(), serial_handler.SeenSampleEvents().size());
+  for (size_t i = 0; i < sample_events.size(); ++i) {
+    EXPECT_EQ(sample_events[i].SerializeAsString(),
+              serial_handler.SeenSampleEvents()[i].SerializeAsString());
+  }
+  EXPECT_EQ(handler.SeenArmSpeRecords().size(), 67);
 }
 
 TEST(PerfDataHandlerTest, KsymbolIntoMappings) {
@@ -617,6 +1340,49 @@ TEST(PerfDataHandlerTest, KsymbolIntoMappings) {
   handler.CheckSeenFilenames();
 }
 
+// The BPF programs are mapped in the kernel's address space, over the kernel
+// mapping they are in, so they are found from any process.
+TEST(PerfDataHandlerTest, KsymbolsAreKernelMappings) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  auto* mmap_event = proto.add_events()->mutable_mmap_event();
+  mmap_event->set_filename("[kernel.kallsyms]_text");
+  mmap_event->set_pid(std::numeric_limits<uint32_t>::max());
+  mmap_event->set_tid(std::numeric_limits<uint32_t>::max());
+  mmap_event->set_start(0xffff0000);
+  mmap_event->set_len(0x10000);
+  mmap_event->set_pgoff(0);
+  for (int i = 1; i <= 2; ++i) {
+    auto* ksymbol_event = proto.add_events()->mutable_ksymbol_event();
+    ksymbol_event->set_addr(0xffff0000 + i * 0x1000);
+    ksymbol_event->set_len(0x800);
+    ksymbol_event->set_ksym_type(quipper::PERF_RECORD_KSYMBOL_TYPE_BPF);
+    ksymbol_event->set_flags(0);
+    ksymbol_event->set_name("bpf_prog_" + std::to_string(i));
+  }
+  for (uint64_t addr : {0xffff1010, 0xffff2010, 0xffff1900}) {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(0x1010);
+    sample_event->set_pid(100);
+    sample_event->set_tid(100);
+    sample_event->set_addr(addr);
+    sample_event->set_period(1);
+    sample_event->set_id(0);
+  }
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  auto& addr_mappings = handler.SeenAddrMappings();
+  ASSERT_EQ(3u, addr_mappings.size());
+  const char* const kFilenames[] = {"bpf_prog_1", "bpf_prog_2",
+                                    "[kernel.kallsyms]_text"};
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_NE(nullptr, addr_mappings[i]);
+    EXPECT_EQ(kFilenames[i], addr_mappings[i]->filename());
+  }
+}
+
 }  // namespace perftools
 
 int main(int argc, char** argv) {
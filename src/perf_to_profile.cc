@@ -11,11 +11,13 @@
 #include "src/perf_data_converter.h"
 
 int main(int argc, char** argv) {
-  std::string input, output;
+  std::vector<std::string> inputs;
+  std::string output;
   bool overwriteOutput = false;
   bool allowUnalignedJitMappings = false;
-  if (!ParseArguments(argc, const_cast<const char**>(argv), &input, &output,
-                      &overwriteOutput, &allowUnalignedJitMappings)) {
+  BatchOptions batch;
+  if (!ParseArguments(argc, const_cast<const char**>(argv), &inputs, &output,
+                      &overwriteOutput, &allowUnalignedJitMappings, &batch)) {
     PrintUsage();
     return EXIT_FAILURE;
   }
@@ -24,17 +26,40 @@ int main(int argc, char** argv) {
   if (allowUnalignedJitMappings) {
     options |= perftools::ConversionOptions::kAllowUnalignedJitMappings;
   }
-  std::string data = ReadFileToString(input);
-  const auto profiles = StringToProfiles(data, perftools::kNoLabels, options);
+  if (inputs.empty()) {
+    std::vector<BatchJob> jobs;
+    if (!ListBatchJobs(batch, &jobs)) {
+      return EXIT_FAILURE;
+    }
+    const size_t failed = RunBatchJobs(jobs, batch, options, overwriteOutput);
+    if (failed != 0) {
+      LOG(ERROR) << failed << " of " << jobs.size() << " inputs failed.";
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+  if (inputs.size() > 1) {
+    const auto merged = FilesToMergedProfile(
+        inputs, perftools::kNoLabels, options, NumThreads(batch.num_jobs));
+    if (merged == nullptr) {
+      LOG(FATAL) << "Failed to merge the profiles of the inputs.";
+    }
+    if (!WriteProfile(*merged, output, overwriteOutput)) {
+      LOG(FATAL) << "Failed to write the profile.";
+    }
+    return EXIT_SUCCESS;
+  }
+
+  const auto profiles =
+      FileToProfiles(inputs[0], perftools::kNoLabels, options);
 
   // With kNoOptions, all of the PID profiles should be merged into a
   // single one.
   if (profiles.size() != 1) {
     LOG(FATAL) << "Expected profile vector to have one element.";
   }
-  const auto& profile = profiles[0]->data;
-  std::ofstream outFile;
-  CreateFile(output, &outFile, overwriteOutput);
-  profile.SerializeToOstream(&outFile);
+  if (!WriteProfile(profiles[0]->data, output, overwriteOutput)) {
+    LOG(FATAL) << "Failed to write the profile.";
+  }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// End-to-end benchmark of RawPerfDataToProfiles(). Converts synthetic and
+// given perf.data files with combinations of sample labels and conversion
+// options, and writes the throughput, the peak RSS and the allocations of
+// each conversion, and of its read, parse and convert phases, as JSON. Each
+// conversion runs in a child process, so that its peak RSS is its own.
+//
+// With a baseline, i.e. the JSON written by an earlier run, the benchmark
+// fails if a conversion is slower than in the baseline by more than the
+// threshold.
+//
+// With -c, the benchmark also counts the cycles, instructions, cache misses,
+// branch misses and dTLB misses of the user space code of each conversion and
+// phase, as `perf stat` would, and writes them per sample and per event of the
+// input as well. The counts of the threads of a conversion are included once
+// the threads exit.
+//
+//   perf_to_profile_benchmark [-i <perf.data>]... [-o <output json>]
+//       [-b <baseline json>] [-t <threshold>] [-r <repetitions>]
+//       [-s <synthetic scale>] [-j <threads>] [-c]
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "src/perf_data_converter.h"
+#include "src/quipper/base/logging.h"
+#include "src/quipper/file_utils.h"
+#include "src/quipper/kernel/perf_internals.h"
+#include "src/quipper/perf_parser.h"
+#include "src/quipper/perf_reader.h"
+#include "src/quipper/synthetic_perf_data.h"
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocated_bytes{0};
+
+// Counts an allocation of |size| bytes aligned to |alignment|, and makes it
+// with malloc(), so that every form of operator delete can free() it.
+// Returns null if it fails.
+void* CountedAllocate(size_t size, size_t alignment) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (size == 0) size = 1;
+  if (alignment <= alignof(std::max_align_t)) return malloc(size);
+  void* ptr = nullptr;
+  return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+void* CountedAllocateOrThrow(size_t size, size_t alignment) {
+  void* ptr = CountedAllocate(size, alignment);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+// Frees what CountedAllocate() allocated.
+void CountedFree(void* ptr) { free(ptr); }
+
+}  // namespace
+
+// Counts the allocations of the conversions. All the replaceable forms are
+// replaced, so that none of them goes uncounted or is freed by a mismatched
+// form.
+void* operator new(size_t size) {
+  return CountedAllocateOrThrow(size, alignof(std::max_align_t));
+}
+void* operator new[](size_t size) {
+  return CountedAllocateOrThrow(size, alignof(std::max_align_t));
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+  return CountedAllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return CountedAllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, alignof(std::max_align_t));
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, alignof(std::max_align_t));
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr) noexcept { CountedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { CountedFree(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  CountedFree(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  CountedFree(ptr);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  CountedFree(ptr);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  CountedFree(ptr);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  CountedFree(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  CountedFree(ptr);
+}
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  CountedFree(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  CountedFree(ptr);
+}
+
+namespace perftools {
+namespace {
+
+struct Input {
+  std::string name;
+  std::string data;
+  // The number of PERF_RECORD_SAMPLE events in |data|.
+  uint64_t samples = 0;
+  // The number of events in |data|.
+  uint64_t events = 0;
+};
+
+// The hardware events counted with -c.
+struct CounterEvent {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+const CounterEvent kCounterEvents[] = {
+    {"cycles", quipper::PERF_TYPE_HARDWARE, quipper::PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", quipper::PERF_TYPE_HARDWARE,
+     quipper::PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", quipper::PERF_TYPE_HARDWARE,
+     quipper::PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", quipper::PERF_TYPE_HARDWARE,
+     quipper::PERF_COUNT_HW_BRANCH_MISSES},
+    {"dtlb_misses", quipper::PERF_TYPE_HW_CACHE,
+     quipper::PERF_COUNT_HW_CACHE_DTLB |
+         (quipper::PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (quipper::PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+constexpr int kNumCounters = sizeof(kCounterEvents) / sizeof(kCounterEvents[0]);
+
+// Counts kCounterEvents in the user space code of the calling process, and of
+// the threads it starts after Open().
+class HardwareCounters {
+ public:
+  HardwareCounters() { std::fill(fds_, fds_ + kNumCounters, -1); }
+  ~HardwareCounters() {
+    for (int fd : fds_) {
+      if (fd >= 0) close(fd);
+    }
+  }
+  HardwareCounters(const HardwareCounters&) = delete;
+  HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+  // Returns false if any of the events can't be counted, e.g. in VMs or
+  // sandboxes without hardware counters.
+  bool Open() {
+    for (int i = 0; i < kNumCounters; ++i) {
+      quipper::perf_event_attr attr = {};
+      attr.type = kCounterEvents[i].type;
+      attr.size = sizeof(attr);
+      attr.config = kCounterEvents[i].config;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fds_[i] < 0) {
+        PLOG(WARNING) << "Failed to open a counter of "
+                      << kCounterEvents[i].name;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Reads the counts since Open() to |counts|.
+  void Read(uint64_t counts[kNumCounters]) const {
+    for (int i = 0; i < kNumCounters; ++i) {
+      if (read(fds_[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+        counts[i] = 0;
+      }
+    }
+  }
+
+ private:
+  int fds_[kNumCounters];
+};
+
+// The time and allocations of a phase of a conversion, and with -c its
+// hardware event counts.
+struct Measurement {
+  double seconds = 0;
+  uint64_t allocations = 0;
+  uint64_t allocated_bytes = 0;
+  bool counted = false;
+  uint64_t counts[kNumCounters] = {};
+};
+
+// The measurements of a conversion, written by the child process that runs it
+// to its parent.
+struct RunResult {
+  bool ok = false;
+  Measurement end_to_end;
+  Measurement read;
+  Measurement parse;
+  Measurement convert;
+  // The peak RSS of the end-to-end conversion, in bytes.
+  uint64_t peak_rss_bytes = 0;
+};
+
+struct Result {
+  std::string name;
+  const Input* input;
+  uint32_t labels;
+  uint32_t options;
+  RunResult best;
+};
+
+// Measures the time and allocations of a phase, and its counts of |counters|
+// if not null, from its construction to Stop().
+class PhaseTimer {
+ public:
+  PhaseTimer(Measurement* measurement, const HardwareCounters* counters)
+      : measurement_(measurement),
+        counters_(counters),
+        allocations_(allocations.load()),
+        allocated_bytes_(allocated_bytes.load()) {
+    if (counters_ != nullptr) counters_->Read(counts_);
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  void Stop() {
+    measurement_->seconds = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start_)
+                                .count();
+    if (counters_ != nullptr) {
+      uint64_t counts[kNumCounters];
+      counters_->Read(counts);
+      for (int i = 0; i < kNumCounters; ++i) {
+        measurement_->counts[i] = counts[i] - counts_[i];
+      }
+      measurement_->counted = true;
+    }
+    measurement_->allocations = allocations.load() - allocations_;
+    measurement_->allocated_bytes = allocated_bytes.load() - allocated_bytes_;
+  }
+
+ private:
+  Measurement* measurement_;
+  const HardwareCounters* counters_;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t counts_[kNumCounters] = {};
+  const uint64_t allocations_;
+  const uint64_t allocated_bytes_;
+};
+
+// Converts |input| as RawPerfDataToProfiles() does, one phase at a time.
+bool ConvertByPhase(const Input& input, uint32_t labels, uint32_t options,
+                    int num_threads, const HardwareCounters* counters,
+                    RunResult* result) {
+  PhaseTimer read_timer(&result->read, counters);
+  quipper::PerfReader reader(
+      quipper::PerfReader::ArenaOptionsForInputSize(input.data.size()));
+  if (num_threads > 1) reader.SetNumDecodeThreads(num_threads);
+  if (!reader.ReadFromPointer(input.data.data(), input.data.size())) {
+    return false;
+  }
+  read_timer.Stop();
+
+  PhaseTimer parse_timer(&result->parse, counters);
+  quipper::PerfParserOptions parser_options;
+  parser_options.sort_events_by_time = true;
+  parser_options.deduce_huge_page_mappings = true;
+  parser_options.combine_mappings = true;
+  parser_options.allow_unaligned_jit_mappings =
+      options & kAllowUnalignedJitMappings;
+  parser_options.map_events = false;
+  parser_options.num_threads = num_threads;
+  quipper::PerfParser parser(&reader, parser_options);
+  if (!parser.ParseRawEvents()) return false;
+  parse_timer.Stop();
+
+  PhaseTimer convert_timer(&result->convert, counters);
+  ConversionParams params;
+  params.sample_labels = labels;
+  params.options = options;
+  params.num_threads = num_threads;
+  const ProcessProfiles profiles =
+      PerfDataProtoToProfiles(&reader.proto(), params);
+  convert_timer.Stop();
+  return !profiles.empty();
+}
+
+// Runs the conversion of |input| in a child process, so that the peak RSS is
+// that of the conversion alone. With |count_hardware|, the child counts the
+// hardware events of the conversion, if it can.
+bool RunConversion(const Input& input, uint32_t labels, uint32_t options,
+                   int num_threads, bool count_hardware, RunResult* result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    PLOG(ERROR) << "Failed to create a pipe";
+    return false;
+  }
+  const pid_t pid = fork();
+  if (pid < 0) {
+    PLOG(ERROR) << "Failed to fork";
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    HardwareCounters hardware_counters;
+    const HardwareCounters* counters =
+        count_hardware && hardware_counters.Open() ? &hardware_counters
+                                                   : nullptr;
+    RunResult child_result;
+    ConversionParams params;
+    params.sample_labels = labels;
+    params.options = options;
+    params.num_threads = num_threads;
+    PhaseTimer timer(&child_result.end_to_end, counters);
+    const ProcessProfiles profiles = RawPerfDataToProfiles(
+        input.data.data(), input.data.size(), {}, params);
+    timer.Stop();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    child_result.peak_rss_bytes = static_cast<uint64_t>(usage.ru_maxrss) << 10;
+    child_result.ok =
+        !profiles.empty() &&
+        ConvertByPhase(input, labels, options, num_threads, counters,
+                       &child_result);
+    const bool written = write(fds[1], &child_result, sizeof(child_result)) ==
+                         sizeof(child_result);
+    _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  close(fds[1]);
+  const bool read_ok =
+      read(fds[0], result, sizeof(*result)) == sizeof(*result);
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return read_ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+         result->ok;
+}
+
+// Keeps the fastest of the runs, and the highest peak RSS.
+void KeepBest(const RunResult& run, RunResult* best) {
+  const uint64_t peak_rss_bytes =
+      std::max(run.peak_rss_bytes, best->peak_rss_bytes);
+  if (!best->ok || run.end_to_end.seconds < best->end_to_end.seconds) {
+    *best = run;
+  }
+  best->peak_rss_bytes = peak_rss_bytes;
+}
+
+void CountEvents(Input* input) {
+  quipper::PerfReader reader;
+  if (!reader.ReadFromString(input->data)) return;
+  input->events = reader.events().size();
+  for (const auto& event : reader.events()) {
+    input->samples += event.header().type() == quipper::PERF_RECORD_SAMPLE;
+  }
+}
+
+// Returns the synthetic inputs, with about |scale| times 100000 samples.
+std::vector<Input> SyntheticInputs(double scale) {
+  using quipper::testing::SyntheticPerfDataOptions;
+  std::vector<std::pair<std::string, SyntheticPerfDataOptions>> shapes;
+  SyntheticPerfDataOptions options;
+  options.num_samples = 100000 * scale;
+  shapes.emplace_back("synthetic", options);
+
+  auto churn = options;
+  churn.num_processes = 200;
+  churn.churn_rate = 0.001;
+  churn.jit_regions_per_process = 4;
+  churn.lost_rate = 0.001;
+  shapes.emplace_back("synthetic-churn", churn);
+
+  auto deep = options;
+  deep.min_stack_depth = 32;
+  deep.max_stack_depth = 256;
+  shapes.emplace_back("synthetic-deep", deep);
+
+  auto lbr = options;
+  lbr.branch_stack_entries = 32;
+  shapes.emplace_back("synthetic-lbr", lbr);
+
+  auto spe = options;
+  spe.num_samples /= 2;
+  spe.spe_records_per_sample = 2;
+  shapes.emplace_back("synthetic-spe", spe);
+
+  std::vector<Input> inputs;
+  for (const auto& shape : shapes) {
+    std::stringstream out;
+    CHECK(quipper::testing::WriteSyntheticPerfData(shape.second, &out));
+    inputs.push_back({shape.first, out.str()});
+  }
+  return inputs;
+}
+
+std::string Fixed(double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.6g", value);
+  return buf;
+}
+
+// Returns the hardware event counts of |measurement|, if any, as JSON fields,
+// also divided by the samples and the events of |input|.
+std::string CountsJson(const Measurement& measurement, const Input& input) {
+  if (!measurement.counted) return "";
+  std::string counts, per_sample, per_event;
+  for (int i = 0; i < kNumCounters; ++i) {
+    const std::string name =
+        std::string(i > 0 ? ", " : "") + "\"" + kCounterEvents[i].name + "\": ";
+    const double count = measurement.counts[i];
+    counts += name + std::to_string(measurement.counts[i]);
+    per_sample += name + Fixed(input.samples > 0 ? count / input.samples : 0);
+    per_event += name + Fixed(input.events > 0 ? count / input.events : 0);
+  }
+  return ", \"counts\": {" + counts + "}, \"counts_per_sample\": {" +
+         per_sample + "}, \"counts_per_event\": {" + per_event + "}";
+}
+
+std::string MeasurementJson(const Measurement& measurement,
+                            const Input& input) {
+  return "{\"seconds\": " + Fixed(measurement.seconds) +
+         ", \"allocations\": " + std::to_string(measurement.allocations) +
+         ", \"allocated_bytes\": " +
+         std::to_string(measurement.allocated_bytes) +
+         CountsJson(measurement, input) + "}";
+}
+
+double SamplesPerSecond(const Result& result) {
+  return result.input->samples / result.best.end_to_end.seconds;
+}
+
+// Writes each result on its own line, which ReadBaseline() relies on.
+void WriteJson(const std::vector<Result>& results, std::ostream* out) {
+  *out << "{\"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    const RunResult& best = result.best;
+    *out << "  {\"name\": \"" << result.name << "\", \"input_bytes\": "
+         << result.input->data.size()
+         << ", \"samples\": " << result.input->samples
+         << ", \"labels\": " << result.labels
+         << ", \"options\": " << result.options
+         << ", \"seconds\": " << Fixed(best.end_to_end.seconds)
+         << ", \"samples_per_second\": " << Fixed(SamplesPerSecond(result))
+         << ", \"megabytes_per_second\": "
+         << Fixed(result.input->data.size() / 1e6 / best.end_to_end.seconds)
+         << ", \"peak_rss_bytes\": " << best.peak_rss_bytes
+         << ", \"allocations\": " << best.end_to_end.allocations
+         << ", \"allocated_bytes\": " << best.end_to_end.allocated_bytes
+         << CountsJson(best.end_to_end, *result.input)
+         << ", \"phases\": {\"read\": "
+         << MeasurementJson(best.read, *result.input)
+         << ", \"parse\": " << MeasurementJson(best.parse, *result.input)
+         << ", \"convert\": " << MeasurementJson(best.convert, *result.input)
+         << "}}"
+         << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  *out << "]}\n";
+}
+
+// Reads the samples per second of each benchmark of a JSON file written by
+// WriteJson().
+bool ReadBaseline(const std::string& filename,
+                  std::map<std::string, double>* samples_per_second) {
+  std::ifstream in(filename);
+  if (!in) {
+    LOG(ERROR) << "Failed to open the baseline " << filename;
+    return false;
+  }
+  const std::string kName = "{\"name\": \"";
+  const std::string kSamplesPerSecond = "\"samples_per_second\": ";
+  std::string line;
+  while (std::getline(in, line)) {
+    const size_t name = line.find(kName);
+    const size_t value = line.find(kSamplesPerSecond);
+    if (name == std::string::npos || value == std::string::npos) continue;
+    const size_t name_start = name + kName.size();
+    const size_t name_end = line.find('"', name_start);
+    (*samples_per_second)[line.substr(name_start, name_end - name_start)] =
+        strtod(line.c_str() + value + kSamplesPerSecond.size(), nullptr);
+  }
+  return true;
+}
+
+// Returns the number of results that are slower than in the baseline by more
+// than |threshold|, a fraction.
+int CountRegressions(const std::vector<Result>& results,
+                     const std::map<std::string, double>& baseline,
+                     double threshold) {
+  int regressions = 0;
+  for (const Result& result : results) {
+    const auto it = baseline.find(result.name);
+    if (it == baseline.end()) continue;
+    const double current = SamplesPerSecond(result);
+    if (current < it->second * (1 - threshold)) {
+      LOG(ERROR) << result.name << " regressed: " << current
+                 << " samples/s, down from " << it->second;
+      ++regressions;
+    }
+  }
+  return regressions;
+}
+
+struct Flags {
+  std::vector<std::string> inputs;
+  std::string output;
+  std::string baseline;
+  double threshold = 0.1;
+  int repetitions = 3;
+  double scale = 1;
+  int num_threads = 1;
+  bool count_hardware = false;
+};
+
+bool ParseFlags(int argc, char* argv[], Flags* flags) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:b:t:r:s:j:c")) != -1) {
+    switch (opt) {
+      case 'i':
+        flags->inputs.push_back(optarg);
+        break;
+      case 'o':
+        flags->output = optarg;
+        break;
+      case 'b':
+        flags->baseline = optarg;
+        break;
+      case 't':
+        flags->threshold = atof(optarg);
+        break;
+      case 'r':
+        flags->repetitions = atoi(optarg);
+        break;
+      case 's':
+        flags->scale = atof(optarg);
+        break;
+      case 'j':
+        flags->num_threads = atoi(optarg);
+        break;
+      case 'c':
+        flags->count_hardware = true;
+        break;
+      default:
+        return false;
+    }
+  }
+  return optind == argc && flags->repetitions > 0 && flags->scale >= 0 &&
+         flags->num_threads > 0;
+}
+
+int Run(int argc, char* argv[]) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
+    LOG(ERROR) << "Usage: " << argv[0]
+               << " [-i <perf.data>]... [-o <output json>]"
+               << " [-b <baseline json>] [-t <threshold>]"
+               << " [-r <repetitions>] [-s <synthetic scale>] [-j <threads>]"
+               << " [-c]";
+    return EXIT_FAILURE;
+  }
+  std::map<std::string, double> baseline;
+  if (!flags.baseline.empty() && !ReadBaseline(flags.baseline, &baseline)) {
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Input> inputs;
+  if (flags.scale > 0) inputs = SyntheticInputs(flags.scale);
+  for (const std::string& filename : flags.inputs) {
+    std::vector<char> data;
+    if (!quipper::FileToBuffer(filename, &data)) {
+      LOG(ERROR) << "Failed to read " << filename;
+      return EXIT_FAILURE;
+    }
+    inputs.push_back({filename, std::string(data.begin(), data.end())});
+  }
+  for (Input& input : inputs) CountEvents(&input);
+
+  const uint32_t kLabels[] = {
+      kNoLabels, kPidAndTidLabels,
+      kPidAndTidLabels | kTimestampNsLabel | kCommLabel | kThreadCommLabel};
+  const uint32_t kOptions[] = {kNoOptions, kGroupByPids,
+                               kGroupByPids | kMarshalProfiles};
+  std::vector<Result> results;
+  bool ok = true;
+  for (const Input& input : inputs) {
+    for (uint32_t labels : kLabels) {
+      for (uint32_t options : kOptions) {
+        Result result{input.name + "/labels:" + std::to_string(labels) +
+                          "/options:" + std::to_string(options),
+                      &input, labels, options};
+        for (int i = 0; i < flags.repetitions; ++i) {
+          RunResult run;
+          if (!RunConversion(input, labels, options, flags.num_threads,
+                             flags.count_hardware, &run)) {
+            LOG(ERROR) << "Failed to convert " << result.name;
+            ok = false;
+            break;
+          }
+          KeepBest(run, &result.best);
+        }
+        if (result.best.ok) results.push_back(result);
+      }
+    }
+  }
+
+  if (flags.output.empty()) {
+    WriteJson(results, &std::cout);
+  } else {
+    std::ofstream out(flags.output);
+    WriteJson(results, &out);
+    if (!out) {
+      LOG(ERROR) << "Failed to write " << flags.output;
+      return EXIT_FAILURE;
+    }
+  }
+  if (CountRegressions(results, baseline, flags.threshold) > 0) ok = false;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace
+}  // namespace perftools
+
+int main(int argc, char* argv[]) { return perftools::Run(argc, argv); }
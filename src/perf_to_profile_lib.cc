@@ -7,8 +7,24 @@
 
 #include "src/perf_to_profile_lib.h"
 
+#include <byteswap.h>
+#include <dirent.h>
+#include <errno.h>
 #include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <utility>
+
+#include "src/builder.h"
+#include "src/profile_merger.h"
+#include "src/quipper/kernel/perf_internals.h"
+#include "src/quipper/mmap_data_reader.h"
+#include "src/quipper/perf_reader.h"
 
 bool FileExists(const std::string& path) {
   struct stat file_stat;
@@ -16,27 +32,317 @@ bool FileExists(const std::string& path) {
 }
 
 std::string ReadFileToString(const std::string& path) {
-  std::ifstream perf_file(path);
+  std::ifstream perf_file(path, std::ios::binary | std::ios::ate);
   if (!perf_file.is_open()) {
-    LOG(FATAL) << "Failed to open file: " << path;
+    LOG(ERROR) << "Failed to open file: " << path;
+    return "";
   }
+  // Read the file straight into the string, when its size is known.
+  const std::streamoff size = perf_file.tellg();
+  if (size >= 0 && perf_file.seekg(0)) {
+    std::string data(size, '\0');
+    if (perf_file.read(&data[0], size)) return data;
+  }
+  perf_file.clear();
+  perf_file.seekg(0);
   std::ostringstream ss;
   ss << perf_file.rdbuf();
   return ss.str();
 }
 
+bool IsRawPerfData(const char* data, size_t size) {
+  // The header of a perf.data file and the one of piped perf data both start
+  // with the magic.
+  uint64_t magic;
+  if (size < sizeof(magic)) return false;
+  std::memcpy(&magic, data, sizeof(magic));
+  return magic == quipper::kPerfMagic || magic == bswap_64(quipper::kPerfMagic);
+}
+
 perftools::ProcessProfiles StringToProfiles(const std::string& data,
                                             uint32_t sample_labels,
                                             uint32_t options) {
-  // Try to parse it as a PerfDataProto.
-  quipper::PerfDataProto perf_data_proto;
-  if (perf_data_proto.ParseFromArray(data.data(), data.length())) {
-    return perftools::PerfDataProtoToProfiles(&perf_data_proto, sample_labels,
-                                              options);
+  return DataToProfiles(data.data(), data.size(), sample_labels, options);
+}
+
+perftools::ProcessProfiles DataToProfiles(const char* data, size_t size,
+                                          uint32_t sample_labels,
+                                          uint32_t options) {
+  if (!IsRawPerfData(data, size)) {
+    // Try to parse it as a PerfDataProto, on an arena so that its millions of
+    // messages are freed at once.
+    google::protobuf::Arena arena;
+    auto* perf_data_proto =
+        google::protobuf::Arena::Create<quipper::PerfDataProto>(&arena);
+    if (perf_data_proto->ParseFromArray(data, size)) {
+      quipper::PerfSerializer::ExpandCallchains(perf_data_proto);
+      return perftools::PerfDataProtoToProfiles(perf_data_proto,
+                                                sample_labels, options);
+    }
+  }
+  // Fallback to reading input as a perf.data file, which also reports why
+  // input that is neither can't be read.
+  return perftools::RawPerfDataToProfiles(data, size, {}, sample_labels,
+                                          options);
+}
+
+namespace {
+
+// Reads up to |size| bytes from |fd| into |buffer|. Returns the number of
+// bytes read, 0 at the end of the input, or -1 on errors.
+ssize_t ReadSome(int fd, char* buffer, size_t size) {
+  ssize_t ret;
+  while ((ret = read(fd, buffer, size)) < 0 && errno == EINTR) {
+  }
+  if (ret < 0) PLOG(ERROR) << "Failed to read the input";
+  return ret;
+}
+
+// Returns whether the |size| bytes at |data| start with the header of piped
+// perf data.
+bool IsPipedPerfData(const char* data, size_t size) {
+  quipper::perf_pipe_file_header header;
+  if (size < sizeof(header) || !IsRawPerfData(data, size)) return false;
+  std::memcpy(&header, data, sizeof(header));
+  return header.size == sizeof(header) ||
+         bswap_64(header.size) == sizeof(header);
+}
+
+}  // namespace
+
+perftools::ProcessProfiles FdToProfiles(int fd, uint32_t sample_labels,
+                                        uint32_t options) {
+  constexpr size_t kReadSize = 1 << 20;
+  std::string data;
+  size_t size = 0;
+  ssize_t ret = 1;
+  // Read enough to tell piped perf data apart.
+  while (size < sizeof(quipper::perf_pipe_file_header) && ret > 0) {
+    data.resize(size + kReadSize);
+    ret = ReadSome(fd, &data[size], kReadSize);
+    size += std::max<ssize_t>(ret, 0);
+  }
+  if (ret < 0) return perftools::ProcessProfiles();
+
+  if (IsPipedPerfData(data.data(), size)) {
+    quipper::PerfReader reader;
+    while (ret > 0) {
+      if (!reader.Feed(data.data(), size)) return perftools::ProcessProfiles();
+      ret = ReadSome(fd, &data[0], kReadSize);
+      size = std::max<ssize_t>(ret, 0);
+    }
+    if (ret < 0 || !reader.Finish()) return perftools::ProcessProfiles();
+    perftools::ConversionParams params;
+    params.sample_labels = sample_labels;
+    params.options = options;
+    return perftools::PerfReaderToProfiles(&reader, {}, params);
+  }
+
+  while (ret > 0) {
+    data.resize(size + kReadSize);
+    ret = ReadSome(fd, &data[size], kReadSize);
+    size += std::max<ssize_t>(ret, 0);
+  }
+  if (ret < 0) return perftools::ProcessProfiles();
+  data.resize(size);
+  return StringToProfiles(data, sample_labels, options);
+}
+
+perftools::ProcessProfiles FileToProfiles(const std::string& path,
+                                          uint32_t sample_labels,
+                                          uint32_t options) {
+  if (path == "-") return FdToProfiles(STDIN_FILENO, sample_labels, options);
+  quipper::MmapDataReader reader(path);
+  if (!reader.IsMapped()) {
+    // E.g. an empty file, or one that can't be mapped, like a pipe.
+    return StringToProfiles(ReadFileToString(path), sample_labels, options);
+  }
+  return DataToProfiles(
+      static_cast<const char*>(reader.GetContiguousData(0, reader.size())),
+      reader.size(), sample_labels, options);
+}
+
+std::unique_ptr<perftools::profiles::Profile> FilesToMergedProfile(
+    const std::vector<std::string>& paths, uint32_t sample_labels,
+    uint32_t options, int num_threads) {
+  // The converted profiles of each path, until they are merged. The threads
+  // don't get further ahead of the merge than a few paths each, to bound
+  // the memory taken by the profiles waiting for their turn.
+  const size_t max_pending = 2 * std::max(num_threads, 1);
+  std::vector<perftools::ProcessProfiles> converted(paths.size());
+  std::vector<bool> is_converted(paths.size(), false);
+  size_t next = 0;
+  size_t num_merged = 0;
+  std::mutex mutex;
+  std::condition_variable cond;
+  auto convert = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cond.wait(lock, [&]() {
+        return next >= paths.size() || next < num_merged + max_pending;
+      });
+      const size_t i = next++;
+      if (i >= paths.size()) return;
+      lock.unlock();
+      perftools::ProcessProfiles profiles =
+          FileToProfiles(paths[i], sample_labels, options);
+      lock.lock();
+      converted[i] = std::move(profiles);
+      is_converted[i] = true;
+      cond.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(num_threads, 1); ++i) {
+    threads.emplace_back(convert);
+  }
+
+  perftools::profiles::ProfileMerger merger;
+  bool ok = true;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    perftools::ProcessProfiles profiles;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&]() { return is_converted[i]; });
+      profiles = std::move(converted[i]);
+    }
+    if (profiles.empty()) {
+      LOG(ERROR) << "Failed to convert " << paths[i];
+      ok = false;
+    }
+    for (const auto& profile : profiles) {
+      if (!merger.Add(profile->data)) {
+        LOG(ERROR) << "Failed to merge a profile of " << paths[i];
+        ok = false;
+      }
+    }
+    profiles.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    ++num_merged;
+    cond.notify_all();
   }
-  // Fallback to reading input as a perf.data file.
-  return perftools::RawPerfDataToProfiles(data.data(), data.length(), {},
-                                          sample_labels, options);
+  for (auto& thread : threads) thread.join();
+  if (!ok) return nullptr;
+  return merger.Consume();
+}
+
+bool ListBatchJobs(const BatchOptions& batch, std::vector<BatchJob>* jobs) {
+  jobs->clear();
+  if (!batch.manifest.empty()) {
+    std::ifstream manifest(batch.manifest);
+    if (!manifest.is_open()) {
+      LOG(ERROR) << "Failed to open manifest: " << batch.manifest;
+      return false;
+    }
+    std::string line;
+    while (std::getline(manifest, line)) {
+      std::istringstream fields(line);
+      BatchJob job;
+      if (!(fields >> job.input)) continue;  // Blank line.
+      if (!(fields >> job.output)) {
+        LOG(ERROR) << "No output for input " << job.input << " in manifest "
+                   << batch.manifest;
+        return false;
+      }
+      jobs->push_back(std::move(job));
+    }
+    return true;
+  }
+
+  DIR* dir = opendir(batch.input_dir.c_str());
+  if (dir == nullptr) {
+    LOG(ERROR) << "Failed to open directory: " << batch.input_dir;
+    return false;
+  }
+  while (const struct dirent* entry = readdir(dir)) {
+    const std::string input = batch.input_dir + "/" + entry->d_name;
+    struct stat file_stat;
+    if (stat(input.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+    jobs->push_back(
+        {input, batch.output_dir + "/" + entry->d_name + ".pb"});
+  }
+  closedir(dir);
+  std::sort(jobs->begin(), jobs->end(),
+            [](const BatchJob& a, const BatchJob& b) {
+              return a.input < b.input;
+            });
+  return true;
+}
+
+namespace {
+
+// Converts the input of |job| and writes its profile. Returns false on errors.
+bool RunBatchJob(const BatchJob& job, uint32_t options,
+                 bool overwrite_output) {
+  if (!FileExists(job.input)) {
+    LOG(ERROR) << "Input doesn't exist: " << job.input;
+    return false;
+  }
+  if (!overwrite_output && FileExists(job.output)) {
+    LOG(ERROR) << "File already exists: " << job.output;
+    return false;
+  }
+  const auto profiles =
+      FileToProfiles(job.input, perftools::kNoLabels, options);
+  if (profiles.size() != 1) {
+    LOG(ERROR) << "Failed to convert " << job.input;
+    return false;
+  }
+  std::ofstream file(job.output, std::ios_base::trunc);
+  if (!profiles[0]->data.SerializeToOstream(&file) || !file.flush()) {
+    LOG(ERROR) << "Failed to write " << job.output;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+size_t RunBatchJobs(const std::vector<BatchJob>& jobs,
+                    const BatchOptions& batch, uint32_t options,
+                    bool overwrite_output) {
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t next = 0;
+  // The total size of the inputs being converted.
+  uint64_t pending_bytes = 0;
+  size_t num_failed = 0;
+  auto run = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (next < jobs.size()) {
+      const BatchJob& job = jobs[next++];
+      struct stat file_stat;
+      const uint64_t size =
+          stat(job.input.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+      cond.wait(lock, [&]() {
+        return batch.max_input_bytes == 0 || pending_bytes == 0 ||
+               pending_bytes + size <= batch.max_input_bytes;
+      });
+      pending_bytes += size;
+      lock.unlock();
+      const bool ok = RunBatchJob(job, options, overwrite_output);
+      lock.lock();
+      pending_bytes -= size;
+      num_failed += !ok;
+      cond.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  const int num_threads = NumThreads(batch.num_jobs);
+  for (int i = 1; i < num_threads && static_cast<size_t>(i) < jobs.size();
+       ++i) {
+    threads.emplace_back(run);
+  }
+  run();
+  for (auto& thread : threads) thread.join();
+  return num_failed;
+}
+
+int NumThreads(int num_jobs) {
+  if (num_jobs > 0) return num_jobs;
+  return std::max(1u, std::thread::hardware_concurrency());
 }
 
 void CreateFile(const std::string& path, std::ofstream* file,
@@ -50,28 +356,57 @@ void CreateFile(const std::string& path, std::ofstream* file,
   }
 }
 
+bool WriteProfile(const perftools::profiles::Profile& profile,
+                  const std::string& path, bool overwrite_output) {
+  if (path == "-") {
+    return perftools::profiles::Builder::MarshalToFile(profile, STDOUT_FILENO);
+  }
+  std::ofstream file;
+  CreateFile(path, &file, overwrite_output);
+  return profile.SerializeToOstream(&file) && file.flush();
+}
+
 void PrintUsage() {
   LOG(INFO) << "Usage:";
-  LOG(INFO) << "perf_to_profile -i <input perf data> -o <output profile> [-f]";
+  LOG(INFO) << "perf_to_profile -i <input perf data> [-i <input perf data>...] "
+            << "-o <output profile> [-f]";
+  LOG(INFO) << "If the -i option is given several times, merge the profiles "
+            << "of all the inputs into one.";
+  LOG(INFO) << "An input of - is read from the standard input, piped perf "
+            << "data as it arrives, and an output of - is written, "
+            << "gzipped, to the standard output.";
   LOG(INFO) << "If the -f option is given, overwrite the existing output "
             << "profile.";
   LOG(INFO) << "If the -j option is given, allow unaligned MMAP events "
             << "required by perf data from VMs with JITs.";
+  LOG(INFO) << "perf_to_profile -I <input dir> -O <output dir> [-f] [-j] "
+            << "[-n <jobs>] [-m <MiB>]";
+  LOG(INFO) << "perf_to_profile -l <manifest> [-f] [-j] [-n <jobs>] "
+            << "[-m <MiB>]";
+  LOG(INFO) << "Convert, in one run, every file of the input directory to "
+            << "the profile of the same name with a .pb suffix in the output "
+            << "directory, or every input listed in the manifest, along with "
+            << "its output, on each line.";
+  LOG(INFO) << "The -n option sets the number of inputs converted at once, "
+            << "as many as there are CPUs by default, and the -m option "
+            << "limits their total size.";
 }
 
-bool ParseArguments(int argc, const char* argv[], std::string* input,
-                    std::string* output, bool* overwrite_output,
-                    bool* allow_unaligned_jit_mappings) {
-  *input = "";
+bool ParseArguments(int argc, const char* argv[],
+                    std::vector<std::string>* inputs, std::string* output,
+                    bool* overwrite_output,
+                    bool* allow_unaligned_jit_mappings, BatchOptions* batch) {
+  inputs->clear();
+  *batch = BatchOptions();
   *output = "";
   *overwrite_output = false;
   *allow_unaligned_jit_mappings = false;
   int opt;
-  while ((opt = getopt(argc, const_cast<char* const*>(argv), ":jfi:o:")) !=
-         -1) {
+  while ((opt = getopt(argc, const_cast<char* const*>(argv),
+                       ":jfi:o:I:O:l:n:m:")) != -1) {
     switch (opt) {
       case 'i':
-        *input = optarg;
+        inputs->push_back(optarg);
         break;
       case 'o':
         *output = optarg;
@@ -82,6 +417,25 @@ bool ParseArguments(int argc, const char* argv[], std::string* input,
       case 'j':
         *allow_unaligned_jit_mappings = true;
         break;
+      case 'I':
+        batch->input_dir = optarg;
+        break;
+      case 'O':
+        batch->output_dir = optarg;
+        break;
+      case 'l':
+        batch->manifest = optarg;
+        break;
+      case 'n':
+        batch->num_jobs = atoi(optarg);
+        if (batch->num_jobs <= 0) {
+          LOG(ERROR) << "The number of jobs must be positive: " << optarg;
+          return false;
+        }
+        break;
+      case 'm':
+        batch->max_input_bytes = strtoull(optarg, nullptr, 10) << 20;
+        break;
       case ':':
         LOG(ERROR) << "Must provide arguments for flags -i and -o";
         return false;
@@ -93,5 +447,20 @@ bool ParseArguments(int argc, const char* argv[], std::string* input,
         return false;
     }
   }
-  return !input->empty() && !output->empty();
+  const bool has_batch_dirs =
+      !batch->input_dir.empty() || !batch->output_dir.empty();
+  if (has_batch_dirs || !batch->manifest.empty()) {
+    if (!inputs->empty() || !output->empty()) {
+      LOG(ERROR) << "Batch conversions don't take the -i and -o flags";
+      return false;
+    }
+    if (has_batch_dirs == !batch->manifest.empty()) {
+      LOG(ERROR) << "Must provide either a manifest or an input directory";
+      return false;
+    }
+    return batch->manifest.empty()
+               ? !batch->input_dir.empty() && !batch->output_dir.empty()
+               : true;
+  }
+  return !inputs->empty() && !output->empty();
 }
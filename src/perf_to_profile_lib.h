@@ -10,35 +10,126 @@
 
 #include <unistd.h>
 #include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "src/quipper/base/logging.h"
+#include "google/protobuf/arena.h"
 #include "src/perf_data_converter.h"
 #include "src/quipper/perf_data.pb.h"
+#include "src/quipper/perf_serializer.h"
 
 // Checks and returns whether or not the file at the given |path| already
 // exists.
 bool FileExists(const std::string& path);
 
-// Reads a file at the given |path| as a string and returns it.
+// Reads a file at the given |path| as a string and returns it. Returns an
+// empty string if the file can't be opened.
 std::string ReadFileToString(const std::string& path);
 
+// Returns whether the |size| bytes at |data| start with the magic of a raw
+// perf.data file, or of perf data piped from "perf record -o -", in either
+// byte order.
+bool IsRawPerfData(const char* data, size_t size);
+
 // Generates profiles from either a raw perf.data string or perf data proto
 // string. Returns a vector of process profiles, empty if any error occurs.
 perftools::ProcessProfiles StringToProfiles(
     const std::string& data, uint32_t sample_labels = perftools::kNoLabels,
     uint32_t options = perftools::kNoOptions);
 
+// Same as above, for the |size| bytes at |data|. Raw perf data is told apart
+// by its magic, so that it isn't parsed as a proto first.
+perftools::ProcessProfiles DataToProfiles(
+    const char* data, size_t size,
+    uint32_t sample_labels = perftools::kNoLabels,
+    uint32_t options = perftools::kNoOptions);
+
+// Same as above, for the data read from |fd| until its end. Piped perf data,
+// e.g. the output of "perf record -o -", is converted as it arrives, without
+// holding the whole input in memory.
+perftools::ProcessProfiles FdToProfiles(
+    int fd, uint32_t sample_labels = perftools::kNoLabels,
+    uint32_t options = perftools::kNoOptions);
+
+// Same as above, for the file at |path|, which is mapped into memory rather
+// than copied when it can be, or for the standard input if |path| is "-".
+perftools::ProcessProfiles FileToProfiles(
+    const std::string& path, uint32_t sample_labels = perftools::kNoLabels,
+    uint32_t options = perftools::kNoOptions);
+
+// Converts the perf data files at |paths|, each of which is read as
+// FileToProfiles() reads it, on up to |num_threads| threads, and
+// merges all of their profiles into one. The profiles are merged in the order
+// of |paths|, as soon as they are converted. Returns null if any error occurs.
+std::unique_ptr<perftools::profiles::Profile> FilesToMergedProfile(
+    const std::vector<std::string>& paths,
+    uint32_t sample_labels = perftools::kNoLabels,
+    uint32_t options = perftools::kNoOptions, int num_threads = 1);
+
+// The options of a batch conversion, which converts many inputs in one run of
+// the tool, each to a profile of its own.
+struct BatchOptions {
+  // A directory whose files are all converted, each to the profile of the
+  // same name with a ".pb" suffix in |output_dir|.
+  std::string input_dir;
+  std::string output_dir;
+  // A file that lists the path of an input and of its profile on each line,
+  // separated by whitespace.
+  std::string manifest;
+  // The number of inputs converted at once, or 0 for as many as there are
+  // CPUs.
+  int num_jobs = 0;
+  // The total size of the inputs converted at once, in bytes, or 0 for no
+  // limit. Inputs larger than this are converted alone.
+  uint64_t max_input_bytes = 0;
+};
+
+// An input of a batch conversion, and the path its profile is written to.
+struct BatchJob {
+  std::string input;
+  std::string output;
+};
+
+// Lists the jobs of the batch conversion described by |batch|, in the order of
+// the manifest, or sorted by input path for a directory. Returns false if the
+// directory or manifest can't be read.
+bool ListBatchJobs(const BatchOptions& batch, std::vector<BatchJob>* jobs);
+
+// Converts the input of each of |jobs| and writes its profile, as a single
+// input is converted, within the limits of |batch|. A job fails, without
+// stopping the others, if its input can't be converted or its profile can't
+// be written, including when it exists and |overwrite_output| isn't set.
+// Returns the number of jobs that failed.
+size_t RunBatchJobs(const std::vector<BatchJob>& jobs,
+                    const BatchOptions& batch, uint32_t options,
+                    bool overwrite_output);
+
+// Returns the number of threads to use for |num_jobs|, as in BatchOptions.
+int NumThreads(int num_jobs);
+
 // Creates a file at the given |path|. If |overwrite_output| is set to true,
 // overwrites the file at the given path.
 void CreateFile(const std::string& path, std::ofstream* file,
                 bool overwrite_output);
 
-// Parses arguments, stores the results in |input|, |output|
-// |overwrite_output| and |allow_unaligned_jit_mappings|, and returns true if
-// arguments parsed successfully and false otherwise.
-bool ParseArguments(int argc, const char* argv[], std::string* input,
+// Writes |profile| to the file at |path|, created as CreateFile() creates it,
+// or to the standard output, gzipped as Builder::MarshalToFile() writes it, if
+// |path| is "-". Returns false if the profile can't be written.
+bool WriteProfile(const perftools::profiles::Profile& profile,
+                  const std::string& path, bool overwrite_output);
+
+// Parses arguments, stores the results in |inputs|, |output|
+// |overwrite_output|, |allow_unaligned_jit_mappings| and |batch|, and returns
+// true if arguments parsed successfully and false otherwise. The -i flag may
+// be given several times, to merge the profiles of all the inputs. Either
+// inputs and an output, or the inputs and outputs of a batch conversion, must
+// be given.
+bool ParseArguments(int argc, const char* argv[],
+                    std::vector<std::string>* inputs,
                     std::string* output, bool* overwrite_output,
-                    bool* allow_unaligned_jit_mappings);
+                    bool* allow_unaligned_jit_mappings, BatchOptions* batch);
 
 // Prints the usage of the tool.
 void PrintUsage();
@@ -7,9 +7,17 @@
 
 #include "src/perf_to_profile_lib.h"
 
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <thread>
+
 #include "src/quipper/base/logging.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include "src/quipper/test_perf_data.h"
 
 namespace {
 
@@ -19,7 +27,7 @@ TEST(PerfToProfileTest, ParseArguments) {
   struct Test {
     std::string desc;
     std::vector<const char*> argv;
-    std::string expected_input;
+    std::vector<std::string> expected_inputs;
     std::string expected_output;
     bool expected_overwrite_output;
     bool allow_unaligned_jit_mappings;
@@ -30,7 +38,7 @@ TEST(PerfToProfileTest, ParseArguments) {
   tests.push_back(Test{
       .desc = "With input, output and overwrite flags",
       .argv = {"<exec>", "-i", "input_perf_file", "-o", "output_profile", "-f"},
-      .expected_input = "input_perf_file",
+      .expected_inputs = {"input_perf_file"},
       .expected_output = "output_profile",
       .expected_overwrite_output = true,
       .allow_unaligned_jit_mappings = false,
@@ -38,7 +46,7 @@ TEST(PerfToProfileTest, ParseArguments) {
   tests.push_back(
       Test{.desc = "With input and output flags",
            .argv = {"<exec>", "-i", "input_perf_file", "-o", "output_profile"},
-           .expected_input = "input_perf_file",
+           .expected_inputs = {"input_perf_file"},
            .expected_output = "output_profile",
            .expected_overwrite_output = false,
            .allow_unaligned_jit_mappings = false,
@@ -46,14 +54,22 @@ TEST(PerfToProfileTest, ParseArguments) {
   tests.push_back(Test{
       .desc = "With input and output flags and jit-support",
       .argv = {"<exec>", "-j", "-i", "input_perf_file", "-o", "output_profile"},
-      .expected_input = "input_perf_file",
+      .expected_inputs = {"input_perf_file"},
       .expected_output = "output_profile",
       .expected_overwrite_output = false,
       .allow_unaligned_jit_mappings = true,
       .want_error = false});
+  tests.push_back(Test{
+      .desc = "With several inputs",
+      .argv = {"<exec>", "-i", "first", "-i", "second", "-o", "output_profile"},
+      .expected_inputs = {"first", "second"},
+      .expected_output = "output_profile",
+      .expected_overwrite_output = false,
+      .allow_unaligned_jit_mappings = false,
+      .want_error = false});
   tests.push_back(Test{.desc = "With only overwrite flag",
                        .argv = {"<exec>", "-f"},
-                       .expected_input = "",
+                       .expected_inputs = {},
                        .expected_output = "",
                        .expected_overwrite_output = false,
                        .allow_unaligned_jit_mappings = false,
@@ -61,30 +77,32 @@ TEST(PerfToProfileTest, ParseArguments) {
   tests.push_back(Test{
       .desc = "With input, output, and invalid flags",
       .argv = {"<exec>", "-i", "input_perf_file", "-o", "output_profile", "-F"},
-      .expected_input = "",
+      .expected_inputs = {},
       .expected_output = "",
       .expected_overwrite_output = false,
       .allow_unaligned_jit_mappings = false,
       .want_error = true});
   tests.push_back(Test{.desc = "With an invalid flag",
                        .argv = {"<exec>", "-F"},
-                       .expected_input = "",
+                       .expected_inputs = {},
                        .expected_output = "",
                        .expected_overwrite_output = false,
                        .allow_unaligned_jit_mappings = false,
                        .want_error = true});
   for (auto test : tests) {
-    std::string input;
+    std::vector<std::string> inputs;
     std::string output;
     bool overwrite_output;
     bool allow_unaligned_jit_mappings;
+    BatchOptions batch;
     LOG(INFO) << "Testing: " << test.desc;
     EXPECT_THAT(
-        ParseArguments(test.argv.size(), test.argv.data(), &input, &output,
-                       &overwrite_output, &allow_unaligned_jit_mappings),
+        ParseArguments(test.argv.size(), test.argv.data(), &inputs, &output,
+                       &overwrite_output, &allow_unaligned_jit_mappings,
+                       &batch),
         Eq(!test.want_error));
     if (!test.want_error) {
-      EXPECT_THAT(input, Eq(test.expected_input));
+      EXPECT_THAT(inputs, Eq(test.expected_inputs));
       EXPECT_THAT(output, Eq(test.expected_output));
       EXPECT_THAT(overwrite_output, Eq(test.expected_overwrite_output));
       EXPECT_THAT(allow_unaligned_jit_mappings,
@@ -94,6 +112,112 @@ TEST(PerfToProfileTest, ParseArguments) {
   }
 }
 
+TEST(PerfToProfileTest, ParseBatchArguments) {
+  struct Test {
+    std::string desc;
+    std::vector<const char*> argv;
+    BatchOptions expected_batch;
+    bool want_error;
+  };
+
+  std::vector<Test> tests;
+  tests.push_back(Test{
+      .desc = "With input and output directories",
+      .argv = {"<exec>", "-I", "in", "-O", "out", "-n", "4", "-m", "16"},
+      .expected_batch = {.input_dir = "in",
+                         .output_dir = "out",
+                         .num_jobs = 4,
+                         .max_input_bytes = 16 << 20},
+      .want_error = false});
+  tests.push_back(Test{.desc = "With a manifest",
+                       .argv = {"<exec>", "-l", "manifest", "-f"},
+                       .expected_batch = {.manifest = "manifest"},
+                       .want_error = false});
+  tests.push_back(Test{.desc = "Without an output directory",
+                       .argv = {"<exec>", "-I", "in"},
+                       .want_error = true});
+  tests.push_back(Test{.desc = "With a manifest and an input directory",
+                       .argv = {"<exec>", "-l", "manifest", "-I", "in", "-O",
+                                "out"},
+                       .want_error = true});
+  tests.push_back(Test{.desc = "With a manifest and an input",
+                       .argv = {"<exec>", "-l", "manifest", "-i", "input"},
+                       .want_error = true});
+  tests.push_back(Test{.desc = "With no jobs",
+                       .argv = {"<exec>", "-l", "manifest", "-n", "0"},
+                       .want_error = true});
+  for (auto test : tests) {
+    std::vector<std::string> inputs;
+    std::string output;
+    bool overwrite_output;
+    bool allow_unaligned_jit_mappings;
+    BatchOptions batch;
+    LOG(INFO) << "Testing: " << test.desc;
+    EXPECT_THAT(
+        ParseArguments(test.argv.size(), test.argv.data(), &inputs, &output,
+                       &overwrite_output, &allow_unaligned_jit_mappings,
+                       &batch),
+        Eq(!test.want_error));
+    if (!test.want_error) {
+      EXPECT_THAT(batch.input_dir, Eq(test.expected_batch.input_dir));
+      EXPECT_THAT(batch.output_dir, Eq(test.expected_batch.output_dir));
+      EXPECT_THAT(batch.manifest, Eq(test.expected_batch.manifest));
+      EXPECT_THAT(batch.num_jobs, Eq(test.expected_batch.num_jobs));
+      EXPECT_THAT(batch.max_input_bytes,
+                  Eq(test.expected_batch.max_input_bytes));
+    }
+    optind = 1;
+  }
+}
+
+TEST(PerfToProfileTest, ListBatchJobs) {
+  char dir_template[] = "/tmp/perf_to_profile_test.XXXXXX";
+  const std::string dir = mkdtemp(dir_template);
+  ASSERT_FALSE(dir.empty());
+  for (const char* name : {"b.data", "a.data"}) {
+    std::ofstream(dir + "/" + name) << "data";
+  }
+  ASSERT_EQ(mkdir((dir + "/subdir").c_str(), 0700), 0);
+  std::ofstream(dir + "/manifest") << "in1 out1\n\n  in2\tout2\n";
+
+  BatchOptions batch;
+  batch.manifest = dir + "/manifest";
+  std::vector<BatchJob> jobs;
+  ASSERT_TRUE(ListBatchJobs(batch, &jobs));
+  ASSERT_EQ(jobs.size(), 2);
+  EXPECT_EQ(jobs[0].input, "in1");
+  EXPECT_EQ(jobs[0].output, "out1");
+  EXPECT_EQ(jobs[1].input, "in2");
+  EXPECT_EQ(jobs[1].output, "out2");
+
+  // Only the regular files of a directory are converted, in order.
+  batch = BatchOptions();
+  batch.input_dir = dir;
+  batch.output_dir = "out";
+  ASSERT_TRUE(ListBatchJobs(batch, &jobs));
+  ASSERT_EQ(jobs.size(), 3);
+  EXPECT_EQ(jobs[0].input, dir + "/a.data");
+  EXPECT_EQ(jobs[0].output, "out/a.data.pb");
+  EXPECT_EQ(jobs[1].input, dir + "/b.data");
+  EXPECT_EQ(jobs[2].input, dir + "/manifest");
+
+  batch.input_dir = dir + "/missing";
+  EXPECT_FALSE(ListBatchJobs(batch, &jobs));
+
+  // A failed job doesn't stop the others.
+  std::vector<BatchJob> failing = {{dir + "/missing", dir + "/out1"},
+                                   {dir + "/a.data", dir + "/out2"}};
+  batch.num_jobs = 2;
+  batch.max_input_bytes = 1;
+  EXPECT_EQ(RunBatchJobs(failing, batch, perftools::kNoOptions, false), 2);
+
+  for (const char* name : {"a.data", "b.data", "manifest"}) {
+    unlink((dir + "/" + name).c_str());
+  }
+  rmdir((dir + "/subdir").c_str());
+  rmdir(dir.c_str());
+}
+
 std::string GetResource(const std::string& relpath) {
   return "src/testdata/" + relpath;
 }
@@ -113,6 +237,93 @@ TEST(PerfToProfileTest, PerfDataProtoStringToProfiles) {
   EXPECT_EQ(profiles.size(), 1);
 }
 
+// Files are converted in place, whatever their format, as their strings are.
+TEST(PerfToProfileTest, FileToProfiles) {
+  for (const char* name : {"multi-event-single-process.perf.data",
+                           "multi-event-single-process.perf_data.pb"}) {
+    const std::string path = GetResource(name);
+    const std::string data = ReadFileToString(path);
+    EXPECT_EQ(name == std::string("multi-event-single-process.perf.data"),
+              IsRawPerfData(data.data(), data.size()));
+    const auto expected = StringToProfiles(data);
+    const auto profiles = FileToProfiles(path);
+    ASSERT_EQ(1, expected.size());
+    ASSERT_EQ(1, profiles.size());
+    EXPECT_EQ(expected[0]->data.SerializeAsString(),
+              profiles[0]->data.SerializeAsString())
+        << name;
+  }
+}
+
+// Piped perf data is converted as it is read from a pipe.
+TEST(PerfToProfileTest, FdToProfiles) {
+  std::stringstream input;
+  quipper::testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  quipper::testing::ExamplePerfEventAttrEvent_Hardware(
+      quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID, false)
+      .WriteTo(&input);
+  quipper::testing::ExampleMmapEvent(
+      1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+      quipper::testing::SampleInfo())
+      .WriteTo(&input);
+  for (int i = 0; i < 1000; ++i) {
+    quipper::testing::ExamplePerfSampleEvent(
+        quipper::testing::SampleInfo().Ip(0x1c1000 + i % 10).Tid(1001))
+        .WriteTo(&input);
+  }
+  const std::string data = input.str();
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  std::thread writer([&]() {
+    // Write in pieces that split the records.
+    for (size_t offset = 0; offset < data.size(); offset += 1000) {
+      const size_t size = std::min<size_t>(1000, data.size() - offset);
+      ASSERT_EQ(size, write(fds[1], data.data() + offset, size));
+    }
+    close(fds[1]);
+  });
+  const auto profiles = FdToProfiles(fds[0]);
+  writer.join();
+  close(fds[0]);
+
+  const auto expected = StringToProfiles(data);
+  ASSERT_EQ(1, expected.size());
+  ASSERT_EQ(1, profiles.size());
+  EXPECT_EQ(10, profiles[0]->data.sample_size());
+  EXPECT_EQ(expected[0]->data.SerializeAsString(),
+            profiles[0]->data.SerializeAsString());
+}
+
+// Merging the profile of a file with itself adds up its values.
+TEST(PerfToProfileTest, FilesToMergedProfile) {
+  std::string path(GetResource("multi-event-single-process.perf.data"));
+  const auto profiles = StringToProfiles(ReadFileToString(path));
+  ASSERT_EQ(profiles.size(), 1);
+  const auto& profile = profiles[0]->data;
+
+  const auto merged = FilesToMergedProfile(
+      {path, path, path}, perftools::kNoLabels, perftools::kNoOptions, 2);
+  ASSERT_NE(merged, nullptr);
+  EXPECT_EQ(merged->sample_type_size(), profile.sample_type_size());
+  EXPECT_EQ(merged->sample_size(), profile.sample_size());
+  EXPECT_EQ(merged->location_size(), profile.location_size());
+  EXPECT_EQ(merged->mapping_size(), profile.mapping_size());
+  int64_t total = 0, merged_total = 0;
+  for (const auto& sample : profile.sample()) total += sample.value(0);
+  for (const auto& sample : merged->sample()) merged_total += sample.value(0);
+  EXPECT_EQ(merged_total, 3 * total);
+}
+
+// A file that can't be read fails the merge instead of the process.
+TEST(PerfToProfileTest, FilesToMergedProfileFailsOnMissingFile) {
+  std::string path(GetResource("multi-event-single-process.perf.data"));
+  EXPECT_EQ(FilesToMergedProfile({path, "/doesnt-exist/perf.data"},
+                                 perftools::kNoLabels, perftools::kNoOptions,
+                                 2),
+            nullptr);
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
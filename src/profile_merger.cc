@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/profile_merger.h"
+
+#include <algorithm>
+#include <string_view>
+
+#include "src/quipper/base/logging.h"
+
+namespace perftools {
+namespace profiles {
+
+namespace {
+
+// Mixes |value| into |hash|.
+uint64_t HashCombine(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+// Separates the variable-length parts of a key.
+constexpr uint64_t kKeySeparator = ~0ULL;
+
+// Returns the index in the merged profile of the string at |index| in the
+// profile being added, given the indices of all of its |strings|. Indices out
+// of range stand for the empty string.
+int64_t StringId(const std::vector<int64_t> &strings, int64_t index) {
+  return index > 0 && index < static_cast<int64_t>(strings.size())
+             ? strings[index]
+             : 0;
+}
+
+// Returns whether |filename| is that of an anonymous mapping, e.g. the heap,
+// the stack or JIT code, rather than of a file.
+bool IsAnonymous(std::string_view filename) {
+  return filename.empty() || filename[0] == '[' ||
+         filename.substr(0, 6) == "//anon" ||
+         filename.substr(0, 14) == "/anon_hugepage";
+}
+
+}  // namespace
+
+size_t ProfileMerger::KeyHash::operator()(const Key &key) const {
+  uint64_t hash = key.size();
+  for (uint64_t value : key) hash = HashCombine(hash, value);
+  return static_cast<size_t>(hash);
+}
+
+size_t ProfileMerger::KeyHash::operator()(
+    const std::pair<int64_t, int64_t> &key) const {
+  return static_cast<size_t>(HashCombine(key.first, key.second));
+}
+
+void ProfileMerger::AddSampleTypes(const Profile &profile,
+                                   const std::vector<int64_t> &strings,
+                                   std::vector<int> *value_indices) {
+  Profile *merged = builder_.mutable_profile();
+  value_indices->clear();
+  for (const auto &sample_type : profile.sample_type()) {
+    const std::pair<int64_t, int64_t> key(
+        StringId(strings, sample_type.type()),
+        StringId(strings, sample_type.unit()));
+    auto inserted = sample_types_.emplace(key, merged->sample_type_size());
+    if (inserted.second) {
+      auto *merged_type = merged->add_sample_type();
+      merged_type->set_type(key.first);
+      merged_type->set_unit(key.second);
+    }
+    value_indices->push_back(inserted.first->second);
+  }
+}
+
+bool ProfileMerger::Add(const Profile &profile) {
+  if (!Builder::CheckValid(profile)) {
+    return false;
+  }
+  Profile *merged = builder_.mutable_profile();
+
+  // The index of each string of |profile| in the merged profile.
+  std::vector<int64_t> strings;
+  strings.reserve(profile.string_table_size());
+  for (const auto &str : profile.string_table()) {
+    strings.push_back(builder_.StringId(std::string_view(str)));
+  }
+  auto string_id = [&strings](int64_t index) {
+    return StringId(strings, index);
+  };
+
+  std::vector<int> value_indices;
+  AddSampleTypes(profile, strings, &value_indices);
+  if (merged->default_sample_type() == 0) {
+    merged->set_default_sample_type(string_id(profile.default_sample_type()));
+  }
+  if (!merged->has_period_type() && profile.has_period_type()) {
+    auto *period_type = merged->mutable_period_type();
+    period_type->set_type(string_id(profile.period_type().type()));
+    period_type->set_unit(string_id(profile.period_type().unit()));
+    merged->set_period(profile.period());
+  }
+  if (merged->drop_frames() == 0) {
+    merged->set_drop_frames(string_id(profile.drop_frames()));
+  }
+  if (merged->keep_frames() == 0) {
+    merged->set_keep_frames(string_id(profile.keep_frames()));
+  }
+  if (merged->doc_url() == 0) {
+    merged->set_doc_url(string_id(profile.doc_url()));
+  }
+  for (int64_t comment : profile.comment()) {
+    if (comments_.insert(string_id(comment)).second) {
+      merged->add_comment(string_id(comment));
+    }
+  }
+  if (profile.time_nanos() != 0) {
+    if (merged->time_nanos() == 0 ||
+        profile.time_nanos() < merged->time_nanos()) {
+      merged->set_time_nanos(profile.time_nanos());
+    }
+    end_nanos_ =
+        std::max(end_nanos_, profile.time_nanos() + profile.duration_nanos());
+    merged->set_duration_nanos(end_nanos_ - merged->time_nanos());
+  }
+
+  // The ID of the merged mapping of each mapping, and the offset from the
+  // addresses of the mapping to those of the merged mapping.
+  std::unordered_map<uint64_t, std::pair<uint64_t, uint64_t>> mapping_ids;
+  Key key;
+  for (const auto &mapping : profile.mapping()) {
+    // The same file is mapped at different addresses in different processes,
+    // so its mappings are told apart by their size and offset in the file,
+    // and by the build ID of the file, or its name if it has none. Anonymous
+    // mappings of the same size are not the same memory, so they are also
+    // told apart by their address, as are all the mappings of profiles of the
+    // same address space.
+    const uint64_t build_id = string_id(mapping.build_id());
+    const std::string_view filename =
+        mapping.filename() > 0 &&
+                mapping.filename() < profile.string_table_size()
+            ? profile.string_table(mapping.filename())
+            : std::string_view();
+    const bool relocatable =
+        !same_address_space_ && (build_id != 0 || !IsAnonymous(filename));
+    key = {relocatable,
+           relocatable ? 0 : mapping.memory_start(),
+           mapping.memory_limit() - mapping.memory_start(),
+           mapping.file_offset(),
+           build_id != 0,
+           build_id != 0
+               ? build_id
+               : static_cast<uint64_t>(string_id(mapping.filename()))};
+    auto inserted = mappings_.emplace(key, merged->mapping_size() + 1);
+    Mapping *merged_mapping;
+    if (inserted.second) {
+      merged_mapping = merged->add_mapping();
+      merged_mapping->set_id(inserted.first->second);
+      merged_mapping->set_memory_start(mapping.memory_start());
+      merged_mapping->set_memory_limit(mapping.memory_limit());
+      merged_mapping->set_file_offset(mapping.file_offset());
+      merged_mapping->set_filename(string_id(mapping.filename()));
+      merged_mapping->set_build_id(build_id);
+    } else {
+      merged_mapping = merged->mutable_mapping(inserted.first->second - 1);
+    }
+    merged_mapping->set_has_functions(merged_mapping->has_functions() ||
+                                      mapping.has_functions());
+    merged_mapping->set_has_filenames(merged_mapping->has_filenames() ||
+                                      mapping.has_filenames());
+    merged_mapping->set_has_line_numbers(merged_mapping->has_line_numbers() ||
+                                         mapping.has_line_numbers());
+    merged_mapping->set_has_inline_frames(
+        merged_mapping->has_inline_frames() || mapping.has_inline_frames());
+    mapping_ids[mapping.id()] = {
+        inserted.first->second,
+        merged_mapping->memory_start() - mapping.memory_start()};
+  }
+
+  std::unordered_map<uint64_t, uint64_t> function_ids;
+  for (const auto &function : profile.function()) {
+    auto str = [&profile](int64_t index) {
+      return index > 0 && index < profile.string_table_size()
+                 ? profile.string_table(index).c_str()
+                 : "";
+    };
+    function_ids[function.id()] =
+        builder_.FunctionId(str(function.name()), str(function.system_name()),
+                            str(function.filename()), function.start_line());
+  }
+
+  std::unordered_map<uint64_t, uint64_t> location_ids;
+  for (const auto &location : profile.location()) {
+    // The address in the merged mapping.
+    const auto mapping_it = mapping_ids.find(location.mapping_id());
+    const uint64_t mapping_id =
+        mapping_it != mapping_ids.end() ? mapping_it->second.first : 0;
+    const uint64_t address =
+        location.address() +
+        (mapping_it != mapping_ids.end() ? mapping_it->second.second : 0);
+    key = {mapping_id, address, location.is_folded()};
+    for (const auto &line : location.line()) {
+      key.push_back(function_ids[line.function_id()]);
+      key.push_back(line.line());
+      key.push_back(line.column());
+    }
+    auto inserted = locations_.emplace(key, merged->location_size() + 1);
+    if (inserted.second) {
+      auto *merged_location = merged->add_location();
+      merged_location->set_id(inserted.first->second);
+      merged_location->set_mapping_id(key[0]);
+      merged_location->set_address(address);
+      merged_location->set_is_folded(location.is_folded());
+      for (const auto &line : location.line()) {
+        auto *merged_line = merged_location->add_line();
+        merged_line->set_function_id(function_ids[line.function_id()]);
+        merged_line->set_line(line.line());
+        merged_line->set_column(line.column());
+      }
+    }
+    location_ids[location.id()] = inserted.first->second;
+  }
+
+  for (const auto &sample : profile.sample()) {
+    key.clear();
+    for (uint64_t location_id : sample.location_id()) {
+      key.push_back(location_ids[location_id]);
+    }
+    key.push_back(kKeySeparator);
+    for (const auto &label : sample.label()) {
+      key.push_back(string_id(label.key()));
+      key.push_back(string_id(label.str()));
+      key.push_back(label.num());
+      key.push_back(string_id(label.num_unit()));
+    }
+    auto inserted = samples_.emplace(key, merged->sample_size());
+    Sample *merged_sample;
+    if (inserted.second) {
+      merged_sample = merged->add_sample();
+      for (uint64_t location_id : sample.location_id()) {
+        merged_sample->add_location_id(location_ids[location_id]);
+      }
+      for (const auto &label : sample.label()) {
+        auto *merged_label = merged_sample->add_label();
+        merged_label->set_key(string_id(label.key()));
+        merged_label->set_str(string_id(label.str()));
+        merged_label->set_num(label.num());
+        merged_label->set_num_unit(string_id(label.num_unit()));
+      }
+    } else {
+      merged_sample = merged->mutable_sample(inserted.first->second);
+    }
+    // The samples get the values of the sample types added since they were.
+    merged_sample->mutable_value()->Resize(merged->sample_type_size(), 0);
+    for (int i = 0; i < sample.value_size(); ++i) {
+      merged_sample->set_value(
+          value_indices[i],
+          merged_sample->value(value_indices[i]) + sample.value(i));
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<Profile> ProfileMerger::Consume() {
+  Profile *merged = builder_.mutable_profile();
+  for (auto &sample : *merged->mutable_sample()) {
+    sample.mutable_value()->Resize(merged->sample_type_size(), 0);
+  }
+  if (!builder_.Finalize()) {
+    LOG(ERROR) << "The merged profile is not valid";
+    return nullptr;
+  }
+  return builder_.Consume();
+}
+
+}  // namespace profiles
+}  // namespace perftools
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_PROFILES_PROFILE_MERGER_H_
+#define PERFTOOLS_PROFILES_PROFILE_MERGER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "src/builder.h"
+
+namespace perftools {
+namespace profiles {
+
+// Merges profiles into one, as they are added. The strings, functions,
+// mappings and locations of the profiles are deduplicated as they are copied
+// into the merged profile, and the values of the samples with the same
+// locations and labels are summed. The sample types are the union of those of
+// the profiles, and a sample has 0 for the types its profile doesn't have.
+//
+// Mappings are the same if they have the same size, file offset and build
+// ID, or filename if they have no build ID, wherever they are mapped, so that
+// the profiles of the same binary loaded at different addresses, e.g. in
+// different processes or on different hosts, are merged. The merged mapping
+// is at the address of the first one added, and the addresses of the
+// locations of the others are moved there. Anonymous mappings, those with no
+// build ID and an empty filename, or one like "[heap]" or "//anon", are only
+// the same if they are also at the same address. Locations are the same if
+// they have the same mapping, address and lines.
+//
+// If |same_address_space| is set, the profiles are of the same process, e.g.
+// of its samples on different CPUs, so all mappings are only the same if they
+// are also at the same address, and no addresses are moved.
+class ProfileMerger {
+ public:
+  explicit ProfileMerger(bool same_address_space = false)
+      : same_address_space_(same_address_space) {}
+
+  ProfileMerger(const ProfileMerger &) = delete;
+  ProfileMerger &operator=(const ProfileMerger &) = delete;
+
+  // Adds the samples of |profile| to the merged profile. Returns false, and
+  // adds nothing, if |profile| is not valid (see Builder::CheckValid()).
+  bool Add(const Profile &profile);
+
+  // Returns the merged profile, or null if it is not valid. No further calls
+  // should be made to the merger after this.
+  std::unique_ptr<Profile> Consume();
+
+ private:
+  // The fields of a mapping, location or sample that identify it, with the
+  // indices remapped to those of the merged profile.
+  typedef std::vector<uint64_t> Key;
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+    size_t operator()(const std::pair<int64_t, int64_t> &key) const;
+  };
+
+  typedef std::unordered_map<Key, uint64_t, KeyHash> KeyIndexMap;
+
+  // Adds the sample types of |profile| that the merged profile doesn't have
+  // yet, and sets |value_indices| to the index of each of them in the merged
+  // profile.
+  void AddSampleTypes(const Profile &profile,
+                      const std::vector<int64_t> &strings,
+                      std::vector<int> *value_indices);
+
+  const bool same_address_space_;
+  Builder builder_;
+
+  // The index of each sample type, keyed by its type and unit.
+  std::unordered_map<std::pair<int64_t, int64_t>, int, KeyHash> sample_types_;
+  // The merged profile's mapping and location IDs, and sample indices.
+  KeyIndexMap mappings_;
+  KeyIndexMap locations_;
+  KeyIndexMap samples_;
+  std::unordered_set<int64_t> comments_;
+  // The end of the time span of the profiles, in nanoseconds.
+  int64_t end_nanos_ = 0;
+};
+
+}  // namespace profiles
+}  // namespace perftools
+
+#endif  // PERFTOOLS_PROFILES_PROFILE_MERGER_H_
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/profile_merger.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+// Builds a profile with one sample of |value| of the sample type |type|, at
+// an address of a mapping of |filename| and |build_id| at |start|.
+Profile MakeProfile(const std::string& type, const std::string& filename,
+                    uint64_t address, int64_t value, uint64_t start = 0x1000,
+                    const std::string& build_id = "") {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder.StringId(type.c_str()));
+  sample_type->set_unit(builder.StringId("count"));
+  profile->set_default_sample_type(sample_type->type());
+  auto* mapping = profile->add_mapping();
+  mapping->set_id(1);
+  mapping->set_memory_start(start);
+  mapping->set_memory_limit(start + 0x1000);
+  mapping->set_filename(builder.StringId(filename.c_str()));
+  if (!build_id.empty()) {
+    mapping->set_build_id(builder.StringId(build_id.c_str()));
+  }
+  auto* location = profile->add_location();
+  location->set_id(7);
+  location->set_mapping_id(1);
+  location->set_address(address);
+  auto* sample = profile->add_sample();
+  sample->add_location_id(7);
+  sample->add_value(value);
+  return *profile;
+}
+
+TEST(ProfileMergerTest, MergesProfiles) {
+  ProfileMerger merger;
+  ASSERT_TRUE(merger.Add(MakeProfile("cycles", "/bin/foo", 0x1100, 1)));
+  ASSERT_TRUE(merger.Add(MakeProfile("cycles", "/bin/foo", 0x1100, 2)));
+  ASSERT_TRUE(merger.Add(MakeProfile("cycles", "/bin/foo", 0x1200, 4)));
+  ASSERT_TRUE(merger.Add(MakeProfile("instructions", "/bin/bar", 0x1100, 8)));
+  EXPECT_FALSE(merger.Add(Profile()));
+  const auto merged = merger.Consume();
+  ASSERT_NE(merged, nullptr);
+
+  ASSERT_EQ(2, merged->sample_type_size());
+  EXPECT_EQ("cycles", merged->string_table(merged->sample_type(0).type()));
+  EXPECT_EQ("instructions",
+            merged->string_table(merged->sample_type(1).type()));
+  EXPECT_EQ(merged->sample_type(0).type(), merged->default_sample_type());
+  ASSERT_EQ(2, merged->mapping_size());
+  EXPECT_EQ("/bin/foo", merged->string_table(merged->mapping(0).filename()));
+  EXPECT_EQ("/bin/bar", merged->string_table(merged->mapping(1).filename()));
+  ASSERT_EQ(3, merged->location_size());
+  EXPECT_EQ(1, merged->location(1).mapping_id());
+  EXPECT_EQ(0x1200, merged->location(1).address());
+  EXPECT_EQ(2, merged->location(2).mapping_id());
+
+  ASSERT_EQ(3, merged->sample_size());
+  const int64_t want_values[][2] = {{3, 0}, {4, 0}, {0, 8}};
+  for (int i = 0; i < 3; ++i) {
+    const Sample& sample = merged->sample(i);
+    ASSERT_EQ(1, sample.location_id_size());
+    EXPECT_EQ(i + 1, sample.location_id(0));
+    ASSERT_EQ(2, sample.value_size());
+    EXPECT_EQ(want_values[i][0], sample.value(0)) << i;
+    EXPECT_EQ(want_values[i][1], sample.value(1)) << i;
+  }
+}
+
+// The same binary loaded at different addresses gets one mapping, at the
+// address of the first one, and the same address in it one location.
+TEST(ProfileMergerTest, MergesMappingsAtDifferentAddresses) {
+  ProfileMerger merger;
+  ASSERT_TRUE(merger.Add(
+      MakeProfile("cycles", "/bin/foo", 0x1100, 1, 0x1000, "abcd")));
+  ASSERT_TRUE(merger.Add(
+      MakeProfile("cycles", "/other/foo", 0x7100, 2, 0x7000, "abcd")));
+  ASSERT_TRUE(merger.Add(
+      MakeProfile("cycles", "/bin/foo", 0x5200, 4, 0x5000, "ef01")));
+  // Without build IDs, the mappings of the same file are merged.
+  ASSERT_TRUE(
+      merger.Add(MakeProfile("cycles", "/bin/bar", 0x3100, 8, 0x3000)));
+  ASSERT_TRUE(
+      merger.Add(MakeProfile("cycles", "/bin/bar", 0x9100, 16, 0x9000)));
+  const auto merged = merger.Consume();
+  ASSERT_NE(merged, nullptr);
+
+  ASSERT_EQ(3, merged->mapping_size());
+  EXPECT_EQ(0x1000, merged->mapping(0).memory_start());
+  EXPECT_EQ("abcd", merged->string_table(merged->mapping(0).build_id()));
+  EXPECT_EQ(0x5000, merged->mapping(1).memory_start());
+  EXPECT_EQ(0x3000, merged->mapping(2).memory_start());
+  ASSERT_EQ(3, merged->location_size());
+  EXPECT_EQ(0x1100, merged->location(0).address());
+  EXPECT_EQ(0x5200, merged->location(1).address());
+  EXPECT_EQ(0x3100, merged->location(2).address());
+  ASSERT_EQ(3, merged->sample_size());
+  EXPECT_EQ(3, merged->sample(0).value(0));
+  EXPECT_EQ(4, merged->sample(1).value(0));
+  EXPECT_EQ(24, merged->sample(2).value(0));
+}
+
+TEST(ProfileMergerTest, KeepsAnonymousMappingsApart) {
+  // Two anonymous mappings of the same size in one profile.
+  Profile profile = MakeProfile("cycles", "//anon", 0x1100, 1, 0x1000);
+  auto* mapping = profile.add_mapping();
+  mapping->set_id(2);
+  mapping->set_memory_start(0x5000);
+  mapping->set_memory_limit(0x6000);
+  mapping->set_filename(profile.mapping(0).filename());
+  auto* location = profile.add_location();
+  location->set_id(8);
+  location->set_mapping_id(2);
+  location->set_address(0x5100);
+  auto* sample = profile.add_sample();
+  sample->add_location_id(8);
+  sample->add_value(2);
+
+  ProfileMerger merger;
+  ASSERT_TRUE(merger.Add(profile));
+  ASSERT_TRUE(merger.Add(MakeProfile("cycles", "[heap]", 0x3100, 4, 0x3000)));
+  ASSERT_TRUE(merger.Add(MakeProfile("cycles", "[heap]", 0x3100, 8, 0x3000)));
+  const auto merged = merger.Consume();
+  ASSERT_NE(merged, nullptr);
+
+  ASSERT_EQ(3, merged->mapping_size());
+  EXPECT_EQ(0x1000, merged->mapping(0).memory_start());
+  EXPECT_EQ(0x5000, merged->mapping(1).memory_start());
+  EXPECT_EQ(0x3000, merged->mapping(2).memory_start());
+  ASSERT_EQ(3, merged->location_size());
+  EXPECT_EQ(0x1100, merged->location(0).address());
+  EXPECT_EQ(0x5100, merged->location(1).address());
+  EXPECT_EQ(0x3100, merged->location(2).address());
+  ASSERT_EQ(3, merged->sample_size());
+  EXPECT_EQ(1, merged->sample(0).value(0));
+  EXPECT_EQ(2, merged->sample(1).value(0));
+  EXPECT_EQ(12, merged->sample(2).value(0));
+}
+
+TEST(ProfileMergerTest, KeepsAddressesInSameAddressSpace) {
+  ProfileMerger merger(/*same_address_space=*/true);
+  ASSERT_TRUE(merger.Add(
+      MakeProfile("cycles", "/bin/foo", 0x1100, 1, 0x1000, "abcd")));
+  ASSERT_TRUE(merger.Add(
+      MakeProfile("cycles", "/bin/foo", 0x5100, 2, 0x5000, "abcd")));
+  ASSERT_TRUE(merger.Add(
+      MakeProfile("cycles", "/bin/foo", 0x1100, 4, 0x1000, "abcd")));
+  const auto merged = merger.Consume();
+  ASSERT_NE(merged, nullptr);
+
+  ASSERT_EQ(2, merged->mapping_size());
+  EXPECT_EQ(0x1000, merged->mapping(0).memory_start());
+  EXPECT_EQ(0x5000, merged->mapping(1).memory_start());
+  ASSERT_EQ(2, merged->location_size());
+  EXPECT_EQ(0x1100, merged->location(0).address());
+  EXPECT_EQ(0x5100, merged->location(1).address());
+  ASSERT_EQ(2, merged->sample_size());
+  EXPECT_EQ(5, merged->sample(0).value(0));
+  EXPECT_EQ(2, merged->sample(1).value(0));
+}
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
@@ -6,21 +6,38 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <iterator>
 #include <vector>
 
 #include "base/logging.h"
 
 namespace quipper {
 
-AddressMapper::AddressMapper(const AddressMapper& other) {
-  // Copy over most members naively.
-  mappings_ = other.mappings_;
-  page_alignment_ = other.page_alignment_;
+namespace {
 
-  // Reconstruct mapping of real addresses to mapped ranges.
-  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    real_addr_to_mapped_range_[iter->real_addr] = iter;
+// Orders ranges by their real addresses.
+struct RealAddrLess {
+  template <typename Range>
+  bool operator()(const Range& range, uint64_t addr) const {
+    return range.real_addr < addr;
   }
+  template <typename Range>
+  bool operator()(uint64_t addr, const Range& range) const {
+    return addr < range.real_addr;
+  }
+};
+
+}  // namespace
+
+AddressMapper::AddressMapper(const AddressMapper& other)
+    : mappings_(other.mappings_), page_alignment_(other.page_alignment_) {}
+
+AddressMapper::Mappings* AddressMapper::MutableMappings() {
+  if (mappings_.use_count() > 1) {
+    mappings_ = std::make_shared<Mappings>(*mappings_);
+  }
+  return mappings_.get();
 }
 
 bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
@@ -59,37 +76,37 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
 
   // lower_bound returns the first range with starting addr >= |real_addr|. The
   // preceding range could also possibly overlap with the new range.
-  auto map_iter_start = real_addr_to_mapped_range_.lower_bound(real_addr);
-  if (map_iter_start != real_addr_to_mapped_range_.begin()) --map_iter_start;
-  // lower_bound returns the first range with starting addr beyond the end of
+  const MappingList& ranges = mappings_->ranges;
+  auto iter_start =
+      std::lower_bound(ranges.begin(), ranges.end(), real_addr, RealAddrLess());
+  if (iter_start != ranges.begin() && std::prev(iter_start)->Intersects(range))
+    --iter_start;
+  // upper_bound returns the first range with starting addr beyond the end of
   // the new mapping range.
-  auto map_iter_end = real_addr_to_mapped_range_.lower_bound(real_addr + size);
+  auto iter_end = std::upper_bound(iter_start, ranges.end(),
+                                   real_addr + size - 1, RealAddrLess());
 
-  std::vector<MappingList::iterator> mappings_to_delete;
-  MappingList::iterator old_range_iter = mappings_.end();
-  for (auto map_iter = map_iter_start; map_iter != map_iter_end; ++map_iter) {
-    auto iter = map_iter->second;
-    if (!iter->Intersects(range)) continue;
+  // Ranges don't overlap, so all the ranges in [iter_start, iter_end) collide
+  // with the new range. If one of them covers it, it is the only one.
+  bool split_old_range = false;
+  if (iter_start != iter_end) {
     // Quit if existing ranges that collide aren't supposed to be removed.
     if (!remove_existing_mappings) return false;
-    if (old_range_iter == mappings_.end() && iter->Covers(range) &&
-        iter->size > range.size) {
-      old_range_iter = iter;
-      continue;
-    }
-    mappings_to_delete.push_back(iter);
+    split_old_range = std::next(iter_start) == iter_end &&
+                      iter_start->Covers(range) && iter_start->size > size;
   }
 
-  for (MappingList::iterator mapping_iter : mappings_to_delete)
-    Unmap(mapping_iter);
-  mappings_to_delete.clear();
+  const size_t start_index = iter_start - ranges.begin();
+  const size_t end_index = iter_end - ranges.begin();
+  Mappings* mappings = MutableMappings();
 
-  // Otherwise check for this range being covered by another range.  If that
-  // happens, split or reduce the existing range to make room.
-  if (old_range_iter != mappings_.end()) {
+  // If this range is covered by another range, split or reduce the existing
+  // range to make room.
+  if (split_old_range) {
     // Make a copy of the old mapping before removing it.
-    const MappedRange old_range = *old_range_iter;
-    Unmap(old_range_iter);
+    const MappedRange old_range = mappings->ranges[start_index];
+    Unmap(mappings, mappings->ranges.begin() + start_index,
+          mappings->ranges.begin() + end_index);
 
     uint64_t gap_before = range.real_addr - old_range.real_addr;
     uint64_t gap_after =
@@ -140,94 +157,106 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
     return true;
   }
 
+  Unmap(mappings, mappings->ranges.begin() + start_index,
+        mappings->ranges.begin() + end_index);
+
   // Now search for a location for the new range.  It should be in the first
   // free block in quipper space.
+  std::vector<MappedSpan>& spans = mappings->spans;
+  auto end_of_unmapped_space_after = [&spans](size_t index) {
+    return index + 1 < spans.size() ? spans[index + 1].mapped_addr
+                                    : UINT64_MAX;
+  };
 
   uint64_t page_offset =
       page_alignment_ ? GetAlignedOffset(range.real_addr) : 0;
 
-  // If there is no existing mapping, add it to the beginning of quipper space.
-  if (IsEmpty()) {
-    range.mapped_addr = page_offset;
-    range.unmapped_space_after = UINT64_MAX - range.size - page_offset;
-    mappings_.push_back(range);
-    real_addr_to_mapped_range_.insert(
-        std::make_pair(range.real_addr, mappings_.begin()));
-    return true;
-  }
-
-  // If there is space before the first mapped range in quipper space, use it.
-  if (mappings_.begin()->mapped_addr >= range.size + page_offset) {
+  // If there is no existing mapping, or there is space before the first mapped
+  // range in quipper space, add it to the beginning of quipper space.
+  size_t span_index = 0;
+  if (spans.empty() || spans[0].mapped_addr >= range.size + page_offset) {
     range.mapped_addr = page_offset;
-    range.unmapped_space_after =
-        mappings_.begin()->mapped_addr - range.size - page_offset;
-    mappings_.push_front(range);
-    MappingList::iterator iter = mappings_.begin();
-    real_addr_to_mapped_range_.insert(std::make_pair(range.real_addr, iter));
-    return true;
-  }
-
-  // Otherwise, search through the existing mappings for a free block after one
-  // of them.
-  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    MappedRange& existing_mapping = *iter;
-    if (page_alignment_) {
+  } else {
+    // Otherwise, search through the existing mappings for a free block after
+    // one of them. Only those followed by at least the size of the range, and
+    // its offset in its page, can hold it.
+    const uint64_t min_gap = range.size <= UINT64_MAX - page_offset
+                                 ? range.size + page_offset
+                                 : UINT64_MAX;
+    for (span_index = mappings->gaps.FindFirst(0, min_gap);
+         span_index < spans.size();
+         span_index = mappings->gaps.FindFirst(span_index + 1, min_gap)) {
+      const MappedSpan& existing_span = spans[span_index];
       uint64_t end_of_existing_mapping =
-          existing_mapping.mapped_addr + existing_mapping.size;
-
-      // Find next page boundary after end of this existing mapping.
-      uint64_t existing_page_offset = GetAlignedOffset(end_of_existing_mapping);
-      uint64_t next_page_boundary =
-          existing_page_offset
-              ? end_of_existing_mapping - existing_page_offset + page_alignment_
-              : end_of_existing_mapping;
-      // Compute where the new mapping would end if it were aligned to this
-      // page boundary.
-      uint64_t mapping_offset = GetAlignedOffset(range.real_addr);
-      uint64_t end_of_new_mapping =
-          next_page_boundary + mapping_offset + range.size;
-      uint64_t end_of_unmapped_space_after =
-          end_of_existing_mapping + existing_mapping.unmapped_space_after;
-
-      // Check if there's enough room in the unmapped space following the
-      // current existing mapping for the page-aligned mapping.
-      if (end_of_new_mapping > end_of_unmapped_space_after) continue;
-
-      range.mapped_addr = next_page_boundary + mapping_offset;
-      range.unmapped_space_after =
-          end_of_unmapped_space_after - end_of_new_mapping;
-      existing_mapping.unmapped_space_after =
-          range.mapped_addr - end_of_existing_mapping;
-    } else {
-      if (existing_mapping.unmapped_space_after < range.size) continue;
-      // Insert the new mapping range immediately after the existing one.
-      range.mapped_addr = existing_mapping.mapped_addr + existing_mapping.size;
-      range.unmapped_space_after =
-          existing_mapping.unmapped_space_after - range.size;
-      existing_mapping.unmapped_space_after = 0;
+          existing_span.mapped_addr + existing_span.size;
+      if (page_alignment_) {
+        // Find next page boundary after end of this existing mapping.
+        uint64_t existing_page_offset =
+            GetAlignedOffset(end_of_existing_mapping);
+        uint64_t next_page_boundary =
+            existing_page_offset ? end_of_existing_mapping -
+                                       existing_page_offset + page_alignment_
+                                 : end_of_existing_mapping;
+        // Compute where the new mapping would end if it were aligned to this
+        // page boundary.
+        uint64_t mapping_offset = GetAlignedOffset(range.real_addr);
+        uint64_t end_of_new_mapping =
+            next_page_boundary + mapping_offset + range.size;
+
+        // Check if there's enough room in the unmapped space following the
+        // current existing mapping for the page-aligned mapping.
+        if (end_of_new_mapping > end_of_unmapped_space_after(span_index)) {
+          continue;
+        }
+
+        range.mapped_addr = next_page_boundary + mapping_offset;
+      } else {
+        if (end_of_unmapped_space_after(span_index) - end_of_existing_mapping <
+            range.size) {
+          continue;
+        }
+        // Insert the new mapping range immediately after the existing one.
+        range.mapped_addr = end_of_existing_mapping;
+      }
+      break;
     }
 
-    mappings_.insert(++iter, range);
-    --iter;
-    real_addr_to_mapped_range_.insert(std::make_pair(range.real_addr, iter));
-    return true;
+    // If it still hasn't succeeded in mapping, it means there is no free space
+    // in quipper space large enough for a mapping of this size.
+    if (span_index == spans.size()) {
+      DumpToLog();
+      LOG(ERROR) << "Could not find space to map addr=" << std::hex
+                 << real_addr << " with size " << std::hex << size;
+      return false;
+    }
+    ++span_index;
   }
 
-  // If it still hasn't succeeded in mapping, it means there is no free space in
-  // quipper space large enough for a mapping of this size.
-  DumpToLog();
-  LOG(ERROR) << "Could not find space to map addr=" << std::hex << real_addr
-             << " with size " << std::hex << size;
-  return false;
+  spans.insert(spans.begin() + span_index, {range.mapped_addr, range.size});
+  // Most ranges go after the last one, which only changes two gaps. The
+  // indices of the spans after one inserted elsewhere all change.
+  if (span_index > 0 && span_index + 1 == spans.size()) {
+    const MappedSpan& previous = spans[span_index - 1];
+    const uint64_t end_of_previous = previous.mapped_addr + previous.size;
+    mappings->gaps.Set(span_index - 1, range.mapped_addr - end_of_previous);
+    mappings->gaps.Append(UINT64_MAX - (range.mapped_addr + range.size));
+  } else {
+    mappings->gaps.Build(spans);
+  }
+  MappingList& mutable_ranges = mappings->ranges;
+  mutable_ranges.insert(
+      std::lower_bound(mutable_ranges.begin(), mutable_ranges.end(),
+                       range.real_addr, RealAddrLess()),
+      range);
+  return true;
 }
 
 void AddressMapper::DumpToLog() const {
-  MappingList::const_iterator it;
-  for (it = mappings_.begin(); it != mappings_.end(); ++it) {
-    LOG(INFO) << " real_addr: 0x" << std::hex << it->real_addr << " mapped: 0x"
-              << std::hex << it->mapped_addr << " base: 0x" << std::hex
-              << it->mapped_addr << " id: 0x" << std::hex << it->id
-              << " size: 0x" << std::hex << it->size;
+  for (const MappedRange& range : mappings_->ranges) {
+    LOG(INFO) << " real_addr: 0x" << std::hex << range.real_addr
+              << " mapped: 0x" << std::hex << range.mapped_addr << " base: 0x"
+              << std::hex << range.mapped_addr << " id: 0x" << std::hex
+              << range.id << " size: 0x" << std::hex << range.size;
   }
 }
 
@@ -238,7 +267,7 @@ bool AddressMapper::GetMappedAddressAndListIterator(
   CHECK(iter);
 
   *iter = GetRangeContainingAddress(real_addr);
-  if (*iter == mappings_.end()) return false;
+  if (*iter == mappings_->ranges.end()) return false;
   *mapped_addr = (*iter)->mapped_addr + real_addr - (*iter)->real_addr;
   return true;
 }
@@ -246,7 +275,7 @@ bool AddressMapper::GetMappedAddressAndListIterator(
 void AddressMapper::GetMappedIDAndOffset(
     const uint64_t real_addr, MappingList::const_iterator real_addr_iter,
     uint64_t* id, uint64_t* offset) const {
-  CHECK(real_addr_iter != mappings_.end());
+  CHECK(real_addr_iter != mappings_->ranges.end());
   CHECK(id);
   CHECK(offset);
 
@@ -257,46 +286,117 @@ void AddressMapper::GetMappedIDAndOffset(
 uint64_t AddressMapper::GetMaxMappedLength() const {
   if (IsEmpty()) return 0;
 
-  uint64_t min = mappings_.begin()->mapped_addr;
-
-  MappingList::const_iterator iter = mappings_.end();
-  --iter;
-  uint64_t max = iter->mapped_addr + iter->size;
+  const std::vector<MappedSpan>& spans = mappings_->spans;
+  uint64_t min = spans.front().mapped_addr;
+  uint64_t max = spans.back().mapped_addr + spans.back().size;
 
   return max - min;
 }
 
-void AddressMapper::Unmap(MappingList::iterator mapping_iter) {
-  // Add the freed up space to the free space counter of the previous
-  // mapped region, if it exists.
-  if (mapping_iter != mappings_.begin()) {
-    const MappedRange& range = *mapping_iter;
-    MappingList::iterator previous_range_iter = std::prev(mapping_iter);
-    previous_range_iter->unmapped_space_after +=
-        range.size + range.unmapped_space_after;
+// static
+void AddressMapper::Unmap(Mappings* mappings, MappingList::iterator begin,
+                          MappingList::iterator end) {
+  if (begin == end) return;
+  // The freed up space becomes part of the unmapped space after the previous
+  // span in quipper space.
+  std::vector<uint64_t> mapped_addrs;
+  for (auto iter = begin; iter != end; ++iter) {
+    mapped_addrs.push_back(iter->mapped_addr);
+  }
+  std::sort(mapped_addrs.begin(), mapped_addrs.end());
+  std::vector<MappedSpan>& spans = mappings->spans;
+  spans.erase(std::remove_if(spans.begin(), spans.end(),
+                             [&mapped_addrs](const MappedSpan& span) {
+                               return std::binary_search(mapped_addrs.begin(),
+                                                         mapped_addrs.end(),
+                                                         span.mapped_addr);
+                             }),
+              spans.end());
+  mappings->gaps.Build(spans);
+  mappings->ranges.erase(begin, end);
+}
+
+void AddressMapper::GapTree::Build(const std::vector<MappedSpan>& spans) {
+  size_ = spans.size();
+  capacity_ = 1;
+  while (capacity_ < size_) capacity_ *= 2;
+  nodes_.assign(2 * capacity_, 0);
+  for (size_t i = 0; i < size_; ++i) {
+    const uint64_t end = spans[i].mapped_addr + spans[i].size;
+    nodes_[capacity_ + i] =
+        (i + 1 < size_ ? spans[i + 1].mapped_addr : UINT64_MAX) - end;
+  }
+  for (size_t i = capacity_ - 1; i > 0; --i) {
+    nodes_[i] = std::max(nodes_[2 * i], nodes_[2 * i + 1]);
+  }
+}
+
+void AddressMapper::GapTree::Set(size_t index, uint64_t gap) {
+  size_t i = capacity_ + index;
+  nodes_[i] = gap;
+  for (i /= 2; i > 0; i /= 2) {
+    nodes_[i] = std::max(nodes_[2 * i], nodes_[2 * i + 1]);
+  }
+}
+
+void AddressMapper::GapTree::Append(uint64_t gap) {
+  if (size_ == capacity_) {
+    // Double the leaves, and rebuild the nodes above them.
+    const size_t capacity = std::max<size_t>(1, 2 * capacity_);
+    std::vector<uint64_t> nodes(2 * capacity, 0);
+    std::copy(nodes_.begin() + capacity_, nodes_.end(),
+              nodes.begin() + capacity);
+    capacity_ = capacity;
+    nodes_.swap(nodes);
+    for (size_t i = capacity_ - 1; i > 0; --i) {
+      nodes_[i] = std::max(nodes_[2 * i], nodes_[2 * i + 1]);
+    }
+  }
+  Set(size_++, gap);
+}
+
+size_t AddressMapper::GapTree::FindFirst(size_t from, uint64_t min_gap) const {
+  if (from >= size_) return size_;
+  // Walk up from the leaf |from| until a node to its right, or the leaf
+  // itself, has a large enough gap, then down to the first such leaf.
+  size_t i = capacity_ + from;
+  if (nodes_[i] < min_gap) {
+    while (true) {
+      // Move to the next subtree to the right, climbing while this is a right
+      // child.
+      while (i % 2 == 1) {
+        i /= 2;
+        if (i == 0) return size_;
+      }
+      ++i;
+      if (nodes_[i] >= min_gap) break;
+    }
+    while (i < capacity_) {
+      i = nodes_[2 * i] >= min_gap ? 2 * i : 2 * i + 1;
+    }
   }
-  real_addr_to_mapped_range_.erase(mapping_iter->real_addr);
-  mappings_.erase(mapping_iter);
+  // The leaves past the last span are 0, so the leaf found is a span's.
+  return i - capacity_;
 }
 
 AddressMapper::MappingList::const_iterator
 AddressMapper::GetRangeContainingAddress(uint64_t real_addr) const {
+  const MappingList& ranges = mappings_->ranges;
   // Find the first range that has a higher real address than the given one.
-  MappingMap::const_iterator target_map_iter =
-      real_addr_to_mapped_range_.upper_bound(real_addr);
+  auto iter =
+      std::upper_bound(ranges.begin(), ranges.end(), real_addr, RealAddrLess());
 
-  if (target_map_iter == real_addr_to_mapped_range_.begin()) {
+  if (iter == ranges.begin()) {
     // The lowest real address in existing mappings is higher than the new
     // mapping address, so |real_addr| does not fall into any mapping.
-    return mappings_.end();
+    return ranges.end();
   }
 
   // Otherwise, the previous mapping could possibly contain |real_addr|.
-  --target_map_iter;
-  MappingList::const_iterator list_iter = target_map_iter->second;
-  if (!list_iter->ContainsAddress(real_addr)) return mappings_.end();
+  --iter;
+  if (!iter->ContainsAddress(real_addr)) return ranges.end();
 
-  return list_iter;
+  return iter;
 }
 
 }  // namespace quipper
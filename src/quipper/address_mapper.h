@@ -8,8 +8,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include <list>
-#include <map>
+#include <memory>
+#include <vector>
 
 namespace quipper {
 
@@ -18,14 +18,17 @@ class AddressMapper {
   struct MappedRange;
 
  public:
-  AddressMapper() : page_alignment_(0) {}
+  AddressMapper()
+      : mappings_(std::make_shared<Mappings>()), page_alignment_(0) {}
 
   // Copy constructor: copies mappings from |source| to this AddressMapper. This
   // is useful for copying mappings from parent to child process upon fork(). It
   // is also useful to copy kernel mappings to any process that is created.
+  // The copies share the mappings until one of them maps a range.
   AddressMapper(const AddressMapper& other);
 
-  typedef std::list<MappedRange> MappingList;
+  // Sorted by real address. Iterators into it are invalidated by MapWithID().
+  typedef std::vector<MappedRange> MappingList;
 
   // Maps a new address range [real_addr, real_addr + length) to quipper space.
   // |id| is an identifier value to be stored along with the mapping.
@@ -64,10 +67,10 @@ class AddressMapper {
                             uint64_t* id, uint64_t* offset) const;
 
   // Returns true if there are no mappings.
-  bool IsEmpty() const { return mappings_.empty(); }
+  bool IsEmpty() const { return mappings_->ranges.empty(); }
 
   // Returns the number of address ranges that are currently mapped.
-  size_t GetNumMappedRanges() const { return mappings_.size(); }
+  size_t GetNumMappedRanges() const { return mappings_->ranges.size(); }
 
   // Returns the maximum length of quipper space containing mapped areas.
   // There may be gaps in between blocks.
@@ -88,8 +91,6 @@ class AddressMapper {
   void DumpToLog() const;
 
  private:
-  typedef std::map<uint64_t, MappingList::iterator> MappingMap;
-
   struct MappedRange {
     uint64_t real_addr;
     uint64_t mapped_addr;
@@ -98,9 +99,6 @@ class AddressMapper {
     uint64_t id;
     uint64_t offset_base;
 
-    // Length of unmapped space after this range.
-    uint64_t unmapped_space_after;
-
     // Determines if this range intersects another range in real space.
     inline bool Intersects(const MappedRange& range) const {
       return (real_addr <= range.real_addr + range.size - 1) &&
@@ -126,14 +124,63 @@ class AddressMapper {
     }
   };
 
-  // Returns an iterator to a MappedRange in |mappings_| that contains
-  // |real_addr|. Returns |mappings_.end()| if no range contains |real_addr|.
+  // The quipper space taken by a mapped range.
+  struct MappedSpan {
+    uint64_t mapped_addr;
+    uint64_t size;
+  };
+
+  // The unmapped space after each of the spans of a Mappings, in a tree of
+  // maxima that finds the first span followed by enough of it in logarithmic
+  // time.
+  class GapTree {
+   public:
+    // Rebuilds the tree for |spans|.
+    void Build(const std::vector<MappedSpan>& spans);
+
+    // Sets the unmapped space after the span |index|.
+    void Set(size_t index, uint64_t gap);
+
+    // Adds the unmapped space after a new last span.
+    void Append(uint64_t gap);
+
+    // Returns the index of the first span from |from| on that is followed by
+    // at least |min_gap| of unmapped space, or the number of spans if none is.
+    size_t FindFirst(size_t from, uint64_t min_gap) const;
+
+   private:
+    // The number of spans.
+    size_t size_ = 0;
+    // The number of leaves of |nodes_|, a power of two.
+    size_t capacity_ = 0;
+    // |nodes_[1]| is the root, the children of |nodes_[i]| are |nodes_[2 * i]|
+    // and |nodes_[2 * i + 1]|, and the leaves, from |nodes_[capacity_]| on, are
+    // the gaps. Each node holds the largest gap of its leaves.
+    std::vector<uint64_t> nodes_;
+  };
+
+  struct Mappings {
+    MappingList ranges;
+    // The spans of |ranges|, sorted by mapped address. The unmapped space after
+    // a span ends at the next span, or at the end of quipper space.
+    std::vector<MappedSpan> spans;
+    // The unmapped space after each of |spans|.
+    GapTree gaps;
+  };
+
+  // Returns the mappings to be modified, after copying them if they are
+  // shared with another AddressMapper.
+  Mappings* MutableMappings();
+
+  // Returns an iterator to a MappedRange in |mappings_->ranges| that contains
+  // |real_addr|. Returns |mappings_->ranges.end()| if no range contains
+  // |real_addr|.
   MappingList::const_iterator GetRangeContainingAddress(
       uint64_t real_addr) const;
 
-  // Removes an existing address mapping, given by an iterator pointing to an
-  // element of |mappings_|.
-  void Unmap(MappingList::iterator mapping_iter);
+  // Removes the ranges [|begin|, |end|) of |mappings|, along with their spans.
+  static void Unmap(Mappings* mappings, MappingList::iterator begin,
+                    MappingList::iterator end);
 
   // Given an address, and a nonzero, power-of-two |page_alignment_| value,
   // returns the offset of the address from the start of the page it is on.
@@ -143,12 +190,10 @@ class AddressMapper {
     return addr & (page_alignment_ - 1);
   }
 
-  // Container for all the existing mappings.
-  MappingList mappings_;
-
-  // Maps real addresses to iterators pointing to entries within |mappings_|.
-  // Must maintain a 1:1 entry correspondence with |mappings_|.
-  MappingMap real_addr_to_mapped_range_;
+  // All the existing mappings, shared with the AddressMappers copied from this
+  // one, or that this one was copied from, until either is modified. Never
+  // null.
+  std::shared_ptr<Mappings> mappings_;
 
   // If set to nonzero, use this as a mapping page boundary. If a mapping does
   // not begin at a multiple of this value, the remapped address should be given
@@ -289,6 +289,67 @@ TEST_F(AddressMapperTest, OverlapBig) {
   EXPECT_EQ(kBigRegion.size, mapper_->GetMaxMappedLength());
 }
 
+// Copies share their mappings until one of them maps a range, which must not
+// affect the other.
+TEST_F(AddressMapperTest, CopiesAreIndependent) {
+  ASSERT_TRUE(MapRange(kMapRanges[0], false, false));
+  ASSERT_TRUE(MapRange(kMapRanges[1], false, false));
+
+  AddressMapper child(*mapper_);
+  EXPECT_EQ(2U, child.GetNumMappedRanges());
+
+  // Split the first range in the child, and map another range in the parent.
+  const Range kChildRange(kMapRanges[0].addr + 0x1000, 0x1000, 0x1234, 0);
+  ASSERT_TRUE(child.MapWithID(kChildRange.addr, kChildRange.size,
+                              kChildRange.id, 0, true, false));
+  ASSERT_TRUE(MapRange(kMapRanges[2], false, false));
+  EXPECT_EQ(4U, child.GetNumMappedRanges());
+  EXPECT_EQ(3U, mapper_->GetNumMappedRanges());
+
+  // The parent still has the whole first range and the new one.
+  TestMappedRange(kMapRanges[0], 0);
+  TestMappedRange(kMapRanges[1], kMapRanges[0].size);
+  TestMappedRange(kMapRanges[2], kMapRanges[0].size + kMapRanges[1].size);
+
+  // The child has the split range, and not the parent's new one.
+  uint64_t mapped_addr;
+  AddressMapper::MappingList::const_iterator iter;
+  ASSERT_TRUE(child.GetMappedAddressAndListIterator(kChildRange.addr,
+                                                    &mapped_addr, &iter));
+  uint64_t id, offset;
+  child.GetMappedIDAndOffset(kChildRange.addr, iter, &id, &offset);
+  EXPECT_EQ(kChildRange.id, id);
+  EXPECT_EQ(0, offset);
+  ASSERT_TRUE(child.GetMappedAddressAndListIterator(kMapRanges[0].addr,
+                                                    &mapped_addr, &iter));
+  child.GetMappedIDAndOffset(kMapRanges[0].addr, iter, &id, &offset);
+  EXPECT_EQ(kMapRanges[0].id, id);
+  EXPECT_FALSE(child.GetMappedAddressAndListIterator(kMapRanges[2].addr,
+                                                     &mapped_addr, &iter));
+}
+
+// Replacing many ranges with one range covering all of them leaves only the
+// new range, in the quipper space freed by the old ones.
+TEST_F(AddressMapperTest, OverlapMany) {
+  const Range kFirstRange(0x10000, 0x1000, 0x1, 0);
+  ASSERT_TRUE(MapRange(kFirstRange, false, false));
+  for (uint64_t i = 0; i < 64; ++i) {
+    ASSERT_TRUE(
+        MapRange(Range(0x100000 + i * 0x2000, 0x1000, i, 0), false, false));
+  }
+  EXPECT_EQ(65U, mapper_->GetNumMappedRanges());
+  const Range kBigRange(0x100000, 0x80000, 0xb16, 0);
+  ASSERT_TRUE(MapRange(kBigRange, true, false));
+  EXPECT_EQ(2U, mapper_->GetNumMappedRanges());
+  TestMappedRange(kFirstRange, 0);
+  TestMappedRange(kBigRange, 0x1000);
+
+  const Range kLastRange(0x20000, 0x1000, 0x2, 0);
+  ASSERT_TRUE(MapRange(kLastRange, false, false));
+  TestMappedRange(kLastRange, 0x81000);
+  EXPECT_EQ(0x82000U, mapper_->GetMaxMappedLength());
+}
+
 // Test a mapping at the end of memory space.
 TEST_F(AddressMapperTest, EndOfMemory) {
   // A region that extends to the end of the address space.
@@ -412,6 +473,41 @@ TEST_F(AddressMapperTest, NotPageAligned) {
   TestMappedRange(kUnalignedRanges[3], 0x012127f0);
 }
 
+// Freed space is reused by the first later range that fits in it, with a
+// nonzero page alignment parameter.
+TEST_F(AddressMapperTest, ReusesFirstFittingHole) {
+  mapper_->set_page_alignment(0x1000);
+
+  // Many ranges are mapped one after the other.
+  for (uint64_t i = 0; i < 100; ++i) {
+    ASSERT_TRUE(MapRange(Range(0x100000 * (i + 1), 0x1000, i, 0), true, false));
+  }
+  for (uint64_t i = 0; i < 100; ++i) {
+    TestMappedRange(Range(0x100000 * (i + 1), 0x1000, i, 0), 0x1000 * i);
+  }
+
+  // Replacing the second range with a larger one moves it to the end, and
+  // leaves a hole of one page.
+  const Range kLarger(0x1ff000, 0x3000, 100, 0);
+  ASSERT_TRUE(MapRange(kLarger, true, false));
+  TestMappedRange(kLarger, 0x64000);
+
+  // A smaller range goes in the hole, and the next one, which would not be
+  // page aligned in what is left of it, goes at the end.
+  const Range kSmall0(0x10000000, 0x800, 101, 0);
+  const Range kSmall1(0x10100000, 0x800, 102, 0);
+  ASSERT_TRUE(MapRange(kSmall0, true, false));
+  ASSERT_TRUE(MapRange(kSmall1, true, false));
+  TestMappedRange(kSmall0, 0x1000);
+  TestMappedRange(kSmall1, 0x67000);
+
+  // Unaligned ranges fill what is left of the hole.
+  mapper_->set_page_alignment(0);
+  const Range kSmall2(0x10200000, 0x800, 103, 0);
+  ASSERT_TRUE(MapRange(kSmall2, true, false));
+  TestMappedRange(kSmall2, 0x1800);
+}
+
 // Have one mapping in the middle of another, with a nonzero page alignment
 // parameter.
 TEST_F(AddressMapperTest, SplitRangeWithPageAlignment) {
@@ -1,5 +1,6 @@
 #include "arm_spe_decoder.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <ios>
@@ -40,6 +41,9 @@ const uint64_t kAddrPktHdrIndexDataVirt = 0x2;
 const uint64_t kAddrPktHdrIndexDataPhys = 0x3;
 const uint64_t kAddrPktHdrIndexPrevBr = 0x4;
 
+// Whether a payload can be read as the low bytes of a native word.
+constexpr bool kIsLittleEndian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
 // Returns the payload size according to the given header.
 inline size_t GetPayloadSize(uint8_t header) {
   return 1U << ((header & Mask(5, 4)) >> 4);
@@ -54,22 +58,54 @@ ArmSpeDecoder::ArmSpeDecoder(std::string_view buf, bool is_cross_endian)
       is_cross_endian_(is_cross_endian) {}
 
 bool ArmSpeDecoder::NextRecord(struct Record* ret_record) {
-  if (ret_record == nullptr || buf_i_ >= buf_.size()) {
+  if (ret_record == nullptr) {
+    return false;
+  }
+  uint64_t events;
+  while (DecodeRecord(ret_record, &events)) {
+    if (Keeps(*ret_record, events)) {
+      return true;
+    }
+    ++num_filtered_records_;
+  }
+  return false;
+}
+
+bool ArmSpeDecoder::Keeps(const Record& record, uint64_t events) const {
+  if ((events & filter_.events) != filter_.events ||
+      record.total_lat < filter_.min_total_lat) {
+    return false;
+  }
+  if (filter_.ops == kAllOps) {
+    return true;
+  }
+  return (record.op.is_other && (filter_.ops & kOpOther)) ||
+         (record.op.is_ldst && (filter_.ops & kOpLoadStore)) ||
+         (record.op.is_br_eret && (filter_.ops & kOpBranch));
+}
+
+bool ArmSpeDecoder::DecodeRecord(struct Record* ret_record, uint64_t* events) {
+  if (buf_i_ >= buf_.size()) {
     return false;
   }
 
   Record record{};
+  *events = 0;
   // One record consists of several packets. So loop till finding the end-type
   // packet or meeting the end of the trace.
   for (Packet p{}; !p.is_end_type && buf_i_ < buf_.size(); buf_i_ += p.size) {
     p = Packet{};
     p.header = buf_[buf_i_];
 
-    // Padding packet
+    // Padding packet. Padding comes in runs, e.g. up to the end of a buffer,
+    // so the whole run is skipped at once.
     if (p.header == 0x0) {
       if (!HandlePacketPadding(&p)) {
         return false;
       }
+      const char* begin = buf_.data() + buf_i_ + 1;
+      const char* end = buf_.data() + buf_.size();
+      p.size += std::find_if(begin, end, [](char c) { return c != 0; }) - begin;
       continue;
     }
 
@@ -94,6 +130,7 @@ bool ArmSpeDecoder::NextRecord(struct Record* ret_record) {
       if (!HandlePacketEvent(&p, &record)) {
         return false;
       }
+      *events = p.payload;
       continue;
     }
 
@@ -173,6 +210,14 @@ bool ArmSpeDecoder::NextRecord(struct Record* ret_record) {
   return true;
 }
 
+size_t ArmSpeDecoder::NextRecords(struct Record* records, size_t num_records) {
+  size_t n = 0;
+  while (n < num_records && NextRecord(&records[n])) {
+    ++n;
+  }
+  return n;
+}
+
 bool ArmSpeDecoder::HandlePacketPadding(struct Packet* p) {
   p->size = 1;
   return true;
@@ -391,6 +436,19 @@ bool ArmSpeDecoder::SetPayloadAndSize(struct Packet* p) {
   }
 
   size_t pos = buf_i_ + header_size;
+  if (kIsLittleEndian && !is_cross_endian_ &&
+      buf_.size() - pos >= sizeof(uint64_t)) {
+    // Fast path: load a whole word and keep the low bytes of the payload.
+    uint64_t payload;
+    memcpy(&payload, buf_.data() + pos, sizeof(payload));
+    if (payload_size < sizeof(payload)) {
+      payload &= (1ULL << (8 * payload_size)) - 1;
+    }
+    p->payload = payload;
+    p->payload_size = payload_size;
+    p->size = header_size + p->payload_size;
+    return true;
+  }
   switch (payload_size) {
     case 1: {
       uint8_t payload;
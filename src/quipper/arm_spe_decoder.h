@@ -113,14 +113,62 @@ class ArmSpeDecoder {
     uint64_t source;
   };
 
+  // Bits of the event packet payload, see RecordEvent, for RecordFilter.
+  static constexpr uint64_t kEventRetired = 1ULL << 1;
+  static constexpr uint64_t kEventL1dRefill = 1ULL << 3;
+  static constexpr uint64_t kEventTlbWalk = 1ULL << 5;
+  static constexpr uint64_t kEventBrMisPred = 1ULL << 7;
+  static constexpr uint64_t kEventLlcAccess = 1ULL << 8;
+  static constexpr uint64_t kEventLlcMiss = 1ULL << 9;
+  static constexpr uint64_t kEventRemoteAccess = 1ULL << 10;
+
+  // Operation types for RecordFilter, see RecordOp.
+  static constexpr uint32_t kOpOther = 1 << 0;
+  static constexpr uint32_t kOpLoadStore = 1 << 1;
+  static constexpr uint32_t kOpBranch = 1 << 2;
+  static constexpr uint32_t kAllOps = kOpOther | kOpLoadStore | kOpBranch;
+
+  // Selects the records returned by the decoder. The other records are parsed
+  // and skipped without being returned. The default filter keeps all records.
+  struct RecordFilter {
+    // The event bits, e.g. kEventLlcMiss, that a record must all have.
+    uint64_t events = 0;
+    // The operation types a record may have. Unless all are allowed, records
+    // without an operation packet are skipped.
+    uint32_t ops = kAllOps;
+    // The lowest total latency of a record.
+    uint32_t min_total_lat = 0;
+
+    bool KeepsAll() const {
+      return events == 0 && ops == kAllOps && min_total_lat == 0;
+    }
+  };
+
   ArmSpeDecoder(std::string_view buf, bool is_cross_endian);
 
+  void set_filter(const RecordFilter& filter) { filter_ = filter; }
+
+  // Returns the number of records skipped so far because of the filter.
+  size_t num_filtered_records() const { return num_filtered_records_; }
+
   // Sets fields of the given record to the next record parsed from the
   // previously given SPE trace. It will return false if it encounters invalid
   // data or reaching the end of the trace.
   bool NextRecord(struct Record* record);
 
+  // Sets records[0..n) to the next n records parsed from the trace, where n is
+  // at most num_records, and returns n. Fewer records are returned only upon
+  // invalid data or reaching the end of the trace.
+  size_t NextRecords(struct Record* records, size_t num_records);
+
  private:
+  // Sets |record| to the next record parsed from the trace, and |events| to
+  // the raw payload of its event packet, regardless of the filter.
+  bool DecodeRecord(struct Record* record, uint64_t* events);
+
+  // Returns whether the filter keeps |record| with event packet |events|.
+  bool Keeps(const Record& record, uint64_t events) const;
+
   struct Packet {
     uint8_t header;
     uint8_t ext_header;
@@ -162,6 +210,9 @@ class ArmSpeDecoder {
   // Represents that if the given SPE trace is encoded in a machine that has
   // different endian than the current one.
   bool is_cross_endian_;
+
+  RecordFilter filter_;
+  size_t num_filtered_records_ = 0;
 };
 
 }  // namespace quipper
@@ -162,6 +162,82 @@ TEST(ArmSpeDecoderTest, CorrectlyParseRecords) {
       }));
 }
 
+TEST(ArmSpeDecoderTest, ParsesRecordsInBatches) {
+  std::string trace;
+  for (int i = 0; i < 3; ++i) trace += GenerateBinaryTrace(SampleSPEPackets);
+  ArmSpeDecoder one_by_one(trace, false);
+  ArmSpeDecoder batched(trace, false);
+
+  ArmSpeDecoder::Record expected[6];
+  for (auto& record : expected) {
+    ASSERT_TRUE(one_by_one.NextRecord(&record));
+  }
+  ArmSpeDecoder::Record records[4];
+  ASSERT_EQ(4, batched.NextRecords(records, 4));
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(CheckEqual(records[i], expected[i])) << i;
+  }
+  // The last batch stops at the end of the trace.
+  ASSERT_EQ(2, batched.NextRecords(records, 4));
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(CheckEqual(records[i], expected[4 + i])) << i;
+  }
+  EXPECT_EQ(0, batched.NextRecords(records, 4));
+}
+
+// Payloads at the end of the trace, where a whole word can't be loaded, are
+// read like those before them.
+TEST(ArmSpeDecoderTest, ParsesPayloadsAtEndOfTrace) {
+  std::string trace = GenerateBinaryTrace({
+      "65 80 5f 00 00",  // CONTEXT 0x5f80 el2
+      "98 0c 00",        // LAT 12 TOT
+      "99 04 00",        // LAT 4 ISSUE
+  });
+  ArmSpeDecoder decoder(trace, false);
+  ArmSpeDecoder::Record record;
+  ASSERT_TRUE(decoder.NextRecord(&record));
+  EXPECT_EQ(0x5f80, record.context.id);
+  EXPECT_EQ(12, record.total_lat);
+  EXPECT_EQ(4, record.issue_lat);
+}
+
+TEST(ArmSpeDecoderTest, SkipsFilteredRecords) {
+  std::string trace = GenerateBinaryTrace(SampleSPEPackets);
+  ArmSpeDecoder::Record record;
+
+  // Record 1 is the only one with a total latency of at least 15.
+  ArmSpeDecoder::RecordFilter filter;
+  filter.min_total_lat = 15;
+  ArmSpeDecoder by_latency(trace, false);
+  by_latency.set_filter(filter);
+  ASSERT_TRUE(by_latency.NextRecord(&record));
+  EXPECT_EQ(17, record.total_lat);
+  EXPECT_FALSE(by_latency.NextRecord(&record));
+  EXPECT_EQ(1, by_latency.num_filtered_records());
+
+  // Record 0 is the only load.
+  filter = ArmSpeDecoder::RecordFilter();
+  filter.ops = ArmSpeDecoder::kOpLoadStore;
+  ArmSpeDecoder by_op(trace, false);
+  by_op.set_filter(filter);
+  ASSERT_TRUE(by_op.NextRecord(&record));
+  EXPECT_EQ(12, record.total_lat);
+  EXPECT_FALSE(by_op.NextRecord(&record));
+
+  // Both records retired, and none missed the last level cache.
+  filter = ArmSpeDecoder::RecordFilter();
+  filter.events = ArmSpeDecoder::kEventRetired;
+  ArmSpeDecoder by_event(trace, false);
+  by_event.set_filter(filter);
+  ArmSpeDecoder::Record records[2];
+  EXPECT_EQ(2, by_event.NextRecords(records, 2));
+  filter.events |= ArmSpeDecoder::kEventLlcMiss;
+  ArmSpeDecoder by_events(trace, false);
+  by_events.set_filter(filter);
+  EXPECT_EQ(0, by_events.NextRecords(records, 2));
+  EXPECT_EQ(2, by_events.num_filtered_records());
+}
+
 TEST(ArmSpeDecoderTest, ReturnFalseUponInvalidData) {
   std::string trace = GenerateBinaryTrace({"ab cd ef ff 99 88 77 66 55 44"});
   ArmSpeDecoder decoder(trace, false);
@@ -4,20 +4,25 @@
 
 #include "base/logging.h"
 
+#include <atomic>
+
 namespace logging {
 
 namespace {
 
 // The minimum logging level. Anything higher than this will be logged. Set to
-// negative values to enable verbose logging.
-int g_min_log_level = INFO;
+// negative values to enable verbose logging. Atomic, since it can be changed
+// while other threads log.
+std::atomic<int> g_min_log_level{INFO};
 
 }  // namespace
 
-void SetMinLogLevel(int level) { g_min_log_level = level; }
+void SetMinLogLevel(int level) {
+  g_min_log_level.store(level, std::memory_order_relaxed);
+}
 
-int GetMinLogLevel() { return g_min_log_level; }
+int GetMinLogLevel() { return g_min_log_level.load(std::memory_order_relaxed); }
 
-int GetVlogVerbosity() { return -g_min_log_level; }
+int GetVlogVerbosity() { return -GetMinLogLevel(); }
 
 }  // namespace logging
@@ -8,11 +8,20 @@
 #include <openssl/md5.h>
 #include <sys/stat.h>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>  
+#include <memory>
+#include <string>
+#include <unordered_map>
 
 #include "base/logging.h"
 
@@ -21,6 +30,12 @@ namespace {
 // Number of hex digits in a byte.
 const int kNumHexDigitsInByte = 2;
 
+// The longest string whose MD5 prefix is cached.
+const size_t kMaxCachedMd5PrefixInputSize = 4096;
+
+// The most MD5 prefixes cached by a thread. The cache starts over when full.
+const size_t kMaxCachedMd5Prefixes = 64 * 1024;
+
 }  // namespace
 
 namespace quipper {
@@ -30,11 +45,12 @@ static uint64_t Md5Prefix(const unsigned char* data,
   uint64_t digest_prefix = 0;
   unsigned char digest[MD5_DIGEST_LENGTH + 1];
 
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-  EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
-  EVP_DigestUpdate(ctx, data, length);
-  EVP_DigestFinal(ctx, digest, NULL);
-  EVP_MD_CTX_free(ctx);
+  // Reuse a context per thread rather than allocating one for each digest.
+  static thread_local std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> ctx(
+      EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  EVP_DigestInit_ex(ctx.get(), EVP_md5(), NULL);
+  EVP_DigestUpdate(ctx.get(), data, length);
+  EVP_DigestFinal_ex(ctx.get(), digest, NULL);
   // We need 64-bits / # of bits in a byte.
   for (size_t i = 0; i < sizeof(uint64_t); i++) {
     digest_prefix = (digest_prefix << 8) | digest[i];
@@ -52,6 +68,17 @@ uint64_t Md5Prefix(const std::vector<char>& input) {
   return Md5Prefix(data, input.size());
 }
 
+uint64_t CachedMd5Prefix(const std::string& input) {
+  if (input.size() > kMaxCachedMd5PrefixInputSize) return Md5Prefix(input);
+  static thread_local std::unordered_map<std::string, uint64_t> cache;
+  auto it = cache.find(input);
+  if (it != cache.end()) return it->second;
+  if (cache.size() >= kMaxCachedMd5Prefixes) cache.clear();
+  const uint64_t md5_prefix = Md5Prefix(input);
+  cache.emplace(input, md5_prefix);
+  return md5_prefix;
+}
+
 std::string RawDataToHexString(const u8* array, size_t length) {
   // Convert the bytes to hex digits one at a time.
   // There will be kNumHexDigitsInByte hex digits, and 1 char for NUL.
@@ -119,5 +146,25 @@ template void ByteSwap<unsigned long>(unsigned long*);
 template void ByteSwap<long long>(long long*);
 template void ByteSwap<unsigned long long>(unsigned long long*);
 
+void ByteSwapArray(uint64_t* values, size_t count) {
+  size_t i = 0;
+#if defined(__SSSE3__)
+  // Reverses the bytes of each of the two values in a vector.
+  const __m128i reverse =
+      _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+  for (; i + 2 <= count; i += 2) {
+    __m128i* pair = reinterpret_cast<__m128i*>(values + i);
+    _mm_storeu_si128(pair,
+                     _mm_shuffle_epi8(_mm_loadu_si128(pair), reverse));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 2 <= count; i += 2) {
+    uint8_t* pair = reinterpret_cast<uint8_t*>(values + i);
+    vst1q_u8(pair, vrev64q_u8(vld1q_u8(pair)));
+  }
+#endif
+  for (; i < count; ++i) values[i] = bswap_64(values[i]);
+}
+
 
 }  // namespace quipper
@@ -21,6 +21,11 @@ namespace quipper {
 template <class T>
 void ByteSwap(T* input);
 
+// Swaps the byte order of each of the |count| values at |values|. Long arrays,
+// such as callchains, are swapped several values at a time when the target
+// supports it.
+void ByteSwapArray(uint64_t* values, size_t count);
+
 // Swaps byte order of |value| if the |swap| flag is set. This function is
 // trivial but it avoids filling code with "if (swap) { ... } " statements.
 template <typename T>
@@ -39,6 +44,11 @@ size_t GetNumBits(const T& value) {
 uint64_t Md5Prefix(const std::string& input);
 uint64_t Md5Prefix(const std::vector<char>& input);
 
+// Like Md5Prefix(), but remembers the results for short strings, such as
+// filenames and comms, which are often hashed over and over. The results are
+// kept per thread, so they are looked up without locking.
+uint64_t CachedMd5Prefix(const std::string& input);
+
 // Returns a string that represents |array| in hexadecimal.
 std::string RawDataToHexString(const u8* array, size_t length);
 
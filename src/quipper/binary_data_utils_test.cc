@@ -4,6 +4,9 @@
 
 #include "binary_data_utils.h"
 
+#include <string>
+#include <vector>
+
 #include "compat/test.h"
 #include "test_utils.h"
 
@@ -22,6 +25,31 @@ TEST(BinaryDataUtilsTest, MD5) {
             0xe4d909c290d0fb1cLL);
 }
 
+TEST(BinaryDataUtilsTest, CachedMd5Prefix) {
+  // Cached and uncached results, for short strings and for one too long to be
+  // cached, are the same.
+  for (int i = 0; i < 2; ++i) {
+    for (const std::string& input :
+         {std::string(), std::string("/usr/lib/libc.so.6"),
+          std::string(100000, 'x')}) {
+      EXPECT_EQ(Md5Prefix(input), CachedMd5Prefix(input));
+    }
+  }
+  EXPECT_EQ(0x0000000018e6137aLL, CachedMd5Prefix("jk8ssl"));
+}
+
+TEST(BinaryDataUtilsTest, ByteSwapArray) {
+  // Odd lengths leave a value after the last whole vector.
+  for (size_t count : {0, 1, 2, 5, 16}) {
+    std::vector<uint64_t> values(count);
+    for (size_t i = 0; i < count; ++i) values[i] = 0x0102030405060708ULL * i;
+    std::vector<uint64_t> expected = values;
+    for (uint64_t& value : expected) ByteSwap(&value);
+    ByteSwapArray(values.data(), values.size());
+    EXPECT_EQ(expected, values) << count;
+  }
+}
+
 TEST(BinaryDataUtilsTest, Align) {
   EXPECT_EQ(12, Align<4>(10));
   EXPECT_EQ(12, Align<4>(12));
@@ -29,6 +29,13 @@ bool BufferReader::ReadData(const size_t size, void* dest) {
   return true;
 }
 
+const void* BufferReader::GetContiguousData(size_t offset, size_t size) const {
+  if (buffer_ == nullptr || offset > size_ || size > size_ - offset) {
+    return nullptr;
+  }
+  return buffer_ + offset;
+}
+
 bool BufferReader::ReadString(size_t size, std::string* str) {
   if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
 
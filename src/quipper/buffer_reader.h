@@ -24,6 +24,8 @@ class BufferReader : public DataReader {
 
   bool ReadData(const size_t size, void* dest) override;
 
+  const void* GetContiguousData(size_t offset, size_t size) const override;
+
   // Reads |size| bytes of the buffer as a null-terminated string into |str|.
   // Trailing nulls, if any, are not added to the string, but they are skipped
   // over. If there is no null terminator within these |size| bytes, then the
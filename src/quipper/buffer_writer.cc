@@ -33,6 +33,11 @@ bool BufferWriter::WriteString(const std::string& str, const size_t size) {
   return true;
 }
 
+void* BufferWriter::GetContiguousBuffer(size_t offset, size_t size) {
+  if (offset > size_ || size > size_ - offset) return nullptr;
+  return buffer_ + offset;
+}
+
 bool BufferWriter::CanWriteSize(size_t data_size) {
   return Tell() + data_size <= size();
 }
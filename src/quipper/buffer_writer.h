@@ -26,6 +26,8 @@ class BufferWriter : public DataWriter {
 
   bool WriteString(const std::string& str, const size_t size) override;
 
+  void* GetContiguousBuffer(size_t offset, size_t size) override;
+
  private:
   bool CanWriteSize(size_t data_size) override;
 
@@ -273,4 +273,17 @@ TEST(BufferWriterTest, NoWritingStringOutOfBounds) {
             std::vector<char>(buffer.begin() + 61, buffer.end()));
 }
 
+// Direct access is given to ranges within the buffer only.
+TEST(BufferWriterTest, GetContiguousBuffer) {
+  std::vector<char> buffer(100);
+  BufferWriter writer(buffer.data(), buffer.size());
+  writer.SeekSet(10);
+  EXPECT_EQ(buffer.data() + 20, writer.GetContiguousBuffer(20, 80));
+  EXPECT_EQ(buffer.data() + 100, writer.GetContiguousBuffer(100, 0));
+  EXPECT_EQ(nullptr, writer.GetContiguousBuffer(20, 81));
+  EXPECT_EQ(nullptr, writer.GetContiguousBuffer(101, 0));
+  // The write pointer hasn't moved.
+  EXPECT_EQ(10, writer.Tell());
+}
+
 }  // namespace quipper
@@ -0,0 +1,156 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "build_id_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "base/logging.h"
+#include "binary_data_utils.h"
+
+namespace quipper {
+
+namespace {
+
+// The first line of a cache file.
+const char kCacheFileHeader[] = "quipper-build-id-cache 1";
+
+// Stands for an empty build ID, i.e. a file without one.
+const char kNoBuildId[] = "-";
+
+}  // namespace
+
+size_t BuildIdCache::KeyHash::operator()(const Key& key) const {
+  uint64_t h = key.dev;
+  for (uint64_t value : {key.ino, static_cast<uint64_t>(key.mtime_ns),
+                         static_cast<uint64_t>(key.size)}) {
+    h = (h ^ value) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+  }
+  return static_cast<size_t>(h);
+}
+
+// static
+BuildIdCache::Key BuildIdCache::KeyFromStat(const struct stat& s) {
+  Key key;
+  key.dev = s.st_dev;
+  key.ino = s.st_ino;
+  key.mtime_ns = static_cast<int64_t>(s.st_mtim.tv_sec) * 1000000000 +
+                 s.st_mtim.tv_nsec;
+  key.size = s.st_size;
+  return key;
+}
+
+// static
+bool BuildIdCache::ReadEntries(const std::string& path, EntryMap* entries,
+                               bool* missing) {
+  *missing = false;
+  std::ifstream file(path);
+  if (!file) {
+    *missing = errno == ENOENT;
+    if (!*missing) LOG(ERROR) << "Failed to open build ID cache " << path;
+    return false;
+  }
+  std::string line;
+  if (!std::getline(file, line) || line != kCacheFileHeader) {
+    LOG(ERROR) << path << " is not a build ID cache";
+    return false;
+  }
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    Key key;
+    std::string hex;
+    if (!(fields >> key.dev >> key.ino >> key.mtime_ns >> key.size >> hex)) {
+      LOG(WARNING) << "Skipping malformed build ID cache line: " << line;
+      continue;
+    }
+    std::string build_id;
+    if (hex != kNoBuildId) {
+      std::vector<u8> raw(hex.size() / 2);
+      if (hex.size() % 2 != 0 ||
+          !HexStringToRawData(hex, raw.data(), raw.size())) {
+        LOG(WARNING) << "Skipping malformed build ID cache line: " << line;
+        continue;
+      }
+      build_id.assign(raw.begin(), raw.end());
+    }
+    (*entries)[key] = build_id;
+  }
+  return true;
+}
+
+bool BuildIdCache::Load(const std::string& path) {
+  bool missing;
+  return ReadEntries(path, &loaded_, &missing) || missing;
+}
+
+bool BuildIdCache::Save(const std::string& path) const {
+  EntryMap entries;
+  bool missing;
+  ReadEntries(path, &entries, &missing);
+  for (const auto& it : loaded_) entries[it.first] = it.second;
+  {
+    std::lock_guard<std::mutex> lock(added_mutex_);
+    for (const auto& it : added_) entries[it.first] = it.second;
+  }
+
+  const std::string temp_path = path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream file(temp_path, std::ios::trunc);
+    file << kCacheFileHeader << "\n";
+    for (const auto& it : entries) {
+      const Key& key = it.first;
+      file << key.dev << " " << key.ino << " " << key.mtime_ns << " "
+           << key.size << " "
+           << (it.second.empty() ? kNoBuildId : RawDataToHexString(it.second))
+           << "\n";
+    }
+    file.close();
+    if (!file) {
+      LOG(ERROR) << "Failed to write build ID cache " << temp_path;
+      unlink(temp_path.c_str());
+      return false;
+    }
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Failed to replace build ID cache " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool BuildIdCache::Lookup(const struct stat& s, std::string* build_id) const {
+  const Key key = KeyFromStat(s);
+  auto it = loaded_.find(key);
+  if (it != loaded_.end()) {
+    *build_id = it->second;
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(added_mutex_);
+  it = added_.find(key);
+  if (it == added_.end()) return false;
+  *build_id = it->second;
+  return true;
+}
+
+void BuildIdCache::Insert(const struct stat& s, const std::string& build_id) {
+  std::lock_guard<std::mutex> lock(added_mutex_);
+  added_[KeyFromStat(s)] = build_id;
+}
+
+size_t BuildIdCache::size() const {
+  std::lock_guard<std::mutex> lock(added_mutex_);
+  size_t n = loaded_.size();
+  for (const auto& it : added_) n += loaded_.count(it.first) == 0;
+  return n;
+}
+
+}  // namespace quipper
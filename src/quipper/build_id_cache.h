@@ -0,0 +1,88 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_BUILD_ID_CACHE_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_BUILD_ID_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace quipper {
+
+// Remembers the build IDs read from ELF files, so that they don't have to be
+// parsed again on later runs on the same host. A file is identified by its
+// device, inode, modification time and size, so an entry no longer matches
+// once the file is replaced or modified.
+//
+// The entries read by Load() never change afterwards, so they are looked up
+// without locking. Those added by Insert() are kept apart, under a mutex, until
+// they are written out by Save().
+class BuildIdCache {
+ public:
+  BuildIdCache() {}
+
+  BuildIdCache(const BuildIdCache&) = delete;
+  BuildIdCache& operator=(const BuildIdCache&) = delete;
+
+  // Reads the entries saved at |path|. Must be called before the cache is
+  // used. Returns false if the file exists but can't be read, or is not a
+  // cache file. A missing file is an empty cache.
+  bool Load(const std::string& path);
+
+  // Writes the loaded and inserted entries, along with any saved at |path| by
+  // other processes in the meantime, to |path|. The file is replaced
+  // atomically, so concurrent readers see either the old or the new version.
+  bool Save(const std::string& path) const;
+
+  // Returns true, and sets |build_id| to the raw build ID of the file with
+  // status |s|, if it is cached. |build_id| is empty if the file is known not
+  // to have one.
+  bool Lookup(const struct stat& s, std::string* build_id) const;
+
+  // Caches the raw build ID of the file with status |s|, which may be empty.
+  void Insert(const struct stat& s, const std::string& build_id);
+
+  // Returns the number of entries.
+  size_t size() const;
+
+ private:
+  struct Key {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t size;
+
+    bool operator==(const Key& other) const {
+      return dev == other.dev && ino == other.ino &&
+             mtime_ns == other.mtime_ns && size == other.size;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  typedef std::unordered_map<Key, std::string, KeyHash> EntryMap;
+
+  static Key KeyFromStat(const struct stat& s);
+
+  // Reads the entries saved at |path| into |entries|. Returns false if the
+  // file can't be read or is not a cache file, and sets |missing| if it
+  // doesn't exist.
+  static bool ReadEntries(const std::string& path, EntryMap* entries,
+                          bool* missing);
+
+  EntryMap loaded_;
+  mutable std::mutex added_mutex_;
+  EntryMap added_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_BUILD_ID_CACHE_H_
@@ -0,0 +1,108 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "build_id_cache.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <string>
+
+#include "compat/test.h"
+#include "scoped_temp_path.h"
+
+namespace quipper {
+
+namespace {
+
+struct stat FileStat(uint64_t ino, int64_t mtime_sec, int64_t size) {
+  struct stat s = {};
+  s.st_dev = 0x801;
+  s.st_ino = ino;
+  s.st_mtim.tv_sec = mtime_sec;
+  s.st_mtim.tv_nsec = 42;
+  s.st_size = size;
+  return s;
+}
+
+}  // namespace
+
+TEST(BuildIdCacheTest, SavesAndLoadsEntries) {
+  ScopedTempDir dir;
+  const std::string path = dir.path() + "cache";
+
+  BuildIdCache cache;
+  EXPECT_TRUE(cache.Load(path));
+  EXPECT_EQ(0, cache.size());
+  cache.Insert(FileStat(1, 100, 4096), "\xde\xad\xbe\xef");
+  cache.Insert(FileStat(2, 100, 4096), "");
+  std::string build_id;
+  ASSERT_TRUE(cache.Lookup(FileStat(1, 100, 4096), &build_id));
+  EXPECT_EQ("\xde\xad\xbe\xef", build_id);
+  ASSERT_TRUE(cache.Save(path));
+
+  BuildIdCache loaded;
+  ASSERT_TRUE(loaded.Load(path));
+  EXPECT_EQ(2, loaded.size());
+  ASSERT_TRUE(loaded.Lookup(FileStat(1, 100, 4096), &build_id));
+  EXPECT_EQ("\xde\xad\xbe\xef", build_id);
+  // The file without a build ID is known not to have one.
+  build_id = "x";
+  ASSERT_TRUE(loaded.Lookup(FileStat(2, 100, 4096), &build_id));
+  EXPECT_EQ("", build_id);
+  // A modified file no longer matches.
+  EXPECT_FALSE(loaded.Lookup(FileStat(1, 101, 4096), &build_id));
+  EXPECT_FALSE(loaded.Lookup(FileStat(1, 100, 8192), &build_id));
+  EXPECT_FALSE(loaded.Lookup(FileStat(3, 100, 4096), &build_id));
+}
+
+// Saving keeps the entries saved by others since the cache was loaded.
+TEST(BuildIdCacheTest, SaveMergesEntries) {
+  ScopedTempDir dir;
+  const std::string path = dir.path() + "cache";
+
+  BuildIdCache first;
+  BuildIdCache second;
+  ASSERT_TRUE(first.Load(path));
+  ASSERT_TRUE(second.Load(path));
+  first.Insert(FileStat(1, 100, 4096), "\x01");
+  second.Insert(FileStat(2, 100, 4096), "\x02");
+  ASSERT_TRUE(first.Save(path));
+  ASSERT_TRUE(second.Save(path));
+
+  BuildIdCache loaded;
+  ASSERT_TRUE(loaded.Load(path));
+  std::string build_id;
+  ASSERT_TRUE(loaded.Lookup(FileStat(1, 100, 4096), &build_id));
+  EXPECT_EQ("\x01", build_id);
+  ASSERT_TRUE(loaded.Lookup(FileStat(2, 100, 4096), &build_id));
+  EXPECT_EQ("\x02", build_id);
+}
+
+TEST(BuildIdCacheTest, RejectsOtherFilesAndSkipsMalformedLines) {
+  ScopedTempDir dir;
+  const std::string path = dir.path() + "cache";
+  {
+    std::ofstream file(path);
+    file << "not a cache\n";
+  }
+  BuildIdCache cache;
+  EXPECT_FALSE(cache.Load(path));
+
+  {
+    std::ofstream file(path);
+    file << "quipper-build-id-cache 1\n"
+         << "2049 1 100000000042 4096 c001d00d\n"
+         << "2049 2 100000000042\n"
+         << "2049 3 100000000042 4096 xyz\n";
+  }
+  BuildIdCache loaded;
+  ASSERT_TRUE(loaded.Load(path));
+  EXPECT_EQ(1, loaded.size());
+  std::string build_id;
+  ASSERT_TRUE(loaded.Lookup(FileStat(1, 100, 4096), &build_id));
+  EXPECT_EQ("\xc0\x01\xd0\x0d", build_id);
+}
+
+}  // namespace quipper
@@ -0,0 +1,40 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "build_id_index.h"
+
+#include <stdint.h>
+
+#include <utility>
+
+#include "base/logging.h"
+#include "binary_data_utils.h"
+#include "perf_buildid.h"
+
+namespace quipper {
+
+BuildIdIndex::BuildIdIndex(
+    const std::map<std::string, std::string>& filenames_to_build_ids) {
+  entries_.reserve(filenames_to_build_ids.size());
+  for (const auto& it : filenames_to_build_ids) {
+    const std::string& hex = it.second;
+    Entry entry;
+    entry.build_id.resize(hex.size() / 2);
+    if (!HexStringToRawData(
+            hex, reinterpret_cast<uint8_t*>(&entry.build_id[0]),
+            entry.build_id.size())) {
+      LOG(ERROR) << "Could not convert hex string to raw data: " << hex;
+      continue;
+    }
+    // As PerfReader does for the build ID events it creates.
+    entry.event_build_id = entry.build_id;
+    entry.event_build_id.resize(kBuildIDArraySize, '\0');
+    std::string event_hex = RawDataToHexString(entry.event_build_id);
+    TrimZeroesFromBuildIDString(&event_hex);
+    entry.event_build_id.resize(event_hex.size() / 2);
+    entries_.emplace(it.first, std::move(entry));
+  }
+}
+
+}  // namespace quipper
@@ -0,0 +1,54 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_BUILD_ID_INDEX_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_BUILD_ID_INDEX_H_
+
+#include <stddef.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+
+namespace quipper {
+
+// The build IDs of files, keyed by filename, decoded once so that the same set
+// can be injected into many perf data files, see
+// PerfReader::InjectIndexedBuildIDs(). The index never changes
+// once built, so it can be shared by concurrent conversions.
+class BuildIdIndex {
+ public:
+  // A decoded build ID.
+  struct Entry {
+    // The bytes of the hex build ID.
+    std::string build_id;
+    // The bytes perf would record for it in a build ID event: those of the hex
+    // build ID, zero-padded or truncated to kBuildIDArraySize bytes, without
+    // their trailing four-byte words of zeroes.
+    std::string event_build_id;
+  };
+
+  // Indexes the hex build IDs of |filenames_to_build_ids|. Those that aren't
+  // hex strings are logged and left out.
+  explicit BuildIdIndex(
+      const std::map<std::string, std::string>& filenames_to_build_ids);
+
+  BuildIdIndex(const BuildIdIndex&) = delete;
+  BuildIdIndex& operator=(const BuildIdIndex&) = delete;
+
+  // Returns the build ID of |filename|, or null if there is none.
+  const Entry* Find(const std::string& filename) const {
+    const auto it = entries_.find(filename);
+    return it != entries_.end() ? &it->second : nullptr;
+  }
+
+  size_t size() const { return entries_.size(); }
+
+ private:
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_BUILD_ID_INDEX_H_
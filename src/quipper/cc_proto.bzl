@@ -0,0 +1,57 @@
+"""C++ proto libraries built for the full or the lite protobuf runtime."""
+
+def cc_proto_library_with_lite(
+        name,
+        proto,
+        src,
+        import_prefix = "",
+        visibility = None):
+    """Defines |name| as the C++ library of the proto_library |proto|.
+
+    With --define=proto_lite=1, |name| is instead the library of a copy of
+    |src|, the source of |proto|, with optimize_for = LITE_RUNTIME, so that the
+    binaries that use it only link the lite protobuf runtime. The header of
+    the copy is included by the same path as that of |proto|, which is its
+    name in the package prefixed by |import_prefix|.
+
+    Args:
+      name: The name of the library.
+      proto: The proto_library of |src|.
+      src: The .proto file, in the current package.
+      import_prefix: The directory that the header is included from.
+      visibility: The visibility of the library.
+    """
+    native.cc_proto_library(
+        name = name + "_full",
+        visibility = visibility,
+        deps = [proto],
+    )
+
+    # Options can be set anywhere at the top level of a .proto file.
+    lite_src = "lite/" + src
+    native.genrule(
+        name = name + "_lite_src",
+        srcs = [src],
+        outs = [lite_src],
+        cmd = "(cat $<; echo 'option optimize_for = LITE_RUNTIME;') > $@",
+    )
+    native.proto_library(
+        name = name + "_lite_proto",
+        srcs = [lite_src],
+        import_prefix = import_prefix,
+        strip_import_prefix = "lite",
+    )
+    native.cc_proto_library(
+        name = name + "_lite",
+        visibility = visibility,
+        deps = [":" + name + "_lite_proto"],
+    )
+
+    native.alias(
+        name = name,
+        actual = select({
+            "//src/quipper:proto_lite": ":" + name + "_lite",
+            "//conditions:default": ":" + name + "_full",
+        }),
+        visibility = visibility,
+    )
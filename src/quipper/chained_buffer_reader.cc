@@ -0,0 +1,91 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chained_buffer_reader.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+ChainedBufferReader::ChainedBufferReader(const std::vector<Segment>& segments) {
+  size_ = 0;
+  for (const Segment& segment : segments) {
+    if (segment.size == 0) continue;
+    segments_.push_back(segment);
+    segment_offsets_.push_back(size_);
+    size_ += segment.size;
+  }
+}
+
+bool ChainedBufferReader::SeekSet(size_t offset) {
+  if (offset > size_) {
+    LOG(ERROR) << "Illegal offset " << offset << " in file of size " << size_;
+    return false;
+  }
+  offset_ = offset;
+  return true;
+}
+
+bool ChainedBufferReader::ReadData(const size_t size, void* dest) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
+
+  char* out = static_cast<char*>(dest);
+  size_t remaining = size;
+  while (remaining > 0) {
+    segment_ = FindSegment(offset_);
+    const Segment& segment = segments_[segment_];
+    const size_t segment_offset = offset_ - segment_offsets_[segment_];
+    const size_t n = std::min(remaining, segment.size - segment_offset);
+    memcpy(out, static_cast<const char*>(segment.data) + segment_offset, n);
+    out += n;
+    remaining -= n;
+    offset_ += n;
+  }
+  return true;
+}
+
+const void* ChainedBufferReader::GetContiguousData(size_t offset,
+                                                   size_t size) const {
+  if (offset >= size_ || size > size_ - offset) return nullptr;
+  const size_t index = FindSegment(offset);
+  const size_t segment_offset = offset - segment_offsets_[index];
+  if (size > segments_[index].size - segment_offset) return nullptr;
+  return static_cast<const char*>(segments_[index].data) + segment_offset;
+}
+
+bool ChainedBufferReader::ReadString(size_t size, std::string* str) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
+
+  const char* data =
+      static_cast<const char*>(GetContiguousData(offset_, size));
+  if (data != nullptr) {
+    *str = std::string(data, strnlen(data, size));
+    offset_ += size;
+    return true;
+  }
+  if (!ReadDataString(size, str)) return false;
+  str->resize(strnlen(str->data(), size));
+  return true;
+}
+
+size_t ChainedBufferReader::FindSegment(size_t offset) const {
+  // Check the segment last read, then the next one, before searching.
+  for (size_t index = segment_;
+       index < segments_.size() && index <= segment_ + 1; ++index) {
+    const size_t start = segment_offsets_[index];
+    if (offset >= start && offset - start < segments_[index].size) {
+      return index;
+    }
+  }
+  return std::upper_bound(segment_offsets_.begin(), segment_offsets_.end(),
+                          offset) -
+         segment_offsets_.begin() - 1;
+}
+
+}  // namespace quipper
@@ -0,0 +1,64 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_CHAINED_BUFFER_READER_H_
+#define CHROMIUMOS_WIDE_PROFILING_CHAINED_BUFFER_READER_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "data_reader.h"
+
+namespace quipper {
+
+// Read from a sequence of data buffers, e.g. the chunks of an input received
+// over the network, as if they were concatenated, so that they don't have to
+// be copied into a single buffer first. Reads may span several buffers, and
+// GetContiguousData() gives direct access to the ranges within one buffer.
+// Does not take ownership of the buffers.
+class ChainedBufferReader : public DataReader {
+ public:
+  struct Segment {
+    const void* data;
+    size_t size;
+  };
+
+  // The data source is the concatenation of |segments|, in order.
+  explicit ChainedBufferReader(const std::vector<Segment>& segments);
+
+  bool SeekSet(size_t offset) override;
+
+  size_t Tell() const override { return offset_; }
+
+  bool ReadData(const size_t size, void* dest) override;
+
+  // Returns nullptr if the range spans several segments.
+  const void* GetContiguousData(size_t offset, size_t size) const override;
+
+  // Reads |size| bytes as a null-terminated string into |str|. Trailing nulls,
+  // if any, are not added to the string, but they are skipped over. If there
+  // is no null terminator within these |size| bytes, then the string is
+  // automatically terminated after |size| bytes.
+  bool ReadString(const size_t size, std::string* str) override;
+
+ private:
+  // Returns the index of the segment containing |offset|, which must be less
+  // than size(), starting from |segment_| since reads are mostly sequential.
+  size_t FindSegment(size_t offset) const;
+
+  // The non-empty segments, and the offset of each one in the data.
+  std::vector<Segment> segments_;
+  std::vector<size_t> segment_offsets_;
+
+  // Data read offset from the start of the data.
+  size_t offset_ = 0;
+  // The segment containing |offset_|, or the last segment read.
+  size_t segment_ = 0;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_CHAINED_BUFFER_READER_H_
@@ -0,0 +1,135 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chained_buffer_reader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+#include "perf_reader.h"
+#include "test_perf_data.h"
+
+namespace quipper {
+
+namespace {
+
+// Splits |data| into segments of the sizes in |sizes|, in turn, and an empty
+// one after each.
+std::vector<ChainedBufferReader::Segment> Split(
+    const std::string& data, const std::vector<size_t>& sizes) {
+  std::vector<ChainedBufferReader::Segment> segments;
+  size_t offset = 0;
+  for (size_t i = 0; offset < data.size(); ++i) {
+    const size_t size =
+        std::min(sizes[i % sizes.size()], data.size() - offset);
+    segments.push_back({data.data() + offset, size});
+    segments.push_back({nullptr, 0});
+    offset += size;
+  }
+  return segments;
+}
+
+}  // namespace
+
+TEST(ChainedBufferReaderTest, ReadsAcrossSegments) {
+  const std::string input = "abcdefghijklmnopqrstuvwxyz";
+  ChainedBufferReader reader(Split(input, {3, 1, 10}));
+  EXPECT_EQ(input.size(), reader.size());
+
+  char data[6];
+  ASSERT_TRUE(reader.ReadData(2, data));
+  EXPECT_EQ("ab", std::string(data, 2));
+  ASSERT_TRUE(reader.ReadData(6, data));
+  EXPECT_EQ("cdefgh", std::string(data, 6));
+  EXPECT_EQ(8, reader.Tell());
+
+  // Reads can seek backward and to the end.
+  ASSERT_TRUE(reader.SeekSet(1));
+  ASSERT_TRUE(reader.ReadData(4, data));
+  EXPECT_EQ("bcde", std::string(data, 4));
+  ASSERT_TRUE(reader.SeekSet(20));
+  ASSERT_TRUE(reader.ReadData(6, data));
+  EXPECT_EQ("uvwxyz", std::string(data, 6));
+  EXPECT_TRUE(reader.ReadData(0, nullptr));
+  EXPECT_FALSE(reader.ReadData(1, data));
+  EXPECT_FALSE(reader.ReadData(SIZE_MAX, nullptr));
+
+  // The cursor can't be set to past the end of the data.
+  EXPECT_FALSE(reader.SeekSet(27));
+  EXPECT_EQ(26, reader.Tell());
+}
+
+TEST(ChainedBufferReaderTest, GetsContiguousDataWithinSegments) {
+  const std::string input = "abcdefghijklmnopqrstuvwxyz";
+  ChainedBufferReader reader(Split(input, {3, 1, 10}));
+  EXPECT_EQ(input.data(), reader.GetContiguousData(0, 3));
+  EXPECT_EQ(nullptr, reader.GetContiguousData(0, 4));
+  EXPECT_EQ(input.data() + 3, reader.GetContiguousData(3, 1));
+  EXPECT_EQ(input.data() + 5, reader.GetContiguousData(5, 9));
+  EXPECT_EQ(nullptr, reader.GetContiguousData(5, 10));
+  EXPECT_EQ(input.data() + 25, reader.GetContiguousData(25, 1));
+  EXPECT_EQ(nullptr, reader.GetContiguousData(25, 2));
+  EXPECT_EQ(nullptr, reader.GetContiguousData(26, 0));
+}
+
+TEST(ChainedBufferReaderTest, ReadsStrings) {
+  const std::string input = std::string("abc\0\0def", 8) + "ghijklmnop";
+  ChainedBufferReader reader(Split(input, {4, 2}));
+  std::string str;
+  EXPECT_TRUE(reader.ReadString(4, &str));
+  EXPECT_EQ("abc", str);
+  EXPECT_TRUE(reader.ReadString(1, &str));
+  EXPECT_EQ("", str);
+  EXPECT_TRUE(reader.ReadString(8, &str));
+  EXPECT_EQ("defghijk", str);
+  EXPECT_FALSE(reader.ReadString(10, &str));
+  EXPECT_EQ("defghijk", str);
+}
+
+// PerfReader reads the same events from segments of any size as from a
+// single buffer.
+TEST(ChainedBufferReaderTest, ReadsPerfData) {
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&input_data);
+  for (int i = 0; i < 20; ++i) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001).Time(200 + i))
+        .WriteTo(&input_data);
+  }
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+  const std::string data = input.str();
+
+  PerfReader expected;
+  ASSERT_TRUE(expected.ReadFromString(data));
+  ASSERT_EQ(21, expected.events().size());
+
+  for (size_t segment_size : {1, 7, 64, 1000}) {
+    ChainedBufferReader chained(Split(data, {segment_size}));
+    PerfReader reader;
+    ASSERT_TRUE(reader.ReadFromData(&chained)) << segment_size;
+    ASSERT_EQ(expected.events().size(), reader.events().size());
+    for (int i = 0; i < reader.events().size(); ++i) {
+      EXPECT_EQ(expected.events().Get(i).SerializeAsString(),
+                reader.events().Get(i).SerializeAsString());
+    }
+  }
+}
+
+}  // namespace quipper
@@ -9,21 +9,40 @@
 #include "perf_parser_options.pb.h"
 #include "perf_stat.pb.h"
 #include "google/protobuf//arena.h"
+#include "google/protobuf//io/coded_stream.h"
+#include "google/protobuf//io/zero_copy_stream_impl.h"
 #include "google/protobuf//io/zero_copy_stream_impl_lite.h"
-#include "google/protobuf//message.h"
 #include "google/protobuf//repeated_field.h"
+#include "google/protobuf//util/delimited_message_util.h"
+// The protos are built for the lite runtime with QUIPPER_PROTO_LITE, without
+// the reflection that these need.
+#ifndef QUIPPER_PROTO_LITE
+#include "google/protobuf//message.h"
 #include "google/protobuf//text_format.h"
+#include "google/protobuf//util/field_mask_util.h"
 #include "google/protobuf//util/message_differencer.h"
+#endif
 
 namespace quipper {
 
 using ::google::protobuf::Arena;
-using ::google::protobuf::Message;
+using ::google::protobuf::ArenaOptions;
 using ::google::protobuf::RepeatedField;
 using ::google::protobuf::RepeatedPtrField;
-using ::google::protobuf::TextFormat;
 using ::google::protobuf::io::ArrayInputStream;
+using ::google::protobuf::io::CodedInputStream;
+using ::google::protobuf::io::CodedOutputStream;
+using ::google::protobuf::io::FileInputStream;
+using ::google::protobuf::io::FileOutputStream;
+using ::google::protobuf::util::ParseDelimitedFromZeroCopyStream;
+using ::google::protobuf::util::SerializeDelimitedToZeroCopyStream;
+#ifndef QUIPPER_PROTO_LITE
+using ::google::protobuf::FieldMask;
+using ::google::protobuf::Message;
+using ::google::protobuf::TextFormat;
+using ::google::protobuf::util::FieldMaskUtil;
 using ::google::protobuf::util::MessageDifferencer;
+#endif
 
 }  // namespace quipper
 
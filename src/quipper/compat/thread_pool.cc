@@ -0,0 +1,166 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "compat/thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+namespace {
+
+// The pool of the calling thread, if it is one of a pool's, and the index of
+// its queue.
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+// How long TaskGroup::Wait() sleeps before it looks for tasks to run again.
+// The tasks of the group may be waiting for tasks scheduled meanwhile.
+constexpr std::chrono::milliseconds kTaskGroupPollInterval(1);
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_threads) {
+  CHECK_GT(num_threads, 0U);
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(new Worker);
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_[i]->thread = std::thread(&ThreadPool::Run, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_queued_.notify_all();
+  for (auto& worker : workers_) worker->thread.join();
+}
+
+void ThreadPool::Schedule(std::function<void()> task) {
+  const size_t index = current_pool == this
+                           ? current_queue
+                           : next_queue_++ % workers_.size();
+  {
+    std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+    workers_[index]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++num_queued_;
+  }
+  task_queued_.notify_one();
+}
+
+bool ThreadPool::RunPendingTask() {
+  std::function<void()> task;
+  if (!TakeTask(current_pool == this ? current_queue : 0, &task)) {
+    return false;
+  }
+  task();
+  return true;
+}
+
+void ThreadPool::Run(size_t index) {
+  current_pool = this;
+  current_queue = index;
+  while (true) {
+    std::function<void()> task;
+    if (TakeTask(index, &task)) {
+      task();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_queued_.wait(lock, [this] { return num_queued_ > 0 || stopping_; });
+    if (num_queued_ == 0) return;
+  }
+}
+
+bool ThreadPool::TakeTask(size_t index, std::function<void()>* task) {
+  if (num_queued_ == 0) return false;
+  {
+    Worker* worker = workers_[index].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    if (!worker->tasks.empty()) {
+      *task = std::move(worker->tasks.back());
+      worker->tasks.pop_back();
+      --num_queued_;
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker* worker = workers_[(index + i) % workers_.size()].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    if (!worker->tasks.empty()) {
+      *task = std::move(worker->tasks.front());
+      worker->tasks.pop_front();
+      --num_queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskGroup::Run(std::function<void()> task) {
+  if (pool_ == nullptr) {
+    task();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    ++state_->num_running;
+  }
+  pool_->Schedule([state = state_, task = std::move(task)] {
+    task();
+    // The group may be destroyed as soon as the count reaches zero, so only
+    // the state is used after that.
+    bool finished;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      finished = --state->num_running == 0;
+    }
+    if (finished) state->finished.notify_all();
+  });
+}
+
+void TaskGroup::Wait() {
+  if (pool_ == nullptr) return;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      if (state_->num_running == 0) return;
+    }
+    if (pool_->RunPendingTask()) continue;
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->finished.wait_for(lock, kTaskGroupPollInterval,
+                              [this] { return state_->num_running == 0; });
+  }
+}
+
+void ParallelFor(ThreadPool* pool, size_t n, size_t max_tasks,
+                 const std::function<void(size_t)>& body) {
+  std::atomic<size_t> next(0);
+  auto run = [n, &body, &next] {
+    for (size_t i = next++; i < n; i = next++) body(i);
+  };
+  const size_t num_tasks = std::min(std::max<size_t>(max_tasks, 1), n);
+  if (pool == nullptr) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_tasks; ++i) threads.emplace_back(run);
+    run();
+    for (auto& thread : threads) thread.join();
+    return;
+  }
+  TaskGroup group(pool);
+  for (size_t i = 1; i < num_tasks; ++i) group.Run(run);
+  run();
+  group.Wait();
+}
+
+}  // namespace quipper
@@ -0,0 +1,126 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_COMPAT_THREAD_POOL_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_COMPAT_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace quipper {
+
+// A fixed set of threads that run the tasks scheduled on them, which can be
+// shared by many concurrent users. Each thread has a queue of its own: the
+// tasks scheduled by a task go to the queue of its thread, which runs the
+// latest first, and the threads that run out of tasks steal the oldest ones
+// of the others. The tasks scheduled from other threads are spread over the
+// queues in turn.
+class ThreadPool {
+ public:
+  // Starts |num_threads| threads, at least one.
+  explicit ThreadPool(size_t num_threads);
+  // Runs the tasks scheduled, then stops the threads.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t num_threads() const { return workers_.size(); }
+
+  // Runs |task| on one of the threads.
+  void Schedule(std::function<void()> task);
+
+  // Runs one of the tasks waiting to run, if any, on the calling thread.
+  // Returns whether there was one.
+  bool RunPendingTask();
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    std::thread thread;
+  };
+
+  void Run(size_t index);
+  // Takes the latest task of the queue of |index|, or else the oldest of
+  // another queue.
+  bool TakeTask(size_t index, std::function<void()>* task);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // The queue of the next task scheduled from outside of the pool.
+  std::atomic<size_t> next_queue_{0};
+  // The number of tasks queued, guarded by |mutex_| when it is incremented so
+  // that the threads waiting for tasks don't miss them.
+  std::atomic<size_t> num_queued_{0};
+  std::mutex mutex_;
+  std::condition_variable task_queued_;
+  bool stopping_ = false;
+};
+
+// A set of tasks run on a ThreadPool that can be waited for together.
+class TaskGroup {
+ public:
+  // Runs the tasks on |pool|, or on the calling thread as they are added if
+  // |pool| is null.
+  explicit TaskGroup(ThreadPool* pool)
+      : pool_(pool), state_(std::make_shared<State>()) {}
+  // Waits for the tasks.
+  ~TaskGroup() { Wait(); }
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void Run(std::function<void()> task);
+
+  // Waits for the tasks run so far to finish. Meanwhile, the calling thread
+  // runs tasks of the pool, so that the tasks of the pool can wait for groups
+  // of their own without tying up its threads.
+  void Wait();
+
+ private:
+  // The count of the tasks running, which each of them holds on to, since the
+  // group may be destroyed as soon as the last of them is done.
+  struct State {
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t num_running = 0;
+  };
+
+  ThreadPool* const pool_;
+  const std::shared_ptr<State> state_;
+};
+
+// Calls |body| with each index in [0, |n|), in up to |max_tasks| tasks on
+// |pool|, or on up to |max_tasks| threads, including the calling one, if
+// |pool| is null. Each task takes the next index until there are none left.
+void ParallelFor(ThreadPool* pool, size_t n, size_t max_tasks,
+                 const std::function<void(size_t)>& body);
+
+// Maps each index in [0, |n|) to a value with |map|, concurrently as
+// ParallelFor() does, then folds the values into |init| in index order with
+// |reduce|, which is called as reduce(T* result, T&& value) on the calling
+// thread. The result doesn't depend on how the work was scheduled, even if
+// |reduce| isn't commutative.
+template <typename T, typename Map, typename Reduce>
+T ParallelMapReduce(ThreadPool* pool, size_t n, size_t max_tasks, T init,
+                    const Map& map, const Reduce& reduce) {
+  std::vector<T> values(n);
+  ParallelFor(pool, n, max_tasks, [&values, &map](size_t i) {
+    values[i] = map(i);
+  });
+  for (T& value : values) reduce(&init, std::move(value));
+  return init;
+}
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_COMPAT_THREAD_POOL_H_
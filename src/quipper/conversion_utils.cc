@@ -4,15 +4,16 @@
 
 #include "conversion_utils.h"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <memory>
 #include <string>
-#include <vector>
+#include <utility>
 
 #include "base/logging.h"
 #include "compat/proto.h"
-#include "file_utils.h"
 #include "perf_parser.h"
 #include "perf_protobuf_io.h"
 #include "perf_reader.h"
@@ -55,20 +56,33 @@ bool ReadInput(const FormatAndFile& input, PerfReader* reader,
     return reader->ReadFile(input.filename);
   }
 
-  if (format == kProtoTextFormat || format == kProtoBinaryFormat) {
-    PerfDataProto perf_data_proto;
-    std::vector<char> data;
-    if (!FileToBuffer(input.filename, &data)) return false;
-    if (format == kProtoTextFormat) {
-      std::string text(data.begin(), data.end());
-      if (!TextFormat::ParseFromString(text, &perf_data_proto)) return false;
-    } else {
-      if (!perf_data_proto.ParseFromArray(data.data(), data.size())) {
-        return false;
-      }
-    }
+  // The input proto is parsed straight from the file onto an arena, which the
+  // reader adopts along with the proto instead of copying it.
+  std::unique_ptr<Arena> arena(new Arena);
+  if (format == kProtoBinaryFormat) {
+    PerfDataProto* perf_data_proto =
+        ReadProtobufFromFileOnArena(input.filename, arena.get());
+    return perf_data_proto != nullptr &&
+           reader->Deserialize(std::move(arena), perf_data_proto);
+  }
 
-    return reader->Deserialize(perf_data_proto);
+  if (format == kProtoTextFormat) {
+#ifdef QUIPPER_PROTO_LITE
+    LOG(ERROR) << "The proto text format needs the full protobuf runtime";
+    return false;
+#else
+    int fd = open(input.filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      LOG(ERROR) << "Failed to open " << input.filename;
+      return false;
+    }
+    FileInputStream text(fd);
+    text.SetCloseOnDelete(true);
+    PerfDataProto* perf_data_proto =
+        Arena::Create<PerfDataProto>(arena.get());
+    if (!TextFormat::Parse(&text, perf_data_proto)) return false;
+    return reader->Deserialize(std::move(arena), perf_data_proto);
+#endif
   }
 
   LOG(ERROR) << "Unimplemented read format: " << input.format;
@@ -86,31 +100,27 @@ bool WriteOutput(const FormatAndFile& output, const PerfParserOptions& options,
   PerfParser parser(reader, options);
   if (!parser.ParseRawEvents()) return false;
 
-  std::string output_string;
   if (output.format == kPerfFormat) {
     return reader->WriteFile(output.filename);
   }
 
   if (output.format == kProtoTextFormat ||
       output.format == kProtoBinaryFormat) {
-    PerfDataProto perf_data_proto;
-    reader->Serialize(&perf_data_proto);
+    // The reader isn't used afterwards, so its proto is written out instead of
+    // a copy, and it is printed or serialized straight to the file.
+    PerfDataProto* perf_data_proto = reader->SerializeInPlace();
 
     // Serialize the parser stats as well.
-    PerfSerializer::SerializeParserStats(parser.stats(), &perf_data_proto);
+    PerfSerializer::SerializeParserStats(parser.stats(), perf_data_proto);
 
     // Reset the timestamp field since it causes reproducability issues when
     // testing.
-    perf_data_proto.set_timestamp_sec(0);
+    perf_data_proto->set_timestamp_sec(0);
 
     if (output.format == kProtoTextFormat) {
-      if (!TextFormat::PrintToString(perf_data_proto, &output_string))
-        return false;
-    } else {
-      output_string = perf_data_proto.SerializeAsString();
+      return WriteProtobufTextToFile(*perf_data_proto, output.filename);
     }
-    std::vector<char> data(output_string.begin(), output_string.end());
-    return BufferToFile(output.filename, data);
+    return WriteProtobufToFile(*perf_data_proto, output.filename);
   }
 
   LOG(ERROR) << "Unimplemented write format: " << output.format;
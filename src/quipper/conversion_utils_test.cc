@@ -4,10 +4,19 @@
 
 #include "conversion_utils.h"
 
+#include <fstream>
+#include <string>
+#include <vector>
+
 #include "base/logging.h"
+#include "compat/proto.h"
 #include "compat/test.h"
+#include "file_utils.h"
+#include "perf_protobuf_io.h"
+#include "perf_reader.h"
 #include "perf_test_files.h"
 #include "scoped_temp_path.h"
+#include "synthetic_perf_data.h"
 #include "test_utils.h"
 
 namespace quipper {
@@ -62,6 +71,41 @@ TEST_P(PerfFile, BinaryOutput) {
                                    basename(output.filename.c_str()));
 }
 
+// The text and binary outputs hold the same proto, and the text can be
+// converted back to perf data.
+TEST(ConversionUtilsTest, ConvertsBetweenFormats) {
+  ScopedTempDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  testing::SyntheticPerfDataOptions options;
+  options.num_samples = 2000;
+  FormatAndFile perf{dir.path() + "input.perf.data", kPerfFormat};
+  {
+    std::ofstream out(perf.filename, std::ios::binary);
+    ASSERT_TRUE(testing::WriteSyntheticPerfData(options, &out));
+  }
+
+  FormatAndFile text{dir.path() + "output.pb_text", kProtoTextFormat};
+  FormatAndFile binary{dir.path() + "output.pb_data", kProtoBinaryFormat};
+  ASSERT_TRUE(ConvertFile(perf, text));
+  ASSERT_TRUE(ConvertFile(perf, binary));
+
+  PerfDataProto from_binary;
+  ASSERT_TRUE(ReadProtobufFromFile(&from_binary, binary.filename));
+  std::vector<char> contents;
+  ASSERT_TRUE(FileToBuffer(text.filename, &contents));
+  PerfDataProto from_text;
+  ASSERT_TRUE(TextFormat::ParseFromString(
+      std::string(contents.begin(), contents.end()), &from_text));
+  EXPECT_EQ(from_binary.SerializeAsString(), from_text.SerializeAsString());
+  EXPECT_EQ(0, from_text.timestamp_sec());
+
+  FormatAndFile back{dir.path() + "output.perf.data", kPerfFormat};
+  ASSERT_TRUE(ConvertFile(text, back));
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFile(back.filename));
+  EXPECT_EQ(from_text.events_size(), reader.events().size());
+}
+
 INSTANTIATE_TEST_SUITE_P(
     ConversionUtilsTest, PerfFile,
     ::testing::ValuesIn(perf_test_files::GetPerfDataFiles()));
@@ -48,12 +48,32 @@ class DataReader {
   bool ReadUint64(uint64_t* value) {
     return ReadIntValue(value);
   }
+  // Reads |count| consecutive 64-bit integers, swapping them all at once.
+  bool ReadUint64Array(uint64_t* values, size_t count) {
+    if (!ReadData(count * sizeof(*values), values)) return false;
+    if (is_cross_endian_) ByteSwapArray(values, count);
+    return true;
+  }
 
   // Read a string. Returns true if it managed to read |size| bytes (excluding
   // null terminator). The actual string may be shorter than the number of bytes
   // requested.
   virtual bool ReadString(const size_t size, std::string* str) = 0;
 
+  // Returns a pointer to |size| bytes of contiguous data starting at |offset|
+  // bytes from the beginning of the data, without copying and without moving
+  // the read pointer. Returns nullptr if the reader can't provide direct
+  // access to its data or the range is out of bounds. The pointer remains
+  // valid for the lifetime of the reader.
+  virtual const void* GetContiguousData(size_t offset, size_t size) const {
+    return nullptr;
+  }
+
+  // Hints that the range [offset, offset + size) is about to be read
+  // sequentially. Readers backed by memory mappings can use this to tune
+  // kernel read-ahead. The default implementation does nothing.
+  virtual void AdviseSequential(size_t offset, size_t size) {}
+
   // Reads a string from data into |dest| at the current offset. The string in
   // data is prefixed with a 32-bit size field. The size() of |*dest| after the
   // read will be the null-terminated string length of the underlying string
@@ -39,6 +39,15 @@ class DataWriter {
   // terminator. Returns true iff the expected number of bytes were written.
   virtual bool WriteString(const std::string& str, const size_t size) = 0;
 
+  // Returns a pointer to |size| bytes of contiguous memory starting at |offset|
+  // bytes from the beginning of the data, which the caller may fill in
+  // directly, without moving the data pointer. Returns nullptr if the writer
+  // can't provide direct access to its destination or the range is out of
+  // bounds.
+  virtual void* GetContiguousBuffer(size_t offset, size_t size) {
+    return nullptr;
+  }
+
   // Writes a string |src| to data, prefixed with a 32-bit size field. The size
   // is rounded up to the next multiple of uint64_t.
   bool WriteStringWithSizeToData(const std::string& src);
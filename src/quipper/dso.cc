@@ -98,8 +98,14 @@ bool GetBuildID(Elf *elf, std::string *buildid) {
 }  // namespace
 
 void InitializeLibelf() {
-  const unsigned int kElfVersionNone = EV_NONE;  // correctly typed.
-  CHECK_NE(kElfVersionNone, elf_version(EV_CURRENT)) << elf_errmsg(-1);
+  // Only the first call sets the version, so that concurrent readers of build
+  // IDs don't race on it.
+  static const bool initialized = [] {
+    const unsigned int kElfVersionNone = EV_NONE;  // correctly typed.
+    CHECK_NE(kElfVersionNone, elf_version(EV_CURRENT)) << elf_errmsg(-1);
+    return true;
+  }();
+  (void)initialized;
 }
 
 bool ReadElfBuildId(const std::string &filename, std::string *buildid) {
@@ -118,8 +124,9 @@ bool ReadElfBuildId(int fd, std::string *buildid) {
 
   Elf *elf = elf_begin(fd, ELF_C_READ_MMAP, nullptr);
   if (elf == nullptr) {
+    // The caller closes fd. Closing it here too could close a file opened on
+    // another thread in the meantime.
     LOG(ERROR) << "Could not read ELF file.";
-    close(fd);
     return false;
   }
 
@@ -5,9 +5,9 @@
 #ifndef CHROMIUMOS_WIDE_PROFILING_DSO_H_
 #define CHROMIUMOS_WIDE_PROFILING_DSO_H_
 
+#include <stddef.h>
 #include <sys/stat.h>
 
-#include <unordered_set>
 #include <utility>
 
 #include "data_reader.h"
@@ -17,6 +17,14 @@ namespace quipper {
 // Defines a type for a pid:tid pair.
 using PidTid = std::pair<u32, u32>;
 
+// Hashes a PidTid, for unordered containers.
+struct PidTidHash {
+  size_t operator()(const PidTid& pidtid) const {
+    const u64 key = (static_cast<u64>(pidtid.first) << 32) | pidtid.second;
+    return static_cast<size_t>(key * 0x9e3779b97f4a7c15ULL >> 16);
+  }
+};
+
 // A struct containing all relevant info for a mapped DSO, independent of any
 // samples.
 struct DSOInfo {
@@ -26,8 +34,10 @@ struct DSOInfo {
   u32 min = 0;
   u64 ino = 0;
   bool hit = false;  // Have we seen any samples in this DSO?
-  // unordered_set of pids this DSO had samples in.
-  std::unordered_set<uint64_t> threads;
+  // The first thread this DSO had samples in, if hit. Its build ID is looked
+  // for in the root of that thread and of its process, which may be in a
+  // container.
+  PidTid thread;
 };
 
 // Do the |DSOInfo| and |struct stat| refer to the same inode?
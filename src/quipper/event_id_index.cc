@@ -0,0 +1,51 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "event_id_index.h"
+
+#include <algorithm>
+
+namespace quipper {
+
+void EventIdIndex::Set(uint64_t id, uint32_t value) {
+  const uint64_t old_min_id = min_id_;
+  if (empty()) {
+    min_id_ = max_id_ = id;
+  } else {
+    min_id_ = std::min(min_id_, id);
+    max_id_ = std::max(max_id_, id);
+  }
+  sparse_[id] = value;
+
+  if (!IsDense(min_id_, max_id_)) {
+    use_dense_ = false;
+    dense_.clear();
+  } else if (use_dense_ && min_id_ == old_min_id) {
+    // The ids mostly come in increasing order, so the array usually just
+    // grows at its end.
+    if (id - min_id_ >= dense_.size()) {
+      dense_.resize(id - min_id_ + 1, kNone);
+    }
+    dense_[id - min_id_] = value;
+  } else {
+    RebuildDense();
+  }
+}
+
+void EventIdIndex::RebuildDense() {
+  dense_.assign(max_id_ - min_id_ + 1, kNone);
+  for (const auto& it : sparse_) {
+    dense_[it.first - min_id_] = it.second;
+  }
+  use_dense_ = true;
+}
+
+void EventIdIndex::clear() {
+  sparse_.clear();
+  dense_.clear();
+  use_dense_ = false;
+  min_id_ = max_id_ = 0;
+}
+
+}  // namespace quipper
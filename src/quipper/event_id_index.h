@@ -0,0 +1,79 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_EVENT_ID_INDEX_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_EVENT_ID_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+namespace quipper {
+
+// Maps the ids of perf events, which tell which attr an event belongs to, to a
+// small value such as the index of the attr. The kernel hands out the ids
+// consecutively, so they are normally looked up by their offset from the
+// smallest id in a dense array. A hash map is used instead if the ids are too
+// sparse for the array to stay small.
+//
+// The index is built while the attrs are read. Lookups don't modify it, so
+// they may be made from several threads once it is built.
+class EventIdIndex {
+ public:
+  EventIdIndex() {}
+
+  // Maps |id| to |value|, replacing any previous value for it.
+  void Set(uint64_t id, uint32_t value);
+
+  // Returns true, and stores the value of |id| in |value|, if |id| is mapped.
+  bool Find(uint64_t id, uint32_t* value) const {
+    if (use_dense_) {
+      const uint64_t offset = id - min_id_;
+      if (id < min_id_ || offset >= dense_.size() || dense_[offset] == kNone) {
+        return false;
+      }
+      *value = dense_[offset];
+      return true;
+    }
+    auto it = sparse_.find(id);
+    if (it == sparse_.end()) return false;
+    *value = it->second;
+    return true;
+  }
+
+  // Returns the number of mapped ids.
+  size_t size() const { return sparse_.size(); }
+  bool empty() const { return sparse_.empty(); }
+
+  // Returns the smallest mapped id. The index must not be empty.
+  uint64_t min_id() const { return min_id_; }
+
+  void clear();
+
+ private:
+  // Marks the slots of dense_ that no id is mapped to.
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  // Whether ids from |min_id| to |max_id| are dense enough for an array.
+  bool IsDense(uint64_t min_id, uint64_t max_id) const {
+    return max_id - min_id < 4 * size() + 64;
+  }
+
+  // Fills dense_ from sparse_, for ids from min_id_ to max_id_.
+  void RebuildDense();
+
+  // All the mapped ids, which are also in dense_ if use_dense_.
+  std::unordered_map<uint64_t, uint32_t> sparse_;
+  // The value of id min_id_ + i at i, or kNone.
+  std::vector<uint32_t> dense_;
+  bool use_dense_ = false;
+  uint64_t min_id_ = 0;
+  uint64_t max_id_ = 0;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_EVENT_ID_INDEX_H_
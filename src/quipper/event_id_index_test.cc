@@ -0,0 +1,61 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "event_id_index.h"
+
+#include <vector>
+
+#include "compat/test.h"
+
+namespace quipper {
+
+TEST(EventIdIndexTest, FindsDenseIds) {
+  EventIdIndex index;
+  EXPECT_TRUE(index.empty());
+  uint32_t value;
+  EXPECT_FALSE(index.Find(0, &value));
+
+  // Ids in increasing order, in decreasing order, with a hole, and one that
+  // is mapped again.
+  for (uint64_t id : {100, 101, 102, 99, 98, 105}) {
+    index.Set(id, id / 2);
+  }
+  index.Set(101, 7);
+  EXPECT_EQ(6, index.size());
+  EXPECT_EQ(98, index.min_id());
+  for (uint64_t id : {98, 99, 100, 102, 105}) {
+    ASSERT_TRUE(index.Find(id, &value)) << id;
+    EXPECT_EQ(id / 2, value);
+  }
+  ASSERT_TRUE(index.Find(101, &value));
+  EXPECT_EQ(7, value);
+  for (uint64_t id : {0, 97, 103, 104, 106, 1000}) {
+    EXPECT_FALSE(index.Find(id, &value)) << id;
+  }
+}
+
+TEST(EventIdIndexTest, FindsSparseIds) {
+  EventIdIndex index;
+  const std::vector<uint64_t> ids = {1ULL << 40, 3, 1ULL << 63, 0};
+  for (size_t i = 0; i < ids.size(); ++i) {
+    index.Set(ids[i], i);
+  }
+  EXPECT_EQ(0, index.min_id());
+  uint32_t value;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    ASSERT_TRUE(index.Find(ids[i], &value)) << ids[i];
+    EXPECT_EQ(i, value);
+  }
+  EXPECT_FALSE(index.Find(1, &value));
+  EXPECT_FALSE(index.Find((1ULL << 40) + 1, &value));
+
+  index.clear();
+  EXPECT_TRUE(index.empty());
+  EXPECT_FALSE(index.Find(3, &value));
+  index.Set(5, 1);
+  ASSERT_TRUE(index.Find(5, &value));
+  EXPECT_EQ(1, value);
+}
+
+}  // namespace quipper
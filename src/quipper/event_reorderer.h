@@ -0,0 +1,99 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_EVENT_REORDERER_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_EVENT_REORDERER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace quipper {
+
+// Restores the time order of perf events incrementally, using the
+// PERF_RECORD_FINISHED_ROUND markers that perf writes after each pass over the
+// per-CPU ring buffers. Each ring buffer is in time order on its own, so the
+// events of a round can only reach back as far as the previous round: once a
+// round is finished, every buffered event up to the latest timestamp of the
+// previous round is final. Only the events of about two rounds are buffered,
+// and each of them goes through a heap once.
+//
+// Events with the same timestamp are emitted in the order they were pushed,
+// so for well-formed input the output matches a stable sort by timestamp.
+template <typename Event>
+class EventReorderer {
+ public:
+  // |emit| is called with each event, in time order.
+  explicit EventReorderer(std::function<void(Event)> emit)
+      : emit_(std::move(emit)) {}
+
+  EventReorderer(const EventReorderer&) = delete;
+  EventReorderer& operator=(const EventReorderer&) = delete;
+
+  // Returns false if an event at |timestamp| is older than an event that has
+  // already been emitted, i.e. the input doesn't honor the round semantics.
+  bool InOrder(uint64_t timestamp) const {
+    return timestamp >= last_emitted_timestamp_;
+  }
+
+  // Buffers an event. Returns false, and drops the event, if it is not
+  // InOrder().
+  bool Push(uint64_t timestamp, Event event) {
+    if (!InOrder(timestamp)) return false;
+    heap_.push_back(Entry{timestamp, next_sequence_++, std::move(event)});
+    std::push_heap(heap_.begin(), heap_.end(), Later);
+    round_max_timestamp_ = std::max(round_max_timestamp_, timestamp);
+    return true;
+  }
+
+  // Called for each PERF_RECORD_FINISHED_ROUND event.
+  void FinishRound() {
+    EmitUpTo(previous_round_max_timestamp_);
+    previous_round_max_timestamp_ = round_max_timestamp_;
+  }
+
+  // Emits all the buffered events. Called after the last event.
+  void Flush() { EmitUpTo(UINT64_MAX); }
+
+  // Returns the number of events currently buffered.
+  size_t size() const { return heap_.size(); }
+
+ private:
+  struct Entry {
+    uint64_t timestamp;
+    // Breaks timestamp ties in push order.
+    uint64_t sequence;
+    Event event;
+  };
+
+  // Orders the heap so that the earliest entry is at the front.
+  static bool Later(const Entry& a, const Entry& b) {
+    return a.timestamp != b.timestamp ? a.timestamp > b.timestamp
+                                      : a.sequence > b.sequence;
+  }
+
+  void EmitUpTo(uint64_t timestamp) {
+    while (!heap_.empty() && heap_.front().timestamp <= timestamp) {
+      std::pop_heap(heap_.begin(), heap_.end(), Later);
+      last_emitted_timestamp_ = heap_.back().timestamp;
+      Event event = std::move(heap_.back().event);
+      heap_.pop_back();
+      emit_(std::move(event));
+    }
+  }
+
+  std::function<void(Event)> emit_;
+  std::vector<Entry> heap_;
+  uint64_t next_sequence_ = 0;
+  uint64_t last_emitted_timestamp_ = 0;
+  // The latest timestamps pushed in the current and the previous round.
+  uint64_t round_max_timestamp_ = 0;
+  uint64_t previous_round_max_timestamp_ = 0;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_EVENT_REORDERER_H_
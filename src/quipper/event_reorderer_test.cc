@@ -0,0 +1,69 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "event_reorderer.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "compat/test.h"
+
+namespace quipper {
+
+TEST(EventReordererTest, EmitsFinishedRoundsInOrder) {
+  std::vector<uint64_t> emitted;
+  EventReorderer<uint64_t> reorderer(
+      [&emitted](uint64_t timestamp) { emitted.push_back(timestamp); });
+
+  // Round 1.
+  EXPECT_TRUE(reorderer.Push(10, 10));
+  EXPECT_TRUE(reorderer.Push(30, 30));
+  EXPECT_TRUE(reorderer.Push(20, 20));
+  reorderer.FinishRound();
+  // Events of the next round may still precede the ones of this round.
+  EXPECT_TRUE(emitted.empty());
+
+  // Round 2.
+  EXPECT_TRUE(reorderer.Push(25, 25));
+  EXPECT_TRUE(reorderer.Push(40, 40));
+  reorderer.FinishRound();
+  // Everything up to the latest timestamp of round 1 is final.
+  EXPECT_EQ((std::vector<uint64_t>{10, 20, 25, 30}), emitted);
+  EXPECT_EQ(1, reorderer.size());
+
+  // Round 3 can't reach back before the events already emitted.
+  EXPECT_FALSE(reorderer.InOrder(29));
+  EXPECT_FALSE(reorderer.Push(29, 29));
+  EXPECT_TRUE(reorderer.InOrder(30));
+  EXPECT_TRUE(reorderer.Push(30, 31));
+  EXPECT_TRUE(reorderer.Push(35, 35));
+
+  reorderer.Flush();
+  EXPECT_EQ((std::vector<uint64_t>{10, 20, 25, 30, 31, 35, 40}), emitted);
+  EXPECT_EQ(0, reorderer.size());
+}
+
+TEST(EventReordererTest, KeepsPushOrderForEqualTimestamps) {
+  std::vector<std::unique_ptr<int>> emitted;
+  EventReorderer<std::unique_ptr<int>> reorderer(
+      [&emitted](std::unique_ptr<int> event) {
+        emitted.push_back(std::move(event));
+      });
+
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(
+        reorderer.Push(100 - (i % 2), std::unique_ptr<int>(new int(i))));
+  }
+  reorderer.Flush();
+
+  ASSERT_EQ(10, emitted.size());
+  // The events at 99 come first, each group in push order.
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(2 * i + 1, *emitted[i]);
+    EXPECT_EQ(2 * i, *emitted[i + 5]);
+  }
+}
+
+}  // namespace quipper
@@ -0,0 +1,71 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "file_writer.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+FileWriter::FileWriter(const std::string& filename)
+    : offset_(0), failed_(false) {
+  size_ = 0;
+  outfile_ = fopen(filename.c_str(), "wb");
+  if (!IsOpen()) PLOG(ERROR) << "Failed to open " << filename;
+}
+
+FileWriter::~FileWriter() {
+  if (IsOpen()) fclose(outfile_);
+}
+
+void FileWriter::SeekSet(size_t offset) {
+  if (!IsOpen() || offset == offset_) return;
+  if (fseek(outfile_, offset, SEEK_SET) != 0) {
+    PLOG(ERROR) << "fseek failure for offset " << offset;
+    failed_ = true;
+    return;
+  }
+  offset_ = offset;
+}
+
+bool FileWriter::WriteData(const void* src, const size_t size) {
+  if (!IsOpen() || failed_) return false;
+  if (size == 0) return true;
+  if (fwrite(src, 1, size, outfile_) < size) {
+    failed_ = true;
+    return false;
+  }
+  offset_ += size;
+  size_ = std::max(size_, offset_);
+  return true;
+}
+
+bool FileWriter::WriteString(const std::string& str, const size_t size) {
+  const size_t write_size = std::min(str.size(), size);
+  if (!WriteData(str.data(), write_size)) return false;
+  for (size_t i = write_size; i < size; ++i) {
+    if (fputc(0, outfile_) == EOF) {
+      failed_ = true;
+      return false;
+    }
+    ++offset_;
+  }
+  size_ = std::max(size_, offset_);
+  return true;
+}
+
+bool FileWriter::Close() {
+  if (!IsOpen()) return false;
+  const bool closed = fclose(outfile_) == 0;
+  outfile_ = nullptr;
+  if (!closed || failed_) {
+    LOG(ERROR) << "Failed to write the output file";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace quipper
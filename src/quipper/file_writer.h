@@ -0,0 +1,56 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_FILE_WRITER_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_FILE_WRITER_H_
+
+#include <stdio.h>
+
+#include <string>
+
+#include "data_writer.h"
+
+namespace quipper {
+
+// Writes to an output file, which is created or truncated. The writes are
+// buffered, so the output does not have to be sized up front. size() is the
+// size of the file written so far.
+class FileWriter : public DataWriter {
+ public:
+  explicit FileWriter(const std::string& filename);
+  ~FileWriter() override;
+
+  FileWriter(const FileWriter&) = delete;
+  FileWriter& operator=(const FileWriter&) = delete;
+
+  bool IsOpen() const { return outfile_; }
+
+  void SeekSet(size_t offset) override;
+
+  size_t Tell() const override { return offset_; }
+
+  bool WriteData(const void* src, const size_t size) override;
+
+  bool WriteString(const std::string& str, const size_t size) override;
+
+  // Flushes and closes the file. Returns false if any write failed, in which
+  // case the file contents are incomplete.
+  bool Close();
+
+ private:
+  bool CanWriteSize(size_t data_size) override { return IsOpen(); }
+
+  // File output handle.
+  FILE* outfile_;
+
+  // Current write offset, in bytes from the start of the file.
+  size_t offset_;
+
+  // Set if a seek or write failed.
+  bool failed_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_FILE_WRITER_H_
@@ -0,0 +1,50 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "file_writer.h"
+
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+#include "file_utils.h"
+#include "scoped_temp_path.h"
+
+namespace quipper {
+
+TEST(FileWriterTest, WritesAndBackpatchesData) {
+  ScopedTempFile output_file;
+  FileWriter writer(output_file.path());
+  ASSERT_TRUE(writer.IsOpen());
+  EXPECT_EQ(0, writer.Tell());
+
+  // Leave room for a header, and fill it in after the rest.
+  writer.SeekSet(4);
+  EXPECT_TRUE(writer.WriteData("data", 4));
+  EXPECT_TRUE(writer.WriteString("padded", 8));
+  EXPECT_TRUE(writer.WriteString("truncated", 5));
+  EXPECT_TRUE(writer.WriteData(nullptr, 0));
+  EXPECT_EQ(21, writer.Tell());
+  EXPECT_EQ(21, writer.size());
+  writer.SeekSet(0);
+  EXPECT_TRUE(writer.WriteData("head", 4));
+  EXPECT_EQ(4, writer.Tell());
+  EXPECT_EQ(21, writer.size());
+  ASSERT_TRUE(writer.Close());
+
+  std::vector<char> contents;
+  ASSERT_TRUE(FileToBuffer(output_file.path(), &contents));
+  EXPECT_EQ(std::string("headdatapadded\0\0trunc", 21),
+            std::string(contents.begin(), contents.end()));
+}
+
+TEST(FileWriterTest, FailsToWriteToMissingDirectory) {
+  ScopedTempDir output_dir;
+  FileWriter writer(output_dir.path() + "missing/file");
+  EXPECT_FALSE(writer.IsOpen());
+  EXPECT_FALSE(writer.WriteData("data", 4));
+  EXPECT_FALSE(writer.Close());
+}
+
+}  // namespace quipper
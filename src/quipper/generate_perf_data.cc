@@ -0,0 +1,113 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Writes a synthetic perf.data file, for benchmarks and load tests of the
+// readers and converters. See SyntheticPerfDataOptions for what the options
+// control.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+#include "base/logging.h"
+#include "synthetic_perf_data.h"
+
+using quipper::testing::SyntheticPerfDataOptions;
+using quipper::testing::SyntheticPerfDataStats;
+
+namespace {
+
+bool ParseArguments(int argc, char* argv[], SyntheticPerfDataOptions* options,
+                    std::string* output) {
+  int opt;
+  while ((opt = getopt(argc, argv, "o:s:p:n:c:m:j:d:D:b:a:l:x")) != -1) {
+    switch (opt) {
+      case 'o':
+        *output = optarg;
+        break;
+      case 's':
+        options->seed = strtoull(optarg, nullptr, 0);
+        break;
+      case 'p':
+        options->num_processes = atoi(optarg);
+        break;
+      case 'n':
+        options->num_samples = strtoull(optarg, nullptr, 0);
+        break;
+      case 'c':
+        options->churn_rate = atof(optarg);
+        break;
+      case 'm':
+        options->mmaps_per_process = atoi(optarg);
+        break;
+      case 'j':
+        options->jit_regions_per_process = atoi(optarg);
+        break;
+      case 'd':
+        options->min_stack_depth = atoi(optarg);
+        break;
+      case 'D':
+        options->max_stack_depth = atoi(optarg);
+        break;
+      case 'b':
+        options->branch_stack_entries = atoi(optarg);
+        break;
+      case 'a':
+        options->spe_records_per_sample = atoi(optarg);
+        break;
+      case 'l':
+        options->lost_rate = atof(optarg);
+        break;
+      case 'x':
+        options->cross_endian = true;
+        break;
+      default:
+        return false;
+    }
+  }
+  return !output->empty() && optind == argc;
+}
+
+void PrintUsage() {
+  LOG(INFO) << "Usage:";
+  LOG(INFO) << "<exe> -o <output perf.data> [-s <seed>] [-p <processes>]"
+            << " [-n <samples>] [-c <churn rate>] [-m <mmaps per process>]"
+            << " [-j <JIT regions per process>] [-d <min stack depth>]"
+            << " [-D <max stack depth>] [-b <branch stack entries>]"
+            << " [-a <SPE records per sample>] [-l <lost rate>] [-x]";
+  LOG(INFO) << "The rates are probabilities per sample, and -x writes the"
+            << " file in the opposite byte order of the host.";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  SyntheticPerfDataOptions options;
+  std::string output;
+  if (!ParseArguments(argc, argv, &options, &output)) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+  std::ofstream out(output, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    LOG(ERROR) << "Failed to open " << output;
+    return EXIT_FAILURE;
+  }
+  SyntheticPerfDataStats stats;
+  if (!quipper::testing::WriteSyntheticPerfData(options, &out, &stats)) {
+    return EXIT_FAILURE;
+  }
+  out.close();
+  if (!out) {
+    LOG(ERROR) << "Failed to write " << output;
+    return EXIT_FAILURE;
+  }
+  LOG(INFO) << "Wrote " << stats.bytes << " bytes: " << stats.samples
+            << " samples, " << stats.mmaps << " mmaps, " << stats.forks
+            << " forks, " << stats.exits << " exits, " << stats.lost_events
+            << " lost events and " << stats.spe_records << " SPE records";
+  return EXIT_SUCCESS;
+}
@@ -6,10 +6,16 @@
 
 #include <sys/mman.h>
 
+#include <algorithm>
 #include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "base/logging.h"
+#include "compat/thread_pool.h"
 #include "perf_data_utils.h"
+#include "trace.h"
 
 using PerfEvent = quipper::PerfDataProto::PerfEvent;
 using MMapEvent = quipper::PerfDataProto::MMapEvent;
@@ -26,8 +32,9 @@ bool IsAnon(const MMapEvent& event) {
                   event.filename() == kAnonHugepageFilename ||
                   event.filename() == kAnonHugepageDeletedFilename);
   if (is_anon && event.pgoff() != 0) {
-    LOG(WARNING) << "//anon should have offset=0 for mmap "
-                 << event.ShortDebugString();
+    LOG(WARNING) << "//anon should have offset=0 for mmap of "
+                 << event.filename() << " at 0x" << std::hex << event.start()
+                 << " with offset 0x" << event.pgoff();
   }
   return is_anon;
 }
@@ -153,122 +160,97 @@ namespace {
 // A map from PID to ranges of mmap events associated with the PID.
 class PerPidMMapEventRange {
  public:
-  using event_itr_t = RepeatedPtrField<PerfEvent>::iterator;
   using key_t = int32_t;
-  using value_t = std::pair<event_itr_t, event_itr_t>;
-  using container = std::unordered_map<key_t, value_t>;
 
-  // Abstracts a range of mmap events between [begin, end).
+  // Iterates over the mmap events of a PID, given by their positions.
   class MMapEventIterator {
    public:
-    MMapEventIterator(key_t pid, event_itr_t begin, event_itr_t end)
-        : itr_(begin), end_(end), pid_(pid), has_events_(true) {}
-    MMapEventIterator() : has_events_(false) {}
+    MMapEventIterator(RepeatedPtrField<PerfEvent>* events,
+                      std::vector<int>::const_iterator itr)
+        : events_(events), itr_(itr) {}
 
-    bool operator==(const MMapEventIterator& x) const {
-      if (!has_events_) {
-        return !x.has_events_;
-      }
-      if (!x.has_events_) {
-        return false;
-      }
-      assert(pid_ == x.pid_);
-      return itr_ == x.itr_;
-    }
+    bool operator==(const MMapEventIterator& x) const { return itr_ == x.itr_; }
 
     bool operator!=(const MMapEventIterator& x) const { return !(*this == x); }
 
-    PerfEvent* operator*() const { return &*itr_; }
+    PerfEvent* operator*() const { return events_->Mutable(*itr_); }
 
-    PerfEvent* operator->() const { return &*itr_; }
+    PerfEvent* operator->() const { return events_->Mutable(*itr_); }
 
     MMapEventIterator& operator++() {
-      for (++itr_; itr_ != end_; ++itr_) {
-        if (!itr_->has_mmap_event()) {
-          continue;
-        }
-        key_t itr_pid = -1;
-        if (itr_->mmap_event().has_pid()) {
-          itr_pid = itr_->mmap_event().pid();
-        }
-        if (itr_pid == pid_) {
-          // Found next matching mmap_event for pid.
-          return *this;
-        }
-      }
-      has_events_ = false;
+      ++itr_;
       return *this;
     }
 
    private:
-    // Current iterator position.
-    event_itr_t itr_;
-    // 1 beyond the last event in this range.
-    event_itr_t end_;
-    // PID of events this iterator is going through.
-    key_t pid_;
-    // Cleared when the iterator runs out of events.
-    bool has_events_;
+    RepeatedPtrField<PerfEvent>* events_;
+    // Current position.
+    std::vector<int>::const_iterator itr_;
   };
 
+  // The mmap events of a PID, from its first to its last synthesized one.
   class MMapEventsForPid {
    public:
-    MMapEventsForPid(container::const_iterator itr) : itr_(itr) {}
+    MMapEventsForPid(RepeatedPtrField<PerfEvent>* events,
+                     std::vector<int> positions)
+        : events_(events), positions_(std::move(positions)) {}
 
     MMapEventIterator begin() const {
-      return MMapEventIterator(itr_->first, itr_->second.first,
-                               itr_->second.second);
+      return MMapEventIterator(events_, positions_.begin());
     }
-    MMapEventIterator end() const { return MMapEventIterator(); }
-
-    const MMapEventsForPid& operator*() const { return *this; }
-
-    bool operator==(const MMapEventsForPid& x) const { return itr_ == x.itr_; }
-
-    bool operator!=(const MMapEventsForPid& x) const { return !(*this == x); }
-
-    MMapEventsForPid& operator++() {
-      ++itr_;
-      return *this;
+    MMapEventIterator end() const {
+      return MMapEventIterator(events_, positions_.end());
     }
 
    private:
-    container::const_iterator itr_;
+    RepeatedPtrField<PerfEvent>* events_;
+    std::vector<int> positions_;
   };
 
-  PerPidMMapEventRange(RepeatedPtrField<PerfEvent>* events) {
-    auto cur = events->begin();
-    auto end = events->end();
-    for (; cur != end; ++cur) {
-      if (!cur->has_mmap_event()) {
-        continue;
+  PerPidMMapEventRange(const MmapEventIndex& index,
+                       RepeatedPtrField<PerfEvent>* events) {
+    // The mmap events of each PID, and how many of them there are up to and
+    // including the last synthesized one.
+    std::unordered_map<key_t, std::pair<std::vector<int>, size_t>> pid_mmaps;
+    for (int position : index.positions()) {
+      const PerfEvent& event = events->Get(position);
+      key_t pid = -1;
+      if (event.mmap_event().has_pid()) {
+        pid = event.mmap_event().pid();
       }
-      // Skip dynamic mmap() events. Hugepage deduction only works on mmaps as
+      // Only look at the mmap events from a PID's first to its last
+      // synthesized one. Hugepage deduction only works on mmaps as
       // synthesized by perf from /proc/${pid}/maps, which have timestamp==0.
-      // Support for deducing hugepages from a sequence of mmap()/mremap() calls
-      // would require additional deduction logic.
-      if (cur->timestamp() != 0) {
-        continue;
-      }
-      key_t pid = -1;
-      if (cur->mmap_event().has_pid()) {
-        pid = cur->mmap_event().pid();
+      // Support for deducing hugepages from a sequence of mmap()/mremap()
+      // calls would require additional deduction logic.
+      auto entry = pid_mmaps.find(pid);
+      if (entry == pid_mmaps.end()) {
+        if (event.timestamp() != 0) continue;
+        entry = pid_mmaps.emplace(pid, std::make_pair(std::vector<int>(), 0))
+                    .first;
       }
-      auto entry = map_.find(pid);
-      if (entry == map_.end()) {
-        map_[pid] = {cur, cur + 1};
-      } else {
-        entry->second.second = cur + 1;
+      entry->second.first.push_back(position);
+      if (event.timestamp() == 0) {
+        entry->second.second = entry->second.first.size();
       }
     }
+    for (auto& entry : pid_mmaps) {
+      std::vector<int>& positions = entry.second.first;
+      positions.resize(entry.second.second);
+      ranges_.emplace_back(events, std::move(positions));
+    }
   }
 
-  MMapEventsForPid begin() const { return MMapEventsForPid(map_.begin()); }
+  std::vector<MMapEventsForPid>::const_iterator begin() const {
+    return ranges_.begin();
+  }
 
-  MMapEventsForPid end() const { return MMapEventsForPid(map_.end()); }
+  std::vector<MMapEventsForPid>::const_iterator end() const {
+    return ranges_.end();
+  }
 
  private:
-  container map_;
+  std::vector<MMapEventsForPid> ranges_;
 };
 
 void UpdateRangeFromNext(PerPidMMapEventRange::MMapEventIterator first,
@@ -317,106 +299,135 @@ void UpdateRangeFromNext(PerPidMMapEventRange::MMapEventIterator first,
   CHECK_EQ(pgoff, start_pgoff + range_length);
 }
 
-}  // namespace
-
-void DeduceHugePages(RepeatedPtrField<PerfEvent>* events) {
-  PerPidMMapEventRange ranges(events);
-
-  for (auto mmap_range : ranges) {
-    // mmap_range is a set of mmap events associated with a PID. We care here
-    // just about fixing huge pages to look like regular pages from a file for a
-    // PID.
-
-    using iterator = PerPidMMapEventRange::MMapEventIterator;
-    // Assigned the start of a set of huge mmapped pages.
-    iterator huge_mmap_range_first = mmap_range.end();
-    // Assigned the last of a set of huge mmapped pages.
-    iterator huge_mmap_range_last = mmap_range.end();
-    // Assigned to the last non-mmap entry.
-    iterator pre_mmap_range_last = mmap_range.end();
-    for (auto itr = mmap_range.begin(); itr != mmap_range.end(); ++itr) {
-      const auto& cur_mmap = itr->mmap_event();
-      if (IsHugePage(cur_mmap)) {
-        if (huge_mmap_range_first == mmap_range.end()) {
-          // New range.
-          huge_mmap_range_first = itr;
+// Deduces the huge page mappings among |mmap_range|, the mmap events of a PID.
+// Only modifies those events.
+void DeducePidHugePages(
+    const PerPidMMapEventRange::MMapEventsForPid& mmap_range) {
+  // mmap_range is a set of mmap events associated with a PID. We care here
+  // just about fixing huge pages to look like regular pages from a file for a
+  // PID.
+
+  using iterator = PerPidMMapEventRange::MMapEventIterator;
+  // Assigned the start of a set of huge mmapped pages.
+  iterator huge_mmap_range_first = mmap_range.end();
+  // Assigned the last of a set of huge mmapped pages.
+  iterator huge_mmap_range_last = mmap_range.end();
+  // Assigned to the last non-mmap entry.
+  iterator pre_mmap_range_last = mmap_range.end();
+  for (auto itr = mmap_range.begin(); itr != mmap_range.end(); ++itr) {
+    const auto& cur_mmap = itr->mmap_event();
+    if (IsHugePage(cur_mmap)) {
+      if (huge_mmap_range_first == mmap_range.end()) {
+        // New range.
+        huge_mmap_range_first = itr;
+        huge_mmap_range_last = itr;
+      } else {
+        const auto& mmap_range_last = huge_mmap_range_last->mmap_event();
+        if (IsVmaContiguous(mmap_range_last, cur_mmap) &&
+            (mmap_range_last.filename() == cur_mmap.filename() ||
+             (IsMergeableAnon(mmap_range_last, cur_mmap))) &&
+            (IsFileContiguous(mmap_range_last, cur_mmap) ||
+             (mmap_range_last.pgoff() == 0 && cur_mmap.pgoff() == 0))) {
+          // Ranges match exactly: //anon,//anon, or file,file; If they use
+          // different names, then deduction needs to consider them
+          // independently.
           huge_mmap_range_last = itr;
         } else {
-          const auto& mmap_range_last = huge_mmap_range_last->mmap_event();
-          if (IsVmaContiguous(mmap_range_last, cur_mmap) &&
-              (mmap_range_last.filename() == cur_mmap.filename() ||
-               (IsMergeableAnon(mmap_range_last, cur_mmap))) &&
-              (IsFileContiguous(mmap_range_last, cur_mmap) ||
-               (mmap_range_last.pgoff() == 0 && cur_mmap.pgoff() == 0))) {
-            // Ranges match exactly: //anon,//anon, or file,file; If they use
-            // different names, then deduction needs to consider them
-            // independently.
-            huge_mmap_range_last = itr;
-          } else {
-            // Discontiguous range, start a new range.
-            huge_mmap_range_first = itr;
-            huge_mmap_range_last = itr;
-            pre_mmap_range_last = mmap_range.end();
-          }
+          // Discontiguous range, start a new range.
+          huge_mmap_range_first = itr;
+          huge_mmap_range_last = itr;
+          pre_mmap_range_last = mmap_range.end();
         }
-      } else {
-        if (huge_mmap_range_first != mmap_range.end()) {
-          const auto& mmap_range_first = huge_mmap_range_first->mmap_event();
-          const auto& mmap_range_last = huge_mmap_range_last->mmap_event();
-          // Not a huge page but there's a pending range to process.
-          uint64_t huge_mmap_range_length = mmap_range_last.start() -
-                                            mmap_range_first.start() +
-                                            mmap_range_last.len();
-          uint64_t start_pgoff = 0;
-          if (pre_mmap_range_last != mmap_range.end()) {
-            const auto& pre_mmap = pre_mmap_range_last->mmap_event();
-            if (IsVmaContiguous(pre_mmap, mmap_range_first) &&
-                IsEquivalentFile(pre_mmap, mmap_range_first) &&
-                IsEquivalentFile(pre_mmap, cur_mmap)) {
-              start_pgoff = pre_mmap.pgoff() + pre_mmap.len();
-            }
-          }
-          if (IsVmaContiguous(mmap_range_last, cur_mmap) &&
-              IsEquivalentFile(mmap_range_last, cur_mmap) &&
-              cur_mmap.pgoff() >= huge_mmap_range_length &&
-              cur_mmap.pgoff() - huge_mmap_range_length == start_pgoff) {
-            UpdateRangeFromNext(huge_mmap_range_first, huge_mmap_range_last,
-                                itr, cur_mmap);
+      }
+    } else {
+      if (huge_mmap_range_first != mmap_range.end()) {
+        const auto& mmap_range_first = huge_mmap_range_first->mmap_event();
+        const auto& mmap_range_last = huge_mmap_range_last->mmap_event();
+        // Not a huge page but there's a pending range to process.
+        uint64_t huge_mmap_range_length = mmap_range_last.start() -
+                                          mmap_range_first.start() +
+                                          mmap_range_last.len();
+        uint64_t start_pgoff = 0;
+        if (pre_mmap_range_last != mmap_range.end()) {
+          const auto& pre_mmap = pre_mmap_range_last->mmap_event();
+          if (IsVmaContiguous(pre_mmap, mmap_range_first) &&
+              IsEquivalentFile(pre_mmap, mmap_range_first) &&
+              IsEquivalentFile(pre_mmap, cur_mmap)) {
+            start_pgoff = pre_mmap.pgoff() + pre_mmap.len();
           }
-          huge_mmap_range_first = mmap_range.end();
-          huge_mmap_range_last = mmap_range.end();
         }
-        pre_mmap_range_last = itr;
+        if (IsVmaContiguous(mmap_range_last, cur_mmap) &&
+            IsEquivalentFile(mmap_range_last, cur_mmap) &&
+            cur_mmap.pgoff() >= huge_mmap_range_length &&
+            cur_mmap.pgoff() - huge_mmap_range_length == start_pgoff) {
+          UpdateRangeFromNext(huge_mmap_range_first, huge_mmap_range_last,
+                              itr, cur_mmap);
+        }
+        huge_mmap_range_first = mmap_range.end();
+        huge_mmap_range_last = mmap_range.end();
       }
+      pre_mmap_range_last = itr;
     }
   }
 }
 
+// The fewest PIDs worth deducing huge pages for on their own thread.
+const size_t kMinPidsPerThread = 256;
+
+}  // namespace
+
+MmapEventIndex::MmapEventIndex(const RepeatedPtrField<PerfEvent>& events) {
+  for (int i = 0; i < events.size(); ++i) {
+    if (events.Get(i).has_mmap_event()) positions_.push_back(i);
+  }
+}
+
+void DeduceHugePages(RepeatedPtrField<PerfEvent>* events) {
+  DeduceHugePages(MmapEventIndex(*events), events);
+}
+
+void DeduceHugePages(const MmapEventIndex& index,
+                     RepeatedPtrField<PerfEvent>* events, int num_threads,
+                     ThreadPool* pool) {
+  QUIPPER_TRACE_SPAN("DeduceHugePages");
+  PerPidMMapEventRange ranges(index, events);
+
+  // Each PID's mmap events are only read and written by its own deduction, so
+  // the PIDs are split among the threads, which take the next one until none
+  // are left.
+  const size_t num_pids = ranges.end() - ranges.begin();
+  const size_t max_threads = std::max<size_t>(num_pids / kMinPidsPerThread, 1);
+  const size_t num_used_threads =
+      std::min<size_t>(std::max(num_threads, 1), max_threads);
+  ParallelFor(pool, num_pids, num_used_threads,
+              [&ranges](size_t i) { DeducePidHugePages(ranges.begin()[i]); });
+}
+
 void CombineMappings(RepeatedPtrField<PerfEvent>* events) {
-  // Combine mappings
-  RepeatedPtrField<PerfEvent> new_events;
-  new_events.Reserve(events->size());
+  MmapEventIndex index(*events);
+  CombineMappings(&index, events);
+}
+
+void CombineMappings(MmapEventIndex* index,
+                     RepeatedPtrField<PerfEvent>* events) {
+  QUIPPER_TRACE_SPAN("CombineMappings");
   std::unordered_map<int32_t, int> pid_to_prev_map;
+  // The positions of the mmap events merged into earlier ones.
+  std::vector<int> merged;
 
-  // |prev| is the index of the last mmap_event in |new_events| (or
-  // |new_events.size()| if no mmap_events have been inserted yet).
-  for (int i = 0; i < events->size(); ++i) {
+  // The values in |pid_to_prev_map| are the positions of the last kept mmap
+  // event of each PID.
+  for (int i : index->positions()) {
     PerfEvent* event = events->Mutable(i);
-    bool should_merge = false;
-
-    const MMapEvent* mmap = nullptr;
+    const MMapEvent* mmap = &event->mmap_event();
     MMapEvent* prev_mmap = nullptr;
     PerfEvent* prev_mmap_event = nullptr;
-    int32_t pid = -1;
-    if (event->has_mmap_event()) {
-      mmap = &event->mmap_event();
-      pid = mmap->has_pid() ? mmap->pid() : -1;
-      auto itr = pid_to_prev_map.find(pid);
-      should_merge = itr != pid_to_prev_map.end();
-      if (should_merge) {
-        prev_mmap_event = new_events.Mutable(itr->second);
-        prev_mmap = prev_mmap_event->mutable_mmap_event();
-      }
+    int32_t pid = mmap->has_pid() ? mmap->pid() : -1;
+    auto itr = pid_to_prev_map.find(pid);
+    bool should_merge = itr != pid_to_prev_map.end();
+    if (should_merge) {
+      prev_mmap_event = events->Mutable(itr->second);
+      prev_mmap = prev_mmap_event->mutable_mmap_event();
     }
 
     // TODO(b/169891636):  For hugetlbfs-backed files, We should verify that the
@@ -439,16 +450,43 @@ void CombineMappings(RepeatedPtrField<PerfEvent>* events) {
       }
       // Combine the lengths of the two mappings.
       prev_mmap->set_len(prev_mmap->len() + mmap->len());
+      merged.push_back(i);
     } else {
       // Remember the last mmap event for a PID.
-      if (mmap != nullptr) {
-        pid_to_prev_map[pid] = new_events.size();
-      }
-      new_events.Add()->Swap(event);
+      pid_to_prev_map[pid] = i;
     }
   }
-
-  events->Swap(&new_events);
+  if (merged.empty()) return;
+
+  // Remove the merged events by moving the blocks of events between them down
+  // over them, as pointers, and deleting them from the end.
+  auto data = events->pointer_begin();
+  std::vector<PerfEvent*> removed;
+  removed.reserve(merged.size());
+  int write_index = merged[0];
+  for (size_t k = 0; k < merged.size(); ++k) {
+    removed.push_back(data[merged[k]]);
+    const int block_begin = merged[k] + 1;
+    const int block_end =
+        k + 1 < merged.size() ? merged[k + 1] : events->size();
+    std::copy(data + block_begin, data + block_end, data + write_index);
+    write_index += block_end - block_begin;
+  }
+  std::copy(removed.begin(), removed.end(), data + write_index);
+  events->DeleteSubrange(write_index, removed.size());
+
+  // Shift the positions of the kept mmap events down past the merged ones.
+  std::vector<int>* positions = index->mutable_positions();
+  size_t num_kept = 0;
+  size_t num_merged = 0;
+  for (int position : *positions) {
+    if (num_merged < merged.size() && merged[num_merged] == position) {
+      ++num_merged;
+      continue;
+    }
+    (*positions)[num_kept++] = position - num_merged;
+  }
+  positions->resize(num_kept);
 }
 
 }  // namespace quipper
@@ -5,10 +5,29 @@
 #ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_HUGE_PAGE_DEDUCER_H_
 #define PERF_DATA_CONVERTER_SRC_QUIPPER_HUGE_PAGE_DEDUCER_H_
 
+#include <vector>
+
 #include "compat/proto.h"
 
 namespace quipper {
 
+class ThreadPool;
+
+// The positions of the mmap events in a list of events, so that the passes
+// below only look at those rather than at every sample.
+class MmapEventIndex {
+ public:
+  explicit MmapEventIndex(
+      const RepeatedPtrField<PerfDataProto::PerfEvent>& events);
+
+  // The positions, in increasing order.
+  const std::vector<int>& positions() const { return positions_; }
+  std::vector<int>* mutable_positions() { return &positions_; }
+
+ private:
+  std::vector<int> positions_;
+};
+
 // Walks through all the perf events in |*events| and deduces correct |pgoff|
 // and |filename| values for MMAP events.
 //
@@ -19,11 +38,24 @@ namespace quipper {
 // other mappings would remain unchanged.
 void DeduceHugePages(RepeatedPtrField<PerfDataProto::PerfEvent>* events);
 
+// Same as above, with |index| being the MmapEventIndex of |*events|. When
+// there are many processes, they are split among up to |num_threads| threads,
+// or as many tasks on |pool| if it isn't null. The result doesn't depend on
+// the number of threads.
+void DeduceHugePages(const MmapEventIndex& index,
+                     RepeatedPtrField<PerfDataProto::PerfEvent>* events,
+                     int num_threads = 1, ThreadPool* pool = nullptr);
+
 // Walks through all the perf events in |*events| and searches for split
 // mappings. Combines these split mappings into one and replaces the split
 // mapping events. Modifies the events vector stored in |*events|.
 void CombineMappings(RepeatedPtrField<PerfDataProto::PerfEvent>* events);
 
+// Same as above, with |index| being the MmapEventIndex of |*events|. Updates
+// |index| to match the combined events.
+void CombineMappings(MmapEventIndex* index,
+                     RepeatedPtrField<PerfDataProto::PerfEvent>* events);
+
 }  // namespace quipper
 
 #endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_HUGE_PAGE_DEDUCER_H_
@@ -148,6 +148,78 @@ TEST(HugePageDeducer, HugePagesMappings) {
                         }));
 }
 
+// The events between merged mappings keep their order, and are moved rather
+// than copied.
+TEST(HugePageDeducer, CombineMappingsKeepsOtherEvents) {
+  RepeatedPtrField<PerfEvent> events;
+  AddMmap(1, 0x1000, 0x1000, 0, "file", &events);
+  events.Add()->mutable_sample_event()->set_ip(0x1010);
+  AddMmap(1, 0x2000, 0x1000, 0x1000, "file", &events);
+  events.Add()->mutable_sample_event()->set_ip(0x2020);
+  AddMmap(2, 0x1000, 0x1000, 0, "other", &events);
+  const PerfEvent* first_sample = &events.Get(1);
+  const PerfEvent* second_sample = &events.Get(3);
+
+  CombineMappings(&events);
+
+  EXPECT_THAT(events,
+              Pointwise(Partially(EqualsProto()),
+                        {"mmap_event: { pid: 1 start: 0x1000 len: 0x2000 "
+                         "pgoff: 0 filename: 'file' }",
+                         "sample_event: { ip: 0x1010 }",
+                         "sample_event: { ip: 0x2020 }",
+                         "mmap_event: { pid: 2 start: 0x1000 len: 0x1000 "
+                         "pgoff: 0 filename: 'other' }"}));
+  EXPECT_EQ(first_sample, &events.Get(1));
+  EXPECT_EQ(second_sample, &events.Get(2));
+}
+
+// The index of the mmap events is updated as they are combined.
+TEST(HugePageDeducer, CombineMappingsUpdatesIndex) {
+  RepeatedPtrField<PerfEvent> events;
+  AddMmap(1, 0x1000, 0x1000, 0, "file", &events);
+  events.Add()->mutable_sample_event()->set_ip(0x1010);
+  AddMmap(1, 0x2000, 0x1000, 0x1000, "file", &events);
+  AddMmap(1, 0x3000, 0x1000, 0x2000, "file", &events);
+  events.Add()->mutable_sample_event()->set_ip(0x2020);
+  AddMmap(2, 0x1000, 0x1000, 0, "other", &events);
+
+  MmapEventIndex index(events);
+  EXPECT_EQ(std::vector<int>({0, 2, 3, 5}), index.positions());
+  DeduceHugePages(index, &events);
+  CombineMappings(&index, &events);
+
+  ASSERT_EQ(4, events.size());
+  EXPECT_EQ(std::vector<int>({0, 3}), index.positions());
+  EXPECT_EQ(0x3000, events.Get(0).mmap_event().len());
+  EXPECT_EQ(0x2020, events.Get(2).sample_event().ip());
+  EXPECT_EQ("other", events.Get(3).mmap_event().filename());
+}
+
+// Deducing the huge pages of many processes on several threads gives the same
+// result as on one.
+TEST(HugePageDeducer, DeducesManyProcessesOnThreads) {
+  RepeatedPtrField<PerfEvent> events;
+  for (uint32_t pid = 1; pid <= 2000; ++pid) {
+    AddMmap(pid, 0x40000000, 0x200000, 0, "//anon", &events);
+    AddMmap(pid, 0x40200000, 0x1000, 0x200000, "/opt/app", &events);
+    events.Add()->mutable_sample_event()->set_ip(0x40000100);
+  }
+  RepeatedPtrField<PerfEvent> serial_events = events;
+
+  DeduceHugePages(MmapEventIndex(serial_events), &serial_events, 1);
+  DeduceHugePages(MmapEventIndex(events), &events, 8);
+
+  ASSERT_EQ(serial_events.size(), events.size());
+  for (int i = 0; i < events.size(); ++i) {
+    EXPECT_EQ(serial_events.Get(i).SerializeAsString(),
+              events.Get(i).SerializeAsString())
+        << i;
+  }
+  EXPECT_EQ("/opt/app", events.Get(0).mmap_event().filename());
+  EXPECT_EQ("/opt/app", events.Get(events.size() - 3).mmap_event().filename());
+}
+
 enum HugepageTextStyle {
   kSlashSlashAnon,
   kAnonHugepage,
@@ -330,6 +330,7 @@ struct perf_sample {
   u32 flags;
   u16 insn_len;
   bool no_hw_idx; /* No hw_idx collected in branch_stack */
+  bool in_place;  /* callchain and raw_data point into the event */
   void *raw_data;
   struct ip_callchain *callchain;
   struct branch_stack *branch_stack;
@@ -358,6 +359,7 @@ struct perf_sample {
         data_src(0),
         flags(0),
         insn_len(0),
+        in_place(false),
         raw_data(nullptr),
         callchain(nullptr),
         branch_stack(nullptr),
@@ -369,9 +371,11 @@ struct perf_sample {
         data_page_size(0),
         code_page_size(0) {}
   ~perf_sample() {
-    delete[] callchain;
+    if (!in_place) {
+      delete[] callchain;
+      delete[] reinterpret_cast<char *>(raw_data);
+    }
     delete[] branch_stack;
-    delete[] reinterpret_cast<char *>(raw_data);
   }
 };
 
@@ -416,7 +420,10 @@ enum perf_user_event_type {
   PERF_RECORD_EVENT_UPDATE = 78,
   PERF_RECORD_TIME_CONV = 79,
   PERF_RECORD_HEADER_FEATURE = 80,
-  PERF_RECORD_HEADER_MAX = 81,
+  PERF_RECORD_COMPRESSED = 81,
+  PERF_RECORD_FINISHED_INIT = 82,
+  PERF_RECORD_COMPRESSED2 = 83,
+  PERF_RECORD_HEADER_MAX = 84,
 };
 
 enum auxtrace_error_type {
@@ -609,6 +616,19 @@ struct feature_event {
   char data[];
 };
 
+/* The zstd compressed events of perf record -z. */
+struct compressed_event {
+  struct perf_event_header header;
+  char data[];
+};
+
+/* Like compressed_event, but with the data padded to 8 bytes. */
+struct compressed2_event {
+  struct perf_event_header header;
+  u64 data_size;
+  char data[];
+};
+
 union perf_event {
   struct perf_event_header header;
   struct mmap_event mmap;
@@ -640,6 +660,8 @@ union perf_event {
   struct stat_round_event stat_round;
   struct time_conv_event time_conv;
   struct feature_event feat;
+  struct compressed_event pack;
+  struct compressed2_event pack2;
 };
 
 typedef perf_event event_t;
@@ -0,0 +1,96 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mmap_data_reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+MmapDataReader::MmapDataReader(const std::string& filename)
+    : buffer_(nullptr), offset_(0) {
+  size_ = 0;
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return;
+  }
+
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    PLOG(WARNING) << "mmap failure for " << filename;
+    return;
+  }
+  buffer_ = static_cast<const char*>(mapping);
+  size_ = st.st_size;
+}
+
+MmapDataReader::~MmapDataReader() {
+  if (IsMapped()) {
+    munmap(const_cast<char*>(buffer_), size_);
+  }
+}
+
+bool MmapDataReader::SeekSet(size_t offset) {
+  if (offset > size_) {
+    LOG(ERROR) << "Illegal offset " << offset << " in file of size " << size_;
+    return false;
+  }
+  offset_ = offset;
+  return true;
+}
+
+bool MmapDataReader::ReadData(const size_t size, void* dest) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
+
+  memcpy(dest, buffer_ + offset_, size);
+  offset_ += size;
+  return true;
+}
+
+const void* MmapDataReader::GetContiguousData(size_t offset,
+                                              size_t size) const {
+  if (buffer_ == nullptr || offset > size_ || size > size_ - offset) {
+    return nullptr;
+  }
+  return buffer_ + offset;
+}
+
+bool MmapDataReader::ReadString(size_t size, std::string* str) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
+
+  size_t actual_length = strnlen(buffer_ + offset_, size);
+  *str = std::string(buffer_ + offset_, actual_length);
+  offset_ += size;
+  return true;
+}
+
+void MmapDataReader::AdviseSequential(size_t offset, size_t size) {
+  if (!IsMapped() || offset >= size_) return;
+  if (size > size_ - offset) size = size_ - offset;
+
+  // madvise() requires a page-aligned start address.
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(buffer_ + offset);
+  uintptr_t aligned_start = start & ~(page_size - 1);
+  if (madvise(reinterpret_cast<void*>(aligned_start),
+              size + (start - aligned_start), MADV_SEQUENTIAL) != 0) {
+    PLOG(WARNING) << "madvise(MADV_SEQUENTIAL) failure";
+  }
+}
+
+}  // namespace quipper
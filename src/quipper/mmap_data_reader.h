@@ -0,0 +1,58 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_MMAP_DATA_READER_H_
+#define CHROMIUMOS_WIDE_PROFILING_MMAP_DATA_READER_H_
+
+#include <string>
+
+#include "data_reader.h"
+
+namespace quipper {
+
+// Read from an input file by mapping it read-only into memory. Data is served
+// straight out of the mapping, so the file contents are never copied into a
+// separate buffer. Must be a normal, mappable file. Does not support pipe
+// inputs.
+class MmapDataReader : public DataReader {
+ public:
+  explicit MmapDataReader(const std::string& filename);
+  ~MmapDataReader() override;
+
+  // Returns true if the file was opened and mapped successfully. An empty file
+  // is never considered mapped.
+  bool IsMapped() const { return buffer_ != nullptr; }
+
+  bool SeekSet(size_t offset) override;
+
+  size_t Tell() const override { return offset_; }
+
+  bool ReadData(const size_t size, void* dest) override;
+
+  const void* GetContiguousData(size_t offset, size_t size) const override;
+
+  // Reads |size| bytes of the mapping as a null-terminated string into |str|.
+  // Trailing nulls, if any, are not added to the string, but they are skipped
+  // over. If there is no null terminator within these |size| bytes, then the
+  // string is automatically terminated after |size| bytes.
+  bool ReadString(const size_t size, std::string* str) override;
+
+  // Advises the kernel that [offset, offset + size) will be read sequentially,
+  // so that it can read ahead aggressively and drop pages behind the reader.
+  void AdviseSequential(size_t offset, size_t size) override;
+
+ private:
+  // Start of the read-only mapping, or nullptr if the file was not mapped.
+  const char* buffer_;
+
+  // Data read offset from the start of |buffer_|.
+  size_t offset_;
+
+  MmapDataReader(const MmapDataReader&) = delete;
+  MmapDataReader& operator=(const MmapDataReader&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_MMAP_DATA_READER_H_
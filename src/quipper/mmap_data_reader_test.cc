@@ -0,0 +1,120 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mmap_data_reader.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "compat/test.h"
+#include "file_utils.h"
+#include "scoped_temp_path.h"
+
+namespace quipper {
+
+// Move the cursor around and make sure the offset is properly set each time.
+TEST(MmapDataReaderTest, MoveOffset) {
+  std::vector<uint8_t> input_data(1000);
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_data));
+
+  MmapDataReader reader(input_file.path());
+  ASSERT_TRUE(reader.IsMapped());
+  EXPECT_EQ(input_data.size(), reader.size());
+  EXPECT_EQ(0, reader.Tell());
+
+  EXPECT_TRUE(reader.SeekSet(100));
+  EXPECT_EQ(100, reader.Tell());
+  EXPECT_TRUE(reader.SeekSet(900));
+  EXPECT_EQ(900, reader.Tell());
+
+  // The cursor can't be set to past the end of the file.
+  EXPECT_FALSE(reader.SeekSet(1200));
+  EXPECT_EQ(900, reader.Tell());
+}
+
+// Empty and missing files can't be mapped.
+TEST(MmapDataReaderTest, UnmappableFiles) {
+  ScopedTempFile empty_file;
+  ASSERT_TRUE(BufferToFile(empty_file.path(), std::string()));
+  MmapDataReader empty_reader(empty_file.path());
+  EXPECT_FALSE(empty_reader.IsMapped());
+  EXPECT_EQ(0, empty_reader.size());
+
+  MmapDataReader missing_reader("/nonexistent/path/to/perf.data");
+  EXPECT_FALSE(missing_reader.IsMapped());
+  EXPECT_EQ(0, missing_reader.size());
+}
+
+// Read data in chunks, out of order and past the end of the file.
+TEST(MmapDataReaderTest, ReadData) {
+  // This string contains four parts, each 10 characters long.
+  const std::string kInputData =
+      "0:abcdefg;"
+      "1:hijklmn;"
+      "2:opqrstu;"
+      "3:vwxyzABC";
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), kInputData));
+  MmapDataReader reader(input_file.path());
+  ASSERT_TRUE(reader.IsMapped());
+  // Hints are allowed anywhere, including ranges past the end of the file.
+  reader.AdviseSequential(0, kInputData.size());
+  reader.AdviseSequential(35, 100);
+  reader.AdviseSequential(1000, 10);
+
+  std::vector<uint8_t> output(10);
+  EXPECT_TRUE(reader.SeekSet(10));
+  EXPECT_TRUE(reader.ReadData(10, output.data()));
+  EXPECT_EQ(20, reader.Tell());
+  EXPECT_EQ("1:hijklmn;", std::string(output.begin(), output.end()));
+
+  EXPECT_TRUE(reader.SeekSet(30));
+  EXPECT_TRUE(reader.ReadData(10, output.data()));
+  EXPECT_EQ(40, reader.Tell());
+  EXPECT_EQ("3:vwxyzABC", std::string(output.begin(), output.end()));
+
+  // Must not be able to read past the end of the file, and the read pointer
+  // should not move.
+  EXPECT_TRUE(reader.SeekSet(35));
+  EXPECT_FALSE(reader.ReadData(10, output.data()));
+  EXPECT_EQ(35, reader.Tell());
+  EXPECT_FALSE(reader.ReadData(SIZE_MAX, output.data()));
+  EXPECT_EQ(35, reader.Tell());
+}
+
+// Test string reads.
+TEST(MmapDataReaderTest, ReadString) {
+  std::string input_string("The quick brown fox jumps over the lazy dog.");
+  std::string input_string_with_padding(input_string);
+  input_string_with_padding.resize(input_string.size() + 10, '\0');
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_string_with_padding));
+  MmapDataReader reader(input_file.path());
+  ASSERT_TRUE(reader.IsMapped());
+
+  // Read the first half of the string.
+  std::string output;
+  EXPECT_TRUE(reader.ReadString(input_string.size() / 2, &output));
+  EXPECT_EQ(input_string.size() / 2, reader.Tell());
+  EXPECT_EQ(input_string.substr(0, input_string.size() / 2), output);
+
+  // Read everything including the padding. The reader should have read past
+  // the padding too, but the output string itself should not have padding.
+  EXPECT_TRUE(reader.SeekSet(0));
+  EXPECT_TRUE(reader.ReadString(input_string_with_padding.size(), &output));
+  EXPECT_EQ(input_string_with_padding.size(), reader.Tell());
+  EXPECT_EQ(input_string, output);
+
+  // Attempt to read past the end of the string.
+  EXPECT_TRUE(reader.SeekSet(0));
+  output = "previous string value";
+  EXPECT_FALSE(reader.ReadString(input_string_with_padding.size() + 1, &output));
+  EXPECT_EQ("previous string value", output);
+}
+
+}  // namespace quipper
@@ -278,6 +278,12 @@ std::string GetEventName(uint32_t type) {
       return "PERF_RECORD_TIME_CONV";
     case PERF_RECORD_HEADER_FEATURE:
       return "PERF_RECORD_HEADER_FEATURE";
+    case PERF_RECORD_COMPRESSED:
+      return "PERF_RECORD_COMPRESSED";
+    case PERF_RECORD_FINISHED_INIT:
+      return "PERF_RECORD_FINISHED_INIT";
+    case PERF_RECORD_COMPRESSED2:
+      return "PERF_RECORD_COMPRESSED2";
     case PERF_RECORD_CGROUP:
       return "PERF_RECORD_CGROUP";
     case PERF_RECORD_KSYMBOL:
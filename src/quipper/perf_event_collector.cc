@@ -0,0 +1,283 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "perf_event_collector.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+
+#include "base/logging.h"
+#include "kernel/perf_internals.h"
+#include "perf_data_utils.h"
+
+namespace quipper {
+
+namespace {
+
+// From linux/perf_event.h, which conflicts with kernel/perf_event.h.
+const unsigned long kPerfEventIocDisable = _IO('$', 1);  // NOLINT
+const unsigned long kPerfEventIocId = _IOR('$', 7, __u64*);  // NOLINT
+
+// The size of the comms of the kernel, TASK_COMM_LEN.
+const size_t kTaskCommSize = 16;
+
+int PerfEventOpen(perf_event_attr* attr, pid_t pid, int cpu) {
+  return syscall(__NR_perf_event_open, attr, pid, cpu, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+// Calls |callback| with the numeric names of the entries of |path|, the PIDs
+// of /proc or the TIDs of /proc/<pid>/task.
+template <typename Callback>
+void ForEachId(const std::string& path, const Callback& callback) {
+  DIR* dir = opendir(path.c_str());
+  if (dir == nullptr) return;
+  while (const struct dirent* entry = readdir(dir)) {
+    char* end;
+    const long id = strtol(entry->d_name, &end, 10);  // NOLINT
+    if (*end == '\0' && id > 0) callback(static_cast<pid_t>(id));
+  }
+  closedir(dir);
+}
+
+}  // namespace
+
+PerfEventCollector::PerfEventCollector(PerfReader* reader)
+    : reader_(reader), attr_(), page_size_(sysconf(_SC_PAGESIZE)) {}
+
+PerfEventCollector::~PerfEventCollector() { CloseEvents(); }
+
+bool PerfEventCollector::Start(const perf_event_attr& attr, pid_t pid,
+                               size_t ring_buffer_pages) {
+  if (!buffers_.empty()) {
+    LOG(ERROR) << "The events are already open.";
+    return false;
+  }
+  if (ring_buffer_pages == 0 ||
+      (ring_buffer_pages & (ring_buffer_pages - 1)) != 0) {
+    LOG(ERROR) << "The ring buffer pages must be a power of two, not "
+               << ring_buffer_pages;
+    return false;
+  }
+  attr_ = attr;
+  attr_.size = sizeof(attr_);
+  attr_.sample_type |= PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+  attr_.sample_id_all = 1;
+  attr_.mmap = 1;
+  attr_.comm = 1;
+  attr_.task = 1;
+  attr_.disabled = 0;
+  sample_info_writer_.reset(new SampleInfoReader(attr_, false));
+  data_size_ = ring_buffer_pages * page_size_;
+
+  std::vector<u64> ids;
+  const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);  // NOLINT
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    const int fd = PerfEventOpen(&attr_, pid, cpu);
+    if (fd < 0) {
+      // The CPUs that are offline can't be opened.
+      if (errno == ENODEV) continue;
+      PLOG(ERROR) << "Failed to open the event on CPU " << cpu;
+      CloseEvents();
+      return false;
+    }
+    void* base = mmap(nullptr, page_size_ + data_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    u64 id = 0;
+    if (base == MAP_FAILED || ioctl(fd, kPerfEventIocId, &id) != 0) {
+      PLOG(ERROR) << "Failed to map the ring buffer of CPU " << cpu;
+      if (base != MAP_FAILED) munmap(base, page_size_ + data_size_);
+      close(fd);
+      CloseEvents();
+      return false;
+    }
+    buffers_.push_back({fd, static_cast<char*>(base)});
+    ids.push_back(id);
+  }
+  if (buffers_.empty()) {
+    LOG(ERROR) << "No CPU is online.";
+    return false;
+  }
+
+  const perf_pipe_file_header header = {kPerfMagic, sizeof(header)};
+  std::vector<u64> buffer(
+      (sizeof(perf_event_header) + sizeof(attr_)) / sizeof(u64) + ids.size());
+  auto* event = reinterpret_cast<attr_event*>(buffer.data());
+  event->header.type = PERF_RECORD_HEADER_ATTR;
+  event->header.size = buffer.size() * sizeof(u64);
+  event->attr = attr_;
+  std::copy(ids.begin(), ids.end(), event->id);
+  if (!reader_->Feed(reinterpret_cast<const char*>(&header), sizeof(header)) ||
+      !reader_->Feed(reinterpret_cast<const char*>(buffer.data()),
+                     event->header.size)) {
+    CloseEvents();
+    return false;
+  }
+
+  // The events are already enabled, so the processes started meanwhile are
+  // recorded rather than synthesized.
+  bool ok = true;
+  if (pid == -1) {
+    ForEachId("/proc", [this, &ok](pid_t pid) {
+      ok = ok && SynthesizeProcess(pid);
+    });
+  } else {
+    ok = SynthesizeProcess(pid);
+  }
+  if (!ok) CloseEvents();
+  return ok;
+}
+
+bool PerfEventCollector::Poll(int timeout_ms) {
+  std::vector<struct pollfd> fds(buffers_.size());
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    fds[i].fd = buffers_[i].fd;
+    fds[i].events = POLLIN;
+  }
+  if (poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR) {
+    PLOG(ERROR) << "Failed to poll the events";
+    return false;
+  }
+  for (RingBuffer& buffer : buffers_) {
+    if (!ReadRingBuffer(&buffer)) return false;
+  }
+  return true;
+}
+
+bool PerfEventCollector::Stop() {
+  for (const RingBuffer& buffer : buffers_) {
+    ioctl(buffer.fd, kPerfEventIocDisable, 0);
+  }
+  bool ok = true;
+  for (RingBuffer& buffer : buffers_) {
+    ok = ok && ReadRingBuffer(&buffer);
+  }
+  CloseEvents();
+  return ok && reader_->Finish();
+}
+
+bool PerfEventCollector::Collect(const perf_event_attr& attr, pid_t pid,
+                                 double time_sec) {
+  if (!Start(attr, pid)) return false;
+  const auto end = std::chrono::steady_clock::now() +
+                   std::chrono::duration<double>(time_sec);
+  for (auto now = std::chrono::steady_clock::now(); now < end;
+       now = std::chrono::steady_clock::now()) {
+    const auto timeout =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - now);
+    if (!Poll(std::max<int>(timeout.count(), 1))) {
+      CloseEvents();
+      return false;
+    }
+  }
+  return Stop();
+}
+
+bool PerfEventCollector::SynthesizeProcess(pid_t pid) {
+  const std::string dir = "/proc/" + std::to_string(pid);
+  // The synthesized records, followed by room for their sample info.
+  std::vector<u64> buffer;
+  bool ok = true;
+  ForEachId(dir + "/task", [this, pid, &dir, &buffer, &ok](pid_t tid) {
+    std::ifstream file(dir + "/task/" + std::to_string(tid) + "/comm");
+    std::string comm;
+    if (!ok || !std::getline(file, comm)) return;
+    comm.resize(std::min(comm.size(), kTaskCommSize - 1));
+    buffer.assign(sizeof(comm_event) / sizeof(u64) + 8, 0);
+    auto* event = reinterpret_cast<comm_event*>(buffer.data());
+    event->header.type = PERF_RECORD_COMM;
+    event->pid = pid;
+    event->tid = tid;
+    memcpy(event->comm, comm.data(), comm.size());
+    ok = FeedSynthesizedEvent(
+        reinterpret_cast<event_t*>(event),
+        offsetof(comm_event, comm) + GetUint64AlignedStringLength(comm.size()),
+        pid, tid);
+  });
+
+  std::ifstream maps(dir + "/maps");
+  for (std::string line; ok && std::getline(maps, line);) {
+    // The lines are of the form
+    // "start-end perms offset major:minor inode   path".
+    unsigned long long start, end, pgoff;  // NOLINT
+    char perms[5];
+    int path_offset = 0;
+    if (sscanf(line.c_str(), "%llx-%llx %4s %llx %*s %*s %n", &start, &end,
+               perms, &pgoff, &path_offset) != 4 ||
+        path_offset == 0 || perms[2] != 'x') {
+      continue;
+    }
+    std::string filename = line.substr(path_offset);
+    if (filename.empty()) filename = "//anon";
+    filename.resize(std::min<size_t>(filename.size(), PATH_MAX - 1));
+    const size_t size = offsetof(mmap_event, filename) +
+                        GetUint64AlignedStringLength(filename.size());
+    buffer.assign(size / sizeof(u64) + 8, 0);
+    auto* event = reinterpret_cast<mmap_event*>(buffer.data());
+    event->header.type = PERF_RECORD_MMAP;
+    event->header.misc = PERF_RECORD_MISC_USER;
+    event->pid = pid;
+    event->tid = pid;
+    event->start = start;
+    event->len = end - start;
+    event->pgoff = pgoff;
+    memcpy(event->filename, filename.data(), filename.size());
+    ok = FeedSynthesizedEvent(reinterpret_cast<event_t*>(event), size, pid,
+                              pid);
+  }
+  return ok;
+}
+
+bool PerfEventCollector::FeedSynthesizedEvent(event_t* event, size_t size,
+                                              u32 pid, u32 tid) {
+  perf_sample sample;
+  sample.pid = pid;
+  sample.tid = tid;
+  event->header.size =
+      size +
+      sample_info_writer_->GetPerfSampleDataSize(sample, event->header.type);
+  return sample_info_writer_->WritePerfSampleInfo(sample, event) &&
+         reader_->Feed(reinterpret_cast<const char*>(event),
+                       event->header.size);
+}
+
+bool PerfEventCollector::ReadRingBuffer(RingBuffer* buffer) {
+  auto* metadata = reinterpret_cast<perf_event_mmap_page*>(buffer->base);
+  const char* data = buffer->base + page_size_;
+  const u64 head = __atomic_load_n(&metadata->data_head, __ATOMIC_ACQUIRE);
+  records_.clear();
+  for (u64 tail = metadata->data_tail; tail < head;) {
+    const size_t offset = tail % data_size_;
+    const size_t size = std::min<u64>(head - tail, data_size_ - offset);
+    records_.insert(records_.end(), data + offset, data + offset + size);
+    tail += size;
+  }
+  // The kernel may overwrite the records once the tail has moved past them.
+  __atomic_store_n(&metadata->data_tail, head, __ATOMIC_RELEASE);
+  return records_.empty() || reader_->Feed(records_.data(), records_.size());
+}
+
+void PerfEventCollector::CloseEvents() {
+  for (const RingBuffer& buffer : buffers_) {
+    munmap(buffer.base, page_size_ + data_size_);
+    close(buffer.fd);
+  }
+  buffers_.clear();
+}
+
+}  // namespace quipper
@@ -0,0 +1,85 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_PERF_EVENT_COLLECTOR_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_PERF_EVENT_COLLECTOR_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "kernel/perf_event.h"
+#include "perf_reader.h"
+#include "sample_info_reader.h"
+
+namespace quipper {
+
+// Collects perf events without the perf binary: opens them with
+// perf_event_open() on each CPU, and feeds the records of their ring buffers
+// to a PerfReader as piped perf data, which the reader parses as they are
+// collected. The records are preceded by the attr of the events and the COMM
+// and MMAP records of the processes running when the collection starts, read
+// from /proc, as perf record synthesizes them.
+class PerfEventCollector {
+ public:
+  // Feeds the records to |reader|, which must outlive the collector.
+  explicit PerfEventCollector(PerfReader* reader);
+  // Closes the events, without finishing the reader if Stop() wasn't called.
+  ~PerfEventCollector();
+
+  PerfEventCollector(const PerfEventCollector&) = delete;
+  PerfEventCollector& operator=(const PerfEventCollector&) = delete;
+
+  // Opens the event of |attr| for the process |pid|, or for all processes if
+  // it is -1, on each online CPU, with ring buffers of |ring_buffer_pages|
+  // pages, a power of two. The records of processes, the TID and the time of
+  // the samples and the sample info of the other records, which the parser
+  // needs, are added to |attr|. Returns false if the events can't be opened.
+  bool Start(const perf_event_attr& attr, pid_t pid = -1,
+             size_t ring_buffer_pages = 64);
+
+  // Waits up to |timeout_ms| milliseconds for records, then feeds the records
+  // of all the ring buffers to the reader. Returns false on errors.
+  bool Poll(int timeout_ms);
+
+  // Closes the events, feeds the last records and finishes the reader.
+  bool Stop();
+
+  // Runs Start(), then Poll() for |time_sec| seconds, then Stop().
+  bool Collect(const perf_event_attr& attr, pid_t pid, double time_sec);
+
+ private:
+  struct RingBuffer {
+    int fd;
+    // The metadata page, followed by the data pages.
+    char* base;
+  };
+
+  // Feeds the COMM records of the threads of |pid| and the MMAP records of
+  // its executable mappings. The process may have exited meanwhile.
+  bool SynthesizeProcess(pid_t pid);
+  // Feeds |event|, whose |size| bytes are the record without its sample info,
+  // followed by sample info of |pid| and |tid|.
+  bool FeedSynthesizedEvent(event_t* event, size_t size, u32 pid, u32 tid);
+  // Feeds the records of |buffer| written since it was last read.
+  bool ReadRingBuffer(RingBuffer* buffer);
+  void CloseEvents();
+
+  PerfReader* const reader_;
+  perf_event_attr attr_;
+  // Writes the sample info of the synthesized records.
+  std::unique_ptr<SampleInfoReader> sample_info_writer_;
+  std::vector<RingBuffer> buffers_;
+  size_t page_size_;
+  size_t data_size_ = 0;
+  // The records read out of a ring buffer, which may wrap around its end.
+  std::vector<char> records_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_PERF_EVENT_COLLECTOR_H_
@@ -0,0 +1,102 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "perf_event_collector.h"
+
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+
+#include "base/logging.h"
+#include "compat/test.h"
+#include "kernel/perf_event.h"
+#include "perf_parser.h"
+#include "perf_reader.h"
+
+namespace quipper {
+namespace {
+
+// Returns the attr of a software event sampling the user time of the tasks.
+perf_event_attr TaskClockAttr() {
+  perf_event_attr attr = {};
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;
+  attr.sample_period = 100000;
+  attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_PERIOD;
+  attr.exclude_kernel = 1;
+  return attr;
+}
+
+// Returns whether perf events can be opened for the calling process, which
+// may not be allowed in the sandbox the test runs in.
+bool IsPerfEventOpenAvailable() {
+  perf_event_attr attr = TaskClockAttr();
+  attr.size = sizeof(attr);
+  const int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) return false;
+  close(fd);
+  return true;
+}
+
+TEST(PerfEventCollectorTest, CollectsSamplesOfItself) {
+  if (!IsPerfEventOpenAvailable()) {
+    LOG(INFO) << "Skipping the test: perf events can't be opened.";
+    return;
+  }
+  PerfReader reader;
+  PerfEventCollector collector(&reader);
+  ASSERT_TRUE(collector.Start(TaskClockAttr(), getpid(), 16));
+  // Spin for long enough to take samples, reading them as they come.
+  const auto end =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+  volatile u64 count = 0;
+  while (std::chrono::steady_clock::now() < end) {
+    for (int i = 0; i < 100000; ++i) count = count + i;
+    ASSERT_TRUE(collector.Poll(0));
+  }
+  ASSERT_TRUE(collector.Stop());
+
+  ASSERT_EQ(1, reader.attrs().size());
+  const u32 pid = getpid();
+  bool has_comm = false, has_mmap = false;
+  int num_samples = 0;
+  for (const auto& event : reader.events()) {
+    switch (event.header().type()) {
+      case PERF_RECORD_COMM:
+        has_comm |= event.comm_event().pid() == pid;
+        break;
+      case PERF_RECORD_MMAP:
+        has_mmap |= event.mmap_event().pid() == pid &&
+                    event.mmap_event().filename().find(
+                        "perf_event_collector_test") != std::string::npos;
+        break;
+      case PERF_RECORD_SAMPLE:
+        EXPECT_EQ(pid, event.sample_event().pid());
+        ++num_samples;
+        break;
+    }
+  }
+  EXPECT_TRUE(has_comm);
+  EXPECT_TRUE(has_mmap);
+  EXPECT_GT(num_samples, 0);
+
+  // The samples map to the synthesized mappings.
+  PerfParserOptions options;
+  options.sample_mapping_percentage_threshold = 0;
+  PerfParser parser(&reader, options);
+  ASSERT_TRUE(parser.ParseRawEvents());
+  EXPECT_GT(parser.stats().num_sample_events_mapped, 0);
+}
+
+TEST(PerfEventCollectorTest, RejectsRingBuffersOfOtherSizes) {
+  PerfReader reader;
+  PerfEventCollector collector(&reader);
+  EXPECT_FALSE(collector.Start(TaskClockAttr(), getpid(), 3));
+}
+
+}  // namespace
+}  // namespace quipper
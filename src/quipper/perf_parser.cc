@@ -12,7 +12,6 @@
 #include <unistd.h>
 
 #include <algorithm>
-#include <functional>
 #include <memory>
 #include <set>
 #include <sstream>
@@ -21,14 +20,17 @@
 #include "base/logging.h"
 #include "address_mapper.h"
 #include "binary_data_utils.h"
+#include "build_id_cache.h"
 #include "compat/cleanup.h"
 #include "compat/proto.h"
+#include "compat/thread_pool.h"
 #include "dso.h"
 #include "huge_page_deducer.h"
 #include "kernel/perf_event.h"
 #include "kernel/perf_internals.h"
 #include "perf_data_utils.h"
 #include "perf_reader.h"
+#include "trace.h"
 
 namespace quipper {
 
@@ -67,27 +69,58 @@ PerfParser::PerfParser(PerfReader* reader, const PerfParserOptions& options)
     : reader_(reader), options_(options) {}
 
 bool PerfParser::ParseRawEvents() {
+  QUIPPER_TRACE_SPAN("PerfParser::ParseRawEvents");
+  if (!options_.map_events &&
+      (options_.do_remap || options_.discard_unused_events ||
+       options_.read_missing_buildids)) {
+    LOG(ERROR) << "Remapping, discarding unused events and reading build IDs "
+               << "require mapping the events.";
+    return false;
+  }
+
+  times_ = PerfParserTimes();
   if (options_.sort_events_by_time) {
-    reader_->MaybeSortEventsByTime();
+    QUIPPER_TRACE_SPAN("PerfParser::SortEventsByTime");
+    ScopedPhaseTimer timer(&times_.sort);
+    if (options_.sort_only_state_events) {
+      reader_->MaybeSortStateEventsByTime();
+    } else {
+      reader_->MaybeSortEventsByTime(options_.keep_unordered_samples);
+    }
   }
 
   // Just in case there was data from a previous call.
   process_mappers_.clear();
 
-  // Find huge page mappings.
-  if (options_.deduce_huge_page_mappings) {
-      DeduceHugePages(reader_->mutable_events());
-  }
+  // Both passes below only look at the mmap events, which are found once.
+  if (options_.deduce_huge_page_mappings || options_.combine_mappings) {
+    MmapEventIndex mmap_index(reader_->events());
 
-  // Combine split mappings.
-  if (options_.combine_mappings) {
-    CombineMappings(reader_->mutable_events());
+    // Find huge page mappings.
+    if (options_.deduce_huge_page_mappings) {
+      ScopedPhaseTimer timer(&times_.huge_page_deduction);
+      DeduceHugePages(mmap_index, reader_->mutable_events(),
+                      options_.num_threads, options_.executor);
+    }
+
+    // Combine split mappings.
+    if (options_.combine_mappings) {
+      ScopedPhaseTimer timer(&times_.combine_mappings);
+      CombineMappings(&mmap_index, reader_->mutable_events());
+    }
   }
 
   // Clear the parsed events to reset their fields. Otherwise, non-sample events
   // may have residual DSO+offset info.
   parsed_events_.clear();
 
+  if (!options_.map_events) {
+    stats_ = {0};
+    return true;
+  }
+
+  QUIPPER_TRACE_SPAN("PerfParser::ProcessEvents");
+  ScopedPhaseTimer timer(&times_.process_events);
   // Events of type PERF_RECORD_FINISHED_ROUND don't have a timestamp, and are
   // not needed.
   // use the partial-sorting of events between rounds to sort faster.
@@ -105,26 +138,7 @@ bool PerfParser::ParseRawEvents() {
 
   if (!options_.discard_unused_events) return true;
 
-  // Some MMAP/MMAP2 events' mapped regions will not have any samples. These
-  // MMAP/MMAP2 events should be dropped. |parsed_events_| should be
-  // reconstructed without these events.
-  write_index = 0;
-  size_t read_index;
-  for (read_index = 0; read_index < parsed_events_.size(); ++read_index) {
-    const ParsedEvent& event = parsed_events_[read_index];
-    if (event.event_ptr->has_mmap_event() &&
-        event.num_samples_in_mmap_region == 0) {
-      continue;
-    }
-    if (read_index != write_index) parsed_events_[write_index] = event;
-    ++write_index;
-  }
-  CHECK_LE(write_index, parsed_events_.size());
-  parsed_events_.resize(write_index);
-
-  // Update the events in |reader_| to match the updated events.
-  UpdatePerfEventsFromParsedEvents();
-
+  DiscardUnusedEvents();
   return true;
 }
 
@@ -162,9 +176,8 @@ bool PerfParser::ProcessEvents() {
   // COMM event for pid 0, we act like we did receive a COMM event for it.
   // Perf does this itself, example:
   //   http://lxr.free-electrons.com/source/tools/perf/util/session.c#L1120
-  commands_.insert(kSwapperCommandName);
   pidtid_to_comm_map_[std::make_pair(kSwapperPid, kSwapperPid)] =
-      &(*commands_.find(kSwapperCommandName));
+      commands_.Intern(kSwapperCommandName);
 
   // Keep track of the first MMAP or MMAP2 event associated with the kernel.
   // First such mapping corresponds to the kernel image, and requires special
@@ -217,7 +230,8 @@ bool PerfParser::ProcessEvents() {
           dso_info.min = event.mmap_event().min();
           dso_info.ino = event.mmap_event().ino();
         }
-        name_to_dso_.emplace(dso_info.name, dso_info);
+        parsed_event.mmap_dso_info =
+            &name_to_dso_.emplace(dso_info.name, dso_info).first->second;
         if (is_kernel) {
           first_kernel_mmap = false;
         }
@@ -249,11 +263,10 @@ bool PerfParser::ProcessEvents() {
         // clang-format on
         ++stats_.num_comm_events;
         CHECK(MapCommEvent(event.comm_event()));
-        commands_.insert(event.comm_event().comm());
         const PidTid pidtid =
             std::make_pair(event.comm_event().pid(), event.comm_event().tid());
         pidtid_to_comm_map_[pidtid] =
-            &(*commands_.find(event.comm_event().comm()));
+            commands_.Intern(event.comm_event().comm());
         break;
       }
       case PERF_RECORD_KSYMBOL: {
@@ -338,21 +351,10 @@ class FdCloser {
   int fd_;
 };
 
-// Merges two uint32_t into a uint64_t for hashing in an unordered_set because
-// there is no default hash method for a pair.
-uint64_t mergeTwoU32(uint32_t first, uint32_t second) {
-  return (uint64_t)first << 32 | second;
-}
-
-// Splits a given uint64_t into two uint32_t. This reverts the above merge
-// operation to retrieve the two uint32_t from an unordered_set.
-std::pair<uint32_t, uint32_t> splitU64(uint64_t value) {
-  return std::make_pair(value >> 32,
-                        std::numeric_limits<uint32_t>::max() & value);
-}
-
+// Reads the build ID of the file at |dso_path|, or gets it from |cache|, if
+// not null. Files without a build ID are cached too.
 bool ReadElfBuildIdIfSameInode(const std::string& dso_path, const DSOInfo& dso,
-                               std::string* buildid) {
+                               BuildIdCache* cache, std::string* buildid) {
   int fd = open(dso_path.c_str(), O_RDONLY);
   FdCloser fd_closer(fd);
   if (fd == -1) {
@@ -365,13 +367,20 @@ bool ReadElfBuildIdIfSameInode(const std::string& dso_path, const DSOInfo& dso,
   // Only reject based on inode if we actually have device info (from MMAP2).
   if (dso.maj != 0 && dso.min != 0 && !SameInode(dso, &s)) return false;
 
-  return ReadElfBuildId(fd, buildid);
+  if (cache != nullptr && cache->Lookup(s, buildid)) {
+    return !buildid->empty();
+  }
+  if (!ReadElfBuildId(fd, buildid)) {
+    buildid->clear();
+  }
+  if (cache != nullptr) cache->Insert(s, *buildid);
+  return !buildid->empty();
 }
 
 // Looks up build ID of a given DSO by reading directly from the file system.
 // - Does not support reading build ID of the main kernel binary.
 // - Reads build IDs of kernel modules and other DSOs using functions in dso.h.
-std::string FindDsoBuildId(const DSOInfo& dso_info) {
+std::string FindDsoBuildId(const DSOInfo& dso_info, BuildIdCache* cache) {
   std::string buildid_bin;
   const std::string& dso_name = dso_info.name;
   if (IsKernelNonModuleName(dso_name)) return buildid_bin;  // still empty
@@ -383,33 +392,28 @@ std::string FindDsoBuildId(const DSOInfo& dso_info) {
     return buildid_bin;
   }
   // Try normal files, possibly inside containers.
-  u32 last_pid = 0;
-  std::vector<uint64_t> threads(dso_info.threads.begin(),
-                                dso_info.threads.end());
-  std::sort(threads.begin(), threads.end());
-  for (auto pidtid_it : threads) {
-    uint32_t pid, tid;
-    std::tie(pid, tid) = splitU64(pidtid_it);
+  if (dso_info.hit) {
+    const uint32_t pid = dso_info.thread.first;
+    const uint32_t tid = dso_info.thread.second;
     std::stringstream dso_path_stream;
     dso_path_stream << "/proc/" << tid << "/root/" << dso_name;
     std::string dso_path = dso_path_stream.str();
-    if (ReadElfBuildIdIfSameInode(dso_path, dso_info, &buildid_bin)) {
+    if (ReadElfBuildIdIfSameInode(dso_path, dso_info, cache, &buildid_bin)) {
       return buildid_bin;
     }
-    // Avoid re-trying the parent process if it's the same for multiple threads.
-    // dso_info.threads is sorted, so threads in a process should be adjacent.
-    if (pid == last_pid || pid == tid) continue;
-    last_pid = pid;
     // Try the parent process:
-    std::stringstream parent_dso_path_stream;
-    parent_dso_path_stream << "/proc/" << pid << "/root/" << dso_name;
-    std::string parent_dso_path = parent_dso_path_stream.str();
-    if (ReadElfBuildIdIfSameInode(parent_dso_path, dso_info, &buildid_bin)) {
-      return buildid_bin;
+    if (pid != tid) {
+      std::stringstream parent_dso_path_stream;
+      parent_dso_path_stream << "/proc/" << pid << "/root/" << dso_name;
+      std::string parent_dso_path = parent_dso_path_stream.str();
+      if (ReadElfBuildIdIfSameInode(parent_dso_path, dso_info, cache,
+                                    &buildid_bin)) {
+        return buildid_bin;
+      }
     }
   }
   // Still don't have a buildid. Try our own filesystem:
-  if (ReadElfBuildIdIfSameInode(dso_name, dso_info, &buildid_bin)) {
+  if (ReadElfBuildIdIfSameInode(dso_name, dso_info, cache, &buildid_bin)) {
     return buildid_bin;
   }
   return buildid_bin;  // still empty.
@@ -423,20 +427,39 @@ bool PerfParser::FillInDsoBuildIds() {
 
   std::map<std::string, std::string> new_buildids;
 
+  std::vector<DSOInfo*> dsos_to_read;
   for (std::pair<const std::string, DSOInfo>& kv : name_to_dso_) {
     DSOInfo& dso_info = kv.second;
     const auto it = filenames_to_build_ids.find(dso_info.name);
     if (it != filenames_to_build_ids.end()) {
       dso_info.build_id = it->second;
     }
+    if (options_.read_missing_buildids && dso_info.hit) {
+      dsos_to_read.push_back(&dso_info);
+    }
+  }
+
+  // Reading the files mostly waits for the file system, so they are read on
+  // up to num_build_id_threads threads. Each thread takes the next unread DSO
+  // until there are none left.
+  std::vector<std::string> buildids_bin(dsos_to_read.size());
+  const size_t num_threads = std::min<size_t>(
+      std::max(options_.num_build_id_threads, 1), dsos_to_read.size());
+  if (num_threads > 1) InitializeLibelf();
+  ParallelFor(options_.executor, dsos_to_read.size(), num_threads,
+              [&](size_t i) {
+                buildids_bin[i] =
+                    FindDsoBuildId(*dsos_to_read[i], options_.build_id_cache);
+              });
+
+  // Apply the build IDs in the same order as if they were read one by one.
+  for (size_t i = 0; i < dsos_to_read.size(); ++i) {
     // If there is both an existing build ID and a new build ID returned by
     // FindDsoBuildId(), overwrite the existing build ID.
-    if (options_.read_missing_buildids && dso_info.hit) {
-      std::string buildid_bin = FindDsoBuildId(dso_info);
-      if (!buildid_bin.empty()) {
-        dso_info.build_id = RawDataToHexString(buildid_bin);
-        new_buildids[dso_info.name] = dso_info.build_id;
-      }
+    if (!buildids_bin[i].empty()) {
+      DSOInfo& dso_info = *dsos_to_read[i];
+      dso_info.build_id = RawDataToHexString(buildids_bin[i]);
+      new_buildids[dso_info.name] = dso_info.build_id;
     }
   }
 
@@ -444,19 +467,35 @@ bool PerfParser::FillInDsoBuildIds() {
   return reader_->InjectBuildIDs(new_buildids);
 }
 
-void PerfParser::UpdatePerfEventsFromParsedEvents() {
-  // Reorder the events in |reader_| to match the order of |parsed_events_|.
-  // The |event_ptr|'s in |parsed_events_| are pointers to existing events in
-  // |reader_|.
-  RepeatedPtrField<PerfEvent> new_events;
-  new_events.Reserve(parsed_events_.size());
-  for (ParsedEvent& parsed_event : parsed_events_) {
-    PerfEvent* new_event = new_events.Add();
-    new_event->Swap(parsed_event.event_ptr);
-    parsed_event.event_ptr = new_event;
+void PerfParser::DiscardUnusedEvents() {
+  // |parsed_events_| points to the events of |reader_| in the same order,
+  // less the PERF_RECORD_FINISHED_ROUND events. The kept events are moved to
+  // the front of both in one pass, swapping only the element pointers of the
+  // repeated field so that the |event_ptr|'s stay valid, then the rest are
+  // deleted at once.
+  RepeatedPtrField<PerfEvent>* events = reader_->mutable_events();
+  int write_index = 0;
+  int read_index = 0;
+  for (ParsedEvent& event : parsed_events_) {
+    while (read_index < events->size() &&
+           events->Mutable(read_index) != event.event_ptr) {
+      ++read_index;
+    }
+    CHECK_LT(read_index, events->size());
+    const int event_index = read_index++;
+    // Some MMAP/MMAP2 events' mapped regions will not have any samples.
+    if (event.event_ptr->has_mmap_event() &&
+        event.num_samples_in_mmap_region == 0) {
+      continue;
+    }
+    events->SwapElements(write_index, event_index);
+    if (&event != &parsed_events_[write_index]) {
+      parsed_events_[write_index] = std::move(event);
+    }
+    ++write_index;
   }
-
-  reader_->mutable_events()->Swap(&new_events);
+  events->DeleteSubrange(write_index, events->size() - write_index);
+  parsed_events_.resize(write_index);
 }
 
 void PerfParser::MapSampleEvent(ParsedEvent* parsed_event) {
@@ -635,13 +674,13 @@ bool PerfParser::MapIPAndPidAndGetNameAndOffset(
     const auto& event = parsed_event.event_ptr;
     DCHECK(event->has_mmap_event()) << "Expected MMAP or MMAP2 event";
 
-    // Find the mmap DSO filename in the set of known DSO names.
-    auto dso_iter = name_to_dso_.find(event->mmap_event().filename());
-    CHECK(dso_iter != name_to_dso_.end());
-    dso_and_offset->dso_info_ = &dso_iter->second;
-
-    dso_iter->second.hit = true;
-    dso_iter->second.threads.insert(mergeTwoU32(pidtid.first, pidtid.second));
+    DSOInfo* dso_info = parsed_event.mmap_dso_info;
+    CHECK(dso_info != nullptr);
+    dso_and_offset->dso_info_ = dso_info;
+    if (!dso_info->hit) {
+      dso_info->hit = true;
+      dso_info->thread = pidtid;
+    }
     ++parsed_event.num_samples_in_mmap_region;
   } else {
     // During the remapping process, ips and addrs that are not mapped to the
@@ -765,8 +804,11 @@ bool PerfParser::MapForkEvent(const PerfDataProto_ForkEvent& event) {
   PidTid child = std::make_pair(event.pid(), event.tid());
   if (parent != child) {
     auto parent_iter = pidtid_to_comm_map_.find(parent);
-    if (parent_iter != pidtid_to_comm_map_.end())
-      pidtid_to_comm_map_[child] = parent_iter->second;
+    if (parent_iter != pidtid_to_comm_map_.end()) {
+      // Look up the command before inserting, which may rehash the map.
+      const std::string* command = parent_iter->second;
+      pidtid_to_comm_map_[child] = command;
+    }
   }
 
   const uint32_t pid = event.pid();
@@ -800,6 +842,7 @@ std::pair<AddressMapper*, bool> PerfParser::GetOrCreateProcessMapper(
   }
   std::unique_ptr<AddressMapper> mapper;
   if (parent_mapper != process_mappers_.end()) {
+    // The copy shares the parent's mappings until either of them maps a range.
     mapper.reset(new AddressMapper(*parent_mapper->second));
   } else {
     mapper.reset(new AddressMapper());
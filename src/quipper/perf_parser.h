@@ -7,9 +7,7 @@
 
 #include <stdint.h>
 
-#include <map>
 #include <memory>
-#include <set>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -19,6 +17,8 @@
 #include "compat/proto.h"
 #include "dso.h"
 #include "perf_reader.h"
+#include "phase_timer.h"
+#include "string_interner.h"
 
 namespace quipper {
 
@@ -28,11 +28,13 @@ using PerfEvent = PerfDataProto_PerfEvent;
 const uint32_t kKernelPid = static_cast<uint32_t>(-1);
 
 class AddressMapper;
+class BuildIdCache;
 class PerfDataProto_BranchStackEntry;
 class PerfDataProto_CommEvent;
 class PerfDataProto_ForkEvent;
 class PerfDataProto_MMapEvent;
 class PerfDataProto_PerfEvent;
+class ThreadPool;
 
 struct ParsedEvent {
   ParsedEvent() : command_(NULL) {}
@@ -45,6 +47,10 @@ struct ParsedEvent {
   // region.
   uint32_t num_samples_in_mmap_region;
 
+  // For mmap events, the DSO of the file mapped, so that the samples in the
+  // region don't look it up by name.
+  DSOInfo* mmap_dso_info = nullptr;
+
   // Command associated with this sample.
   const std::string* command_;
 
@@ -147,6 +153,15 @@ struct PerfEventStats {
   bool did_remap;
 };
 
+// The time ParseRawEvents() spent in each of its passes over the events.
+struct PerfParserTimes {
+  PhaseTime sort;
+  PhaseTime huge_page_deduction;
+  PhaseTime combine_mappings;
+  // Mapping the events, including discarding the unused ones.
+  PhaseTime process_events;
+};
+
 struct PerfParserOptions {
   // For synthetic address mapping.
   bool do_remap = false;
@@ -163,13 +178,36 @@ struct PerfParserOptions {
   // PerfSerializerTest. However, we should look at restructuring PerfParser not
   // to need it, while still providing some PerfParserStats.
   bool sort_events_by_time = true;
+  // With sort_events_by_time, leaves the events as they are if sorting them
+  // would only reorder the samples, see PerfReader::MaybeSortEventsByTime().
+  bool keep_unordered_samples = false;
+  // With sort_events_by_time, only sorts the events that change how samples
+  // are processed, and leaves the samples between them in the order they
+  // were read in, see PerfReader::MaybeSortStateEventsByTime(). Takes
+  // precedence over keep_unordered_samples.
+  bool sort_only_state_events = false;
   // If buildids are missing from the input data, they can be retrieved from
   // the filesystem.
   bool read_missing_buildids = false;
+  // With read_missing_buildids, the build IDs of files are looked up in and
+  // added to this cache, if not null, instead of always parsing the files.
+  // Unowned. The caller loads and saves it, e.g. across runs on a host.
+  BuildIdCache* build_id_cache = nullptr;
+  // With read_missing_buildids, the files are read on up to this many
+  // threads. Reading them mostly waits for the file system, so more threads
+  // than CPUs can help, e.g. on network file systems.
+  int num_build_id_threads = 1;
   // Deduces file names and offsets for hugepage-backed mappings, as
   // hugepage_text replaces these with anonymous mappings without filename or
   // offset information..
   bool deduce_huge_page_mappings = true;
+  // Huge page mappings of many processes are deduced on up to this many
+  // threads.
+  int num_threads = 1;
+  // If not null, the work spread over num_threads or num_build_id_threads
+  // threads runs as that many tasks on this pool instead, so that many parsers
+  // can share its threads. Unowned.
+  ThreadPool* executor = nullptr;
   // Checks for split binary mappings and merges them when possible.  This
   // combines the split mappings into a single mapping so future consumers of
   // the perf data will see  a single mapping and not two or more distinct
@@ -178,6 +216,11 @@ struct PerfParserOptions {
   // Handle unaligned MMAP events emited by VMs that dynamically generate
   // code objects.
   bool allow_unaligned_jit_mappings = false;
+  // Set this to false to only sort, deduce hugepage mappings and combine
+  // mappings, for callers that only need the modified events. The events are
+  // then not mapped, and parsed_events() and stats() are left empty. Requires
+  // do_remap, discard_unused_events and read_missing_buildids to be false.
+  bool map_events = true;
 };
 
 class PerfParser {
@@ -206,6 +249,9 @@ class PerfParser {
 
   const PerfEventStats& stats() const { return stats_; }
 
+  // Returns the time the last call to ParseRawEvents() spent in each pass.
+  const PerfParserTimes& times() const { return times_; }
+
   // Use with caution. Deserialization uses this to restore stats from proto.
   PerfEventStats* mutable_stats() { return &stats_; }
 
@@ -221,10 +267,10 @@ class PerfParser {
   // new build ID read using dso.h, this will overwrite the existing build ID.
   bool FillInDsoBuildIds();
 
-  // Updates |reader_->events| based on the contents of |parsed_events_|. For
-  // example, if |parsed_events_| had some events removed or reordered,
-  // |reader_| would be updated to contain the new sequence of events.
-  void UpdatePerfEventsFromParsedEvents();
+  // Drops the MMAP/MMAP2 events whose regions have no samples, and the
+  // PERF_RECORD_FINISHED_ROUND events, from both |parsed_events_| and
+  // |reader_->events|, in place.
+  void DiscardUnusedEvents();
 
   // Performs a sample event remap including for code and data addresses if
   // present. It increments stats counters for samples that could be mapped,
@@ -283,14 +329,17 @@ class PerfParser {
   // Store all option flags as one struct.
   PerfParserOptions options_;
 
-  // Maps pid/tid to commands.
-  std::map<PidTid, const std::string*> pidtid_to_comm_map_;
+  // Maps pid/tid to commands. Every thread creation adds an entry, so the map
+  // is hashed.
+  std::unordered_map<PidTid, const std::string*, PidTidHash>
+      pidtid_to_comm_map_;
 
-  // A set to store the actual command strings.
-  std::set<std::string> commands_;
+  // The actual command strings, which are shared by many threads.
+  StringInterner commands_;
 
   // ParseRawEvents() records some statistics here.
   PerfEventStats stats_;
+  PerfParserTimes times_;
 
   // A set of unique DSOs that may be referenced by multiple events.
   std::unordered_map<std::string, DSOInfo> name_to_dso_;
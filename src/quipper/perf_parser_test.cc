@@ -5,6 +5,7 @@
 #include "perf_parser.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/capability.h>
 #include <sys/mount.h>
 #include <sys/sysmacros.h>
@@ -18,6 +19,7 @@
 #include <vector>
 
 #include "base/logging.h"
+#include "build_id_cache.h"
 #include "compat/test.h"
 #include "compat/thread.h"
 #include "dso_test_utils.h"
@@ -2964,6 +2966,128 @@ TEST(PerfParserTest, OnlyReadsBuildidIfSampled) {
   EXPECT_EQ(filenames_to_build_ids.end(), it) << it->first << " " << it->second;
 }
 
+TEST(PerfParserTest, ReadsBuildidsThroughCache) {
+  ScopedTempDir tmpdir("/tmp/quipper_tmp.");
+  const std::string filename = tmpdir.path() + "buildid_not_known";
+  InitializeLibelf();
+  testing::WriteElfWithBuildid(filename, ".note.gnu.build-id",
+                               "\xc0\x01\xd0\x0d");
+  struct stat file_stat;
+  ASSERT_EQ(stat(filename.c_str(), &file_stat), 0);
+
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, filename,
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c100a).Tid(1001))
+      .WriteTo(&input);
+
+  // The first parse reads the build ID from the file and caches it, and the
+  // second one takes the cached build ID, here a different one, instead.
+  BuildIdCache cache;
+  for (const char* want_build_id : {"c001d00d", "f00d"}) {
+    PerfReader reader;
+    ASSERT_TRUE(reader.ReadFromString(input.str()));
+    PerfParserOptions options;
+    options.read_missing_buildids = true;
+    options.build_id_cache = &cache;
+    PerfParser parser(&reader, options);
+    EXPECT_TRUE(parser.ParseRawEvents());
+
+    const std::vector<ParsedEvent> &events = parser.parsed_events();
+    ASSERT_EQ(2, events.size());
+    EXPECT_EQ(filename, events[1].dso_and_offset.dso_name());
+    EXPECT_EQ(want_build_id, events[1].dso_and_offset.build_id());
+
+    std::string cached;
+    ASSERT_TRUE(cache.Lookup(file_stat, &cached));
+    EXPECT_EQ(1, cache.size());
+    cache.Insert(file_stat, "\xf0\x0d");
+  }
+}
+
+TEST(PerfParserTest, ReadsBuildidsOnSeveralThreads) {
+  ScopedTempDir tmpdir("/tmp/quipper_tmp.");
+  InitializeLibelf();
+  const int kNumFiles = 8;
+  std::vector<std::string> filenames;
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+  for (int i = 0; i < kNumFiles; ++i) {
+    filenames.push_back(tmpdir.path() + "buildid_" + std::to_string(i));
+    testing::WriteElfWithBuildid(filenames.back(), ".note.gnu.build-id",
+                                 std::string("\xc0\x01\xd0") +
+                                     static_cast<char>(i));
+    const uint64_t start = 0x1c1000 + i * 0x1000;
+    testing::ExampleMmapEvent(1001, start, 0x1000, 0, filenames.back(),
+                              testing::SampleInfo().Tid(1001))
+        .WriteTo(&input);
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(start + 0xa).Tid(1001))
+        .WriteTo(&input);
+  }
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  PerfParserOptions options;
+  options.read_missing_buildids = true;
+  options.num_build_id_threads = 4;
+  PerfParser parser(&reader, options);
+  EXPECT_TRUE(parser.ParseRawEvents());
+
+  const std::vector<ParsedEvent> &events = parser.parsed_events();
+  ASSERT_EQ(2 * kNumFiles, events.size());
+  for (int i = 0; i < kNumFiles; ++i) {
+    const ParsedEvent &sample = events[2 * i + 1];
+    EXPECT_EQ(filenames[i], sample.dso_and_offset.dso_name());
+    char want_build_id[9];
+    snprintf(want_build_id, sizeof(want_build_id), "c001d0%02x", i);
+    EXPECT_EQ(want_build_id, sample.dso_and_offset.build_id());
+  }
+}
+
+TEST(PerfParserTest, OnlyModifiesEventsWithoutMapping) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c100a).Tid(1001).Time(12300020))
+      .WriteTo(&input);
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(12300010))
+      .WriteTo(&input);
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  PerfParserOptions options;
+  options.map_events = false;
+  options.do_remap = true;
+  EXPECT_FALSE(PerfParser(&reader, options).ParseRawEvents());
+
+  options.do_remap = false;
+  PerfParser parser(&reader, options);
+  ASSERT_TRUE(parser.ParseRawEvents());
+  EXPECT_TRUE(parser.parsed_events().empty());
+  EXPECT_EQ(0, parser.stats().num_sample_events);
+
+  // The events were still sorted by time.
+  ASSERT_EQ(2, reader.events().size());
+  EXPECT_TRUE(reader.events().Get(0).has_mmap_event());
+  EXPECT_TRUE(reader.events().Get(1).has_sample_event());
+  EXPECT_EQ(0x1c1000, reader.events().Get(0).mmap_event().start());
+}
+
 TEST(PerfParserTest, HandlesFinishedRoundEventsAndSortsByTime) {
   // For now at least, we are ignoring PERF_RECORD_FINISHED_ROUND events.
 
@@ -3037,6 +3161,74 @@ TEST(PerfParserTest, HandlesFinishedRoundEventsAndSortsByTime) {
   EXPECT_EQ(12300050, events[4].event_ptr->sample_event().sample_time_ns());
 }
 
+TEST(PerfParserTest, DiscardsUnusedEventsInPlace) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_MMAP
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(12300010))
+      .WriteTo(&input);  // unused
+  testing::ExampleMmapEvent(1001, 0x1c3000, 0x1000, 0, "/usr/lib/bar.so",
+                            testing::SampleInfo().Tid(1001).Time(12300020))
+      .WriteTo(&input);  // 0
+  // PERF_RECORD_FINISHED_ROUND
+  testing::FinishedRoundEvent().WriteTo(&input);  // N/A
+
+  // PERF_RECORD_SAMPLE
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c3000).Tid(1001).Time(12300030))
+      .WriteTo(&input);  // 1
+  testing::ExampleMmapEvent(1001, 0x1c5000, 0x1000, 0, "/usr/lib/baz.so",
+                            testing::SampleInfo().Tid(1001).Time(12300040))
+      .WriteTo(&input);  // unused
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x00000000001c3100).Tid(1001).Time(12300050))
+      .WriteTo(&input);  // 2
+  // PERF_RECORD_FINISHED_ROUND
+  testing::FinishedRoundEvent().WriteTo(&input);  // N/A
+
+  //
+  // Parse input.
+  //
+
+  PerfReader reader;
+  EXPECT_TRUE(reader.ReadFromString(input.str()));
+
+  PerfParserOptions options;
+  options.sample_mapping_percentage_threshold = 0;
+  options.discard_unused_events = true;
+  PerfParser parser(&reader, options);
+  EXPECT_TRUE(parser.ParseRawEvents());
+
+  EXPECT_EQ(3, parser.stats().num_mmap_events);
+  EXPECT_EQ(2, parser.stats().num_sample_events_mapped);
+
+  // The parsed events still point to the events of the reader, which are
+  // left in the same order.
+  const std::vector<ParsedEvent> &events = parser.parsed_events();
+  ASSERT_EQ(3, events.size());
+  ASSERT_EQ(3, reader.events().size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(&reader.events().Get(i), events[i].event_ptr);
+  }
+  EXPECT_EQ("/usr/lib/bar.so", events[0].event_ptr->mmap_event().filename());
+  EXPECT_EQ(12300030, events[1].event_ptr->sample_event().sample_time_ns());
+  EXPECT_EQ("/usr/lib/bar.so", events[1].dso_and_offset.dso_name());
+  EXPECT_EQ(12300050, events[2].event_ptr->sample_event().sample_time_ns());
+  EXPECT_EQ(0x100, events[2].dso_and_offset.offset());
+}
+
 TEST(PerfParserTest, MmapCoversEntireAddressSpace) {
   std::stringstream input;
 
@@ -4,14 +4,48 @@
 
 #include "perf_protobuf_io.h"
 
+#include <fcntl.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "base/logging.h"
 
 #include "file_utils.h"
+#include "mmap_data_reader.h"
 
 namespace quipper {
 
+namespace {
+
+// The first bytes of a chunked container file.
+const char kChunkedProtobufMagic[] = "QPCHUNK1";
+const size_t kChunkedProtobufMagicSize = sizeof(kChunkedProtobufMagic) - 1;
+
+// Parses the contents of |filename| into |perf_data_proto|, straight out of a
+// read-only mapping of the file if it can be mapped.
+bool ParseProtobufFromFile(const std::string& filename,
+                           PerfDataProto* perf_data_proto) {
+  bool ret;
+  MmapDataReader mapped_file(filename);
+  if (mapped_file.IsMapped()) {
+    ret = perf_data_proto->ParseFromArray(
+        mapped_file.GetContiguousData(0, mapped_file.size()),
+        mapped_file.size());
+  } else {
+    std::vector<char> buffer;
+    if (!FileToBuffer(filename, &buffer)) return false;
+    ret = perf_data_proto->ParseFromArray(buffer.data(), buffer.size());
+  }
+  PerfSerializer::ExpandCallchains(perf_data_proto);
+
+  LOG(INFO) << "#events" << perf_data_proto->events_size();
+
+  return ret;
+}
+
+}  // namespace
+
 bool SerializeFromString(const std::string& contents,
                          PerfDataProto* perf_data_proto) {
   return SerializeFromStringWithOptions(contents, PerfParserOptions(),
@@ -27,7 +61,8 @@ bool SerializeFromStringWithOptions(const std::string& contents,
   PerfParser parser(&reader, options);
   if (!parser.ParseRawEvents()) return false;
 
-  if (!reader.Serialize(perf_data_proto)) return false;
+  // The reader isn't used afterwards, so its proto is moved out.
+  if (!reader.SerializeAndRelease(perf_data_proto)) return false;
 
   // Append parser stats to protobuf.
   PerfSerializer::SerializeParserStats(parser.stats(), perf_data_proto);
@@ -64,13 +99,28 @@ bool SerializeFromFileWithOptions(const std::string& filename,
   PerfParser parser(&reader, options);
   if (!parser.ParseRawEvents()) return false;
 
-  if (!reader.Serialize(perf_data_proto)) return false;
+  // The reader isn't used afterwards, so its proto is moved out.
+  if (!reader.SerializeAndRelease(perf_data_proto)) return false;
 
   // Append parser stats to protobuf.
   PerfSerializer::SerializeParserStats(parser.stats(), perf_data_proto);
   return true;
 }
 
+bool SerializeFromFileToString(const std::string& filename,
+                               const PerfParserOptions& options,
+                               std::string* output) {
+  PerfReader reader;
+  if (!reader.ReadFile(filename)) return false;
+
+  PerfParser parser(&reader, options);
+  if (!parser.ParseRawEvents()) return false;
+
+  PerfDataProto* perf_data_proto = reader.SerializeInPlace();
+  PerfSerializer::SerializeParserStats(parser.stats(), perf_data_proto);
+  return perf_data_proto->SerializeToString(output);
+}
+
 bool DeserializeToFile(const PerfDataProto& perf_data_proto,
                        const std::string& filename) {
   PerfReader reader;
@@ -79,22 +129,191 @@ bool DeserializeToFile(const PerfDataProto& perf_data_proto,
 
 bool WriteProtobufToFile(const PerfDataProto& perf_data_proto,
                          const std::string& filename) {
-  std::string output;
-  perf_data_proto.SerializeToString(&output);
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  FileOutputStream output(fd);
+  const bool serialized = perf_data_proto.SerializeToZeroCopyStream(&output);
+  // Closing flushes the buffered output.
+  if (!output.Close() || !serialized) {
+    LOG(ERROR) << "Failed to write " << filename;
+    return false;
+  }
+  return true;
+}
 
-  return BufferToFile(filename, output);
+bool WriteProtobufTextToFile(const PerfDataProto& perf_data_proto,
+                             const std::string& filename) {
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  FileOutputStream output(fd);
+#ifdef QUIPPER_PROTO_LITE
+  const bool printed = false;
+  LOG(ERROR) << "The proto text format needs the full protobuf runtime";
+#else
+  const bool printed = TextFormat::Print(perf_data_proto, &output);
+#endif
+  // Closing flushes the buffered output.
+  if (!output.Close() || !printed) {
+    LOG(ERROR) << "Failed to write " << filename;
+    return false;
+  }
+  return true;
 }
 
 bool ReadProtobufFromFile(PerfDataProto* perf_data_proto,
                           const std::string& filename) {
-  std::vector<char> buffer;
-  if (!FileToBuffer(filename, &buffer)) return false;
+  return ParseProtobufFromFile(filename, perf_data_proto);
+}
 
-  bool ret = perf_data_proto->ParseFromArray(buffer.data(), buffer.size());
+bool WriteChunkedProtobufToFile(const PerfDataProto& perf_data_proto,
+                                const std::string& filename,
+                                size_t events_per_chunk) {
+  CHECK_GT(events_per_chunk, 0);
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  FileOutputStream output(fd);
+  {
+    CodedOutputStream coded_output(&output);
+    coded_output.WriteRaw(kChunkedProtobufMagic, kChunkedProtobufMagicSize);
+  }
 
-  LOG(INFO) << "#events" << perf_data_proto->events_size();
+  // The header is everything but the events, which are copied chunk by chunk.
+#ifdef QUIPPER_PROTO_LITE
+  // Without reflection, the fields other than the events can't be listed, so
+  // each of them is copied by name, see PerfDataProto.
+  PerfDataProto header;
+  *header.mutable_file_attrs() = perf_data_proto.file_attrs();
+  *header.mutable_event_types() = perf_data_proto.event_types();
+  if (perf_data_proto.has_timestamp_sec()) {
+    header.set_timestamp_sec(perf_data_proto.timestamp_sec());
+  }
+  if (perf_data_proto.has_stats()) {
+    *header.mutable_stats() = perf_data_proto.stats();
+  }
+  *header.mutable_metadata_mask() = perf_data_proto.metadata_mask();
+  if (perf_data_proto.has_tracing_data()) {
+    *header.mutable_tracing_data() = perf_data_proto.tracing_data();
+  }
+  *header.mutable_build_ids() = perf_data_proto.build_ids();
+  *header.mutable_uint32_metadata() = perf_data_proto.uint32_metadata();
+  *header.mutable_uint64_metadata() = perf_data_proto.uint64_metadata();
+  if (perf_data_proto.has_cpu_topology()) {
+    *header.mutable_cpu_topology() = perf_data_proto.cpu_topology();
+  }
+  *header.mutable_numa_topology() = perf_data_proto.numa_topology();
+  *header.mutable_pmu_mappings() = perf_data_proto.pmu_mappings();
+  *header.mutable_group_desc() = perf_data_proto.group_desc();
+  *header.mutable_hybrid_topology() = perf_data_proto.hybrid_topology();
+  if (perf_data_proto.has_string_metadata()) {
+    *header.mutable_string_metadata() = perf_data_proto.string_metadata();
+  }
+  if (perf_data_proto.has_compact_callchains()) {
+    header.set_compact_callchains(perf_data_proto.compact_callchains());
+  }
+#else
+  FieldMask header_fields;
+  const auto* descriptor = PerfDataProto::descriptor();
+  for (int i = 0; i < descriptor->field_count(); ++i) {
+    if (descriptor->field(i)->number() != PerfDataProto::kEventsFieldNumber) {
+      header_fields.add_paths(descriptor->field(i)->name());
+    }
+  }
+  PerfDataProto header;
+  FieldMaskUtil::MergeMessageTo(perf_data_proto, header_fields,
+                                FieldMaskUtil::MergeOptions(), &header);
+#endif
+  bool written = SerializeDelimitedToZeroCopyStream(header, &output);
 
-  return ret;
+  PerfDataProto chunk;
+  const int num_events = perf_data_proto.events_size();
+  for (int start = 0; written && start < num_events;
+       start += events_per_chunk) {
+    const int end = std::min<int>(num_events, start + events_per_chunk);
+    chunk.Clear();
+    chunk.mutable_events()->Reserve(end - start);
+    for (int i = start; i < end; ++i) {
+      *chunk.add_events() = perf_data_proto.events(i);
+    }
+    written = SerializeDelimitedToZeroCopyStream(chunk, &output);
+  }
+  // Closing flushes the buffered output.
+  if (!output.Close() || !written) {
+    LOG(ERROR) << "Failed to write " << filename;
+    return false;
+  }
+  return true;
+}
+
+ChunkedProtobufReader::ChunkedProtobufReader() {}
+
+ChunkedProtobufReader::~ChunkedProtobufReader() {}
+
+bool ChunkedProtobufReader::Open(const std::string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  input_.reset(new FileInputStream(fd));
+  input_->SetCloseOnDelete(true);
+  header_.Clear();
+  failed_ = false;
+
+  std::string magic;
+  {
+    CodedInputStream coded_input(input_.get());
+    coded_input.ReadString(&magic, kChunkedProtobufMagicSize);
+  }
+  if (magic != kChunkedProtobufMagic) {
+    LOG(ERROR) << filename << " is not a chunked perf data proto file";
+    input_.reset();
+    return false;
+  }
+  if (!ParseDelimitedFromZeroCopyStream(&header_, input_.get(), nullptr)) {
+    LOG(ERROR) << "Failed to read the header of " << filename;
+    input_.reset();
+    return false;
+  }
+  compact_callchains_ = header_.compact_callchains();
+  header_.clear_compact_callchains();
+  return true;
+}
+
+bool ChunkedProtobufReader::ReadChunk(PerfDataProto* chunk) {
+  if (input_ == nullptr || failed_) return false;
+  chunk->Clear();
+  bool clean_eof = false;
+  if (!ParseDelimitedFromZeroCopyStream(chunk, input_.get(), &clean_eof)) {
+    if (!clean_eof) {
+      LOG(ERROR) << "Failed to read a chunk of events";
+      failed_ = true;
+    }
+    return false;
+  }
+  if (compact_callchains_) {
+    chunk->set_compact_callchains(true);
+    PerfSerializer::ExpandCallchains(chunk);
+  }
+  return true;
+}
+
+PerfDataProto* ReadProtobufFromFileOnArena(const std::string& filename,
+                                           Arena* arena) {
+  PerfDataProto* perf_data_proto = Arena::Create<PerfDataProto>(arena);
+  if (!ParseProtobufFromFile(filename, perf_data_proto)) return nullptr;
+  return perf_data_proto;
 }
 
 }  // namespace quipper
@@ -5,6 +5,11 @@
 #ifndef CHROMIUMOS_WIDE_PROFILING_PERF_PROTOBUF_IO_H_
 #define CHROMIUMOS_WIDE_PROFILING_PERF_PROTOBUF_IO_H_
 
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+
 #include "compat/proto.h"
 #include "perf_parser.h"
 #include "perf_reader.h"
@@ -37,18 +42,81 @@ bool SerializeFromFileWithOptions(const std::string& filename,
                                   const PerfParserOptions& options,
                                   PerfDataProto* proto);
 
+// Same as SerializeFromFileWithOptions(), but serializes the protobuf to
+// |output| straight out of the PerfReader, without copying it to a
+// PerfDataProto of the caller first.
+bool SerializeFromFileToString(const std::string& filename,
+                               const PerfParserOptions& options,
+                               std::string* output);
+
 // Convert a PerfDataProto to raw perf data, storing it in a file.
 bool DeserializeToFile(const PerfDataProto& proto, const std::string& filename);
 
-// Writes PerfDataProto object to a file as serialized protobuf data.
+// Writes PerfDataProto object to a file as serialized protobuf data. The data
+// is serialized straight to the file.
 bool WriteProtobufToFile(const quipper::PerfDataProto& perf_data_proto,
                          const std::string& filename);
 
+// Writes PerfDataProto object to a file in protobuf text format. The text is
+// printed straight to the file.
+bool WriteProtobufTextToFile(const quipper::PerfDataProto& perf_data_proto,
+                             const std::string& filename);
+
 // Read from a file containing serialized PerfDataProto data into a
-// PerfDataProto object.
+// PerfDataProto object. Callchains in the compact encoding are expanded.
 bool ReadProtobufFromFile(quipper::PerfDataProto* perf_data_proto,
                           const std::string& filename);
 
+// Same as ReadProtobufFromFile(), but allocates the PerfDataProto object and
+// all its messages on |arena|, which owns them, so that they are freed at once
+// with it instead of one by one. Returns nullptr on failure.
+quipper::PerfDataProto* ReadProtobufFromFileOnArena(const std::string& filename,
+                                                    Arena* arena);
+
+// Writes |perf_data_proto| to a file in the chunked container format: a header
+// holding all of it but the events, followed by its events in chunks of up to
+// |events_per_chunk|. The header and the chunks are length-delimited
+// PerfDataProto objects, the chunks holding only events. Unlike a single
+// PerfDataProto object, which can't be parsed past 2 GB, the container can
+// hold any number of events, and can be read one chunk at a time by
+// ChunkedProtobufReader.
+bool WriteChunkedProtobufToFile(const quipper::PerfDataProto& perf_data_proto,
+                                const std::string& filename,
+                                size_t events_per_chunk = 100000);
+
+// Reads a file written by WriteChunkedProtobufToFile() one chunk at a time.
+class ChunkedProtobufReader {
+ public:
+  ChunkedProtobufReader();
+  ~ChunkedProtobufReader();
+
+  ChunkedProtobufReader(const ChunkedProtobufReader&) = delete;
+  ChunkedProtobufReader& operator=(const ChunkedProtobufReader&) = delete;
+
+  // Opens |filename| and reads its header. Returns false if the file can't be
+  // opened or is not a chunked container.
+  bool Open(const std::string& filename);
+
+  // Returns the header of the file, with the file attrs, the metadata and the
+  // build IDs, but no events.
+  const quipper::PerfDataProto& header() const { return header_; }
+
+  // Replaces the contents of |chunk| with the events of the next chunk, and
+  // returns true. Returns false at the end of the file, or if the chunk can't
+  // be read, in which case failed() returns true. Callchains in the compact
+  // encoding are expanded.
+  bool ReadChunk(quipper::PerfDataProto* chunk);
+
+  bool failed() const { return failed_; }
+
+ private:
+  std::unique_ptr<FileInputStream> input_;
+  quipper::PerfDataProto header_;
+  // Whether the callchains of the chunks are in the compact encoding.
+  bool compact_callchains_ = false;
+  bool failed_ = false;
+};
+
 }  // namespace quipper
 
 #endif  // CHROMIUMOS_WIDE_PROFILING_PERF_PROTOBUF_IO_H_
@@ -4,35 +4,53 @@
 
 #include "perf_reader.h"
 
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <limits>
 #include <map>
+#include <memory>
+#include <queue>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "base/logging.h"
 #include "binary_data_utils.h"
 #include "buffer_reader.h"
 #include "buffer_writer.h"
+#include "build_id_index.h"
 #include "compat/proto.h"
+#include "compat/thread.h"
+#include "event_reorderer.h"
 #include "file_reader.h"
 #include "file_utils.h"
+#include "file_writer.h"
 #include "kernel/perf_event.h"
 #include "kernel/perf_internals.h"
+#include "mmap_data_reader.h"
 #include "perf_buildid.h"
 #include "perf_data_structures.h"
 #include "perf_data_utils.h"
 #include "perf_serializer.h"
+#include "sample_columns.h"
 #include "sample_info_reader.h"
 #include "string_utils.h"
+#include "trace.h"
+#include "zstd_decompressor.h"
 
 namespace quipper {
 
@@ -76,6 +94,12 @@ const uint64_t kSupportedMetadataMask =
     1 << HEADER_BRANCH_STACK | 1 << HEADER_PMU_MAPPINGS |
     1 << HEADER_GROUP_DESC | 1 << HEADER_HYBRID_TOPOLOGY;
 
+// The metadata types that are left in the input with SetLazyMetadata().
+const uint64_t kLazyMetadataMask =
+    1 << HEADER_TRACING_DATA | 1 << HEADER_CPU_TOPOLOGY |
+    1 << HEADER_NUMA_TOPOLOGY | 1 << HEADER_PMU_MAPPINGS |
+    1 << HEADER_GROUP_DESC | 1 << HEADER_HYBRID_TOPOLOGY;
+
 // By default, the build ID event has PID = -1.
 const uint32_t kDefaultBuildIDEventPid = static_cast<uint32_t>(-1);
 
@@ -216,6 +240,280 @@ static bool CompareEventTimes(const PerfEvent* e1, const PerfEvent* e2) {
   return e1->timestamp() < e2->timestamp();
 }
 
+// Orders |events| by timestamp in a single pass using the round boundaries
+// marked by PERF_RECORD_FINISHED_ROUND events, producing the same order as a
+// stable sort with CompareEventTimes. Returns false without modifying |events|
+// if there are no round boundaries or the events don't honor them.
+static bool OrderEventsByRounds(RepeatedPtrField<PerfEvent>* events) {
+  std::vector<PerfEvent*> ordered;
+  ordered.reserve(events->size());
+  // Events without a timestamp, including the PERF_RECORD_FINISHED_ROUND
+  // events themselves, sort before all the others.
+  bool has_rounds = false;
+  for (auto it = events->pointer_begin(); it != events->pointer_end(); ++it) {
+    PerfEvent* event = *it;
+    if (event->timestamp() != 0) continue;
+    has_rounds |= event->header().type() == PERF_RECORD_FINISHED_ROUND;
+    ordered.push_back(event);
+  }
+  if (!has_rounds) return false;
+
+  EventReorderer<PerfEvent*> reorderer(
+      [&ordered](PerfEvent* event) { ordered.push_back(event); });
+  for (auto it = events->pointer_begin(); it != events->pointer_end(); ++it) {
+    PerfEvent* event = *it;
+    if (event->header().type() == PERF_RECORD_FINISHED_ROUND) {
+      reorderer.FinishRound();
+    } else if (event->timestamp() != 0 &&
+               !reorderer.Push(event->timestamp(), event)) {
+      return false;
+    }
+  }
+  reorderer.Flush();
+
+  CHECK_EQ(ordered.size(), static_cast<size_t>(events->size()));
+  std::copy(ordered.begin(), ordered.end(), events->pointer_begin());
+  return true;
+}
+
+// Merges the streams of events that end at |stream_ends| in |events|, each
+// ordered by time within a bounded window, by always taking the event with the
+// earliest timestamp at the head of a stream, as perf does for directory-format
+// data. Events without a timestamp are taken at the time of the event before
+// them in their stream. Ties go to the earlier stream.
+static void MergeEventStreams(RepeatedPtrField<PerfEvent>* events,
+                              const std::vector<int>& stream_ends) {
+  struct Stream {
+    int next;
+    int end;
+    u64 time;
+  };
+  std::vector<Stream> streams;
+  int begin = 0;
+  for (int end : stream_ends) {
+    streams.push_back({begin, end, 0});
+    begin = end;
+  }
+  using Head = std::pair<u64, size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  auto push_head = [events, &streams, &heads](size_t i) {
+    Stream* stream = &streams[i];
+    if (stream->next == stream->end) return;
+    const u64 time = events->Get(stream->next).timestamp();
+    if (time != 0) stream->time = time;
+    heads.emplace(stream->time, i);
+  };
+  for (size_t i = 0; i < streams.size(); ++i) push_head(i);
+
+  std::vector<PerfEvent*> merged;
+  merged.reserve(events->size());
+  while (!heads.empty()) {
+    const size_t i = heads.top().second;
+    heads.pop();
+    merged.push_back(events->Mutable(streams[i].next++));
+    push_head(i);
+  }
+  std::copy(merged.begin(), merged.end(), events->pointer_begin());
+}
+
+// Returns true if events of |type| change how the samples after them are
+// processed, as mmaps, comms, forks and exits do. The samples themselves and
+// the events whose order doesn't matter, e.g. the counts of lost samples,
+// don't.
+static bool ChangesSampleProcessing(u32 type) {
+  switch (type) {
+    case PERF_RECORD_SAMPLE:
+    case PERF_RECORD_FINISHED_ROUND:
+    case PERF_RECORD_LOST:
+    case PERF_RECORD_LOST_SAMPLES:
+    case PERF_RECORD_THROTTLE:
+    case PERF_RECORD_UNTHROTTLE:
+      return false;
+  }
+  return true;
+}
+
+// Returns true if sorting |events| by time would only reorder the samples
+// among themselves and among the events that don't change how samples are
+// processed, whichever order they come in. The other events must then all
+// come before the first sample, in time order, and no later than any sample.
+static bool SortingOnlyReordersSamples(
+    const RepeatedPtrField<PerfEvent>& events) {
+  bool seen_sample = false;
+  u64 max_other_time = 0;
+  u64 min_sample_time = std::numeric_limits<u64>::max();
+  for (const PerfEvent& event : events) {
+    const u32 type = event.header().type();
+    if (type == PERF_RECORD_SAMPLE) {
+      seen_sample = true;
+      min_sample_time = std::min(min_sample_time, event.timestamp());
+      continue;
+    }
+    if (!ChangesSampleProcessing(type)) continue;
+    if (seen_sample || event.timestamp() < max_other_time) return false;
+    max_other_time = event.timestamp();
+  }
+  return max_other_time <= min_sample_time;
+}
+
+// Sorts the events of |events| that change how samples are processed by time,
+// and moves each of the other events right after the last of them no later
+// than it, keeping the order of the other events otherwise. Each of them is
+// bucketed by a binary search over the times of the few events that are
+// sorted. Returns false if the events were already in that order.
+static bool OrderStateEventsByTime(RepeatedPtrField<PerfEvent>* events) {
+  std::vector<PerfEvent*> state_events;
+  for (auto it = events->pointer_begin(); it != events->pointer_end(); ++it) {
+    PerfEvent* event = *it;
+    if (ChangesSampleProcessing(event->header().type())) {
+      state_events.push_back(event);
+    }
+  }
+  bool ordered = std::is_sorted(state_events.begin(), state_events.end(),
+                                CompareEventTimes);
+  if (!ordered) {
+    std::stable_sort(state_events.begin(), state_events.end(),
+                     CompareEventTimes);
+  }
+  std::vector<u64> state_times;
+  state_times.reserve(state_events.size());
+  for (const PerfEvent* event : state_events) {
+    state_times.push_back(event->timestamp());
+  }
+
+  // The number of state events before each of the other events, and the
+  // number of other events after each state event and before the next.
+  std::vector<u32> buckets;
+  buckets.reserve(events->size() - state_events.size());
+  std::vector<int> bucket_sizes(state_events.size() + 1);
+  u32 state_events_seen = 0;
+  for (const PerfEvent& event : *events) {
+    if (ChangesSampleProcessing(event.header().type())) {
+      ++state_events_seen;
+      continue;
+    }
+    const u32 bucket = std::upper_bound(state_times.begin(), state_times.end(),
+                                        event.timestamp()) -
+                       state_times.begin();
+    ordered &= bucket == state_events_seen;
+    buckets.push_back(bucket);
+    ++bucket_sizes[bucket];
+  }
+  if (ordered) return false;
+
+  // The position of the next event of each bucket, the state event that
+  // starts it being at the position before.
+  std::vector<int> positions(bucket_sizes.size());
+  for (size_t i = 1; i < positions.size(); ++i) {
+    positions[i] = positions[i - 1] + bucket_sizes[i - 1] + 1;
+  }
+  std::vector<PerfEvent*> reordered(events->size());
+  for (size_t i = 0; i < state_events.size(); ++i) {
+    reordered[positions[i + 1] - 1] = state_events[i];
+  }
+  size_t next_bucket = 0;
+  for (auto it = events->pointer_begin(); it != events->pointer_end(); ++it) {
+    PerfEvent* event = *it;
+    if (ChangesSampleProcessing(event->header().type())) continue;
+    reordered[positions[buckets[next_bucket++]]++] = event;
+  }
+  std::copy(reordered.begin(), reordered.end(), events->pointer_begin());
+  return true;
+}
+
+// Runs a function on a new thread.
+class FunctionThread : public quipper::Thread {
+ public:
+  explicit FunctionThread(std::function<void()> body)
+      : Thread("quipper"), body_(std::move(body)) {}
+
+ protected:
+  void Run() override { body_(); }
+
+ private:
+  std::function<void()> body_;
+};
+
+// The largest first block allocated by an arena sized for the input.
+const size_t kMaxArenaStartBlockSize = 16 * 1024 * 1024;
+
+// The smallest chunk of the data section worth decoding on its own thread.
+const size_t kMinDataSectionChunkSize = 64 * 1024;
+
+// The size of the blocks of decompressed events decoded on their own thread.
+const size_t kDecompressedBlockSize = 256 * 1024;
+
+// The fewest events worth writing on their own thread.
+const int kMinEventsPerEncodeThread = 4096;
+
+// Returns the number of bytes |event| takes up in the data section.
+u64 DataSectionSizeOf(const PerfEvent& event) {
+  u64 size = event.header().size();
+  // Auxtrace event contain trace data at the end of the event.
+  if (event.header().type() == PERF_RECORD_AUXTRACE) {
+    size += event.auxtrace_event().size();
+  }
+  return size;
+}
+
+bool IsCompressedEventType(u32 type) {
+  return type == PERF_RECORD_COMPRESSED || type == PERF_RECORD_COMPRESSED2;
+}
+
+// Walks the event headers of the |size| bytes of the data section at
+// |section|. Splits the section into at most |max_chunks| chunks of similar
+// size at event boundaries, and stores the offsets at which the chunks start in
+// |chunk_offsets|. Stores the number of events whose type is not in
+// |types_to_skip| in |num_events|, and whether there are compressed events,
+// which can't be decoded as chunks, in |compressed|. Returns false if the event
+// headers are inconsistent with the section size, so that the section has to
+// be read sequentially to report the error.
+bool ScanDataSection(const char* section, size_t size, bool cross_endian,
+                     size_t max_chunks,
+                     const std::unordered_set<u32>& types_to_skip,
+                     std::vector<size_t>* chunk_offsets, size_t* num_events,
+                     bool* compressed) {
+  const size_t num_chunks = std::min(
+      max_chunks, std::max<size_t>(size / kMinDataSectionChunkSize, 1));
+  const size_t target_chunk_size = size / num_chunks;
+  chunk_offsets->assign(1, 0);
+  *num_events = 0;
+  *compressed = false;
+  size_t offset = 0;
+  while (offset < size) {
+    perf_event_header header;
+    if (size - offset < sizeof(header)) return false;
+    memcpy(&header, section + offset, sizeof(header));
+    if (cross_endian) {
+      ByteSwap(&header.type);
+      ByteSwap(&header.size);
+    }
+    if (header.size < sizeof(header) || header.size > size - offset) {
+      return false;
+    }
+    u64 event_size = header.size;
+    if (header.type == PERF_RECORD_AUXTRACE) {
+      // The trace data follows the event.
+      u64 trace_size;
+      if (header.size < sizeof(header) + sizeof(trace_size)) return false;
+      memcpy(&trace_size, section + offset + sizeof(header),
+             sizeof(trace_size));
+      if (cross_endian) ByteSwap(&trace_size);
+      if (trace_size > size - offset - event_size) return false;
+      event_size += trace_size;
+    }
+    if (types_to_skip.count(header.type) == 0) ++*num_events;
+    if (IsCompressedEventType(header.type)) *compressed = true;
+    offset += event_size;
+    if (offset < size &&
+        offset - chunk_offsets->back() >= target_chunk_size &&
+        chunk_offsets->size() < num_chunks) {
+      chunk_offsets->push_back(offset);
+    }
+  }
+  return true;
+}
+
 // Returns true if the mmap was generated when parsing the /proc/PID/maps timed
 // out.
 bool IsProcMapTimeoutMmap(const struct perf_event_header& header) {
@@ -365,27 +663,23 @@ bool ByteSwapEventDataVariablePayloadFields(event_t* event) {
   uint32_t type = event->header.type;
   switch (type) {
     case PERF_RECORD_NAMESPACES:
-      for (u64 i = 0; i < event->namespaces.nr_namespaces; ++i) {
-        ByteSwap(&event->namespaces.link_info[i].dev);
-        ByteSwap(&event->namespaces.link_info[i].ino);
-      }
+      // Each link info is a dev and an ino.
+      ByteSwapArray(reinterpret_cast<u64*>(event->namespaces.link_info),
+                    event->namespaces.nr_namespaces *
+                        (sizeof(perf_ns_link_info) / sizeof(u64)));
       return true;
     case PERF_RECORD_AUXTRACE_INFO: {
       u64 priv_size =
           (event->header.size - offsetof(struct auxtrace_info_event, priv)) /
           sizeof(u64);
-      for (u64 i = 0; i < priv_size; ++i) {
-        ByteSwap(&event->auxtrace_info.priv[i]);
-      }
+      ByteSwapArray(event->auxtrace_info.priv, priv_size);
       return true;
     }
     case PERF_RECORD_ID_INDEX:
-      for (u64 i = 0; i < event->id_index.nr; ++i) {
-        ByteSwap(&event->id_index.entries[i].id);
-        ByteSwap(&event->id_index.entries[i].idx);
-        ByteSwap(&event->id_index.entries[i].cpu);
-        ByteSwap(&event->id_index.entries[i].tid);
-      }
+      // Each entry is an id, idx, cpu and tid.
+      ByteSwapArray(reinterpret_cast<u64*>(event->id_index.entries),
+                    event->id_index.nr *
+                        (sizeof(id_index_event_entry) / sizeof(u64)));
       return true;
     case PERF_RECORD_THREAD_MAP:
       for (u64 i = 0; i < event->thread_map.nr; ++i) {
@@ -393,10 +687,10 @@ bool ByteSwapEventDataVariablePayloadFields(event_t* event) {
       }
       return true;
     case PERF_RECORD_STAT_CONFIG:
-      for (u64 i = 0; i < event->stat_config.nr; ++i) {
-        ByteSwap(&event->stat_config.data[i].tag);
-        ByteSwap(&event->stat_config.data[i].val);
-      }
+      // Each entry is a tag and a val.
+      ByteSwapArray(reinterpret_cast<u64*>(event->stat_config.data),
+                    event->stat_config.nr *
+                        (sizeof(stat_config_event_entry) / sizeof(u64)));
       return true;
     case PERF_RECORD_CGROUP:
       ByteSwap(&event->cgroup.id);
@@ -443,17 +737,32 @@ bool ByteSwapEventDataVariablePayloadFields(event_t* event) {
 
 }  // namespace
 
-PerfReader::PerfReader()
-    : proto_(Arena::Create<PerfDataProto>(&arena_)), is_cross_endian_(false) {
+PerfReader::PerfReader() : PerfReader(ArenaOptions()) {}
+
+PerfReader::PerfReader(const ArenaOptions& arena_options)
+    : arena_(arena_options),
+      proto_(Arena::Create<PerfDataProto>(&arena_)),
+      is_cross_endian_(false) {
   // The metadata mask is stored in |proto_|. It should be initialized to 0
   // since it is used heavily.
   proto_->add_metadata_mask(0);
 }
 
+ArenaOptions PerfReader::ArenaOptionsForInputSize(size_t size) {
+  ArenaOptions options;
+  options.start_block_size = std::max(
+      options.start_block_size, std::min(size, kMaxArenaStartBlockSize));
+  options.max_block_size =
+      std::max(options.max_block_size, options.start_block_size);
+  return options;
+}
+
 PerfReader::~PerfReader() {}
 
 bool PerfReader::Serialize(PerfDataProto* perf_data_proto) const {
   perf_data_proto->CopyFrom(*proto_);
+  if (sample_columns_ != nullptr) sample_columns_->MergeInto(perf_data_proto);
+  if (compact_callchains_) PerfSerializer::CompactCallchains(perf_data_proto);
 
   // Add a timestamp_sec to the protobuf.
   struct timeval timestamp_sec;
@@ -462,8 +771,61 @@ bool PerfReader::Serialize(PerfDataProto* perf_data_proto) const {
   return true;
 }
 
+PerfDataProto* PerfReader::SerializeInPlace() {
+  if (sample_columns_ != nullptr) {
+    sample_columns_->MergeInto(proto_);
+    sample_columns_ = nullptr;
+  }
+  if (compact_callchains_) PerfSerializer::CompactCallchains(proto_);
+  mmap_events_valid_ = false;
+
+  struct timeval timestamp_sec;
+  if (!gettimeofday(&timestamp_sec, NULL))
+    proto_->set_timestamp_sec(timestamp_sec.tv_sec);
+  return proto_;
+}
+
+bool PerfReader::SerializeAndRelease(PerfDataProto* perf_data_proto) {
+  perf_data_proto->Swap(SerializeInPlace());
+  return true;
+}
+
 bool PerfReader::Deserialize(const PerfDataProto& perf_data_proto) {
+  MoveProtoToArena();
   proto_->CopyFrom(perf_data_proto);
+  return FinishDeserialize();
+}
+
+bool PerfReader::Deserialize(PerfDataProto&& perf_data_proto) {
+  // Swap() copies the contents only of messages on an arena.
+  std::unique_ptr<PerfDataProto> proto(new PerfDataProto);
+  proto->Swap(&perf_data_proto);
+  proto_ = proto.get();
+  adopted_proto_ = std::move(proto);
+  adopted_arena_.reset();
+  return FinishDeserialize();
+}
+
+bool PerfReader::Deserialize(std::unique_ptr<Arena> arena,
+                             PerfDataProto* perf_data_proto) {
+  proto_ = perf_data_proto;
+  adopted_arena_ = std::move(arena);
+  adopted_proto_.reset();
+  return FinishDeserialize();
+}
+
+void PerfReader::MoveProtoToArena() {
+  if (adopted_arena_ == nullptr && adopted_proto_ == nullptr) return;
+  PerfDataProto* proto = Arena::Create<PerfDataProto>(&arena_);
+  proto->Swap(proto_);
+  proto_ = proto;
+  adopted_proto_.reset();
+  adopted_arena_.reset();
+}
+
+bool PerfReader::FinishDeserialize() {
+  PerfSerializer::ExpandCallchains(proto_);
+  mmap_events_valid_ = false;
 
   // Iterate through all attrs and create a SampleInfoReader for each of them.
   // This is necessary for writing the proto representation of perf data to raw
@@ -480,6 +842,16 @@ bool PerfReader::Deserialize(const PerfDataProto& perf_data_proto) {
 }
 
 bool PerfReader::ReadFile(const std::string& filename) {
+  // Prefer serving the data straight out of a read-only mapping of the file,
+  // which avoids copying the whole file into memory. Fall back to regular
+  // file reads for inputs that can't be mapped.
+  std::unique_ptr<MmapDataReader> mmap_reader(new MmapDataReader(filename));
+  if (mmap_reader->IsMapped()) {
+    DataReader* data = mmap_reader.get();
+    if (lazy_metadata_) lazy_input_ = std::move(mmap_reader);
+    return ReadFromData(data);
+  }
+
   FileReader reader(filename);
   if (!reader.IsOpen()) {
     LOG(ERROR) << "Unable to open file " << filename;
@@ -488,6 +860,125 @@ bool PerfReader::ReadFile(const std::string& filename) {
   return ReadFromData(&reader);
 }
 
+bool PerfReader::ReadTimeRange(const std::string& filename, u64 start_time,
+                               u64 end_time) {
+  filter_state_.has_time_range = true;
+  filter_state_.start_time = start_time;
+  filter_state_.end_time = end_time;
+  const bool ok = ReadFile(filename);
+  filter_state_.has_time_range = false;
+  return ok;
+}
+
+bool PerfReader::ReadDirectory(const std::string& dirname) {
+  QUIPPER_TRACE_SPAN("PerfReader::ReadDirectory");
+  if (event_callback_ || sample_event_callback_ || sample_columns_ ||
+      !filter_state_.empty()) {
+    LOG(ERROR) << "Directory-format perf data can't be read with callbacks, "
+               << "sample columns or filters";
+    return false;
+  }
+  if (!ReadFile(dirname + "/data")) return false;
+
+  // The data.N files, in the order of N.
+  std::vector<std::pair<u64, std::string>> filenames;
+  DIR* dir = opendir(dirname.c_str());
+  if (dir == nullptr) {
+    LOG(ERROR) << "Unable to open directory " << dirname;
+    return false;
+  }
+  while (const struct dirent* entry = readdir(dir)) {
+    const char* index = entry->d_name + strlen("data.");
+    if (strncmp(entry->d_name, "data.", strlen("data.")) != 0 ||
+        *index == '\0' || strspn(index, "0123456789") != strlen(index)) {
+      continue;
+    }
+    filenames.emplace_back(strtoull(index, nullptr, 10),
+                           dirname + "/" + entry->d_name);
+  }
+  closedir(dir);
+  std::sort(filenames.begin(), filenames.end());
+
+  // Like the chunks of ReadDataSectionChunks(), each file is decoded into its
+  // own proto on |arena_|.
+  struct DataFile {
+    std::unique_ptr<MmapDataReader> mapping;
+    std::vector<char> contents;
+    const char* start;
+    size_t size;
+    PerfDataProto* events;
+    std::unordered_set<std::string> filenames_with_build_id;
+    WarningCounts warnings;
+    bool ok;
+  };
+  std::vector<DataFile> files(filenames.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    const std::string& filename = filenames[i].second;
+    DataFile* file = &files[i];
+    file->mapping.reset(new MmapDataReader(filename));
+    if (file->mapping->IsMapped()) {
+      file->size = file->mapping->size();
+      file->start = static_cast<const char*>(
+          file->mapping->GetContiguousData(0, file->size));
+    } else {
+      file->mapping.reset();
+      if (!FileToBuffer(filename, &file->contents)) {
+        LOG(ERROR) << "Unable to read file " << filename;
+        return false;
+      }
+      file->start = file->contents.data();
+      file->size = file->contents.size();
+    }
+    std::vector<size_t> chunk_offsets;
+    size_t num_events;
+    bool compressed;
+    if (!ScanDataSection(file->start, file->size, is_cross_endian_,
+                         /*max_chunks=*/1, {}, &chunk_offsets, &num_events,
+                         &compressed)) {
+      LOG(ERROR) << "Invalid events in " << filename;
+      return false;
+    }
+    if (compressed) {
+      LOG(ERROR) << "Compressed events in " << filename << " are unsupported";
+      return false;
+    }
+    file->events = Arena::Create<PerfDataProto>(&arena_);
+    file->events->mutable_events()->Reserve(num_events);
+  }
+
+  std::atomic<size_t> next_file(0);
+  auto read_files = [this, &files, &next_file] {
+    for (size_t i; (i = next_file++) < files.size();) {
+      DataFile* file = &files[i];
+      file->ok = ReadDataSectionChunk(
+          file->start, file->size, is_cross_endian_, file->events,
+          &file->filenames_with_build_id, &file->warnings);
+    }
+  };
+  // This thread reads files too.
+  std::vector<std::unique_ptr<FunctionThread>> threads;
+  for (size_t i = 1; i < std::min(num_decode_threads_, files.size()); ++i) {
+    threads.emplace_back(new FunctionThread(read_files));
+    threads.back()->Start();
+  }
+  read_files();
+  for (auto& thread : threads) thread->Join();
+
+  std::vector<int> stream_ends = {proto_->events_size()};
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (!files[i].ok) {
+      LOG(ERROR) << "Couldn't read the events of " << filenames[i].second;
+      return false;
+    }
+    AddDataSectionChunk(files[i].events, files[i].warnings);
+    stream_ends.push_back(proto_->events_size());
+  }
+  MergeEventStreams(proto_->mutable_events(), stream_ends);
+  mmap_events_valid_ = false;
+  DLOG(INFO) << "Number of events stored: " << proto_->events_size();
+  return true;
+}
+
 bool PerfReader::ReadFromVector(const std::vector<char>& data) {
   return ReadFromPointer(data.data(), data.size());
 }
@@ -497,21 +988,40 @@ bool PerfReader::ReadFromString(const std::string& str) {
 }
 
 bool PerfReader::ReadFromPointer(const char* data, size_t size) {
-  BufferReader buffer(data, size);
-  return ReadFromData(&buffer);
+  std::unique_ptr<BufferReader> buffer(new BufferReader(data, size));
+  DataReader* reader = buffer.get();
+  if (lazy_metadata_) lazy_input_ = std::move(buffer);
+  input_ = std::string_view(data, size);
+  const bool ok = ReadFromData(reader);
+  input_ = std::string_view();
+  return ok;
 }
 
 bool PerfReader::ReadFromData(DataReader* data) {
+  QUIPPER_TRACE_SPAN("PerfReader::ReadFromData");
+  MoveProtoToArena();
+  lazy_metadata_sections_.clear();
+  if (data != lazy_input_.get()) lazy_input_.reset();
+  const bool ok = ReadPerfData(data);
+  // Only the input of lazy metadata is kept.
+  if (lazy_metadata_sections_.empty()) lazy_input_.reset();
+  return ok;
+}
+
+bool PerfReader::ReadPerfData(DataReader* data) {
   if (data->size() == 0) {
     LOG(ERROR) << "Input data is empty";
     return false;
   }
   if (!ReadHeader(data)) return false;
+  warnings_.Clear();
 
   // Check if it is normal perf data.
   if (header_.size == sizeof(header_)) {
     DVLOG(1) << "Perf data is in normal format.";
-    return ReadFileData(data);
+    const bool ok = ReadFileData(data);
+    warnings_.Log();
+    return ok;
   }
 
   // Otherwise it is piped data.
@@ -522,25 +1032,57 @@ bool PerfReader::ReadFromData(DataReader* data) {
     return false;
   }
 
-  return ReadPipedData(data);
+  const bool ok = ReadPipedData(data);
+  warnings_.Log();
+  return ok;
 }
 
 bool PerfReader::WriteFile(const std::string& filename) {
-  std::vector<char> data;
-  return WriteToVector(&data) && BufferToFile(filename, data);
+  if (!ReadLazyMetadata()) return false;
+  // Unlike a buffer, the file doesn't have to be sized up front, so it is
+  // written in a single pass over the events. It is written to a temporary
+  // file, which then replaces |filename|, so that a failed write leaves any
+  // existing file as it was.
+  const std::string temp_path =
+      filename + ".tmp." + std::to_string(getpid());
+  bool written;
+  {
+    FileWriter data(temp_path);
+    if (!data.IsOpen()) return false;
+    struct perf_file_header header;
+    GenerateHeader(&header);
+
+    written = WriteHeader(header, &data) && WriteAttrs(header, &data) &&
+              WriteData(header, &data) && WriteMetadata(header, &data);
+    written = data.Close() && written;
+  }
+  if (!written) {
+    LOG(ERROR) << "Failed to write " << temp_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), filename.c_str()) != 0) {
+    LOG(ERROR) << "Failed to replace " << filename;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
 }
 
 bool PerfReader::WriteToVector(std::vector<char>* data) {
+  if (!ReadLazyMetadata()) return false;
   data->resize(GetSize());
   return WriteToPointerWithoutCheckingSize(&data->at(0), data->size());
 }
 
 bool PerfReader::WriteToString(std::string* str) {
+  if (!ReadLazyMetadata()) return false;
   str->resize(GetSize());
   return WriteToPointerWithoutCheckingSize(&str->at(0), str->size());
 }
 
 bool PerfReader::WriteToPointer(char* buffer, size_t size) {
+  if (!ReadLazyMetadata()) return false;
   size_t required_size = GetSize();
   if (size < required_size) {
     LOG(ERROR) << "Buffer is too small - buffer size is " << size
@@ -609,12 +1151,7 @@ void PerfReader::GenerateHeader(struct perf_file_header* header) const {
   header->attr_size = sizeof(perf_file_attr);
   header->attrs.size = header->attr_size * attrs().size();
   for (const PerfEvent& event : proto_->events()) {
-    header->data.size += event.header().size();
-    // Auxtrace event contain trace data at the end of the event. Add the size
-    // of this trace data to the header.data size.
-    if (event.header().type() == PERF_RECORD_AUXTRACE) {
-      header->data.size += event.auxtrace_event().size();
-    }
+    header->data.size += DataSectionSizeOf(event);
   }
   // Do not use the event_types section. Use EVENT_DESC metadata instead.
   header->event_types.size = 0;
@@ -649,7 +1186,7 @@ void PerfReader::GenerateHeader(struct perf_file_header* header) const {
 bool PerfReader::InjectBuildIDs(
     const std::map<std::string, std::string>& filenames_to_build_ids) {
   set_metadata_mask_bit(HEADER_BUILD_ID);
-  std::set<std::string> updated_filenames;
+  std::unordered_set<std::string> updated_filenames;
   // Inject new build ID's for existing build ID events.
   for (auto& build_id : *proto_->mutable_build_ids()) {
     auto find_result = filenames_to_build_ids.find(build_id.filename());
@@ -670,15 +1207,15 @@ bool PerfReader::InjectBuildIDs(
     updated_filenames.insert(build_id.filename());
   }
 
+  if (updated_filenames.size() == filenames_to_build_ids.size()) return true;
+
   // For files with no existing build ID events, create new build ID events.
   // This requires a lookup of all MMAP's to determine the |misc| field of each
-  // build ID event.
-  std::map<std::string, uint16_t> filename_to_misc;
-  for (const PerfEvent& event : proto_->events()) {
-    if (event.header().type() == PERF_RECORD_MMAP ||
-        event.header().type() == PERF_RECORD_MMAP2) {
-      filename_to_misc[event.mmap_event().filename()] = event.header().misc();
-    }
+  // build ID event. The filenames point into the events, which outlive the
+  // map.
+  std::unordered_map<std::string_view, uint16_t> filename_to_misc;
+  for (const PerfEvent* event : MmapEvents()) {
+    filename_to_misc[event->mmap_event().filename()] = event->header().misc();
   }
 
   std::map<std::string, std::string>::const_iterator it;
@@ -689,8 +1226,7 @@ bool PerfReader::InjectBuildIDs(
 
     // Determine the misc field.
     uint16_t new_misc = PERF_RECORD_MISC_KERNEL;
-    std::map<std::string, uint16_t>::const_iterator misc_iter =
-        filename_to_misc.find(filename);
+    auto misc_iter = filename_to_misc.find(filename);
     if (misc_iter != filename_to_misc.end()) new_misc = misc_iter->second;
 
     std::string build_id = it->second;
@@ -706,6 +1242,42 @@ bool PerfReader::InjectBuildIDs(
   return true;
 }
 
+void PerfReader::InjectIndexedBuildIDs(
+    const BuildIdIndex& index,
+    const std::vector<std::string>& other_filenames) {
+  set_metadata_mask_bit(HEADER_BUILD_ID);
+  std::unordered_set<std::string> seen_filenames;
+  for (auto& build_id : *proto_->mutable_build_ids()) {
+    seen_filenames.insert(build_id.filename());
+    const BuildIdIndex::Entry* entry = index.Find(build_id.filename());
+    if (entry == nullptr) continue;
+    build_id.set_build_id_hash(entry->build_id);
+    build_id.set_is_injected(true);
+  }
+
+  // The build ID events are made as by CreateBuildIDEvent(), out of the
+  // decoded build IDs.
+  auto add_build_id = [this, &index, &seen_filenames](
+                          const std::string& filename, uint16_t misc) {
+    if (!seen_filenames.insert(filename).second) return;
+    const BuildIdIndex::Entry* entry = index.Find(filename);
+    if (entry == nullptr) return;
+    PerfDataProto_PerfBuildID* build_id = proto_->add_build_ids();
+    build_id->set_misc(misc);
+    build_id->set_pid(kDefaultBuildIDEventPid);
+    build_id->set_filename(filename);
+    build_id->set_filename_md5_prefix(CachedMd5Prefix(filename));
+    build_id->set_build_id_hash(entry->event_build_id);
+    build_id->set_is_injected(true);
+  };
+  for (const PerfEvent* event : MmapEvents()) {
+    add_build_id(event->mmap_event().filename(), event->header().misc());
+  }
+  for (const std::string& filename : other_filenames) {
+    add_build_id(filename, PERF_RECORD_MISC_KERNEL);
+  }
+}
+
 bool PerfReader::Localize(
     const std::map<std::string, std::string>& build_ids_to_filenames) {
   std::map<std::string, std::string> filename_map;
@@ -781,16 +1353,29 @@ void PerfReader::GetFilenamesToBuildIDs(
   }
 }
 
-void PerfReader::MaybeSortEventsByTime() {
+bool PerfReader::HasEventTimes() const {
   // Events can not be sorted by time if PERF_SAMPLE_TIME is not set in
   // attr.sample_type for all attrs.
   for (const auto& attr : attrs()) {
     if (!(attr.attr().sample_type() & PERF_SAMPLE_TIME)) {
-      return;
+      return false;
     }
   }
+  return true;
+}
+
+void PerfReader::MaybeSortEventsByTime(bool keep_unordered_samples) {
+  if (!HasEventTimes()) return;
+
+  if (keep_unordered_samples && SortingOnlyReordersSamples(proto_->events())) {
+    return;
+  }
 
-  // Sort the events based on timestamp.
+  // Sort the events based on timestamp. Events of different CPUs are only out
+  // of order within a bounded window, so prefer merging them round by round
+  // over a full sort.
+  mmap_events_valid_ = false;
+  if (OrderEventsByRounds(proto_->mutable_events())) return;
 
   // This sorts the pointers in the proto-internal vector, which
   // requires no copying and less external space.
@@ -798,6 +1383,13 @@ void PerfReader::MaybeSortEventsByTime() {
                    proto_->mutable_events()->pointer_end(), CompareEventTimes);
 }
 
+void PerfReader::MaybeSortStateEventsByTime() {
+  if (!HasEventTimes()) return;
+  if (OrderStateEventsByTime(proto_->mutable_events())) {
+    mmap_events_valid_ = false;
+  }
+}
+
 bool PerfReader::ReadHeader(DataReader* data) {
   CheckNoEventHeaderPadding();
   // The header is the first thing to be read. Don't use SeekSet(0) because it
@@ -1065,8 +1657,43 @@ bool PerfReader::ReadEventType(DataReader* data, int attr_idx,
 }
 
 bool PerfReader::ReadDataSection(DataReader* data) {
+  decompressor_.reset();
+  decompressed_.clear();
+  if (filter_state_.has_time_range) return ReadDataSectionTimeRange(data);
+
+  // If the section is in memory, count the events to store them without
+  // growing |proto_| repeatedly, and split the section to decode it on several
+  // threads if requested. The sample callback and the sample columns must see
+  // the events in order.
+  const char* section =
+      event_callback_ ? nullptr
+                      : static_cast<const char*>(data->GetContiguousData(
+                            header_.data.offset, header_.data.size));
+  const size_t max_chunks =
+      sample_event_callback_ || sample_columns_ || !filter_state_.empty()
+          ? 1
+          : num_decode_threads_;
+  std::vector<size_t> chunk_offsets;
+  size_t num_events = 0;
+  bool compressed = false;
+  if (section != nullptr &&
+      ScanDataSection(section, header_.data.size, data->is_cross_endian(),
+                      max_chunks, event_types_to_skip_when_serializing_,
+                      &chunk_offsets, &num_events, &compressed)) {
+    if (compressed) {
+      if (max_chunks > 1) return ReadCompressedDataSection(data, section);
+    } else if (sample_columns_ == nullptr) {
+      // Most of the events are samples, which wouldn't go into |proto_|.
+      proto_->mutable_events()->Reserve(proto_->events_size() + num_events);
+    }
+    if (!compressed && chunk_offsets.size() > 1) {
+      return ReadDataSectionChunks(data, section, chunk_offsets);
+    }
+  }
+
   u64 data_remaining_bytes = header_.data.size;
   if (!data->SeekSet(header_.data.offset)) return false;
+  data->AdviseSequential(header_.data.offset, header_.data.size);
   while (data_remaining_bytes != 0) {
     // Read the header to determine the size of the event.
     perf_event_header header;
@@ -1083,17 +1710,499 @@ bool PerfReader::ReadDataSection(DataReader* data) {
 
     data_remaining_bytes -= sizeof(header) + read_size;
   }
+  if (!decompressed_.empty()) {
+    LOG(ERROR) << "The data section ends with an incomplete compressed event "
+               << "of " << decompressed_.size() << " bytes.";
+    return false;
+  }
 
   DLOG(INFO) << "Number of events stored: " << proto_->events_size();
   return true;
 }
 
+bool PerfReader::ReadDataSectionTimeRange(DataReader* data) {
+  if (time_index_.empty() && !BuildTimeIndex(data)) return false;
+  for (size_t i = 0; i < time_index_.size(); ++i) {
+    if (time_index_[i].offset >= header_.data.size ||
+        (i > 0 && time_index_[i].offset <= time_index_[i - 1].offset)) {
+      LOG(ERROR) << "Time index doesn't match the data section";
+      return false;
+    }
+  }
+
+  // Events in the range are in the rounds from the first one ending after
+  // |start_time| to the last one starting before |end_time|. The rounds may
+  // overlap, but those before and after these can't hold any.
+  const u64 start_time = filter_state_.start_time;
+  const u64 end_time = filter_state_.end_time;
+  size_t first = 0;
+  while (first < time_index_.size() &&
+         (time_index_[first].max_time < start_time ||
+          time_index_[first].max_time == 0)) {
+    ++first;
+  }
+  size_t last = time_index_.size();
+  while (last > first && (time_index_[last - 1].min_time > end_time ||
+                          time_index_[last - 1].max_time == 0)) {
+    --last;
+  }
+  const u64 range_offset = first < time_index_.size()
+                               ? time_index_[first].offset
+                               : header_.data.size;
+  const u64 range_end_offset = last < time_index_.size()
+                                   ? time_index_[last].offset
+                                   : header_.data.size;
+
+  if (!data->SeekSet(header_.data.offset)) return false;
+  u64 offset = 0;
+  while (offset < range_end_offset) {
+    perf_event_header header;
+    if (!ReadPerfEventHeader(data, &header)) {
+      LOG(ERROR) << "Error reading event header from data section.";
+      return false;
+    }
+
+    size_t read_size = 0;
+    if (offset < range_offset && header.type == PERF_RECORD_SAMPLE) {
+      // The samples before the range are skipped without being decoded.
+      read_size = header.size - sizeof(header);
+      if (!data->SeekSet(data->Tell() + read_size)) return false;
+    } else if (!ReadNonHeaderEventDataWithoutHeader(data, header,
+                                                    &read_size)) {
+      LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+      return false;
+    }
+    offset += sizeof(header) + read_size;
+  }
+  // The rest of the compressed events are after the range.
+  decompressed_.clear();
+
+  DLOG(INFO) << "Number of events stored: " << proto_->events_size();
+  return data->SeekSet(header_.data.offset + header_.data.size);
+}
+
+bool PerfReader::BuildTimeIndex(DataReader* data) {
+  time_index_.clear();
+  if (!data->SeekSet(header_.data.offset)) return false;
+  TimeIndexEntry round = {0, 0, 0};
+  // Holds each event, aligned as an event_t.
+  std::vector<u64> buffer;
+  u64 offset = 0;
+  while (offset < header_.data.size) {
+    perf_event_header header;
+    if (!ReadPerfEventHeader(data, &header)) {
+      LOG(ERROR) << "Error reading event header from data section.";
+      return false;
+    }
+    buffer.resize((header.size + sizeof(u64) - 1) / sizeof(u64));
+    event_t* event = reinterpret_cast<event_t*>(buffer.data());
+    event->header = header;
+    if (!data->ReadDataValue(header.size - sizeof(header), "rest of event",
+                             &event->header + 1)) {
+      return false;
+    }
+    offset += header.size;
+    if (header.type == PERF_RECORD_AUXTRACE) {
+      // Skip the trace data that follows the event.
+      if (header.size < sizeof(header) + sizeof(event->auxtrace.size)) {
+        LOG(ERROR) << "Truncated auxtrace event";
+        return false;
+      }
+      u64 trace_size = event->auxtrace.size;
+      if (data->is_cross_endian()) ByteSwap(&trace_size);
+      if (!data->SeekSet(data->Tell() + trace_size)) return false;
+      offset += trace_size;
+    }
+
+    if (header.type == PERF_RECORD_FINISHED_ROUND) {
+      time_index_.push_back(round);
+      round = {offset, 0, 0};
+      continue;
+    }
+    if (IsCompressedEventType(header.type)) {
+      // The times of the compressed events aren't known without decompressing
+      // them, so the round has to be read whatever the range.
+      round.min_time = 1;
+      round.max_time = std::numeric_limits<u64>::max();
+      continue;
+    }
+    u64 time;
+    if (!serializer_.ReadEventTime(*event, &time) || time == 0) continue;
+    if (round.max_time == 0 || time < round.min_time) round.min_time = time;
+    round.max_time = std::max(round.max_time, time);
+  }
+  if (round.offset < header_.data.size) time_index_.push_back(round);
+  return true;
+}
+
+bool PerfReader::ReadDataSectionChunks(
+    DataReader* data, const char* section,
+    const std::vector<size_t>& chunk_offsets) {
+  // Each chunk is decoded into its own proto, allocated on |arena_| so that
+  // the events can later be moved to |proto_| without being copied.
+  struct Chunk {
+    const char* start;
+    size_t size;
+    PerfDataProto* events;
+    std::unordered_set<std::string> filenames_with_build_id;
+    WarningCounts warnings;
+    bool ok;
+  };
+  std::vector<Chunk> chunks(chunk_offsets.size());
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const size_t end = i + 1 < chunks.size() ? chunk_offsets[i + 1]
+                                             : header_.data.size;
+    chunks[i].start = section + chunk_offsets[i];
+    chunks[i].size = end - chunk_offsets[i];
+    chunks[i].events = Arena::Create<PerfDataProto>(&arena_);
+  }
+  const bool cross_endian = data->is_cross_endian();
+  auto read_chunk = [this, cross_endian](Chunk* chunk) {
+    chunk->ok = ReadDataSectionChunk(
+        chunk->start, chunk->size, cross_endian, chunk->events,
+        &chunk->filenames_with_build_id, &chunk->warnings);
+  };
+
+  // The first chunk is read on this thread.
+  std::vector<std::unique_ptr<FunctionThread>> threads;
+  for (size_t i = 1; i < chunks.size(); ++i) {
+    Chunk* chunk = &chunks[i];
+    threads.emplace_back(
+        new FunctionThread([&read_chunk, chunk] { read_chunk(chunk); }));
+    threads.back()->Start();
+  }
+  read_chunk(&chunks[0]);
+  for (auto& thread : threads) thread->Join();
+
+  for (const Chunk& chunk : chunks) {
+    if (!chunk.ok) {
+      LOG(ERROR) << "Couldn't read the data section chunk at offset "
+                 << header_.data.offset + (chunk.start - section);
+      return false;
+    }
+  }
+
+  for (Chunk& chunk : chunks) AddDataSectionChunk(chunk.events, chunk.warnings);
+
+  DLOG(INFO) << "Number of events stored: " << proto_->events_size();
+  return data->SeekSet(header_.data.offset + header_.data.size);
+}
+
+void PerfReader::AddDataSectionChunk(PerfDataProto* events,
+                                     const WarningCounts& warnings) {
+  warnings_.Merge(warnings);
+  // Keep only the first build ID found in an MMAP2 event for each filename, as
+  // when reading sequentially.
+  for (const auto& build_id : events->build_ids()) {
+    if (filenames_with_build_id_.insert(build_id.filename()).second) {
+      *proto_->add_build_ids() = build_id;
+    }
+  }
+  std::vector<PerfEvent*> extracted(events->events_size());
+  events->mutable_events()->UnsafeArenaExtractSubrange(0, extracted.size(),
+                                                       extracted.data());
+  for (PerfEvent* event : extracted) {
+    proto_->mutable_events()->UnsafeArenaAddAllocated(event);
+    AddToMmapEvents(event);
+  }
+}
+
+bool PerfReader::ReadCompressedDataSection(DataReader* data,
+                                           const char* section) {
+  // A block of decompressed events, decoded like a chunk of
+  // ReadDataSectionChunks().
+  struct Block {
+    std::vector<char> data;
+    PerfDataProto* events;
+    std::unordered_set<std::string> filenames_with_build_id;
+    WarningCounts warnings;
+    bool ok;
+    std::unique_ptr<FunctionThread> thread;
+  };
+  const bool cross_endian = data->is_cross_endian();
+  std::deque<std::unique_ptr<Block>> blocks;
+  bool ok = true;
+  // Waits for the oldest block to be decoded, and adds its events.
+  auto finish_block = [this, &blocks, &ok] {
+    std::unique_ptr<Block> block = std::move(blocks.front());
+    blocks.pop_front();
+    block->thread->Join();
+    if (!block->ok) {
+      LOG(ERROR) << "Couldn't read a block of decompressed events";
+      ok = false;
+    }
+    if (ok) AddDataSectionChunk(block->events, block->warnings);
+  };
+  // The events decompressed but not decoded yet, of which the first |size|
+  // bytes are decoded on a new thread by start_block().
+  std::vector<char> pending;
+  auto start_block = [this, &blocks, &pending, &finish_block,
+                      cross_endian](size_t size) {
+    // This thread keeps decompressing.
+    if (blocks.size() + 1 >= num_decode_threads_) finish_block();
+    std::unique_ptr<Block> block(new Block);
+    block->data.assign(pending.begin() + size, pending.end());
+    block->data.swap(pending);
+    block->data.resize(size);
+    block->events = Arena::Create<PerfDataProto>(&arena_);
+    Block* b = block.get();
+    block->thread.reset(new FunctionThread([this, b, cross_endian] {
+      b->ok = ReadDataSectionChunk(b->data.data(), b->data.size(),
+                                   cross_endian, b->events,
+                                   &b->filenames_with_build_id, &b->warnings);
+    }));
+    block->thread->Start();
+    blocks.push_back(std::move(block));
+  };
+
+  // The other events, e.g. those synthesized by perf, are decoded in order
+  // with the decompressed ones.
+  const size_t size = header_.data.size;
+  size_t offset = 0;
+  while (ok && offset < size) {
+    perf_event_header header;
+    memcpy(&header, section + offset, sizeof(header));
+    if (cross_endian) {
+      ByteSwap(&header.type);
+      ByteSwap(&header.size);
+    }
+    const size_t record_size = PipedRecordSize(section + offset, size - offset);
+    if (record_size > size - offset) {
+      LOG(ERROR) << "Event " << GetEventName(header.type)
+                 << " overruns the data section";
+      ok = false;
+      break;
+    }
+    if (IsCompressedEventType(header.type)) {
+      ok = DecompressEvent(header, section + offset + sizeof(header), &pending);
+    } else {
+      pending.insert(pending.end(), section + offset,
+                     section + offset + record_size);
+    }
+    offset += record_size;
+    if (ok && pending.size() >= kDecompressedBlockSize) {
+      const size_t block_size =
+          CompleteEventsSize(pending.data(), pending.size());
+      if (block_size > 0) start_block(block_size);
+    }
+  }
+  if (ok && !pending.empty()) {
+    if (CompleteEventsSize(pending.data(), pending.size()) != pending.size()) {
+      LOG(ERROR) << "The data section ends with an incomplete compressed "
+                 << "event.";
+      ok = false;
+    } else {
+      start_block(pending.size());
+    }
+  }
+  while (!blocks.empty()) finish_block();
+  if (!ok) return false;
+
+  DLOG(INFO) << "Number of events stored: " << proto_->events_size();
+  return data->SeekSet(header_.data.offset + header_.data.size);
+}
+
+bool PerfReader::DecompressEvent(const perf_event_header& header,
+                                 const char* payload, std::vector<char>* out) {
+  if (decompressor_ == nullptr) decompressor_.reset(new ZstdDecompressor);
+  size_t size = header.size - sizeof(header);
+  if (header.type == PERF_RECORD_COMPRESSED2) {
+    // The data is followed by padding.
+    u64 data_size;
+    if (size < sizeof(data_size)) {
+      LOG(ERROR) << "Truncated PERF_RECORD_COMPRESSED2 event";
+      return false;
+    }
+    memcpy(&data_size, payload, sizeof(data_size));
+    if (is_cross_endian_) ByteSwap(&data_size);
+    payload += sizeof(data_size);
+    size -= sizeof(data_size);
+    if (data_size > size) {
+      LOG(ERROR) << "Size " << data_size << " of the compressed data should be"
+                 << " at most the remaining size " << size
+                 << " of the PERF_RECORD_COMPRESSED2 event";
+      return false;
+    }
+    size = data_size;
+  }
+  return decompressor_->Decompress(payload, size, out);
+}
+
+bool PerfReader::ReadCompressedEvent(DataReader* data,
+                                     const perf_event_header& header,
+                                     size_t* read_size) {
+  *read_size = header.size - sizeof(header);
+  const char* payload = static_cast<const char*>(
+      data->GetContiguousData(data->Tell(), *read_size));
+  std::vector<char> buffer;
+  if (payload != nullptr) {
+    if (!data->SeekSet(data->Tell() + *read_size)) return false;
+  } else {
+    buffer.resize(*read_size);
+    if (!data->ReadDataValue(*read_size, "compressed data", buffer.data())) {
+      return false;
+    }
+    payload = buffer.data();
+  }
+  if (!DecompressEvent(header, payload, &decompressed_)) return false;
+
+  const size_t size =
+      CompleteEventsSize(decompressed_.data(), decompressed_.size());
+  BufferReader events(decompressed_.data(), size);
+  events.set_is_cross_endian(is_cross_endian_);
+  while (events.Tell() < size) {
+    perf_event_header event_header;
+    if (!ReadPerfEventHeader(&events, &event_header)) {
+      LOG(ERROR) << "Error reading decompressed event header.";
+      return false;
+    }
+    size_t event_read_size = 0;
+    if (!ReadEventToProto(&events, event_header, &event_read_size)) {
+      LOG(ERROR) << "Couldn't read decompressed event "
+                 << GetEventName(event_header.type);
+      return false;
+    }
+  }
+  decompressed_.erase(decompressed_.begin(), decompressed_.begin() + size);
+  return true;
+}
+
+size_t PerfReader::CompleteEventsSize(const char* data, size_t size) const {
+  size_t offset = 0;
+  while (true) {
+    const size_t event_size = PipedRecordSize(data + offset, size - offset);
+    if (event_size == 0 || event_size > size - offset) return offset;
+    offset += event_size;
+  }
+}
+
+bool PerfReader::ReadDataSectionChunk(
+    const char* chunk, size_t size, bool cross_endian, PerfDataProto* out,
+    std::unordered_set<std::string>* filenames_with_build_id,
+    WarningCounts* warnings) const {
+  BufferReader data(chunk, size);
+  data.set_is_cross_endian(cross_endian);
+  while (data.Tell() < size) {
+    perf_event_header header;
+    if (!ReadPerfEventHeader(&data, &header)) {
+      LOG(ERROR) << "Error reading event header from data section.";
+      return false;
+    }
+
+    size_t read_size = 0;
+    if (!ReadNonHeaderEventDataWithoutHeader(
+            &data, header, &read_size, out, filenames_with_build_id,
+            /*filter_state=*/nullptr, warnings)) {
+      LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PerfReader::KeepEvent(const event_t& event, FilterState* state) const {
+  if (state->has_time_range && event.header.type == PERF_RECORD_SAMPLE) {
+    u64 time;
+    if (!serializer_.ReadEventTime(event, &time) ||
+        time < state->start_time || time > state->end_time) {
+      ++state->num_filtered_events;
+      return false;
+    }
+  }
+  if (state->filter.empty()) return true;
+
+  ProcessFilter* filter = &state->filter;
+  // With cgroups, the processes of the selected samples are only known from
+  // the samples, so the other events of all the processes are kept.
+  const bool keep_all_processes = !filter->cgroups.empty();
+  u32 pid;
+  switch (event.header.type) {
+    case PERF_RECORD_SAMPLE: {
+      u64 cgroup = 0;
+      if (!serializer_.ReadSamplePid(event, &pid,
+                                     keep_all_processes ? &cgroup : nullptr)) {
+        return true;
+      }
+      if (filter->pids.count(pid) || filter->cgroup_ids.count(cgroup)) {
+        return true;
+      }
+      ++state->num_filtered_events;
+      return false;
+    }
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2: {
+      // The kernel's mmaps are shared by all the processes.
+      const u16 cpumode = event.header.misc & PERF_RECORD_MISC_CPUMODE_MASK;
+      if (cpumode == PERF_RECORD_MISC_KERNEL ||
+          cpumode == PERF_RECORD_MISC_GUEST_KERNEL) {
+        return true;
+      }
+      pid = event.header.type == PERF_RECORD_MMAP ? event.mmap.pid
+                                                  : event.mmap2.pid;
+      break;
+    }
+    case PERF_RECORD_COMM:
+      pid = event.comm.pid;
+      // Threads can be named differently from their process.
+      if (pid == event.comm.tid && filter->comms.count(event.comm.comm)) {
+        filter->pids.insert(pid);
+      }
+      break;
+    case PERF_RECORD_FORK:
+      pid = event.fork.pid;
+      if (filter->pids.count(event.fork.ppid)) filter->pids.insert(pid);
+      break;
+    case PERF_RECORD_EXIT:
+      pid = event.fork.pid;
+      break;
+    case PERF_RECORD_CGROUP:
+      if (filter->cgroups.count(event.cgroup.path)) {
+        filter->cgroup_ids.insert(event.cgroup.id);
+      }
+      return true;
+    default:
+      return true;
+  }
+  if (keep_all_processes || filter->pids.count(pid)) return true;
+  ++state->num_filtered_events;
+  return false;
+}
+
 bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     DataReader* data, const perf_event_header& header, size_t* read_size) {
+  if (IsCompressedEventType(header.type)) {
+    return ReadCompressedEvent(data, header, read_size);
+  }
+  return ReadEventToProto(data, header, read_size);
+}
+
+bool PerfReader::ReadEventToProto(DataReader* data,
+                                  const perf_event_header& header,
+                                  size_t* read_size) {
+  const int num_events = proto_->events_size();
+  if (!ReadNonHeaderEventDataWithoutHeader(
+          data, header, read_size, proto_, &filenames_with_build_id_,
+          filter_state_.empty() ? nullptr : &filter_state_, &warnings_)) {
+    return false;
+  }
+  if (proto_->events_size() > num_events) {
+    AddToMmapEvents(proto_->mutable_events()->Mutable(num_events));
+  }
+  return true;
+}
+
+bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
+    DataReader* data, const perf_event_header& header, size_t* read_size,
+    PerfDataProto* out,
+    std::unordered_set<std::string>* filenames_with_build_id,
+    FilterState* filter_state, WarningCounts* warnings) const {
   size_t skip_or_read_size = header.size - sizeof(header);
   if (!PerfSerializer::IsSupportedKernelEventType(header.type) &&
       !PerfSerializer::IsSupportedUserEventType(header.type)) {
-    LOG(WARNING) << "Skipping unsupported event " << GetEventName(header.type);
+    if (warnings->Add("Skipped unsupported events", header.type)) {
+      LOG(WARNING) << "Skipping unsupported event "
+                   << GetEventName(header.type);
+    }
     if (!data->SeekSet(data->Tell() + skip_or_read_size)) return false;
     *read_size = skip_or_read_size;
     return true;
@@ -1118,33 +2227,49 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     return false;
   }
   if (IsProcMapTimeoutMmap(header)) {
-    LOG(WARNING) << "Skipping truncated mmap from event "
-                 << GetEventName(header.type);
+    if (warnings->Add("Skipped truncated mmaps", header.type)) {
+      LOG(WARNING) << "Skipping truncated mmap from event "
+                   << GetEventName(header.type);
+    }
     if (!data->SeekSet(data->Tell() + skip_or_read_size)) return false;
     *read_size = skip_or_read_size;
     return true;
   }
 
-  // Allocate space for an event struct based on the size in the header.
-  // Don't blindly allocate the entire event_t because it is a
-  // variable-sized type that may include data beyond what's nominally
-  // declared in its definition.
-  malloced_unique_ptr<event_t> event(CallocMemoryForEvent(header.size));
-  event->header = header;
+  // If the reader holds the whole input in memory and no byte swapping is
+  // needed, decode the event in place. Otherwise, allocate space for an event
+  // struct based on the size in the header. Don't blindly allocate the entire
+  // event_t because it is a variable-sized type that may include data beyond
+  // what's nominally declared in its definition.
+  malloced_unique_ptr<event_t> event_copy;
+  const event_t* event = nullptr;
+  const void* event_data =
+      data->is_cross_endian()
+          ? nullptr
+          : data->GetContiguousData(data->Tell() - sizeof(header),
+                                    header.size);
+  if (event_data != nullptr &&
+      reinterpret_cast<uintptr_t>(event_data) % alignof(event_t) == 0) {
+    event = static_cast<const event_t*>(event_data);
+    if (!data->SeekSet(data->Tell() + skip_or_read_size)) return false;
+  } else {
+    event_copy.reset(CallocMemoryForEvent(header.size));
+    event_copy->header = header;
 
-  // Read the rest of the event data.
-  if (!data->ReadDataValue(skip_or_read_size, "rest of event",
-                           &event->header + 1)) {
-    return false;
+    // Read the rest of the event data.
+    if (!data->ReadDataValue(skip_or_read_size, "rest of event",
+                             &event_copy->header + 1)) {
+      return false;
+    }
+    if (data->is_cross_endian() &&
+        !ByteSwapEventDataFixedPayloadFields(event_copy.get())) {
+      return false;
+    }
+    event = event_copy.get();
   }
 
   *read_size = skip_or_read_size;
 
-  if (data->is_cross_endian() &&
-      !ByteSwapEventDataFixedPayloadFields(event.get())) {
-    return false;
-  }
-
   size_t variable_payload_size = 0;
   if (!GetEventDataVariablePayloadSize(*event,
                                        event->header.size - fixed_payload_size,
@@ -1156,7 +2281,7 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     return false;
   }
   if (data->is_cross_endian() &&
-      !ByteSwapEventDataVariablePayloadFields(event.get())) {
+      !ByteSwapEventDataVariablePayloadFields(event_copy.get())) {
     return false;
   }
 
@@ -1169,6 +2294,8 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     return false;
   }
 
+  if (filter_state != nullptr && !KeepEvent(*event, filter_state)) return true;
+
   if (event->header.type == PERF_RECORD_MMAP ||
       event->header.type == PERF_RECORD_MMAP2) {
     if (proto_->file_attrs_size() > 0 && proto_->file_attrs(0).has_attr() &&
@@ -1183,8 +2310,12 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
       // MMAPs, however, are still valid, and thus the perf.data can still be
       // used to profile userspace code. Thus, we'll ignore zero-length kernel
       // MMAPs.
-      LOG(WARNING) << "Skipping zero length kernel mmap event from a perf.data "
-                   << "collected in userspace";
+      if (warnings->Add("Skipped zero length kernel mmaps of a perf.data "
+                        "collected in userspace",
+                        event->header.type)) {
+        LOG(WARNING) << "Skipping zero length kernel mmap event from a "
+                     << "perf.data collected in userspace";
+      }
       return true;
     }
 
@@ -1192,8 +2323,8 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
         event->header.misc & PERF_RECORD_MISC_MMAP_BUILD_ID) {
       std::string filename(event->mmap2.filename);
 
-      if (filenames_with_build_id_.find(filename) ==
-          filenames_with_build_id_.end()) {
+      if (filenames_with_build_id->find(filename) ==
+          filenames_with_build_id->end()) {
         // Serialize a build-id event for a new filename
         if (event->mmap2.build_id_size > kMaxBuildIdSize) {
           LOG(ERROR) << "Build-id size is too big: "
@@ -1205,12 +2336,12 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
         malloced_unique_ptr<build_id_event> build_id_event = CreateBuildIDEvent(
             build_id_str, event->mmap2.filename, event->header.misc);
         if (!serializer_.SerializeBuildIDEvent(build_id_event,
-                                               proto_->add_build_ids())) {
+                                               out->add_build_ids())) {
           LOG(ERROR) << "Could not serialize build ID event in MMAP2 for "
                      << filename << " with ID " << event->mmap2.build_id;
           return false;
         }
-        filenames_with_build_id_.insert(std::move(filename));
+        filenames_with_build_id->insert(std::move(filename));
       }
     }
   }
@@ -1221,18 +2352,26 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
       // Serialize the event outside the long-lived arena to reduce memory
       // overheads.
       PerfEvent proto_event;
-      if (!serializer_.SerializeEvent(event, &proto_event)) return false;
+      if (!serializer_.SerializeEvent(*event, &proto_event)) return false;
       sample_event_callback_(proto_event.sample_event());
     }
     return true;
   }
 
-  // Serialize the event to protobuf form.
-  PerfEvent* proto_event = proto_->add_events();
-  if (!serializer_.SerializeEvent(event, proto_event)) return false;
+  // Serialize the event to protobuf form. A streamed event lives only for the
+  // duration of the callback, outside of the long-lived arena, and so does a
+  // sample until it is stored in |sample_columns_|.
+  const bool to_sample_columns = sample_columns_ != nullptr &&
+                                 !event_callback_ &&
+                                 event->header.type == PERF_RECORD_SAMPLE;
+  PerfEvent streamed_event;
+  PerfEvent* proto_event = event_callback_ || to_sample_columns
+                               ? &streamed_event
+                               : out->add_events();
+  if (!serializer_.SerializeEvent(*event, proto_event)) return false;
 
   if (proto_event->header().type() == PERF_RECORD_AUXTRACE) {
-    if (!ReadAuxtraceTraceData(data, proto_event)) return false;
+    if (!ReadAuxtraceTraceData(data, proto_event, warnings)) return false;
     *read_size += proto_event->auxtrace_event().size();
   }
 
@@ -1240,6 +2379,20 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     sample_event_callback_(proto_event->sample_event());
   }
 
+  if (event_callback_ && !event_callback_(*proto_event)) {
+    LOG(ERROR) << "Event callback failed for event "
+               << GetEventName(event->header.type);
+    return false;
+  }
+
+  if (to_sample_columns) {
+    if (SampleColumns::CanStore(streamed_event)) {
+      sample_columns_->Append(streamed_event, out->events_size());
+    } else {
+      *out->add_events() = streamed_event;
+    }
+  }
+
   return true;
 }
 
@@ -1262,6 +2415,12 @@ bool PerfReader::ReadMetadata(DataReader* data) {
   auto section_iter = sections.begin();
   for (u32 type = HEADER_FIRST_FEATURE; type != HEADER_LAST_FEATURE; ++type) {
     if (!get_metadata_mask_bit(type)) continue;
+    if (data == lazy_input_.get() && (kLazyMetadataMask & (1ULL << type))) {
+      lazy_metadata_sections_.push_back(
+          {type, section_iter->offset, section_iter->size});
+      ++section_iter;
+      continue;
+    }
     if (!data->SeekSet(section_iter->offset)) return false;
     u64 size = section_iter->size;
     if (!ReadMetadataWithoutHeader(data, type, size)) return false;
@@ -1271,6 +2430,21 @@ bool PerfReader::ReadMetadata(DataReader* data) {
   return true;
 }
 
+bool PerfReader::ReadLazyMetadata() {
+  const std::unique_ptr<DataReader> data = std::move(lazy_input_);
+  std::vector<LazyMetadataSection> sections;
+  sections.swap(lazy_metadata_sections_);
+  for (const LazyMetadataSection& section : sections) {
+    if (!data->SeekSet(section.offset) ||
+        !ReadMetadataWithoutHeader(data.get(), section.type, section.size)) {
+      LOG(ERROR) << "Error reading lazy metadata "
+                 << GetMetadataName(section.type);
+      return false;
+    }
+  }
+  return true;
+}
+
 bool PerfReader::ReadMetadataWithoutHeader(DataReader* data, u32 type,
                                            size_t size) {
   size_t remaining_size = data->size() - data->Tell();
@@ -1818,61 +2992,217 @@ bool PerfReader::ReadFileData(DataReader* data) {
 bool PerfReader::ReadPipedData(DataReader* data) {
   // The piped data comes right after the file header.
   CHECK_EQ(piped_header_.size, data->Tell());
-  bool result = true;
+  if (event_callback_) {
+    // Piped data interleaves metadata, e.g. build IDs, with the events, so it
+    // can't be guaranteed to be available before the events are delivered.
+    LOG(ERROR) << "Streaming events is not supported for piped data.";
+    return false;
+  }
   int num_event_types = 0;
 
   CheckNoEventHeaderPadding();
 
-  while (result && data->Tell() < data->size()) {
-    perf_event_header header;
-    if (!ReadPerfEventHeader(data, &header)) {
-      LOG(ERROR) << "Error reading event header.";
-      return false;
-    }
-
-    // Compute the size of the post-header part of the event data.
-    size_t size_without_header = header.size - sizeof(header);
-
-    if (PerfSerializer::IsSupportedHeaderEventType(header.type)) {
-      result = [&] {
-        switch (header.type) {
-          case PERF_RECORD_HEADER_ATTR:
-            return ReadAttrEventBlock(data, size_without_header);
-          case PERF_RECORD_HEADER_EVENT_TYPE:
-            return ReadEventType(data, num_event_types++, header.size);
-          case PERF_RECORD_HEADER_TRACING_DATA:
-            set_metadata_mask_bit(HEADER_TRACING_DATA);
-            {
-              // TRACING_DATA's header.size is a lie. It is the size of only the
-              // event struct. The size of the data is in the event struct, and
-              // followed immediately by the tracing header data.
-              decltype(tracing_data_event::size) size = 0;
-              if (!data->ReadUint32(&size)) {
-                LOG(ERROR) << "Error reading tracing data size.";
-                return false;
-              }
-              return ReadTracingMetadata(data, size);
-            }
-          case PERF_RECORD_HEADER_BUILD_ID:
-            set_metadata_mask_bit(HEADER_BUILD_ID);
-            return ReadBuildIDMetadataWithoutHeader(data, header);
-          case PERF_RECORD_HEADER_FEATURE:
-            return ReadHeaderFeature(data, header);
-        }
+  decompressor_.reset();
+  decompressed_.clear();
+  while (data->Tell() < data->size()) {
+    if (!ReadPipedEvent(data, &num_event_types)) return false;
+  }
+  if (!decompressed_.empty()) {
+    LOG(ERROR) << "Piped perf data ends with an incomplete compressed event "
+               << "of " << decompressed_.size() << " bytes.";
+    return false;
+  }
+  FinishPipedData(num_event_types);
+  return true;
+}
+
+bool PerfReader::Feed(const char* data, size_t size) {
+  MoveProtoToArena();
+  if (event_callback_) {
+    LOG(ERROR) << "Streaming events is not supported for piped data.";
+    return false;
+  }
+  // Parses the header, unless it was already read, and the complete records
+  // at the front of |begin|, and sets |*parsed| to the bytes they take.
+  auto parse = [this](const char* begin, size_t available, size_t* parsed) {
+    size_t offset = 0;
+    *parsed = 0;
+    if (!feed_header_read_) {
+      if (available < sizeof(piped_header_)) return true;
+      BufferReader reader(begin, sizeof(piped_header_));
+      if (!ReadHeader(&reader) ||
+          piped_header_.size != sizeof(piped_header_)) {
+        LOG(ERROR) << "Only piped perf data can be fed.";
         return false;
-      }();
-      continue;
+      }
+      CheckNoEventHeaderPadding();
+      feed_header_read_ = true;
+      decompressor_.reset();
+      decompressed_.clear();
+      offset = sizeof(piped_header_);
     }
-
-    size_t read_size = 0;
-    if (!ReadNonHeaderEventDataWithoutHeader(data, header, &read_size)) {
-      LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+    for (;;) {
+      size_t record_size = PipedRecordSize(begin + offset, available - offset);
+      if (record_size == 0 || record_size > available - offset) break;
+      BufferReader reader(begin + offset, record_size);
+      reader.set_is_cross_endian(is_cross_endian_);
+      if (!ReadPipedEvent(&reader, &feed_num_event_types_)) return false;
+      offset += record_size;
+    }
+    *parsed = offset;
+    return true;
+  };
+
+  // The header or record that was cut off at the end of the bytes fed earlier
+  // is completed with only as many bytes of |data| as it lacks, and the rest
+  // of |data| is parsed in place.
+  size_t offset = 0;
+  while (!feed_buffer_.empty()) {
+    size_t needed = sizeof(piped_header_);
+    bool size_known = true;
+    if (feed_header_read_) {
+      needed = PipedRecordSize(feed_buffer_.data(), feed_buffer_.size());
+      if (needed == 0) {
+        // Take the bytes of its header, then one at a time those of the size
+        // of its data, so none of the next record is taken.
+        size_known = false;
+        if (feed_buffer_.size() < sizeof(perf_event_header)) {
+          needed = sizeof(perf_event_header);
+        } else if (feed_buffer_.size() < sizeof(perf_event_header) + 8) {
+          needed = feed_buffer_.size() + 1;
+        } else {
+          // The record has no size, so it can't be completed.
+          feed_buffer_.insert(feed_buffer_.end(), data + offset, data + size);
+          return true;
+        }
+      }
+    }
+    needed = std::max(needed, feed_buffer_.size());
+    const size_t taken = std::min(needed - feed_buffer_.size(), size - offset);
+    feed_buffer_.insert(feed_buffer_.end(), data + offset,
+                        data + offset + taken);
+    offset += taken;
+    if (feed_buffer_.size() < needed) return true;
+    if (!size_known) continue;
+    size_t parsed;
+    if (!parse(feed_buffer_.data(), feed_buffer_.size(), &parsed)) {
       return false;
     }
+    if (parsed < feed_buffer_.size()) {
+      // The record claims to be shorter than its header.
+      feed_buffer_.insert(feed_buffer_.end(), data + offset, data + size);
+      return true;
+    }
+    feed_buffer_.clear();
+  }
+
+  size_t parsed;
+  if (!parse(data + offset, size - offset, &parsed)) return false;
+  // Keep the incomplete record for the next call.
+  feed_buffer_.assign(data + offset + parsed, data + size);
+  return true;
+}
+
+bool PerfReader::Finish() {
+  if (!feed_header_read_) {
+    LOG(ERROR) << "No piped perf data header was fed.";
+    return false;
+  }
+  if (!feed_buffer_.empty()) {
+    LOG(ERROR) << "Piped perf data ends with an incomplete record of "
+               << feed_buffer_.size() << " bytes.";
+    return false;
+  }
+  if (!decompressed_.empty()) {
+    LOG(ERROR) << "Piped perf data ends with an incomplete compressed event "
+               << "of " << decompressed_.size() << " bytes.";
+    return false;
+  }
+  FinishPipedData(feed_num_event_types_);
+  warnings_.Log();
+  return true;
+}
+
+size_t PerfReader::PipedRecordSize(const char* data, size_t size) const {
+  perf_event_header header;
+  if (size < sizeof(header)) return 0;
+  memcpy(&header, data, sizeof(header));
+  if (is_cross_endian_) {
+    ByteSwap(&header.type);
+    ByteSwap(&header.size);
+  }
+  // The data of these events follows them, see ReadPipedEvent() and
+  // ReadAuxtraceTraceData().
+  if (header.type == PERF_RECORD_HEADER_TRACING_DATA) {
+    decltype(tracing_data_event::size) data_size;
+    if (size < sizeof(header) + sizeof(data_size)) return 0;
+    memcpy(&data_size, data + sizeof(header), sizeof(data_size));
+    if (is_cross_endian_) ByteSwap(&data_size);
+    return sizeof(header) + sizeof(data_size) + data_size;
+  }
+  if (header.type == PERF_RECORD_AUXTRACE) {
+    decltype(auxtrace_event::size) data_size;
+    if (size < sizeof(header) + sizeof(data_size)) return 0;
+    memcpy(&data_size, data + sizeof(header), sizeof(data_size));
+    if (is_cross_endian_) ByteSwap(&data_size);
+    if (data_size > std::numeric_limits<size_t>::max() - header.size) {
+      return std::numeric_limits<size_t>::max();
+    }
+    return header.size + data_size;
+  }
+  // A size too small for the header is reported when the event is read.
+  return std::max<size_t>(header.size, sizeof(header));
+}
+
+bool PerfReader::ReadPipedEvent(DataReader* data, int* num_event_types) {
+  perf_event_header header;
+  if (!ReadPerfEventHeader(data, &header)) {
+    LOG(ERROR) << "Error reading event header.";
+    return false;
+  }
+
+  // Compute the size of the post-header part of the event data.
+  size_t size_without_header = header.size - sizeof(header);
+
+  if (PerfSerializer::IsSupportedHeaderEventType(header.type)) {
+    return [&] {
+      switch (header.type) {
+        case PERF_RECORD_HEADER_ATTR:
+          return ReadAttrEventBlock(data, size_without_header);
+        case PERF_RECORD_HEADER_EVENT_TYPE:
+          return ReadEventType(data, (*num_event_types)++, header.size);
+        case PERF_RECORD_HEADER_TRACING_DATA:
+          set_metadata_mask_bit(HEADER_TRACING_DATA);
+          {
+            // TRACING_DATA's header.size is a lie. It is the size of only the
+            // event struct. The size of the data is in the event struct, and
+            // followed immediately by the tracing header data.
+            decltype(tracing_data_event::size) size = 0;
+            if (!data->ReadUint32(&size)) {
+              LOG(ERROR) << "Error reading tracing data size.";
+              return false;
+            }
+            return ReadTracingMetadata(data, size);
+          }
+        case PERF_RECORD_HEADER_BUILD_ID:
+          set_metadata_mask_bit(HEADER_BUILD_ID);
+          return ReadBuildIDMetadataWithoutHeader(data, header);
+        case PERF_RECORD_HEADER_FEATURE:
+          return ReadHeaderFeature(data, header);
+      }
+      return false;
+    }();
   }
 
-  if (!result) return false;
+  size_t read_size = 0;
+  if (!ReadNonHeaderEventDataWithoutHeader(data, header, &read_size)) {
+    LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+    return false;
+  }
+  return true;
+}
 
+void PerfReader::FinishPipedData(int num_event_types) {
   // The PERF_RECORD_HEADER_EVENT_TYPE events are obsolete, but if present
   // and PERF_RECORD_HEADER_EVENT_DESC metadata events are not, we should use
   // them. Otherwise, we should use prefer the _EVENT_DESC data.
@@ -1881,12 +3211,11 @@ bool PerfReader::ReadPipedData(DataReader* data) {
     // We can construct HEADER_EVENT_DESC:
     set_metadata_mask_bit(HEADER_EVENT_DESC);
   }
-
-  return result;
 }
 
 bool PerfReader::ReadAuxtraceTraceData(DataReader* data,
-                                       PerfEvent* proto_event) {
+                                       PerfEvent* proto_event,
+                                       WarningCounts* warnings) const {
   size_t size = proto_event->auxtrace_event().size();
   size_t remaining_size = data->size() - data->Tell();
   if (size > remaining_size) {
@@ -1896,6 +3225,22 @@ bool PerfReader::ReadAuxtraceTraceData(DataReader* data,
         << " remaining size " << remaining_size << " of the perf.data input";
     return false;
   }
+  if (data->is_cross_endian() &&
+      warnings->Add("Couldn't byteswap the trace data of",
+                    PERF_RECORD_AUXTRACE)) {
+    LOG(ERROR) << "Cannot byteswap trace data from PERF_RECORD_AUXTRACE";
+  }
+  if (reference_auxtrace_data_ && size != 0) {
+    // The data of compressed events is in a buffer of their own.
+    const char* trace_data =
+        static_cast<const char*>(data->GetContiguousData(data->Tell(), size));
+    if (trace_data != nullptr && trace_data >= input_.data() &&
+        trace_data + size <= input_.data() + input_.size()) {
+      proto_event->mutable_auxtrace_event()->set_trace_data_offset(
+          trace_data - input_.data());
+      return data->SeekSet(data->Tell() + size);
+    }
+  }
   malloced_unique_ptr<char> trace_data(
       reinterpret_cast<char*>(calloc(1, size)));
   if (trace_data == nullptr) {
@@ -1907,9 +3252,6 @@ bool PerfReader::ReadAuxtraceTraceData(DataReader* data,
                            trace_data.get())) {
     return false;
   }
-  if (data->is_cross_endian()) {
-    LOG(ERROR) << "Cannot byteswap trace data from PERF_RECORD_AUXTRACE";
-  }
   if (!serializer_.SerializeAuxtraceEventTraceData(
           trace_data.get(), size, proto_event->mutable_auxtrace_event())) {
     return false;
@@ -1961,7 +3303,26 @@ bool PerfReader::WriteData(const struct perf_file_header& header,
 
   CHECK(serializer_.SampleInfoReaderAvailable());
   CHECK_EQ(header.data.offset, data->Tell());
-  for (const PerfEvent& proto_event : proto_->events()) {
+  void* section =
+      num_encode_threads_ > 1 &&
+              proto_->events_size() >= 2 * kMinEventsPerEncodeThread
+          ? data->GetContiguousBuffer(header.data.offset, header.data.size)
+          : nullptr;
+  if (section == nullptr) return WriteEvents(0, proto_->events_size(), data);
+
+  if (!WriteEventsInParallel(static_cast<char*>(section), header.data.size)) {
+    return false;
+  }
+  data->SeekSet(header.data.offset + header.data.size);
+  return true;
+}
+
+bool PerfReader::WriteEvents(int begin, int end, DataWriter* data) const {
+  // Each event is deserialized into this buffer, which only grows, rather
+  // than into a newly allocated one.
+  std::vector<u64> event_buffer;
+  for (int i = begin; i < end; ++i) {
+    const PerfEvent& proto_event = proto_->events(i);
     size_t expected_size = serializer_.GetEventSize(proto_event);
     if (expected_size == 0) {
       LOG(ERROR) << "Couldn't get event size for event "
@@ -1974,12 +3335,13 @@ bool PerfReader::WriteData(const struct perf_file_header& header,
                  << ", got " << proto_event.header().size();
       return false;
     }
-    malloced_unique_ptr<event_t> event;
+    event_buffer.assign((expected_size + sizeof(u64) - 1) / sizeof(u64), 0);
+    event_t* event = reinterpret_cast<event_t*>(event_buffer.data());
     // The nominal size given by |proto_event| may not be correct, as the
     // contents may have changed since the PerfEvent was created. Use the size
-    // in the event_t returned by PerfSerializer::DeserializeEvent().
-    if (!serializer_.DeserializeEvent(proto_event, &event) ||
-        !data->WriteDataValue(event.get(), event->header.size, "event data")) {
+    // in the event_t filled in by PerfSerializer::DeserializeEvent().
+    if (!serializer_.DeserializeEvent(proto_event, event) ||
+        !data->WriteDataValue(event, event->header.size, "event data")) {
       return false;
     }
     // PERF_RECORD_AUXTRACE contains trace data that is written after writing
@@ -1999,6 +3361,55 @@ bool PerfReader::WriteData(const struct perf_file_header& header,
   return true;
 }
 
+bool PerfReader::WriteEventsInParallel(char* section, size_t size) const {
+  const int num_events = proto_->events_size();
+  const int num_threads = static_cast<int>(std::min<size_t>(
+      num_encode_threads_, num_events / kMinEventsPerEncodeThread));
+
+  // Split the events evenly, and find where each range starts in the data
+  // section.
+  std::vector<int> begins(num_threads + 1);
+  std::vector<size_t> offsets(num_threads + 1);
+  int event = 0;
+  size_t offset = 0;
+  for (int i = 0; i <= num_threads; ++i) {
+    begins[i] = static_cast<int>(static_cast<int64_t>(num_events) * i /
+                                 num_threads);
+    for (; event < begins[i]; ++event) {
+      offset += DataSectionSizeOf(proto_->events(event));
+    }
+    offsets[i] = offset;
+  }
+  CHECK_EQ(size, offsets[num_threads]);
+
+  // A range must fill its part of the section exactly.
+  std::vector<char> ok(num_threads);
+  auto write_range = [this, section, &begins, &offsets, &ok](int i) {
+    BufferWriter range(section + offsets[i], offsets[i + 1] - offsets[i]);
+    ok[i] = WriteEvents(begins[i], begins[i + 1], &range) &&
+            range.Tell() == range.size();
+  };
+
+  // The first range is written on this thread.
+  std::vector<std::unique_ptr<FunctionThread>> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    threads.emplace_back(
+        new FunctionThread([&write_range, i] { write_range(i); }));
+    threads.back()->Start();
+  }
+  write_range(0);
+  for (auto& thread : threads) thread->Join();
+
+  for (int i = 0; i < num_threads; ++i) {
+    if (!ok[i]) {
+      LOG(ERROR) << "Couldn't write events " << begins[i] << " to "
+                 << begins[i + 1];
+      return false;
+    }
+  }
+  return true;
+}
+
 bool PerfReader::WriteMetadata(const struct perf_file_header& header,
                                DataWriter* data) const {
   const size_t header_offset = header.data.offset + header.data.size;
@@ -2568,30 +3979,43 @@ bool PerfReader::NeedsNumberOfStringData(u32 type) const {
 bool PerfReader::LocalizeMMapFilenames(
     const std::map<std::string, std::string>& filename_map) {
   CHECK(serializer_.SampleInfoReaderAvailable());
+  if (filename_map.empty()) return true;
+
+  // The keys and values point into |filename_map|.
+  std::unordered_map<std::string_view, const std::string*> new_filenames;
+  new_filenames.reserve(filename_map.size());
+  for (const auto& it : filename_map) new_filenames[it.first] = &it.second;
 
   // Search for mmap/mmap2 events for which the filename needs to be updated.
-  for (PerfEvent& event : *proto_->mutable_events()) {
-    if (event.header().type() != PERF_RECORD_MMAP &&
-        event.header().type() != PERF_RECORD_MMAP2) {
-      continue;
-    }
-    const std::string& filename = event.mmap_event().filename();
-    const auto it = filename_map.find(filename);
-    if (it == filename_map.end())  // not found
+  for (PerfEvent* event : MmapEvents()) {
+    const std::string& filename = event->mmap_event().filename();
+    const auto it = new_filenames.find(filename);
+    if (it == new_filenames.end())  // not found
       continue;
 
-    const std::string& new_filename = it->second;
+    const std::string& new_filename = *it->second;
     size_t old_len = GetUint64AlignedStringLength(filename.size());
     size_t new_len = GetUint64AlignedStringLength(new_filename.size());
-    size_t new_size = event.header().size() - old_len + new_len;
+    size_t new_size = event->header().size() - old_len + new_len;
 
-    event.mutable_mmap_event()->set_filename(new_filename);
-    event.mutable_header()->set_size(new_size);
+    event->mutable_mmap_event()->set_filename(new_filename);
+    event->mutable_header()->set_size(new_size);
   }
 
   return true;
 }
 
+const std::vector<PerfEvent*>& PerfReader::MmapEvents() {
+  if (!mmap_events_valid_) {
+    mmap_events_.clear();
+    for (PerfEvent& event : *proto_->mutable_events()) {
+      AddToMmapEvents(&event);
+    }
+    mmap_events_valid_ = true;
+  }
+  return mmap_events_;
+}
+
 bool PerfReader::AddPerfFileAttr(const PerfFileAttr& attr) {
   serializer_.SerializePerfFileAttr(attr, proto_->add_file_attrs());
 
@@ -12,14 +12,17 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "compat/proto.h"
 #include "kernel/perf_event.h"
 #include "perf_serializer.h"
 #include "sample_info_reader.h"
+#include "warning_counts.h"
 
 namespace quipper {
 
@@ -28,28 +31,84 @@ namespace quipper {
 
 typedef u32 num_siblings_type;
 
+class BuildIdIndex;
 class DataReader;
 class DataWriter;
+class SampleColumns;
+class ZstdDecompressor;
 
 struct PerfFileAttr;
 
 class PerfReader {
  public:
   PerfReader();
+  // Allocates the output proto on an arena configured with |arena_options|.
+  explicit PerfReader(const ArenaOptions& arena_options);
   ~PerfReader();
 
+  // Returns arena options suited to reading a perf data file of |size| bytes:
+  // the arena starts with a block in proportion to the input and grows in large
+  // blocks, instead of growing from a few hundred bytes.
+  static ArenaOptions ArenaOptionsForInputSize(size_t size);
+
   // Copy stored contents to |*perf_data_proto|. Appends a timestamp. Returns
   // true on success.
   bool Serialize(PerfDataProto* perf_data_proto) const;
-  // Read in contents from a protobuf. Returns true on success.
+  // Same as Serialize(), but finishes the stored proto in place and returns
+  // it, instead of copying it, for callers that are done with the reader. The
+  // reader can only be destroyed afterwards.
+  PerfDataProto* SerializeInPlace();
+  // Same as SerializeInPlace(), but swaps the stored proto into
+  // |*perf_data_proto|, which only copies it if the two are on different
+  // arenas. The reader can only be destroyed afterwards.
+  bool SerializeAndRelease(PerfDataProto* perf_data_proto);
+  // Read in contents from a protobuf. Returns true on success. Callchains in
+  // the compact encoding are expanded.
   bool Deserialize(const PerfDataProto& perf_data_proto);
+  // Same as above, but takes the contents of |perf_data_proto| instead of
+  // copying them if it isn't on an arena.
+  bool Deserialize(PerfDataProto&& perf_data_proto);
+  // Same as above, but adopts |perf_data_proto| itself, allocated on |arena|,
+  // which the reader keeps alive. Reading perf data into the reader afterwards
+  // moves the proto onto the reader's own arena first.
+  bool Deserialize(std::unique_ptr<Arena> arena,
+                   PerfDataProto* perf_data_proto);
 
   bool ReadFile(const std::string& filename);
+  // Reads the perf data at |filename| like ReadFile(), but only keeps the
+  // samples with timestamps in [start_time, end_time], and skips the rounds of
+  // events, delimited by PERF_RECORD_FINISHED_ROUND events, that hold none of
+  // them. The events other than samples before the range are still read for
+  // the context they give, e.g. the mmaps. The rounds are found with the time
+  // index, which is built from the whole data section unless one was set by
+  // SetTimeIndex(). Piped data is read whole, and only the samples outside the
+  // range are dropped.
+  bool ReadTimeRange(const std::string& filename, u64 start_time,
+                     u64 end_time);
+  // Reads the directory |dirname| that perf record writes with --threads,
+  // whose "data" file holds the header, the metadata and the events synthesized
+  // by perf, and whose "data.N" files hold the events of each recording thread
+  // without a header. The data.N files are decoded on up to
+  // |num_decode_threads_| threads, and their events are merged with those of
+  // the data file in time order. The event callbacks, the sample columns and
+  // the filters aren't supported, nor are compressed data.N files.
+  bool ReadDirectory(const std::string& dirname);
   bool ReadFromVector(const std::vector<char>& data);
   bool ReadFromString(const std::string& str);
   bool ReadFromPointer(const char* data, size_t size);
   bool ReadFromData(DataReader* data);
 
+  // Reads piped perf data, e.g. the output of "perf record -o -", as it
+  // arrives. Feed() parses the complete records among the bytes fed so far and
+  // only keeps the incomplete last one, so memory for the input is bounded by
+  // the size of a record rather than of the whole stream. Finish() must follow
+  // the last bytes, and fails if the stream ends in the middle of a record.
+  // Both return false upon error, after which the reader must not be fed.
+  bool Feed(const char* data, size_t size);
+  bool Finish();
+
+  // Writes the perf data to |filename|, which is only replaced once all of it
+  // is written, so that it is left as it was if that fails.
   bool WriteFile(const std::string& filename);
   bool WriteToVector(std::vector<char>* data);
   bool WriteToString(std::string* str);
@@ -63,6 +122,13 @@ class PerfReader {
   // deleted.
   bool InjectBuildIDs(
       const std::map<std::string, std::string>& filenames_to_build_ids);
+  // Like the above, but only injects the build IDs of |index| for the
+  // filenames of the existing build ID events and of the mmap events, and for
+  // |other_filenames|, which get kernel misc bits if no mmap has them. The
+  // entries of |index| that the data doesn't mention cost nothing.
+  void InjectIndexedBuildIDs(
+      const BuildIdIndex& index,
+      const std::vector<std::string>& other_filenames = {});
 
   // Replaces existing filenames with filenames from |build_ids_to_filenames|
   // by joining on build ids.  If a build id in |build_ids_to_filenames| is not
@@ -95,8 +161,23 @@ class PerfReader {
       std::map<std::string, std::string>* filenames_to_build_ids) const;
 
   // Sort all events in |proto_| by timestamps if they are available. Otherwise
-  // event order is unchanged.
-  void MaybeSortEventsByTime();
+  // event order is unchanged. With |keep_unordered_samples|, the events are
+  // also left as they are if sorting them would only reorder the samples
+  // among themselves and among the events whose order doesn't matter, e.g.
+  // when all the mmaps, comms, forks and exits are synthesized before the
+  // first sample, as by perf record -a on a host that doesn't start new
+  // processes. That is for consumers that aggregate the samples in any order.
+  void MaybeSortEventsByTime(bool keep_unordered_samples = false);
+
+  // Like MaybeSortEventsByTime(), but only sorts the events that change how
+  // samples are processed, such as mmaps, comms, forks and exits, by time.
+  // Each sample is moved right after the last of them that is no later than
+  // it, and the samples otherwise keep the order they were read in, e.g.
+  // that of the perf buffer of each CPU within each round. The samples are
+  // then only placed by a binary search over the times of the few events
+  // sorted, rather than sorted themselves, and those between two such events
+  // may be out of order with one another.
+  void MaybeSortStateEventsByTime();
 
   // Accessors and mutators.
 
@@ -107,7 +188,13 @@ class PerfReader {
   // Call Serialize() instead of this function to acquire an "official" protobuf
   // with a timestamp.
   const PerfDataProto& proto() const { return *proto_; }
-  PerfDataProto* mutable_proto() { return proto_; }
+  PerfDataProto* mutable_proto() {
+    mmap_events_valid_ = false;
+    return proto_;
+  }
+
+  // Returns the bytes of the blocks of the arena the proto is allocated on.
+  uint64_t arena_space_allocated() const { return arena_.SpaceAllocated(); }
 
   const RepeatedPtrField<PerfDataProto_PerfFileAttr>& attrs() const {
     return proto_->file_attrs();
@@ -123,6 +210,7 @@ class PerfReader {
   // space required to store the corresponding raw event. If that happens, the
   // caller is responsible for correctly updating the size in the event header.
   RepeatedPtrField<PerfDataProto_PerfEvent>* mutable_events() {
+    mmap_events_valid_ = false;
     return proto_->mutable_events();
   }
 
@@ -165,7 +253,163 @@ class PerfReader {
     sample_event_callback_ = callback;
   }
 
+  // Sets the number of threads used to decode the data section of a normal
+  // perf data file that is held in memory, e.g. when read with
+  // ReadFromPointer() or from a mappable file. Large data sections are split
+  // into chunks at event boundaries, which are decoded concurrently and then
+  // concatenated in order. The events of PERF_RECORD_COMPRESSED records, as
+  // written by perf record -z, are decoded in blocks as they are decompressed.
+  // Has no effect when an event or sample callback or a process filter is set,
+  // since those must see the events in order as they are read.
+  void SetNumDecodeThreads(size_t num_threads) {
+    num_decode_threads_ = num_threads;
+  }
+
+  // Sets the number of threads used to write the events of the data section
+  // when writing to memory, e.g. with WriteToVector() or WriteToPointer(). The
+  // events are split into ranges, whose offsets in the output are known from
+  // the event sizes, and each range is written in place on its own thread.
+  void SetNumEncodeThreads(size_t num_threads) {
+    num_encode_threads_ = num_threads;
+  }
+
+  // Sets the callback to be called for each event in the data section of a
+  // normal (non-piped) perf data file, in file order. When set, events are
+  // handed to |callback| instead of being stored in the output proto, so
+  // reading no longer materializes all the events in memory. The metadata
+  // sections are read before the data section, so the file attrs, build IDs
+  // and string metadata are already available when the first event is
+  // delivered. Reading stops with an error if |callback| returns false. Event
+  // types passed to |SetEventTypesToSkipWhenSerializing| are not delivered.
+  void SetEventCallback(
+      std::function<bool(const PerfDataProto_PerfEvent&)> callback) {
+    event_callback_ = callback;
+  }
+
+  // Stores the sample events accepted by SampleColumns::CanStore() in
+  // |columns| instead of the output proto, which takes much less memory for
+  // large profiles. The samples keep their positions relative to the events
+  // left in the proto, which must therefore not be reordered later, e.g. by
+  // MaybeSortEventsByTime(). Serialize() merges the samples back into the
+  // output, but the Write*() functions only write the events in the proto.
+  // The data section is read on a single thread. Has no effect when an event
+  // callback is set.
+  void SetSampleColumns(SampleColumns* columns) { sample_columns_ = columns; }
+
+  // Makes Serialize() store the callchains in their compact encoding, see
+  // PerfSerializer::CompactCallchains(), which makes the serialized proto
+  // much smaller. The events of the reader keep the regular encoding.
+  void SetCompactCallchains(bool compact) { compact_callchains_ = compact; }
+
+  // Only stores the sample info fields of |fields|, a mask of PERF_SAMPLE_*
+  // bits, in the events read, see PerfSerializer::SetSampleFields(). Users
+  // that only look at some of the fields save the time and memory of the
+  // others, e.g. of the raw data of tracepoints, and can read the samples of
+  // DWARF call graphs, whose user registers and stacks are skipped.
+  void SetSampleFields(uint64_t fields) { serializer_.SetSampleFields(fields); }
+
+  // Makes ReadFromPointer() store the offsets of the trace data of the
+  // PERF_RECORD_AUXTRACE events in the input, in trace_data_offset, instead
+  // of copying the trace data into the events. The input must then outlive
+  // the proto for the trace data to be used, and the events can't be written
+  // out. The trace data of compressed events is still copied.
+  void SetReferenceAuxtraceData(bool reference) {
+    reference_auxtrace_data_ = reference;
+  }
+
+  // Makes ReadFile() and ReadFromPointer() leave the metadata that profiles
+  // are usually converted without, i.e. the tracing data, the CPU, NUMA and
+  // hybrid topologies, the PMU mappings and the group descriptions, in the
+  // input until ReadLazyMetadata() is called, instead of parsing it with the
+  // rest of the file. The mapping of the file is kept until then, and the
+  // input of ReadFromPointer() must outlive the call. The Write*() functions
+  // read the lazy metadata first, but Serialize() leaves it out.
+  void SetLazyMetadata(bool lazy) { lazy_metadata_ = lazy; }
+
+  // Parses the metadata left in the input by SetLazyMetadata(), if any, and
+  // releases the input. Returns false upon error.
+  bool ReadLazyMetadata();
+
+  // Selects the processes whose events are read.
+  struct ProcessFilter {
+    // The PIDs of the processes to keep.
+    std::unordered_set<u32> pids;
+    // The commands of the processes to keep. A process is kept from the
+    // PERF_RECORD_COMM event that gives it one of these names on, e.g. when
+    // it is synthesized or execs.
+    std::unordered_set<std::string> comms;
+    // The paths of the cgroups whose samples are kept, whatever their
+    // process. Since the cgroup of a process is only known from its samples,
+    // the other events of all the processes are kept if any are given.
+    std::unordered_set<std::string> cgroups;
+    // The IDs of the cgroups in |cgroups|, as found in PERF_RECORD_CGROUP
+    // events.
+    std::unordered_set<u64> cgroup_ids;
+
+    bool empty() const {
+      return pids.empty() && comms.empty() && cgroups.empty();
+    }
+  };
+
+  // Drops the samples, mmaps, comms, forks and exits of the processes that
+  // |filter| doesn't select as they are decoded, before they are serialized.
+  // The processes forked by a selected process are selected too. The kernel
+  // mmaps and the events that don't belong to a process are always kept. An
+  // empty filter keeps all the events, which is the default.
+  void SetProcessFilter(const ProcessFilter& filter) {
+    filter_state_ = FilterState();
+    filter_state_.filter = filter;
+  }
+
+  // Returns the process filter, to which the processes and cgroups selected
+  // by the events read so far have been added. It can be handed to the reader
+  // of the next part of the same recording.
+  const ProcessFilter& process_filter() const {
+    return filter_state_.filter;
+  }
+
+  // Returns the number of events dropped by the process filter or the time
+  // range as they were decoded.
+  size_t num_filtered_events() const {
+    return filter_state_.num_filtered_events;
+  }
+
+  // Returns the counts of the events skipped or read in part, by reason and by
+  // event type. They are logged once after the input is read.
+  const WarningCounts& warnings() const { return warnings_; }
+
+  // A round of events of the data section, with the range of the timestamps
+  // of its events. Both are 0 if none has a timestamp.
+  struct TimeIndexEntry {
+    // The offset of the round in the data section.
+    u64 offset;
+    u64 min_time;
+    u64 max_time;
+  };
+  typedef std::vector<TimeIndexEntry> TimeIndex;
+
+  // Returns the time index of the data section, as built or used by
+  // ReadTimeRange(). It can be saved to read other ranges of the same file
+  // later.
+  const TimeIndex& time_index() const { return time_index_; }
+
+  // Sets the time index for ReadTimeRange() to use, which must have been
+  // returned by time_index() for the same file.
+  void SetTimeIndex(TimeIndex index) { time_index_ = std::move(index); }
+
  private:
+  // Sets up the reader for the proto it has deserialized, once it is in
+  // |proto_|.
+  bool FinishDeserialize();
+  // Returns true if all the events have a timestamp, which they must have to
+  // be sorted by time.
+  bool HasEventTimes() const;
+  // Moves an adopted proto onto |arena_|, since the events decoded there are
+  // moved into |proto_| without copies.
+  void MoveProtoToArena();
+
+  // Reads the normal or piped perf data of |data|, for ReadFromData().
+  bool ReadPerfData(DataReader* data);
   bool ReadHeader(DataReader* data);
   bool ReadAttrsSection(DataReader* data);
   bool ReadAttr(DataReader* data);
@@ -178,14 +422,87 @@ class PerfReader {
 
   bool ReadDataSection(DataReader* data);
 
+  // Decodes the chunks of the data section, held in memory at |section|, that
+  // start at |chunk_offsets| on separate threads, and appends the results to
+  // the output proto in order.
+  bool ReadDataSectionChunks(DataReader* data, const char* section,
+                             const std::vector<size_t>& chunk_offsets);
+  // Decodes the |size| bytes of events at |chunk| into |out|. See
+  // ReadNonHeaderEventDataWithoutHeader() below.
+  bool ReadDataSectionChunk(
+      const char* chunk, size_t size, bool cross_endian, PerfDataProto* out,
+      std::unordered_set<std::string>* filenames_with_build_id,
+      WarningCounts* warnings) const;
+  // Moves the events and build IDs that ReadDataSectionChunk() stored in
+  // |events| to the output proto, and adds |warnings| to |warnings_|.
+  void AddDataSectionChunk(PerfDataProto* events,
+                           const WarningCounts& warnings);
+
+  // Reads the events of the data section held in memory at |section|, which
+  // holds PERF_RECORD_COMPRESSED records. The records are decompressed in
+  // order on this thread, since they continue a single zstd stream, and the
+  // blocks of events decompressed are decoded on up to
+  // |num_decode_threads_| - 1 other threads while the next ones are
+  // decompressed.
+  bool ReadCompressedDataSection(DataReader* data, const char* section);
+  // Decompresses the payload of the PERF_RECORD_COMPRESSED or
+  // PERF_RECORD_COMPRESSED2 record |header|, which follows it at |payload|,
+  // and appends the events to |out|.
+  bool DecompressEvent(const perf_event_header& header, const char* payload,
+                       std::vector<char>* out);
+  // Reads the payload of the compressed record |header| from |data|, and the
+  // events that it completes in |decompressed_|.
+  bool ReadCompressedEvent(DataReader* data, const perf_event_header& header,
+                           size_t* read_size);
+  // Returns the size of the complete events at the start of the |size| bytes
+  // at |data|, with the data that follows some of them.
+  size_t CompleteEventsSize(const char* data, size_t size) const;
+
+  // Reads the events of the data section in the time range of
+  // |filter_state_|, seeking past the rounds of events outside of it.
+  bool ReadDataSectionTimeRange(DataReader* data);
+  // Builds |time_index_| from the whole data section.
+  bool BuildTimeIndex(DataReader* data);
+
+  // The process filter and the time range, updated as the events are read.
+  struct FilterState {
+    ProcessFilter filter;
+    // Whether the samples outside of [start_time, end_time] are dropped.
+    bool has_time_range = false;
+    u64 start_time = 0;
+    u64 end_time = 0;
+    size_t num_filtered_events = 0;
+
+    bool empty() const { return filter.empty() && !has_time_range; }
+  };
+
+  // Returns whether |event| passes the filters of |state|, and adds the
+  // processes and cgroups that it selects to its process filter.
+  bool KeepEvent(const event_t& event, FilterState* state) const;
+
   // Reads the event data of non-header events from both file and pipe mode
   // perf outputs. Returns true on success. Otherwise, returns false. On
   // success, updates the |read_size| with the size of the read non-header event
   // data including any data following the actual event not including the size
-  // of the header.
+  // of the header. Compressed events are decompressed, and the events that
+  // they complete are read.
   bool ReadNonHeaderEventDataWithoutHeader(DataReader* data,
                                            const perf_event_header& header,
                                            size_t* read_size);
+  // Same as above, for an event that isn't compressed.
+  bool ReadEventToProto(DataReader* data, const perf_event_header& header,
+                        size_t* read_size);
+  // Same as above, but adds the events and the build IDs found in MMAP2
+  // events to |out|, using |filenames_with_build_id| to add only one build ID
+  // per filename, drops the events that the filters of |filter_state| don't
+  // keep if it is not null, and counts the events skipped in |warnings|. Only
+  // touches state shared with other calls through const accessors, so that
+  // chunks of events can be read concurrently.
+  bool ReadNonHeaderEventDataWithoutHeader(
+      DataReader* data, const perf_event_header& header, size_t* read_size,
+      PerfDataProto* out,
+      std::unordered_set<std::string>* filenames_with_build_id,
+      FilterState* filter_state, WarningCounts* warnings) const;
 
   // Reads metadata in normal mode.
   bool ReadMetadata(DataReader* data);
@@ -207,7 +524,8 @@ class PerfReader {
 
   // Reads and serializes trace data following PERF_RECORD_AUXTRACE event.
   bool ReadAuxtraceTraceData(DataReader* data,
-                             PerfDataProto_PerfEvent* proto_event);
+                             PerfDataProto_PerfEvent* proto_event,
+                             WarningCounts* warnings) const;
 
   // Reads a singular string metadata field (with preceding size field) from
   // |data| and writes the string and its Md5sum prefix into |dest|.
@@ -239,6 +557,18 @@ class PerfReader {
   // Read perf data from piped perf output data.
   bool ReadPipedData(DataReader* data);
 
+  // Reads the next event of piped perf data, counting the
+  // PERF_RECORD_HEADER_EVENT_TYPE events in |num_event_types|.
+  bool ReadPipedEvent(DataReader* data, int* num_event_types);
+
+  // Completes the metadata once all of the piped data has been read.
+  void FinishPipedData(int num_event_types);
+
+  // Returns the full size of the piped data record that starts the |size|
+  // bytes at |data|, including any data following the event, or 0 if more
+  // bytes are needed to tell.
+  size_t PipedRecordSize(const char* data, size_t size) const;
+
   // Processes the remaining piped-mode header events, introduced after
   // perf-4.13.
   bool ProcessPipedModeHeaderEvents(DataReader* data,
@@ -261,6 +591,11 @@ class PerfReader {
   bool WriteAttrs(const struct perf_file_header& header,
                   DataWriter* data) const;
   bool WriteData(const struct perf_file_header& header, DataWriter* data) const;
+  // Writes the events of |proto_| in [begin, end) to |data|.
+  bool WriteEvents(int begin, int end, DataWriter* data) const;
+  // Writes the events of |proto_| to the |size| bytes of the data section at
+  // |section| on up to |num_encode_threads_| threads.
+  bool WriteEventsInParallel(char* section, size_t size) const;
   bool WriteMetadata(const struct perf_file_header& header,
                      DataWriter* data) const;
 
@@ -312,6 +647,18 @@ class PerfReader {
   bool LocalizeMMapFilenames(
       const std::map<std::string, std::string>& filename_map);
 
+  // Returns the MMAP and MMAP2 events of |proto_|, in order. They are collected
+  // again if the events may have been changed since they were read.
+  const std::vector<PerfDataProto_PerfEvent*>& MmapEvents();
+  // Adds |event|, just added to |proto_|, to |mmap_events_| if it is an MMAP
+  // or MMAP2 event.
+  void AddToMmapEvents(PerfDataProto_PerfEvent* event) {
+    const u32 type = event->header().type();
+    if (type == PERF_RECORD_MMAP || type == PERF_RECORD_MMAP2) {
+      mmap_events_.push_back(event);
+    }
+  }
+
   // Stores a PerfFileAttr in |proto_|, creates a sample info reader from
   // |attr|, and updates |serializer_|. Returns true on success. Returns false
   // when the event ID position in the events linked to the |attr| are
@@ -339,6 +686,10 @@ class PerfReader {
   // Store the perf data as a protobuf.
   Arena arena_;
   PerfDataProto* proto_;
+  // The arena or the heap proto that |proto_| is on instead of |arena_| after
+  // a Deserialize() that adopts it.
+  std::unique_ptr<Arena> adopted_arena_;
+  std::unique_ptr<PerfDataProto> adopted_proto_;
 
   // Attribute ids that have been added to |proto_|. PerfFileAttr is generated
   // in PERF_RECORD_HEADER_ATTR, PERF_RECORD_HEADER_EVENT_TYPE, and
@@ -367,6 +718,9 @@ class PerfReader {
   // For build-id embedded in MMAP2 records
   std::unordered_set<std::string> filenames_with_build_id_;
 
+  // The warnings hit while reading the events, see warnings().
+  WarningCounts warnings_;
+
   // Which event types should be skipped when serializing to the output proto,
   // e.g. PERF_RECORD_SAMPLE, PERF_RECORD_COMM, etc.
   std::unordered_set<u32> event_types_to_skip_when_serializing_;
@@ -375,6 +729,63 @@ class PerfReader {
   // even if PERF_RECORD_SAMPLE is in |event_types_to_skip_when_serializing|.
   std::function<void(const PerfDataProto_SampleEvent&)> sample_event_callback_;
 
+  // Number of threads to decode the data section with.
+  size_t num_decode_threads_ = 1;
+
+  // Number of threads to write the data section with.
+  size_t num_encode_threads_ = 1;
+
+  // Callback to be called for each event in the data section if set. Such
+  // events are not added to the output proto.
+  std::function<bool(const PerfDataProto_PerfEvent&)> event_callback_;
+
+  // Where the sample events are stored if not null.
+  SampleColumns* sample_columns_ = nullptr;
+
+  // Whether Serialize() compacts the callchains.
+  bool compact_callchains_ = false;
+
+  // See SetLazyMetadata(). |lazy_input_| is the input that the sections in
+  // |lazy_metadata_sections_| are read from.
+  struct LazyMetadataSection {
+    u32 type;
+    u64 offset;
+    u64 size;
+  };
+  bool lazy_metadata_ = false;
+  std::unique_ptr<DataReader> lazy_input_;
+  std::vector<LazyMetadataSection> lazy_metadata_sections_;
+
+  // See SetReferenceAuxtraceData(). |input_| is the input of ReadFromPointer()
+  // while it is being read.
+  bool reference_auxtrace_data_ = false;
+  std::string_view input_;
+
+  // The filters of the events, which keep all of them if empty.
+  FilterState filter_state_;
+
+  // The rounds of events of the data section.
+  TimeIndex time_index_;
+
+  // The MMAP and MMAP2 events of |proto_|, collected as the events are read so
+  // that injecting build IDs and localizing filenames don't walk all the
+  // events. Only valid if |mmap_events_valid_|, which is cleared when the
+  // events may be changed otherwise, e.g. by the users of mutable_events().
+  std::vector<PerfDataProto_PerfEvent*> mmap_events_;
+  bool mmap_events_valid_ = true;
+
+  // The state of Feed(): the bytes fed that don't form a complete record yet,
+  // whether the header has been read, and the number of
+  // PERF_RECORD_HEADER_EVENT_TYPE events read.
+  std::vector<char> feed_buffer_;
+  bool feed_header_read_ = false;
+  int feed_num_event_types_ = 0;
+
+  // The stream of the PERF_RECORD_COMPRESSED records read sequentially, and
+  // the bytes decompressed from it that don't form a complete event yet.
+  std::unique_ptr<ZstdDecompressor> decompressor_;
+  std::vector<char> decompressed_;
+
   PerfReader(const PerfReader&) = delete;
   PerfReader& operator=(const PerfReader&) = delete;
 };
@@ -5,16 +5,27 @@
 #include "perf_reader.h"
 
 #include <byteswap.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <map>
 #include <sstream>
 #include <string>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "base/logging.h"
+#include "binary_data_utils.h"
+#include "build_id_index.h"
 #include "file_utils.h"
 #include "kernel/perf_internals.h"
 #include "perf_test_files.h"
+#include "sample_columns.h"
+#include "scoped_temp_path.h"
 #include "test_perf_data.h"
 #include "test_utils.h"
 
@@ -309,6 +320,30 @@ TEST(PerfReaderTest, ReadsAndWritesPipedModeAuxTraceEvents) {
   }
 }
 
+TEST(PerfReaderTest, ReferencesAuxTraceDataInInput) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP,
+                                              false /*sample_id_all*/)
+      .WriteTo(&input);
+  testing::ExampleAuxtraceEvent(9, 0x2000, 7, 3, 0x68d, 4, 0, "/dev/zero")
+      .WriteTo(&input);
+  const std::string input_string = input.str();
+
+  PerfReader pr;
+  pr.SetReferenceAuxtraceData(true);
+  ASSERT_TRUE(pr.ReadFromString(input_string));
+  ASSERT_EQ(1, pr.events().size());
+  const PerfDataProto_AuxtraceEvent& event =
+      pr.events().Get(0).auxtrace_event();
+  EXPECT_EQ(9, event.size());
+  EXPECT_FALSE(event.has_trace_data());
+  ASSERT_TRUE(event.has_trace_data_offset());
+  EXPECT_EQ(input_string.size() - event.size(), event.trace_data_offset());
+  EXPECT_EQ("/dev/zero",
+            input_string.substr(event.trace_data_offset(), event.size()));
+}
+
 TEST(PerfReaderTest, ReadsAndWritesAuxTraceEvents) {
   std::stringstream input;
 
@@ -361,6 +396,150 @@ TEST(PerfReaderTest, ReadsAndWritesAuxTraceEvents) {
   }
 }
 
+TEST(PerfReaderTest, StreamsEventsToEventCallback) {
+  // data
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1234, 0x0000000000810000, 0x10000, 0x2000,
+                            "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1234, 1235))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x0000000000810100).Tid(1234, 1235))
+      .WriteTo(&input_data);
+  testing::ExampleAuxtraceEvent(9, 0x2000, 7, 3, 0x68d, 4, 0, "/dev/zero")
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x000000000081ff00).Tid(1234, 1235))
+      .WriteTo(&input_data);
+
+  std::stringstream input;
+
+  // header
+  const size_t data_size = input_data.str().size();
+  testing::ExamplePerfDataFileHeader file_header((0));
+  file_header.WithAttrCount(1).WithDataSize(data_size);
+  file_header.WriteTo(&input);
+
+  // attrs
+  ASSERT_EQ(file_header.header().attrs.offset, static_cast<u64>(input.tellp()));
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // data
+  ASSERT_EQ(file_header.header().data.offset, static_cast<u64>(input.tellp()));
+  input << input_data.str();
+
+  //
+  // Parse input.
+  //
+
+  std::vector<PerfEvent> streamed_events;
+  int num_attrs_seen = -1;
+  PerfReader pr;
+  pr.SetEventCallback([&](const PerfEvent& event) {
+    // The attrs are available before the first event is delivered.
+    if (streamed_events.empty()) num_attrs_seen = pr.attrs().size();
+    streamed_events.push_back(event);
+    return true;
+  });
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+
+  // The streamed events are not stored in the proto.
+  EXPECT_EQ(0, pr.events().size());
+  EXPECT_EQ(1, num_attrs_seen);
+  ASSERT_EQ(4, streamed_events.size());
+  EXPECT_EQ(PERF_RECORD_MMAP, streamed_events[0].header().type());
+  EXPECT_EQ("/usr/lib/foo.so", streamed_events[0].mmap_event().filename());
+  EXPECT_EQ(0x810100, streamed_events[1].sample_event().ip());
+  EXPECT_EQ("/dev/zero", streamed_events[2].auxtrace_event().trace_data());
+  EXPECT_EQ(0x81ff00, streamed_events[3].sample_event().ip());
+
+  // Reading stops when the callback fails.
+  PerfReader failing_pr;
+  int num_callbacks = 0;
+  failing_pr.SetEventCallback([&](const PerfEvent& event) {
+    return ++num_callbacks < 2;
+  });
+  EXPECT_FALSE(failing_pr.ReadFromString(input.str()));
+  EXPECT_EQ(2, num_callbacks);
+}
+
+TEST(PerfReaderTest, DoesNotStreamPipedData) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP,
+                                              false /*sample_id_all*/)
+      .WriteTo(&input);
+
+  PerfReader pr;
+  pr.SetEventCallback([](const PerfEvent& event) { return true; });
+  EXPECT_FALSE(pr.ReadFromString(input.str()));
+}
+
+TEST(PerfReaderTest, ReadsFedPipedData) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+  const std::string trace_metadata = "\x17\x08\x44tracing0.5BLAHBLAHBLAH";
+  const tracing_data_event trace_event = {
+      .header =
+          {
+              .type = PERF_RECORD_HEADER_TRACING_DATA,
+              .misc = 0,
+              .size = sizeof(tracing_data_event),
+          },
+      .size = static_cast<u32>(trace_metadata.size()),
+  };
+  input.write(reinterpret_cast<const char*>(&trace_event), sizeof(trace_event));
+  input.write(trace_metadata.data(), trace_metadata.size());
+  testing::ExampleMmapEvent(1234, 0x0000000000810000, 0x10000, 0x2000,
+                            "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1234, 1235))
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x0000000000810100).Tid(1234, 1235))
+      .WriteTo(&input);
+  testing::ExampleAuxtraceEvent(9, 0x2000, 7, 3, 0x68d, 4, 0, "/dev/zero")
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x000000000081ff00).Tid(1234, 1235))
+      .WriteTo(&input);
+  const std::string data = input.str();
+
+  PerfReader expected;
+  ASSERT_TRUE(expected.ReadFromString(data));
+  ASSERT_EQ(4, expected.events().size());
+
+  for (size_t chunk_size : {size_t{1}, size_t{3}, size_t{7}, size_t{13},
+                            size_t{100}, data.size()}) {
+    PerfReader pr;
+    for (size_t i = 0; i < data.size(); i += chunk_size) {
+      ASSERT_TRUE(
+          pr.Feed(data.data() + i, std::min(chunk_size, data.size() - i)))
+          << chunk_size;
+    }
+    ASSERT_TRUE(pr.Finish()) << chunk_size;
+    EXPECT_EQ(expected.proto().SerializeAsString(),
+              pr.proto().SerializeAsString())
+        << chunk_size;
+    EXPECT_EQ(trace_metadata, pr.tracing_data());
+  }
+
+  // The stream can't end in the middle of a record.
+  PerfReader truncated;
+  ASSERT_TRUE(truncated.Feed(data.data(), data.size() - 1));
+  EXPECT_FALSE(truncated.Finish());
+  // Only piped data can be fed.
+  PerfReader not_piped;
+  std::stringstream file_header;
+  testing::ExamplePerfDataFileHeader(0).WriteTo(&file_header);
+  EXPECT_FALSE(
+      not_piped.Feed(file_header.str().data(), file_header.str().size()));
+}
+
 TEST(PerfReaderTest, FailsToReadAuxTraceEventWithInvalidTraceSize) {
   std::stringstream input;
 
@@ -444,6 +623,119 @@ TEST(PerfReaderTest, ReadsAndWritesTraceMetadata) {
   EXPECT_EQ(tracing_metadata.data().value(), pr.tracing_data());
 }
 
+TEST(PerfReaderTest, ReadsOnlySampleFieldsSet) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1).WithDataSize(
+      testing::ExamplePerfSampleEvent_Tracepoint::kEventSize);
+  file_header.WriteTo(&input);
+
+  // attrs
+  testing::ExamplePerfFileAttr_Tracepoint(73).WriteTo(&input);
+
+  // data
+  testing::ExamplePerfSampleEvent_Tracepoint().WriteTo(&input);
+
+  PerfReader pr;
+  pr.SetSampleFields(~PERF_SAMPLE_RAW & ~PERF_SAMPLE_CPU);
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+  ASSERT_EQ(1, pr.events().size());
+  const PerfDataProto_SampleEvent& sample = pr.events().Get(0).sample_event();
+  EXPECT_EQ(0x00007f999c38d15a, sample.ip());
+  EXPECT_EQ(0x68d, sample.pid());
+  EXPECT_EQ(0x0001e0211cbab7b9, sample.sample_time_ns());
+  EXPECT_EQ(1, sample.period());
+  EXPECT_FALSE(sample.has_cpu());
+  EXPECT_FALSE(sample.has_raw());
+  EXPECT_FALSE(sample.has_raw_size());
+}
+
+TEST(PerfReaderTest, ReadsTraceMetadataLazily) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePerfDataFileHeader file_header(1 << HEADER_TRACING_DATA);
+  file_header.WithAttrCount(1).WithDataSize(
+      testing::ExamplePerfSampleEvent_Tracepoint::kEventSize);
+  file_header.WriteTo(&input);
+
+  // attrs
+  testing::ExamplePerfFileAttr_Tracepoint(73).WriteTo(&input);
+
+  // data
+  testing::ExamplePerfSampleEvent_Tracepoint().WriteTo(&input);
+
+  // metadata
+  testing::ExampleTracingMetadata tracing_metadata(file_header.data_end() +
+                                                   sizeof(perf_file_section));
+  tracing_metadata.index_entry().WriteTo(&input);
+  tracing_metadata.data().WriteTo(&input);
+  const std::string input_string = input.str();
+
+  PerfReader pr;
+  pr.SetLazyMetadata(true);
+  ASSERT_TRUE(pr.ReadFromString(input_string));
+  EXPECT_EQ(1, pr.events().size());
+  EXPECT_EQ("", pr.tracing_data());
+  ASSERT_TRUE(pr.ReadLazyMetadata());
+  EXPECT_EQ(tracing_metadata.data().value(), pr.tracing_data());
+
+  // Writing the data reads the lazy metadata first.
+  PerfReader lazy_pr;
+  lazy_pr.SetLazyMetadata(true);
+  ASSERT_TRUE(lazy_pr.ReadFromString(input_string));
+  std::vector<char> output_perf_data;
+  ASSERT_TRUE(lazy_pr.WriteToVector(&output_perf_data));
+  EXPECT_EQ(tracing_metadata.data().value(), lazy_pr.tracing_data());
+  PerfReader written_pr;
+  ASSERT_TRUE(written_pr.ReadFromVector(output_perf_data));
+  EXPECT_EQ(tracing_metadata.data().value(), written_pr.tracing_data());
+}
+
+TEST(PerfReaderTest, AdoptsDeserializedProto) {
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1).WithDataSize(
+      testing::ExamplePerfSampleEvent_Tracepoint::kEventSize);
+  file_header.WriteTo(&input);
+  testing::ExamplePerfFileAttr_Tracepoint(73).WriteTo(&input);
+  testing::ExamplePerfSampleEvent_Tracepoint().WriteTo(&input);
+  PerfReader pr;
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+  PerfDataProto proto = pr.proto();
+
+  // The contents of a heap proto are taken without copies.
+  PerfDataProto heap_proto = proto;
+  const PerfEvent* event = &heap_proto.events(0);
+  PerfReader moved_pr;
+  ASSERT_TRUE(moved_pr.Deserialize(std::move(heap_proto)));
+  EXPECT_EQ(event, &moved_pr.events().Get(0));
+  EXPECT_EQ(proto.SerializeAsString(), moved_pr.proto().SerializeAsString());
+
+  // A proto on an arena is adopted along with its arena.
+  std::unique_ptr<Arena> arena(new Arena);
+  PerfDataProto* arena_proto = Arena::Create<PerfDataProto>(arena.get());
+  arena_proto->CopyFrom(proto);
+  PerfReader adopted_pr;
+  ASSERT_TRUE(adopted_pr.Deserialize(std::move(arena), arena_proto));
+  EXPECT_EQ(&arena_proto->events(0), &adopted_pr.events().Get(0));
+  EXPECT_EQ(1, adopted_pr.attrs().size());
+  std::string output;
+  ASSERT_TRUE(adopted_pr.WriteToString(&output));
+  PerfReader written_pr;
+  ASSERT_TRUE(written_pr.ReadFromString(output));
+  EXPECT_EQ(1, written_pr.events().size());
+
+  // Reading perf data afterwards moves the proto onto the reader's arena,
+  // where the events read are added to those adopted.
+  ASSERT_TRUE(adopted_pr.ReadFromString(input.str()));
+  ASSERT_EQ(2, adopted_pr.events().size());
+  EXPECT_EQ(proto.events(0).SerializeAsString(),
+            adopted_pr.events().Get(1).SerializeAsString());
+}
+
 TEST(PerfReaderTest, ReadsTracingMetadataEvent) {
   std::stringstream input;
 
@@ -2571,7 +2863,9 @@ TEST(PerfReaderTest, UnsupportedPerfEvent) {
       .size = sizeof(struct perf_event_header),
   };
 
-  const size_t data_size = sizeof(event);
+  // The skipped events are counted rather than logged one by one.
+  const int num_events = 3;
+  const size_t data_size = num_events * sizeof(event);
 
   // header
   testing::ExamplePerfDataFileHeader file_header(0);
@@ -2584,7 +2878,9 @@ TEST(PerfReaderTest, UnsupportedPerfEvent) {
 
   // data
   ASSERT_EQ(file_header.header().data.offset, static_cast<u64>(input.tellp()));
-  input.write(reinterpret_cast<const char*>(&event), data_size);
+  for (int i = 0; i < num_events; ++i) {
+    input.write(reinterpret_cast<const char*>(&event), sizeof(event));
+  }
   ASSERT_EQ(file_header.header().data.offset + data_size,
             static_cast<u64>(input.tellp()));
   // no metadata
@@ -2602,6 +2898,9 @@ TEST(PerfReaderTest, UnsupportedPerfEvent) {
 
   // Verify perf events.
   ASSERT_EQ(0, pr.events().size());
+  EXPECT_EQ(num_events,
+            pr.warnings().count("Skipped unsupported events", event.type));
+  EXPECT_EQ(1, pr.warnings().counts().size());
 }
 
 TEST(PerfReaderTest, MMapEventWithZeroEventSize) {
@@ -2866,4 +3165,1005 @@ TEST(PerfReaderTest, MMap2EventWithBuildId) {
   ASSERT_EQ(mmap2.ino_generation(), 0);
 }
 
+// Events are decoded in place when the input buffer is suitably aligned, and
+// copied out otherwise. Both paths must produce the same events.
+TEST(PerfReaderTest, ReadsEventsFromAlignedAndMisalignedBuffers) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_MMAP
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input);
+
+  // PERF_RECORD_SAMPLE
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1234).Tid(1001, 1002))
+      .WriteTo(&input);
+
+  const std::string data = input.str();
+  // Place the input at an offset that breaks the natural alignment of events.
+  std::vector<char> misaligned(data.size() + 1);
+  memcpy(misaligned.data() + 1, data.data(), data.size());
+
+  PerfReader aligned_reader;
+  ASSERT_TRUE(aligned_reader.ReadFromString(data));
+  PerfReader misaligned_reader;
+  ASSERT_TRUE(
+      misaligned_reader.ReadFromPointer(misaligned.data() + 1, data.size()));
+
+  ASSERT_EQ(2, aligned_reader.events().size());
+  const PerfEvent& mmap = aligned_reader.events().Get(0);
+  EXPECT_EQ(PERF_RECORD_MMAP, mmap.header().type());
+  EXPECT_EQ("/usr/lib/foo.so", mmap.mmap_event().filename());
+  EXPECT_EQ(0x1c1000, mmap.mmap_event().start());
+  const PerfEvent& sample = aligned_reader.events().Get(1);
+  EXPECT_EQ(PERF_RECORD_SAMPLE, sample.header().type());
+  EXPECT_EQ(0x1c1234, sample.sample_event().ip());
+  EXPECT_EQ(1002, sample.sample_event().tid());
+
+  EXPECT_EQ(aligned_reader.proto().SerializeAsString(),
+            misaligned_reader.proto().SerializeAsString());
+}
+
+// Events are merged round by round when PERF_RECORD_FINISHED_ROUND events
+// are present, falling back to a full sort when the rounds are violated. Both
+// must produce the order of a stable sort by timestamp.
+TEST(PerfReaderTest, SortsEventsByTimeUsingRounds) {
+  // A timestamp of 0 stands for a PERF_RECORD_FINISHED_ROUND event.
+  const std::vector<std::vector<u64>> kInputs = {
+      {10, 30, 20, 0, 25, 40, 35, 30, 0, 33, 50, 0, 45},
+      // 12 is older than the events flushed at the second round boundary.
+      {10, 30, 20, 0, 25, 40, 35, 30, 0, 12, 50, 0, 45},
+      // No rounds at all.
+      {10, 30, 20, 25, 40, 35, 30, 33, 50, 45},
+  };
+  for (const auto& timestamps : kInputs) {
+    PerfDataProto proto;
+    proto.add_file_attrs()->mutable_attr()->set_sample_type(PERF_SAMPLE_IP |
+                                                            PERF_SAMPLE_TIME);
+    std::vector<std::pair<u64, int>> expected;
+    for (size_t i = 0; i < timestamps.size(); ++i) {
+      PerfEvent* event = proto.add_events();
+      event->mutable_header()->set_size(sizeof(perf_event_header));
+      if (timestamps[i] == 0) {
+        event->mutable_header()->set_type(PERF_RECORD_FINISHED_ROUND);
+        expected.emplace_back(0, i);
+        continue;
+      }
+      event->mutable_header()->set_type(PERF_RECORD_SAMPLE);
+      event->set_timestamp(timestamps[i]);
+      // Tag the events to tell apart the ones with the same timestamp.
+      event->mutable_sample_event()->set_ip(i);
+      expected.emplace_back(timestamps[i], i);
+    }
+    std::stable_sort(expected.begin(), expected.end(),
+                     [](const std::pair<u64, int>& a,
+                        const std::pair<u64, int>& b) {
+                       return a.first < b.first;
+                     });
+
+    PerfReader reader;
+    ASSERT_TRUE(reader.Deserialize(proto));
+    reader.MaybeSortEventsByTime();
+
+    ASSERT_EQ(expected.size(), reader.events().size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      const PerfEvent& event = reader.events().Get(i);
+      EXPECT_EQ(expected[i].first, event.timestamp()) << "index " << i;
+      if (event.has_sample_event()) {
+        EXPECT_EQ(expected[i].second, event.sample_event().ip())
+            << "index " << i;
+      }
+    }
+  }
+}
+
+TEST(PerfReaderTest, KeepsUnorderedSamples) {
+  struct Event {
+    u32 type;
+    u64 time;
+  };
+  auto make_proto = [](const std::vector<Event>& events) {
+    PerfDataProto proto;
+    proto.add_file_attrs()->mutable_attr()->set_sample_type(PERF_SAMPLE_IP |
+                                                            PERF_SAMPLE_TIME);
+    for (const Event& e : events) {
+      PerfEvent* event = proto.add_events();
+      event->mutable_header()->set_type(e.type);
+      event->mutable_header()->set_size(sizeof(perf_event_header));
+      event->set_timestamp(e.time);
+    }
+    return proto;
+  };
+  auto event_times = [](const PerfReader& reader) {
+    std::vector<u64> times;
+    for (const auto& event : reader.events()) {
+      times.push_back(event.timestamp());
+    }
+    return times;
+  };
+
+  // The mmaps and comms synthesized at the start come before all the samples,
+  // which are out of order, as are the lost samples.
+  const PerfDataProto synthesized = make_proto({
+      {PERF_RECORD_MMAP, 0},
+      {PERF_RECORD_COMM, 0},
+      {PERF_RECORD_MMAP, 5},
+      {PERF_RECORD_SAMPLE, 30},
+      {PERF_RECORD_SAMPLE, 10},
+      {PERF_RECORD_LOST_SAMPLES, 20},
+      {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_SAMPLE, 25},
+  });
+  PerfReader reader;
+  ASSERT_TRUE(reader.Deserialize(synthesized));
+  reader.MaybeSortEventsByTime(/*keep_unordered_samples=*/true);
+  EXPECT_EQ(std::vector<u64>({0, 0, 5, 30, 10, 20, 0, 25}),
+            event_times(reader));
+  reader.MaybeSortEventsByTime();
+  EXPECT_EQ(std::vector<u64>({0, 0, 0, 5, 10, 20, 25, 30}),
+            event_times(reader));
+
+  // Events whose order matters are sorted if they aren't all before the
+  // samples, in time order, and no later than the samples.
+  for (const std::vector<Event>& events : std::vector<std::vector<Event>>{
+           {{PERF_RECORD_SAMPLE, 30}, {PERF_RECORD_MMAP, 20}},
+           {{PERF_RECORD_MMAP, 20}, {PERF_RECORD_MMAP, 5},
+            {PERF_RECORD_SAMPLE, 30}},
+           {{PERF_RECORD_MMAP, 20}, {PERF_RECORD_SAMPLE, 10}},
+       }) {
+    PerfReader sorted_reader;
+    ASSERT_TRUE(sorted_reader.Deserialize(make_proto(events)));
+    sorted_reader.MaybeSortEventsByTime(/*keep_unordered_samples=*/true);
+    const std::vector<u64> times = event_times(sorted_reader);
+    EXPECT_TRUE(std::is_sorted(times.begin(), times.end()));
+  }
+}
+
+TEST(PerfReaderTest, SortsStateEventsByTime) {
+  struct Event {
+    u32 type;
+    u64 time;
+  };
+  auto make_proto = [](const std::vector<Event>& events) {
+    PerfDataProto proto;
+    proto.add_file_attrs()->mutable_attr()->set_sample_type(PERF_SAMPLE_IP |
+                                                            PERF_SAMPLE_TIME);
+    for (const Event& e : events) {
+      PerfEvent* event = proto.add_events();
+      event->mutable_header()->set_type(e.type);
+      event->mutable_header()->set_size(sizeof(perf_event_header));
+      event->set_timestamp(e.time);
+    }
+    return proto;
+  };
+  auto events = [](const PerfReader& reader) {
+    std::vector<std::pair<u32, u64>> events;
+    for (const auto& event : reader.events()) {
+      events.emplace_back(event.header().type(), event.timestamp());
+    }
+    return events;
+  };
+
+  // The events of two CPUs in a round, each in time order. The mmaps and the
+  // exit are sorted, and each sample goes right after the last of them no
+  // later than it, in the order the samples were read in otherwise.
+  PerfReader reader;
+  ASSERT_TRUE(reader.Deserialize(make_proto({
+      {PERF_RECORD_MMAP, 0},
+      {PERF_RECORD_SAMPLE, 30},
+      {PERF_RECORD_SAMPLE, 10},
+      {PERF_RECORD_MMAP, 20},
+      {PERF_RECORD_SAMPLE, 25},
+      {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_SAMPLE, 5},
+      {PERF_RECORD_SAMPLE, 20},
+      {PERF_RECORD_EXIT, 15},
+      {PERF_RECORD_SAMPLE, 12},
+  })));
+  reader.MaybeSortStateEventsByTime();
+  EXPECT_EQ((std::vector<std::pair<u32, u64>>{
+                {PERF_RECORD_MMAP, 0},
+                {PERF_RECORD_SAMPLE, 10},
+                {PERF_RECORD_FINISHED_ROUND, 0},
+                {PERF_RECORD_SAMPLE, 5},
+                {PERF_RECORD_SAMPLE, 12},
+                {PERF_RECORD_EXIT, 15},
+                {PERF_RECORD_MMAP, 20},
+                {PERF_RECORD_SAMPLE, 30},
+                {PERF_RECORD_SAMPLE, 25},
+                {PERF_RECORD_SAMPLE, 20},
+            }),
+            events(reader));
+
+  // Events already in that order are left as they are.
+  const std::vector<std::pair<u32, u64>> sorted = events(reader);
+  reader.MaybeSortStateEventsByTime();
+  EXPECT_EQ(sorted, events(reader));
+}
+
+// A large data section is decoded in chunks on several threads, which must
+// produce the same proto as reading it sequentially.
+TEST(PerfReaderTest, DecodesDataSectionOnMultipleThreads) {
+  std::stringstream input_data;
+  for (int i = 0; i < 20000; ++i) {
+    if (i % 1000 == 0) {
+      // The same file is mapped with different build IDs. Only the first one
+      // is kept.
+      std::vector<u8> build_id(20, static_cast<u8>(i / 1000 + 1));
+      testing::ExampleMmap2Event(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                                 testing::SampleInfo().Tid(1001))
+          .WithMisc(PERF_RECORD_MISC_MMAP_BUILD_ID)
+          .WithBuildId(build_id.data(), build_id.size())
+          .WriteTo(&input_data);
+    }
+    if (i % 5000 == 0) {
+      testing::ExampleAuxtraceEvent(9, 0x2000, 7, 3, 0x68d, 4, 0, "/dev/zero")
+          .WriteTo(&input_data);
+    }
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001, 1002))
+        .WriteTo(&input_data);
+  }
+
+  std::stringstream input;
+
+  // header
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+
+  // attrs
+  ASSERT_EQ(file_header.header().attrs.offset, static_cast<u64>(input.tellp()));
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // data
+  ASSERT_EQ(file_header.header().data.offset, static_cast<u64>(input.tellp()));
+  input << input_data.str();
+
+  PerfReader sequential_reader(
+      PerfReader::ArenaOptionsForInputSize(input.str().size()));
+  ASSERT_TRUE(sequential_reader.ReadFromString(input.str()));
+  PerfReader parallel_reader;
+  parallel_reader.SetNumDecodeThreads(4);
+  ASSERT_TRUE(parallel_reader.ReadFromString(input.str()));
+
+  EXPECT_EQ(20000 + 20 + 4, parallel_reader.events().size());
+  ASSERT_EQ(1, parallel_reader.build_ids().size());
+  EXPECT_EQ(std::string(20, 1),
+            parallel_reader.build_ids().Get(0).build_id_hash());
+  EXPECT_EQ(sequential_reader.proto().SerializeAsString(),
+            parallel_reader.proto().SerializeAsString());
+}
+
+namespace {
+
+// Compresses |events| as perf record -z does, into a zstd stream that isn't
+// ended, and splits it into PERF_RECORD_COMPRESSED records, or
+// PERF_RECORD_COMPRESSED2 ones if |compressed2|, of at most |max_data_size|
+// bytes of it, so that events straddle the records.
+std::string CompressEvents(const std::string& events, size_t max_data_size,
+                           bool compressed2) {
+  ZSTD_CStream* stream = ZSTD_createCStream();
+  ZSTD_initCStream(stream, 1);
+  std::string data(ZSTD_compressBound(events.size()) + 64, '\0');
+  ZSTD_inBuffer input = {events.data(), events.size(), 0};
+  ZSTD_outBuffer output = {&data[0], data.size(), 0};
+  while (input.pos < input.size) ZSTD_compressStream(stream, &output, &input);
+  while (ZSTD_flushStream(stream, &output) != 0) {
+  }
+  ZSTD_freeCStream(stream);
+  data.resize(output.pos);
+
+  std::string records;
+  for (size_t i = 0; i < data.size(); i += max_data_size) {
+    const u64 size = std::min(max_data_size, data.size() - i);
+    const u64 padded_size = Align<u64>(size);
+    perf_event_header header;
+    header.type =
+        compressed2 ? PERF_RECORD_COMPRESSED2 : PERF_RECORD_COMPRESSED;
+    header.misc = 0;
+    header.size = sizeof(header) +
+                  (compressed2 ? sizeof(size) + padded_size : size);
+    records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (compressed2) {
+      records.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    }
+    records.append(data, i, size);
+    if (compressed2) records.append(padded_size - size, '\0');
+  }
+  return records;
+}
+
+}  // namespace
+
+TEST(PerfReaderTest, ReadsCompressedEvents) {
+  std::stringstream input_data;
+  for (int i = 0; i < 50000; ++i) {
+    if (i % 1000 == 0) {
+      std::vector<u8> build_id(20, static_cast<u8>(i / 1000 + 1));
+      testing::ExampleMmap2Event(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                                 testing::SampleInfo().Tid(1001))
+          .WithMisc(PERF_RECORD_MISC_MMAP_BUILD_ID)
+          .WithBuildId(build_id.data(), build_id.size())
+          .WriteTo(&input_data);
+    }
+    if (i % 5000 == 0) {
+      testing::ExampleAuxtraceEvent(9, 0x2000, 7, 3, 0x68d, 4, 0, "/dev/zero")
+          .WriteTo(&input_data);
+    }
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001, 1002))
+        .WriteTo(&input_data);
+  }
+  const std::string events = input_data.str();
+  auto perf_data = [](const std::string& data) {
+    std::stringstream input;
+    testing::ExamplePerfDataFileHeader file_header(0);
+    file_header.WithAttrCount(1).WithDataSize(data.size()).WriteTo(&input);
+    testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                          true /*sample_id_all*/)
+        .WriteTo(&input);
+    input << data;
+    return input.str();
+  };
+  PerfReader expected;
+  ASSERT_TRUE(expected.ReadFromString(perf_data(events)));
+  ASSERT_EQ(50000 + 50 + 10, expected.events().size());
+
+  for (bool compressed2 : {false, true}) {
+    const std::string compressed = CompressEvents(events, 4000, compressed2);
+    ASSERT_LT(compressed.size(), events.size() / 4);
+    for (size_t num_threads : {1, 4}) {
+      PerfReader reader;
+      reader.SetNumDecodeThreads(num_threads);
+      ASSERT_TRUE(reader.ReadFromString(perf_data(compressed)))
+          << compressed2 << " " << num_threads;
+      EXPECT_EQ(expected.proto().SerializeAsString(),
+                reader.proto().SerializeAsString())
+          << compressed2 << " " << num_threads;
+    }
+  }
+
+  // The events of piped data are compressed the same way.
+  std::stringstream piped_input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&piped_input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&piped_input);
+  piped_input << CompressEvents(events, 4000, false);
+  const std::string piped = piped_input.str();
+  PerfReader piped_reader;
+  ASSERT_TRUE(piped_reader.ReadFromString(piped));
+  PerfReader fed_reader;
+  for (size_t i = 0; i < piped.size(); i += 1000) {
+    ASSERT_TRUE(fed_reader.Feed(piped.data() + i,
+                                std::min<size_t>(1000, piped.size() - i)));
+  }
+  ASSERT_TRUE(fed_reader.Finish());
+  for (const PerfReader* reader : {&piped_reader, &fed_reader}) {
+    ASSERT_EQ(expected.events().size(), reader->events().size());
+    for (int i = 0; i < expected.events().size(); ++i) {
+      EXPECT_EQ(expected.events().Get(i).SerializeAsString(),
+                reader->events().Get(i).SerializeAsString())
+          << i;
+    }
+  }
+
+  // The compressed events can't end in the middle of an event.
+  const std::string truncated =
+      CompressEvents(events.substr(0, events.size() - 1), 4000, false);
+  for (size_t num_threads : {1, 4}) {
+    PerfReader reader;
+    reader.SetNumDecodeThreads(num_threads);
+    EXPECT_FALSE(reader.ReadFromString(perf_data(truncated))) << num_threads;
+  }
+}
+
+TEST(PerfReaderTest, ArenaOptionsForInputSize) {
+  const ArenaOptions default_options;
+  // Small inputs use the default block sizes.
+  ArenaOptions options = PerfReader::ArenaOptionsForInputSize(1);
+  EXPECT_EQ(default_options.start_block_size, options.start_block_size);
+  EXPECT_EQ(default_options.max_block_size, options.max_block_size);
+
+  options = PerfReader::ArenaOptionsForInputSize(1024 * 1024);
+  EXPECT_EQ(1024 * 1024, options.start_block_size);
+  EXPECT_EQ(1024 * 1024, options.max_block_size);
+
+  // The first block is capped for very large inputs.
+  options = PerfReader::ArenaOptionsForInputSize(size_t{1} << 40);
+  EXPECT_GT(size_t{1} << 40, options.start_block_size);
+  EXPECT_EQ(options.start_block_size, options.max_block_size);
+}
+
+TEST(PerfReaderTest, StoresSamplesInColumns) {
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1234).Tid(1001, 1002))
+      .WriteTo(&input_data);
+  testing::ExampleMmapEvent(1001, 0x1c2000, 0x1000, 0, "/usr/lib/bar.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c2234).Tid(1001, 1002))
+      .WriteTo(&input_data);
+
+  std::stringstream input;
+
+  // header
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+
+  // attrs
+  ASSERT_EQ(file_header.header().attrs.offset, static_cast<u64>(input.tellp()));
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // data
+  ASSERT_EQ(file_header.header().data.offset, static_cast<u64>(input.tellp()));
+  input << input_data.str();
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  SampleColumns columns;
+  PerfReader columns_reader;
+  columns_reader.SetSampleColumns(&columns);
+  ASSERT_TRUE(columns_reader.ReadFromString(input.str()));
+
+  // Only the mmaps are in the proto.
+  ASSERT_EQ(2, columns_reader.events().size());
+  EXPECT_EQ(PERF_RECORD_MMAP, columns_reader.events().Get(0).header().type());
+  EXPECT_EQ(PERF_RECORD_MMAP, columns_reader.events().Get(1).header().type());
+  ASSERT_EQ(2, columns.size());
+  EXPECT_EQ(1, columns.event_index(0));
+  EXPECT_EQ(2, columns.event_index(1));
+
+  // The samples are merged back when serializing.
+  PerfDataProto proto;
+  ASSERT_TRUE(columns_reader.Serialize(&proto));
+  ASSERT_EQ(reader.events().size(), proto.events_size());
+  for (int i = 0; i < proto.events_size(); ++i) {
+    EXPECT_EQ(reader.events().Get(i).SerializeAsString(),
+              proto.events(i).SerializeAsString())
+        << "event " << i;
+  }
+
+  // Releasing the proto merges them as well, and takes the stored events
+  // instead of copies.
+  const PerfEvent* mmap_event = &columns_reader.events().Get(0);
+  PerfDataProto released_proto;
+  ASSERT_TRUE(columns_reader.SerializeAndRelease(&released_proto));
+  EXPECT_EQ(mmap_event, &released_proto.events(0));
+  proto.clear_timestamp_sec();
+  released_proto.clear_timestamp_sec();
+  EXPECT_EQ(proto.SerializeAsString(), released_proto.SerializeAsString());
+}
+
+TEST(PerfReaderTest, ReadsOnlySelectedProcesses) {
+  std::stringstream input_data;
+  testing::ExampleCommEvent(1001, 1001, "server",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/bin/server",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  testing::ExampleMmapEvent(-1, 0x8000000, 0x100000, 0, "[kernel.kallsyms]",
+                            testing::SampleInfo().Tid(-1))
+      .WithMisc(PERF_RECORD_MISC_KERNEL)
+      .WriteTo(&input_data);
+  testing::ExampleMmapEvent(2002, 0x1c1000, 0x1000, 0, "/usr/bin/other",
+                            testing::SampleInfo().Tid(2002))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1234).Tid(1001, 1002))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1234).Tid(2002, 2002))
+      .WriteTo(&input_data);
+  // The child of the selected process is selected too.
+  testing::ExampleForkEvent(3003, 1001, 3003, 1001, 0,
+                            testing::SampleInfo().Tid(3003))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1234).Tid(3003, 3003))
+      .WriteTo(&input_data);
+  // A thread's name doesn't select its process.
+  testing::ExampleCommEvent(2002, 2003, "server",
+                            testing::SampleInfo().Tid(2002, 2003))
+      .WriteTo(&input_data);
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x8001000).Tid(2002, 2003))
+      .WriteTo(&input_data);
+  testing::ExampleExitEvent(2002, 1, 2002, 1, 0,
+                            testing::SampleInfo().Tid(2002))
+      .WriteTo(&input_data);
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+
+  auto event_pids = [](const PerfReader& reader) {
+    std::vector<std::pair<u32, u32>> pids;
+    for (const auto& event : reader.events()) {
+      u32 pid;
+      if (event.has_sample_event()) {
+        pid = event.sample_event().pid();
+      } else if (event.has_mmap_event()) {
+        pid = event.mmap_event().pid();
+      } else if (event.has_comm_event()) {
+        pid = event.comm_event().pid();
+      } else if (event.has_fork_event()) {
+        pid = event.fork_event().pid();
+      } else {
+        pid = event.exit_event().pid();
+      }
+      pids.emplace_back(event.header().type(), pid);
+    }
+    return pids;
+  };
+
+  PerfReader::ProcessFilter by_comm;
+  by_comm.comms = {"server"};
+  PerfReader comm_reader;
+  comm_reader.SetProcessFilter(by_comm);
+  ASSERT_TRUE(comm_reader.ReadFromString(input.str()));
+  const std::vector<std::pair<u32, u32>> want_by_comm = {
+      {PERF_RECORD_COMM, 1001},
+      {PERF_RECORD_MMAP, 1001},
+      {PERF_RECORD_MMAP, -1},
+      {PERF_RECORD_SAMPLE, 1001},
+      {PERF_RECORD_FORK, 3003},
+      {PERF_RECORD_SAMPLE, 3003},
+  };
+  EXPECT_EQ(want_by_comm, event_pids(comm_reader));
+  EXPECT_EQ(5, comm_reader.num_filtered_events());
+  EXPECT_EQ((std::unordered_set<u32>{1001, 3003}),
+            comm_reader.process_filter().pids);
+
+  PerfReader::ProcessFilter by_pid;
+  by_pid.pids = {2002};
+  PerfReader pid_reader;
+  pid_reader.SetProcessFilter(by_pid);
+  ASSERT_TRUE(pid_reader.ReadFromString(input.str()));
+  const std::vector<std::pair<u32, u32>> want_by_pid = {
+      {PERF_RECORD_MMAP, -1},
+      {PERF_RECORD_MMAP, 2002},
+      {PERF_RECORD_SAMPLE, 2002},
+      {PERF_RECORD_COMM, 2002},
+      {PERF_RECORD_SAMPLE, 2002},
+      {PERF_RECORD_EXIT, 2002},
+  };
+  EXPECT_EQ(want_by_pid, event_pids(pid_reader));
+  EXPECT_EQ(5, pid_reader.num_filtered_events());
+
+  // An empty filter keeps all the events.
+  PerfReader reader;
+  reader.SetProcessFilter(PerfReader::ProcessFilter());
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  EXPECT_EQ(11, reader.events().size());
+  EXPECT_EQ(0, reader.num_filtered_events());
+}
+
+TEST(PerfReaderTest, ReadsTimeRange) {
+  std::stringstream input_data;
+  auto sample = [&input_data](u64 time) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1234).Tid(1001).Time(time))
+        .WriteTo(&input_data);
+  };
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/bin/server",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&input_data);
+  sample(150);
+  testing::FinishedRoundEvent().WriteTo(&input_data);
+  sample(200);
+  testing::ExampleMmapEvent(1001, 0x2c1000, 0x1000, 0, "/usr/lib/libfoo.so",
+                            testing::SampleInfo().Tid(1001).Time(250))
+      .WriteTo(&input_data);
+  sample(260);
+  testing::FinishedRoundEvent().WriteTo(&input_data);
+  sample(300);
+  sample(350);
+  testing::FinishedRoundEvent().WriteTo(&input_data);
+  sample(400);
+  testing::ExampleMmapEvent(1001, 0x3c1000, 0x1000, 0, "/usr/lib/libbar.so",
+                            testing::SampleInfo().Tid(1001).Time(410))
+      .WriteTo(&input_data);
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+  ScopedTempFile file;
+  ASSERT_TRUE(BufferToFile(file.path(), input.str()));
+
+  auto event_times = [](const PerfReader& reader) {
+    std::vector<std::pair<u32, u64>> times;
+    for (const auto& event : reader.events()) {
+      times.emplace_back(event.header().type(), event.timestamp());
+    }
+    return times;
+  };
+  // The mmap before the range is kept, but not the samples before or after
+  // it, and the last round is skipped.
+  const std::vector<std::pair<u32, u64>> expected = {
+      {PERF_RECORD_MMAP, 100},
+      {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_MMAP, 250},
+      {PERF_RECORD_SAMPLE, 260},
+      {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_SAMPLE, 300},
+      {PERF_RECORD_FINISHED_ROUND, 0},
+  };
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadTimeRange(file.path(), 250, 320));
+  EXPECT_EQ(expected, event_times(reader));
+  EXPECT_EQ(2, reader.num_filtered_events());
+  const PerfReader::TimeIndex& index = reader.time_index();
+  ASSERT_EQ(4, index.size());
+  EXPECT_EQ(0, index[0].offset);
+  EXPECT_EQ(100, index[0].min_time);
+  EXPECT_EQ(150, index[0].max_time);
+  EXPECT_EQ(200, index[1].min_time);
+  EXPECT_EQ(260, index[1].max_time);
+  EXPECT_EQ(300, index[2].min_time);
+  EXPECT_EQ(350, index[2].max_time);
+  EXPECT_EQ(400, index[3].min_time);
+  EXPECT_EQ(410, index[3].max_time);
+  for (size_t i = 1; i < index.size(); ++i) {
+    EXPECT_LT(index[i - 1].offset, index[i].offset);
+  }
+
+  // The index can be reused.
+  PerfReader indexed_reader;
+  indexed_reader.SetTimeIndex(index);
+  ASSERT_TRUE(indexed_reader.ReadTimeRange(file.path(), 250, 320));
+  EXPECT_EQ(expected, event_times(indexed_reader));
+
+  // A range past the end keeps only the events other than samples.
+  PerfReader late_reader;
+  late_reader.SetTimeIndex(index);
+  ASSERT_TRUE(late_reader.ReadTimeRange(file.path(), 1000, 2000));
+  for (const auto& event : late_reader.events()) {
+    EXPECT_NE(PERF_RECORD_SAMPLE, event.header().type());
+  }
+  EXPECT_EQ(6, late_reader.events().size());
+}
+
+TEST(PerfReaderTest, ReadsDirectory) {
+  auto sample = [](u64 time, std::stringstream* out) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1234).Tid(1001).Time(time))
+        .WriteTo(out);
+  };
+  // The data file holds the header and the events synthesized by perf.
+  std::stringstream main_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/bin/server",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&main_data);
+  sample(300, &main_data);
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(main_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << main_data.str();
+
+  // The data.N files only hold events.
+  std::stringstream thread_data[2];
+  sample(150, &thread_data[0]);
+  sample(350, &thread_data[0]);
+  testing::ExampleMmapEvent(1001, 0x2c1000, 0x1000, 0, "/usr/lib/libfoo.so",
+                            testing::SampleInfo().Tid(1001).Time(200))
+      .WriteTo(&thread_data[1]);
+  sample(250, &thread_data[1]);
+  sample(400, &thread_data[1]);
+
+  ScopedTempDir dir;
+  ASSERT_TRUE(BufferToFile(dir.path() + "data", input.str()));
+  ASSERT_TRUE(BufferToFile(dir.path() + "data.0", thread_data[0].str()));
+  ASSERT_TRUE(BufferToFile(dir.path() + "data.1", thread_data[1].str()));
+  ASSERT_TRUE(BufferToFile(dir.path() + "data.tmp", std::string("junk")));
+
+  PerfReader reader;
+  reader.SetNumDecodeThreads(2);
+  ASSERT_TRUE(reader.ReadDirectory(dir.path()));
+  std::vector<std::pair<u32, u64>> times;
+  for (const auto& event : reader.events()) {
+    times.emplace_back(event.header().type(), event.timestamp());
+  }
+  const std::vector<std::pair<u32, u64>> expected = {
+      {PERF_RECORD_MMAP, 100},   {PERF_RECORD_SAMPLE, 150},
+      {PERF_RECORD_MMAP, 200},   {PERF_RECORD_SAMPLE, 250},
+      {PERF_RECORD_SAMPLE, 300}, {PERF_RECORD_SAMPLE, 350},
+      {PERF_RECORD_SAMPLE, 400},
+  };
+  EXPECT_EQ(expected, times);
+
+  // A truncated data.N file is an error.
+  ASSERT_TRUE(BufferToFile(dir.path() + "data.2",
+                           thread_data[0].str().substr(0, 10)));
+  PerfReader truncated_reader;
+  EXPECT_FALSE(truncated_reader.ReadDirectory(dir.path()));
+}
+
+TEST(PerfReaderTest, InjectsBuildIdsAndLocalizesMmapEvents) {
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WithMisc(PERF_RECORD_MISC_USER)
+      .WriteTo(&input_data);
+  for (int i = 0; i < 100; ++i) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001))
+        .WriteTo(&input_data);
+  }
+  testing::ExampleMmap2Event(1001, 0x2c1000, 0x1000, 0, "/usr/lib/bar.so",
+                             testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+
+  PerfReader sequential_reader;
+  ASSERT_TRUE(sequential_reader.ReadFromString(input.str()));
+  PerfReader parallel_reader;
+  parallel_reader.SetNumDecodeThreads(4);
+  ASSERT_TRUE(parallel_reader.ReadFromString(input.str()));
+
+  for (PerfReader* reader : {&sequential_reader, &parallel_reader}) {
+    ASSERT_TRUE(reader->InjectBuildIDs({{"/usr/lib/foo.so", "c001d00d"},
+                                        {"/usr/lib/baz.so", "deadbeef"}}));
+    ASSERT_EQ(2, reader->build_ids().size());
+    // The misc field is taken from the mmap of the file, if there is one.
+    EXPECT_EQ("/usr/lib/baz.so", reader->build_ids().Get(0).filename());
+    EXPECT_EQ(PERF_RECORD_MISC_KERNEL, reader->build_ids().Get(0).misc());
+    EXPECT_EQ("/usr/lib/foo.so", reader->build_ids().Get(1).filename());
+    EXPECT_EQ(PERF_RECORD_MISC_USER, reader->build_ids().Get(1).misc());
+
+    ASSERT_TRUE(reader->LocalizeUsingFilenames(
+        {{"/usr/lib/foo.so", "/tmp/foo.so"}, {"/usr/lib/bar.so", "/b.so"}}));
+    ASSERT_EQ(102, reader->events().size());
+    EXPECT_EQ("/tmp/foo.so", reader->events().Get(0).mmap_event().filename());
+    EXPECT_EQ("/b.so", reader->events().Get(101).mmap_event().filename());
+
+    // An mmap added afterwards is localized too.
+    *reader->mutable_events()->Add() = reader->events().Get(0);
+    ASSERT_TRUE(
+        reader->LocalizeUsingFilenames({{"/tmp/foo.so", "/opt/foo.so"}}));
+    EXPECT_EQ("/opt/foo.so", reader->events().Get(0).mmap_event().filename());
+    EXPECT_EQ("/opt/foo.so", reader->events().Get(102).mmap_event().filename());
+  }
+}
+
+TEST(PerfReaderTest, InjectsBuildIdsOfIndexForMentionedFiles) {
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  testing::ExampleMmap2Event(1001, 0x2c1000, 0x1000, 0, "/usr/lib/bar.so",
+                             testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+
+  const std::map<std::string, std::string> build_ids = {
+      {"/usr/lib/foo.so", "c001d00d"},
+      {"/usr/lib/bar.so", "0123456789abcdef0123456789abcdef00000000"},
+      {"/usr/lib/baz.so", "deadbeef"},
+      {"[kernel.kallsyms]", "f00d"},
+      {"/usr/lib/bad.so", "not hex!"},
+  };
+  const BuildIdIndex index(build_ids);
+  EXPECT_EQ(4, index.size());
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  reader.InjectIndexedBuildIDs(index, {"[kernel.kallsyms]"});
+  // The build IDs are those the map of them would inject, but only for the
+  // files mentioned.
+  PerfReader map_reader;
+  ASSERT_TRUE(map_reader.ReadFromString(input.str()));
+  ASSERT_TRUE(map_reader.InjectBuildIDs(build_ids));
+  std::map<std::string, PerfDataProto_PerfBuildID> expected;
+  for (const auto& build_id : map_reader.build_ids()) {
+    expected[build_id.filename()] = build_id;
+  }
+  ASSERT_EQ(3, reader.build_ids().size());
+  for (const auto& build_id : reader.build_ids()) {
+    EXPECT_EQ(expected[build_id.filename()].SerializeAsString(),
+              build_id.SerializeAsString())
+        << build_id.filename();
+  }
+  EXPECT_EQ("/usr/lib/foo.so", reader.build_ids().Get(0).filename());
+  EXPECT_EQ("/usr/lib/bar.so", reader.build_ids().Get(1).filename());
+  EXPECT_EQ(16, reader.build_ids().Get(1).build_id_hash().size());
+  EXPECT_EQ("[kernel.kallsyms]", reader.build_ids().Get(2).filename());
+  EXPECT_EQ(PERF_RECORD_MISC_KERNEL, reader.build_ids().Get(2).misc());
+
+  // The build IDs of existing build ID events are replaced.
+  const std::map<std::string, std::string> new_build_ids = {
+      {"/usr/lib/foo.so", "abcd"}};
+  reader.InjectIndexedBuildIDs(BuildIdIndex(new_build_ids));
+  ASSERT_EQ(3, reader.build_ids().size());
+  EXPECT_EQ(std::string("\xab\xcd"), reader.build_ids().Get(0).build_id_hash());
+}
+
+TEST(PerfReaderTest, WritesSameFileAsBuffer) {
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  testing::ExampleCommEvent(1001, 1001, "server",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&input_data);
+  for (int i = 0; i < 100; ++i) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001))
+        .WriteTo(&input_data);
+  }
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  ASSERT_TRUE(reader.InjectBuildIDs({{"/usr/lib/foo.so", "c001d00d"}}));
+  std::string buffer;
+  ASSERT_TRUE(reader.WriteToString(&buffer));
+
+  ScopedTempFile file;
+  ASSERT_TRUE(reader.WriteFile(file.path()));
+  std::vector<char> contents;
+  ASSERT_TRUE(FileToBuffer(file.path(), &contents));
+  // The buffer may be larger than needed, as some metadata sizes are counted
+  // even if the metadata isn't written.
+  ASSERT_LE(contents.size(), buffer.size());
+  EXPECT_EQ(buffer.substr(0, contents.size()),
+            std::string(contents.begin(), contents.end()));
+
+  PerfReader buffer_reader;
+  ASSERT_TRUE(buffer_reader.ReadFromString(buffer));
+  PerfReader file_reader;
+  ASSERT_TRUE(file_reader.ReadFile(file.path()));
+  EXPECT_EQ(buffer_reader.proto().SerializeAsString(),
+            file_reader.proto().SerializeAsString());
+}
+
+TEST(PerfReaderTest, FailedWriteKeepsExistingFile) {
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1).WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP, true /*sample_id_all*/)
+      .WriteTo(&input);
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+
+  // The temporary file can't be created where a directory already is.
+  ScopedTempFile file;
+  const std::string old_contents = "old perf data";
+  ASSERT_TRUE(BufferToFile(file.path(), old_contents));
+  const std::string temp_path =
+      file.path() + ".tmp." + std::to_string(getpid());
+  ASSERT_EQ(0, mkdir(temp_path.c_str(), 0700));
+  EXPECT_FALSE(reader.WriteFile(file.path()));
+  ASSERT_EQ(0, rmdir(temp_path.c_str()));
+  std::vector<char> contents;
+  ASSERT_TRUE(FileToBuffer(file.path(), &contents));
+  EXPECT_EQ(old_contents, std::string(contents.begin(), contents.end()));
+
+  // A directory can't be replaced by a file, and the temporary file is
+  // removed.
+  ScopedTempDir dir;
+  const std::string dir_path = dir.path() + "perf.data";
+  ASSERT_EQ(0, mkdir(dir_path.c_str(), 0700));
+  EXPECT_FALSE(reader.WriteFile(dir_path));
+  EXPECT_FALSE(FileExists(dir_path + ".tmp." + std::to_string(getpid())));
+  ASSERT_EQ(0, rmdir(dir_path.c_str()));
+
+  ASSERT_TRUE(reader.WriteFile(file.path()));
+  ASSERT_TRUE(FileToBuffer(file.path(), &contents));
+  EXPECT_NE(old_contents, std::string(contents.begin(), contents.end()));
+}
+
+TEST(PerfReaderTest, WritesDataSectionOnMultipleThreads) {
+  std::stringstream input_data;
+  for (int i = 0; i < 20000; ++i) {
+    if (i % 1000 == 0) {
+      testing::ExampleMmapEvent(1001, 0x1c1000 + i, 0x1000, 0,
+                                "/usr/lib/foo.so",
+                                testing::SampleInfo().Tid(1001))
+          .WriteTo(&input_data);
+    }
+    if (i % 5000 == 0) {
+      testing::ExampleAuxtraceEvent(9, 0x2000, 7, 3, 0x68d, 4, 0, "/dev/zero")
+          .WriteTo(&input_data);
+    }
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001, 1002))
+        .WriteTo(&input_data);
+  }
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_IP | PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(input.str()));
+  std::string sequential_output;
+  ASSERT_TRUE(reader.WriteToString(&sequential_output));
+  reader.SetNumEncodeThreads(4);
+  std::string parallel_output;
+  ASSERT_TRUE(reader.WriteToString(&parallel_output));
+  EXPECT_EQ(sequential_output, parallel_output);
+
+  // An event whose size doesn't match its contents fails the write.
+  reader.mutable_events()->Mutable(15000)->mutable_header()->set_size(8);
+  EXPECT_FALSE(reader.WriteToString(&parallel_output));
+}
+
 }  // namespace quipper
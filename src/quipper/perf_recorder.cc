@@ -16,6 +16,8 @@
 #include "perf_option_parser.h"
 #include "perf_parser.h"
 #include "perf_protobuf_io.h"
+#include "perf_reader.h"
+#include "perf_serializer.h"
 #include "perf_stat_parser.h"
 #include "run_command.h"
 #include "scoped_temp_path.h"
@@ -30,12 +32,8 @@ const char kPerfStatCommand[] = "stat";
 const char kPerfMemCommand[] = "mem";
 const char kPerfInjectCommand[] = "inject";
 
-// Reads a perf data file and converts it to a PerfDataProto, which is stored as
-// a serialized string in |output_string|. Returns true on success.
-bool ParsePerfDataFileToString(const std::string& filename,
-                               std::string* output_string) {
-  // Now convert it into a protobuf.
-
+// Returns the options to convert recorded perf data to a PerfDataProto with.
+PerfParserOptions RecordedDataParserOptions() {
   PerfParserOptions options;
   // Make sure to remap address for security reasons.
   options.do_remap = true;
@@ -45,10 +43,16 @@ bool ParsePerfDataFileToString(const std::string& filename,
   options.read_missing_buildids = true;
   // Resolve split huge pages mappings.
   options.deduce_huge_page_mappings = true;
+  return options;
+}
 
-  PerfDataProto perf_data;
-  return SerializeFromFileWithOptions(filename, options, &perf_data) &&
-         perf_data.SerializeToString(output_string);
+// Reads a perf data file and converts it to a PerfDataProto with |options|,
+// which is stored as a serialized string in |output_string|. Returns true on
+// success.
+bool ParsePerfDataFileToString(const std::string& filename,
+                               const PerfParserOptions& options,
+                               std::string* output_string) {
+  return SerializeFromFileToString(filename, options, output_string);
 }
 
 // Reads a perf data file and converts it to a PerfStatProto, which is stored as
@@ -91,6 +95,16 @@ bool IsRecordingETM(const std::vector<std::string>& perf_args) {
   return false;
 }
 
+// Returns whether |inject_args| only ask perf inject for the build IDs of the
+// hit DSOs, which the parser reads as well.
+bool OnlyInjectsBuildIds(const std::vector<std::string>& inject_args) {
+  if (inject_args.size() < 3) return false;
+  for (auto it = inject_args.begin() + 2; it != inject_args.end(); ++it) {
+    if (*it != "-b" && *it != "--build-ids") return false;
+  }
+  return true;
+}
+
 }  // namespace
 
 PerfRecorder::PerfRecorder() : PerfRecorder({"/usr/bin/perf"}) {}
@@ -104,14 +118,14 @@ PerfRecorder::PerfRecorder(const std::vector<std::string>& perf_binary_command)
 // - Add our own paramters.
 std::vector<std::string> PerfRecorder::FullPerfCommand(
     const std::vector<std::string>& perf_args, const double time_sec,
-    const ScopedTempFile& output_file) {
+    const std::string& output_path) {
   const std::string& perf_type = perf_args[1];
 
   std::vector<std::string> full_perf_args(perf_binary_command_);
   full_perf_args.insert(full_perf_args.end(),
                         perf_args.begin() + 1,  // skip "perf"
                         perf_args.end());
-  full_perf_args.insert(full_perf_args.end(), {"-o", output_file.path()});
+  full_perf_args.insert(full_perf_args.end(), {"-o", output_path});
 
   // The perf stat output parser requires raw data from verbose output.
   if (perf_type == kPerfStatCommand) full_perf_args.emplace_back("-v");
@@ -130,9 +144,9 @@ std::vector<std::string> PerfRecorder::FullPerfCommand(
   return full_perf_args;
 }
 
-bool PerfRecorder::RunCommandAndGetSerializedOutput(
-    const std::vector<std::string>& perf_args, const double time_sec,
-    const std::vector<std::string>& inject_args, std::string* output_string) {
+bool PerfRecorder::ValidateCommands(
+    const std::vector<std::string>& perf_args,
+    const std::vector<std::string>& inject_args) const {
   if (!ValidatePerfCommandLine(perf_args)) {
     LOG(ERROR) << "Perf arguments are not safe to run";
     return false;
@@ -145,7 +159,7 @@ bool PerfRecorder::RunCommandAndGetSerializedOutput(
   if (perf_type != kPerfRecordCommand && perf_type != kPerfStatCommand &&
       perf_type != kPerfMemCommand) {
     LOG(ERROR) << "Unsupported perf subcommand: " << perf_type;
-    return {};
+    return false;
   }
 
   if (perf_type == kPerfRecordCommand && IsRecordingETM(perf_args) &&
@@ -154,8 +168,44 @@ bool PerfRecorder::RunCommandAndGetSerializedOutput(
     return false;
   }
 
+  if (inject_args.empty()) return true;
+
+  if (!ValidatePerfCommandLine(inject_args)) {
+    LOG(ERROR) << "Perf inject arguments are not safe to run";
+    return false;
+  }
+
+  const std::string& inject_command = inject_args[1];
+  if (inject_command != kPerfInjectCommand) {
+    LOG(ERROR) << "Unsupported perf subcommand for perf inject: "
+               << inject_command;
+    return false;
+  }
+  return true;
+}
+
+bool PerfRecorder::RunsInject(
+    const std::vector<std::string>& inject_args) const {
+  return !inject_args.empty() &&
+         !(inject_build_ids_in_process_ && OnlyInjectsBuildIds(inject_args));
+}
+
+PerfParserOptions PerfRecorder::ParserOptions() const {
+  PerfParserOptions options = RecordedDataParserOptions();
+  options.num_build_id_threads = num_build_id_threads_;
+  options.build_id_cache = build_id_cache_;
+  return options;
+}
+
+bool PerfRecorder::RunCommandAndGetSerializedOutput(
+    const std::vector<std::string>& perf_args, const double time_sec,
+    const std::vector<std::string>& inject_args, std::string* output_string) {
+  if (!ValidateCommands(perf_args, inject_args)) return false;
+  const std::string& perf_type = perf_args[1];
+
   ScopedTempFile output_file;
-  auto full_perf_args = FullPerfCommand(perf_args, time_sec, output_file);
+  auto full_perf_args =
+      FullPerfCommand(perf_args, time_sec, output_file.path());
 
   // The perf command writes the output to a file, so ignore stdout.
   int status = RunCommand(full_perf_args, nullptr);
@@ -164,9 +214,11 @@ bool PerfRecorder::RunCommandAndGetSerializedOutput(
     return false;
   }
 
-  if (inject_args.empty()) {
-    if (perf_type == kPerfRecordCommand || perf_type == kPerfMemCommand)
-      return ParsePerfDataFileToString(output_file.path(), output_string);
+  if (!RunsInject(inject_args)) {
+    if (perf_type == kPerfRecordCommand || perf_type == kPerfMemCommand) {
+      return ParsePerfDataFileToString(output_file.path(), ParserOptions(),
+                                       output_string);
+    }
 
     // Otherwise, parse as perf stat output.
     return ParsePerfStatFileToString(output_file.path(), full_perf_args,
@@ -174,20 +226,10 @@ bool PerfRecorder::RunCommandAndGetSerializedOutput(
   }
 
   // If provided, run perf inject on the previous output of perf.
-  if (!ValidatePerfCommandLine(inject_args)) {
-    LOG(ERROR) << "Perf inject arguments are not safe to run";
-    return false;
-  }
-
-  const std::string& inject_command = inject_args[1];
-  if (inject_command != kPerfInjectCommand) {
-    LOG(ERROR) << "Unsupported perf subcommand for perf inject: "
-               << inject_command;
-    return false;
-  }
   ScopedTempFile& inject_input = output_file;
   ScopedTempFile inject_output;
-  auto full_inject_args = FullPerfCommand(inject_args, 0, inject_output);
+  auto full_inject_args =
+      FullPerfCommand(inject_args, 0, inject_output.path());
   full_inject_args.emplace_back("-i");
   full_inject_args.emplace_back(inject_input.path());
   status = RunCommand(full_inject_args, nullptr);
@@ -195,7 +237,48 @@ bool PerfRecorder::RunCommandAndGetSerializedOutput(
     PLOG(ERROR) << "perf inject failed with status: " << status << ", Error";
     return false;
   }
-  return ParsePerfDataFileToString(inject_output.path(), output_string);
+  return ParsePerfDataFileToString(inject_output.path(), ParserOptions(),
+                                   output_string);
+}
+
+bool PerfRecorder::RunCommandAndWriteSerializedOutput(
+    const std::vector<std::string>& perf_args, const double time_sec,
+    const std::vector<std::string>& inject_args, int output_fd) {
+  if (!ValidateCommands(perf_args, inject_args)) return false;
+  if (perf_args[1] == kPerfStatCommand) {
+    LOG(ERROR) << "perf stat output can't be streamed";
+    return false;
+  }
+
+  std::vector<std::vector<std::string>> commands = {
+      FullPerfCommand(perf_args, time_sec, "-")};
+  if (RunsInject(inject_args)) {
+    commands.push_back(FullPerfCommand(inject_args, 0, "-"));
+    commands.back().insert(commands.back().end(), {"-i", "-"});
+  }
+
+  PerfReader reader;
+  int status = RunPipeline(commands, [&reader](const char* data, size_t size) {
+    return reader.Feed(data, size);
+  });
+  if (status != 0) {
+    PLOG(ERROR) << "perf command failed with status: " << status << ", Error";
+    return false;
+  }
+  if (!reader.Finish()) return false;
+
+  PerfParser parser(&reader, ParserOptions());
+  if (!parser.ParseRawEvents()) return false;
+
+  // Serialize the proto of the reader in place rather than a copy of it, like
+  // PerfReader::Serialize() makes.
+  PerfDataProto* perf_data = reader.SerializeInPlace();
+  PerfSerializer::SerializeParserStats(parser.stats(), perf_data);
+  if (!perf_data->SerializeToFileDescriptor(output_fd)) {
+    LOG(ERROR) << "Failed to write the serialized perf data";
+    return false;
+  }
+  return true;
 }
 
 }  // namespace quipper
@@ -13,6 +13,9 @@
 
 namespace quipper {
 
+class BuildIdCache;
+struct PerfParserOptions;
+
 class PerfRecorder {
  public:
   PerfRecorder();
@@ -32,6 +35,27 @@ class PerfRecorder {
       const std::vector<std::string>& perf_args, const double time_sec,
       const std::vector<std::string>& inject_args, std::string* output_string);
 
+  // Like RunCommandAndGetSerializedOutput(), for "perf record" and "perf mem",
+  // but without temporary files: perf writes piped data to a pipe, through
+  // perf inject if |inject_args| are provided, which is parsed as it arrives.
+  // The serialized PerfDataProto is written to |output_fd|.
+  bool RunCommandAndWriteSerializedOutput(
+      const std::vector<std::string>& perf_args, const double time_sec,
+      const std::vector<std::string>& inject_args, int output_fd);
+
+  // Makes the two functions above inject the build IDs of the DSOs hit by the
+  // samples, when |inject_args| ask perf inject for nothing else, i.e. are
+  // "perf inject -b", while they parse the perf data, instead of running perf
+  // inject, which reads and writes all the data again. The build IDs are read
+  // on up to |num_threads| threads, and looked up in and added to |cache| if
+  // not null, which must outlive the recorder.
+  void InjectBuildIdsInProcess(int num_threads = 1,
+                               BuildIdCache* cache = nullptr) {
+    inject_build_ids_in_process_ = true;
+    num_build_id_threads_ = num_threads;
+    build_id_cache_ = cache;
+  }
+
   // The command prefix for running perf. e.g., "perf", or "/usr/bin/perf",
   // or perhaps {"sudo", "/usr/bin/perf"}.
   const std::vector<std::string>& perf_binary_command() const {
@@ -40,9 +64,26 @@ class PerfRecorder {
 
  private:
   const std::vector<std::string> perf_binary_command_;
+  // Returns the command to run for |perf_args|, which writes its output to
+  // |output_path|, "-" meaning stdout.
   std::vector<std::string> FullPerfCommand(
       const std::vector<std::string>& perf_args, const double time_sec,
-      const ScopedTempFile& output_file);
+      const std::string& output_path);
+
+  // Returns whether |perf_args| and |inject_args| may be run, logging why
+  // not otherwise.
+  bool ValidateCommands(const std::vector<std::string>& perf_args,
+                        const std::vector<std::string>& inject_args) const;
+
+  // Returns whether perf inject has to be run with |inject_args|.
+  bool RunsInject(const std::vector<std::string>& inject_args) const;
+
+  // Returns the options to convert recorded perf data to a PerfDataProto with.
+  PerfParserOptions ParserOptions() const;
+
+  bool inject_build_ids_in_process_ = false;
+  int num_build_id_threads_ = 1;
+  BuildIdCache* build_id_cache_ = nullptr;
 };
 
 }  // namespace quipper
@@ -4,14 +4,19 @@
 
 #include "perf_recorder.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <string>
 #include <vector>
 
 #include "compat/test.h"
+#include "file_utils.h"
 #include "perf_protobuf_io.h"
 #include "perf_reader.h"
 #include "perf_serializer.h"
 #include "run_command.h"
+#include "scoped_temp_path.h"
 #include "test_utils.h"
 
 namespace quipper {
@@ -124,6 +129,49 @@ TEST_F(PerfRecorderTest, RecordAndInjectToProto) {
             command.Get(8).value().substr(0, strlen("/tmp/quipper")));
 }
 
+TEST_F(PerfRecorderTest, RecordAndInjectBuildIdsInProcess) {
+  perf_recorder_.InjectBuildIdsInProcess(/*num_threads=*/4);
+  std::string output_string;
+  EXPECT_TRUE(perf_recorder_.RunCommandAndGetSerializedOutput(
+      {"perf", "record"}, 0.2, {"perf", "inject", "-b"}, &output_string));
+
+  quipper::PerfDataProto perf_data_proto;
+  EXPECT_TRUE(perf_data_proto.ParseFromString(output_string));
+
+  // perf inject didn't run.
+  const auto& string_meta = perf_data_proto.string_metadata();
+  const auto& command = string_meta.perf_command_line_token();
+  EXPECT_EQ(GetPerfPath(), command.Get(0).value());
+  EXPECT_EQ("record", command.Get(1).value());
+}
+
+TEST_F(PerfRecorderTest, RecordThroughPipeToProtobuf) {
+  // The proto is written to a file, rather than to a pipe that would have to
+  // be drained concurrently.
+  ScopedTempFile output_file;
+  int fd = open(output_file.path().c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_TRUE(perf_recorder_.RunCommandAndWriteSerializedOutput(
+      {"perf", "record"}, 0.2, {}, fd));
+  close(fd);
+
+  std::vector<char> output;
+  ASSERT_TRUE(FileToBuffer(output_file.path(), &output));
+  quipper::PerfDataProto perf_data_proto;
+  ASSERT_TRUE(perf_data_proto.ParseFromArray(output.data(), output.size()));
+  const auto& command =
+      perf_data_proto.string_metadata().perf_command_line_token();
+  EXPECT_EQ(GetPerfPath(), command.Get(0).value());
+  EXPECT_EQ("record", command.Get(1).value());
+  EXPECT_EQ("-o", command.Get(2).value());
+  EXPECT_EQ("-", command.Get(3).value());
+}
+
+TEST_F(PerfRecorderTest, StatCantBeStreamed) {
+  EXPECT_FALSE(perf_recorder_.RunCommandAndWriteSerializedOutput(
+      {"perf", "stat"}, 0.2, {}, 1));
+}
+
 TEST_F(PerfRecorderTest, RecordETMRequiresInject) {
   std::string output_string;
   EXPECT_FALSE(perf_recorder_.RunCommandAndGetSerializedOutput(
@@ -97,8 +97,8 @@ bool PerfSerializer::ContainsSampleInfo(uint32_t type) const {
   // Do non-PERF_RECORD_SAMPLE events have a sample_id? Reflects the value of
   // sample_id_all in the first attr, which should be consistent across all
   // attrs.
-  return !sample_info_reader_map_.empty() &&
-         sample_info_reader_map_.begin()->second->event_attr().sample_id_all;
+  const SampleInfoReader* reader = GetSampleInfoReaderForId(0);
+  return reader != nullptr && reader->event_attr().sample_id_all;
 }
 
 size_t PerfSerializer::GetEventSize(
@@ -311,8 +311,11 @@ bool PerfSerializer::DeserializePerfEventType(
 bool PerfSerializer::SerializeEvent(
     const malloced_unique_ptr<event_t>& event_ptr,
     PerfDataProto_PerfEvent* event_proto) const {
-  const event_t& event = *event_ptr;
+  return SerializeEvent(*event_ptr, event_proto);
+}
 
+bool PerfSerializer::SerializeEvent(
+    const event_t& event, PerfDataProto_PerfEvent* event_proto) const {
   if (!SerializeEventHeader(event.header, event_proto->mutable_header()))
     return false;
 
@@ -417,8 +420,11 @@ bool PerfSerializer::DeserializeEvent(
     const PerfDataProto_PerfEvent& event_proto,
     malloced_unique_ptr<event_t>* event_ptr) const {
   event_ptr->reset(CallocMemoryForEvent(event_proto.header().size()));
-  event_t* event = event_ptr->get();
+  return DeserializeEvent(event_proto, event_ptr->get());
+}
 
+bool PerfSerializer::DeserializeEvent(
+    const PerfDataProto_PerfEvent& event_proto, event_t* event) const {
   if (!DeserializeEventHeader(event_proto.header(), &event->header))
     return false;
 
@@ -552,10 +558,19 @@ bool PerfSerializer::DeserializeEventHeader(
 
 bool PerfSerializer::SerializeSampleEvent(
     const event_t& event, PerfDataProto_SampleEvent* sample) const {
+  const SampleInfoReader* reader = GetSampleInfoReaderForEvent(event);
+  if (!reader) {
+    LOG(ERROR) << "No SampleInfoReader available";
+    return false;
+  }
+  // The callchain and raw data are copied from |event| straight into |sample|.
   perf_sample sample_info;
-  uint64_t sample_type = 0;
-  if (!ReadPerfSampleInfoAndType(event, &sample_info, &sample_type))
+  if (!reader->ReadPerfSampleInfo(event, &sample_info, /*in_place=*/true)) {
     return false;
+  }
+  const uint64_t sample_type =
+      reader->event_attr().sample_type & sample_fields_;
+  const uint64_t read_format = reader->event_attr().read_format;
 
   if (sample_type & PERF_SAMPLE_IP) sample->set_ip(sample_info.ip);
   if (sample_type & PERF_SAMPLE_TID) {
@@ -577,55 +592,54 @@ bool PerfSerializer::SerializeSampleEvent(
     sample->set_raw_size(sample_info.raw_size);
   }
   if (sample_type & PERF_SAMPLE_READ) {
-    const SampleInfoReader* reader = GetSampleInfoReaderForEvent(event);
-    if (reader) {
-      PerfDataProto_ReadInfo* read_info = sample->mutable_read_info();
-      if (reader->event_attr().read_format & PERF_FORMAT_TOTAL_TIME_ENABLED)
-        read_info->set_time_enabled(sample_info.read.time_enabled);
-      if (reader->event_attr().read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
-        read_info->set_time_running(sample_info.read.time_running);
-      if (reader->event_attr().read_format & PERF_FORMAT_GROUP) {
-        for (size_t i = 0; i < sample_info.read.group.nr; i++) {
-          auto read_value = read_info->add_read_value();
-          read_value->set_value(sample_info.read.group.values[i].value);
-          if (reader->event_attr().read_format & PERF_FORMAT_ID)
-            read_value->set_id(sample_info.read.group.values[i].id);
-          if (reader->event_attr().read_format & PERF_FORMAT_LOST)
-            read_value->set_lost(sample_info.read.group.values[i].lost);
-        }
-      } else {
+    PerfDataProto_ReadInfo* read_info = sample->mutable_read_info();
+    if (read_format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+      read_info->set_time_enabled(sample_info.read.time_enabled);
+    if (read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+      read_info->set_time_running(sample_info.read.time_running);
+    if (read_format & PERF_FORMAT_GROUP) {
+      read_info->mutable_read_value()->Reserve(sample_info.read.group.nr);
+      for (size_t i = 0; i < sample_info.read.group.nr; i++) {
         auto read_value = read_info->add_read_value();
-        read_value->set_value(sample_info.read.one.value);
-        if (reader->event_attr().read_format & PERF_FORMAT_ID)
-          read_value->set_id(sample_info.read.one.id);
-        if (reader->event_attr().read_format & PERF_FORMAT_LOST)
-          read_value->set_lost(sample_info.read.one.lost);
+        read_value->set_value(sample_info.read.group.values[i].value);
+        if (read_format & PERF_FORMAT_ID)
+          read_value->set_id(sample_info.read.group.values[i].id);
+        if (read_format & PERF_FORMAT_LOST)
+          read_value->set_lost(sample_info.read.group.values[i].lost);
       }
+    } else {
+      auto read_value = read_info->add_read_value();
+      read_value->set_value(sample_info.read.one.value);
+      if (read_format & PERF_FORMAT_ID)
+        read_value->set_id(sample_info.read.one.id);
+      if (read_format & PERF_FORMAT_LOST)
+        read_value->set_lost(sample_info.read.one.lost);
     }
   }
   if (sample_type & PERF_SAMPLE_CALLCHAIN) {
-    sample->mutable_callchain()->Reserve(sample_info.callchain->nr);
-    for (size_t i = 0; i < sample_info.callchain->nr; ++i)
-      sample->add_callchain(sample_info.callchain->ips[i]);
+    const uint64_t* ips = sample_info.callchain->ips;
+    sample->mutable_callchain()->Add(ips, ips + sample_info.callchain->nr);
   }
   if (sample_type & PERF_SAMPLE_BRANCH_STACK) {
     sample->set_no_hw_idx(sample_info.no_hw_idx);
     sample->set_branch_stack_hw_idx(sample_info.branch_stack->hw_idx);
+    auto* branch_stack = sample->mutable_branch_stack();
+    branch_stack->Reserve(sample_info.branch_stack->nr);
     for (size_t i = 0; i < sample_info.branch_stack->nr; ++i) {
-      sample->add_branch_stack();
       const struct branch_entry& entry = sample_info.branch_stack->entries[i];
-      sample->mutable_branch_stack(i)->set_from_ip(entry.from);
-      sample->mutable_branch_stack(i)->set_to_ip(entry.to);
-      sample->mutable_branch_stack(i)->set_mispredicted(entry.flags.mispred);
+      auto* entry_proto = branch_stack->Add();
+      entry_proto->set_from_ip(entry.from);
+      entry_proto->set_to_ip(entry.to);
+      entry_proto->set_mispredicted(entry.flags.mispred);
       // Support for mispred, predicted is optional. In case it
       // is not supported mispred = predicted = 0. So, set predicted
       // separately.
-      sample->mutable_branch_stack(i)->set_predicted(entry.flags.predicted);
-      sample->mutable_branch_stack(i)->set_in_transaction(entry.flags.in_tx);
-      sample->mutable_branch_stack(i)->set_abort(entry.flags.abort);
-      sample->mutable_branch_stack(i)->set_cycles(entry.flags.cycles);
-      sample->mutable_branch_stack(i)->set_type(entry.flags.type);
-      sample->mutable_branch_stack(i)->set_spec(entry.flags.spec);
+      entry_proto->set_predicted(entry.flags.predicted);
+      entry_proto->set_in_transaction(entry.flags.in_tx);
+      entry_proto->set_abort(entry.flags.abort);
+      entry_proto->set_cycles(entry.flags.cycles);
+      entry_proto->set_type(entry.flags.type);
+      entry_proto->set_spec(entry.flags.spec);
       if (entry.flags.reserved != 0) {
         LOG(WARNING) << "Ignoring branch stack entry reserved bits: "
                      << entry.flags.reserved;
@@ -676,12 +690,12 @@ bool PerfSerializer::SerializeMMapEvent(const event_t& event,
   sample->set_len(mmap.len);
   sample->set_pgoff(mmap.pgoff);
   sample->set_filename(mmap.filename);
-  sample->set_filename_md5_prefix(Md5Prefix(mmap.filename));
+  sample->set_filename_md5_prefix(CachedMd5Prefix(sample->filename()));
   std::string root_path = RootPath(mmap.filename);
   if (!root_path.empty()) {
     sample->set_root_path(root_path);
   }
-  sample->set_root_path_md5_prefix(Md5Prefix(root_path));
+  sample->set_root_path_md5_prefix(CachedMd5Prefix(root_path));
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -724,12 +738,12 @@ bool PerfSerializer::SerializeMMap2Event(
   sample->set_prot(mmap.prot);
   sample->set_flags(mmap.flags);
   sample->set_filename(mmap.filename);
-  sample->set_filename_md5_prefix(Md5Prefix(mmap.filename));
+  sample->set_filename_md5_prefix(CachedMd5Prefix(sample->filename()));
   std::string root_path = RootPath(mmap.filename);
   if (!root_path.empty()) {
     sample->set_root_path(root_path);
   }
-  sample->set_root_path_md5_prefix(Md5Prefix(root_path));
+  sample->set_root_path_md5_prefix(CachedMd5Prefix(root_path));
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -774,7 +788,7 @@ bool PerfSerializer::SerializeCommEvent(const event_t& event,
   sample->set_pid(comm.pid);
   sample->set_tid(comm.tid);
   sample->set_comm(comm.comm);
-  sample->set_comm_md5_prefix(Md5Prefix(comm.comm));
+  sample->set_comm_md5_prefix(CachedMd5Prefix(sample->comm()));
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -1064,7 +1078,7 @@ bool PerfSerializer::SerializeBuildIDEvent(
   to->set_misc(from->header.misc);
   to->set_pid(from->pid);
   to->set_filename(from->filename);
-  to->set_filename_md5_prefix(Md5Prefix(from->filename));
+  to->set_filename_md5_prefix(CachedMd5Prefix(to->filename()));
   if (from->header.misc & PERF_RECORD_MISC_BUILD_ID_SIZE)
     to->set_size(from->size);
 
@@ -1252,7 +1266,7 @@ bool PerfSerializer::SerializeThreadMapEvent(
     auto entry = sample->add_entries();
     entry->set_pid(thread_map.entries[i].pid);
     entry->set_comm(thread_map.entries[i].comm);
-    entry->set_comm_md5_prefix(Md5Prefix(thread_map.entries[i].comm));
+    entry->set_comm_md5_prefix(CachedMd5Prefix(entry->comm()));
   }
   return true;
 }
@@ -1544,6 +1558,40 @@ void PerfSerializer::SerializeParserStats(const PerfEventStats& stats,
   stats_pb->set_num_sample_events_mapped(stats.num_sample_events_mapped);
 }
 
+// static
+void PerfSerializer::CompactCallchains(PerfDataProto* perf_data_proto) {
+  if (perf_data_proto->compact_callchains()) return;
+  for (auto& event : *perf_data_proto->mutable_events()) {
+    if (!event.has_sample_event()) continue;
+    PerfDataProto_SampleEvent* sample = event.mutable_sample_event();
+    sample->mutable_callchain_delta()->Reserve(sample->callchain_size());
+    u64 previous = 0;
+    for (u64 ip : sample->callchain()) {
+      sample->add_callchain_delta(static_cast<int64_t>(ip - previous));
+      previous = ip;
+    }
+    sample->clear_callchain();
+  }
+  perf_data_proto->set_compact_callchains(true);
+}
+
+// static
+void PerfSerializer::ExpandCallchains(PerfDataProto* perf_data_proto) {
+  if (!perf_data_proto->compact_callchains()) return;
+  for (auto& event : *perf_data_proto->mutable_events()) {
+    if (!event.has_sample_event()) continue;
+    PerfDataProto_SampleEvent* sample = event.mutable_sample_event();
+    sample->mutable_callchain()->Reserve(sample->callchain_delta_size());
+    u64 ip = 0;
+    for (int64_t delta : sample->callchain_delta()) {
+      ip += static_cast<u64>(delta);
+      sample->add_callchain(ip);
+    }
+    sample->clear_callchain_delta();
+  }
+  perf_data_proto->clear_compact_callchains();
+}
+
 // static
 void PerfSerializer::DeserializeParserStats(
     const PerfDataProto& perf_data_proto, PerfEventStats* stats) {
@@ -1558,14 +1606,24 @@ void PerfSerializer::DeserializeParserStats(
 
 bool PerfSerializer::CreateSampleInfoReader(const PerfFileAttr& attr,
                                             bool read_cross_endian) {
+  const uint32_t reader_index = sample_info_readers_.size();
+  sample_info_readers_.emplace_back(
+      new SampleInfoReader(attr.attr, read_cross_endian));
+  sample_info_readers_.back()->set_skipped_fields(~sample_fields_);
   for (const auto& id :
        (attr.ids.empty() ? std::initializer_list<u64>({0}) : attr.ids)) {
-    sample_info_reader_map_[id].reset(
-        new SampleInfoReader(attr.attr, read_cross_endian));
+    sample_info_reader_index_.Set(id, reader_index);
   }
   return UpdateEventIdPositions(attr.attr);
 }
 
+void PerfSerializer::SetSampleFields(uint64_t fields) {
+  sample_fields_ = fields;
+  for (const auto& reader : sample_info_readers_) {
+    reader->set_skipped_fields(~fields);
+  }
+}
+
 bool PerfSerializer::UpdateEventIdPositions(
     const struct perf_event_attr& attr) {
   const u64 sample_type = attr.sample_type;
@@ -1613,6 +1671,34 @@ bool PerfSerializer::UpdateEventIdPositions(
   return true;
 }
 
+bool PerfSerializer::ReadSamplePid(const event_t& event, u32* pid,
+                                   u64* cgroup) const {
+  const SampleInfoReader* reader = GetSampleInfoReaderForEvent(event);
+  if (reader == nullptr) return false;
+  if (cgroup == nullptr) return reader->ReadSamplePid(event, pid);
+  perf_sample sample;
+  if (!(reader->event_attr().sample_type & PERF_SAMPLE_TID) ||
+      !reader->ReadPerfSampleInfo(event, &sample)) {
+    return false;
+  }
+  *pid = sample.pid;
+  *cgroup = sample.cgroup;
+  return true;
+}
+
+bool PerfSerializer::ReadEventTime(const event_t& event, u64* time) const {
+  if (!ContainsSampleInfo(event.header.type)) return false;
+  const SampleInfoReader* reader = GetSampleInfoReaderForEvent(event);
+  perf_sample sample;
+  if (reader == nullptr ||
+      !(reader->event_attr().sample_type & PERF_SAMPLE_TIME) ||
+      !reader->ReadPerfSampleInfo(event, &sample)) {
+    return false;
+  }
+  *time = sample.time;
+  return true;
+}
+
 const SampleInfoReader* PerfSerializer::GetSampleInfoReaderForEvent(
     const event_t& event) const {
   // Where is the event id?
@@ -1684,14 +1770,14 @@ const SampleInfoReader* PerfSerializer::GetSampleInfoReaderForEvent(
 
 const SampleInfoReader* PerfSerializer::GetSampleInfoReaderForId(
     uint64_t id) const {
-  if (id) {
-    auto iter = sample_info_reader_map_.find(id);
-    if (iter == sample_info_reader_map_.end()) return nullptr;
-    return iter->second.get();
+  if (sample_info_reader_index_.empty()) return nullptr;
+  // Without an ID, the reader of the smallest ID is used.
+  uint32_t reader_index;
+  if (!sample_info_reader_index_.Find(
+          id ? id : sample_info_reader_index_.min_id(), &reader_index)) {
+    return nullptr;
   }
-
-  if (sample_info_reader_map_.empty()) return nullptr;
-  return sample_info_reader_map_.begin()->second.get();
+  return sample_info_readers_[reader_index].get();
 }
 
 bool PerfSerializer::ReadPerfSampleInfoAndType(const event_t& event,
@@ -1704,7 +1790,7 @@ bool PerfSerializer::ReadPerfSampleInfoAndType(const event_t& event,
   }
 
   if (!reader->ReadPerfSampleInfo(event, sample_info)) return false;
-  *sample_type = reader->event_attr().sample_type;
+  *sample_type = reader->event_attr().sample_type & sample_fields_;
   return true;
 }
 
@@ -8,11 +8,11 @@
 #include <stdint.h>
 #include <sys/types.h>
 
-#include <map>
 #include <memory>
 #include <vector>
 
 #include "compat/proto.h"
+#include "event_id_index.h"
 #include "perf_data_utils.h"
 
 struct perf_event_attr;
@@ -83,8 +83,17 @@ class PerfSerializer {
 
   bool SerializeEvent(const malloced_unique_ptr<event_t>& event_ptr,
                       PerfDataProto_PerfEvent* event_proto) const;
+  // Like above, but reads from |event| in place. This allows serializing an
+  // event that points directly into an input buffer without copying it.
+  bool SerializeEvent(const event_t& event,
+                      PerfDataProto_PerfEvent* event_proto) const;
   bool DeserializeEvent(const PerfDataProto_PerfEvent& event_proto,
                         malloced_unique_ptr<event_t>* event_ptr) const;
+  // Like above, but deserializes into |event|, which must be zeroed and at
+  // least event_proto.header().size() bytes long. This allows reusing one
+  // buffer for many events.
+  bool DeserializeEvent(const PerfDataProto_PerfEvent& event_proto,
+                        event_t* event) const;
 
   bool SerializeEventHeader(const perf_event_header& header,
                             PerfDataProto_EventHeader* header_proto) const;
@@ -268,15 +277,40 @@ class PerfSerializer {
   static void DeserializeParserStats(const PerfDataProto& perf_data_proto,
                                      PerfEventStats* stats);
 
+  // Converts the callchains of the sample events of |perf_data_proto| to
+  // their compact encoding, which takes a few bytes per address instead of up
+  // to 10 since consecutive frames tend to be close, and marks the proto as
+  // holding it. Does nothing if it already does.
+  static void CompactCallchains(PerfDataProto* perf_data_proto);
+  // Converts the callchains of a proto marked by CompactCallchains() back to
+  // their regular encoding.
+  static void ExpandCallchains(PerfDataProto* perf_data_proto);
+
   // Instantiate a new PerfSampleReader with the given attr type. If an old one
   // exists for that attr type, it is discarded.
   bool CreateSampleInfoReader(const PerfFileAttr& event_attr,
                               bool read_cross_endian);
 
+  // Limits the sample info fields that are serialized, of sample events and
+  // of the sample info of other events, to |fields|, a mask of PERF_SAMPLE_*
+  // bits. The raw data and the user registers and stack of samples outside of
+  // it are skipped over without being read. Applies to the attrs added later
+  // too. The events can't be deserialized faithfully from the protos then.
+  void SetSampleFields(uint64_t fields);
+
   bool SampleInfoReaderAvailable() const {
-    return !sample_info_reader_map_.empty();
+    return !sample_info_reader_index_.empty();
   }
 
+  // Reads the PID of a PERF_RECORD_SAMPLE event without serializing it, and
+  // its cgroup ID if |cgroup| is not null, which takes decoding the whole
+  // sample. Returns false if the sample has no PID.
+  bool ReadSamplePid(const event_t& event, u32* pid, u64* cgroup) const;
+
+  // Reads the timestamp of |event| without serializing it. Returns false if
+  // the event has none.
+  bool ReadEventTime(const event_t& event, u64* time) const;
+
  private:
   // Special values for the event/other_event_id_pos_ fields.
   enum EventIdPosition {
@@ -336,9 +370,14 @@ class PerfSerializer {
   // (Corresponds to evsel->is_pos in perf)
   ssize_t other_event_id_pos_ = EventIdPosition::Uninitialized;
 
-  // For each perf event attr ID, there is a SampleInfoReader to read events of
-  // the associated perf attr type.
-  std::map<uint64_t, std::unique_ptr<SampleInfoReader>> sample_info_reader_map_;
+  // For each perf event attr, there is a SampleInfoReader to read events of
+  // the associated perf attr type. sample_info_reader_index_ maps each of the
+  // attr's IDs to the position of its reader in sample_info_readers_.
+  std::vector<std::unique_ptr<SampleInfoReader>> sample_info_readers_;
+  EventIdIndex sample_info_reader_index_;
+
+  // See SetSampleFields().
+  uint64_t sample_fields_ = ~0ULL;
 };
 
 }  // namespace quipper
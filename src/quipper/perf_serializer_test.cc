@@ -10,6 +10,7 @@
 #include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "base/logging.h"
 #include "compat/proto.h"
@@ -1852,6 +1853,119 @@ TEST(PerfSerializerTest, SerializesAndDeserializesIdIndexEvents) {
   }
 }
 
+TEST(PerfSerializerTest, CompactsAndExpandsCallchains) {
+  PerfDataProto perf_data_proto;
+  const std::vector<std::vector<u64>> callchains = {
+      {PERF_CONTEXT_KERNEL, 0xffffffff81012345, 0xffffffff81000123,
+       PERF_CONTEXT_USER, 0x55555555a123, 0x555555559abc, 0x7ffff7a2d830},
+      {},
+      {0x1000},
+  };
+  for (const auto& callchain : callchains) {
+    PerfDataProto_PerfEvent* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(PERF_RECORD_SAMPLE);
+    PerfDataProto_SampleEvent* sample = event->mutable_sample_event();
+    sample->set_ip(0x1234);
+    for (u64 ip : callchain) sample->add_callchain(ip);
+  }
+  perf_data_proto.add_events()->mutable_header()->set_type(
+      PERF_RECORD_FINISHED_ROUND);
+  const std::string regular = perf_data_proto.SerializeAsString();
+
+  PerfDataProto compact_proto = perf_data_proto;
+  PerfSerializer::CompactCallchains(&compact_proto);
+  EXPECT_TRUE(compact_proto.compact_callchains());
+  for (const auto& event : compact_proto.events()) {
+    EXPECT_EQ(0, event.sample_event().callchain_size());
+  }
+  EXPECT_EQ(7, compact_proto.events(0).sample_event().callchain_delta_size());
+  const std::string compact = compact_proto.SerializeAsString();
+  EXPECT_LT(compact.size(), regular.size());
+  // Compacting twice has no effect.
+  PerfSerializer::CompactCallchains(&compact_proto);
+  EXPECT_EQ(compact, compact_proto.SerializeAsString());
+
+  // Compact callchains are expanded when read back.
+  ScopedTempFile file;
+  ASSERT_TRUE(WriteProtobufToFile(compact_proto, file.path()));
+  PerfDataProto read_proto;
+  ASSERT_TRUE(ReadProtobufFromFile(&read_proto, file.path()));
+  EXPECT_FALSE(read_proto.has_compact_callchains());
+  EXPECT_EQ(regular, read_proto.SerializeAsString());
+
+  // Regular callchains are left alone.
+  PerfSerializer::ExpandCallchains(&read_proto);
+  EXPECT_EQ(regular, read_proto.SerializeAsString());
+}
+
+TEST(PerfSerializerTest, ReadsProtobufFromFileOnArena) {
+  PerfDataProto perf_data_proto;
+  for (int i = 0; i < 3; ++i) {
+    PerfDataProto_PerfEvent* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(PERF_RECORD_SAMPLE);
+    event->mutable_sample_event()->set_ip(0x1000 + i);
+    event->mutable_sample_event()->add_callchain(0x2000 + i);
+  }
+  perf_data_proto.mutable_string_metadata()->mutable_hostname()->set_value(
+      "localhost");
+  ScopedTempFile file;
+  ASSERT_TRUE(WriteProtobufToFile(perf_data_proto, file.path()));
+
+  Arena arena;
+  const PerfDataProto* read_proto =
+      ReadProtobufFromFileOnArena(file.path(), &arena);
+  ASSERT_NE(nullptr, read_proto);
+  EXPECT_EQ(perf_data_proto.SerializeAsString(),
+            read_proto->SerializeAsString());
+
+  EXPECT_EQ(nullptr,
+            ReadProtobufFromFileOnArena(file.path() + ".missing", &arena));
+}
+
+TEST(PerfSerializerTest, WritesAndReadsChunkedProtobufFiles) {
+  PerfDataProto perf_data_proto;
+  perf_data_proto.add_file_attrs()->mutable_attr()->set_type(
+      PERF_TYPE_HARDWARE);
+  perf_data_proto.add_build_ids()->set_filename("/usr/bin/foo");
+  for (int i = 0; i < 5; ++i) {
+    PerfDataProto_PerfEvent* event = perf_data_proto.add_events();
+    event->mutable_header()->set_type(PERF_RECORD_SAMPLE);
+    event->mutable_sample_event()->set_ip(0x1000 + i);
+    event->mutable_sample_event()->add_callchain(0x2000 + i);
+  }
+  PerfSerializer::CompactCallchains(&perf_data_proto);
+  ScopedTempFile file;
+  ASSERT_TRUE(WriteChunkedProtobufToFile(perf_data_proto, file.path(),
+                                         /*events_per_chunk=*/2));
+  PerfSerializer::ExpandCallchains(&perf_data_proto);
+
+  ChunkedProtobufReader reader;
+  ASSERT_TRUE(reader.Open(file.path()));
+  PerfDataProto expected_header = perf_data_proto;
+  expected_header.clear_events();
+  EXPECT_EQ(expected_header.SerializeAsString(),
+            reader.header().SerializeAsString());
+
+  PerfDataProto chunk;
+  PerfDataProto events;
+  std::vector<int> chunk_sizes;
+  while (reader.ReadChunk(&chunk)) {
+    chunk_sizes.push_back(chunk.events_size());
+    EXPECT_FALSE(chunk.has_compact_callchains());
+    events.MergeFrom(chunk);
+  }
+  EXPECT_FALSE(reader.failed());
+  EXPECT_EQ((std::vector<int>{2, 2, 1}), chunk_sizes);
+  events.MergeFrom(expected_header);
+  EXPECT_EQ(perf_data_proto.SerializeAsString(), events.SerializeAsString());
+
+  // A regular proto file is not a chunked one.
+  ASSERT_TRUE(WriteProtobufToFile(perf_data_proto, file.path()));
+  ChunkedProtobufReader regular_reader;
+  EXPECT_FALSE(regular_reader.Open(file.path()));
+  EXPECT_FALSE(regular_reader.ReadChunk(&chunk));
+}
+
 namespace {
 std::vector<const char*> AllPerfData() {
   const auto& files = perf_test_files::GetPerfDataFiles();
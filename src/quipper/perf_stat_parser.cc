@@ -4,75 +4,246 @@
 
 #include "perf_stat_parser.h"
 
-#include <stdlib.h>  // for strtoull and strtod
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <system_error>
 #include <vector>
 
 #include "base/logging.h"
 
 #include "compat/proto.h"
-#include "file_utils.h"
-#include "string_utils.h"
 
 namespace quipper {
 
-bool ParsePerfStatFileToProto(const std::string& path, PerfStatProto* proto) {
-  std::vector<char> data;
-  if (!FileToBuffer(path, &data)) {
-    return false;
+namespace {
+
+// The size of the reads of ParsePerfStatFdToProto(), which grows for longer
+// lines.
+constexpr size_t kReadSize = 64 * 1024;
+
+bool IsWhitespace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Parses |str| as a decimal count. If |grouped|, the digits may be grouped by
+// commas, as in "12,345,678".
+bool ParseCount(std::string_view str, bool grouped, uint64_t* out) {
+  if (str.empty()) return false;
+  if (!grouped) {
+    auto result = std::from_chars(str.data(), str.data() + str.size(), *out);
+    return result.ec == std::errc() && result.ptr == str.data() + str.size();
+  }
+  uint64_t count = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (str[i] == ',' && i > 0 && i + 1 < str.size() && str[i - 1] != ',') {
+      continue;
+    }
+    if (str[i] < '0' || str[i] > '9') return false;
+    const uint64_t digit = str[i] - '0';
+    if (count > (std::numeric_limits<uint64_t>::max() - digit) / 10) {
+      return false;
+    }
+    count = count * 10 + digit;
   }
-  std::string data_str(data.begin(), data.end());
-  return ParsePerfStatOutputToProto(data_str, proto);
+  *out = count;
+  return true;
 }
 
-bool ParsePerfStatOutputToProto(const std::string& data, PerfStatProto* proto) {
-  std::vector<std::string> lines;
-  SplitString(data, '\n', &lines);
-  uint64_t time_ms = 0;
-  for (size_t i = 0; i < lines.size(); ++i) {
-    TrimWhitespace(&lines[i]);
-    // Look for lines of the form:
-    // "name: 123 123 123"
-    // OR
-    // "1.234 seconds time elapsed"
-    std::vector<std::string> tokens;
-    SplitString(lines[i], ' ', &tokens);
-    if (tokens.size() != 4) {
-      continue;
+// Parses the timestamp of an interval, which perf always prints with a
+// fractional part.
+bool ParseIntervalTime(std::string_view str, uint64_t* time_ms) {
+  return str.find('.') != std::string_view::npos &&
+         SecondsStringToMillisecondsUint64(str, time_ms);
+}
+
+// Parses perf stat output one line at a time, without copying it.
+class PerfStatParser {
+ public:
+  PerfStatParser(char csv_separator, PerfStatProto* proto)
+      : csv_separator_(csv_separator), proto_(proto) {}
+
+  // Parses the lines of |data|. The last line needs no newline.
+  void ParseLines(std::string_view data) {
+    while (!data.empty()) {
+      size_t end = data.find('\n');
+      if (end == std::string_view::npos) end = data.size();
+      ParseLine(data.substr(0, end));
+      data.remove_prefix(std::min(end + 1, data.size()));
+    }
+  }
+
+  // Sets the time elapsed of the lines that aren't of intervals, and returns
+  // whether there are lines.
+  bool Finish() {
+    if (elapsed_ms_ != 0) {
+      for (int i = 0; i < proto_->line_size(); ++i) {
+        if (!proto_->line(i).has_time_ms()) {
+          proto_->mutable_line(i)->set_time_ms(elapsed_ms_);
+        }
+      }
+    }
+    return proto_->line_size() > 0;
+  }
+
+ private:
+  // The most fields of a line that are looked at.
+  static constexpr size_t kMaxFields = 4;
+
+  void ParseLine(std::string_view line) {
+    if (csv_separator_ != '\0') {
+      ParseCsvLine(line);
+    } else {
+      ParseTextLine(line);
+    }
+  }
+
+  // Looks for lines of the form:
+  // "name: 123 123 123"
+  // OR
+  // "1.234 seconds time elapsed"
+  // OR
+  // "1.234 123 name ..."
+  void ParseTextLine(std::string_view line) {
+    std::string_view fields[kMaxFields];
+    size_t num_fields = 0;
+    size_t pos = 0;
+    while (true) {
+      while (pos < line.size() && IsWhitespace(line[pos])) ++pos;
+      if (pos == line.size()) break;
+      size_t end = pos;
+      while (end < line.size() && !IsWhitespace(line[end])) ++end;
+      if (num_fields < kMaxFields) {
+        fields[num_fields] = line.substr(pos, end - pos);
+      }
+      ++num_fields;
+      pos = end;
     }
-    const std::string& first_token = tokens[0];
-    // Look for "name: 123 123 123"
-    if (first_token.back() == ':') {
-      char* endptr;
-      uint64_t count = strtoull(tokens[1].c_str(), &endptr, 10);
-      if (*endptr != '\0') {
-        continue;
+
+    uint64_t count = 0, time_ms = 0;
+    if (num_fields == 4 && fields[0].back() == ':') {
+      // Look for "name: 123 123 123"
+      if (ParseCount(fields[1], false, &count)) {
+        fields[0].remove_suffix(1);
+        AddLine(fields[0], count, nullptr);
       }
-      auto newline = proto->add_line();
-      newline->set_count(count);
-      newline->set_event_name(first_token.substr(0, first_token.size() - 1));
+    } else if (num_fields == 4 && fields[1] == "seconds") {
+      // Look for "1.234 seconds time elapsed"
+      if (!SecondsStringToMillisecondsUint64(fields[0], &elapsed_ms_)) {
+        elapsed_ms_ = 0;
+      }
+    } else if (num_fields >= 3 && ParseCount(fields[1], true, &count) &&
+               ParseIntervalTime(fields[0], &time_ms)) {
+      // Look for "1.234 123 name ..."
+      AddLine(fields[2], count, &time_ms);
+    }
+  }
+
+  // Looks for lines of the form:
+  // "123,unit,name,..."
+  // OR
+  // "1.234,123,unit,name,..."
+  void ParseCsvLine(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.empty() || line[0] == '#') return;
+    std::string_view fields[kMaxFields];
+    size_t num_fields = 0;
+    while (num_fields < kMaxFields) {
+      const size_t end = line.find(csv_separator_);
+      fields[num_fields++] = line.substr(0, end);
+      if (end == std::string_view::npos) break;
+      line.remove_prefix(end + 1);
     }
-    // Look for "1.234 seconds time elapsed"
-    if (tokens[1] == "seconds" &&
-        !SecondsStringToMillisecondsUint64(first_token, &time_ms)) {
-      time_ms = 0;
+
+    uint64_t count = 0, time_ms = 0;
+    if (num_fields == 4 && ParseCount(fields[1], false, &count) &&
+        ParseIntervalTime(fields[0], &time_ms)) {
+      AddLine(fields[3], count, &time_ms);
+    } else if (num_fields >= 3 && ParseCount(fields[0], false, &count)) {
+      AddLine(fields[2], count, nullptr);
     }
   }
-  if (time_ms != 0) {
-    for (int i = 0; i < proto->line_size(); ++i) {
-      proto->mutable_line(i)->set_time_ms(time_ms);
+
+  void AddLine(std::string_view event_name, uint64_t count,
+               const uint64_t* time_ms) {
+    if (event_name.empty()) return;
+    auto* line = proto_->add_line();
+    line->set_count(count);
+    line->set_event_name(event_name.data(), event_name.size());
+    if (time_ms != nullptr) line->set_time_ms(*time_ms);
+  }
+
+  const char csv_separator_;
+  PerfStatProto* const proto_;
+  // The time elapsed of the whole run, or 0 if it wasn't printed.
+  uint64_t elapsed_ms_ = 0;
+};
+
+}  // namespace
+
+bool ParsePerfStatFileToProto(const std::string& path, PerfStatProto* proto,
+                              char csv_separator) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ret = ParsePerfStatFdToProto(fd, proto, csv_separator);
+  close(fd);
+  return ret;
+}
+
+bool ParsePerfStatOutputToProto(std::string_view data, PerfStatProto* proto,
+                                char csv_separator) {
+  PerfStatParser parser(csv_separator, proto);
+  parser.ParseLines(data);
+  return parser.Finish();
+}
+
+bool ParsePerfStatFdToProto(int fd, PerfStatProto* proto, char csv_separator) {
+  PerfStatParser parser(csv_separator, proto);
+  std::vector<char> buffer(kReadSize);
+  // The bytes at the start of |buffer| of a line that hasn't ended yet.
+  size_t size = 0;
+  while (true) {
+    if (size == buffer.size()) {
+      buffer.resize(2 * buffer.size());
+    }
+    ssize_t read_size;
+    do {
+      read_size = read(fd, buffer.data() + size, buffer.size() - size);
+    } while (read_size < 0 && errno == EINTR);
+    if (read_size < 0) {
+      PLOG(ERROR) << "Failed to read perf stat output";
+      return false;
+    }
+    if (read_size == 0) {
+      break;
+    }
+    const std::string_view data(buffer.data(), size + read_size);
+    const size_t end = data.rfind('\n');
+    if (end == std::string_view::npos) {
+      size = data.size();
+      continue;
     }
+    parser.ParseLines(data.substr(0, end + 1));
+    size = data.size() - (end + 1);
+    memmove(buffer.data(), buffer.data() + end + 1, size);
   }
-  return proto->line_size() > 0;
+  parser.ParseLines(std::string_view(buffer.data(), size));
+  return parser.Finish();
 }
 
-bool SecondsStringToMillisecondsUint64(const std::string& str, uint64_t* out) {
-  char* endptr;
-  double seconds = strtod(str.c_str(), &endptr);
-  if (*endptr != '\0') {
+bool SecondsStringToMillisecondsUint64(std::string_view str, uint64_t* out) {
+  double seconds;
+  auto result = std::from_chars(str.data(), str.data() + str.size(), seconds);
+  if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
     return false;
   }
-  if (seconds < 0) {
+  if (!(seconds >= 0) || !std::isfinite(seconds)) {
     return false;
   }
   *out = (static_cast<uint64_t>(seconds * 1000.0 + 0.5));
@@ -5,26 +5,45 @@
 #ifndef CHROMIUMOS_WIDE_PROFILING_PERF_STAT_PARSER_H_
 #define CHROMIUMOS_WIDE_PROFILING_PERF_STAT_PARSER_H_
 
+#include <stdint.h>
+
 #include <string>
+#include <string_view>
 
 #include "compat/proto.h"
 
 namespace quipper {
 
-// These functions parse the contents at |path| or of |data| into a
-// PerfStatProto. Return true if at least one line of data was inserted into
-// |proto|. Otherwise return false;
-// Both functions below assume perf stat output is in the form:
+// These functions parse the contents at |path|, of |data| or read from |fd|
+// into a PerfStatProto. Return true if at least one line of data was inserted
+// into |proto|. Otherwise return false;
+// When |csv_separator| is 0, the functions below assume perf stat output is in
+// the form:
 //     "event: 123 123 123\n"
 //     "event2: 123 123 123\n"
 //     "..."
 //     "1.234 seconds time elapsed"
-bool ParsePerfStatFileToProto(const std::string& path, PerfStatProto* proto);
-bool ParsePerfStatOutputToProto(const std::string& data, PerfStatProto* proto);
+// or, with "perf stat -I", in the form:
+//     "     1.000123456         12,345,678      event   ..."
+//     "     1.000123456            123,456      event2  ..."
+//     "     2.000234567         12,345,678      event   ..."
+// Otherwise they assume the output of "perf stat -x <csv_separator>", with
+// lines of the form "123,,event,..." or, with "-I",
+// "1.000123456,123,,event,...".
+// The lines of other forms, and those of events that weren't counted or whose
+// counts aren't integers, are skipped. The lines of intervals have the time of
+// their interval, and the others the time elapsed, if it was printed.
+bool ParsePerfStatFileToProto(const std::string& path, PerfStatProto* proto,
+                              char csv_separator = '\0');
+bool ParsePerfStatOutputToProto(std::string_view data, PerfStatProto* proto,
+                                char csv_separator = '\0');
+// Reads |fd| until its end, parsing each line as soon as it has been read.
+bool ParsePerfStatFdToProto(int fd, PerfStatProto* proto,
+                            char csv_separator = '\0');
 
 // This function assumes that |str| is of the form "1234.1234567" and returns
 // false otherwise. This function does not accept negatives (e.g. "-12.23").
-bool SecondsStringToMillisecondsUint64(const std::string& str, uint64_t* out);
+bool SecondsStringToMillisecondsUint64(std::string_view str, uint64_t* out);
 
 }  // namespace quipper
 
@@ -4,6 +4,9 @@
 
 #include "perf_stat_parser.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <string>
 
 #include "base/logging.h"
@@ -44,6 +47,28 @@ const char kFullInput[] =
     "       2.001402976 seconds time elapsed\n"
     "\n";
 
+// From 'perf stat -I 1000 -e cycles,instructions,branch-misses -- sleep 2'
+const char kIntervalInput[] =
+    "#           time             counts unit events\n"
+    "     1.001034562         12,370,132      cycles\n"
+    "     1.001034562          8,495,473      instructions              #    "
+    "0.69  insn per cycle\n"
+    "     1.001034562      <not counted>      branch-misses\n"
+    "     2.002372810            890,313      cycles\n"
+    "     2.002372810            357,180      instructions              #    "
+    "0.40  insn per cycle\n";
+
+// From 'perf stat -x, -e cycles -e task-clock -e branch-misses -- sleep 1'
+const char kCsvInput[] =
+    "3127430,,cycles,2013127,100.00,,\n"
+    "1.23,msec,task-clock,1230470,100.00,0.001,CPUs utilized\n"
+    "<not counted>,,branch-misses,0,100.00,,\n";
+
+// From 'perf stat -I 500 -x; -e cycles -- sleep 1'
+const char kCsvIntervalInput[] =
+    "0.500141990;2069021;;cycles;1081730;100.00;;\n"
+    "1.000487645;431044;;cycles;591221;100.00;;\n";
+
 }  // namespace
 
 TEST(PerfStatParserTest, InvalidStringReturnsFalse) {
@@ -115,6 +140,71 @@ TEST(PerfStatParserTest, ValidFullStringParsesCorrectly) {
   EXPECT_EQ(2001, line4.time_ms());
 }
 
+TEST(PerfStatParserTest, IntervalsParseCorrectly) {
+  PerfStatProto proto;
+  ASSERT_TRUE(ParsePerfStatOutputToProto(kIntervalInput, &proto));
+
+  ASSERT_EQ(proto.line_size(), 4);
+  EXPECT_EQ("cycles", proto.line(0).event_name());
+  EXPECT_EQ(12370132, proto.line(0).count());
+  EXPECT_EQ(1001, proto.line(0).time_ms());
+  EXPECT_EQ("instructions", proto.line(1).event_name());
+  EXPECT_EQ(8495473, proto.line(1).count());
+  EXPECT_EQ(1001, proto.line(1).time_ms());
+  EXPECT_EQ("cycles", proto.line(2).event_name());
+  EXPECT_EQ(890313, proto.line(2).count());
+  EXPECT_EQ(2002, proto.line(2).time_ms());
+  EXPECT_EQ("instructions", proto.line(3).event_name());
+  EXPECT_EQ(357180, proto.line(3).count());
+  EXPECT_EQ(2002, proto.line(3).time_ms());
+}
+
+TEST(PerfStatParserTest, CsvParsesCorrectly) {
+  PerfStatProto proto;
+  ASSERT_TRUE(ParsePerfStatOutputToProto(kCsvInput, &proto, ','));
+
+  ASSERT_EQ(proto.line_size(), 1);
+  EXPECT_EQ("cycles", proto.line(0).event_name());
+  EXPECT_EQ(3127430, proto.line(0).count());
+  EXPECT_FALSE(proto.line(0).has_time_ms());
+
+  PerfStatProto interval_proto;
+  ASSERT_TRUE(
+      ParsePerfStatOutputToProto(kCsvIntervalInput, &interval_proto, ';'));
+
+  ASSERT_EQ(interval_proto.line_size(), 2);
+  EXPECT_EQ("cycles", interval_proto.line(0).event_name());
+  EXPECT_EQ(2069021, interval_proto.line(0).count());
+  EXPECT_EQ(500, interval_proto.line(0).time_ms());
+  EXPECT_EQ("cycles", interval_proto.line(1).event_name());
+  EXPECT_EQ(431044, interval_proto.line(1).count());
+  EXPECT_EQ(1000, interval_proto.line(1).time_ms());
+}
+
+TEST(PerfStatParserTest, ParsesFromFd) {
+  // Enough intervals for the lines to cross the reads.
+  std::string input;
+  const int kNumIntervals = 5000;
+  for (int i = 1; i <= kNumIntervals; ++i) {
+    input += std::to_string(i) + ".000000001," + std::to_string(i) +
+             ",,cycles," + std::string(20, '1') + ",100.00,,\n";
+  }
+  ScopedTempFile file;
+  ASSERT_FALSE(file.path().empty());
+  ASSERT_TRUE(BufferToFile(file.path(), input));
+  int fd = open(file.path().c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  PerfStatProto proto;
+  EXPECT_TRUE(ParsePerfStatFdToProto(fd, &proto, ','));
+  close(fd);
+
+  ASSERT_EQ(proto.line_size(), kNumIntervals);
+  for (int i = 0; i < kNumIntervals; ++i) {
+    EXPECT_EQ(i + 1, proto.line(i).count());
+    EXPECT_EQ((i + 1) * 1000, proto.line(i).time_ms());
+  }
+}
+
 TEST(PerfStatParserTest, NonexistentFileReturnsFalse) {
   PerfStatProto proto;
   ASSERT_FALSE(ParsePerfStatFileToProto("/dev/null/nope/nope.txt", &proto));
@@ -0,0 +1,106 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_PHASE_TIMER_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_PHASE_TIMER_H_
+
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace quipper {
+
+namespace internal {
+
+inline std::atomic<uint64_t> allocations{0};
+inline std::atomic<uint64_t> allocated_bytes{0};
+
+}  // namespace internal
+
+// Counts an allocation of |bytes| by the process. Counting allocations is
+// opt-in: programs that want the allocations of the phases in their
+// PhaseTimes call it from their replacement of the global operator new, e.g.
+//   void* operator new(size_t size) {
+//     quipper::CountAllocation(size);
+//     ...
+//   }
+// Without it, the phases have no allocations.
+inline void CountAllocation(size_t bytes) {
+  internal::allocations.fetch_add(1, std::memory_order_relaxed);
+  internal::allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+// The time spent in a phase of a computation, possibly over several runs.
+struct PhaseTime {
+  double wall_seconds = 0;
+  // The CPU time of the whole process, so it includes the time of the threads
+  // the phase runs on other than the calling one.
+  double cpu_seconds = 0;
+  // The allocations counted by CountAllocation(), also of the whole process.
+  // The blocks of protobuf arenas are counted as they are allocated, not the
+  // messages in them.
+  uint64_t allocations = 0;
+  uint64_t allocated_bytes = 0;
+
+  PhaseTime& operator+=(const PhaseTime& other) {
+    wall_seconds += other.wall_seconds;
+    cpu_seconds += other.cpu_seconds;
+    allocations += other.allocations;
+    allocated_bytes += other.allocated_bytes;
+    return *this;
+  }
+};
+
+// Adds the wall and CPU time, and the allocations, from its construction to
+// its destruction to a PhaseTime. Does nothing if the PhaseTime is null, so
+// callers can time phases only when their caller asked for it.
+class ScopedPhaseTimer {
+ public:
+  explicit ScopedPhaseTimer(PhaseTime* time) : time_(time) {
+    if (time_ == nullptr) return;
+    allocations_start_ =
+        internal::allocations.load(std::memory_order_relaxed);
+    allocated_bytes_start_ =
+        internal::allocated_bytes.load(std::memory_order_relaxed);
+    wall_start_ = std::chrono::steady_clock::now();
+    cpu_start_ = CpuSeconds();
+  }
+
+  ScopedPhaseTimer(const ScopedPhaseTimer&) = delete;
+  ScopedPhaseTimer& operator=(const ScopedPhaseTimer&) = delete;
+
+  ~ScopedPhaseTimer() {
+    if (time_ == nullptr) return;
+    time_->cpu_seconds += CpuSeconds() - cpu_start_;
+    time_->wall_seconds += std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - wall_start_)
+                               .count();
+    time_->allocations +=
+        internal::allocations.load(std::memory_order_relaxed) -
+        allocations_start_;
+    time_->allocated_bytes +=
+        internal::allocated_bytes.load(std::memory_order_relaxed) -
+        allocated_bytes_start_;
+  }
+
+ private:
+  static double CpuSeconds() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) return 0;
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  PhaseTime* const time_;
+  std::chrono::steady_clock::time_point wall_start_;
+  double cpu_start_ = 0;
+  uint64_t allocations_start_ = 0;
+  uint64_t allocated_bytes_start_ = 0;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_PHASE_TIMER_H_
@@ -0,0 +1,39 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "phase_timer.h"
+
+#include "compat/test.h"
+
+namespace quipper {
+
+TEST(PhaseTimerTest, AddsTheAllocationsOfThePhase) {
+  PhaseTime time;
+  CountAllocation(1000);
+  {
+    ScopedPhaseTimer timer(&time);
+    CountAllocation(16);
+    CountAllocation(48);
+  }
+  EXPECT_EQ(2, time.allocations);
+  EXPECT_EQ(64, time.allocated_bytes);
+  EXPECT_GE(time.wall_seconds, 0);
+
+  // The runs of a phase add up, and phases that aren't timed count nothing.
+  {
+    ScopedPhaseTimer timer(&time);
+    ScopedPhaseTimer untimed(nullptr);
+    CountAllocation(8);
+  }
+  EXPECT_EQ(3, time.allocations);
+  EXPECT_EQ(72, time.allocated_bytes);
+
+  PhaseTime total;
+  total += time;
+  total += time;
+  EXPECT_EQ(6, total.allocations);
+  EXPECT_EQ(144, total.allocated_bytes);
+}
+
+}  // namespace quipper
@@ -0,0 +1,160 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "read_ahead_file_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+namespace {
+
+size_t FileSize(int fd) {
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) return 0;
+  return st.st_size;
+}
+
+}  // namespace
+
+ReadAheadFileReader::ReadAheadFileReader(const std::string& filename,
+                                         size_t chunk_size, size_t num_chunks)
+    : fd_(open(filename.c_str(), O_RDONLY | O_CLOEXEC)),
+      chunk_size_(std::max<size_t>(1, chunk_size)),
+      num_chunks_(std::max<size_t>(1, num_chunks)),
+      file_chunks_((FileSize(fd_) + chunk_size_ - 1) / chunk_size_) {
+  size_ = FileSize(fd_);
+  if (!IsOpen()) return;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  buffers_.reset(new char[chunk_size_ * num_chunks_]);
+  prefetcher_ = std::thread(&ReadAheadFileReader::Prefetch, this);
+}
+
+ReadAheadFileReader::~ReadAheadFileReader() {
+  if (!IsOpen()) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  chunk_wanted_.notify_one();
+  prefetcher_.join();
+  close(fd_);
+}
+
+bool ReadAheadFileReader::SeekSet(size_t offset) {
+  if (offset > size_) {
+    LOG(ERROR) << "Illegal offset " << offset << " in file of size " << size_;
+    return false;
+  }
+  offset_ = offset;
+  const size_t chunk = offset / chunk_size_;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (chunk >= first_chunk_ && chunk < end_chunk_) {
+      // Keep the chunks prefetched from |chunk| on.
+      first_chunk_ = chunk;
+    } else {
+      ++generation_;
+      first_chunk_ = end_chunk_ = chunk;
+      failed_ = false;
+    }
+  }
+  chunk_wanted_.notify_one();
+  return true;
+}
+
+bool ReadAheadFileReader::ReadData(const size_t size, void* dest) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) {
+    return false;
+  }
+  char* out = static_cast<char*>(dest);
+  size_t remaining = size;
+  while (remaining > 0) {
+    const size_t chunk = offset_ / chunk_size_;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (chunk != first_chunk_) {
+        // The read pointer moved on to the next chunk, which releases the
+        // buffer of the previous one.
+        first_chunk_ = chunk;
+        chunk_wanted_.notify_one();
+      }
+      chunk_fetched_.wait(lock, [&] { return end_chunk_ > chunk || failed_; });
+      if (end_chunk_ <= chunk) return false;
+    }
+    // Only this thread reads the buffers of the chunks fetched, and the
+    // prefetcher doesn't write them until they are released.
+    const size_t chunk_offset = offset_ - chunk * chunk_size_;
+    const size_t n = std::min(remaining, chunk_size_ - chunk_offset);
+    memcpy(out, ChunkBuffer(chunk) + chunk_offset, n);
+    out += n;
+    remaining -= n;
+    offset_ += n;
+  }
+  return true;
+}
+
+bool ReadAheadFileReader::ReadString(const size_t size, std::string* str) {
+  if (!ReadDataString(size, str)) return false;
+
+  // Truncate anything after a terminating null.
+  size_t actual_length = strnlen(str->data(), size);
+  str->resize(actual_length);
+  return true;
+}
+
+void ReadAheadFileReader::Prefetch() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    chunk_wanted_.wait(lock, [this] {
+      return stop_ || (!failed_ && end_chunk_ < file_chunks_ &&
+                       end_chunk_ < first_chunk_ + num_chunks_);
+    });
+    if (stop_) return;
+    const size_t chunk = end_chunk_;
+    const uint64_t generation = generation_;
+    lock.unlock();
+    const bool ok = ReadChunk(chunk);
+    lock.lock();
+    // Drop the chunk if the reader moved elsewhere in the meantime.
+    if (generation != generation_) continue;
+    if (ok) {
+      ++end_chunk_;
+    } else {
+      failed_ = true;
+    }
+    chunk_fetched_.notify_one();
+  }
+}
+
+bool ReadAheadFileReader::ReadChunk(size_t chunk) {
+  const size_t start = chunk * chunk_size_;
+  const size_t size = std::min(chunk_size_, size_ - start);
+  char* buffer = ChunkBuffer(chunk);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t n = pread(fd_, buffer + done, size - done, start + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      PLOG(ERROR) << "pread failure for offset " << start + done
+                  << " in file of size " << size_;
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+}  // namespace quipper
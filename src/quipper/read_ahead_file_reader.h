@@ -0,0 +1,99 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_READ_AHEAD_FILE_READER_H_
+#define CHROMIUMOS_WIDE_PROFILING_READ_AHEAD_FILE_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "data_reader.h"
+
+namespace quipper {
+
+// Read from an input file, prefetching the data ahead of the read pointer on
+// a background thread, so that reading from slow storage, e.g. a network
+// filesystem, overlaps with decoding the data already read. The file is read
+// in chunks of |chunk_size| bytes, at multiples of |chunk_size| in the file,
+// into a ring of |num_chunks| buffers. Reads past the chunks prefetched wait
+// for them, and seeks out of them restart the prefetching at the new offset.
+// Must be a normal file. Does not support pipe inputs.
+class ReadAheadFileReader : public DataReader {
+ public:
+  static constexpr size_t kDefaultChunkSize = 4 << 20;
+  static constexpr size_t kDefaultNumChunks = 4;
+
+  explicit ReadAheadFileReader(const std::string& filename,
+                               size_t chunk_size = kDefaultChunkSize,
+                               size_t num_chunks = kDefaultNumChunks);
+  ~ReadAheadFileReader() override;
+
+  bool IsOpen() const { return fd_ >= 0; }
+
+  bool SeekSet(size_t offset) override;
+
+  size_t Tell() const override { return offset_; }
+
+  bool ReadData(const size_t size, void* dest) override;
+
+  // If there is a failure reading the data from file, |*str| will not be
+  // modified.
+  bool ReadString(const size_t size, std::string* str) override;
+
+ private:
+  // Fetches the chunks [first_chunk_, first_chunk_ + num_chunks_) in order,
+  // as they come in range, until |stop_| is set.
+  void Prefetch();
+
+  // Reads the chunk |chunk| of the file into its buffer. Returns false on
+  // failure.
+  bool ReadChunk(size_t chunk);
+
+  char* ChunkBuffer(size_t chunk) {
+    return buffers_.get() + (chunk % num_chunks_) * chunk_size_;
+  }
+
+  // File input descriptor, or -1 if the file couldn't be opened.
+  int fd_;
+  const size_t chunk_size_;
+  const size_t num_chunks_;
+  const size_t file_chunks_;
+  // The ring of |num_chunks_| buffers of |chunk_size_| bytes.
+  std::unique_ptr<char[]> buffers_;
+
+  // Data read offset from the start of the file. Only used by the reading
+  // thread.
+  size_t offset_ = 0;
+
+  std::mutex mutex_;
+  // Signaled when more chunks can be fetched, or when stopping.
+  std::condition_variable chunk_wanted_;
+  // Signaled when a chunk has been fetched, or failed to be.
+  std::condition_variable chunk_fetched_;
+  // The chunk of |offset_|, before which the buffers can be reused.
+  size_t first_chunk_ = 0;
+  // The chunks [first_chunk_, end_chunk_) have been fetched.
+  size_t end_chunk_ = 0;
+  // Incremented whenever the prefetching restarts at another offset, so that
+  // the chunks being fetched for the previous offset are dropped.
+  uint64_t generation_ = 0;
+  // Set if fetching the chunk |end_chunk_| failed.
+  bool failed_ = false;
+  bool stop_ = false;
+
+  std::thread prefetcher_;
+
+  ReadAheadFileReader(const ReadAheadFileReader&) = delete;
+  ReadAheadFileReader& operator=(const ReadAheadFileReader&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_READ_AHEAD_FILE_READER_H_
@@ -0,0 +1,148 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "read_ahead_file_reader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+#include "file_utils.h"
+#include "perf_reader.h"
+#include "scoped_temp_path.h"
+#include "test_perf_data.h"
+#include "test_utils.h"
+
+namespace quipper {
+
+namespace {
+
+std::vector<uint8_t> MakeData(size_t size) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; ++i) data[i] = i * 7 + i / 256;
+  return data;
+}
+
+}  // namespace
+
+// Read the data in pieces of various sizes, which straddle the chunks and may
+// span several of them.
+TEST(ReadAheadFileReaderTest, ReadsAcrossChunks) {
+  const std::vector<uint8_t> input_data = MakeData(1000);
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_data));
+
+  ReadAheadFileReader reader(input_file.path(), /*chunk_size=*/7,
+                             /*num_chunks=*/3);
+  ASSERT_TRUE(reader.IsOpen());
+  EXPECT_EQ(input_data.size(), reader.size());
+
+  std::vector<uint8_t> output;
+  for (size_t size = 0; output.size() < input_data.size(); ++size) {
+    const size_t n = std::min(size % 40, input_data.size() - output.size());
+    std::vector<uint8_t> piece(n);
+    ASSERT_TRUE(reader.ReadData(n, piece.data()));
+    output.insert(output.end(), piece.begin(), piece.end());
+    EXPECT_EQ(output.size(), reader.Tell());
+  }
+  EXPECT_EQ(input_data, output);
+
+  // There's nothing left to read.
+  uint8_t byte;
+  EXPECT_FALSE(reader.ReadData(1, &byte));
+  EXPECT_TRUE(reader.ReadData(0, nullptr));
+  EXPECT_FALSE(reader.ReadData(SIZE_MAX, nullptr));
+}
+
+// Seek within and out of the chunks prefetched, back and forth.
+TEST(ReadAheadFileReaderTest, ReadsAfterSeeks) {
+  const std::vector<uint8_t> input_data = MakeData(1000);
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_data));
+
+  ReadAheadFileReader reader(input_file.path(), /*chunk_size=*/16,
+                             /*num_chunks=*/4);
+  for (size_t offset : {0, 5, 40, 20, 990, 100, 101, 500, 0, 984}) {
+    ASSERT_TRUE(reader.SeekSet(offset));
+    EXPECT_EQ(offset, reader.Tell());
+    uint8_t data[10];
+    ASSERT_TRUE(reader.ReadData(sizeof(data), data));
+    EXPECT_EQ(std::vector<uint8_t>(input_data.begin() + offset,
+                                   input_data.begin() + offset + sizeof(data)),
+              std::vector<uint8_t>(data, data + sizeof(data)));
+  }
+
+  // The cursor can't be set to past the end of the file.
+  EXPECT_TRUE(reader.SeekSet(1000));
+  EXPECT_FALSE(reader.SeekSet(1200));
+  EXPECT_EQ(1000, reader.Tell());
+}
+
+TEST(ReadAheadFileReaderTest, ReadsStrings) {
+  const std::string kInputData = std::string("abc\0\0def", 8) + "ghijklmnop";
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), kInputData));
+
+  ReadAheadFileReader reader(input_file.path(), /*chunk_size=*/4,
+                             /*num_chunks=*/2);
+  std::string str;
+  EXPECT_TRUE(reader.ReadString(5, &str));
+  EXPECT_EQ("abc", str);
+  EXPECT_TRUE(reader.ReadString(8, &str));
+  EXPECT_EQ("defghijk", str);
+  EXPECT_FALSE(reader.ReadString(10, &str));
+  EXPECT_EQ("defghijk", str);
+}
+
+TEST(ReadAheadFileReaderTest, FailsToOpenMissingFile) {
+  ScopedTempDir dir;
+  ReadAheadFileReader reader(dir.path() + "missing");
+  EXPECT_FALSE(reader.IsOpen());
+  EXPECT_EQ(0, reader.size());
+}
+
+// PerfReader reads the same events through the reader as from memory.
+TEST(ReadAheadFileReaderTest, ReadsPerfData) {
+  std::stringstream input_data;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001).Time(100))
+      .WriteTo(&input_data);
+  for (int i = 0; i < 100; ++i) {
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1c1000 + i).Tid(1001).Time(200 + i))
+        .WriteTo(&input_data);
+  }
+
+  std::stringstream input;
+  testing::ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1)
+      .WithDataSize(input_data.str().size())
+      .WriteTo(&input);
+  testing::ExamplePerfFileAttr_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+  input << input_data.str();
+  ScopedTempFile file;
+  ASSERT_TRUE(BufferToFile(file.path(), input.str()));
+
+  PerfReader expected;
+  ASSERT_TRUE(expected.ReadFromString(input.str()));
+  ASSERT_EQ(101, expected.events().size());
+
+  ReadAheadFileReader data(file.path(), /*chunk_size=*/256,
+                           /*num_chunks=*/2);
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromData(&data));
+  ASSERT_EQ(expected.events().size(), reader.events().size());
+  for (int i = 0; i < reader.events().size(); ++i) {
+    EXPECT_EQ(expected.events().Get(i).SerializeAsString(),
+              reader.events().Get(i).SerializeAsString());
+  }
+}
+
+}  // namespace quipper
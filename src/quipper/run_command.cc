@@ -157,6 +157,96 @@ class SigintHandler {
 
 SigintHandler* SigintHandler::g_signal_handler;
 
+// Returns the exit status of the child |pid| in the terms of RunCommand().
+int WaitForChild(pid_t pid) {
+  int exit_status;
+  while (waitpid(pid, &exit_status, 0) < 0 && errno == EINTR) {
+  }
+  if (WIFEXITED(exit_status)) {
+    return WEXITSTATUS(exit_status);
+  } else if (WIFSIGNALED(exit_status)) {
+    return SigintHandler::GetSignaledExitStatus(exit_status);
+  }
+  return -1;
+}
+
+// Executes |command| in a child process with |stdin_fd|, unless it is -1, as
+// its stdin, |stdout_fd| as its stdout, and stderr directed to /dev/null. The
+// child is set up by |signal_handler| if not null, and is otherwise put into
+// its own process group. Other file descriptors must be close-on-exec. Returns
+// the pid of the child once it executes the command, or -1 with errno set if
+// it couldn't.
+pid_t StartCommand(const std::vector<std::string>& command, int stdin_fd,
+                   int stdout_fd, SigintHandler* signal_handler) {
+  std::vector<char*> c_str_cmd;
+  c_str_cmd.reserve(command.size() + 1);
+  for (const auto& c : command) {
+    c_str_cmd.push_back(const_cast<char*>(c.c_str()));
+  }
+  c_str_cmd.push_back(nullptr);
+
+  int errno_pipefd[2];
+  if (pipe2(errno_pipefd, O_CLOEXEC)) {
+    PLOG(ERROR) << "pipe for errno";
+    if (signal_handler != nullptr) signal_handler->OnForked(-1);
+    return -1;
+  }
+
+  const pid_t child = fork();
+  if (signal_handler != nullptr) signal_handler->OnForked(child);
+
+  if (child == 0) {
+    if (signal_handler == nullptr) {
+      (void)setpgid(0, 0);
+      (void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+    }
+    int devnull_fd = open("/dev/null", O_WRONLY);
+    if (devnull_fd < 0) {
+      PLOG(FATAL) << "open /dev/null";
+    }
+    if (stdin_fd != -1 && dup2(stdin_fd, 0) < 0) {
+      PLOG(FATAL) << "dup2 stdin";
+    }
+    if (dup2(stdout_fd, 1) < 0) {
+      PLOG(FATAL) << "dup2 stdout";
+    }
+    if (dup2(devnull_fd, 2) < 0) {
+      PLOG(FATAL) << "dup2 stderr";
+    }
+    close(devnull_fd);
+
+    execvp(c_str_cmd[0], c_str_cmd.data());
+    int exec_errno = errno;
+    int ret;
+    do {
+      ret = write(errno_pipefd[1], &exec_errno, sizeof(exec_errno));
+    } while (ret < 0 && errno == EINTR);
+    std::_Exit(EXIT_FAILURE);
+  }
+
+  close(errno_pipefd[1]);
+  if (child < 0) {
+    PLOG(ERROR) << "fork";
+    close(errno_pipefd[0]);
+    return -1;
+  }
+  int child_exec_errno;
+  int read_errno_res;
+  do {
+    read_errno_res =
+        read(errno_pipefd[0], &child_exec_errno, sizeof(child_exec_errno));
+  } while (read_errno_res < 0 && errno == EINTR);
+  close(errno_pipefd[0]);
+  if (read_errno_res > 0) {
+    // exec failed in the child.
+    while (waitpid(child, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    errno = child_exec_errno;
+    return -1;
+  }
+  return child;
+}
+
 }  // namespace
 
 int RunCommand(const std::vector<std::string>& command,
@@ -287,4 +377,78 @@ int RunCommand(const std::vector<std::string>& command,
   return -1;
 }
 
+int RunPipeline(const std::vector<std::vector<std::string>>& commands,
+                const std::function<bool(const char*, size_t)>& output) {
+  if (commands.empty()) return 0;
+
+  // pipefds[i] goes from command i to the next one, or to |output|.
+  std::vector<int> pipefds(2 * commands.size(), -1);
+  for (size_t i = 0; i < commands.size(); ++i) {
+    if (pipe2(&pipefds[2 * i], O_CLOEXEC)) {
+      PLOG(ERROR) << "pipe";
+      for (int fd : pipefds) {
+        if (fd != -1) close(fd);
+      }
+      return -1;
+    }
+  }
+
+  // Only the first command gets SIGINT forwarded, see RunCommand().
+  SigintHandler signal_handler;
+  std::vector<pid_t> children;
+  int start_errno = 0;
+  for (size_t i = 0; i < commands.size(); ++i) {
+    pid_t child =
+        StartCommand(commands[i], i == 0 ? -1 : pipefds[2 * i - 2],
+                     pipefds[2 * i + 1], i == 0 ? &signal_handler : nullptr);
+    if (child < 0) {
+      start_errno = errno;
+      break;
+    }
+    children.push_back(child);
+  }
+
+  // Only keep the read end of the last pipe. Closing the others lets the
+  // commands see the end of their input, or fail to write to a command that
+  // couldn't be executed.
+  const int output_fd = pipefds[pipefds.size() - 2];
+  for (size_t i = 0; i < pipefds.size(); ++i) {
+    if (pipefds[i] != output_fd) close(pipefds[i]);
+  }
+
+  static const size_t kReadSize = 1 << 16;
+  std::vector<char> buffer(kReadSize);
+  // The errno of a failure to read the output or to pass it on, if any.
+  int output_errno = 0;
+  while (start_errno == 0) {
+    ssize_t read_sz;
+    do {
+      read_sz = read(output_fd, buffer.data(), buffer.size());
+    } while (read_sz < 0 && errno == EINTR);
+    if (read_sz < 0) {
+      output_errno = errno;
+      PLOG(ERROR) << "read";
+      break;
+    }
+    if (read_sz == 0) break;
+    if (!output(buffer.data(), read_sz)) {
+      output_errno = ECANCELED;
+      break;
+    }
+  }
+  close(output_fd);
+
+  int status = 0;
+  for (pid_t child : children) {
+    int child_status = WaitForChild(child);
+    if (status == 0) status = child_status;
+  }
+  if (start_errno != 0 || output_errno != 0) {
+    errno = start_errno != 0 ? start_errno : output_errno;
+    return -1;
+  }
+  errno = 0;
+  return status;
+}
+
 }  // namespace quipper
@@ -5,6 +5,9 @@
 #ifndef CHROMIUMOS_WIDE_PROFILING_RUN_COMMAND_H_
 #define CHROMIUMOS_WIDE_PROFILING_RUN_COMMAND_H_
 
+#include <stddef.h>
+
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -17,6 +20,19 @@ namespace quipper {
 int RunCommand(const std::vector<std::string>& command,
                std::vector<char>* output);
 
+// Executes the commands in |commands| as a pipeline, the stdout of each one
+// being the stdin of the next. stderr is directed to /dev/null. The stdout of
+// the last command is passed to |output| in chunks as it is written, until
+// |output| returns false, after which the pipe is closed. SIGINT is forwarded
+// to the first command only, so that stopping it lets the others complete.
+// Returns the exit status of the first command, in pipeline order, that did
+// not exit with 0, or 0 if all did. Returns -1 if a command could not be
+// executed, or if the output could not be read, with errno set accordingly,
+// or if |output| returned false, with errno set to ECANCELED, since the
+// output was then not all passed on.
+int RunPipeline(const std::vector<std::vector<std::string>>& commands,
+                const std::function<bool(const char*, size_t)>& output);
+
 }  // namespace quipper
 
 #endif  // CHROMIUMOS_WIDE_PROFILING_RUN_COMMAND_H_
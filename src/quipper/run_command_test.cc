@@ -12,6 +12,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <string>
 #include <vector>
 
 #include "compat/test.h"
@@ -69,6 +70,52 @@ TEST_F(RunCommandTest, NoSuchExecutable) {
   EXPECT_EQ(ENOENT, save_errno);
 }
 
+TEST_F(RunCommandTest, PipesCommandsIntoOutput) {
+  std::string output;
+  EXPECT_EQ(0, RunPipeline({{"/bin/sh", "-c", "echo 'Hello, world!'"},
+                            {"tr", "a-z", "A-Z"},
+                            {"cat"}},
+                           [&output](const char* data, size_t size) {
+                             output.append(data, size);
+                             return true;
+                           }));
+  EXPECT_EQ("HELLO, WORLD!\n", output);
+}
+
+TEST_F(RunCommandTest, PipelineStopsReadingOutput) {
+  size_t size_read = 0;
+  EXPECT_NE(0, RunPipeline({{"dd", "if=/dev/zero", "bs=4096", "count=4096"}},
+                           [&size_read](const char* data, size_t size) {
+                             size_read += size;
+                             return false;
+                           }));
+  EXPECT_GT(size_read, 0);
+  EXPECT_LT(size_read, 4096 * 4096);
+}
+
+// The output that |output| rejects fails the pipeline, even though the
+// commands succeed.
+TEST_F(RunCommandTest, PipelineFailsWhenOutputIsRejected) {
+  int ret = RunPipeline({{"/bin/sh", "-c", "echo 'Hello, world!'"}},
+                        [](const char* data, size_t size) { return false; });
+  int save_errno = errno;
+  EXPECT_EQ(-1, ret);
+  EXPECT_EQ(ECANCELED, save_errno);
+}
+
+TEST_F(RunCommandTest, PipelineReturnsFirstFailure) {
+  auto ignore = [](const char* data, size_t size) { return true; };
+  EXPECT_EQ(3, RunPipeline({{"/bin/sh", "-c", "exit 3"},
+                            {"/bin/sh", "-c", "cat; exit 4"}},
+                           ignore));
+  EXPECT_EQ(4, RunPipeline({{"true"}, {"/bin/sh", "-c", "cat; exit 4"}},
+                           ignore));
+  int ret = RunPipeline({{"true"}, {"/doesnt-exist/not-bin/true"}}, ignore);
+  int save_errno = errno;
+  EXPECT_EQ(-1, ret);
+  EXPECT_EQ(ENOENT, save_errno);
+}
+
 TEST_F(RunCommandTest, SignalIgnore) {
   struct sigaction handler {
     {
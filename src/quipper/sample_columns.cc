@@ -0,0 +1,176 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sample_columns.h"
+
+#include "base/logging.h"
+#include "kernel/perf_event.h"
+
+namespace quipper {
+
+namespace {
+
+// Bits of the packed header telling which fields of the event are present.
+enum : uint64_t {
+  kHasMisc = 1 << 0,
+  kHasSize = 1 << 1,
+  kHasIp = 1 << 2,
+  kHasPid = 1 << 3,
+  kHasTid = 1 << 4,
+  kHasTime = 1 << 5,
+  kHasPeriod = 1 << 6,
+  // The optional fields, stored in the pool in this order.
+  kHasTimestamp = 1 << 7,
+  kHasAddr = 1 << 8,
+  kHasId = 1 << 9,
+  kHasStreamId = 1 << 10,
+  kHasCpu = 1 << 11,
+  // The event's timestamp is the sample time, so it isn't stored in the pool.
+  kTimestampIsTime = 1 << 12,
+};
+
+// The header packs the field bits in its low 16 bits, the header's misc in
+// the next 16, and the header's size in the upper 32.
+uint64_t PackHeader(uint64_t fields, uint32_t misc, uint32_t size) {
+  return fields | static_cast<uint64_t>(misc) << 16 |
+         static_cast<uint64_t>(size) << 32;
+}
+
+uint64_t HeaderFields(uint64_t header) { return header & 0xffff; }
+uint32_t HeaderMisc(uint64_t header) { return (header >> 16) & 0xffff; }
+uint32_t HeaderSize(uint64_t header) { return header >> 32; }
+
+}  // namespace
+
+// static
+bool SampleColumns::CanStore(const PerfDataProto_PerfEvent& event) {
+  if (!event.has_sample_event() || !event.header().has_type() ||
+      event.header().type() != PERF_RECORD_SAMPLE ||
+      event.header().misc() > UINT16_MAX) {
+    return false;
+  }
+  const PerfDataProto_SampleEvent& sample = event.sample_event();
+  return !sample.has_raw() && !sample.has_raw_size() &&
+         !sample.has_read_info() && sample.branch_stack_size() == 0 &&
+         !sample.has_weight() && !sample.has_data_src() &&
+         !sample.has_transaction() && !sample.has_physical_addr() &&
+         !sample.has_cgroup() && !sample.has_data_page_size() &&
+         !sample.has_code_page_size() && !sample.has_no_hw_idx() &&
+         !sample.has_branch_stack_hw_idx() && !sample.has_weight_struct();
+}
+
+void SampleColumns::Append(const PerfDataProto_PerfEvent& event,
+                           size_t event_index) {
+  DCHECK(CanStore(event));
+  const PerfDataProto_SampleEvent& sample = event.sample_event();
+  uint64_t fields = 0;
+  if (event.header().has_misc()) fields |= kHasMisc;
+  if (event.header().has_size()) fields |= kHasSize;
+  if (sample.has_ip()) fields |= kHasIp;
+  if (sample.has_pid()) fields |= kHasPid;
+  if (sample.has_tid()) fields |= kHasTid;
+  if (sample.has_sample_time_ns()) fields |= kHasTime;
+  if (sample.has_period()) fields |= kHasPeriod;
+
+  pool_offset_.push_back(pool_.size());
+  if (event.has_timestamp()) {
+    if (sample.has_sample_time_ns() &&
+        event.timestamp() == sample.sample_time_ns()) {
+      fields |= kTimestampIsTime;
+    } else {
+      fields |= kHasTimestamp;
+      pool_.push_back(event.timestamp());
+    }
+  }
+  if (sample.has_addr()) {
+    fields |= kHasAddr;
+    pool_.push_back(sample.addr());
+  }
+  if (sample.has_id()) {
+    fields |= kHasId;
+    pool_.push_back(sample.id());
+  }
+  if (sample.has_stream_id()) {
+    fields |= kHasStreamId;
+    pool_.push_back(sample.stream_id());
+  }
+  if (sample.has_cpu()) {
+    fields |= kHasCpu;
+    pool_.push_back(sample.cpu());
+  }
+  pool_.insert(pool_.end(), sample.callchain().begin(),
+               sample.callchain().end());
+
+  header_.push_back(
+      PackHeader(fields, event.header().misc(), event.header().size()));
+  event_index_.push_back(event_index);
+  ip_.push_back(sample.ip());
+  pid_.push_back(sample.pid());
+  tid_.push_back(sample.tid());
+  time_.push_back(sample.sample_time_ns());
+  period_.push_back(sample.period());
+}
+
+void SampleColumns::GetEvent(size_t i, PerfDataProto_PerfEvent* event) const {
+  event->Clear();
+  const uint64_t fields = HeaderFields(header_[i]);
+  PerfDataProto_EventHeader* header = event->mutable_header();
+  header->set_type(PERF_RECORD_SAMPLE);
+  if (fields & kHasMisc) header->set_misc(HeaderMisc(header_[i]));
+  if (fields & kHasSize) header->set_size(HeaderSize(header_[i]));
+
+  PerfDataProto_SampleEvent* sample = event->mutable_sample_event();
+  if (fields & kHasIp) sample->set_ip(ip_[i]);
+  if (fields & kHasPid) sample->set_pid(pid_[i]);
+  if (fields & kHasTid) sample->set_tid(tid_[i]);
+  if (fields & kHasTime) sample->set_sample_time_ns(time_[i]);
+  if (fields & kHasPeriod) sample->set_period(period_[i]);
+  if (fields & kTimestampIsTime) event->set_timestamp(time_[i]);
+
+  const uint64_t* pool = pool_.data() + pool_offset_[i];
+  if (fields & kHasTimestamp) event->set_timestamp(*pool++);
+  if (fields & kHasAddr) sample->set_addr(*pool++);
+  if (fields & kHasId) sample->set_id(*pool++);
+  if (fields & kHasStreamId) sample->set_stream_id(*pool++);
+  if (fields & kHasCpu) sample->set_cpu(*pool++);
+
+  const uint64_t* pool_end =
+      pool_.data() + (i + 1 < size() ? pool_offset_[i + 1] : pool_.size());
+  if (pool != pool_end) {
+    sample->mutable_callchain()->Reserve(pool_end - pool);
+    for (; pool != pool_end; ++pool) sample->add_callchain(*pool);
+  }
+}
+
+void SampleColumns::MergeInto(PerfDataProto* proto) const {
+  if (size() == 0) return;
+  // Take the events out without copying them, even if they are on an arena,
+  // and put them back with the samples in between.
+  RepeatedPtrField<PerfDataProto_PerfEvent>* events = proto->mutable_events();
+  std::vector<PerfDataProto_PerfEvent*> released(events->size());
+  events->UnsafeArenaExtractSubrange(0, released.size(), released.data());
+  events->Reserve(released.size() + size());
+
+  size_t sample = 0;
+  for (size_t i = 0; i <= released.size(); ++i) {
+    for (; sample < size() && event_index_[sample] <= i; ++sample) {
+      GetEvent(sample, events->Add());
+    }
+    if (i < released.size()) events->UnsafeArenaAddAllocated(released[i]);
+  }
+}
+
+void SampleColumns::clear() {
+  header_.clear();
+  event_index_.clear();
+  ip_.clear();
+  pid_.clear();
+  tid_.clear();
+  time_.clear();
+  period_.clear();
+  pool_.clear();
+  pool_offset_.clear();
+}
+
+}  // namespace quipper
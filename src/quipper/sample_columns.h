@@ -0,0 +1,75 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_SAMPLE_COLUMNS_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_SAMPLE_COLUMNS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "compat/proto.h"
+
+namespace quipper {
+
+// Stores PERF_RECORD_SAMPLE events compactly, outside of a PerfDataProto. The
+// common fields are kept in one array each, and the less common ones and the
+// callchains in a shared pool, so that a sample takes tens of bytes instead of
+// the hundreds taken by the PerfEvent, EventHeader and SampleEvent messages.
+//
+// Each sample remembers its position among the events of the PerfDataProto
+// that it was read with, so that the two can be replayed or merged back in the
+// original order, as long as the proto's events are not reordered.
+class SampleColumns {
+ public:
+  SampleColumns() {}
+
+  SampleColumns(const SampleColumns&) = delete;
+  SampleColumns& operator=(const SampleColumns&) = delete;
+
+  // Returns true if |event| is a sample event that can be stored without losing
+  // any of its fields. Samples with e.g. raw data or a branch stack can't.
+  static bool CanStore(const PerfDataProto_PerfEvent& event);
+
+  // Appends |event|, which must satisfy CanStore(). It goes right before the
+  // event at |event_index| in the events of the proto.
+  void Append(const PerfDataProto_PerfEvent& event, size_t event_index);
+
+  // Returns the number of stored samples.
+  size_t size() const { return header_.size(); }
+
+  // Returns the index of the proto event that sample |i| goes before.
+  size_t event_index(size_t i) const { return event_index_[i]; }
+
+  // Stores sample |i| in |event|, replacing its contents.
+  void GetEvent(size_t i, PerfDataProto_PerfEvent* event) const;
+
+  // Inserts the samples into the events of |proto| at their positions. |proto|
+  // must be the one that the samples were read with.
+  void MergeInto(PerfDataProto* proto) const;
+
+  void clear();
+
+ private:
+  // Which fields of the event proto are present, and the header's misc and
+  // size, packed together.
+  std::vector<uint64_t> header_;
+  std::vector<size_t> event_index_;
+
+  std::vector<uint64_t> ip_;
+  std::vector<uint32_t> pid_;
+  std::vector<uint32_t> tid_;
+  std::vector<uint64_t> time_;
+  std::vector<uint64_t> period_;
+
+  // The present optional fields of each sample, in a fixed order, followed by
+  // its callchain. Those of sample i start at pool_offset_[i].
+  std::vector<uint64_t> pool_;
+  std::vector<size_t> pool_offset_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_SAMPLE_COLUMNS_H_
@@ -0,0 +1,118 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sample_columns.h"
+
+#include <vector>
+
+#include "compat/proto.h"
+#include "compat/test.h"
+#include "kernel/perf_event.h"
+
+namespace quipper {
+
+namespace {
+
+PerfDataProto_PerfEvent SampleEvent(uint64_t ip) {
+  PerfDataProto_PerfEvent event;
+  event.mutable_header()->set_type(PERF_RECORD_SAMPLE);
+  event.mutable_header()->set_misc(PERF_RECORD_MISC_USER);
+  event.mutable_header()->set_size(64);
+  event.mutable_sample_event()->set_ip(ip);
+  return event;
+}
+
+}  // namespace
+
+// Samples are rebuilt with exactly the fields they were stored with.
+TEST(SampleColumnsTest, RoundTripsSamples) {
+  std::vector<PerfDataProto_PerfEvent> events;
+  events.push_back(SampleEvent(0x1000));
+
+  events.push_back(SampleEvent(0x2000));
+  PerfDataProto_SampleEvent* sample = events.back().mutable_sample_event();
+  sample->set_pid(100);
+  sample->set_tid(101);
+  sample->set_sample_time_ns(1234);
+  sample->set_period(10);
+  sample->set_cpu(0);
+  sample->add_callchain(PERF_CONTEXT_USER);
+  sample->add_callchain(0x2000);
+  sample->add_callchain(0x3000);
+  events.back().set_timestamp(1234);
+
+  events.push_back(SampleEvent(0x4000));
+  sample = events.back().mutable_sample_event();
+  sample->set_addr(0x5000);
+  sample->set_id(7);
+  sample->set_stream_id(8);
+  events.back().set_timestamp(5678);
+  events.back().mutable_header()->clear_size();
+
+  SampleColumns columns;
+  for (size_t i = 0; i < events.size(); ++i) {
+    ASSERT_TRUE(SampleColumns::CanStore(events[i]));
+    columns.Append(events[i], i);
+  }
+
+  ASSERT_EQ(events.size(), columns.size());
+  PerfDataProto_PerfEvent event;
+  for (size_t i = 0; i < events.size(); ++i) {
+    EXPECT_EQ(i, columns.event_index(i));
+    columns.GetEvent(i, &event);
+    EXPECT_TRUE(MessageDifferencer::Equals(events[i], event))
+        << "sample " << i << ": " << event.ShortDebugString();
+  }
+
+  columns.clear();
+  EXPECT_EQ(0, columns.size());
+}
+
+TEST(SampleColumnsTest, StoresOnlySamplesWithoutOtherFields) {
+  PerfDataProto_PerfEvent event = SampleEvent(0x1000);
+  EXPECT_TRUE(SampleColumns::CanStore(event));
+
+  event.mutable_sample_event()->add_branch_stack()->set_from_ip(0x1000);
+  EXPECT_FALSE(SampleColumns::CanStore(event));
+
+  event = SampleEvent(0x1000);
+  event.mutable_sample_event()->set_raw_size(0);
+  EXPECT_FALSE(SampleColumns::CanStore(event));
+
+  event = SampleEvent(0x1000);
+  event.mutable_sample_event()->set_weight(1);
+  EXPECT_FALSE(SampleColumns::CanStore(event));
+
+  PerfDataProto_PerfEvent mmap;
+  mmap.mutable_header()->set_type(PERF_RECORD_MMAP);
+  mmap.mutable_mmap_event()->set_start(0x1000);
+  EXPECT_FALSE(SampleColumns::CanStore(mmap));
+}
+
+// Merging puts each sample back before the event it was stored before.
+TEST(SampleColumnsTest, MergesSamplesIntoEvents) {
+  PerfDataProto proto;
+  for (int i = 0; i < 2; ++i) {
+    PerfDataProto_PerfEvent* mmap = proto.add_events();
+    mmap->mutable_header()->set_type(PERF_RECORD_MMAP);
+    mmap->mutable_mmap_event()->set_start(i);
+  }
+
+  SampleColumns columns;
+  columns.Append(SampleEvent(0x1000), 0);
+  columns.Append(SampleEvent(0x2000), 1);
+  columns.Append(SampleEvent(0x3000), 1);
+  columns.Append(SampleEvent(0x4000), 2);
+  columns.MergeInto(&proto);
+
+  ASSERT_EQ(6, proto.events_size());
+  EXPECT_EQ(0x1000, proto.events(0).sample_event().ip());
+  EXPECT_EQ(0, proto.events(1).mmap_event().start());
+  EXPECT_EQ(0x2000, proto.events(2).sample_event().ip());
+  EXPECT_EQ(0x3000, proto.events(3).sample_event().ip());
+  EXPECT_EQ(1, proto.events(4).mmap_event().start());
+  EXPECT_EQ(0x4000, proto.events(5).sample_event().ip());
+}
+
+}  // namespace quipper
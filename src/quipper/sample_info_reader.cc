@@ -108,8 +108,10 @@ bool ReadGroupReadInfo(DataReader* reader, uint64_t read_format,
 
 // Read call chain info from perf data.  Corresponds to sample format type
 // PERF_SAMPLE_CALLCHAIN. Returns true when callchain data is read completely.
-// Otherwise, returns false.
-bool ReadCallchain(DataReader* reader, struct perf_sample* sample) {
+// Otherwise, returns false. If |sample->in_place|, |data| is what |reader|
+// reads, and the callchain points into it.
+bool ReadCallchain(DataReader* reader, const char* data,
+                   struct perf_sample* sample) {
   // Make sure there is no existing allocated memory in |sample->callchain|.
   CHECK_EQ(static_cast<void*>(NULL), sample->callchain);
 
@@ -132,15 +134,20 @@ bool ReadCallchain(DataReader* reader, struct perf_sample* sample) {
     return false;
   }
 
+  if (sample->in_place) {
+    const size_t offset = reader->Tell() - sizeof(callchain_size);
+    sample->callchain = reinterpret_cast<struct ip_callchain*>(
+        const_cast<char*>(data + offset));
+    return reader->SeekSet(reader->Tell() + callchain_size * sizeof(u64));
+  }
+
   sample->callchain =
       reinterpret_cast<struct ip_callchain*>(new uint64_t[callchain_size + 1]);
   sample->callchain->nr = callchain_size;
 
-  for (size_t i = 0; i < callchain_size; ++i) {
-    if (!reader->ReadUint64(&sample->callchain->ips[i])) {
-      LOG(ERROR) << "Failed to read the callchain entry: " << i;
-      return false;
-    }
+  if (!reader->ReadUint64Array(sample->callchain->ips, callchain_size)) {
+    LOG(ERROR) << "Failed to read the callchain entries";
+    return false;
   }
 
   return true;
@@ -148,8 +155,10 @@ bool ReadCallchain(DataReader* reader, struct perf_sample* sample) {
 
 // Read raw info from perf data.  Corresponds to sample format type
 // PERF_SAMPLE_RAW. Returns true when raw data is read completely. Otherwise,
-// return false.
-bool ReadRawData(DataReader* reader, struct perf_sample* sample) {
+// return false. If |sample->in_place|, |data| is what |reader| reads, and the
+// raw data points into it.
+bool ReadRawData(DataReader* reader, const char* data,
+                 struct perf_sample* sample) {
   // Save the original read offset.
   size_t reader_offset = reader->Tell();
 
@@ -163,10 +172,14 @@ bool ReadRawData(DataReader* reader, struct perf_sample* sample) {
                << " cannot exceed the remaining event size " << remaining_size;
     return false;
   }
-  // Allocate space for and read the raw data bytes.
-  sample->raw_data = new uint8_t[sample->raw_size];
-  if (!reader->ReadData(sample->raw_size, sample->raw_data)) {
-    return false;
+  if (sample->in_place) {
+    sample->raw_data = const_cast<char*>(data + reader->Tell());
+  } else {
+    // Allocate space for and read the raw data bytes.
+    sample->raw_data = new uint8_t[sample->raw_size];
+    if (!reader->ReadData(sample->raw_size, sample->raw_data)) {
+      return false;
+    }
   }
 
   // Determine the bytes that were read, and align to the next 64 bits.
@@ -240,13 +253,14 @@ bool ReadBranchStack(DataReader* reader, struct perf_sample* sample) {
 // sample info fields are present.
 // |is_cross_endian| indicates that the data is cross-endian and that the byte
 // order should be reversed for each field according to its size.
+// The variable-sized fields of |skipped_fields| are skipped over unread.
 // Returns true when sample info data is read completely and updates the
 // |read_size| with the size of read or skipped perf sample info data. On
 // failure, returns false.
 bool ReadPerfSampleFromData(const event_t& event,
                             const struct perf_event_attr& attr,
-                            bool is_cross_endian, struct perf_sample* sample,
-                            size_t* read_size) {
+                            bool is_cross_endian, uint64_t skipped_fields,
+                            struct perf_sample* sample, size_t* read_size) {
   BufferReader reader(&event, event.header.size);
   reader.set_is_cross_endian(is_cross_endian);
   size_t seek = GetEventDataSize(event);
@@ -381,14 +395,25 @@ bool ReadPerfSampleFromData(const event_t& event,
   // { u64                   nr,
   //   u64                   ips[nr];  } && PERF_SAMPLE_CALLCHAIN
   if (sample_fields & PERF_SAMPLE_CALLCHAIN &&
-      !ReadCallchain(&reader, sample)) {
+      !ReadCallchain(&reader, reinterpret_cast<const char*>(&event),
+                     sample)) {
     LOG(ERROR) << "Couldn't read PERF_SAMPLE_CALLCHAIN";
     return false;
   }
 
   // { u32                   size;
   //   char                  data[size];}&& PERF_SAMPLE_RAW
-  if (sample_fields & PERF_SAMPLE_RAW && !ReadRawData(&reader, sample)) {
+  if (sample_fields & PERF_SAMPLE_RAW & skipped_fields) {
+    uint32_t raw_size = 0;
+    if (!reader.ReadUint32(&raw_size) ||
+        !reader.SeekSet(reader.Tell() - sizeof(raw_size) +
+                        Align<uint64_t>(sizeof(raw_size) + raw_size))) {
+      LOG(ERROR) << "Couldn't skip PERF_SAMPLE_RAW";
+      return false;
+    }
+  } else if (sample_fields & PERF_SAMPLE_RAW &&
+             !ReadRawData(&reader, reinterpret_cast<const char*>(&event),
+                          sample)) {
     LOG(ERROR) << "Couldn't read PERF_SAMPLE_RAW";
     return false;
   }
@@ -408,7 +433,17 @@ bool ReadPerfSampleFromData(const event_t& event,
 
   // { u64                   abi; # enum perf_sample_regs_abi
   //   u64                   regs[weight(mask)]; } && PERF_SAMPLE_REGS_USER
-  if (sample_fields & PERF_SAMPLE_REGS_USER) {
+  if (sample_fields & PERF_SAMPLE_REGS_USER & skipped_fields) {
+    // There are no registers when the ABI is PERF_SAMPLE_REGS_ABI_NONE.
+    uint64_t abi = 0;
+    const size_t regs_size =
+        __builtin_popcountll(attr.sample_regs_user) * sizeof(u64);
+    if (!reader.ReadUint64(&abi) ||
+        (abi != 0 && !reader.SeekSet(reader.Tell() + regs_size))) {
+      LOG(ERROR) << "Couldn't skip PERF_SAMPLE_REGS_USER";
+      return false;
+    }
+  } else if (sample_fields & PERF_SAMPLE_REGS_USER) {
     LOG(ERROR) << "PERF_SAMPLE_REGS_USER is not yet supported.";
     return false;
   }
@@ -416,7 +451,17 @@ bool ReadPerfSampleFromData(const event_t& event,
   // { u64                   size;
   //   char                  data[size];
   //   u64                   dyn_size; } && PERF_SAMPLE_STACK_USER
-  if (sample_fields & PERF_SAMPLE_STACK_USER) {
+  if (sample_fields & PERF_SAMPLE_STACK_USER & skipped_fields) {
+    // There is no |dyn_size| when the stack is empty.
+    uint64_t stack_size = 0, dyn_size = 0;
+    if (!reader.ReadUint64(&stack_size) ||
+        stack_size > reader.size() - reader.Tell() ||
+        !reader.SeekSet(reader.Tell() + stack_size) ||
+        (stack_size != 0 && !reader.ReadUint64(&dyn_size))) {
+      LOG(ERROR) << "Couldn't skip PERF_SAMPLE_STACK_USER";
+      return false;
+    }
+  } else if (sample_fields & PERF_SAMPLE_STACK_USER) {
     LOG(ERROR) << "PERF_SAMPLE_STACK_USER is not yet supported.";
     return false;
   }
@@ -847,9 +892,117 @@ bool SampleInfoReader::IsSupportedEventType(uint32_t type) {
   return false;
 }
 
+void SampleInfoReader::InitSampleLayout() {
+  // The fields of PERF_RECORD_SAMPLE that are 64 bits each, in their order in
+  // the event, and the member of SampleLayout that holds their offset.
+  const struct {
+    uint64_t field;
+    uint16_t SampleLayout::*offset;
+  } kFixedFields[] = {
+      {PERF_SAMPLE_IDENTIFIER, &SampleLayout::id},
+      {PERF_SAMPLE_IP, &SampleLayout::ip},
+      {PERF_SAMPLE_TID, &SampleLayout::tid},
+      {PERF_SAMPLE_TIME, &SampleLayout::time},
+      {PERF_SAMPLE_ADDR, &SampleLayout::addr},
+      // PERF_SAMPLE_ID overrides PERF_SAMPLE_IDENTIFIER, as in
+      // ReadPerfSampleFromData().
+      {PERF_SAMPLE_ID, &SampleLayout::id},
+      {PERF_SAMPLE_STREAM_ID, &SampleLayout::stream_id},
+      {PERF_SAMPLE_CPU, &SampleLayout::cpu},
+      {PERF_SAMPLE_PERIOD, &SampleLayout::period},
+  };
+
+  sample_layout_ = SampleLayout();
+  uint64_t fields = event_attr_.sample_type;
+  has_sample_layout_ = !read_cross_endian_;
+  uint16_t offset = sizeof(struct perf_event_header);
+  for (const auto& fixed_field : kFixedFields) {
+    if (!(fields & fixed_field.field)) continue;
+    sample_layout_.*fixed_field.offset = offset;
+    offset += sizeof(uint64_t);
+    fields &= ~fixed_field.field;
+  }
+  sample_layout_.fixed_size = offset;
+  if (fields & PERF_SAMPLE_CALLCHAIN) {
+    sample_layout_.callchain = offset;
+    fields &= ~PERF_SAMPLE_CALLCHAIN;
+  }
+  if (fields != 0) has_sample_layout_ = false;
+}
+
+bool SampleInfoReader::ReadSampleWithLayout(const event_t& event,
+                                            struct perf_sample* sample) const {
+  const SampleLayout& layout = sample_layout_;
+  const char* data = reinterpret_cast<const char*>(&event);
+  const size_t size = event.header.size;
+  if (size < layout.fixed_size) return false;
+
+  uint64_t callchain_size = 0;
+  if (layout.callchain) {
+    if (size - layout.fixed_size < sizeof(callchain_size)) return false;
+    memcpy(&callchain_size, data + layout.callchain, sizeof(callchain_size));
+    const size_t max_callchain_entries =
+        (size - layout.fixed_size - sizeof(callchain_size)) / sizeof(u64);
+    if (callchain_size > max_callchain_entries ||
+        size != layout.fixed_size + sizeof(callchain_size) +
+                    callchain_size * sizeof(u64)) {
+      return false;
+    }
+  } else if (size != layout.fixed_size) {
+    return false;
+  }
+
+  if (layout.ip) memcpy(&sample->ip, data + layout.ip, sizeof(sample->ip));
+  if (layout.tid) {
+    memcpy(&sample->pid, data + layout.tid, sizeof(sample->pid));
+    memcpy(&sample->tid, data + layout.tid + sizeof(sample->pid),
+           sizeof(sample->tid));
+  }
+  if (layout.time) {
+    memcpy(&sample->time, data + layout.time, sizeof(sample->time));
+  }
+  if (layout.addr) {
+    memcpy(&sample->addr, data + layout.addr, sizeof(sample->addr));
+  }
+  if (layout.id) memcpy(&sample->id, data + layout.id, sizeof(sample->id));
+  if (layout.stream_id) {
+    memcpy(&sample->stream_id, data + layout.stream_id,
+           sizeof(sample->stream_id));
+  }
+  if (layout.cpu) memcpy(&sample->cpu, data + layout.cpu, sizeof(sample->cpu));
+  if (layout.period) {
+    memcpy(&sample->period, data + layout.period, sizeof(sample->period));
+  }
+  if (layout.callchain) {
+    // Make sure there is no existing allocated memory in |sample->callchain|.
+    CHECK_EQ(static_cast<void*>(NULL), sample->callchain);
+    if (sample->in_place) {
+      sample->callchain = reinterpret_cast<struct ip_callchain*>(
+          const_cast<char*>(data + layout.callchain));
+      return true;
+    }
+    sample->callchain = reinterpret_cast<struct ip_callchain*>(
+        new uint64_t[callchain_size + 1]);
+    sample->callchain->nr = callchain_size;
+    memcpy(sample->callchain->ips,
+           data + layout.callchain + sizeof(callchain_size),
+           callchain_size * sizeof(u64));
+  }
+  return true;
+}
+
 bool SampleInfoReader::ReadPerfSampleInfo(const event_t& event,
-                                          struct perf_sample* sample) const {
+                                          struct perf_sample* sample,
+                                          bool in_place) const {
   CHECK(sample);
+  sample->in_place = in_place && !read_cross_endian_;
+
+  // Events that don't match the layout are read below, which reports the
+  // error.
+  if (has_sample_layout_ && event.header.type == PERF_RECORD_SAMPLE &&
+      ReadSampleWithLayout(event, sample)) {
+    return true;
+  }
 
   if (!SampleInfoReader::IsSupportedEventType(event.header.type)) {
     LOG(ERROR) << "Unsupported event " << GetEventName(event.header.type);
@@ -857,7 +1010,8 @@ bool SampleInfoReader::ReadPerfSampleInfo(const event_t& event,
   }
 
   size_t size_read_or_skipped = 0;
-  if (!ReadPerfSampleFromData(event, event_attr_, read_cross_endian_, sample,
+  if (!ReadPerfSampleFromData(event, event_attr_, read_cross_endian_,
+                              skipped_fields_, sample,
                               &size_read_or_skipped)) {
     return false;
   }
@@ -870,6 +1024,22 @@ bool SampleInfoReader::ReadPerfSampleInfo(const event_t& event,
   return (size_read_or_skipped == event.header.size);
 }
 
+bool SampleInfoReader::ReadSamplePid(const event_t& event,
+                                     uint32_t* pid) const {
+  const uint64_t sample_type = event_attr_.sample_type;
+  if (event.header.type != PERF_RECORD_SAMPLE ||
+      !(sample_type & PERF_SAMPLE_TID)) {
+    return false;
+  }
+  size_t offset = sizeof(struct perf_event_header);
+  if (sample_type & PERF_SAMPLE_IDENTIFIER) offset += sizeof(uint64_t);
+  if (sample_type & PERF_SAMPLE_IP) offset += sizeof(uint64_t);
+  if (event.header.size < offset + sizeof(*pid)) return false;
+  BufferReader reader(&event, event.header.size);
+  reader.set_is_cross_endian(read_cross_endian_);
+  return reader.SeekSet(offset) && reader.ReadUint32(pid);
+}
+
 bool SampleInfoReader::WritePerfSampleInfo(const perf_sample& sample,
                                            event_t* event) const {
   CHECK(event);
@@ -21,13 +21,30 @@ struct perf_sample;
 class SampleInfoReader {
  public:
   SampleInfoReader(struct perf_event_attr event_attr, bool read_cross_endian)
-      : event_attr_(event_attr), read_cross_endian_(read_cross_endian) {}
+      : event_attr_(event_attr), read_cross_endian_(read_cross_endian) {
+    InitSampleLayout();
+  }
 
   // Returns true if the given event type is supported by the SampleInfoReader.
   static bool IsSupportedEventType(uint32_t type);
 
-  bool ReadPerfSampleInfo(const event_t& event,
-                          struct perf_sample* sample) const;
+  // Reads the sample info fields of |event| into |sample|. If |in_place|, the
+  // callchain and raw data of |sample| point into |event| instead of being
+  // copied, unless their bytes need to be swapped, so |event| must outlive
+  // |sample|.
+  bool ReadPerfSampleInfo(const event_t& event, struct perf_sample* sample,
+                          bool in_place = false) const;
+
+  // Makes ReadPerfSampleInfo() skip over the fields of |fields| among
+  // PERF_SAMPLE_RAW, PERF_SAMPLE_REGS_USER and PERF_SAMPLE_STACK_USER, which
+  // are left empty, instead of reading them. The user registers and stack
+  // can't be read otherwise.
+  void set_skipped_fields(uint64_t fields) { skipped_fields_ = fields; }
+
+  // Reads only the PID of a PERF_RECORD_SAMPLE event, which only the
+  // identifier and the IP come before. Returns false if the samples don't
+  // have a PID.
+  bool ReadSamplePid(const event_t& event, uint32_t* pid) const;
   bool WritePerfSampleInfo(const perf_sample& sample, event_t* event) const;
   // Given a general perf sample format |sample_type|, return the fields of that
   // format that are present in a sample for an event of type |event_type|.
@@ -59,6 +76,34 @@ class SampleInfoReader {
   const perf_event_attr& event_attr() const { return event_attr_; }
 
  private:
+  // Byte offsets of the fields of a PERF_RECORD_SAMPLE event, from the start of
+  // the event, or 0 for the fields that are not present.
+  struct SampleLayout {
+    uint16_t ip;
+    uint16_t tid;
+    uint16_t time;
+    uint16_t addr;
+    uint16_t id;
+    uint16_t stream_id;
+    uint16_t cpu;
+    uint16_t period;
+    // The callchain is the last field when present.
+    uint16_t callchain;
+    // The size of the event, or of the fields before the callchain if any.
+    uint16_t fixed_size;
+  };
+
+  // Sets up |sample_layout_| if the sample type of |event_attr_| only has
+  // fields at fixed offsets, optionally followed by a callchain, and the data
+  // doesn't need byte swapping. These are the common layouts, which can then
+  // be decoded with direct loads instead of walking the sample type bits.
+  void InitSampleLayout();
+
+  // Reads a PERF_RECORD_SAMPLE event using |sample_layout_|. Returns false
+  // without changing |sample| if the event doesn't match the layout.
+  bool ReadSampleWithLayout(const event_t& event,
+                            struct perf_sample* sample) const;
+
   // Event attribute info, which determines the contents of some perf_sample
   // data.
   struct perf_event_attr event_attr_;
@@ -66,6 +111,13 @@ class SampleInfoReader {
   // Set this flag if values (uint32s and uint64s) should be endian-swapped
   // during reads.
   bool read_cross_endian_;
+
+  // See set_skipped_fields().
+  uint64_t skipped_fields_ = 0;
+
+  // Whether PERF_RECORD_SAMPLE events can be read with |sample_layout_|.
+  bool has_sample_layout_;
+  SampleLayout sample_layout_;
 };
 
 }  // namespace quipper
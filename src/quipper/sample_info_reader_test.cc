@@ -233,6 +233,185 @@ TEST(SampleInfoReaderTest, ReadSampleEventCrossEndian) {
   EXPECT_EQ(bswap_64(10001), sample.period);
 }
 
+TEST(SampleInfoReaderTest, ReadSampleEventWithCallchain) {
+  // clang-format off
+  uint64_t sample_type =
+      PERF_SAMPLE_IDENTIFIER |
+      PERF_SAMPLE_IP |
+      PERF_SAMPLE_TID |
+      PERF_SAMPLE_TIME |
+      PERF_SAMPLE_CPU |
+      PERF_SAMPLE_PERIOD |
+      PERF_SAMPLE_CALLCHAIN;
+  // clang-format on
+  struct perf_event_attr attr = {0};
+  attr.sample_type = sample_type;
+
+  SampleInfoReader reader(attr, false /* read_cross_endian */);
+
+  const u64 sample_event_array[] = {
+      3,                                     // IDENTIFIER
+      0xffffffff01234567,                    // IP
+      PunU32U64{.v32 = {0x68d, 0x68e}}.v64,  // TID (u32 pid, tid)
+      1415837014 * 1000000000ULL,            // TIME
+      8,                                     // CPU
+      10001,                                 // PERIOD
+      3,                                     // CALLCHAIN nr
+      PERF_CONTEXT_USER,                     // CALLCHAIN ips
+      0x00007f999c38d15a,
+      0x00007f999c38e000,
+  };
+  sample_event sample_event_struct = {
+      .header = {
+          .type = PERF_RECORD_SAMPLE,
+          .misc = 0,
+          .size = sizeof(sample_event) + sizeof(sample_event_array),
+      }};
+
+  std::stringstream input;
+  input.write(reinterpret_cast<const char*>(&sample_event_struct),
+              sizeof(sample_event_struct));
+  input.write(reinterpret_cast<const char*>(sample_event_array),
+              sizeof(sample_event_array));
+  std::string input_string = input.str();
+  const event_t& event = *reinterpret_cast<const event_t*>(input_string.data());
+
+  perf_sample sample;
+  ASSERT_TRUE(reader.ReadPerfSampleInfo(event, &sample));
+
+  EXPECT_EQ(3, sample.id);
+  EXPECT_EQ(0xffffffff01234567, sample.ip);
+  EXPECT_EQ(0x68d, sample.pid);
+  EXPECT_EQ(0x68e, sample.tid);
+  EXPECT_EQ(1415837014 * 1000000000ULL, sample.time);
+  EXPECT_EQ(8, sample.cpu);
+  EXPECT_EQ(10001, sample.period);
+  ASSERT_NE(nullptr, sample.callchain);
+  ASSERT_EQ(3, sample.callchain->nr);
+  EXPECT_EQ(PERF_CONTEXT_USER, sample.callchain->ips[0]);
+  EXPECT_EQ(0x00007f999c38d15a, sample.callchain->ips[1]);
+  EXPECT_EQ(0x00007f999c38e000, sample.callchain->ips[2]);
+
+  // The callchain can't extend past the end of the event.
+  input_string.resize(input_string.size() - sizeof(u64));
+  sample_event_struct.header.size -= sizeof(u64);
+  memcpy(&input_string[0], &sample_event_struct, sizeof(sample_event_struct));
+  const event_t& truncated_event =
+      *reinterpret_cast<const event_t*>(input_string.data());
+  perf_sample truncated_sample;
+  EXPECT_FALSE(reader.ReadPerfSampleInfo(truncated_event, &truncated_sample));
+}
+
+TEST(SampleInfoReaderTest, ReadSampleEventInPlace) {
+  struct perf_event_attr attr = {0};
+  attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
+
+  const u64 sample_event_array[] = {
+      0xffffffff01234567,                   // IP
+      2,                                    // CALLCHAIN nr
+      PERF_CONTEXT_USER,                    // CALLCHAIN ips
+      0x00007f999c38d15a,
+      PunU32U64{.v32 = {4, 0xdeadbeef}}.v64,  // RAW (u32 size, data[size])
+  };
+  const sample_event sample_event_struct = {
+      .header = {
+          .type = PERF_RECORD_SAMPLE,
+          .misc = 0,
+          .size = sizeof(sample_event) + sizeof(sample_event_array),
+      }};
+
+  std::stringstream input;
+  input.write(reinterpret_cast<const char*>(&sample_event_struct),
+              sizeof(sample_event_struct));
+  input.write(reinterpret_cast<const char*>(sample_event_array),
+              sizeof(sample_event_array));
+  std::string input_string = input.str();
+  const event_t& event = *reinterpret_cast<const event_t*>(input_string.data());
+  const char* data = input_string.data();
+
+  // Without raw data, the sample has a layout of fixed offsets.
+  {
+    std::string callchain_string = input_string;
+    callchain_string.resize(callchain_string.size() - sizeof(u64));
+    event_t& callchain_event =
+        *reinterpret_cast<event_t*>(&callchain_string[0]);
+    callchain_event.header.size -= sizeof(u64);
+    SampleInfoReader reader(attr, false /* read_cross_endian */);
+    perf_sample sample;
+    ASSERT_TRUE(reader.ReadPerfSampleInfo(callchain_event, &sample,
+                                          true /* in_place */));
+    EXPECT_TRUE(sample.in_place);
+    EXPECT_EQ(callchain_string.data() + sizeof(sample_event) + sizeof(u64),
+              reinterpret_cast<const char*>(sample.callchain));
+    ASSERT_EQ(2, sample.callchain->nr);
+    EXPECT_EQ(0x00007f999c38d15a, sample.callchain->ips[1]);
+  }
+
+  attr.sample_type |= PERF_SAMPLE_RAW;
+  SampleInfoReader reader(attr, false /* read_cross_endian */);
+  perf_sample sample;
+  ASSERT_TRUE(reader.ReadPerfSampleInfo(event, &sample, true /* in_place */));
+  EXPECT_EQ(0xffffffff01234567, sample.ip);
+  EXPECT_EQ(data + sizeof(sample_event) + sizeof(u64),
+            reinterpret_cast<const char*>(sample.callchain));
+  ASSERT_EQ(2, sample.callchain->nr);
+  EXPECT_EQ(PERF_CONTEXT_USER, sample.callchain->ips[0]);
+  EXPECT_EQ(0x00007f999c38d15a, sample.callchain->ips[1]);
+  ASSERT_EQ(4, sample.raw_size);
+  EXPECT_EQ(data + sizeof(sample_event) + 4 * sizeof(u64) + sizeof(u32),
+            static_cast<const char*>(sample.raw_data));
+
+  // Data that needs its bytes swapped is still copied.
+  SampleInfoReader cross_endian_reader(attr, true /* read_cross_endian */);
+  perf_sample copied_sample;
+  cross_endian_reader.ReadPerfSampleInfo(event, &copied_sample,
+                                         true /* in_place */);
+  EXPECT_FALSE(copied_sample.in_place);
+}
+
+TEST(SampleInfoReaderTest, SkipsUserRegsAndStack) {
+  struct perf_event_attr attr = {0};
+  attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_REGS_USER |
+                     PERF_SAMPLE_STACK_USER | PERF_SAMPLE_WEIGHT;
+  attr.sample_regs_user = 0x3;
+
+  const u64 sample_event_array[] = {
+      0xffffffff01234567,       // IP
+      PERF_SAMPLE_REGS_ABI_64,  // REGS_USER abi
+      0x00007ffe12345678,       // REGS_USER regs[2]
+      0x00007ffe12345000,
+      16,                       // STACK_USER size
+      0x1111111111111111,       // STACK_USER data[16]
+      0x2222222222222222,
+      8,                        // STACK_USER dyn_size
+      12345,                    // WEIGHT
+  };
+  const sample_event sample_event_struct = {
+      .header = {
+          .type = PERF_RECORD_SAMPLE,
+          .misc = 0,
+          .size = sizeof(sample_event) + sizeof(sample_event_array),
+      }};
+
+  std::stringstream input;
+  input.write(reinterpret_cast<const char*>(&sample_event_struct),
+              sizeof(sample_event_struct));
+  input.write(reinterpret_cast<const char*>(sample_event_array),
+              sizeof(sample_event_array));
+  std::string input_string = input.str();
+  const event_t& event = *reinterpret_cast<const event_t*>(input_string.data());
+
+  SampleInfoReader reader(attr, false /* read_cross_endian */);
+  perf_sample unsupported_sample;
+  EXPECT_FALSE(reader.ReadPerfSampleInfo(event, &unsupported_sample));
+
+  reader.set_skipped_fields(PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER);
+  perf_sample sample;
+  ASSERT_TRUE(reader.ReadPerfSampleInfo(event, &sample));
+  EXPECT_EQ(0xffffffff01234567, sample.ip);
+  EXPECT_EQ(12345, sample.weight.full);
+}
+
 TEST(SampleInfoReaderTest, ReadMmapEvent) {
   // clang-format off
   uint64_t sample_type =      // * == in sample_id_all
@@ -0,0 +1,18 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "string_interner.h"
+
+namespace quipper {
+
+const std::string* StringInterner::Intern(std::string_view str) {
+  const auto it = index_.find(str);
+  if (it != index_.end()) return it->second;
+  // The key views the copy, whose characters don't move either.
+  const std::string* copy = &strings_.emplace_back(str);
+  index_.emplace(*copy, copy);
+  return copy;
+}
+
+}  // namespace quipper
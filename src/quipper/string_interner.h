@@ -0,0 +1,43 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_STRING_INTERNER_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_STRING_INTERNER_H_
+
+#include <stddef.h>
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace quipper {
+
+// Keeps a single copy of each distinct string it is given, e.g. the commands
+// of the threads of a profile, which may have millions of threads but only a
+// few commands. The copies are stored one after the other and keep their
+// addresses until the interner is destroyed, so that they may be referenced,
+// and compared, by address.
+class StringInterner {
+ public:
+  StringInterner() {}
+
+  StringInterner(const StringInterner&) = delete;
+  StringInterner& operator=(const StringInterner&) = delete;
+
+  // Returns the copy of |str|, adding it if it is new.
+  const std::string* Intern(std::string_view str);
+
+  // The number of distinct strings.
+  size_t size() const { return strings_.size(); }
+
+ private:
+  std::deque<std::string> strings_;
+  // The copies in |strings_| by their contents.
+  std::unordered_map<std::string_view, const std::string*> index_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_STRING_INTERNER_H_
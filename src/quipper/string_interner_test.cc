@@ -0,0 +1,37 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "string_interner.h"
+
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+
+namespace quipper {
+
+TEST(StringInternerTest, KeepsOneStableCopyOfEachString) {
+  StringInterner interner;
+  const std::string* foo = interner.Intern("foo");
+  EXPECT_EQ("foo", *foo);
+  EXPECT_EQ(foo, interner.Intern(std::string("foo")));
+  EXPECT_NE(foo, interner.Intern("bar"));
+  EXPECT_EQ(2, interner.size());
+
+  // The copies don't move as more strings are added, short or long.
+  std::vector<const std::string*> copies;
+  for (int i = 0; i < 1000; ++i) {
+    copies.push_back(interner.Intern(std::string(i % 50, 'x') +
+                                     std::to_string(i)));
+  }
+  EXPECT_EQ(foo, interner.Intern("foo"));
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(std::string(i % 50, 'x') + std::to_string(i), *copies[i]);
+    EXPECT_EQ(copies[i],
+              interner.Intern(std::string(i % 50, 'x') + std::to_string(i)));
+  }
+  EXPECT_EQ(1002, interner.size());
+}
+
+}  // namespace quipper
@@ -0,0 +1,391 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "synthetic_perf_data.h"
+
+#include <sys/mman.h>
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "binary_data_utils.h"
+#include "kernel/perf_event.h"
+#include "kernel/perf_internals.h"
+#include "test_perf_data.h"
+
+namespace quipper {
+namespace testing {
+
+namespace {
+
+// The layout of the address spaces. Each process maps its binary, then its
+// libraries and JIT regions one after the other.
+constexpr u64 kBinaryStart = 0x400000;
+constexpr u64 kLibraryStart = 0x7f0000000000;
+constexpr u64 kJitStart = 0x7e0000000000;
+constexpr u64 kMappingSize = 0x200000;
+constexpr u64 kJitRegionSize = 0x10000;
+constexpr u64 kFunctionSize = 0x400;
+// Where the data accesses traced by SPE go.
+constexpr u64 kHeapStart = 0x5500000000;
+constexpr u64 kHeapSize = 0x10000000;
+
+// The numbers of distinct binaries and libraries that the processes map, so
+// that the same files show up in many of them.
+constexpr int kNumBinaries = 16;
+constexpr int kNumLibraries = 64;
+// The number of functions whose addresses the most frequent frames take.
+constexpr u64 kNumFunctions = 256;
+
+constexpr int kMaxMappings = 1024;
+constexpr int kMaxStackDepth = 1024;
+constexpr int kMaxBranchStackEntries = 32;
+
+// The size of the buffered SPE records above which they are written out in a
+// PERF_RECORD_AUXTRACE event.
+constexpr size_t kSpeBufferSize = 64 * 1024;
+
+constexpr u64 kBaseSampleType = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                                PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD |
+                                PERF_SAMPLE_CALLCHAIN;
+
+// The branch entry flags of predicted and mispredicted branches.
+constexpr u64 kBranchMispredicted = 0x1;
+constexpr u64 kBranchPredicted = 0x2;
+
+struct Process {
+  u32 pid;
+  u32 ppid;
+  // The address ranges mapped by the process, as [start, start + len).
+  std::vector<std::pair<u64, u64>> mappings;
+};
+
+bool ValidateOptions(const SyntheticPerfDataOptions& options) {
+  if (options.num_processes < 1) {
+    LOG(ERROR) << "There has to be at least one process";
+    return false;
+  }
+  if (options.mmaps_per_process < 1 ||
+      options.mmaps_per_process > kMaxMappings ||
+      options.jit_regions_per_process < 0 ||
+      options.jit_regions_per_process > kMaxMappings) {
+    LOG(ERROR) << "Each process needs 1 to " << kMaxMappings
+               << " mmaps and up to " << kMaxMappings << " JIT regions";
+    return false;
+  }
+  if (options.min_stack_depth < 1 ||
+      options.min_stack_depth > options.max_stack_depth ||
+      options.max_stack_depth > kMaxStackDepth) {
+    LOG(ERROR) << "Invalid stack depths: " << options.min_stack_depth
+               << " to " << options.max_stack_depth;
+    return false;
+  }
+  if (options.branch_stack_entries < 0 ||
+      options.branch_stack_entries > kMaxBranchStackEntries) {
+    LOG(ERROR) << "Branch stacks have up to " << kMaxBranchStackEntries
+               << " entries";
+    return false;
+  }
+  if (options.cross_endian && options.branch_stack_entries > 0) {
+    LOG(ERROR) << "Cross-endian branch stacks are not supported";
+    return false;
+  }
+  if (options.spe_records_per_sample < 0) {
+    LOG(ERROR) << "Invalid number of SPE records per sample";
+    return false;
+  }
+  if (!(options.churn_rate >= 0 && options.churn_rate <= 1) ||
+      !(options.lost_rate >= 0 && options.lost_rate <= 1)) {
+    LOG(ERROR) << "The churn and lost rates are probabilities";
+    return false;
+  }
+  return true;
+}
+
+// Writes the events of a synthetic perf.data file. The random numbers are
+// drawn from the raw output of std::mt19937_64, whose sequence is specified,
+// rather than from the standard distributions, whose results vary across
+// implementations, so that a seed gives the same file everywhere.
+class Generator {
+ public:
+  Generator(const SyntheticPerfDataOptions& options, std::ostream* out,
+            SyntheticPerfDataStats* stats)
+      : options_(options), out_(out), stats_(stats), random_(options.seed) {}
+
+  Generator(const Generator&) = delete;
+  Generator& operator=(const Generator&) = delete;
+
+  bool Write();
+
+ private:
+  // Returns a random number in [0, n).
+  u64 Random(u64 n) { return random_() % n; }
+
+  // Returns true with probability |p|.
+  bool Chance(double p) { return (random_() >> 11) * 0x1.0p-53 < p; }
+
+  u32 Swap32(u32 value) const {
+    return MaybeSwap(value, options_.cross_endian);
+  }
+  u64 Swap64(u64 value) const {
+    return MaybeSwap(value, options_.cross_endian);
+  }
+
+  // Writes |event| in the byte order of the file.
+  template <typename T>
+  void WriteEvent(T&& event) {
+    event.WithCrossEndianness(options_.cross_endian).WriteTo(out_);
+  }
+
+  // The sample_id_all fields of the events of |process|.
+  SampleInfo SampleId(const Process& process) const {
+    return SampleInfo()
+        .Tid(Swap32(process.pid), Swap32(process.pid))
+        .Time(Swap64(time_));
+  }
+
+  // Returns a random code address of |process|. Low function numbers are the
+  // most frequent, so that the profiles have hot spots.
+  u64 CodeAddress(const Process& process) {
+    const auto& mapping = process.mappings[Random(process.mappings.size())];
+    const u64 function =
+        Random(Random(kNumFunctions) + 1) % (mapping.second / kFunctionSize);
+    return mapping.first + function * kFunctionSize + Random(kFunctionSize);
+  }
+
+  // Writes the COMM and MMAP2 events of |process| executing a random binary.
+  void Exec(Process* process);
+  // Forks a process from the one at |parent| and makes it exec.
+  Process Fork(const Process& parent);
+  // Replaces a random process by a new one.
+  void Churn();
+  void WriteSample(const Process& process);
+  void AddSpeRecord(const Process& process);
+  // Writes out the buffered SPE records.
+  void FlushSpeRecords();
+
+  const SyntheticPerfDataOptions& options_;
+  std::ostream* out_;
+  SyntheticPerfDataStats* stats_;
+  std::mt19937_64 random_;
+
+  u64 time_ = 0;
+  u32 next_pid_ = 1000;
+  std::vector<Process> processes_;
+
+  std::string spe_buffer_;
+  // The offset of the next SPE buffer in the AUX area.
+  u64 aux_offset_ = 0;
+};
+
+void Generator::Exec(Process* process) {
+  const u64 binary = Random(kNumBinaries);
+  WriteEvent(ExampleCommEvent(process->pid, process->pid,
+                              "synthetic" + std::to_string(binary),
+                              SampleId(*process)));
+  ++stats_->comms;
+  process->mappings.clear();
+  for (int i = 0; i < options_.mmaps_per_process; ++i) {
+    u64 start;
+    std::string filename;
+    if (i == 0) {
+      start = kBinaryStart;
+      filename = "/usr/bin/synthetic" + std::to_string(binary);
+    } else {
+      start = kLibraryStart + (i - 1) * kMappingSize;
+      filename =
+          "/usr/lib/libsynthetic" + std::to_string(Random(kNumLibraries)) +
+          ".so";
+    }
+    WriteEvent(ExampleMmap2Event(process->pid, start, kMappingSize, 0,
+                                 filename, SampleId(*process))
+                   .WithProtFlags(PROT_READ | PROT_EXEC, MAP_PRIVATE));
+    process->mappings.emplace_back(start, kMappingSize);
+  }
+  for (int i = 0; i < options_.jit_regions_per_process; ++i) {
+    const u64 start = kJitStart + i * kJitRegionSize;
+    WriteEvent(ExampleMmap2Event(process->pid, start, kJitRegionSize, 0,
+                                 "/tmp/jitted-" + std::to_string(process->pid) +
+                                     "-" + std::to_string(i) + ".so",
+                                 SampleId(*process))
+                   .WithProtFlags(PROT_READ | PROT_EXEC, MAP_PRIVATE));
+    process->mappings.emplace_back(start, kJitRegionSize);
+  }
+  stats_->mmaps +=
+      options_.mmaps_per_process + options_.jit_regions_per_process;
+}
+
+Process Generator::Fork(const Process& parent) {
+  Process child{next_pid_++, parent.pid, {}};
+  WriteEvent(ExampleForkEvent(child.pid, parent.pid, child.pid, parent.pid,
+                              time_, SampleId(child)));
+  ++stats_->forks;
+  Exec(&child);
+  return child;
+}
+
+void Generator::Churn() {
+  const u64 exiting = Random(processes_.size());
+  Process child = Fork(processes_[Random(processes_.size())]);
+  const Process& process = processes_[exiting];
+  WriteEvent(ExampleExitEvent(process.pid, process.ppid, process.pid,
+                              process.ppid, time_, SampleId(process)));
+  ++stats_->exits;
+  processes_[exiting] = std::move(child);
+}
+
+void Generator::WriteSample(const Process& process) {
+  // Depths are drawn from a quadratic distribution: a depth d is about twice
+  // as likely as a depth 2d, as in most profiles.
+  const double u = (random_() >> 11) * 0x1.0p-53;
+  const int depth =
+      options_.min_stack_depth +
+      static_cast<int>((options_.max_stack_depth - options_.min_stack_depth +
+                        1) * u * u);
+  const u64 ip = CodeAddress(process);
+  SampleInfo sample;
+  sample.Ip(Swap64(ip))
+      .Tid(Swap32(process.pid), Swap32(process.pid))
+      .Time(Swap64(time_))
+      .Period(Swap64(10000 + Random(100)))
+      .Callchain_nr(Swap64(depth + 1))
+      .Callchain_ip(Swap64(PERF_CONTEXT_USER))
+      .Callchain_ip(Swap64(ip));
+  for (int i = 1; i < depth; ++i) {
+    sample.Callchain_ip(Swap64(CodeAddress(process)));
+  }
+  if (options_.branch_stack_entries > 0) {
+    sample.BranchStack_nr(options_.branch_stack_entries);
+    for (int i = 0; i < options_.branch_stack_entries; ++i) {
+      const u64 from = CodeAddress(process);
+      sample.BranchStack_lbr(
+          from, CodeAddress(process),
+          Random(8) == 0 ? kBranchMispredicted : kBranchPredicted);
+    }
+  }
+  WriteEvent(ExamplePerfSampleEvent(sample));
+  ++stats_->samples;
+}
+
+void Generator::AddSpeRecord(const Process& process) {
+  // A load, as "perf record -e arm_spe//" writes them: PC, CONTEXT, LD, EV,
+  // LAT TOT, VA and TS packets. The payloads are in the byte order of the
+  // file.
+  auto add_packet = [this](u8 header, u64 payload, size_t size) {
+    spe_buffer_.push_back(static_cast<char>(header));
+    if (options_.cross_endian) {
+      switch (size) {
+        case sizeof(u16):
+          payload = bswap_16(static_cast<u16>(payload));
+          break;
+        case sizeof(u32):
+          payload = bswap_32(static_cast<u32>(payload));
+          break;
+        case sizeof(u64):
+          payload = bswap_64(payload);
+          break;
+      }
+    }
+    // The payload is the first |size| bytes of |payload| on little-endian
+    // hosts, which perf runs on.
+    spe_buffer_.append(reinterpret_cast<const char*>(&payload), size);
+  };
+  // The NS bit is set and the exception level is EL0.
+  add_packet(0xb0, CodeAddress(process) | (1ULL << 63), sizeof(u64));
+  add_packet(0x65, process.pid, sizeof(u32));
+  add_packet(0x49, 0x00, sizeof(u8));
+  // RETIRED, L1D-ACCESS and TLB-ACCESS, and L1D-REFILL for misses.
+  add_packet(0x52, Random(8) == 0 ? 0x1e : 0x16, sizeof(u16));
+  add_packet(0x98, 4 + Random(200), sizeof(u16));
+  add_packet(0xb2, kHeapStart + Random(kHeapSize), sizeof(u64));
+  add_packet(0x71, time_, sizeof(u64));
+  ++stats_->spe_records;
+  if (spe_buffer_.size() >= kSpeBufferSize) FlushSpeRecords();
+}
+
+void Generator::FlushSpeRecords() {
+  if (spe_buffer_.empty()) return;
+  // The buffers are padded to 8 bytes with padding packets.
+  spe_buffer_.resize((spe_buffer_.size() + 7) / 8 * 8, '\0');
+  const u64 size = spe_buffer_.size();
+  WriteEvent(ExampleAuxtraceEvent(size, aux_offset_, 0, 0,
+                                  static_cast<u32>(-1), 0, 0,
+                                  std::move(spe_buffer_)));
+  ++stats_->auxtrace_events;
+  aux_offset_ += size;
+  spe_buffer_.clear();
+}
+
+bool Generator::Write() {
+  const u64 sample_type =
+      kBaseSampleType |
+      (options_.branch_stack_entries > 0 ? PERF_SAMPLE_BRANCH_STACK : 0);
+  ExamplePerfDataFileHeader file_header(0);
+  file_header.WithAttrCount(1).WithCrossEndianness(options_.cross_endian);
+  out_->seekp(0);
+  file_header.WriteTo(out_);
+  CHECK_EQ(file_header.header().attrs.offset,
+           static_cast<u64>(out_->tellp()));
+  WriteEvent(ExamplePerfFileAttr_Hardware(sample_type, true /*sample_id_all*/));
+  const u64 data_offset = file_header.header().data.offset;
+  CHECK_EQ(data_offset, static_cast<u64>(out_->tellp()));
+
+  if (options_.spe_records_per_sample > 0) {
+    WriteEvent(ExampleAuxtraceInfoEvent(PERF_AUXTRACE_ARM_SPE, {0, 0}));
+  }
+  // The processes that run from the start are written with time 0, as perf
+  // synthesizes them. PERF_RECORD_AUXTRACE events have no time, so the SPE
+  // records are sorted with them rather than with the samples.
+  for (int i = 0; i < options_.num_processes; ++i) {
+    Process process{next_pid_++, 1, {}};
+    Exec(&process);
+    processes_.push_back(std::move(process));
+  }
+  time_ = 1000000000;
+
+  for (u64 i = 0; i < options_.num_samples && out_->good(); ++i) {
+    time_ += 1000 + Random(1000);
+    if (Chance(options_.churn_rate)) Churn();
+    const Process& process = processes_[Random(processes_.size())];
+    if (Chance(options_.lost_rate)) {
+      WriteEvent(ExampleLostEvent(0, 1 + Random(100), SampleId(process)));
+      ++stats_->lost_events;
+    }
+    WriteSample(process);
+    for (int j = 0; j < options_.spe_records_per_sample; ++j) {
+      AddSpeRecord(process);
+    }
+  }
+  FlushSpeRecords();
+
+  const u64 end = out_->tellp();
+  file_header.WithDataSize(end - data_offset);
+  out_->seekp(0);
+  file_header.WriteTo(out_);
+  out_->seekp(end);
+  stats_->bytes = end;
+  if (!out_->good()) {
+    LOG(ERROR) << "Failed to write the synthetic perf data";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool WriteSyntheticPerfData(const SyntheticPerfDataOptions& options,
+                            std::ostream* out, SyntheticPerfDataStats* stats) {
+  if (!ValidateOptions(options)) return false;
+  SyntheticPerfDataStats local_stats;
+  if (!stats) stats = &local_stats;
+  *stats = SyntheticPerfDataStats();
+  Generator generator(options, out, stats);
+  return generator.Write();
+}
+
+}  // namespace testing
+}  // namespace quipper
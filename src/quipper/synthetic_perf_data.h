@@ -0,0 +1,69 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_SYNTHETIC_PERF_DATA_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_SYNTHETIC_PERF_DATA_H_
+
+#include <cstdint>
+#include <ostream>
+
+namespace quipper {
+namespace testing {
+
+// The shape of a synthetic perf.data file. The same options, including the
+// seed, always produce the same file.
+struct SyntheticPerfDataOptions {
+  uint64_t seed = 1;
+  // The number of processes alive at any time.
+  int num_processes = 10;
+  uint64_t num_samples = 100000;
+  // The probability, for each sample, that a process exits and another one
+  // forks and execs to replace it.
+  double churn_rate = 0;
+  // The file mappings of each process: its binary, then shared libraries.
+  int mmaps_per_process = 4;
+  // The "jitted-" mappings of each process, as perf inject writes them.
+  int jit_regions_per_process = 0;
+  // The callchain depths, which are skewed toward the shallow end.
+  int min_stack_depth = 1;
+  int max_stack_depth = 32;
+  // The LBR entries of each sample. No branch stacks are sampled if 0.
+  int branch_stack_entries = 0;
+  // The ARM SPE records traced for each sample, which are written in
+  // PERF_RECORD_AUXTRACE buffers.
+  int spe_records_per_sample = 0;
+  // The probability, for each sample, that a PERF_RECORD_LOST precedes it.
+  double lost_rate = 0;
+  // Writes the file in the opposite byte order of the host. Cross-endian
+  // branch stacks aren't supported by PerfReader, so they aren't either.
+  bool cross_endian = false;
+};
+
+// The counts of the events written to a synthetic perf.data file.
+struct SyntheticPerfDataStats {
+  uint64_t samples = 0;
+  uint64_t forks = 0;
+  uint64_t exits = 0;
+  uint64_t comms = 0;
+  uint64_t mmaps = 0;
+  uint64_t lost_events = 0;
+  uint64_t spe_records = 0;
+  uint64_t auxtrace_events = 0;
+  // The total size of the file.
+  uint64_t bytes = 0;
+};
+
+// Writes a synthetic perf.data file to |out|, from the beginning. The events
+// are generated and written one at a time, so the file can be much larger
+// than memory; |out| has to be seekable, since the header is rewritten with
+// the data size at the end. Stores the counts of the events in |stats| if it
+// isn't null. Returns false if |options| are invalid or a write failed.
+bool WriteSyntheticPerfData(const SyntheticPerfDataOptions& options,
+                            std::ostream* out,
+                            SyntheticPerfDataStats* stats = nullptr);
+
+}  // namespace testing
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_SYNTHETIC_PERF_DATA_H_
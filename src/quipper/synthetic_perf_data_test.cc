@@ -0,0 +1,154 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "synthetic_perf_data.h"
+
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "compat/test.h"
+#include "kernel/perf_internals.h"
+#include "perf_parser.h"
+#include "perf_reader.h"
+
+namespace quipper {
+namespace testing {
+
+namespace {
+
+SyntheticPerfDataOptions ExampleOptions() {
+  SyntheticPerfDataOptions options;
+  options.seed = 7;
+  options.num_processes = 5;
+  options.num_samples = 2000;
+  options.churn_rate = 0.01;
+  options.mmaps_per_process = 3;
+  options.jit_regions_per_process = 2;
+  options.min_stack_depth = 2;
+  options.max_stack_depth = 40;
+  options.spe_records_per_sample = 4;
+  options.lost_rate = 0.01;
+  return options;
+}
+
+// Returns the number of events of each type read by |reader|.
+std::map<u32, uint64_t> CountEvents(const PerfReader& reader) {
+  std::map<u32, uint64_t> counts;
+  for (const auto& event : reader.events()) ++counts[event.header().type()];
+  return counts;
+}
+
+}  // namespace
+
+TEST(SyntheticPerfDataTest, WritesTheRequestedEvents) {
+  SyntheticPerfDataOptions options = ExampleOptions();
+  options.branch_stack_entries = 8;
+  std::stringstream out;
+  SyntheticPerfDataStats stats;
+  ASSERT_TRUE(WriteSyntheticPerfData(options, &out, &stats));
+  EXPECT_EQ(out.str().size(), stats.bytes);
+
+  PerfReader reader;
+  ASSERT_TRUE(reader.ReadFromString(out.str()));
+  auto counts = CountEvents(reader);
+  EXPECT_EQ(options.num_samples, stats.samples);
+  EXPECT_EQ(stats.samples, counts[PERF_RECORD_SAMPLE]);
+  EXPECT_GT(stats.forks, 0);
+  EXPECT_EQ(stats.forks, counts[PERF_RECORD_FORK]);
+  EXPECT_EQ(stats.forks, stats.exits);
+  EXPECT_EQ(stats.exits, counts[PERF_RECORD_EXIT]);
+  EXPECT_EQ(options.num_processes + stats.forks, stats.comms);
+  EXPECT_EQ(stats.comms, counts[PERF_RECORD_COMM]);
+  EXPECT_EQ(stats.comms * 5, stats.mmaps);
+  EXPECT_EQ(stats.mmaps, counts[PERF_RECORD_MMAP2]);
+  EXPECT_GT(stats.lost_events, 0);
+  EXPECT_EQ(stats.lost_events, counts[PERF_RECORD_LOST]);
+  EXPECT_EQ(1, counts[PERF_RECORD_AUXTRACE_INFO]);
+  EXPECT_EQ(options.num_samples * 4, stats.spe_records);
+  EXPECT_EQ(stats.auxtrace_events, counts[PERF_RECORD_AUXTRACE]);
+
+  for (const auto& event : reader.events()) {
+    if (!event.has_sample_event()) continue;
+    const auto& sample = event.sample_event();
+    // The user context marker, then the frames.
+    EXPECT_GE(sample.callchain_size(), 3);
+    EXPECT_LE(sample.callchain_size(), 41);
+    EXPECT_EQ(sample.ip(), sample.callchain(1));
+    EXPECT_EQ(8, sample.branch_stack_size());
+  }
+
+  // All the sampled addresses are in the mappings of their processes.
+  PerfParserOptions parser_options;
+  parser_options.sort_events_by_time = true;
+  PerfParser parser(&reader, parser_options);
+  ASSERT_TRUE(parser.ParseRawEvents());
+  EXPECT_EQ(stats.samples, parser.stats().num_sample_events_mapped);
+}
+
+TEST(SyntheticPerfDataTest, IsDeterministic) {
+  std::stringstream first, second, other_seed;
+  SyntheticPerfDataOptions options = ExampleOptions();
+  ASSERT_TRUE(WriteSyntheticPerfData(options, &first));
+  ASSERT_TRUE(WriteSyntheticPerfData(options, &second));
+  EXPECT_EQ(first.str(), second.str());
+  options.seed = 8;
+  ASSERT_TRUE(WriteSyntheticPerfData(options, &other_seed));
+  EXPECT_NE(first.str(), other_seed.str());
+}
+
+TEST(SyntheticPerfDataTest, WritesCrossEndianData) {
+  SyntheticPerfDataOptions options = ExampleOptions();
+  std::stringstream native_out, cross_endian_out;
+  ASSERT_TRUE(WriteSyntheticPerfData(options, &native_out));
+  options.cross_endian = true;
+  ASSERT_TRUE(WriteSyntheticPerfData(options, &cross_endian_out));
+  EXPECT_NE(native_out.str(), cross_endian_out.str());
+
+  PerfReader native, cross_endian;
+  ASSERT_TRUE(native.ReadFromString(native_out.str()));
+  ASSERT_TRUE(cross_endian.ReadFromString(cross_endian_out.str()));
+  ASSERT_EQ(native.events().size(), cross_endian.events().size());
+  for (int i = 0; i < native.events().size(); ++i) {
+    const auto& event = native.events().Get(i);
+    const auto& swapped_event = cross_endian.events().Get(i);
+    ASSERT_EQ(event.header().type(), swapped_event.header().type());
+    EXPECT_EQ(event.timestamp(), swapped_event.timestamp());
+    if (event.has_sample_event()) {
+      EXPECT_EQ(event.sample_event().pid(),
+                swapped_event.sample_event().pid());
+      EXPECT_EQ(event.sample_event().ip(), swapped_event.sample_event().ip());
+      EXPECT_EQ(event.sample_event().period(),
+                swapped_event.sample_event().period());
+    } else if (event.has_mmap_event()) {
+      EXPECT_EQ(event.mmap_event().start(),
+                swapped_event.mmap_event().start());
+      EXPECT_EQ(event.mmap_event().filename(),
+                swapped_event.mmap_event().filename());
+    } else if (event.has_lost_event()) {
+      EXPECT_EQ(event.lost_event().lost(), swapped_event.lost_event().lost());
+    }
+  }
+}
+
+TEST(SyntheticPerfDataTest, RejectsInvalidOptions) {
+  std::stringstream out;
+  SyntheticPerfDataOptions options;
+  options.num_processes = 0;
+  EXPECT_FALSE(WriteSyntheticPerfData(options, &out));
+  options = SyntheticPerfDataOptions();
+  options.min_stack_depth = 10;
+  options.max_stack_depth = 5;
+  EXPECT_FALSE(WriteSyntheticPerfData(options, &out));
+  options = SyntheticPerfDataOptions();
+  options.branch_stack_entries = 4;
+  options.cross_endian = true;
+  EXPECT_FALSE(WriteSyntheticPerfData(options, &out));
+  options = SyntheticPerfDataOptions();
+  options.lost_rate = 2;
+  EXPECT_FALSE(WriteSyntheticPerfData(options, &out));
+}
+
+}  // namespace testing
+}  // namespace quipper
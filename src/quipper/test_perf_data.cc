@@ -361,6 +361,57 @@ void ExampleForkExitEvent::WriteTo(std::ostream* out) const {
            static_cast<u64>(written_event_size));
 }
 
+void ExampleCommEvent::WriteTo(std::ostream* out) const {
+  CHECK_LT(comm_.size(), static_cast<size_t>(kMaxCommSize));
+  const size_t comm_aligned_length = GetUint64AlignedStringLength(comm_.size());
+  const size_t event_size =
+      offsetof(struct comm_event, comm) + comm_aligned_length +
+      sample_id_.size();
+
+  struct comm_event event = {
+      .header =
+          {
+              .type = MaybeSwap32(PERF_RECORD_COMM),
+              .misc = 0,
+              .size = MaybeSwap16(static_cast<u16>(event_size)),
+          },
+      .pid = MaybeSwap32(pid_),
+      .tid = MaybeSwap32(tid_),
+      // .comm = ..., // written separately
+  };
+
+  const size_t pre_event_offset = out->tellp();
+  out->write(reinterpret_cast<const char*>(&event),
+             offsetof(struct comm_event, comm));
+  *out << comm_ << std::string(comm_aligned_length - comm_.size(), '\0');
+  out->write(sample_id_.data(), sample_id_.size());
+  const size_t written_event_size =
+      static_cast<size_t>(out->tellp()) - pre_event_offset;
+  CHECK_EQ(event_size, written_event_size);
+}
+
+void ExampleLostEvent::WriteTo(std::ostream* out) const {
+  const size_t event_size = sizeof(struct lost_event) + sample_id_.size();
+
+  struct lost_event event = {
+      .header =
+          {
+              .type = MaybeSwap32(PERF_RECORD_LOST),
+              .misc = 0,
+              .size = MaybeSwap16(static_cast<u16>(event_size)),
+          },
+      .id = MaybeSwap64(id_),
+      .lost = MaybeSwap64(lost_),
+  };
+
+  const size_t pre_event_offset = out->tellp();
+  out->write(reinterpret_cast<const char*>(&event), sizeof(event));
+  out->write(sample_id_.data(), sample_id_.size());
+  const size_t written_event_size =
+      static_cast<size_t>(out->tellp()) - pre_event_offset;
+  CHECK_EQ(event_size, written_event_size);
+}
+
 void FinishedRoundEvent::WriteTo(std::ostream* out) const {
   const perf_event_header event = {
       .type = PERF_RECORD_FINISHED_ROUND,
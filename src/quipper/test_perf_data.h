@@ -302,6 +302,9 @@ class SampleInfo {
   }
   SampleInfo& Time(u64 time) { return AddField(time); }
   SampleInfo& Addr(u64 addr) { return AddField(addr); }
+  SampleInfo& Period(u64 period) { return AddField(period); }
+  SampleInfo& Callchain_nr(u64 nr) { return AddField(nr); }
+  SampleInfo& Callchain_ip(u64 ip) { return AddField(ip); }
   SampleInfo& Id(u64 id) { return AddField(id); }
   SampleInfo& BranchStack_nr(u64 nr) { return AddField(nr); }
   SampleInfo& BranchStack_lbr(u64 from, u64 to, u64 flags) {
@@ -480,6 +483,34 @@ class ExampleExitEvent : public ExampleForkExitEvent {
                              sample_id) {}
 };
 
+// Produces a PERF_RECORD_COMM event.
+class ExampleCommEvent : public StreamWriteable {
+ public:
+  ExampleCommEvent(u32 pid, u32 tid, const std::string& comm,
+                   const SampleInfo& sample_id)
+      : pid_(pid), tid_(tid), comm_(comm), sample_id_(sample_id) {}
+  void WriteTo(std::ostream* out) const override;
+
+ private:
+  const u32 pid_;
+  const u32 tid_;
+  const std::string comm_;
+  const SampleInfo sample_id_;
+};
+
+// Produces a PERF_RECORD_LOST event.
+class ExampleLostEvent : public StreamWriteable {
+ public:
+  ExampleLostEvent(u64 id, u64 lost, const SampleInfo& sample_id)
+      : id_(id), lost_(lost), sample_id_(sample_id) {}
+  void WriteTo(std::ostream* out) const override;
+
+ private:
+  const u64 id_;
+  const u64 lost_;
+  const SampleInfo sample_id_;
+};
+
 // Produces the PERF_RECORD_FINISHED_ROUND event. This event is just a header.
 class FinishedRoundEvent : public StreamWriteable {
  public:
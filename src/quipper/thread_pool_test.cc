@@ -0,0 +1,89 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "compat/thread_pool.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+
+namespace quipper {
+namespace {
+
+TEST(ThreadPoolTest, RunsTasksOfGroups) {
+  ThreadPool pool(4);
+  EXPECT_EQ(4, pool.num_threads());
+  std::atomic<int> count(0);
+  {
+    TaskGroup group(&pool);
+    for (int i = 0; i < 1000; ++i) group.Run([&count] { ++count; });
+    group.Wait();
+    EXPECT_EQ(1000, count);
+  }
+  // Without a pool, the tasks run as they are added.
+  TaskGroup inline_group(nullptr);
+  inline_group.Run([&count] { ++count; });
+  EXPECT_EQ(1001, count);
+}
+
+// A group can be destroyed as soon as its tasks are done, while the threads
+// that ran them may still be finishing up.
+TEST(ThreadPoolTest, DestroysGroupsRightAfterTheirTasks) {
+  ThreadPool pool(4);
+  std::atomic<int> count(0);
+  for (int i = 0; i < 10000; ++i) {
+    std::unique_ptr<TaskGroup> group(new TaskGroup(&pool));
+    group->Run([&count] { ++count; });
+    group->Run([&count] { ++count; });
+    group->Wait();
+    group.reset();
+  }
+  EXPECT_EQ(20000, count);
+}
+
+TEST(ThreadPoolTest, RunsNestedGroupsOnOneThread) {
+  // Each task waits for a group of its own, whose tasks the waiting threads
+  // run themselves.
+  ThreadPool pool(1);
+  std::atomic<int> count(0);
+  TaskGroup outer(&pool);
+  for (int i = 0; i < 10; ++i) {
+    outer.Run([&pool, &count] {
+      TaskGroup inner(&pool);
+      for (int j = 0; j < 10; ++j) inner.Run([&count] { ++count; });
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+  EXPECT_EQ(100, count);
+}
+
+TEST(ThreadPoolTest, ParallelForCallsEachIndexOnce) {
+  ThreadPool pool(3);
+  for (ThreadPool* p : {&pool, static_cast<ThreadPool*>(nullptr)}) {
+    std::vector<int> calls(10000);
+    ParallelFor(p, calls.size(), 8, [&calls](size_t i) { ++calls[i]; });
+    EXPECT_EQ(std::vector<int>(calls.size(), 1), calls);
+  }
+  ParallelFor(&pool, 0, 8, [](size_t i) { FAIL(); });
+}
+
+TEST(ThreadPoolTest, ParallelMapReduceFoldsInOrder) {
+  ThreadPool pool(4);
+  for (ThreadPool* p : {&pool, static_cast<ThreadPool*>(nullptr)}) {
+    const std::string result = ParallelMapReduce(
+        p, 200, 4, std::string(),
+        [](size_t i) { return std::to_string(i) + ","; },
+        [](std::string* out, std::string&& value) { *out += value; });
+    std::string expected;
+    for (int i = 0; i < 200; ++i) expected += std::to_string(i) + ",";
+    EXPECT_EQ(expected, result);
+  }
+}
+
+}  // namespace
+}  // namespace quipper
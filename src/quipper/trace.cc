@@ -0,0 +1,89 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+
+namespace quipper {
+
+namespace {
+
+std::atomic<TraceSink*> trace_sink{nullptr};
+
+uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t CurrentTid() {
+  static thread_local const int64_t tid = syscall(SYS_gettid);
+  return tid;
+}
+
+// Writes |ns| in microseconds, the unit of the trace event format, keeping
+// the nanoseconds as decimals.
+void WriteMicroseconds(uint64_t ns, std::ostream* out) {
+  const uint64_t fraction = ns % 1000;
+  *out << ns / 1000 << '.' << fraction / 100 << fraction / 10 % 10
+       << fraction % 10;
+}
+
+// Writes |name| as a JSON string.
+void WriteJsonString(const char* name, std::ostream* out) {
+  *out << '"';
+  for (const char* c = name; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') *out << '\\';
+    *out << *c;
+  }
+  *out << '"';
+}
+
+}  // namespace
+
+void SetTraceSink(TraceSink* sink) {
+  trace_sink.store(sink, std::memory_order_release);
+}
+
+TraceSink* GetTraceSink() {
+  return trace_sink.load(std::memory_order_acquire);
+}
+
+ChromeJsonTraceSink::ChromeJsonTraceSink(std::ostream* out) : out_(out) {
+  *out_ << "[";
+}
+
+ChromeJsonTraceSink::~ChromeJsonTraceSink() {
+  *out_ << "\n]\n";
+  out_->flush();
+}
+
+void ChromeJsonTraceSink::AddSpan(const char* name, uint64_t start_ns,
+                                  uint64_t duration_ns, int64_t tid) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  *out_ << (empty_ ? "\n" : ",\n") << "{\"name\":";
+  WriteJsonString(name, out_);
+  *out_ << ",\"cat\":\"quipper\",\"ph\":\"X\",\"ts\":";
+  WriteMicroseconds(start_ns, out_);
+  *out_ << ",\"dur\":";
+  WriteMicroseconds(duration_ns, out_);
+  *out_ << ",\"pid\":" << getpid() << ",\"tid\":" << tid << "}";
+  empty_ = false;
+}
+
+TraceSpan::TraceSpan(const char* name) : name_(name), sink_(GetTraceSink()) {
+  if (sink_ != nullptr) start_ns_ = NowNs();
+}
+
+TraceSpan::~TraceSpan() {
+  if (sink_ == nullptr) return;
+  sink_->AddSpan(name_, start_ns_, NowNs() - start_ns_, CurrentTid());
+}
+
+}  // namespace quipper
@@ -0,0 +1,91 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Trace spans around the stages of reading and converting perf data, for
+// investigating slow conversions on a timeline. The spans are only compiled
+// in when QUIPPER_TRACING is defined, e.g. with --define=quipper_tracing=1 in
+// Bazel; otherwise QUIPPER_TRACE_SPAN() expands to nothing. Even then, no
+// clock is read until a sink is set with SetTraceSink().
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_TRACE_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_TRACE_H_
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+namespace quipper {
+
+// Receives the spans that ended. It may be called on several threads at
+// once. A Perfetto sink can emit each span as a complete slice with its
+// start and duration.
+class TraceSink {
+ public:
+  virtual ~TraceSink() {}
+
+  // |name| is a string literal. The times are in nanoseconds of the monotonic
+  // clock, and |tid| is the ID of the thread the span ran on.
+  virtual void AddSpan(const char* name, uint64_t start_ns,
+                       uint64_t duration_ns, int64_t tid) = 0;
+};
+
+// Sets the sink of the spans of all threads, or stops tracing if |sink| is
+// null. The sink is not owned, and must outlive the spans started while it
+// was set.
+void SetTraceSink(TraceSink* sink);
+TraceSink* GetTraceSink();
+
+// Writes the spans as a trace in the JSON format of Chrome's trace event
+// profiler, which chrome://tracing and the Perfetto UI open.
+class ChromeJsonTraceSink : public TraceSink {
+ public:
+  explicit ChromeJsonTraceSink(std::ostream* out);
+  // Terminates the trace.
+  ~ChromeJsonTraceSink() override;
+
+  ChromeJsonTraceSink(const ChromeJsonTraceSink&) = delete;
+  ChromeJsonTraceSink& operator=(const ChromeJsonTraceSink&) = delete;
+
+  void AddSpan(const char* name, uint64_t start_ns, uint64_t duration_ns,
+               int64_t tid) override;
+
+ private:
+  std::mutex mutex_;
+  std::ostream* const out_;
+  bool empty_ = true;
+};
+
+// Hands the span from its construction to its destruction to the sink, if
+// one was set when it was constructed. Use QUIPPER_TRACE_SPAN() instead, so
+// that the span is compiled out when tracing is disabled.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name);
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* const name_;
+  TraceSink* const sink_;
+  uint64_t start_ns_ = 0;
+};
+
+}  // namespace quipper
+
+#define QUIPPER_TRACE_CONCAT_INNER(a, b) a##b
+#define QUIPPER_TRACE_CONCAT(a, b) QUIPPER_TRACE_CONCAT_INNER(a, b)
+
+// Traces the rest of the enclosing scope as a span named |name|, which must
+// be a string literal.
+#ifdef QUIPPER_TRACING
+#define QUIPPER_TRACE_SPAN(name)                                   \
+  ::quipper::TraceSpan QUIPPER_TRACE_CONCAT(quipper_trace_span_, \
+                                            __LINE__)(name)
+#else
+#define QUIPPER_TRACE_SPAN(name) static_cast<void>(0)
+#endif
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_TRACE_H_
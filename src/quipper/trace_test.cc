@@ -0,0 +1,83 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "trace.h"
+
+#include <unistd.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+
+namespace quipper {
+
+namespace {
+
+class RecordingSink : public TraceSink {
+ public:
+  void AddSpan(const char* name, uint64_t start_ns, uint64_t duration_ns,
+               int64_t tid) override {
+    names.push_back(name);
+    tids.push_back(tid);
+  }
+
+  std::vector<std::string> names;
+  std::vector<int64_t> tids;
+};
+
+}  // namespace
+
+TEST(TraceTest, HandsEndedSpansToTheSink) {
+  RecordingSink sink;
+  SetTraceSink(&sink);
+  {
+    TraceSpan outer("outer");
+    { TraceSpan inner("inner"); }
+    EXPECT_EQ(std::vector<std::string>{"inner"}, sink.names);
+  }
+  SetTraceSink(nullptr);
+  { TraceSpan untraced("untraced"); }
+  EXPECT_EQ((std::vector<std::string>{"inner", "outer"}), sink.names);
+  EXPECT_EQ(sink.tids[0], sink.tids[1]);
+}
+
+TEST(TraceTest, IgnoresSpansStartedWithoutASink) {
+  RecordingSink sink;
+  {
+    TraceSpan span("span");
+    SetTraceSink(&sink);
+  }
+  SetTraceSink(nullptr);
+  EXPECT_TRUE(sink.names.empty());
+}
+
+TEST(TraceTest, WritesChromeJsonTrace) {
+  std::stringstream out;
+  {
+    ChromeJsonTraceSink sink(&out);
+    sink.AddSpan("Parse", 1234567, 89, 7);
+    sink.AddSpan("say \"hi\"", 2000000, 1000, 8);
+  }
+  const std::string pid = std::to_string(getpid());
+  EXPECT_EQ(
+      "[\n"
+      "{\"name\":\"Parse\",\"cat\":\"quipper\",\"ph\":\"X\",\"ts\":1234.567,"
+      "\"dur\":0.089,\"pid\":" +
+          pid +
+          ",\"tid\":7},\n"
+          "{\"name\":\"say \\\"hi\\\"\",\"cat\":\"quipper\",\"ph\":\"X\","
+          "\"ts\":2000.000,\"dur\":1.000,\"pid\":" +
+          pid + ",\"tid\":8}\n]\n",
+      out.str());
+}
+
+TEST(TraceTest, WritesEmptyChromeJsonTrace) {
+  std::stringstream out;
+  { ChromeJsonTraceSink sink(&out); }
+  EXPECT_EQ("[\n]\n", out.str());
+}
+
+}  // namespace quipper
@@ -0,0 +1,37 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "warning_counts.h"
+
+#include "base/logging.h"
+#include "perf_data_utils.h"
+
+namespace quipper {
+
+bool WarningCounts::Add(const char* what, uint32_t type) {
+  ++counts_[std::make_pair(std::string(what), type)];
+  return logging::GetVlogVerbosity() >= 1;
+}
+
+void WarningCounts::Merge(const WarningCounts& other) {
+  for (const auto& it : other.counts_) counts_[it.first] += it.second;
+}
+
+void WarningCounts::Log() const {
+  for (const auto& it : counts_) {
+    if (it.first.second == 0) {
+      LOG(WARNING) << it.first.first << ": " << it.second << " times";
+    } else {
+      LOG(WARNING) << it.first.first << " " << GetEventName(it.first.second)
+                   << ": " << it.second << " times";
+    }
+  }
+}
+
+uint64_t WarningCounts::count(const std::string& what, uint32_t type) const {
+  auto it = counts_.find(std::make_pair(what, type));
+  return it == counts_.end() ? 0 : it->second;
+}
+
+}  // namespace quipper
@@ -0,0 +1,49 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_WARNING_COUNTS_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_WARNING_COUNTS_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace quipper {
+
+// Counts the warnings that may be hit for every one of millions of events, so
+// that each kind is logged once with its count, by Log(), rather than once
+// per event. With a VLOG verbosity of at least 1, e.g. after
+// SetVerbosityLevel(1), the callers also log each occurrence.
+class WarningCounts {
+ public:
+  // The number of times each warning was hit about events of each
+  // PERF_RECORD_* type, or of type 0 for the warnings that aren't about a
+  // type in particular.
+  typedef std::map<std::pair<std::string, uint32_t>, uint64_t> Counts;
+
+  // Counts the warning |what| about an event of |type|. Returns whether the
+  // caller should also log this occurrence, with its details.
+  bool Add(const char* what, uint32_t type = 0);
+
+  // Adds the counts of |other| to these.
+  void Merge(const WarningCounts& other);
+
+  // Logs a warning with the count of each warning hit, if any.
+  void Log() const;
+
+  void Clear() { counts_.clear(); }
+  bool empty() const { return counts_.empty(); }
+  const Counts& counts() const { return counts_; }
+
+  // Returns the number of times |what| was hit about events of |type|.
+  uint64_t count(const std::string& what, uint32_t type = 0) const;
+
+ private:
+  Counts counts_;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_WARNING_COUNTS_H_
@@ -0,0 +1,49 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "warning_counts.h"
+
+#include "compat/log_level.h"
+#include "compat/test.h"
+#include "kernel/perf_internals.h"
+
+namespace quipper {
+
+TEST(WarningCountsTest, CountsByWarningAndType) {
+  WarningCounts warnings;
+  EXPECT_TRUE(warnings.empty());
+  warnings.Add("Skipped", PERF_RECORD_MMAP);
+  warnings.Add("Skipped", PERF_RECORD_MMAP);
+  warnings.Add("Skipped", PERF_RECORD_COMM);
+  warnings.Add("Guessed");
+  EXPECT_FALSE(warnings.empty());
+  EXPECT_EQ(2, warnings.count("Skipped", PERF_RECORD_MMAP));
+  EXPECT_EQ(1, warnings.count("Skipped", PERF_RECORD_COMM));
+  EXPECT_EQ(0, warnings.count("Skipped"));
+  EXPECT_EQ(1, warnings.count("Guessed"));
+  EXPECT_EQ(3, warnings.counts().size());
+
+  WarningCounts other;
+  other.Add("Skipped", PERF_RECORD_MMAP);
+  other.Add("Truncated", PERF_RECORD_SAMPLE);
+  warnings.Merge(other);
+  EXPECT_EQ(3, warnings.count("Skipped", PERF_RECORD_MMAP));
+  EXPECT_EQ(1, warnings.count("Truncated", PERF_RECORD_SAMPLE));
+  EXPECT_EQ(4, warnings.counts().size());
+
+  warnings.Clear();
+  EXPECT_TRUE(warnings.empty());
+}
+
+TEST(WarningCountsTest, AsksForEachOccurrenceInVerboseMode) {
+  WarningCounts warnings;
+  SetVerbosityLevel(0);
+  EXPECT_FALSE(warnings.Add("Skipped"));
+  SetVerbosityLevel(1);
+  EXPECT_TRUE(warnings.Add("Skipped"));
+  SetVerbosityLevel(0);
+  EXPECT_EQ(2, warnings.count("Skipped"));
+}
+
+}  // namespace quipper
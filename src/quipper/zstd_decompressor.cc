@@ -0,0 +1,44 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "zstd_decompressor.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+ZstdDecompressor::ZstdDecompressor() : stream_(ZSTD_createDStream()) {
+  CHECK(stream_ != nullptr);
+  ZSTD_initDStream(stream_);
+}
+
+ZstdDecompressor::~ZstdDecompressor() { ZSTD_freeDStream(stream_); }
+
+bool ZstdDecompressor::Decompress(const void* data, size_t size,
+                                  std::vector<char>* out) {
+  ZSTD_inBuffer input = {data, size, 0};
+  // Events compress well, so leave room for several times the input. zstd may
+  // hold back output when the room runs out, so keep going until it doesn't
+  // fill all of it.
+  ZSTD_outBuffer output;
+  do {
+    const size_t offset = out->size();
+    out->resize(offset + std::max(ZSTD_DStreamOutSize(),
+                                  4 * (input.size - input.pos)));
+    output = {out->data() + offset, out->size() - offset, 0};
+    const size_t ret = ZSTD_decompressStream(stream_, &output, &input);
+    out->resize(offset + output.pos);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "Couldn't decompress zstd data: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+  } while (input.pos < input.size || output.pos == output.size);
+  return true;
+}
+
+}  // namespace quipper
@@ -0,0 +1,38 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef PERF_DATA_CONVERTER_SRC_QUIPPER_ZSTD_DECOMPRESSOR_H_
+#define PERF_DATA_CONVERTER_SRC_QUIPPER_ZSTD_DECOMPRESSOR_H_
+
+#include <cstddef>
+#include <vector>
+
+struct ZSTD_DCtx_s;
+
+namespace quipper {
+
+// Decompresses a zstd stream that arrives in parts, such as the one that perf
+// record -z splits into the payloads of its PERF_RECORD_COMPRESSED records.
+// perf doesn't end the stream between records, so the parts have to be
+// decompressed in order, and the output of a part may end in the middle of an
+// event.
+class ZstdDecompressor {
+ public:
+  ZstdDecompressor();
+  ~ZstdDecompressor();
+
+  // Decompresses the |size| bytes at |data|, the next part of the stream, and
+  // appends the output to |out|. Returns false if the data is corrupt.
+  bool Decompress(const void* data, size_t size, std::vector<char>* out);
+
+ private:
+  ZSTD_DCtx_s* stream_;
+
+  ZstdDecompressor(const ZstdDecompressor&) = delete;
+  ZstdDecompressor& operator=(const ZstdDecompressor&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // PERF_DATA_CONVERTER_SRC_QUIPPER_ZSTD_DECOMPRESSOR_H_
@@ -0,0 +1,60 @@
+// Copyright 2026 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "zstd_decompressor.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "compat/test.h"
+
+namespace quipper {
+namespace {
+
+// Compresses |data| into a single stream, flushed but not ended, as perf
+// record -z does.
+std::string CompressStream(const std::string& data) {
+  ZSTD_CStream* stream = ZSTD_createCStream();
+  ZSTD_initCStream(stream, 1);
+  std::string compressed(ZSTD_compressBound(data.size()) + 64, '\0');
+  ZSTD_inBuffer input = {data.data(), data.size(), 0};
+  ZSTD_outBuffer output = {&compressed[0], compressed.size(), 0};
+  while (input.pos < input.size) ZSTD_compressStream(stream, &output, &input);
+  while (ZSTD_flushStream(stream, &output) != 0) {
+  }
+  ZSTD_freeCStream(stream);
+  compressed.resize(output.pos);
+  return compressed;
+}
+
+TEST(ZstdDecompressorTest, DecompressesStreamInParts) {
+  std::string data;
+  for (int i = 0; i < 100000; ++i) data += "event " + std::to_string(i % 97);
+  const std::string compressed = CompressStream(data);
+  ASSERT_LT(compressed.size(), data.size() / 4);
+
+  for (size_t part_size : {size_t{1}, size_t{1000}, compressed.size()}) {
+    ZstdDecompressor decompressor;
+    std::vector<char> out;
+    for (size_t i = 0; i < compressed.size(); i += part_size) {
+      ASSERT_TRUE(decompressor.Decompress(
+          compressed.data() + i, std::min(part_size, compressed.size() - i),
+          &out));
+    }
+    EXPECT_EQ(data, std::string(out.begin(), out.end())) << part_size;
+  }
+}
+
+TEST(ZstdDecompressorTest, FailsOnCorruptData) {
+  ZstdDecompressor decompressor;
+  std::vector<char> out;
+  const std::string garbage(64, 'x');
+  EXPECT_FALSE(decompressor.Decompress(garbage.data(), garbage.size(), &out));
+}
+
+}  // namespace
+}  // namespace quipper
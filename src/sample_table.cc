@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/sample_table.h"
+
+#include "src/quipper/kernel/perf_event.h"
+
+namespace perftools {
+
+namespace {
+
+// The bytes taken by the columns of a sample, and by those of a frame.
+constexpr size_t kRowBytes =
+    6 * sizeof(uint32_t) + 4 * sizeof(uint64_t) + sizeof(int32_t);
+constexpr size_t kFrameBytes = sizeof(uint64_t) + sizeof(int32_t);
+
+}  // namespace
+
+bool SampleTableWriter::Sample(const SampleContext& sample) {
+  const auto& event = sample.sample;
+  batch_.pid.push_back(event.pid());
+  batch_.tid.push_back(event.tid());
+  batch_.time_ns.push_back(event.sample_time_ns());
+  batch_.cpu.push_back(event.cpu());
+  int32_t cgroup = -1;
+  if (sample.cgroup != nullptr) {
+    const auto inserted = cgroup_indices_.emplace(
+        *sample.cgroup, static_cast<int32_t>(cgroup_indices_.size()));
+    if (inserted.second) {
+      batch_.cgroup_dictionary.push_back(*sample.cgroup);
+      batch_bytes_ += sample.cgroup->size();
+    }
+    cgroup = inserted.first->second;
+  }
+  batch_.cgroup.push_back(cgroup);
+  batch_.count.push_back(sample.count);
+  batch_.period.push_back(event.period());
+  // As for the converter's latency labels, the total latency of a weight
+  // struct takes precedence over the weight field.
+  batch_.weight.push_back(event.has_weight_struct() &&
+                                  event.weight_struct().has_var2_w()
+                              ? event.weight_struct().var2_w()
+                              : event.weight());
+  const bool spe = sample.spe.is_spe;
+  batch_.spe_total_latency.push_back(spe ? sample.spe.record.total_lat : 0);
+  batch_.spe_issue_latency.push_back(spe ? sample.spe.record.issue_lat : 0);
+  batch_.spe_translation_latency.push_back(
+      spe ? sample.spe.record.translation_lat : 0);
+
+  // perf_events includes the sampled IP at the leaf of the callchain, after
+  // the context markers.
+  AddFrame(event.ip(), sample.sample_mapping);
+  bool leaf = true;
+  for (const Location& location : sample.callchain) {
+    if (location.ip >= quipper::PERF_CONTEXT_MAX) continue;
+    if (leaf && location.ip == event.ip()) {
+      leaf = false;
+      continue;
+    }
+    leaf = false;
+    AddFrame(location.ip, location.mapping);
+  }
+  batch_.frame_offsets.push_back(batch_.frame_address.size());
+  batch_bytes_ += kRowBytes + sizeof(int32_t);
+  if (batch_bytes_ >= max_batch_bytes_) Flush();
+  return true;
+}
+
+void SampleTableWriter::Finish() {
+  if (batch_.num_rows() > 0) Flush();
+}
+
+int32_t SampleTableWriter::MappingIndex(const Dso* dso) {
+  const auto inserted = mapping_indices_.emplace(
+      dso, static_cast<int32_t>(mapping_indices_.size()));
+  if (inserted.second) {
+    batch_.mapping_filename_dictionary.push_back(dso->filename);
+    batch_.mapping_build_id_dictionary.push_back(dso->build_id.value);
+    batch_bytes_ += dso->filename.size() + dso->build_id.value.size();
+  }
+  return inserted.first->second;
+}
+
+void SampleTableWriter::AddFrame(uint64_t ip, const Mapping* mapping) {
+  if (mapping != nullptr && ip >= mapping->start && ip < mapping->limit) {
+    batch_.frame_address.push_back(ip - mapping->start + mapping->file_offset);
+    batch_.frame_mapping.push_back(MappingIndex(mapping->dso));
+  } else {
+    batch_.frame_address.push_back(ip);
+    batch_.frame_mapping.push_back(-1);
+  }
+  batch_bytes_ += kFrameBytes;
+}
+
+void SampleTableWriter::Flush() {
+  callback_(std::move(batch_));
+  batch_ = SampleTableBatch();
+  batch_bytes_ = 0;
+}
+
+std::vector<SampleTableBatch> PerfDataProtoToSampleTableBatches(
+    const quipper::PerfDataProto& perf_data, const size_t max_batch_bytes) {
+  std::vector<SampleTableBatch> batches;
+  SampleTableWriter writer(
+      [&batches](SampleTableBatch&& batch) {
+        batches.push_back(std::move(batch));
+      },
+      max_batch_bytes);
+  PerfDataHandler::Process(perf_data, &writer);
+  return batches;
+}
+
+}  // namespace perftools
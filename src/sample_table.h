@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef PERFTOOLS_SAMPLE_TABLE_H_
+#define PERFTOOLS_SAMPLE_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/perf_data_handler.h"
+#include "src/quipper/perf_data.pb.h"
+
+namespace perftools {
+
+// A batch of normalized samples laid out in columns, as Arrow record batches
+// are: each column has one entry per sample, the strings are
+// dictionary-encoded, and the stacks are list columns of the offsets of the
+// frames in the flattened frame columns.
+struct SampleTableBatch {
+  std::vector<uint32_t> pid;
+  std::vector<uint32_t> tid;
+  // 0 if the samples have no time or CPU.
+  std::vector<uint64_t> time_ns;
+  std::vector<uint32_t> cpu;
+  // Indices into cgroup_dictionary, or -1 if the sample has no cgroup.
+  std::vector<int32_t> cgroup;
+  // The number of samples the row stands for, more than one only for the
+  // samples synthesized for lost records.
+  std::vector<uint64_t> count;
+  std::vector<uint64_t> period;
+  std::vector<uint64_t> weight;
+  // The latencies of the Arm SPE samples, 0 for the others.
+  std::vector<uint32_t> spe_total_latency;
+  std::vector<uint32_t> spe_issue_latency;
+  std::vector<uint32_t> spe_translation_latency;
+
+  // The frames of sample i, leaf first, are those in
+  // [frame_offsets[i], frame_offsets[i + 1]). A frame is the offset of its
+  // address in the file of its mapping, an index into the mapping
+  // dictionary, or the address itself and -1 if it isn't mapped.
+  std::vector<int32_t> frame_offsets = {0};
+  std::vector<uint64_t> frame_address;
+  std::vector<int32_t> frame_mapping;
+
+  // The dictionary entries first used by the samples of this batch, to be
+  // appended to those of the earlier batches, as Arrow delta dictionaries
+  // are. The indices refer to the entries of all the batches so far.
+  std::vector<std::string> cgroup_dictionary;
+  std::vector<std::string> mapping_filename_dictionary;
+  std::vector<std::string> mapping_build_id_dictionary;
+
+  size_t num_rows() const { return pid.size(); }
+};
+
+// Writes the normalized samples, bypassing the profile builder, as batches
+// of columns handed to a callback once they take about max_batch_bytes, so
+// that the samples can be loaded into columnar stores without profiles being
+// built and taken apart again.
+class SampleTableWriter : public PerfDataHandler {
+ public:
+  typedef std::function<void(SampleTableBatch&& batch)> BatchCallback;
+
+  explicit SampleTableWriter(BatchCallback callback,
+                             size_t max_batch_bytes = 1 << 20)
+      : callback_(std::move(callback)), max_batch_bytes_(max_batch_bytes) {}
+  SampleTableWriter(const SampleTableWriter&) = delete;
+  SampleTableWriter& operator=(const SampleTableWriter&) = delete;
+
+  bool Sample(const SampleContext& sample) override;
+  void Comm(const CommContext& comm) override {}
+  void MMap(const MMapContext& mmap) override {}
+  // Hands over the last batch, if it has any samples.
+  void Finish() override;
+
+ private:
+  // Returns the index of |dso| in the mapping dictionary, adding it to that
+  // of the batch if it is new.
+  int32_t MappingIndex(const Dso* dso);
+  void AddFrame(uint64_t ip, const Mapping* mapping);
+  void Flush();
+
+  const BatchCallback callback_;
+  const size_t max_batch_bytes_;
+  SampleTableBatch batch_;
+  size_t batch_bytes_ = 0;
+  std::unordered_map<const Dso*, int32_t> mapping_indices_;
+  std::unordered_map<std::string, int32_t> cgroup_indices_;
+};
+
+// Writes the samples of |perf_data| in batches of about |max_batch_bytes|.
+std::vector<SampleTableBatch> PerfDataProtoToSampleTableBatches(
+    const quipper::PerfDataProto& perf_data, size_t max_batch_bytes = 1 << 20);
+
+}  // namespace perftools
+
+#endif  // PERFTOOLS_SAMPLE_TABLE_H_
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2026, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/sample_table.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "src/quipper/kernel/perf_event.h"
+#include "src/quipper/perf_data.pb.h"
+
+namespace perftools {
+namespace {
+
+void AddMmap(uint32_t pid, const std::string& filename, uint64_t start,
+             uint64_t len, uint64_t pgoff, quipper::PerfDataProto* proto) {
+  auto* mmap = proto->add_events()->mutable_mmap_event();
+  mmap->set_filename(filename);
+  mmap->set_pid(pid);
+  mmap->set_tid(pid);
+  mmap->set_start(start);
+  mmap->set_len(len);
+  mmap->set_pgoff(pgoff);
+}
+
+// Adds a sample of |pid| at |ip|, called from |callers|.
+void AddSample(uint32_t pid, uint64_t ip, const std::vector<uint64_t>& callers,
+               uint64_t time_ns, quipper::PerfDataProto* proto) {
+  auto* sample = proto->add_events()->mutable_sample_event();
+  sample->set_pid(pid);
+  sample->set_tid(pid + 1);
+  sample->set_ip(ip);
+  sample->set_period(10);
+  sample->set_weight(7);
+  sample->set_sample_time_ns(time_ns);
+  sample->set_cpu(3);
+  sample->add_callchain(quipper::PERF_CONTEXT_USER);
+  sample->add_callchain(ip);
+  for (uint64_t caller : callers) sample->add_callchain(caller);
+}
+
+TEST(SampleTableTest, WritesSamplesInColumns) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  AddMmap(10, "/bin/app", 0x1000, 0x1000, 0, &proto);
+  AddMmap(10, "/lib/libc.so", 0x10000, 0x1000, 0x2000, &proto);
+  AddSample(10, 0x10010, {0x1100, 0x1200}, 100, &proto);
+  AddSample(10, 0x1300, {0x50000}, 200, &proto);
+  AddSample(10, 0x1300, {}, 300, &proto);
+
+  const std::vector<SampleTableBatch> batches =
+      PerfDataProtoToSampleTableBatches(proto);
+  ASSERT_EQ(1, batches.size());
+  const SampleTableBatch& batch = batches[0];
+  ASSERT_EQ(3, batch.num_rows());
+  EXPECT_EQ(std::vector<uint32_t>({10, 10, 10}), batch.pid);
+  EXPECT_EQ(std::vector<uint32_t>({11, 11, 11}), batch.tid);
+  EXPECT_EQ(std::vector<uint64_t>({100, 200, 300}), batch.time_ns);
+  EXPECT_EQ(std::vector<uint32_t>({3, 3, 3}), batch.cpu);
+  EXPECT_EQ(std::vector<int32_t>({-1, -1, -1}), batch.cgroup);
+  EXPECT_EQ(std::vector<uint64_t>({10, 10, 10}), batch.period);
+  EXPECT_EQ(std::vector<uint64_t>({7, 7, 7}), batch.weight);
+  EXPECT_EQ(std::vector<uint32_t>({0, 0, 0}), batch.spe_total_latency);
+
+  // The leaf is not repeated from the callchain, and the unmapped caller
+  // keeps its address.
+  EXPECT_EQ(std::vector<int32_t>({0, 3, 5, 6}), batch.frame_offsets);
+  EXPECT_EQ(std::vector<uint64_t>({0x2010, 0x100, 0x200, 0x300, 0x50000,
+                                   0x300}),
+            batch.frame_address);
+  EXPECT_EQ(std::vector<int32_t>({0, 1, 1, 1, -1, 1}), batch.frame_mapping);
+  EXPECT_EQ(std::vector<std::string>({"/lib/libc.so", "/bin/app"}),
+            batch.mapping_filename_dictionary);
+  EXPECT_EQ(std::vector<std::string>({"", ""}),
+            batch.mapping_build_id_dictionary);
+}
+
+TEST(SampleTableTest, FlushesBoundedBatches) {
+  quipper::PerfDataProto proto;
+  proto.add_file_attrs()->add_ids(0);
+  AddMmap(10, "/bin/app", 0x1000, 0x1000, 0, &proto);
+  AddMmap(20, "/bin/other", 0x1000, 0x1000, 0, &proto);
+  for (int i = 0; i < 100; ++i) {
+    AddSample(i < 50 ? 10 : 20, 0x1000 + i, {0x1800}, i, &proto);
+  }
+
+  const std::vector<SampleTableBatch> batches =
+      PerfDataProtoToSampleTableBatches(proto, /*max_batch_bytes=*/1000);
+  ASSERT_GT(batches.size(), 1);
+  size_t rows = 0;
+  std::vector<std::string> filenames;
+  for (const SampleTableBatch& batch : batches) {
+    rows += batch.num_rows();
+    // A sample takes at least 64 bytes.
+    EXPECT_LE(batch.num_rows(), 1000 / 64 + 1);
+    EXPECT_EQ(batch.num_rows() + 1, batch.frame_offsets.size());
+    EXPECT_EQ(batch.frame_offsets.back(), batch.frame_address.size());
+    filenames.insert(filenames.end(),
+                     batch.mapping_filename_dictionary.begin(),
+                     batch.mapping_filename_dictionary.end());
+  }
+  EXPECT_EQ(100, rows);
+  // Each entry of the dictionary is only in the first batch that uses it.
+  EXPECT_EQ(std::vector<std::string>({"/bin/app", "/bin/other"}), filenames);
+}
+
+}  // namespace
+}  // namespace perftools